@@ -129,6 +129,8 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 			int neg_op;
 			const struct dmap_query_field_map *dqfm;
 			char *end;
+			char *fts;
+			size_t len;
 			long long llval;
 
 			escaped = NULL;
@@ -280,6 +282,23 @@ expr	returns [ pANTLR3_STRING result, int valid ]
 					goto STR_result_valid_0; /* ABORT */
 				}
 
+				/* Contains search (*value*), use the full-text index if possible */
+				len = strlen((char *)val);
+				if (!neg_op && (len > 2) && (val[0] == '*') && (val[len - 1] == '*'))
+				{
+					val[len - 1] = '\0';
+					fts = db_fts_contains(dqfm->db_col, (char *)val + 1);
+					val[len - 1] = '*';
+
+					if (fts)
+					{
+						$result->append8($result, fts);
+						free(fts);
+
+						goto STR_out;
+					}
+				}
+
 				escaped = (pANTLR3_UINT8)db_escape_string((char *)val);
 				if (!escaped)
 				{
@@ -38,6 +38,9 @@
 #include "cache.h"
 #include "http.h"
 #include "transcode.h"
+#include "library.h"
+#include "listener.h"
+#include "worker.h"
 
 #include "artwork.h"
 
@@ -119,6 +122,34 @@ struct artwork_source {
   enum artwork_cache cache;
 };
 
+/* Background generation of album artwork at the sizes that the user
+ * configured (library/artwork_pregen_sizes), largest first. Albums are done in
+ * batches on the worker thread, so that other worker tasks don't wait for long.
+ */
+#define ARTWORK_PREGEN_SIZES_MAX 8
+#define ARTWORK_PREGEN_BATCH 20
+#define ARTWORK_PREGEN_DELAY 10
+#define ARTWORK_PREGEN_BUCKETS 1024
+
+struct artwork_pregen_arg {
+  // Only albums with files added or modified since then, 0 means all
+  time_t since;
+  // When the run started, the next run will be from then
+  time_t start;
+  int offset;
+};
+
+/* Largest artwork of the albums done in the current run, so the other sizes of
+ * an identical image can be copied instead of rescaled
+ */
+struct artwork_pregen_seen {
+  uint32_t hash;
+  int64_t persistentid;
+  int format;
+
+  struct artwork_pregen_seen *next;
+};
+
 /* File extensions that we look for or accept
  */
 static const char *cover_extension[] =
@@ -347,7 +378,7 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *inbuf, int max_
 
   DPRINTF(E_SPAM, L_ART, "Getting artwork (max destination width %d height %d)\n", max_w, max_h);
 
-  xcode_decode = transcode_decode_setup(XCODE_JPEG, DATA_KIND_FILE, path, inbuf, 0); // Covers XCODE_PNG too
+  xcode_decode = transcode_decode_setup(XCODE_JPEG, DATA_KIND_FILE, path, inbuf, 0, NULL); // Covers XCODE_PNG too
   if (!xcode_decode)
     {
       if (path)
@@ -381,6 +412,14 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *inbuf, int max_
     {
       if (is_embedded)
 	{
+	  // Artwork that already fits is sent as it is in the file
+	  ret = transcode_decode_image_copy(evbuf, xcode_decode);
+	  if (ret > 0)
+	    {
+	      transcode_decode_cleanup(&xcode_decode);
+	      return format_ok;
+	    }
+
 	  target_w = width;
 	  target_h = height;
 	}
@@ -400,6 +439,10 @@ artwork_get(struct evbuffer *evbuf, char *path, struct evbuffer *inbuf, int max_
 	}
     }
 
+  // Large JPEGs are decoded at a fraction of their size, closer to the target
+  if (format_ok == ART_FMT_JPEG)
+    transcode_decode_scale(xcode_decode, target_w, target_h);
+
   if (format_ok == ART_FMT_JPEG)
     xcode_encode = transcode_encode_setup(XCODE_JPEG, xcode_decode, NULL, target_w, target_h);
   else
@@ -1061,6 +1104,294 @@ process_group(struct artwork_ctx *ctx)
 }
 
 
+/* ----------------------- BACKGROUND PREGENERATION ------------------------ */
+
+static int pregen_sizes[ARTWORK_PREGEN_SIZES_MAX];
+static int pregen_nsizes;
+// Set by the listener until the run is started, so events are coalesced
+static int pregen_pending;
+// Worker thread only
+static bool pregen_running;
+static bool pregen_rerun;
+static time_t pregen_last;
+static struct artwork_pregen_seen *pregen_seen[ARTWORK_PREGEN_BUCKETS];
+
+static void
+pregen_seen_clear(void)
+{
+  struct artwork_pregen_seen *s;
+  int i;
+
+  for (i = 0; i < ARTWORK_PREGEN_BUCKETS; i++)
+    {
+      while ((s = pregen_seen[i]))
+	{
+	  pregen_seen[i] = s->next;
+	  free(s);
+	}
+    }
+}
+
+/* Returns the persistentid of an earlier album with the same image, or adds
+ * the album and returns 0
+ */
+static int64_t
+pregen_seen_check(uint32_t hash, int64_t persistentid, int format)
+{
+  struct artwork_pregen_seen *s;
+  int i;
+
+  i = hash % ARTWORK_PREGEN_BUCKETS;
+  for (s = pregen_seen[i]; s; s = s->next)
+    {
+      if (s->hash == hash && s->format == format)
+	return s->persistentid;
+    }
+
+  s = malloc(sizeof(struct artwork_pregen_seen));
+  if (!s)
+    return 0;
+
+  s->hash = hash;
+  s->persistentid = persistentid;
+  s->format = format;
+  s->next = pregen_seen[i];
+  pregen_seen[i] = s;
+
+  return 0;
+}
+
+/* Makes a smaller version of the artwork in src, or a copy if it is already
+ * small enough
+ */
+static int
+pregen_rescale(struct evbuffer *evbuf, struct evbuffer *src, int size)
+{
+  struct evbuffer *ref;
+  uint8_t *buf;
+  size_t len;
+  int ret;
+
+  len = evbuffer_get_length(src);
+  buf = evbuffer_pullup(src, -1);
+  if (!buf)
+    return ART_E_ERROR;
+
+  CHECK_NULL(L_ART, ref = evbuffer_new());
+
+  // The decoder takes the data from ref, so src is kept
+  ret = evbuffer_add_reference(ref, buf, len, NULL, NULL);
+  if (ret == 0)
+    ret = artwork_get(evbuf, NULL, ref, size, size, false);
+  else
+    ret = ART_E_ERROR;
+
+  evbuffer_free(ref);
+
+  // ART_E_ERROR is also returned if no rescaling is required
+  if (ret == ART_E_ERROR)
+    {
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+      ret = evbuffer_add(evbuf, buf, len);
+      if (ret < 0)
+	return ART_E_ERROR;
+    }
+
+  return 0;
+}
+
+static void
+pregen_group(int id)
+{
+  struct artwork_ctx ctx;
+  struct evbuffer *src;
+  struct evbuffer *evbuf;
+  int64_t dup_id;
+  uint32_t hash;
+  int format;
+  int dup_format;
+  int cached;
+  int i;
+  int ret;
+
+  memset(&ctx, 0, sizeof(struct artwork_ctx));
+
+  ret = db_group_persistentid_byid(id, &ctx.persistentid);
+  if (ret < 0)
+    return;
+
+  CHECK_NULL(L_ART, src = evbuffer_new());
+  CHECK_NULL(L_ART, evbuf = evbuffer_new());
+
+  // If the largest size is in the cache (or it is known that the album has no
+  // artwork) then the album was done before
+  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx.persistentid, pregen_sizes[0], pregen_sizes[0], &cached, &format, src);
+  if (ret < 0 || cached)
+    goto out;
+
+  ctx.qp.type = Q_GROUP_ITEMS;
+  ctx.qp.persistentid = ctx.persistentid;
+  ctx.evbuf = src;
+  ctx.max_w = pregen_sizes[0];
+  ctx.max_h = pregen_sizes[0];
+  ctx.cache = ON_FAILURE;
+  ctx.individual = cfg_getbool(cfg_getsec(cfg, "library"), "artwork_individual");
+
+  format = process_group(&ctx);
+  if (format <= 0)
+    {
+      if (ctx.cache == ON_FAILURE)
+	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, pregen_sizes[0], pregen_sizes[0], 0, "", src);
+
+      goto out;
+    }
+
+  if (ctx.cache != ON_SUCCESS)
+    goto out;
+
+  cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, pregen_sizes[0], pregen_sizes[0], format, ctx.path, src);
+
+  hash = djb_hash(evbuffer_pullup(src, -1), evbuffer_get_length(src));
+  dup_id = pregen_seen_check(hash, ctx.persistentid, format);
+
+  for (i = 1; i < pregen_nsizes; i++)
+    {
+      ret = -1;
+      if (dup_id)
+	{
+	  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, dup_id, pregen_sizes[i], pregen_sizes[i], &cached, &dup_format, evbuf);
+	  if (ret < 0 || !cached || dup_format != format)
+	    {
+	      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+	      ret = -1;
+	    }
+	}
+
+      if (ret < 0)
+	ret = pregen_rescale(evbuf, src, pregen_sizes[i]);
+
+      if (ret == 0)
+	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, pregen_sizes[i], pregen_sizes[i], format, ctx.path, evbuf);
+
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+    }
+
+  DPRINTF(E_DBG, L_ART, "Made artwork for album %" PRIi64 " at %d size(s)%s\n", ctx.persistentid, pregen_nsizes, dup_id ? " (duplicate image)" : "");
+
+ out:
+  evbuffer_free(evbuf);
+  evbuffer_free(src);
+}
+
+static void pregen_start_cb(void *arg);
+
+/* Thread: worker */
+static void
+pregen_batch_cb(void *arg)
+{
+  struct artwork_pregen_arg *pa = arg;
+  struct query_params qp;
+  struct db_group_info dbgri;
+  int ids[ARTWORK_PREGEN_BATCH];
+  int n;
+  int i;
+  int ret;
+
+  if (library_is_exiting())
+    goto end;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_GROUP_ALBUMS;
+  qp.idx_type = I_SUB;
+  qp.offset = pa->offset;
+  qp.limit = ARTWORK_PREGEN_BATCH;
+  if (pa->since > 0)
+    qp.filter = db_mprintf("(f.time_added >= %" PRIi64 " OR f.time_modified >= %" PRIi64 ")", (int64_t)pa->since, (int64_t)pa->since);
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not start query for artwork pregeneration\n");
+      free(qp.filter);
+      goto end;
+    }
+
+  // The ids are collected first, since making the artwork also queries the db
+  n = 0;
+  while ((n < ARTWORK_PREGEN_BATCH) && ((ret = db_query_fetch_group(&qp, &dbgri)) == 0) && (dbgri.id))
+    {
+      if (safe_atoi32(dbgri.id, &ids[n]) == 0)
+	n++;
+    }
+
+  db_query_end(&qp);
+  free(qp.filter);
+
+  for (i = 0; i < n; i++)
+    pregen_group(ids[i]);
+
+  if (n == ARTWORK_PREGEN_BATCH)
+    {
+      pa->offset += n;
+      worker_execute(pregen_batch_cb, pa, sizeof(struct artwork_pregen_arg), 0, WORKER_PRIO_BACKGROUND);
+      return;
+    }
+
+  DPRINTF(E_INFO, L_ART, "Artwork pregeneration done, checked %d album(s)\n", pa->offset + n);
+
+  pregen_last = pa->start;
+
+ end:
+  pregen_seen_clear();
+  pregen_running = false;
+
+  if (pregen_rerun)
+    {
+      pregen_rerun = false;
+      worker_execute(pregen_start_cb, NULL, 0, 0, WORKER_PRIO_BACKGROUND);
+    }
+}
+
+/* Thread: worker */
+static void
+pregen_start_cb(void *arg)
+{
+  struct artwork_pregen_arg pa;
+
+  __atomic_store_n(&pregen_pending, 0, __ATOMIC_RELEASE);
+
+  // Files that the scan is still adding are done when it ends
+  if (library_is_scanning())
+    return;
+
+  if (pregen_running)
+    {
+      pregen_rerun = true;
+      return;
+    }
+
+  pregen_running = true;
+
+  memset(&pa, 0, sizeof(struct artwork_pregen_arg));
+  pa.since = pregen_last;
+  pa.start = time(NULL);
+
+  DPRINTF(E_DBG, L_ART, "Starting artwork pregeneration for albums changed since %" PRIi64 "\n", (int64_t)pa.since);
+
+  pregen_batch_cb(&pa);
+}
+
+/* Thread: any thread making library changes */
+static void
+pregen_listener_cb(short event_mask)
+{
+  if (__atomic_exchange_n(&pregen_pending, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  worker_execute(pregen_start_cb, NULL, 0, ARTWORK_PREGEN_DELAY, WORKER_PRIO_BACKGROUND);
+}
+
+
 /* ------------------------------ ARTWORK API ------------------------------ */
 
 int
@@ -1198,3 +1529,57 @@ artwork_file_is_artwork(const char *filename)
 
   return 0;
 }
+
+int
+artwork_pregen_init(void)
+{
+  cfg_t *lib;
+  int size;
+  int n;
+  int i;
+  int j;
+
+  lib = cfg_getsec(cfg, "library");
+  n = cfg_size(lib, "artwork_pregen_sizes");
+
+  pregen_nsizes = 0;
+  for (i = 0; i < n && pregen_nsizes < ARTWORK_PREGEN_SIZES_MAX; i++)
+    {
+      size = cfg_getnint(lib, "artwork_pregen_sizes", i);
+      if (size <= 0)
+	{
+	  DPRINTF(E_LOG, L_ART, "Ignoring invalid artwork size %d in artwork_pregen_sizes\n", size);
+	  continue;
+	}
+
+      // Keep the sizes sorted largest first, so the others can be made from it
+      for (j = pregen_nsizes; j > 0 && pregen_sizes[j - 1] < size; j--)
+	pregen_sizes[j] = pregen_sizes[j - 1];
+
+      pregen_sizes[j] = size;
+      pregen_nsizes++;
+    }
+
+  if (pregen_nsizes == 0)
+    return 0;
+
+  DPRINTF(E_INFO, L_ART, "Album artwork will be made in the background at %d size(s), largest %dx%d\n", pregen_nsizes, pregen_sizes[0], pregen_sizes[0]);
+
+  pregen_last = 0;
+
+  // A run over all the albums after startup, then after each library change
+  __atomic_store_n(&pregen_pending, 1, __ATOMIC_RELEASE);
+  worker_execute(pregen_start_cb, NULL, 0, ARTWORK_PREGEN_DELAY, WORKER_PRIO_BACKGROUND);
+
+  // LISTENER_UPDATE is for the end of a scan that changed nothing
+  return listener_add(pregen_listener_cb, LISTENER_DATABASE | LISTENER_UPDATE, NULL);
+}
+
+void
+artwork_pregen_deinit(void)
+{
+  if (pregen_nsizes == 0)
+    return;
+
+  listener_remove(pregen_listener_cb);
+}
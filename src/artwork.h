@@ -40,4 +40,17 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h);
 int
 artwork_file_is_artwork(const char *filename);
 
+/*
+ * Starts making album artwork at the sizes in library/artwork_pregen_sizes in
+ * the background, after startup and after library changes. The results go to
+ * the artwork cache, where requests for the same sizes will find them.
+ *
+ * @return       0 on success, -1 on error
+ */
+int
+artwork_pregen_init(void);
+
+void
+artwork_pregen_deinit(void);
+
 #endif /* !__ARTWORK_H__ */
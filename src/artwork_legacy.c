@@ -1625,3 +1625,21 @@ artwork_file_is_artwork(const char *filename)
 
   return 0;
 }
+
+/* Background artwork generation needs to rescale from memory, which is not
+ * supported with this ffmpeg version
+ */
+int
+artwork_pregen_init(void)
+{
+  if (cfg_size(cfg_getsec(cfg, "library"), "artwork_pregen_sizes") > 0)
+    DPRINTF(E_LOG, L_ART, "Option artwork_pregen_sizes is not supported with this version of ffmpeg\n");
+
+  return 0;
+}
+
+void
+artwork_pregen_deinit(void)
+{
+  return;
+}
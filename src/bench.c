@@ -0,0 +1,1662 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Benchmarks of the server's own code paths, run with --bench <name[:size]>.
+ * They are meant as a regression guard when changing the db or the protocol
+ * code, so the runs are deterministic: the same size always gives the same
+ * synthetic library. The results are printed to stdout.
+ *
+ *   daap[:ntracks]   Replies to typical iTunes and Remote requests, built from a
+ *                    synthetic library of ntracks (default 10000)
+ *   player[:ndev]    Plays generated WAV tracks through the player to ndev dummy
+ *                    outputs (default 1), measuring tick lateness, CPU and the
+ *                    time spent switching tracks
+ *   scan[:nfiles]    Scans a generated tree of tiny tagged MP3, FLAC and M4A
+ *                    files and playlists (default 3000 files): initial scan,
+ *                    rescan without changes and a burst of new files
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <event2/buffer.h>
+
+#include "bench.h"
+#include "conffile.h"
+#include "db.h"
+#include "logger.h"
+#include "misc.h"
+#include "library.h"
+#include "cache.h"
+#include "httpd.h"
+#include "httpd_daap.h"
+#include "mdns.h"
+#include "worker.h"
+#include "player.h"
+#include "outputs.h"
+
+#define BENCH_DAAP_TRACKS_DEFAULT 10000
+#define BENCH_DAAP_RUNS 5
+#define BENCH_PLAYLISTS 10
+#define BENCH_PLAYLIST_ITEMS 250
+#define BENCH_BATCH_SIZE 1000
+#define BENCH_PLAYER_TRACKS 4
+#define BENCH_PLAYER_TRACK_SECONDS 10
+#define BENCH_PLAYER_DEVICES_MAX 64
+#define BENCH_SCAN_FILES_DEFAULT 3000
+
+struct bench_daap_query
+{
+  const char *name;
+  const char *uri;   // %d is replaced with the id of a playlist
+  int is_remote;
+};
+
+#define BENCH_META_ITUNES "dmap.itemkind,dmap.itemid,dmap.persistentid,dmap.itemname,dmap.containeritemid," \
+  "daap.songalbum,daap.songartist,daap.songalbumartist,daap.songgenre,daap.songcomposer,daap.songtime," \
+  "daap.songtracknumber,daap.songtrackcount,daap.songdiscnumber,daap.songdisccount,daap.songyear," \
+  "daap.songbitrate,daap.songsamplerate,daap.songsize,daap.songformat,daap.songdatakind,daap.songuserrating," \
+  "daap.songdateadded,daap.songdatemodified,daap.songcompilation,daap.songcodectype,daap.sortname," \
+  "daap.sortartist,daap.sortalbum,daap.sortalbumartist,daap.songalbumid,com.apple.itunes.mediakind," \
+  "com.apple.itunes.has-video,daap.songcontentrating"
+
+#define BENCH_META_REMOTE "dmap.itemname,dmap.itemid,daap.songartist,daap.songalbumartist,daap.songalbum," \
+  "com.apple.itunes.cloud-id,dmap.containeritemid,com.apple.itunes.has-video,com.apple.itunes.itms-songid," \
+  "com.apple.itunes.extended-media-kind,dmap.downloadstatus,daap.songdisabled,daap.songtime"
+
+#define BENCH_QUERY_MUSIC "('com.apple.itunes.mediakind:1','com.apple.itunes.mediakind:32')"
+
+static const struct bench_daap_query bench_daap_queries[] =
+  {
+    { "itunes items",     "/databases/1/items?session-id=1&revision-number=1&type=music&meta=" BENCH_META_ITUNES, 0 },
+    { "itunes containers", "/databases/1/containers?session-id=1&revision-number=1&meta=dmap.itemid,dmap.itemname,"
+                          "dmap.persistentid,dmap.parentcontainerid,com.apple.itunes.is-podcast-playlist,"
+                          "com.apple.itunes.special-playlist,com.apple.itunes.smart-playlist,dmap.haschildcontainers,"
+                          "com.apple.itunes.saved-genius,dmap.objectextradata", 0 },
+    { "itunes playlist",  "/databases/1/containers/%d/items?session-id=1&revision-number=1&type=music&meta=dmap.itemkind,"
+                          "dmap.itemid,dmap.containeritemid", 0 },
+    { "remote albums",    "/databases/1/groups?session-id=1&meta=dmap.itemname,dmap.itemid,dmap.persistentid,"
+                          "daap.songartist,daap.songalbumartist,daap.songdatereleased,dmap.itemcount,daap.songtime"
+                          "&type=music&group-type=albums&sort=album&include-sort-headers=1"
+                          "&query=(('daap.songalbumartist!:'+'daap.songalbum!:')+" BENCH_QUERY_MUSIC ")", 1 },
+    { "remote artists",   "/databases/1/groups?session-id=1&meta=dmap.itemname,dmap.itemid,dmap.persistentid,"
+                          "daap.songartist,daap.groupalbumcount,daap.songartistid&type=music&group-type=artists"
+                          "&sort=album&include-sort-headers=1&query=('daap.songalbumartist!:'+" BENCH_QUERY_MUSIC ")", 1 },
+    { "remote browse",    "/databases/1/browse/artists?session-id=1&include-sort-headers=1"
+                          "&filter=('daap.songalbumartist!:'+" BENCH_QUERY_MUSIC ")", 1 },
+    { "remote genres",    "/databases/1/browse/genres?session-id=1&include-sort-headers=1"
+                          "&filter=" BENCH_QUERY_MUSIC, 1 },
+    { "remote songs",     "/databases/1/containers/1/items?session-id=1&meta=" BENCH_META_REMOTE "&type=music"
+                          "&sort=name&include-sort-headers=1&query=(" BENCH_QUERY_MUSIC "+'dmap.itemname!:')", 1 },
+    { "remote playlist",  "/databases/1/containers/%d/items?session-id=1&meta=" BENCH_META_REMOTE "&type=music"
+                          "&sort=physical&include-sort-headers=1", 1 },
+  };
+
+// Weighted towards the first entries, like the genres of a real library
+static const char *bench_genres[] =
+  {
+    "Rock", "Pop", "Alternative", "Electronic", "Jazz", "Classical", "Hip-Hop", "Soundtrack", "Country", "Blues",
+    "Metal", "Folk", "Reggae", "Soul", "R&B", "World", "Latin", "Punk", "Ambient", "Singer/Songwriter",
+  };
+
+// Some with articles and non-ASCII characters, to exercise the sort tags
+static const char *bench_words[] =
+  {
+    "The", "A", "Love", "Night", "Blue", "Electric", "Dream", "Fire", "Song", "Light", "Heart", "City", "Road",
+    "Rain", "Summer", "Black", "Golden", "Wild", "Silver", "Day", "Stone", "Moon", "River", "Ghost", "Radio",
+    "Motörhead", "Björk", "Sigur", "Café", "Über", "Señor", "Noël", "Ångström", "Zoë", "Déjà", "Vu", "Åre",
+  };
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+struct bench_player_devices
+{
+  uint64_t ids[BENCH_PLAYER_DEVICES_MAX + 1]; // ids[0] is the count, as for player_speaker_set()
+};
+
+static uint64_t bench_rng_state;
+static char bench_db_path[64];
+static char bench_cache_path[sizeof(bench_db_path) + 8];
+
+
+/* ------------------------------- Helpers --------------------------------- */
+
+static uint64_t
+bench_clock_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t
+bench_cpu_usec(void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+
+  return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static long
+bench_rss_peak_kb(void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+
+  return ru.ru_maxrss;
+}
+
+// xorshift64*, so that a given size always gives the same library
+static uint32_t
+bench_rand(void)
+{
+  bench_rng_state ^= bench_rng_state >> 12;
+  bench_rng_state ^= bench_rng_state << 25;
+  bench_rng_state ^= bench_rng_state >> 27;
+
+  return (uint32_t)((bench_rng_state * 2685821657736338717ULL) >> 32);
+}
+
+// Index in [0, n) where low indexes are much more likely, e.g. a few artists
+// have many albums and most have one or two
+static int
+bench_rand_skewed(int n)
+{
+  double r;
+
+  r = bench_rand() / 4294967296.0;
+
+  return (int)(n * r * r * r);
+}
+
+static char *
+bench_name(int nwords)
+{
+  char buf[256];
+  int len;
+  int i;
+
+  len = 0;
+  for (i = 0; i < nwords; i++)
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%s", i ? " " : "", bench_words[bench_rand() % ARRAY_LEN(bench_words)]);
+
+  return strdup(buf);
+}
+
+static int
+bench_db_setup(void)
+{
+  int fd;
+
+  bench_rng_state = 88172645463325252ULL;
+
+  snprintf(bench_db_path, sizeof(bench_db_path), "/tmp/forked-daapd-bench-XXXXXX");
+  fd = mkstemp(bench_db_path);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create temporary database: %s\n", strerror(errno));
+      return -1;
+    }
+
+  close(fd);
+
+  // The benchmarks must not touch the real library, and they don't need the
+  // ports of a running server
+  snprintf(bench_cache_path, sizeof(bench_cache_path), "%s-cache", bench_db_path);
+
+  cfg_setstr(cfg_getsec(cfg, "general"), "db_path", bench_db_path);
+  cfg_setstr(cfg_getsec(cfg, "general"), "cache_path", bench_cache_path);
+  cfg_setint(cfg_getsec(cfg, "general"), "websocket_port", 0);
+  cfg_setint(cfg_getsec(cfg, "library"), "port", 0);
+
+  if (db_init() < 0)
+    goto error;
+
+  if (db_perthread_init() < 0)
+    {
+      db_deinit();
+      goto error;
+    }
+
+  return 0;
+
+ error:
+  DPRINTF(E_LOG, L_MAIN, "Could not initialize temporary database '%s'\n", bench_db_path);
+  unlink(bench_db_path);
+  return -1;
+}
+
+static void
+bench_db_unlink(const char *db_path)
+{
+  char path[PATH_MAX];
+
+  unlink(db_path);
+  snprintf(path, sizeof(path), "%s-wal", db_path);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s-shm", db_path);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s-journal", db_path);
+  unlink(path);
+}
+
+static void
+bench_db_cleanup(void)
+{
+  db_perthread_deinit();
+  db_deinit();
+
+  bench_db_unlink(bench_db_path);
+  bench_db_unlink(bench_cache_path);
+}
+
+
+/* -------------------------- Synthetic library ---------------------------- */
+
+static void
+bench_track_add(int id, const char *artist, const char *album_artist, const char *album, const char *genre, int year, int track, int total_tracks, bool compilation)
+{
+  struct media_file_info mfi;
+  char *title;
+
+  memset(&mfi, 0, sizeof(struct media_file_info));
+
+  title = bench_name(1 + bench_rand() % 4);
+
+  mfi.path = safe_asprintf("/bench/%s/%s/%02d %s %d.mp3", album_artist, album, track, title, id);
+  mfi.fname = strdup(strrchr(mfi.path, '/') + 1);
+  mfi.virtual_path = safe_asprintf("/file:%s", mfi.path);
+  mfi.directory_id = DIR_FILE;
+  mfi.title = title;
+  mfi.artist = strdup(artist);
+  mfi.album_artist = strdup(album_artist);
+  mfi.album = strdup(album);
+  mfi.genre = strdup(genre);
+  mfi.composer = (bench_rand() % 3 == 0) ? bench_name(2) : NULL;
+  mfi.type = strdup("mp3");
+  mfi.codectype = strdup("mpeg");
+  mfi.description = strdup("MPEG audio file");
+  mfi.year = year;
+  mfi.date_released = (year - 1970) * 31536000 + bench_rand() % 31536000;
+  mfi.track = track;
+  mfi.total_tracks = total_tracks;
+  mfi.disc = 1;
+  mfi.total_discs = 1;
+  mfi.compilation = compilation;
+  mfi.song_length = 90000 + bench_rand() % 360000;
+  mfi.bitrate = (bench_rand() % 4 == 0) ? 192 : 320;
+  mfi.samplerate = 44100;
+  mfi.bits_per_sample = 16;
+  mfi.file_size = (int64_t)mfi.song_length * mfi.bitrate / 8;
+  mfi.rating = (bench_rand() % 5 == 0) ? 20 * (1 + bench_rand() % 5) : 0;
+  mfi.play_count = bench_rand_skewed(200);
+  mfi.time_added = 1262304000 + id * 60;
+  mfi.time_modified = mfi.time_added;
+  mfi.data_kind = DATA_KIND_FILE;
+  mfi.media_kind = MEDIA_KIND_MUSIC;
+  mfi.item_kind = 2; /* music */
+
+  library_add_media(&mfi);
+
+  free_mfi(&mfi, 1);
+}
+
+static int
+bench_library_generate(int ntracks)
+{
+  struct playlist_info pli;
+  char **artists;
+  char *album;
+  char path[64];
+  char title[64];
+  int nartists;
+  int ntr;
+  bool compilation;
+  int genre;
+  int year;
+  int artist;
+  int plid;
+  int id;
+  int i;
+  int j;
+
+  nartists = ntracks / 40 + 1;
+  CHECK_NULL(L_MAIN, artists = calloc(nartists, sizeof(char *)));
+  for (i = 0; i < nartists; i++)
+    artists[i] = bench_name(1 + bench_rand() % 3);
+
+  db_transaction_begin();
+
+  // Albums of 8-17 tracks, 5% are compilations of various artists
+  for (id = 1; id <= ntracks; )
+    {
+      artist = bench_rand_skewed(nartists);
+      genre = bench_rand_skewed(ARRAY_LEN(bench_genres));
+      year = 1960 + bench_rand() % 60;
+      album = bench_name(1 + bench_rand() % 3);
+      ntr = 8 + bench_rand() % 10;
+      compilation = (bench_rand() % 20 == 0);
+
+      for (i = 1; i <= ntr && id <= ntracks; i++, id++)
+	{
+	  if (compilation)
+	    bench_track_add(id, artists[bench_rand_skewed(nartists)], "Various Artists", album, bench_genres[genre], year, i, ntr, true);
+	  else
+	    bench_track_add(id, artists[artist], artists[artist], album, bench_genres[genre], year, i, ntr, false);
+
+	  if (id % BENCH_BATCH_SIZE == 0)
+	    {
+	      db_transaction_end();
+	      db_transaction_begin();
+	    }
+	}
+
+      free(album);
+    }
+
+  db_transaction_end();
+
+  for (i = 0; i < nartists; i++)
+    free(artists[i]);
+  free(artists);
+
+  // The ids of the files are 1..ntracks, since the database is new
+  plid = -1;
+  for (i = 0; i < BENCH_PLAYLISTS; i++)
+    {
+      snprintf(path, sizeof(path), "/bench/playlist%d.m3u", i);
+      snprintf(title, sizeof(title), "Playlist %d", i);
+
+      id = library_add_playlist_info(path, title, path, PL_PLAIN, 0, DIR_FILE);
+      if (id < 0)
+	return -1;
+
+      if (plid < 0)
+	plid = id;
+
+      db_transaction_begin();
+      for (j = 0; j < BENCH_PLAYLIST_ITEMS; j++)
+	db_pl_add_item_byid(id, 1 + bench_rand() % ntracks);
+      db_transaction_end();
+    }
+
+  memset(&pli, 0, sizeof(struct playlist_info));
+  pli.type = PL_SMART;
+  pli.title = "Top rated";
+  pli.path = "/bench/toprated.smartpl";
+  pli.query = "f.rating >= 80 AND f.media_kind = 1";
+  pli.directory_id = DIR_FILE;
+  db_pl_add(&pli, &id);
+
+  db_sortkeys_update();
+
+  return plid;
+}
+
+
+/* --------------------------------- DAAP ---------------------------------- */
+
+static int
+bench_daap(int ntracks, const char *webroot)
+{
+  const struct bench_daap_query *q;
+  struct evbuffer *reply;
+  struct evbuffer *gzipped;
+  struct stat sb;
+  char uri[2048];
+  uint64_t start;
+  uint64_t usec;
+  uint64_t usec_min;
+  uint64_t usec_total;
+  uint64_t gzip_usec;
+  size_t len;
+  size_t gzip_len;
+  int plid;
+  int i;
+  int j;
+  int ret;
+
+  if (ntracks <= 0)
+    ntracks = BENCH_DAAP_TRACKS_DEFAULT;
+
+  ret = bench_db_setup();
+  if (ret < 0)
+    return -1;
+
+  // The DAAP handlers are set up by httpd, the requests are then built here
+  // without a client, the same way the cache does it
+  ret = httpd_init(webroot);
+  if (ret < 0)
+    {
+      bench_db_cleanup();
+      return -1;
+    }
+
+  printf("Generating library of %d tracks\n", ntracks);
+
+  start = bench_clock_usec();
+  plid = bench_library_generate(ntracks);
+  usec = bench_clock_usec() - start;
+  if (plid < 0)
+    {
+      ret = -1;
+      goto out;
+    }
+
+  stat(bench_db_path, &sb);
+  printf("Generated in %.1f s (%.0f tracks/s), db size %.1f MB, peak RSS %.1f MB\n\n", usec / 1000000.0,
+	 ntracks * 1000000.0 / (usec ? usec : 1), sb.st_size / 1048576.0, bench_rss_peak_kb() / 1024.0);
+
+  printf("%-18s %9s %9s %10s %9s %9s %7s %9s\n", "query", "min ms", "avg ms", "bytes", "MB/s", "gzip ms", "ratio", "RSS MB");
+
+  for (i = 0; i < ARRAY_LEN(bench_daap_queries); i++)
+    {
+      q = &bench_daap_queries[i];
+      snprintf(uri, sizeof(uri), q->uri, plid);
+
+      usec_min = UINT64_MAX;
+      usec_total = 0;
+      len = 0;
+      reply = NULL;
+      for (j = 0; j < BENCH_DAAP_RUNS; j++)
+	{
+	  if (reply)
+	    evbuffer_free(reply);
+
+	  start = bench_clock_usec();
+	  reply = daap_reply_build(uri, q->is_remote ? "Remote/1021" : "iTunes/12.8 (Macintosh; OS X 10.13.6)", q->is_remote);
+	  usec = bench_clock_usec() - start;
+	  if (!reply)
+	    break;
+
+	  usec_total += usec;
+	  if (usec < usec_min)
+	    usec_min = usec;
+	}
+
+      if (!reply)
+	{
+	  printf("%-18s failed, see the log\n", q->name);
+	  ret = -1;
+	  continue;
+	}
+
+      len = evbuffer_get_length(reply);
+
+      start = bench_clock_usec();
+      gzipped = httpd_gzip_deflate(reply);
+      gzip_usec = bench_clock_usec() - start;
+      gzip_len = gzipped ? evbuffer_get_length(gzipped) : 0;
+
+      printf("%-18s %9.2f %9.2f %10zu %9.1f %9.2f %6.1f%% %9.1f\n", q->name, usec_min / 1000.0, usec_total / 1000.0 / BENCH_DAAP_RUNS,
+	     len, len / 1.048576 / (usec_min ? usec_min : 1), gzip_usec / 1000.0, len ? 100.0 * gzip_len / len : 0.0,
+	     bench_rss_peak_kb() / 1024.0);
+
+      if (gzipped)
+	evbuffer_free(gzipped);
+      evbuffer_free(reply);
+    }
+
+ out:
+  httpd_deinit();
+  bench_db_cleanup();
+
+  return ret;
+}
+
+
+/* -------------------------------- Player --------------------------------- */
+
+static void
+bench_le32(uint8_t *p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+// Writes a stereo 16 bit 44100 Hz WAV with a sine of the given frequency
+static int
+bench_wav_write(const char *path, int seconds, int freq)
+{
+  uint8_t header[44] = "RIFF\0\0\0\0WAVEfmt \0\0\0\0\1\0\2\0\0\0\0\0\0\0\0\0\4\0\20\0data";
+  int16_t frames[2 * 4410];
+  uint32_t datalen;
+  FILE *fp;
+  int n;
+  int i;
+  int j;
+
+  fp = fopen(path, "wb");
+  if (!fp)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  datalen = seconds * 44100 * 4;
+
+  bench_le32(header + 4, 36 + datalen);
+  bench_le32(header + 16, 16);
+  bench_le32(header + 24, 44100);
+  bench_le32(header + 28, 44100 * 4);
+  bench_le32(header + 40, datalen);
+  fwrite(header, 1, sizeof(header), fp);
+
+  n = 0;
+  for (i = 0; i < seconds * 10; i++)
+    {
+      for (j = 0; j < 4410; j++, n++)
+	{
+	  frames[2 * j] = (int16_t)(8000 * sin(2 * M_PI * freq * n / 44100.0));
+	  frames[2 * j + 1] = frames[2 * j];
+	}
+
+      fwrite(frames, sizeof(frames), 1, fp);
+    }
+
+  if (fclose(fp) != 0)
+    return -1;
+
+  return 0;
+}
+
+static int
+bench_player_tracks_add(const char *dir)
+{
+  struct media_file_info mfi;
+  struct query_params qp;
+  char path[PATH_MAX];
+  int i;
+  int ret;
+
+  for (i = 1; i <= BENCH_PLAYER_TRACKS; i++)
+    {
+      snprintf(path, sizeof(path), "%s/%02d.wav", dir, i);
+
+      ret = bench_wav_write(path, BENCH_PLAYER_TRACK_SECONDS, 220 * i);
+      if (ret < 0)
+	return -1;
+
+      memset(&mfi, 0, sizeof(struct media_file_info));
+      mfi.path = strdup(path);
+      mfi.fname = strdup(strrchr(path, '/') + 1);
+      mfi.virtual_path = safe_asprintf("/file:%s", path);
+      mfi.directory_id = DIR_FILE;
+      mfi.title = safe_asprintf("Sine %d Hz", 220 * i);
+      mfi.artist = strdup("Bench");
+      mfi.album = strdup("Bench");
+      mfi.type = strdup("wav");
+      mfi.codectype = strdup("wav");
+      mfi.description = strdup("WAV audio file");
+      mfi.track = i;
+      mfi.total_tracks = BENCH_PLAYER_TRACKS;
+      mfi.song_length = BENCH_PLAYER_TRACK_SECONDS * 1000;
+      mfi.samplerate = 44100;
+      mfi.bits_per_sample = 16;
+      mfi.bitrate = 1411;
+      mfi.data_kind = DATA_KIND_FILE;
+      mfi.media_kind = MEDIA_KIND_MUSIC;
+
+      library_add_media(&mfi);
+
+      free_mfi(&mfi, 1);
+    }
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_ITEMS;
+  qp.idx_type = I_NONE;
+  qp.sort = S_ALBUM;
+
+  return db_queue_add_by_query(&qp, 0, 0);
+}
+
+static void
+bench_player_device_cb(struct spk_info *spk, void *arg)
+{
+  struct bench_player_devices *devices = arg;
+
+  if (strcmp(spk->output_type, outputs_name(OUTPUT_TYPE_DUMMY)) != 0 || devices->ids[0] >= BENCH_PLAYER_DEVICES_MAX)
+    return;
+
+  devices->ids[0]++;
+  devices->ids[devices->ids[0]] = spk->id;
+}
+
+static void
+bench_player_report(struct player_stats *stats, int ndevices, uint64_t wall_usec, uint64_t cpu_usec)
+{
+  uint64_t ticks;
+  int i;
+
+  printf("Played %.1f s to %d dummy outputs, %" PRIu64 " ticks (%" PRIu64 " with overruns, %" PRIu64 " missed)\n",
+	 wall_usec / 1000000.0, ndevices, stats->ticks, stats->overruns, stats->overrun_ticks);
+  printf("Resets %u, aborts %u, underruns %u, lowest input buffer %zu of %zu bytes\n\n",
+	 stats->resets, stats->aborts, stats->underruns, stats->input_buffered_min, stats->input_size);
+
+  ticks = stats->ticks ? stats->ticks : 1;
+
+  printf("Tick lateness (max %.2f ms):\n", stats->lateness_max_us / 1000.0);
+  for (i = 0; i < PLAYER_STATS_LATENESS_BUCKETS; i++)
+    {
+      if (stats->lateness_bound_ms[i] > 0)
+	printf("  < %4u ms  %10" PRIu64 "  %6.2f%%\n", stats->lateness_bound_ms[i], stats->lateness[i], 100.0 * stats->lateness[i] / ticks);
+      else
+	printf("  longer     %10" PRIu64 "  %6.2f%%\n", stats->lateness[i], 100.0 * stats->lateness[i] / ticks);
+    }
+
+  printf("\nTrack switches %u, avg %.2f ms, max %.2f ms\n", stats->switches,
+	 stats->switches ? stats->switch_total_us / 1000.0 / stats->switches : 0.0, stats->switch_max_us / 1000.0);
+
+  // Compare runs with a different number of outputs for the cost of each
+  printf("CPU %.2f%% of one core, %.3f%% per output\n", 100.0 * cpu_usec / wall_usec, 100.0 * cpu_usec / wall_usec / ndevices);
+
+  for (i = 0; i < stats->noutputs; i++)
+    {
+      if (stats->outputs[i].writes == 0)
+	continue;
+
+      printf("Output %s: %" PRIu64 " writes, avg %.1f us, max %" PRIu64 " us, %.3f%% of the time writing\n", stats->outputs[i].name,
+	     stats->outputs[i].writes, (double)stats->outputs[i].total_us / stats->outputs[i].writes, stats->outputs[i].max_us,
+	     100.0 * stats->outputs[i].total_us / wall_usec);
+    }
+
+  printf("Peak RSS %.1f MB\n", bench_rss_peak_kb() / 1024.0);
+}
+
+static int
+bench_player(int ndevices)
+{
+  struct bench_player_devices devices;
+  struct player_stats stats;
+  struct player_status status;
+  struct timespec ts = { 0, 100000000 };
+  char dir[] = "/tmp/forked-daapd-bench-XXXXXX";
+  char path[PATH_MAX];
+  uint64_t start;
+  uint64_t wall_usec;
+  uint64_t cpu_usec;
+  uint64_t timeout;
+  int i;
+  int ret;
+
+  if (ndevices <= 0)
+    ndevices = 1;
+  if (ndevices > BENCH_PLAYER_DEVICES_MAX)
+    {
+      fprintf(stderr, "At most %d outputs are possible\n", BENCH_PLAYER_DEVICES_MAX);
+      return -1;
+    }
+
+  if (!mkdtemp(dir))
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create temporary directory: %s\n", strerror(errno));
+      return -1;
+    }
+
+  cfg_setstr(cfg_getsec(cfg, "audio"), "type", "dummy");
+  cfg_setint(cfg_getsec(cfg, "audio"), "dummy_devices", ndevices);
+  cfg_setbool(cfg_getsec(cfg, "general"), "speaker_autoselect", cfg_false);
+
+  ret = bench_db_setup();
+  if (ret < 0)
+    goto out_rmdir;
+
+  // The outputs that discover devices need mDNS, even if only dummy is used
+  ret = mdns_init();
+  if (ret < 0)
+    goto out_db;
+
+  ret = worker_init();
+  if (ret < 0)
+    goto out_mdns;
+
+  ret = player_init();
+  if (ret < 0)
+    goto out_worker;
+
+  ret = bench_player_tracks_add(dir);
+  if (ret < 0)
+    goto out_player;
+
+  memset(&devices, 0, sizeof(struct bench_player_devices));
+  player_speaker_enumerate(bench_player_device_cb, &devices);
+
+  ret = player_speaker_set(devices.ids);
+  if (ret < 0 || devices.ids[0] != ndevices)
+    {
+      fprintf(stderr, "Could not select %d dummy outputs\n", ndevices);
+      ret = -1;
+      goto out_player;
+    }
+
+  printf("Playing %d tracks of %d s to %d dummy outputs\n", BENCH_PLAYER_TRACKS, BENCH_PLAYER_TRACK_SECONDS, ndevices);
+
+  start = bench_clock_usec();
+  cpu_usec = bench_cpu_usec();
+
+  ret = player_playback_start();
+  if (ret < 0)
+    {
+      fprintf(stderr, "Could not start playback\n");
+      goto out_player;
+    }
+
+  timeout = start + (BENCH_PLAYER_TRACKS * BENCH_PLAYER_TRACK_SECONDS + 30) * 1000000ULL;
+  do
+    {
+      nanosleep(&ts, NULL);
+      player_get_status(&status);
+    }
+  while (status.status != PLAY_STOPPED && bench_clock_usec() < timeout);
+
+  wall_usec = bench_clock_usec() - start;
+  cpu_usec = bench_cpu_usec() - cpu_usec;
+
+  // The stats are only reset when playback starts again, so these are still
+  // the ones of the session that just ended
+  player_get_stats(&stats);
+
+  if (status.status != PLAY_STOPPED)
+    {
+      fprintf(stderr, "Playback did not end in time\n");
+      player_playback_stop();
+      ret = -1;
+    }
+
+  bench_player_report(&stats, ndevices, wall_usec ? wall_usec : 1, cpu_usec);
+
+ out_player:
+  player_deinit();
+ out_worker:
+  worker_deinit();
+ out_mdns:
+  mdns_deinit();
+ out_db:
+  bench_db_cleanup();
+ out_rmdir:
+  for (i = 1; i <= BENCH_PLAYER_TRACKS; i++)
+    {
+      snprintf(path, sizeof(path), "%s/%02d.wav", dir, i);
+      unlink(path);
+    }
+  rmdir(dir);
+
+  return ret;
+}
+
+
+/* -------------------------------- Scanner -------------------------------- */
+
+struct bench_tags
+{
+  const char *title;
+  const char *artist;
+  const char *album_artist;
+  const char *album;
+  const char *genre;
+  int track;
+  int total_tracks;
+  int year;
+};
+
+struct bench_io
+{
+  uint64_t syscalls; // read and write syscalls, from /proc/self/io
+  uint64_t write_bytes;
+};
+
+// 1x1 PNG, embedded as cover art in all the files
+static const uint8_t bench_png[] =
+  {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52, 0x00, 0x00,
+    0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x02, 0x00, 0x00, 0x00, 0x90, 0x77, 0x53, 0xde, 0x00, 0x00, 0x00,
+    0x0c, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0xf8, 0xdf, 0xc0, 0x00, 0x00, 0x04, 0x01, 0x01, 0x80, 0xc5,
+    0x2a, 0x18, 0x5d, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82,
+  };
+
+static void
+bench_add_be16(struct evbuffer *evbuf, uint16_t v)
+{
+  uint8_t b[2] = { v >> 8, v & 0xff };
+
+  evbuffer_add(evbuf, b, sizeof(b));
+}
+
+static void
+bench_add_be24(struct evbuffer *evbuf, uint32_t v)
+{
+  uint8_t b[3] = { (v >> 16) & 0xff, (v >> 8) & 0xff, v & 0xff };
+
+  evbuffer_add(evbuf, b, sizeof(b));
+}
+
+static void
+bench_add_be32(struct evbuffer *evbuf, uint32_t v)
+{
+  uint8_t b[4] = { v >> 24, (v >> 16) & 0xff, (v >> 8) & 0xff, v & 0xff };
+
+  evbuffer_add(evbuf, b, sizeof(b));
+}
+
+static void
+bench_add_le32(struct evbuffer *evbuf, uint32_t v)
+{
+  uint8_t b[4];
+
+  bench_le32(b, v);
+  evbuffer_add(evbuf, b, sizeof(b));
+}
+
+static void
+bench_add_zeros(struct evbuffer *evbuf, size_t len)
+{
+  uint8_t zeros[128] = { 0 };
+  size_t n;
+
+  for (; len > 0; len -= n)
+    {
+      n = (len < sizeof(zeros)) ? len : sizeof(zeros);
+      evbuffer_add(evbuf, zeros, n);
+    }
+}
+
+static int
+bench_evbuffer_save(const char *path, struct evbuffer *evbuf)
+{
+  int fd;
+  int ret;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  ret = 0;
+  while (evbuffer_get_length(evbuf) > 0 && ret >= 0)
+    ret = evbuffer_write(evbuf, fd);
+
+  close(fd);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+/* MP3: ID3v2.4 tag followed by about a second of silent 32 kbps mono frames */
+
+static void
+bench_id3_syncsafe(struct evbuffer *evbuf, uint32_t v)
+{
+  uint8_t b[4] = { (v >> 21) & 0x7f, (v >> 14) & 0x7f, (v >> 7) & 0x7f, v & 0x7f };
+
+  evbuffer_add(evbuf, b, sizeof(b));
+}
+
+static void
+bench_id3_frame(struct evbuffer *tag, const char *id, const void *data, size_t len)
+{
+  evbuffer_add(tag, id, 4);
+  bench_id3_syncsafe(tag, len);
+  bench_add_be16(tag, 0);
+  evbuffer_add(tag, data, len);
+}
+
+static void
+bench_id3_text(struct evbuffer *tag, const char *id, const char *text)
+{
+  struct evbuffer *frame;
+
+  CHECK_NULL(L_MAIN, frame = evbuffer_new());
+
+  evbuffer_add(frame, "\3", 1); // UTF-8
+  evbuffer_add(frame, text, strlen(text));
+
+  bench_id3_frame(tag, id, evbuffer_pullup(frame, -1), evbuffer_get_length(frame));
+
+  evbuffer_free(frame);
+}
+
+static int
+bench_mp3_write(const char *path, struct bench_tags *tags)
+{
+  struct evbuffer *file;
+  struct evbuffer *tag;
+  struct evbuffer *apic;
+  uint8_t frame_header[4] = { 0xff, 0xfb, 0x10, 0xc0 };
+  char buf[32];
+  int ret;
+  int i;
+
+  CHECK_NULL(L_MAIN, file = evbuffer_new());
+  CHECK_NULL(L_MAIN, tag = evbuffer_new());
+  CHECK_NULL(L_MAIN, apic = evbuffer_new());
+
+  bench_id3_text(tag, "TIT2", tags->title);
+  bench_id3_text(tag, "TPE1", tags->artist);
+  bench_id3_text(tag, "TPE2", tags->album_artist);
+  bench_id3_text(tag, "TALB", tags->album);
+  bench_id3_text(tag, "TCON", tags->genre);
+  snprintf(buf, sizeof(buf), "%d/%d", tags->track, tags->total_tracks);
+  bench_id3_text(tag, "TRCK", buf);
+  snprintf(buf, sizeof(buf), "%d", tags->year);
+  bench_id3_text(tag, "TDRC", buf);
+
+  evbuffer_add(apic, "\0image/png\0\3\0", 13);
+  evbuffer_add(apic, bench_png, sizeof(bench_png));
+  bench_id3_frame(tag, "APIC", evbuffer_pullup(apic, -1), evbuffer_get_length(apic));
+
+  evbuffer_add(file, "ID3\4\0\0", 6);
+  bench_id3_syncsafe(file, evbuffer_get_length(tag));
+  evbuffer_add_buffer(file, tag);
+
+  // An all zero Layer III frame is valid silence
+  for (i = 0; i < 38; i++)
+    {
+      evbuffer_add(file, frame_header, sizeof(frame_header));
+      bench_add_zeros(file, 104 - sizeof(frame_header));
+    }
+
+  ret = bench_evbuffer_save(path, file);
+
+  evbuffer_free(apic);
+  evbuffer_free(tag);
+  evbuffer_free(file);
+
+  return ret;
+}
+
+/* FLAC: metadata blocks and about a second of silent frames, which are just a
+ * constant subframe each */
+
+static uint8_t
+bench_crc8(const uint8_t *data, size_t len)
+{
+  uint8_t crc = 0;
+  int i;
+
+  while (len--)
+    {
+      crc ^= *data++;
+      for (i = 0; i < 8; i++)
+	crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+
+  return crc;
+}
+
+static uint16_t
+bench_crc16(const uint8_t *data, size_t len)
+{
+  uint16_t crc = 0;
+  int i;
+
+  while (len--)
+    {
+      crc ^= (uint16_t)(*data++) << 8;
+      for (i = 0; i < 8; i++)
+	crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : (crc << 1);
+    }
+
+  return crc;
+}
+
+static void
+bench_flac_block(struct evbuffer *file, int type, bool last, struct evbuffer *block)
+{
+  uint8_t b = (last ? 0x80 : 0) | type;
+
+  evbuffer_add(file, &b, 1);
+  bench_add_be24(file, evbuffer_get_length(block));
+  evbuffer_add_buffer(file, block);
+}
+
+static void
+bench_vorbis_comment(struct evbuffer *block, const char *key, const char *value)
+{
+  bench_add_le32(block, strlen(key) + 1 + strlen(value));
+  evbuffer_add_printf(block, "%s=%s", key, value);
+}
+
+static int
+bench_flac_write(const char *path, struct bench_tags *tags)
+{
+  struct evbuffer *file;
+  struct evbuffer *block;
+  uint8_t frame[11];
+  uint16_t crc;
+  char buf[32];
+  int nframes = 11;
+  int ret;
+  int i;
+
+  CHECK_NULL(L_MAIN, file = evbuffer_new());
+  CHECK_NULL(L_MAIN, block = evbuffer_new());
+
+  evbuffer_add(file, "fLaC", 4);
+
+  // STREAMINFO: 4096 samples per block, 44100 Hz, mono, 16 bit, no MD5
+  bench_add_be16(block, 4096);
+  bench_add_be16(block, 4096);
+  bench_add_be24(block, 0);
+  bench_add_be24(block, 0);
+  bench_add_be32(block, (44100 << 12) | (0 << 9) | (15 << 4));
+  bench_add_be32(block, nframes * 4096);
+  bench_add_zeros(block, 16);
+  bench_flac_block(file, 0, false, block);
+
+  bench_add_le32(block, strlen(PACKAGE));
+  evbuffer_add(block, PACKAGE, strlen(PACKAGE));
+  bench_add_le32(block, 7);
+  bench_vorbis_comment(block, "TITLE", tags->title);
+  bench_vorbis_comment(block, "ARTIST", tags->artist);
+  bench_vorbis_comment(block, "ALBUMARTIST", tags->album_artist);
+  bench_vorbis_comment(block, "ALBUM", tags->album);
+  bench_vorbis_comment(block, "GENRE", tags->genre);
+  snprintf(buf, sizeof(buf), "%d/%d", tags->track, tags->total_tracks);
+  bench_vorbis_comment(block, "TRACKNUMBER", buf);
+  snprintf(buf, sizeof(buf), "%d", tags->year);
+  bench_vorbis_comment(block, "DATE", buf);
+  bench_flac_block(file, 4, false, block);
+
+  bench_add_be32(block, 3); // Front cover
+  bench_add_be32(block, strlen("image/png"));
+  evbuffer_add(block, "image/png", strlen("image/png"));
+  bench_add_be32(block, 0);
+  bench_add_be32(block, 1);
+  bench_add_be32(block, 1);
+  bench_add_be32(block, 24);
+  bench_add_be32(block, 0);
+  bench_add_be32(block, sizeof(bench_png));
+  evbuffer_add(block, bench_png, sizeof(bench_png));
+  bench_flac_block(file, 6, true, block);
+
+  for (i = 0; i < nframes; i++)
+    {
+      // Fixed blocksize 4096, 44100 Hz, mono, 16 bit, frame number i (< 128)
+      frame[0] = 0xff;
+      frame[1] = 0xf8;
+      frame[2] = 0xc9;
+      frame[3] = 0x08;
+      frame[4] = i;
+      frame[5] = bench_crc8(frame, 5);
+      // Constant subframe with value 0
+      frame[6] = 0x00;
+      frame[7] = 0x00;
+      frame[8] = 0x00;
+      crc = bench_crc16(frame, 9);
+      frame[9] = crc >> 8;
+      frame[10] = crc & 0xff;
+
+      evbuffer_add(file, frame, sizeof(frame));
+    }
+
+  ret = bench_evbuffer_save(path, file);
+
+  evbuffer_free(block);
+  evbuffer_free(file);
+
+  return ret;
+}
+
+/* M4A: half a second of 8 kHz mono PCM ('sowt', no codec needed to write it)
+ * and iTunes style metadata with cover art */
+
+static void
+bench_mp4_box(struct evbuffer *out, const char *type, struct evbuffer *payload)
+{
+  bench_add_be32(out, 8 + evbuffer_get_length(payload));
+  evbuffer_add(out, type, 4);
+  evbuffer_add_buffer(out, payload);
+}
+
+static void
+bench_mp4_item(struct evbuffer *ilst, const char *type, uint32_t data_type, const void *value, size_t len)
+{
+  struct evbuffer *data;
+  struct evbuffer *item;
+
+  CHECK_NULL(L_MAIN, data = evbuffer_new());
+  CHECK_NULL(L_MAIN, item = evbuffer_new());
+
+  bench_add_be32(data, data_type);
+  bench_add_be32(data, 0);
+  evbuffer_add(data, value, len);
+  bench_mp4_box(item, "data", data);
+  bench_mp4_box(ilst, type, item);
+
+  evbuffer_free(item);
+  evbuffer_free(data);
+}
+
+static void
+bench_mp4_matrix(struct evbuffer *evbuf)
+{
+  bench_add_be32(evbuf, 0x00010000);
+  bench_add_zeros(evbuf, 12);
+  bench_add_be32(evbuf, 0x00010000);
+  bench_add_zeros(evbuf, 12);
+  bench_add_be32(evbuf, 0x40000000);
+}
+
+static int
+bench_m4a_write(const char *path, struct bench_tags *tags)
+{
+  struct evbuffer *file;
+  struct evbuffer *b[8]; // Payloads of the boxes being built, by nesting level
+  uint8_t trkn[8] = { 0, 0, 0, tags->track, 0, tags->total_tracks, 0, 0 };
+  char buf[32];
+  uint32_t nsamples = 4000;
+  int ret;
+  int i;
+
+  CHECK_NULL(L_MAIN, file = evbuffer_new());
+  for (i = 0; i < ARRAY_LEN(b); i++)
+    CHECK_NULL(L_MAIN, b[i] = evbuffer_new());
+
+  evbuffer_add(b[0], "M4A \0\0\0\0M4A mp42isom", 20);
+  bench_mp4_box(file, "ftyp", b[0]);
+
+  // Samples right after ftyp, so they start at offset 28 + 8
+  bench_add_zeros(b[0], nsamples * 2);
+  bench_mp4_box(file, "mdat", b[0]);
+
+  // moov
+  bench_add_be32(b[1], 0);
+  bench_add_be32(b[1], 0);
+  bench_add_be32(b[1], 0);
+  bench_add_be32(b[1], 8000);
+  bench_add_be32(b[1], nsamples);
+  bench_add_be32(b[1], 0x00010000);
+  bench_add_be16(b[1], 0x0100);
+  bench_add_zeros(b[1], 10);
+  bench_mp4_matrix(b[1]);
+  bench_add_zeros(b[1], 24);
+  bench_add_be32(b[1], 2);
+  bench_mp4_box(b[0], "mvhd", b[1]);
+
+  // moov.trak
+  bench_add_be32(b[2], 0x00000007);
+  bench_add_be32(b[2], 0);
+  bench_add_be32(b[2], 0);
+  bench_add_be32(b[2], 1);
+  bench_add_be32(b[2], 0);
+  bench_add_be32(b[2], nsamples);
+  bench_add_zeros(b[2], 8);
+  bench_add_be32(b[2], 0);
+  bench_add_be16(b[2], 0x0100);
+  bench_add_be16(b[2], 0);
+  bench_mp4_matrix(b[2]);
+  bench_add_be32(b[2], 0);
+  bench_add_be32(b[2], 0);
+  bench_mp4_box(b[1], "tkhd", b[2]);
+
+  // moov.trak.mdia
+  bench_add_be32(b[3], 0);
+  bench_add_be32(b[3], 0);
+  bench_add_be32(b[3], 0);
+  bench_add_be32(b[3], 8000);
+  bench_add_be32(b[3], nsamples);
+  bench_add_be16(b[3], 0x55c4); // "und"
+  bench_add_be16(b[3], 0);
+  bench_mp4_box(b[2], "mdhd", b[3]);
+
+  bench_add_be32(b[3], 0);
+  bench_add_be32(b[3], 0);
+  evbuffer_add(b[3], "soun", 4);
+  bench_add_zeros(b[3], 12);
+  evbuffer_add(b[3], "SoundHandler", 13);
+  bench_mp4_box(b[2], "hdlr", b[3]);
+
+  // moov.trak.mdia.minf
+  bench_add_be32(b[4], 0);
+  bench_add_be32(b[4], 0);
+  bench_mp4_box(b[3], "smhd", b[4]);
+
+  bench_add_be32(b[6], 1); // Self-contained
+  bench_mp4_box(b[5], "url ", b[6]);
+  bench_add_be32(b[6], 0);
+  bench_add_be32(b[6], 1);
+  evbuffer_add_buffer(b[6], b[5]);
+  bench_mp4_box(b[4], "dref", b[6]);
+  bench_mp4_box(b[3], "dinf", b[4]);
+
+  // moov.trak.mdia.minf.stbl
+  bench_add_zeros(b[6], 6);
+  bench_add_be16(b[6], 1);
+  bench_add_be16(b[6], 0);
+  bench_add_be16(b[6], 0);
+  bench_add_be32(b[6], 0);
+  bench_add_be16(b[6], 1);
+  bench_add_be16(b[6], 16);
+  bench_add_be16(b[6], 0);
+  bench_add_be16(b[6], 0);
+  bench_add_be32(b[6], 8000 << 16);
+  bench_add_be32(b[5], 0);
+  bench_add_be32(b[5], 1);
+  bench_mp4_box(b[5], "sowt", b[6]);
+  bench_mp4_box(b[4], "stsd", b[5]);
+
+  bench_add_be32(b[5], 0);
+  bench_add_be32(b[5], 1);
+  bench_add_be32(b[5], nsamples);
+  bench_add_be32(b[5], 1);
+  bench_mp4_box(b[4], "stts", b[5]);
+
+  bench_add_be32(b[5], 0);
+  bench_add_be32(b[5], 1);
+  bench_add_be32(b[5], 1);
+  bench_add_be32(b[5], nsamples);
+  bench_add_be32(b[5], 1);
+  bench_mp4_box(b[4], "stsc", b[5]);
+
+  bench_add_be32(b[5], 0);
+  bench_add_be32(b[5], 2);
+  bench_add_be32(b[5], nsamples);
+  bench_mp4_box(b[4], "stsz", b[5]);
+
+  bench_add_be32(b[5], 0);
+  bench_add_be32(b[5], 1);
+  bench_add_be32(b[5], 28 + 8);
+  bench_mp4_box(b[4], "stco", b[5]);
+
+  bench_mp4_box(b[3], "stbl", b[4]);
+  bench_mp4_box(b[2], "minf", b[3]);
+  bench_mp4_box(b[1], "mdia", b[2]);
+  bench_mp4_box(b[0], "trak", b[1]);
+
+  // moov.udta.meta.ilst
+  bench_mp4_item(b[3], "\251nam", 1, tags->title, strlen(tags->title));
+  bench_mp4_item(b[3], "\251ART", 1, tags->artist, strlen(tags->artist));
+  bench_mp4_item(b[3], "aART", 1, tags->album_artist, strlen(tags->album_artist));
+  bench_mp4_item(b[3], "\251alb", 1, tags->album, strlen(tags->album));
+  bench_mp4_item(b[3], "\251gen", 1, tags->genre, strlen(tags->genre));
+  snprintf(buf, sizeof(buf), "%d", tags->year);
+  bench_mp4_item(b[3], "\251day", 1, buf, strlen(buf));
+  bench_mp4_item(b[3], "trkn", 0, trkn, sizeof(trkn));
+  bench_mp4_item(b[3], "covr", 14, bench_png, sizeof(bench_png));
+
+  bench_add_be32(b[2], 0);
+  bench_add_be32(b[4], 0);
+  bench_add_be32(b[4], 0);
+  evbuffer_add(b[4], "mdirappl", 8);
+  bench_add_zeros(b[4], 9);
+  bench_mp4_box(b[2], "hdlr", b[4]);
+  bench_mp4_box(b[2], "ilst", b[3]);
+  bench_mp4_box(b[1], "meta", b[2]);
+  bench_mp4_box(b[0], "udta", b[1]);
+
+  bench_mp4_box(file, "moov", b[0]);
+
+  ret = bench_evbuffer_save(path, file);
+
+  for (i = 0; i < ARRAY_LEN(b); i++)
+    evbuffer_free(b[i]);
+  evbuffer_free(file);
+
+  return ret;
+}
+
+// Makes nfiles in albums of 8-17 tracks under dir, in all three formats, and
+// an m3u playlist for each album
+static int
+bench_tree_generate(const char *dir, int nfiles, int first)
+{
+  struct bench_tags tags;
+  char path[PATH_MAX];
+  char album_dir[PATH_MAX];
+  char *artist;
+  char *album;
+  char *title;
+  FILE *m3u;
+  int ntr;
+  int n;
+  int i;
+  int ret;
+
+  for (n = 0; n < nfiles; )
+    {
+      artist = bench_name(1 + bench_rand() % 3);
+      album = bench_name(1 + bench_rand() % 3);
+      ntr = 8 + bench_rand() % 10;
+
+      snprintf(album_dir, sizeof(album_dir), "%s/%s %d", dir, artist, first + n);
+      ret = mkdir(album_dir, 0755);
+      if (ret == 0)
+	{
+	  snprintf(path, sizeof(path), "%s/%s.m3u", album_dir, album);
+	  m3u = fopen(path, "w");
+	}
+      else
+	m3u = NULL;
+
+      if (!m3u)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Could not create album in '%s': %s\n", album_dir, strerror(errno));
+	  free(artist);
+	  free(album);
+	  return -1;
+	}
+
+      for (i = 1; i <= ntr && n < nfiles; i++, n++)
+	{
+	  title = bench_name(1 + bench_rand() % 4);
+
+	  tags.title = title;
+	  tags.artist = artist;
+	  tags.album_artist = artist;
+	  tags.album = album;
+	  tags.genre = bench_genres[bench_rand_skewed(ARRAY_LEN(bench_genres))];
+	  tags.track = i;
+	  tags.total_tracks = ntr;
+	  tags.year = 1960 + bench_rand() % 60;
+
+	  switch (n % 3)
+	    {
+	      case 0:
+		snprintf(path, sizeof(path), "%s/%02d %s.mp3", album_dir, i, title);
+		ret = bench_mp3_write(path, &tags);
+		break;
+	      case 1:
+		snprintf(path, sizeof(path), "%s/%02d %s.flac", album_dir, i, title);
+		ret = bench_flac_write(path, &tags);
+		break;
+	      default:
+		snprintf(path, sizeof(path), "%s/%02d %s.m4a", album_dir, i, title);
+		ret = bench_m4a_write(path, &tags);
+	    }
+
+	  fprintf(m3u, "%s\n", strrchr(path, '/') + 1);
+
+	  free(title);
+	  if (ret < 0)
+	    break;
+	}
+
+      fclose(m3u);
+      free(artist);
+      free(album);
+
+      if (ret < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+static int
+bench_tree_remove_cb(const char *path, const struct stat *sb, int type, struct FTW *ftwbuf)
+{
+  return remove(path);
+}
+
+static void
+bench_io_get(struct bench_io *io)
+{
+  char line[128];
+  uint64_t v;
+  FILE *fp;
+
+  memset(io, 0, sizeof(struct bench_io));
+
+  // Linux only, elsewhere the numbers are just 0
+  fp = fopen("/proc/self/io", "r");
+  if (!fp)
+    return;
+
+  while (fgets(line, sizeof(line), fp))
+    {
+      if (sscanf(line, "syscr: %" SCNu64, &v) == 1 || sscanf(line, "syscw: %" SCNu64, &v) == 1)
+	io->syscalls += v;
+      else if (sscanf(line, "write_bytes: %" SCNu64, &v) == 1)
+	io->write_bytes = v;
+    }
+
+  fclose(fp);
+}
+
+// Waits for the running or the upcoming library scan to end
+static int
+bench_scan_wait(void)
+{
+  struct library_scan_stats stats;
+  struct timespec ts = { 0, 20000000 };
+  uint64_t timeout;
+
+  timeout = bench_clock_usec() + 3600 * 1000000ULL;
+  do
+    {
+      nanosleep(&ts, NULL);
+
+      library_scan_stats_get(&stats);
+      free(stats.probe_slowest);
+    }
+  while ((!stats.start || stats.running || library_is_scanning()) && bench_clock_usec() < timeout);
+
+  return (stats.running || library_is_scanning()) ? -1 : 0;
+}
+
+static void
+bench_scan_report(const char *name, int nfiles, uint64_t usec, struct bench_io *io_start, struct bench_io *io_end)
+{
+  int n = nfiles ? nfiles : 1;
+
+  printf("%-10s %8d %9.2f %9.0f %9.1f %10.0f %8.1f\n", name, nfiles, usec / 1000000.0, nfiles * 1000000.0 / (usec ? usec : 1),
+	 (double)(io_end->syscalls - io_start->syscalls) / n, (double)(io_end->write_bytes - io_start->write_bytes) / n,
+	 bench_rss_peak_kb() / 1024.0);
+}
+
+static void
+bench_scan_stats_report(void)
+{
+  struct library_scan_stats stats;
+
+  library_scan_stats_get(&stats);
+
+  printf("           probed %" PRIu64 ", skipped %" PRIu64 ", saved %" PRIu64 ", probe p50/p99/max %.2f/%.2f/%.2f ms, db writes %.3f ms/file\n",
+	 stats.files_probed, stats.files_skipped, stats.files_saved, stats.probe_usec_p50 / 1000.0, stats.probe_usec_p99 / 1000.0,
+	 stats.probe_usec_max / 1000.0, stats.files_saved ? stats.db_write_usec / 1000.0 / stats.files_saved : 0.0);
+
+  free(stats.probe_slowest);
+}
+
+static int
+bench_scan(int nfiles)
+{
+  struct bench_io io_start;
+  struct bench_io io_end;
+  struct timespec ts = { 0, 20000000 };
+  char dir[] = "/tmp/forked-daapd-bench-XXXXXX";
+  char path[PATH_MAX];
+  uint64_t start;
+  uint64_t timeout;
+  int nburst;
+  int ret;
+
+  if (nfiles <= 0)
+    nfiles = BENCH_SCAN_FILES_DEFAULT;
+
+  nburst = nfiles / 10 + 1;
+
+  if (!mkdtemp(dir))
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create temporary directory: %s\n", strerror(errno));
+      return -1;
+    }
+
+  ret = bench_db_setup();
+  if (ret < 0)
+    goto out_rmdir;
+
+  printf("Generating %d files in %s\n", nfiles, dir);
+
+  start = bench_clock_usec();
+  ret = bench_tree_generate(dir, nfiles, 0);
+  if (ret < 0)
+    goto out_db;
+
+  printf("Generated in %.1f s\n\n", (bench_clock_usec() - start) / 1000000.0);
+
+  cfg_setlist(cfg_getsec(cfg, "library"), "directories", 1, dir);
+  // There is no player, so don't wait for it to be idle
+  cfg_setint(cfg_getsec(cfg, "sqlite"), "maintenance_idle", 0);
+
+  ret = worker_init();
+  if (ret < 0)
+    goto out_db;
+
+  ret = cache_init();
+  if (ret < 0)
+    goto out_worker;
+
+  printf("%-10s %8s %9s %9s %9s %10s %8s\n", "scenario", "files", "s", "files/s", "rw calls", "wr bytes", "RSS MB");
+
+  // Initial scan, started by library_init()
+  bench_io_get(&io_start);
+  start = bench_clock_usec();
+
+  ret = library_init();
+  if (ret < 0)
+    goto out_cache;
+
+  ret = bench_scan_wait();
+
+  bench_io_get(&io_end);
+  bench_scan_report("initial", nfiles, bench_clock_usec() - start, &io_start, &io_end);
+  bench_scan_stats_report();
+  if (ret < 0)
+    goto out_library;
+
+  // Rescan where nothing changed
+  bench_io_get(&io_start);
+  start = bench_clock_usec();
+
+  library_rescan();
+  ret = bench_scan_wait();
+
+  bench_io_get(&io_end);
+  bench_scan_report("rescan", nfiles, bench_clock_usec() - start, &io_start, &io_end);
+  bench_scan_stats_report();
+  if (ret < 0)
+    goto out_library;
+
+  // A burst of new files, e.g. an album collection copied in, picked up with
+  // inotify. This includes the time to write the files.
+  snprintf(path, sizeof(path), "%s/burst", dir);
+  bench_io_get(&io_start);
+  start = bench_clock_usec();
+
+  ret = mkdir(path, 0755);
+  if (ret == 0)
+    ret = bench_tree_generate(path, nburst, nfiles);
+  if (ret < 0)
+    goto out_library;
+
+  timeout = start + 600 * 1000000ULL;
+  while (db_files_get_count() < nfiles + nburst && bench_clock_usec() < timeout)
+    nanosleep(&ts, NULL);
+
+  bench_io_get(&io_end);
+  bench_scan_report("inotify", nburst, bench_clock_usec() - start, &io_start, &io_end);
+
+  if (db_files_get_count() < nfiles + nburst)
+    {
+      fprintf(stderr, "Only %d of %d files were added to the library\n", db_files_get_count(), nfiles + nburst);
+      ret = -1;
+    }
+
+ out_library:
+  library_deinit();
+ out_cache:
+  cache_deinit();
+ out_worker:
+  worker_deinit();
+ out_db:
+  bench_db_cleanup();
+ out_rmdir:
+  nftw(dir, bench_tree_remove_cb, 16, FTW_DEPTH | FTW_PHYS);
+
+  return ret;
+}
+
+
+/* ---------------------------------- API ---------------------------------- */
+
+int
+bench_run(const char *spec, const char *webroot)
+{
+  char *name;
+  char *ptr;
+  int32_t size;
+  int ret;
+
+  name = strdup(spec);
+  size = 0;
+
+  ptr = strchr(name, ':');
+  if (ptr)
+    {
+      *ptr = '\0';
+      ret = safe_atoi32(ptr + 1, &size);
+      if (ret < 0 || size <= 0)
+	{
+	  fprintf(stderr, "Invalid benchmark size '%s'\n", ptr + 1);
+	  free(name);
+	  return -1;
+	}
+    }
+
+  if (strcmp(name, "daap") == 0)
+    ret = bench_daap(size, webroot);
+  else if (strcmp(name, "player") == 0)
+    ret = bench_player(size);
+  else if (strcmp(name, "scan") == 0)
+    ret = bench_scan(size);
+  else
+    {
+      fprintf(stderr, "Unknown benchmark '%s', available are: daap, player, scan\n", name);
+      ret = -1;
+    }
+
+  free(name);
+  return ret;
+}
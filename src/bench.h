@@ -0,0 +1,16 @@
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/* Runs a benchmark instead of the server (started with --bench) and prints the
+ * results to stdout. The spec is the name of the benchmark, optionally followed
+ * by a colon and its size, e.g. "daap:100000".
+ *
+ * @in spec      name[:size] of the benchmark
+ * @in webroot   web root, needed to start httpd
+ * @return       0 on success, -1 on error
+ */
+int
+bench_run(const char *spec, const char *webroot);
+
+#endif /* !__BENCH_H__ */
@@ -24,6 +24,7 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -43,11 +44,32 @@
 #include "httpd_daap.h"
 #include "db.h"
 #include "cache.h"
+#include "dmap_common.h"
 #include "listener.h"
 #include "commands.h"
+#include "metrics.h"
+#include "misc.h"
 
 
-#define CACHE_VERSION 3
+#define CACHE_VERSION 5
+
+// Buckets in the hash table of the in-memory DAAP reply cache
+#define CACHE_DAAP_MEM_BUCKETS 64
+#define CACHE_DMAP_RECORD_BUCKETS 16384
+#define CACHE_ARTWORK_MEM_BUCKETS 256
+
+// Artwork cache writes are queued and written in one transaction when the
+// queue is full or after CACHE_ARTWORK_FLUSH_SECS
+#define CACHE_ARTWORK_PENDING_MAX 128
+#define CACHE_ARTWORK_PENDING_SIZE (8 * 1024 * 1024)
+#define CACHE_ARTWORK_FLUSH_SECS 2
+
+// After a library change the cached DAAP replies are rebuilt one at a time,
+// with a pause as long as the last build (at least the minimum below) so the
+// cache thread keeps answering. Queries not used for CACHE_DAAP_COLD_SECS are
+// only rebuilt when a client asks for them again.
+#define CACHE_DAAP_REGEN_GAP_MSEC 200
+#define CACHE_DAAP_COLD_SECS (7 * 24 * 3600)
 
 
 struct cache_arg
@@ -78,6 +100,7 @@ static pthread_t tid_cache;
 struct event_base *evbase_cache;
 static struct commands_base *cmdbase;
 static struct event *cache_daap_updateev;
+static struct event *cache_daap_regenev;
 
 static int g_initialized;
 
@@ -85,16 +108,126 @@ static int g_initialized;
 static sqlite3 *g_db_hdl;
 static char *g_db_path;
 
-// Global artwork stash
-struct stash
+static int g_suspended;
+
+// Changes whenever cached artwork is removed, see cache_artwork_generation()
+static unsigned int g_artwork_gen;
+
+// Artwork adds and pings that haven't been written to the db yet. Only used by
+// the cache thread, so no lock.
+struct artwork_pending
 {
+  struct evbuffer *evbuf; // NULL for a ping
   char *path;
+  int type;
+  int64_t persistentid;
+  int max_w;
+  int max_h;
   int format;
-  size_t size;
-  uint8_t *data;
-} g_stash;
+  time_t mtime;
+  time_t stamp;
 
-static int g_suspended;
+  struct artwork_pending *next;
+};
+
+static struct artwork_pending *g_artwork_pending_head;
+static struct artwork_pending *g_artwork_pending_tail;
+static int g_artwork_pending_count;
+static size_t g_artwork_pending_size;
+static struct event *cache_artwork_flushev;
+static struct timeval cache_artwork_flush_tv = { CACHE_ARTWORK_FLUSH_SECS, 0 };
+
+// In-memory tier of the DAAP reply cache, in front of the replies table. It is
+// used directly by the httpd threads, so it has its own lock.
+struct daap_mem_entry
+{
+  char *query;
+  uint32_t hash;
+  struct evbuffer *reply; // gzipped
+
+  struct daap_mem_entry *lru_prev;
+  struct daap_mem_entry *lru_next;
+  struct daap_mem_entry *bucket_next;
+};
+
+static struct daap_mem_entry *g_daap_mem_buckets[CACHE_DAAP_MEM_BUCKETS];
+static struct daap_mem_entry *g_daap_mem_lru_head; // Most recently used
+static struct daap_mem_entry *g_daap_mem_lru_tail;
+static pthread_mutex_t g_daap_mem_lck = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_daap_mem_size;
+static int g_daap_mem_count;
+static size_t g_daap_mem_max;
+static struct cache_daap_stats g_daap_stats;
+
+// Queries waiting for their reply to be rebuilt, hottest first
+struct daap_regen
+{
+  int id;
+  char *query;
+  char *ua;
+  int is_remote;
+
+  struct daap_regen *next;
+};
+
+static struct daap_regen *g_daap_regen_head;
+static int g_daap_regen_done;
+
+// Pre-encoded DMAP items (mlit containers), so that song lists can be made by
+// concatenating them. Keyed by item id and meta set, and only valid while the
+// stamp of the item is unchanged.
+struct dmap_record
+{
+  uint32_t id;
+  uint32_t meta_hash;
+  uint64_t stamp;
+
+  struct dmap_record *lru_prev;
+  struct dmap_record *lru_next;
+  struct dmap_record *bucket_next;
+
+  size_t len;
+  uint8_t data[];
+};
+
+static struct dmap_record *g_dmap_rec_buckets[CACHE_DMAP_RECORD_BUCKETS];
+static struct dmap_record *g_dmap_rec_lru_head; // Most recently used
+static struct dmap_record *g_dmap_rec_lru_tail;
+static pthread_mutex_t g_dmap_rec_lck = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_dmap_rec_size;
+static int g_dmap_rec_count;
+static size_t g_dmap_rec_max;
+static uint64_t g_dmap_rec_hits;
+static uint64_t g_dmap_rec_misses;
+
+// Recently served artwork, in front of the artwork table and also holding the
+// stashed images of online artwork (which aren't in the table). Used directly
+// by the artwork threads, so it has its own lock.
+struct artwork_mem_entry
+{
+  char *key;
+  uint32_t hash;
+  int format;
+  unsigned int gen; // g_artwork_gen when added, ignored for stashed images
+  bool stashed;
+
+  struct artwork_mem_entry *lru_prev;
+  struct artwork_mem_entry *lru_next;
+  struct artwork_mem_entry *bucket_next;
+
+  size_t len;
+  uint8_t data[];
+};
+
+static struct artwork_mem_entry *g_artwork_mem_buckets[CACHE_ARTWORK_MEM_BUCKETS];
+static struct artwork_mem_entry *g_artwork_mem_lru_head; // Most recently used
+static struct artwork_mem_entry *g_artwork_mem_lru_tail;
+static pthread_mutex_t g_artwork_mem_lck = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_artwork_mem_size;
+static int g_artwork_mem_count;
+static size_t g_artwork_mem_max;
+static uint64_t g_artwork_mem_hits;
+static uint64_t g_artwork_mem_misses;
 
 // The user may configure a threshold (in msec), and queries slower than
 // that will have their reply cached
@@ -123,6 +256,532 @@ remove_tag(char *in, const char *tag)
 }
 
 
+/* Returns the query without the transient tags, caller must free */
+static char *
+daap_query_normalize(const char *query)
+{
+  char *normalized;
+
+  normalized = strdup(query);
+  if (!normalized)
+    return NULL;
+
+  remove_tag(normalized, "session-id");
+  remove_tag(normalized, "revision-number");
+
+  return normalized;
+}
+
+
+/* ---------------------------- DAAP MEMORY TIER --------------------------- */
+/*                                 Thread: any                               */
+
+// Must be called with the lock held
+static void
+daap_mem_lru_unlink(struct daap_mem_entry *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    g_daap_mem_lru_head = e->lru_next;
+
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    g_daap_mem_lru_tail = e->lru_prev;
+
+  e->lru_prev = NULL;
+  e->lru_next = NULL;
+}
+
+// Must be called with the lock held
+static void
+daap_mem_lru_push(struct daap_mem_entry *e)
+{
+  e->lru_next = g_daap_mem_lru_head;
+  if (g_daap_mem_lru_head)
+    g_daap_mem_lru_head->lru_prev = e;
+  g_daap_mem_lru_head = e;
+
+  if (!g_daap_mem_lru_tail)
+    g_daap_mem_lru_tail = e;
+}
+
+// Must be called with the lock held
+static struct daap_mem_entry *
+daap_mem_find(const char *query, uint32_t hash)
+{
+  struct daap_mem_entry *e;
+
+  for (e = g_daap_mem_buckets[hash % CACHE_DAAP_MEM_BUCKETS]; e; e = e->bucket_next)
+    {
+      if (e->hash == hash && strcmp(e->query, query) == 0)
+	return e;
+    }
+
+  return NULL;
+}
+
+// Must be called with the lock held
+static void
+daap_mem_remove(struct daap_mem_entry *e)
+{
+  struct daap_mem_entry **p;
+
+  for (p = &g_daap_mem_buckets[e->hash % CACHE_DAAP_MEM_BUCKETS]; *p; p = &(*p)->bucket_next)
+    {
+      if (*p == e)
+	{
+	  *p = e->bucket_next;
+	  break;
+	}
+    }
+
+  daap_mem_lru_unlink(e);
+
+  g_daap_mem_size -= evbuffer_get_length(e->reply);
+  g_daap_mem_count--;
+
+  evbuffer_free(e->reply);
+  free(e->query);
+  free(e);
+}
+
+static void
+daap_mem_clear(void)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem_lck));
+
+  while (g_daap_mem_lru_head)
+    daap_mem_remove(g_daap_mem_lru_head);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem_lck));
+}
+
+/* Adds a gzipped reply for the normalized query, evicting the least recently
+ * used replies if we get above the size limit. The data is copied.
+ */
+static void
+daap_mem_add(const char *query, const uint8_t *data, size_t len)
+{
+  struct daap_mem_entry *e;
+  uint32_t hash;
+
+  // A single reply may not push out everything else
+  if (len > g_daap_mem_max / 4)
+    return;
+
+  hash = djb_hash(query, strlen(query));
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem_lck));
+
+  e = daap_mem_find(query, hash);
+  if (e)
+    daap_mem_remove(e);
+
+  while (g_daap_mem_lru_tail && (g_daap_mem_size + len > g_daap_mem_max))
+    {
+      daap_mem_remove(g_daap_mem_lru_tail);
+      g_daap_stats.mem_evictions++;
+    }
+
+  CHECK_NULL(L_CACHE, e = calloc(1, sizeof(struct daap_mem_entry)));
+  CHECK_NULL(L_CACHE, e->query = strdup(query));
+  CHECK_NULL(L_CACHE, e->reply = evbuffer_new());
+  CHECK_ERR(L_CACHE, evbuffer_add(e->reply, data, len));
+  e->hash = hash;
+
+  e->bucket_next = g_daap_mem_buckets[hash % CACHE_DAAP_MEM_BUCKETS];
+  g_daap_mem_buckets[hash % CACHE_DAAP_MEM_BUCKETS] = e;
+  daap_mem_lru_push(e);
+
+  g_daap_mem_size += len;
+  g_daap_mem_count++;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem_lck));
+}
+
+static int
+daap_mem_get(struct evbuffer *evbuf, const char *query)
+{
+  struct daap_mem_entry *e;
+  uint32_t hash;
+  int ret;
+
+  hash = djb_hash(query, strlen(query));
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem_lck));
+
+  e = daap_mem_find(query, hash);
+  if (e)
+    {
+      daap_mem_lru_unlink(e);
+      daap_mem_lru_push(e);
+
+      ret = evbuffer_add(evbuf, evbuffer_pullup(e->reply, -1), evbuffer_get_length(e->reply));
+      g_daap_stats.mem_hits++;
+    }
+  else
+    ret = -1;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem_lck));
+
+  return ret;
+}
+
+
+/* ---------------------------- DMAP RECORD CACHE -------------------------- */
+/*                                 Thread: any                               */
+
+static inline uint32_t
+dmap_rec_bucket(uint32_t id, uint32_t meta_hash)
+{
+  return ((id * 2654435761U) ^ meta_hash) % CACHE_DMAP_RECORD_BUCKETS;
+}
+
+// Must be called with the lock held
+static void
+dmap_rec_lru_unlink(struct dmap_record *r)
+{
+  if (r->lru_prev)
+    r->lru_prev->lru_next = r->lru_next;
+  else
+    g_dmap_rec_lru_head = r->lru_next;
+
+  if (r->lru_next)
+    r->lru_next->lru_prev = r->lru_prev;
+  else
+    g_dmap_rec_lru_tail = r->lru_prev;
+
+  r->lru_prev = NULL;
+  r->lru_next = NULL;
+}
+
+// Must be called with the lock held
+static void
+dmap_rec_lru_push(struct dmap_record *r)
+{
+  r->lru_next = g_dmap_rec_lru_head;
+  if (g_dmap_rec_lru_head)
+    g_dmap_rec_lru_head->lru_prev = r;
+  g_dmap_rec_lru_head = r;
+
+  if (!g_dmap_rec_lru_tail)
+    g_dmap_rec_lru_tail = r;
+}
+
+// Must be called with the lock held
+static struct dmap_record *
+dmap_rec_find(uint32_t id, uint32_t meta_hash)
+{
+  struct dmap_record *r;
+
+  for (r = g_dmap_rec_buckets[dmap_rec_bucket(id, meta_hash)]; r; r = r->bucket_next)
+    {
+      if (r->id == id && r->meta_hash == meta_hash)
+	return r;
+    }
+
+  return NULL;
+}
+
+// Must be called with the lock held
+static void
+dmap_rec_remove(struct dmap_record *r)
+{
+  struct dmap_record **p;
+
+  for (p = &g_dmap_rec_buckets[dmap_rec_bucket(r->id, r->meta_hash)]; *p; p = &(*p)->bucket_next)
+    {
+      if (*p == r)
+	{
+	  *p = r->bucket_next;
+	  break;
+	}
+    }
+
+  dmap_rec_lru_unlink(r);
+
+  g_dmap_rec_size -= sizeof(struct dmap_record) + r->len;
+  g_dmap_rec_count--;
+
+  free(r);
+}
+
+static void
+dmap_rec_clear(void)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_dmap_rec_lck));
+
+  while (g_dmap_rec_lru_head)
+    dmap_rec_remove(g_dmap_rec_lru_head);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_dmap_rec_lck));
+}
+
+int
+cache_dmap_record_get(struct dmap_writer *w, uint32_t id, uint32_t meta_hash, uint64_t stamp)
+{
+  struct dmap_record *r;
+  int ret;
+
+  if (!g_dmap_rec_max)
+    return -1;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_dmap_rec_lck));
+
+  r = dmap_rec_find(id, meta_hash);
+  if (r && r->stamp != stamp)
+    {
+      dmap_rec_remove(r);
+      r = NULL;
+    }
+
+  if (r)
+    {
+      dmap_rec_lru_unlink(r);
+      dmap_rec_lru_push(r);
+
+      dmap_writer_raw(w, r->data, r->len);
+      ret = 0;
+      g_dmap_rec_hits++;
+    }
+  else
+    {
+      ret = -1;
+      g_dmap_rec_misses++;
+    }
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_dmap_rec_lck));
+
+  return ret;
+}
+
+void
+cache_dmap_record_add(uint32_t id, uint32_t meta_hash, uint64_t stamp, const uint8_t *data, size_t len)
+{
+  struct dmap_record *r;
+  size_t size;
+
+  if (!g_dmap_rec_max)
+    return;
+
+  size = sizeof(struct dmap_record) + len;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_dmap_rec_lck));
+
+  r = dmap_rec_find(id, meta_hash);
+  if (r)
+    dmap_rec_remove(r);
+
+  while (g_dmap_rec_lru_tail && (g_dmap_rec_size + size > g_dmap_rec_max))
+    dmap_rec_remove(g_dmap_rec_lru_tail);
+
+  r = malloc(size);
+  if (!r)
+    {
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_dmap_rec_lck));
+      return;
+    }
+
+  memset(r, 0, sizeof(struct dmap_record));
+  r->id = id;
+  r->meta_hash = meta_hash;
+  r->stamp = stamp;
+  r->len = len;
+  memcpy(r->data, data, len);
+
+  r->bucket_next = g_dmap_rec_buckets[dmap_rec_bucket(id, meta_hash)];
+  g_dmap_rec_buckets[dmap_rec_bucket(id, meta_hash)] = r;
+  dmap_rec_lru_push(r);
+
+  g_dmap_rec_size += size;
+  g_dmap_rec_count++;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_dmap_rec_lck));
+}
+
+
+/* --------------------------- ARTWORK MEMORY TIER ------------------------- */
+/*                                 Thread: any                               */
+
+static void
+artwork_mem_key(char *key, size_t size, int type, int64_t persistentid, int max_w, int max_h)
+{
+  snprintf(key, size, "%d:%" PRIi64 ":%dx%d", type, persistentid, max_w, max_h);
+}
+
+// Must be called with the lock held
+static void
+artwork_mem_lru_unlink(struct artwork_mem_entry *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    g_artwork_mem_lru_head = e->lru_next;
+
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    g_artwork_mem_lru_tail = e->lru_prev;
+
+  e->lru_prev = NULL;
+  e->lru_next = NULL;
+}
+
+// Must be called with the lock held
+static void
+artwork_mem_lru_push(struct artwork_mem_entry *e)
+{
+  e->lru_next = g_artwork_mem_lru_head;
+  if (g_artwork_mem_lru_head)
+    g_artwork_mem_lru_head->lru_prev = e;
+  g_artwork_mem_lru_head = e;
+
+  if (!g_artwork_mem_lru_tail)
+    g_artwork_mem_lru_tail = e;
+}
+
+// Must be called with the lock held
+static struct artwork_mem_entry *
+artwork_mem_find(const char *key, uint32_t hash)
+{
+  struct artwork_mem_entry *e;
+
+  for (e = g_artwork_mem_buckets[hash % CACHE_ARTWORK_MEM_BUCKETS]; e; e = e->bucket_next)
+    {
+      if (e->hash == hash && strcmp(e->key, key) == 0)
+	return e;
+    }
+
+  return NULL;
+}
+
+// Must be called with the lock held
+static void
+artwork_mem_remove(struct artwork_mem_entry *e)
+{
+  struct artwork_mem_entry **p;
+
+  for (p = &g_artwork_mem_buckets[e->hash % CACHE_ARTWORK_MEM_BUCKETS]; *p; p = &(*p)->bucket_next)
+    {
+      if (*p == e)
+	{
+	  *p = e->bucket_next;
+	  break;
+	}
+    }
+
+  artwork_mem_lru_unlink(e);
+
+  g_artwork_mem_size -= e->len;
+  g_artwork_mem_count--;
+
+  free(e->key);
+  free(e);
+}
+
+static void
+artwork_mem_clear(void)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_artwork_mem_lck));
+
+  while (g_artwork_mem_lru_head)
+    artwork_mem_remove(g_artwork_mem_lru_head);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_artwork_mem_lck));
+}
+
+/* Adds an image, evicting the least recently used if we get above the size
+ * limit. The data is copied.
+ */
+static void
+artwork_mem_add(const char *key, bool stashed, int format, struct evbuffer *evbuf)
+{
+  struct artwork_mem_entry *e;
+  uint32_t hash;
+  size_t len;
+
+  len = evbuffer_get_length(evbuf);
+
+  // A single image may not push out everything else
+  if (len > g_artwork_mem_max / 4)
+    return;
+
+  hash = djb_hash(key, strlen(key));
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_artwork_mem_lck));
+
+  e = artwork_mem_find(key, hash);
+  if (e)
+    artwork_mem_remove(e);
+
+  while (g_artwork_mem_lru_tail && (g_artwork_mem_size + len > g_artwork_mem_max))
+    artwork_mem_remove(g_artwork_mem_lru_tail);
+
+  CHECK_NULL(L_CACHE, e = calloc(1, sizeof(struct artwork_mem_entry) + len));
+  CHECK_NULL(L_CACHE, e->key = strdup(key));
+  e->hash = hash;
+  e->format = format;
+  e->gen = __atomic_load_n(&g_artwork_gen, __ATOMIC_ACQUIRE);
+  e->stashed = stashed;
+  e->len = len;
+  evbuffer_copyout(evbuf, e->data, len);
+
+  e->bucket_next = g_artwork_mem_buckets[hash % CACHE_ARTWORK_MEM_BUCKETS];
+  g_artwork_mem_buckets[hash % CACHE_ARTWORK_MEM_BUCKETS] = e;
+  artwork_mem_lru_push(e);
+
+  g_artwork_mem_size += len;
+  g_artwork_mem_count++;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_artwork_mem_lck));
+}
+
+// Returns 0 and adds the image to evbuf if found, otherwise -1
+static int
+artwork_mem_get(struct evbuffer *evbuf, int *format, const char *key)
+{
+  struct artwork_mem_entry *e;
+  uint32_t hash;
+  int ret;
+
+  if (g_artwork_mem_max == 0)
+    return -1;
+
+  hash = djb_hash(key, strlen(key));
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_artwork_mem_lck));
+
+  e = artwork_mem_find(key, hash);
+
+  // Artwork was removed from the cache since, so this may be outdated
+  if (e && !e->stashed && e->gen != __atomic_load_n(&g_artwork_gen, __ATOMIC_ACQUIRE))
+    {
+      artwork_mem_remove(e);
+      e = NULL;
+    }
+
+  if (!e)
+    {
+      g_artwork_mem_misses++;
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_artwork_mem_lck));
+      return -1;
+    }
+
+  artwork_mem_lru_unlink(e);
+  artwork_mem_lru_push(e);
+  g_artwork_mem_hits++;
+
+  *format = e->format;
+  ret = evbuffer_add(evbuf, e->data, e->len);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_artwork_mem_lck));
+
+  return ret;
+}
+
+
 /* --------------------------------- MAIN --------------------------------- */
 /*                              Thread: cache                              */
 
@@ -142,7 +801,9 @@ cache_create_tables(void)
   "   user_agent         VARCHAR(1024),"			\
   "   is_remote          INTEGER DEFAULT 0,"			\
   "   msec               INTEGER DEFAULT 0,"			\
-  "   timestamp          INTEGER DEFAULT 0"			\
+  "   timestamp          INTEGER DEFAULT 0,"			\
+  "   hits               INTEGER DEFAULT 0,"			\
+  "   last_use           INTEGER DEFAULT 0"			\
   ");"
 #define I_QUERY							\
   "CREATE INDEX IF NOT EXISTS idx_query ON replies (query);"
@@ -162,6 +823,13 @@ cache_create_tables(void)
   "CREATE INDEX IF NOT EXISTS idx_persistentidwh ON artwork(type, persistentid, max_w, max_h);"
 #define I_ARTWORK_PATH				\
   "CREATE INDEX IF NOT EXISTS idx_pathtime ON artwork(filepath, db_timestamp);"
+#define T_SEEKINDEX					\
+  "CREATE TABLE IF NOT EXISTS seekindex ("		\
+  "   id                  INTEGER PRIMARY KEY NOT NULL,"\
+  "   filepath            VARCHAR(4096) UNIQUE NOT NULL,"\
+  "   mtime               INTEGER DEFAULT 0,"		\
+  "   data                BLOB"				\
+  ");"
 #define T_ADMIN_CACHE	\
   "CREATE TABLE IF NOT EXISTS admin_cache("	\
   " key VARCHAR(32) PRIMARY KEY NOT NULL,"	\
@@ -239,6 +907,17 @@ cache_create_tables(void)
       return -1;
     }
 
+  // Create seek index table
+  ret = sqlite3_exec(g_db_hdl, T_SEEKINDEX, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_CACHE, "Error creating cache table 'seekindex': %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_close(g_db_hdl);
+      return -1;
+    }
+
   // Create admin cache table
   ret = sqlite3_exec(g_db_hdl, T_ADMIN_CACHE, NULL, NULL, &errmsg);
   if (ret != SQLITE_OK)
@@ -271,6 +950,7 @@ cache_create_tables(void)
 #undef T_ARTWORK
 #undef I_ARTWORK_ID
 #undef I_ARTWORK_PATH
+#undef T_SEEKINDEX
 #undef T_ADMIN_CACHE
 #undef Q_CACHE_VERSION
 }
@@ -284,6 +964,7 @@ cache_drop_tables(void)
 #define D_ARTWORK	"DROP TABLE IF EXISTS artwork;"
 #define D_ARTWORK_ID	"DROP INDEX IF EXISTS idx_persistentidwh;"
 #define D_ARTWORK_PATH	"DROP INDEX IF EXISTS idx_pathtime;"
+#define D_SEEKINDEX	"DROP TABLE IF EXISTS seekindex;"
 #define D_ADMIN_CACHE	"DROP TABLE IF EXISTS admin_cache;"
 #define Q_VACUUM	"VACUUM;"
 
@@ -355,6 +1036,17 @@ cache_drop_tables(void)
       return -1;
     }
 
+  // Drop seek index table
+  ret = sqlite3_exec(g_db_hdl, D_SEEKINDEX, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_CACHE, "Error dropping seek index table: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_close(g_db_hdl);
+      return -1;
+    }
+
   // Drop admin cache table
   ret = sqlite3_exec(g_db_hdl, D_ADMIN_CACHE, NULL, NULL, &errmsg);
   if (ret != SQLITE_OK)
@@ -386,6 +1078,7 @@ cache_drop_tables(void)
 #undef D_ARTWORK
 #undef D_ARTWORK_ID
 #undef D_ARTWORK_PATH
+#undef D_SEEKINDEX
 #undef D_ADMIN_CACHE
 #undef Q_VACUUM
 }
@@ -502,21 +1195,22 @@ cache_create(void)
 	}
     }
 
-  // Set journal mode
+  // Set journal mode, with WAL as default so that the batched artwork writes
+  // don't block readers
   journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
-  if (journal_mode)
+  if (!journal_mode)
+    journal_mode = "WAL";
+
+  query = sqlite3_mprintf(Q_PRAGMA_JOURNAL_MODE, journal_mode);
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
     {
-      query = sqlite3_mprintf(Q_PRAGMA_JOURNAL_MODE, journal_mode);
-      ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
-      sqlite3_free(query);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error setting pragma_journal_mode: %s\n", errmsg);
+      DPRINTF(E_LOG, L_CACHE, "Error setting pragma_journal_mode: %s\n", errmsg);
 
-	  sqlite3_free(errmsg);
-	  sqlite3_close(g_db_hdl);
-	  return -1;
-	}
+      sqlite3_free(errmsg);
+      sqlite3_close(g_db_hdl);
+      return -1;
     }
 
   // Set synchronous flag
@@ -583,6 +1277,7 @@ static int
 cache_daap_reply_add(const char *query, struct evbuffer *evbuf)
 {
 #define Q_TMPL "INSERT INTO replies (query, reply) VALUES (?, ?);"
+#define Q_DEL "DELETE FROM replies WHERE query = ?;"
   sqlite3_stmt *stmt;
   unsigned char *data;
   size_t datalen;
@@ -591,45 +1286,144 @@ cache_daap_reply_add(const char *query, struct evbuffer *evbuf)
   datalen = evbuffer_get_length(evbuf);
   data = evbuffer_pullup(evbuf, -1);
 
-  ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
-  if (ret != SQLITE_OK)
+  // Replies are rebuilt one by one, so there may be an old one
+  ret = sqlite3_prepare_v2(g_db_hdl, Q_DEL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
+      return -1;
+    }
+
+  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+
+  ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
+      return -1;
+    }
+
+  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, data, datalen, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error finalizing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
+      return -1;
+    }
+
+  //DPRINTF(E_DBG, L_CACHE, "Wrote cache reply, size %d\n", datalen);
+
+  return 0;
+#undef Q_DEL
+#undef Q_TMPL
+}
+
+static void
+daap_regen_free(struct daap_regen *r)
+{
+  free(r->query);
+  free(r->ua);
+  free(r);
+}
+
+static void
+daap_regen_clear(void)
+{
+  struct daap_regen *r;
+
+  while ((r = g_daap_regen_head))
+    {
+      g_daap_regen_head = r->next;
+      daap_regen_free(r);
+    }
+}
+
+// Takes the query out of the list, so it can be put back somewhere else
+static struct daap_regen *
+daap_regen_take(const char *query)
+{
+  struct daap_regen **p;
+  struct daap_regen *r;
+
+  for (p = &g_daap_regen_head; *p; p = &(*p)->next)
+    {
+      if (strcmp((*p)->query, query) == 0)
+	{
+	  r = *p;
+	  *p = r->next;
+	  r->next = NULL;
+	  return r;
+	}
+    }
+
+  return NULL;
+}
+
+static struct daap_regen *
+daap_regen_new(int id, const char *query, const char *ua, int is_remote)
+{
+  struct daap_regen *r;
+
+  CHECK_NULL(L_CACHE, r = calloc(1, sizeof(struct daap_regen)));
+  CHECK_NULL(L_CACHE, r->query = strdup(query));
+  r->ua = safe_strdup(ua);
+  r->id = id;
+  r->is_remote = is_remote;
+
+  return r;
+}
+
+static void
+daap_regen_push(struct daap_regen *r, bool first)
+{
+  struct daap_regen **p;
+
+  if (first)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      return -1;
+      r->next = g_daap_regen_head;
+      g_daap_regen_head = r;
+      return;
     }
 
-  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
-  sqlite3_bind_blob(stmt, 2, data, datalen, SQLITE_STATIC);
+  for (p = &g_daap_regen_head; *p; p = &(*p)->next)
+    ;
 
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_DONE)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error stepping query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      sqlite3_finalize(stmt);
-      return -1;
-    }
+  r->next = NULL;
+  *p = r;
+}
 
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error finalizing query for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      return -1;
-    }
+// Starts rebuilding after the delay, unless it is already going on
+static void
+daap_regen_schedule(int delay_secs)
+{
+  struct timeval delay = { delay_secs, 0 };
 
-  //DPRINTF(E_DBG, L_CACHE, "Wrote cache reply, size %d\n", datalen);
+  if (evtimer_pending(cache_daap_regenev, NULL))
+    return;
 
-  return 0;
-#undef Q_TMPL
+  evtimer_add(cache_daap_regenev, &delay);
 }
 
 /* Adds the query to the list of queries for which we will build and cache a reply */
 static enum command_state
 cache_daap_query_add(void *arg, int *retval)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, is_remote, query, msec, timestamp) VALUES ('%q', %d, '%q', %d, %" PRIi64 ");"
-#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY timestamp DESC LIMIT 20);"
+#define Q_TMPL "INSERT OR REPLACE INTO queries (user_agent, is_remote, query, msec, timestamp, hits, last_use) VALUES ('%q', %d, '%q', %d, %" PRIi64 ", COALESCE((SELECT hits FROM queries WHERE query = '%q'), 0), %" PRIi64 ");"
+#define Q_CLEANUP "DELETE FROM queries WHERE id NOT IN (SELECT id FROM queries ORDER BY last_use DESC LIMIT 20);"
   struct cache_arg *cmdarg;
-  struct timeval delay = { 60, 0 };
+  struct daap_regen *r;
   char *query;
   char *errmsg;
   int ret;
@@ -652,7 +1446,7 @@ cache_daap_query_add(void *arg, int *retval)
   remove_tag(cmdarg->query, "session-id");
   remove_tag(cmdarg->query, "revision-number");
 
-  query = sqlite3_mprintf(Q_TMPL, cmdarg->ua, cmdarg->is_remote, cmdarg->query, cmdarg->msec, (int64_t)time(NULL));
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->ua, cmdarg->is_remote, cmdarg->query, cmdarg->msec, (int64_t)time(NULL), cmdarg->query, (int64_t)time(NULL));
   if (!query)
     {
       DPRINTF(E_LOG, L_CACHE, "Out of memory making query string.\n");
@@ -672,6 +1466,13 @@ cache_daap_query_add(void *arg, int *retval)
 
   DPRINTF(E_INFO, L_CACHE, "Slow query (%d ms) added to cache: '%s' (user-agent: '%s')\n", cmdarg->msec, cmdarg->query, cmdarg->ua);
 
+  // Only this query needs building, the other replies are still valid
+  r = daap_regen_take(cmdarg->query);
+  if (r)
+    daap_regen_free(r);
+
+  daap_regen_push(daap_regen_new(sqlite3_last_insert_rowid(g_db_hdl), cmdarg->query, cmdarg->ua, cmdarg->is_remote), false);
+
   free(cmdarg->ua);
   free(cmdarg->query);
 
@@ -687,7 +1488,7 @@ cache_daap_query_add(void *arg, int *retval)
 
   // Will set of cache regeneration after waiting a bit (so there is less risk
   // of disturbing the user)
-  evtimer_add(cache_daap_updateev, &delay);
+  daap_regen_schedule(60);
 
   *retval = 0;
   return COMMAND_END;
@@ -801,17 +1602,169 @@ cache_daap_query_delete(const int id)
 #undef Q_TMPL
 }
 
+/* Counts a hit of a cached reply, or moves a missing one to the front of the
+ * rebuild list. A query that was left out of the rebuild because it was cold
+ * is put back in the list this way, the first time a client asks for it.
+ */
+static enum command_state
+cache_daap_query_used(void *arg, int *retval)
+{
+#define Q_HIT "UPDATE queries SET hits = hits + 1, last_use = %" PRIi64 " WHERE query = '%q';"
+#define Q_FIND "SELECT id, user_agent, is_remote FROM queries WHERE query = ?;"
+  struct cache_arg *cmdarg;
+  struct daap_regen *r;
+  sqlite3_stmt *stmt;
+  char *query;
+  char *errmsg;
+  int ret;
+
+  cmdarg = arg;
+
+  if (cmdarg->cached)
+    {
+      query = sqlite3_mprintf(Q_HIT, (int64_t)time(NULL), cmdarg->query);
+      if (!query)
+	goto out;
+
+      ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error counting cache hit: %s\n", errmsg);
+	  sqlite3_free(errmsg);
+	}
+
+      goto out;
+    }
+
+  r = daap_regen_take(cmdarg->query);
+  if (!r)
+    {
+      ret = sqlite3_prepare_v2(g_db_hdl, Q_FIND, -1, &stmt, 0);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Error preparing query for cache lookup: %s\n", sqlite3_errmsg(g_db_hdl));
+	  goto out;
+	}
+
+      sqlite3_bind_text(stmt, 1, cmdarg->query, -1, SQLITE_STATIC);
+
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+	r = daap_regen_new(sqlite3_column_int(stmt, 0), cmdarg->query, (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
+
+      sqlite3_finalize(stmt);
+    }
+
+  if (r)
+    {
+      DPRINTF(E_DBG, L_CACHE, "Cache miss for known query, rebuilding it first: %s\n", cmdarg->query);
+
+      daap_regen_push(r, true);
+      daap_regen_schedule(0);
+    }
+
+ out:
+  free(cmdarg->query);
+
+  *retval = 0;
+  return COMMAND_END;
+#undef Q_FIND
+#undef Q_HIT
+}
+
 /* Here we actually update the cache by asking httpd_daap for responses
- * to the queries set for caching
+ * to the queries set for caching. One reply is built per call, then the next
+ * call is scheduled with a pause in between, so that the cache thread keeps
+ * serving replies and artwork while a large library is being rebuilt.
  */
 static void
-cache_daap_update_cb(int fd, short what, void *arg)
+cache_daap_regen_cb(int fd, short what, void *arg)
 {
-  sqlite3_stmt *stmt;
+  struct daap_regen *r;
   struct evbuffer *evbuf;
   struct evbuffer *gzbuf;
+  struct timeval delay;
+  struct timespec start;
+  struct timespec end;
+  int msec;
+
+  if (g_suspended)
+    {
+      DPRINTF(E_DBG, L_CACHE, "Postponing DAAP cache rebuild while suspended\n");
+      daap_regen_schedule(10);
+      return;
+    }
+
+  r = g_daap_regen_head;
+  if (!r)
+    return;
+
+  g_daap_regen_head = r->next;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  evbuf = daap_reply_build(r->query, r->ua, r->is_remote);
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", r->query);
+      cache_daap_query_delete(r->id);
+      goto next;
+    }
+
+  gzbuf = httpd_gzip_deflate(evbuf);
+  evbuffer_free(evbuf);
+  if (!gzbuf)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", r->query);
+      cache_daap_query_delete(r->id);
+      goto next;
+    }
+
+  cache_daap_reply_add(r->query, gzbuf);
+
+  if (g_daap_mem_max)
+    daap_mem_add(r->query, evbuffer_pullup(gzbuf, -1), evbuffer_get_length(gzbuf));
+
+  evbuffer_free(gzbuf);
+
+  g_daap_regen_done++;
+
+ next:
+  daap_regen_free(r);
+
+  if (!g_daap_regen_head)
+    {
+      DPRINTF(E_LOG, L_CACHE, "DAAP cache updated, %d replies rebuilt\n", g_daap_regen_done);
+      g_daap_regen_done = 0;
+      return;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  msec = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+  if (msec < CACHE_DAAP_REGEN_GAP_MSEC)
+    msec = CACHE_DAAP_REGEN_GAP_MSEC;
+
+  delay.tv_sec = msec / 1000;
+  delay.tv_usec = (msec % 1000) * 1000;
+  evtimer_add(cache_daap_regenev, &delay);
+}
+
+/* After a library change all replies may be outdated, so they are deleted and
+ * the queries are lined up for rebuilding, the most used first. Hits are
+ * halved each time, so that queries that were popular long ago give way.
+ */
+static void
+cache_daap_update_cb(int fd, short what, void *arg)
+{
+#define Q_QUERIES "SELECT id, user_agent, is_remote, query, last_use FROM queries ORDER BY hits DESC, last_use DESC;"
+#define Q_DECAY "UPDATE queries SET hits = hits / 2;"
+  struct daap_regen *tail;
+  struct daap_regen *r;
+  sqlite3_stmt *stmt;
   char *errmsg;
-  char *query;
+  int64_t cold;
+  int nqueries;
+  int ncold;
   int ret;
 
   if (g_suspended)
@@ -830,44 +1783,37 @@ cache_daap_update_cb(int fd, short what, void *arg)
       return;
     }
 
-  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT id, user_agent, is_remote, query FROM queries;", -1, &stmt, 0);
+  daap_mem_clear();
+  daap_regen_clear();
+  g_daap_regen_done = 0;
+
+  ret = sqlite3_prepare_v2(g_db_hdl, Q_QUERIES, -1, &stmt, 0);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
       return;
     }
 
+  cold = (int64_t)time(NULL) - CACHE_DAAP_COLD_SECS;
+  nqueries = 0;
+  ncold = 0;
+  tail = NULL;
   while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-      query = strdup((char *)sqlite3_column_text(stmt, 3));
-
-      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
-      if (!evbuf)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
-	  free(query);
-
-	  continue;
-	}
-
-      gzbuf = httpd_gzip_deflate(evbuf);
-      if (!gzbuf)
+      if (sqlite3_column_int64(stmt, 4) < cold)
 	{
-	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
-	  free(query);
-	  evbuffer_free(evbuf);
-
+	  ncold++;
 	  continue;
 	}
 
-      evbuffer_free(evbuf);
-
-      cache_daap_reply_add(query, gzbuf);
+      r = daap_regen_new(sqlite3_column_int(stmt, 0), (char *)sqlite3_column_text(stmt, 3), (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
+      if (tail)
+	tail->next = r;
+      else
+	g_daap_regen_head = r;
+      tail = r;
 
-      free(query);
-      evbuffer_free(gzbuf);
+      nqueries++;
     }
 
   if (ret != SQLITE_DONE)
@@ -875,28 +1821,204 @@ cache_daap_update_cb(int fd, short what, void *arg)
 
   sqlite3_finalize(stmt);
 
-  DPRINTF(E_LOG, L_CACHE, "DAAP cache updated\n");
+  ret = sqlite3_exec(g_db_hdl, Q_DECAY, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error decaying cache hit counts: %s\n", errmsg);
+      sqlite3_free(errmsg);
+    }
+
+  DPRINTF(E_INFO, L_CACHE, "Rebuilding %d DAAP replies, %d unused ones are rebuilt when requested\n", nqueries, ncold);
+
+  if (g_daap_regen_head)
+    {
+      evtimer_del(cache_daap_regenev);
+      daap_regen_schedule(0);
+    }
+#undef Q_DECAY
+#undef Q_QUERIES
 }
 
 /* Sets off an update by activating the event. The delay is because we are low
  * priority compared to other listeners of database updates.
+ *
+ * Thread: cache (delivered by the listener on evbase_cache)
  */
-static enum command_state
-cache_daap_update(void *arg, int *retval)
+static void
+cache_daap_listener_cb(short event_mask)
 {
   struct timeval delay = { 10, 0 };
 
-  *retval = event_add(cache_daap_updateev, &delay);
-  return COMMAND_END;
+  event_add(cache_daap_updateev, &delay);
+}
+
+
+static int
+artwork_ping_write(const char *path, time_t stamp, time_t mtime)
+{
+#define Q_TMPL_PING "UPDATE artwork SET db_timestamp = %" PRIi64 " WHERE filepath = '%q' AND db_timestamp >= %" PRIi64 ";"
+  char *query;
+  char *errmsg;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL_PING, (int64_t)stamp, path, (int64_t)mtime);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+#undef Q_TMPL_PING
+}
+
+static int
+artwork_add_write(sqlite3_stmt *stmt, struct artwork_pending *p)
+{
+  int ret;
+
+  sqlite3_bind_int64(stmt, 1, p->persistentid);
+  sqlite3_bind_int(stmt, 2, p->max_w);
+  sqlite3_bind_int(stmt, 3, p->max_h);
+  sqlite3_bind_int(stmt, 4, p->format);
+  sqlite3_bind_text(stmt, 5, p->path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 6, (int64_t)p->stamp);
+  sqlite3_bind_blob(stmt, 7, evbuffer_pullup(p->evbuf, -1), evbuffer_get_length(p->evbuf), SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 8, p->type);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error stepping query for artwork add: %s\n", sqlite3_errmsg(g_db_hdl));
+      sqlite3_reset(stmt);
+      return -1;
+    }
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  return 0;
 }
 
-/* Callback from filescanner thread */
 static void
-cache_daap_listener_cb(short event_mask)
+artwork_pending_free(struct artwork_pending *p)
+{
+  if (p->evbuf)
+    evbuffer_free(p->evbuf);
+  free(p->path);
+  free(p);
+}
+
+/*
+ * Writes the queued artwork adds and pings in a single transaction, in the
+ * order they were made. Must be called before anything that reads or deletes
+ * from the artwork table and can't be answered from the queue.
+ */
+static void
+cache_artwork_flush(void)
+{
+  struct artwork_pending *p;
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int count;
+  int ret;
+
+  if (!g_artwork_pending_head)
+    return;
+
+  evtimer_del(cache_artwork_flushev);
+
+  ret = sqlite3_exec(g_db_hdl, "BEGIN TRANSACTION;", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not begin artwork transaction: %s\n", errmsg);
+      sqlite3_free(errmsg);
+    }
+
+  ret = sqlite3_prepare_v2(g_db_hdl, "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, data, type) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?);", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      stmt = NULL;
+    }
+
+  count = g_artwork_pending_count;
+  while ((p = g_artwork_pending_head))
+    {
+      g_artwork_pending_head = p->next;
+
+      if (!p->evbuf)
+	artwork_ping_write(p->path, p->stamp, p->mtime);
+      else if (stmt)
+	artwork_add_write(stmt, p);
+
+      artwork_pending_free(p);
+    }
+
+  g_artwork_pending_tail = NULL;
+  g_artwork_pending_count = 0;
+  g_artwork_pending_size = 0;
+
+  sqlite3_finalize(stmt);
+
+  ret = sqlite3_exec(g_db_hdl, "COMMIT TRANSACTION;", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not commit artwork transaction: %s\n", errmsg);
+      sqlite3_free(errmsg);
+    }
+
+  DPRINTF(E_DBG, L_CACHE, "Wrote %d queued artwork cache changes\n", count);
+}
+
+static void
+cache_artwork_flush_cb(int fd, short what, void *arg)
+{
+  cache_artwork_flush();
+}
+
+static void
+artwork_pending_add(struct artwork_pending *p)
 {
-  commands_exec_async(cmdbase, cache_daap_update, NULL);
+  if (g_artwork_pending_tail)
+    g_artwork_pending_tail->next = p;
+  else
+    g_artwork_pending_head = p;
+  g_artwork_pending_tail = p;
+
+  g_artwork_pending_count++;
+  if (p->evbuf)
+    g_artwork_pending_size += evbuffer_get_length(p->evbuf);
+
+  if (g_artwork_pending_count >= CACHE_ARTWORK_PENDING_MAX || g_artwork_pending_size >= CACHE_ARTWORK_PENDING_SIZE)
+    cache_artwork_flush();
+  else if (!evtimer_pending(cache_artwork_flushev, NULL))
+    evtimer_add(cache_artwork_flushev, &cache_artwork_flush_tv);
 }
 
+// Returns the most recent queued add for the artwork, if any
+static struct artwork_pending *
+artwork_pending_find(int type, int64_t persistentid, int max_w, int max_h)
+{
+  struct artwork_pending *p;
+  struct artwork_pending *found;
+
+  found = NULL;
+  for (p = g_artwork_pending_head; p; p = p->next)
+    {
+      if (p->evbuf && p->type == type && p->persistentid == persistentid && p->max_w == max_w && p->max_h == max_h)
+	found = p;
+    }
+
+  return found;
+}
 
 /*
  * Updates cached timestamps to current time for all cache entries for the given path, if the file was not modfied
@@ -910,57 +2032,72 @@ cache_daap_listener_cb(short event_mask)
 static enum command_state
 cache_artwork_ping_impl(void *arg, int *retval)
 {
-#define Q_TMPL_PING "UPDATE artwork SET db_timestamp = %" PRIi64 " WHERE filepath = '%q' AND db_timestamp >= %" PRIi64 ";"
 #define Q_TMPL_DEL "DELETE FROM artwork WHERE filepath = '%q' AND db_timestamp < %" PRIi64 ";"
 
   struct cache_arg *cmdarg;
+  struct artwork_pending *p;
   char *query;
   char *errmsg;
   int ret;
 
   cmdarg = arg;
-  query = sqlite3_mprintf(Q_TMPL_PING, (int64_t)time(NULL), cmdarg->path, (int64_t)cmdarg->mtime);
 
-  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
-
-  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
+  if (cmdarg->del <= 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+      p = calloc(1, sizeof(struct artwork_pending));
+      if (!p)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork ping\n");
+	  free(cmdarg->path);
+	  *retval = -1;
+	  return COMMAND_END;
+	}
 
-      goto error_ping;
+      p->path = cmdarg->path;
+      p->mtime = cmdarg->mtime;
+      p->stamp = time(NULL);
+
+      artwork_pending_add(p);
+
+      *retval = 0;
+      return COMMAND_END;
     }
 
-  if (cmdarg->del > 0)
+  // The delete must also apply to the queued adds
+  cache_artwork_flush();
+
+  ret = artwork_ping_write(cmdarg->path, time(NULL), cmdarg->mtime);
+  if (ret < 0)
     {
-      query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->path, (int64_t)cmdarg->mtime);
+      free(cmdarg->path);
+      *retval = -1;
+      return COMMAND_END;
+    }
 
-      DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+  query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->path, (int64_t)cmdarg->mtime);
 
-      ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
-      sqlite3_free(query);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
 
-	  goto error_ping;
-	}
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      free(cmdarg->path);
+      *retval = -1;
+      return COMMAND_END;
     }
 
+  if (sqlite3_changes(g_db_hdl) > 0)
+    __atomic_add_fetch(&g_artwork_gen, 1, __ATOMIC_RELEASE);
+
   free(cmdarg->path);
 
   *retval = 0;
   return COMMAND_END;
 
- error_ping:
-  sqlite3_free(errmsg);
-  free(cmdarg->path);
-
-  *retval = -1;
-  return COMMAND_END;
-  
-#undef Q_TMPL_PING
 #undef Q_TMPL_DEL
 }
 
@@ -981,6 +2118,9 @@ cache_artwork_delete_by_path_impl(void *arg, int *retval)
   int ret;
 
   cmdarg = arg;
+
+  cache_artwork_flush();
+
   query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->path);
 
   DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
@@ -998,6 +2138,9 @@ cache_artwork_delete_by_path_impl(void *arg, int *retval)
 
   DPRINTF(E_DBG, L_CACHE, "Deleted %d rows\n", sqlite3_changes(g_db_hdl));
 
+  if (sqlite3_changes(g_db_hdl) > 0)
+    __atomic_add_fetch(&g_artwork_gen, 1, __ATOMIC_RELEASE);
+
   *retval = 0;
   return COMMAND_END;
 
@@ -1021,6 +2164,9 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
   int ret;
 
   cmdarg = arg;
+
+  cache_artwork_flush();
+
   query = sqlite3_mprintf(Q_TMPL, (int64_t)cmdarg->mtime);
 
   DPRINTF(E_DBG, L_CACHE, "Running purge query '%s'\n", query);
@@ -1038,6 +2184,9 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
 
   DPRINTF(E_DBG, L_CACHE, "Purged %d rows\n", sqlite3_changes(g_db_hdl));
 
+  if (sqlite3_changes(g_db_hdl) > 0)
+    __atomic_add_fetch(&g_artwork_gen, 1, __ATOMIC_RELEASE);
+
   *retval = 0;
   return COMMAND_END;
 
@@ -1045,7 +2194,8 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
 }
 
 /*
- * Adds the given (scaled) artwork image to the artwork cache
+ * Queues the given (scaled) artwork image for writing to the artwork cache,
+ * see cache_artwork_flush()
  *
  * @param cmdarg->persistentid persistent songalbumid or songartistid
  * @param cmdarg->max_w maximum image width
@@ -1059,51 +2209,30 @@ static enum command_state
 cache_artwork_add_impl(void *arg, int *retval)
 {
   struct cache_arg *cmdarg;
-  sqlite3_stmt *stmt;
-  char *query;
-  uint8_t *data;
-  int datalen;
-  int ret;
+  struct artwork_pending *p;
 
   cmdarg = arg;
-  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, data, type) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?);";
 
-  ret = sqlite3_prepare_v2(g_db_hdl, query, -1, &stmt, 0);
-  if (ret != SQLITE_OK)
+  p = calloc(1, sizeof(struct artwork_pending));
+  if (!p)
     {
-      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork add\n");
+      evbuffer_free(cmdarg->evbuf);
+      free(cmdarg->path);
       *retval = -1;
       return COMMAND_END;
     }
 
-  datalen = evbuffer_get_length(cmdarg->evbuf);
-  data = evbuffer_pullup(cmdarg->evbuf, -1);
-
-  sqlite3_bind_int64(stmt, 1, cmdarg->persistentid);
-  sqlite3_bind_int(stmt, 2, cmdarg->max_w);
-  sqlite3_bind_int(stmt, 3, cmdarg->max_h);
-  sqlite3_bind_int(stmt, 4, cmdarg->format);
-  sqlite3_bind_text(stmt, 5, cmdarg->path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 6, (uint64_t)time(NULL));
-  sqlite3_bind_blob(stmt, 7, data, datalen, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 8, cmdarg->type);
-
-  ret = sqlite3_step(stmt);
-  if (ret != SQLITE_DONE)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error stepping query for artwork add: %s\n", sqlite3_errmsg(g_db_hdl));
-      sqlite3_finalize(stmt);
-      *retval = -1;
-      return COMMAND_END;
-    }
+  p->evbuf = cmdarg->evbuf;
+  p->path = cmdarg->path;
+  p->type = cmdarg->type;
+  p->persistentid = cmdarg->persistentid;
+  p->max_w = cmdarg->max_w;
+  p->max_h = cmdarg->max_h;
+  p->format = cmdarg->format;
+  p->stamp = time(NULL);
 
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error finalizing query for artwork add: %s\n", sqlite3_errmsg(g_db_hdl));
-      *retval = -1;
-      return COMMAND_END;
-    }
+  artwork_pending_add(p);
 
   *retval = 0;
   return COMMAND_END;
@@ -1129,12 +2258,34 @@ cache_artwork_get_impl(void *arg, int *retval)
 {
 #define Q_TMPL "SELECT a.format, a.data FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d;"
   struct cache_arg *cmdarg;
+  struct artwork_pending *p;
   sqlite3_stmt *stmt;
   char *query;
   int datalen;
   int ret;
 
   cmdarg = arg;
+
+  // Not written to the db yet
+  p = artwork_pending_find(cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h);
+  if (p)
+    {
+      cmdarg->format = p->format;
+      cmdarg->cached = 1;
+
+      ret = evbuffer_add(cmdarg->evbuf, evbuffer_pullup(p->evbuf, -1), evbuffer_get_length(p->evbuf));
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork evbuffer\n");
+	  cmdarg->cached = 0;
+	  *retval = -1;
+	  return COMMAND_END;
+	}
+
+      *retval = 0;
+      return COMMAND_END;
+    }
+
   query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h);
   if (!query)
     {
@@ -1211,65 +2362,125 @@ cache_artwork_get_impl(void *arg, int *retval)
 #undef Q_TMPL
 }
 
+/*
+ * Adds (or replaces) the seek index for the given media file
+ *
+ * @param cmdarg->path the full path to the media file
+ * @param cmdarg->mtime modified timestamp of the media file
+ * @param cmdarg->evbuf event buffer with the seek index, freed by this function
+ * @return 0 if successful, -1 if an error occurred
+ */
 static enum command_state
-cache_artwork_stash_impl(void *arg, int *retval)
+cache_seekindex_add_impl(void *arg, int *retval)
 {
   struct cache_arg *cmdarg;
+  sqlite3_stmt *stmt;
+  char *query;
+  uint8_t *data;
+  int datalen;
+  int ret;
 
   cmdarg = arg;
+  query = "INSERT OR REPLACE INTO seekindex (id, filepath, mtime, data) VALUES (NULL, ?, ?, ?);";
 
-  /* Clear current stash */
-  if (g_stash.path)
+  ret = sqlite3_prepare_v2(g_db_hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
     {
-      free(g_stash.path);
-      free(g_stash.data);
-      memset(&g_stash, 0, sizeof(struct stash));
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      ret = -1;
+      goto out;
     }
 
-  g_stash.size = evbuffer_get_length(cmdarg->evbuf);
-  g_stash.data = malloc(g_stash.size);
-  if (!g_stash.data)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork stash data\n");
-      *retval = -1;
-      return COMMAND_END;
-    }
+  datalen = evbuffer_get_length(cmdarg->evbuf);
+  data = evbuffer_pullup(cmdarg->evbuf, -1);
 
-  g_stash.path = strdup(cmdarg->path);
-  if (!g_stash.path)
+  sqlite3_bind_text(stmt, 1, cmdarg->path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, (int64_t)cmdarg->mtime);
+  sqlite3_bind_blob(stmt, 3, data, datalen, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork stash path\n");
-      free(g_stash.data);
-      *retval = -1;
-      return COMMAND_END;
+      DPRINTF(E_LOG, L_CACHE, "Error stepping query for seek index add: %s\n", sqlite3_errmsg(g_db_hdl));
+      sqlite3_finalize(stmt);
+      ret = -1;
+      goto out;
     }
 
-  g_stash.format = cmdarg->format;
+  sqlite3_finalize(stmt);
+
+  DPRINTF(E_DBG, L_CACHE, "Stored seek index (%d bytes) for '%s'\n", datalen, cmdarg->path);
+
+  ret = 0;
+
+ out:
+  evbuffer_free(cmdarg->evbuf);
+  free(cmdarg->path);
 
-  *retval = evbuffer_copyout(cmdarg->evbuf, g_stash.data, g_stash.size);
+  *retval = ret;
   return COMMAND_END;
 }
 
+/*
+ * Get the seek index for the given media file, if it exists and is not older
+ * than the file
+ *
+ * @param cmdarg->path the full path to the media file
+ * @param cmdarg->mtime modified timestamp of the media file
+ * @param cmdarg->cached set by this function to 0 if no cache entry exists, otherwise 1
+ * @param cmdarg->evbuf event buffer filled by this function with the seek index
+ * @return 0 if successful, -1 if an error occurred
+ */
 static enum command_state
-cache_artwork_read_impl(void *arg, int *retval)
+cache_seekindex_get_impl(void *arg, int *retval)
 {
+#define Q_TMPL "SELECT s.data FROM seekindex s WHERE s.filepath = '%q' AND s.mtime = %" PRIi64 ";"
   struct cache_arg *cmdarg;
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
 
   cmdarg = arg;
-  cmdarg->format = 0;
+  cmdarg->cached = 0;
+
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->path, (int64_t)cmdarg->mtime);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
+      *retval = -1;
+      return COMMAND_END;
+    }
 
-  if (!g_stash.path || !g_stash.data || (strcmp(g_stash.path, cmdarg->path) != 0))
+  ret = sqlite3_prepare_v2(g_db_hdl, query, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
     {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      sqlite3_free(query);
       *retval = -1;
       return COMMAND_END;
     }
 
-  cmdarg->format = g_stash.format;
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW)
+    {
+      ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+      if (ret == 0)
+	cmdarg->cached = 1;
+    }
+  else if (ret == SQLITE_DONE)
+    ret = 0;
+  else
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+      ret = -1;
+    }
 
-  DPRINTF(E_DBG, L_CACHE, "Stash hit (format %d, size %zu): %s\n", g_stash.format, g_stash.size, g_stash.path);
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
 
-  *retval = evbuffer_add(cmdarg->evbuf, g_stash.data, g_stash.size);
+  *retval = ret;
   return COMMAND_END;
+#undef Q_TMPL
 }
 
 static void *
@@ -1306,6 +2517,8 @@ cache(void *arg)
       g_initialized = 0;
     }
 
+  cache_artwork_flush();
+
   db_perthread_deinit();
 
   cache_close();
@@ -1323,6 +2536,25 @@ cache(void *arg)
  *
  */
 
+// Takes ownership of the normalized query
+static void
+daap_query_used(char *normalized, bool cached)
+{
+  struct cache_arg *cmdarg;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      free(normalized);
+      return;
+    }
+
+  cmdarg->query = normalized;
+  cmdarg->cached = cached;
+
+  commands_exec_async(cmdbase, cache_daap_query_used, cmdarg);
+}
+
 void
 cache_daap_suspend(void)
 {
@@ -1339,14 +2571,109 @@ int
 cache_daap_get(struct evbuffer *evbuf, const char *query)
 {
   struct cache_arg cmdarg;
+  char *normalized;
+  int ret;
 
   if (!g_initialized)
     return -1;
 
-  cmdarg.query = strdup(query);
+  normalized = daap_query_normalize(query);
+  if (!normalized)
+    return -1;
+
+  if (g_daap_mem_max && daap_mem_get(evbuf, normalized) == 0)
+    {
+      daap_query_used(normalized, true);
+      return 0;
+    }
+
+  // Freed by cache_daap_query_get
+  cmdarg.query = normalized;
   cmdarg.evbuf = evbuf;
 
-  return commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
+  ret = commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem_lck));
+  if (ret == 0)
+    g_daap_stats.db_hits++;
+  else
+    g_daap_stats.misses++;
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem_lck));
+
+  normalized = daap_query_normalize(query);
+  if (!normalized)
+    return ret;
+
+  // Keep the reply in memory for next time
+  if (ret == 0 && g_daap_mem_max)
+    daap_mem_add(normalized, evbuffer_pullup(evbuf, -1), evbuffer_get_length(evbuf));
+
+  daap_query_used(normalized, (ret == 0));
+
+  return ret;
+}
+
+void
+cache_daap_stats_get(struct cache_daap_stats *stats)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem_lck));
+
+  *stats = g_daap_stats;
+
+  stats->mem_bytes = g_daap_mem_size;
+  stats->mem_entries = g_daap_mem_count;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem_lck));
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_dmap_rec_lck));
+
+  stats->record_hits = g_dmap_rec_hits;
+  stats->record_misses = g_dmap_rec_misses;
+  stats->record_bytes = g_dmap_rec_size;
+  stats->record_entries = g_dmap_rec_count;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_dmap_rec_lck));
+}
+
+static void
+cache_metrics_cb(struct evbuffer *evbuf)
+{
+  struct cache_daap_stats stats;
+  uint64_t artwork_hits;
+  uint64_t artwork_misses;
+  size_t artwork_bytes;
+  int artwork_entries;
+
+  cache_daap_stats_get(&stats);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_artwork_mem_lck));
+  artwork_hits = g_artwork_mem_hits;
+  artwork_misses = g_artwork_mem_misses;
+  artwork_bytes = g_artwork_mem_size;
+  artwork_entries = g_artwork_mem_count;
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_artwork_mem_lck));
+
+  metrics_print_family(evbuf, "forked_daapd_cache_lookups_total", METRICS_COUNTER, "Cache lookups by cache and result");
+  metrics_print_value(evbuf, "forked_daapd_cache_lookups_total", "cache=\"daap_memory\",result=\"hit\"", stats.mem_hits);
+  metrics_print_value(evbuf, "forked_daapd_cache_lookups_total", "cache=\"daap_db\",result=\"hit\"", stats.db_hits);
+  metrics_print_value(evbuf, "forked_daapd_cache_lookups_total", "cache=\"daap\",result=\"miss\"", stats.misses);
+  metrics_print_value(evbuf, "forked_daapd_cache_lookups_total", "cache=\"dmap_record\",result=\"hit\"", stats.record_hits);
+  metrics_print_value(evbuf, "forked_daapd_cache_lookups_total", "cache=\"dmap_record\",result=\"miss\"", stats.record_misses);
+  metrics_print_value(evbuf, "forked_daapd_cache_lookups_total", "cache=\"artwork_memory\",result=\"hit\"", artwork_hits);
+  metrics_print_value(evbuf, "forked_daapd_cache_lookups_total", "cache=\"artwork_memory\",result=\"miss\"", artwork_misses);
+
+  metrics_print_family(evbuf, "forked_daapd_cache_evictions_total", METRICS_COUNTER, "Entries evicted from the memory caches");
+  metrics_print_value(evbuf, "forked_daapd_cache_evictions_total", "cache=\"daap_memory\"", stats.mem_evictions);
+
+  metrics_print_family(evbuf, "forked_daapd_cache_bytes", METRICS_GAUGE, "Size of the memory caches");
+  metrics_print_value(evbuf, "forked_daapd_cache_bytes", "cache=\"daap_memory\"", stats.mem_bytes);
+  metrics_print_value(evbuf, "forked_daapd_cache_bytes", "cache=\"dmap_record\"", stats.record_bytes);
+  metrics_print_value(evbuf, "forked_daapd_cache_bytes", "cache=\"artwork_memory\"", artwork_bytes);
+
+  metrics_print_family(evbuf, "forked_daapd_cache_entries", METRICS_GAUGE, "Entries in the memory caches");
+  metrics_print_value(evbuf, "forked_daapd_cache_entries", "cache=\"daap_memory\"", stats.mem_entries);
+  metrics_print_value(evbuf, "forked_daapd_cache_entries", "cache=\"dmap_record\"", stats.record_entries);
+  metrics_print_value(evbuf, "forked_daapd_cache_entries", "cache=\"artwork_memory\"", artwork_entries);
 }
 
 void
@@ -1453,6 +2780,16 @@ cache_artwork_purge_cruft(time_t ref)
   return commands_exec_sync(cmdbase, cache_artwork_purge_cruft_impl, NULL, &cmdarg);
 }
 
+/*
+ * Returns a counter that changes whenever entries are removed from the artwork
+ * cache, i.e. when artwork files were changed or deleted. Doesn't block.
+ */
+unsigned int
+cache_artwork_generation(void)
+{
+  return __atomic_load_n(&g_artwork_gen, __ATOMIC_ACQUIRE);
+}
+
 /*
  * Adds the given (scaled) artwork image to the artwork cache
  *
@@ -1468,20 +2805,42 @@ cache_artwork_purge_cruft(time_t ref)
 int
 cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf)
 {
-  struct cache_arg cmdarg;
+  struct cache_arg *cmdarg;
+  char key[64];
+
+  // Just made for a client, so likely to be asked for again soon
+  artwork_mem_key(key, sizeof(key), type, persistentid, max_w, max_h);
+  artwork_mem_add(key, false, format, evbuf);
 
   if (!g_initialized)
     return -1;
 
-  cmdarg.type = type;
-  cmdarg.persistentid = persistentid;
-  cmdarg.max_w = max_w;
-  cmdarg.max_h = max_h;
-  cmdarg.format = format;
-  cmdarg.path = filename;
-  cmdarg.evbuf = evbuf;
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return -1;
+    }
+
+  // The caller keeps using evbuf, so the cache thread gets a copy
+  cmdarg->evbuf = evbuffer_new();
+  if (!cmdarg->evbuf || evbuffer_add(cmdarg->evbuf, evbuffer_pullup(evbuf, -1), evbuffer_get_length(evbuf)) < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork evbuffer\n");
+      if (cmdarg->evbuf)
+	evbuffer_free(cmdarg->evbuf);
+      free(cmdarg);
+      return -1;
+    }
 
-  return commands_exec_sync(cmdbase, cache_artwork_add_impl, NULL, &cmdarg);
+  cmdarg->type = type;
+  cmdarg->persistentid = persistentid;
+  cmdarg->max_w = max_w;
+  cmdarg->max_h = max_h;
+  cmdarg->format = format;
+  cmdarg->path = strdup(filename);
+
+  return commands_exec_async(cmdbase, cache_artwork_add_impl, cmdarg);
 }
 
 /*
@@ -1502,8 +2861,19 @@ int
 cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf)
 {
   struct cache_arg cmdarg;
+  char key[64];
+  size_t len;
   int ret;
 
+  artwork_mem_key(key, sizeof(key), type, persistentid, max_w, max_h);
+
+  ret = artwork_mem_get(evbuf, format, key);
+  if (ret == 0)
+    {
+      *cached = 1;
+      return 0;
+    }
+
   if (!g_initialized)
     {
       *cached = 0;
@@ -1517,16 +2887,23 @@ cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cac
   cmdarg.max_h = max_h;
   cmdarg.evbuf = evbuf;
 
+  len = evbuffer_get_length(evbuf);
+
   ret = commands_exec_sync(cmdbase, cache_artwork_get_impl, NULL, &cmdarg);
 
   *format = cmdarg.format;
   *cached = cmdarg.cached;
 
+  // Only if evbuf has nothing but the image
+  if (ret == 0 && cmdarg.cached && len == 0)
+    artwork_mem_add(key, false, cmdarg.format, evbuf);
+
   return ret;
 }
 
 /*
- * Put an artwork image in the in-memory stash (the previous will be deleted)
+ * Put an artwork image in the in-memory stash, which keeps the most recently
+ * used images up to cache_artwork_memory
  *
  * @param evbuf event buffer with the cached image to cache
  * @param path the source (url) of the image to stash
@@ -1536,43 +2913,107 @@ cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cac
 int
 cache_artwork_stash(struct evbuffer *evbuf, char *path, int format)
 {
-  struct cache_arg cmdarg;
-
-  if (!g_initialized)
-    return -1;
+  // The keys of the other images start with a digit, so can't be a url
+  artwork_mem_add(path, true, format, evbuf);
 
-  cmdarg.evbuf = evbuf;
-  cmdarg.path = path;
-  cmdarg.format = format;
-
-  return commands_exec_sync(cmdbase, cache_artwork_stash_impl, NULL, &cmdarg);
+  return 0;
 }
 
 /*
  * Read the cached artwork image in the in-memory stash into evbuffer
  *
  * @param evbuf event buffer filled by this function with the cached image
- * @param path this function will check that the path matches the cached image's path
+ * @param path the source (url) of the image
  * @param format set by this function to the format of the image
  * @return 0 if successful, -1 if an error occurred
  */
 int
 cache_artwork_read(struct evbuffer *evbuf, char *path, int *format)
+{
+  int ret;
+
+  ret = artwork_mem_get(evbuf, format, path);
+  if (ret < 0)
+    {
+      *format = 0;
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_CACHE, "Stash hit (format %d): %s\n", *format, path);
+
+  return 0;
+}
+
+
+/* ----------------------------- Seek index API ---------------------------- */
+
+/*
+ * Stores the seek index for the given media file. The index is an opaque blob
+ * produced by the transcoder. The call is asynchronous, so it may be made from
+ * the player's input thread.
+ *
+ * @param path the full path to the media file
+ * @param mtime modified timestamp of the media file
+ * @param data the seek index
+ * @param len size of the seek index
+ */
+void
+cache_seekindex_add(const char *path, time_t mtime, const void *data, size_t len)
+{
+  struct cache_arg *cmdarg;
+
+  if (!g_initialized)
+    return;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->path = strdup(path);
+  cmdarg->mtime = mtime;
+  cmdarg->evbuf = evbuffer_new();
+  if (!cmdarg->path || !cmdarg->evbuf || (evbuffer_add(cmdarg->evbuf, data, len) < 0))
+    {
+      DPRINTF(E_LOG, L_CACHE, "Out of memory for seek index\n");
+      if (cmdarg->evbuf)
+	evbuffer_free(cmdarg->evbuf);
+      free(cmdarg->path);
+      free(cmdarg);
+      return;
+    }
+
+  commands_exec_async(cmdbase, cache_seekindex_add_impl, cmdarg);
+}
+
+/*
+ * Get the seek index for the given media file
+ *
+ * @param evbuf event buffer filled by this function with the seek index
+ * @param path the full path to the media file
+ * @param mtime modified timestamp of the media file, older indices are ignored
+ * @return 1 if an index was found, 0 if not, -1 if an error occurred
+ */
+int
+cache_seekindex_get(struct evbuffer *evbuf, const char *path, time_t mtime)
 {
   struct cache_arg cmdarg;
   int ret;
 
   if (!g_initialized)
-    return -1;
+    return 0;
 
   cmdarg.evbuf = evbuf;
-  cmdarg.path = path;
-
-  ret = commands_exec_sync(cmdbase, cache_artwork_read_impl, NULL, &cmdarg);
+  cmdarg.path = (char *)path;
+  cmdarg.mtime = mtime;
 
-  *format = cmdarg.format;
+  ret = commands_exec_sync(cmdbase, cache_seekindex_get_impl, NULL, &cmdarg);
+  if (ret < 0)
+    return -1;
 
-  return ret;
+  return cmdarg.cached;
 }
 
 
@@ -1585,6 +3026,10 @@ cache_init(void)
 
   g_initialized = 0;
 
+  // Doesn't need the cache thread, so also used if the rest is disabled
+  g_dmap_rec_max = 1024 * cfg_getint(cfg_getsec(cfg, "general"), "cache_dmap_records");
+  g_artwork_mem_max = 1024 * cfg_getint(cfg_getsec(cfg, "general"), "cache_artwork_memory");
+
   g_db_path = cfg_getstr(cfg_getsec(cfg, "general"), "cache_path");
   if (!g_db_path || (strlen(g_db_path) == 0))
     {
@@ -1599,6 +3044,8 @@ cache_init(void)
       return 0;
     }
 
+  g_daap_mem_max = 1024 * cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_memory");
+
   evbase_cache = event_base_new();
   if (!evbase_cache)
     {
@@ -1607,15 +3054,25 @@ cache_init(void)
     }
 
   cache_daap_updateev = evtimer_new(evbase_cache, cache_daap_update_cb, NULL);
-  if (!cache_daap_updateev)
+  cache_daap_regenev = evtimer_new(evbase_cache, cache_daap_regen_cb, NULL);
+  if (!cache_daap_updateev || !cache_daap_regenev)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create cache event\n");
+      goto evnew_fail;
+    }
+
+  cache_artwork_flushev = evtimer_new(evbase_cache, cache_artwork_flush_cb, NULL);
+  if (!cache_artwork_flushev)
     {
       DPRINTF(E_LOG, L_CACHE, "Could not create cache event\n");
       goto evnew_fail;
     }
 
   cmdbase = commands_base_new(evbase_cache, NULL);
+  commands_base_metrics(cmdbase, "cache");
+  metrics_collector_add(cache_metrics_cb);
 
-  ret = listener_add(cache_daap_listener_cb, LISTENER_DATABASE);
+  ret = listener_add(cache_daap_listener_cb, LISTENER_DATABASE, evbase_cache);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_CACHE, "Could not create listener event\n");
@@ -1657,6 +3114,12 @@ cache_deinit(void)
 {
   int ret;
 
+  dmap_rec_clear();
+  g_dmap_rec_max = 0;
+
+  artwork_mem_clear();
+  g_artwork_mem_max = 0;
+
   if (!g_initialized)
     return;
 
@@ -1673,6 +3136,9 @@ cache_deinit(void)
       return;
     }
 
+  daap_mem_clear();
+  daap_regen_clear();
+
   // Free event base (should free events too)
   event_base_free(evbase_cache);
 }
@@ -2,6 +2,7 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <stdint.h>
 #include <event2/buffer.h>
 
 /* ---------------------------- DAAP cache API  --------------------------- */
@@ -21,6 +22,43 @@ cache_daap_add(const char *query, const char *ua, int is_remote, int msec);
 int
 cache_daap_threshold(void);
 
+struct cache_daap_stats
+{
+  uint64_t mem_hits;      // Replies served from memory
+  uint64_t db_hits;       // Replies served from the cache database
+  uint64_t misses;
+  uint64_t mem_evictions;
+  size_t mem_bytes;
+  int mem_entries;
+
+  // Pre-encoded items, see cache_dmap_record_get()
+  uint64_t record_hits;
+  uint64_t record_misses;
+  size_t record_bytes;
+  int record_entries;
+};
+
+void
+cache_daap_stats_get(struct cache_daap_stats *stats);
+
+
+/* ---------------------------- DMAP record cache API  --------------------------- */
+
+struct dmap_writer;
+
+/*
+ * Adds the pre-encoded DMAP item (the mlit container) with the given id that
+ * was encoded with meta set meta_hash to the DMAP writer. The record is only returned if
+ * it was added with the same stamp, which must change when the item does.
+ *
+ * @return       0 on success, -1 if not cached
+ */
+int
+cache_dmap_record_get(struct dmap_writer *w, uint32_t id, uint32_t meta_hash, uint64_t stamp);
+
+void
+cache_dmap_record_add(uint32_t id, uint32_t meta_hash, uint64_t stamp, const uint8_t *data, size_t len);
+
 
 /* ---------------------------- Artwork cache API  --------------------------- */
 
@@ -36,6 +74,9 @@ cache_artwork_delete_by_path(char *path);
 int
 cache_artwork_purge_cruft(time_t ref);
 
+unsigned int
+cache_artwork_generation(void);
+
 int
 cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf);
 
@@ -48,6 +89,14 @@ cache_artwork_stash(struct evbuffer *evbuf, char *path, int format);
 int
 cache_artwork_read(struct evbuffer *evbuf, char *path, int *format);
 
+/* ---------------------------- Seek index cache API  --------------------------- */
+
+void
+cache_seekindex_add(const char *path, time_t mtime, const void *data, size_t len);
+
+int
+cache_seekindex_get(struct evbuffer *evbuf, const char *path, time_t mtime);
+
 /* ---------------------------- Cache API  --------------------------- */
 
 int
@@ -16,22 +16,36 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include "commands.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef HAVE_EVENTFD
+# include <sys/eventfd.h>
+#endif
 
 #include "logger.h"
+#include "metrics.h"
 #include "misc.h"
 
+// Commands run per event loop iteration, before other events get a turn
+#define COMMANDS_BATCH_MAX 32
+
 struct command
 {
-  pthread_mutex_t lck;
-  pthread_cond_t cond;
+  // The calling thread's, see sync_lck and sync_cond
+  pthread_mutex_t *lck;
+  pthread_cond_t *cond;
+  bool done;
 
   command_function func;
   command_function func_bh;
@@ -39,17 +53,104 @@ struct command
   int nonblock;
   int ret;
   int pending;
+
+  struct command *next;
 };
 
 struct commands_base
 {
   struct event_base *evbase;
   command_exit_cb exit_cb;
-  int command_pipe[2];
   struct event *command_event;
+  struct event *resume_event;
   struct command *current_cmd;
+
+  // Wakes the event loop thread, both are the same fd if it is an eventfd
+  int wakeup_fd[2];
+
+  // Producers push onto incoming without locking (newest first). Only the
+  // producer that finds it empty wakes the event loop thread, which then
+  // takes all of it at once and moves it to ready (oldest first).
+  struct command *incoming;
+  struct command *ready;
+  struct command *ready_tail;
+
+  // Commands queued but not yet run, see commands_base_metrics()
+  struct metrics_metric *depth;
 };
 
+// Used by commands_exec_sync(), a thread waits for one command at a time
+static __thread bool sync_initialized;
+static __thread pthread_mutex_t sync_lck;
+static __thread pthread_cond_t sync_cond;
+
+// Async commands are freed by the event loop threads to cmd_returned, and a
+// thread that runs out of commands takes all of them to its own free list
+static struct command *cmd_returned;
+static __thread struct command *cmd_freelist;
+
+static enum command_state
+cmdloop_exit(void *arg, int *retval);
+
+
+static struct command *
+command_alloc(void)
+{
+  struct command *cmd;
+
+  if (!cmd_freelist)
+    cmd_freelist = __atomic_exchange_n(&cmd_returned, NULL, __ATOMIC_ACQUIRE);
+
+  if (!cmd_freelist)
+    return calloc(1, sizeof(struct command));
+
+  cmd = cmd_freelist;
+  cmd_freelist = cmd->next;
+
+  memset(cmd, 0, sizeof(struct command));
+  return cmd;
+}
+
+static void
+command_release(struct command *cmd)
+{
+  cmd->next = __atomic_load_n(&cmd_returned, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&cmd_returned, &cmd->next, cmd, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ; /* EMPTY */
+}
+
+static void
+wakeup_write(struct commands_base *cmdbase)
+{
+  int ret;
+
+#ifdef HAVE_EVENTFD
+  ret = eventfd_write(cmdbase->wakeup_fd[1], 1);
+#else
+  ret = write(cmdbase->wakeup_fd[1], "", 1);
+  if (ret == 1)
+    ret = 0;
+#endif
+  // A full pipe already means there will be a wakeup
+  if (ret < 0 && errno != EAGAIN)
+    DPRINTF(E_LOG, L_MAIN, "Could not wake command loop: %s\n", strerror(errno));
+}
+
+static void
+wakeup_drain(struct commands_base *cmdbase)
+{
+#ifdef HAVE_EVENTFD
+  eventfd_t count;
+
+  eventfd_read(cmdbase->wakeup_fd[0], &count);
+#else
+  char buf[64];
+
+  while (read(cmdbase->wakeup_fd[0], buf, sizeof(buf)) == sizeof(buf))
+    ; /* EMPTY */
+#endif
+}
+
 /*
  * Asynchronous execution of the command function
  */
@@ -65,20 +166,22 @@ command_cb_async(struct commands_base *cmdbase, struct command *cmd)
   if (cmdstate != COMMAND_PENDING && cmd->arg)
     free(cmd->arg);
 
-  free(cmd);
-
-  event_add(cmdbase->command_event, NULL);
+  command_release(cmd);
 }
 
 /*
  * Synchronous execution of the command function
+ *
+ * @return true if no further commands may be run now, because the command is
+ *         waiting for pending events or because cmdbase is going away
  */
-static void
+static bool
 command_cb_sync(struct commands_base *cmdbase, struct command *cmd)
 {
   enum command_state cmdstate;
+  bool exiting;
 
-  CHECK_ERR(L_MAIN, pthread_mutex_lock(&cmd->lck));
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(cmd->lck));
 
   cmdstate = cmd->func(cmd->arg, &cmd->ret);
   if (cmdstate == COMMAND_PENDING)
@@ -86,69 +189,107 @@ command_cb_sync(struct commands_base *cmdbase, struct command *cmd)
       // Command execution is waiting for pending events before returning to the caller
       cmdbase->current_cmd = cmd;
       cmd->pending = cmd->ret;
+      return true;
     }
-  else
-    {
-      // Command execution finished, execute the bottom half function
-      if (cmd->ret == 0 && cmd->func_bh)
-	cmd->func_bh(cmd->arg, &cmd->ret);
 
-      event_add(cmdbase->command_event, NULL);
+  // Command execution finished, execute the bottom half function
+  if (cmd->ret == 0 && cmd->func_bh)
+    cmd->func_bh(cmd->arg, &cmd->ret);
 
-      // Signal the calling thread that the command execution finished
-      CHECK_ERR(L_MAIN, pthread_cond_signal(&cmd->cond));
-      CHECK_ERR(L_MAIN, pthread_mutex_unlock(&cmd->lck));
+  // The caller of cmdloop_exit frees cmdbase as soon as it is signaled
+  exiting = (cmd->func == cmdloop_exit);
 
-      // Note if cmd->func was cmdloop_exit then cmdbase may be invalid now,
-      // because commands_base_destroy() may have freed it
-    }
+  // Signal the calling thread that the command execution finished, cmd is
+  // invalid after this
+  cmd->done = true;
+  CHECK_ERR(L_MAIN, pthread_cond_signal(cmd->cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(cmd->lck));
+
+  return exiting;
 }
 
 /*
- * Event callback function
- *
- * Function is triggered by libevent if there is data to read on the command pipe (writing to the command pipe happens through
- * the send_command function).
+ * Runs the queued commands, at most COMMANDS_BATCH_MAX of them. Stops when a
+ * command is waiting for pending events, commands_exec_end() continues.
  */
 static void
-command_cb(int fd, short what, void *arg)
+commands_run(struct commands_base *cmdbase)
 {
-  struct commands_base *cmdbase;
   struct command *cmd;
-  int ret;
+  struct command *next;
+  struct command *list;
+  int n;
 
-  cmdbase = arg;
+  if (cmdbase->current_cmd)
+    return;
 
-  // Get the command to execute from the pipe
-  ret = read(cmdbase->command_pipe[0], &cmd, sizeof(cmd));
-  if (ret != sizeof(cmd))
+  // Newest first, so reverse while moving to the ready list
+  list = NULL;
+  for (cmd = __atomic_exchange_n(&cmdbase->incoming, NULL, __ATOMIC_ACQUIRE); cmd; cmd = next)
     {
-      DPRINTF(E_LOG, L_MAIN, "Error reading command from command pipe: expected %zu bytes, read %d bytes\n", sizeof(cmd), ret);
-
-      event_add(cmdbase->command_event, NULL);
-      return;
+      next = cmd->next;
+      cmd->next = list;
+      list = cmd;
     }
 
-  // Execute the command function
-  if (cmd->nonblock)
+  if (list)
     {
-      // Command is executed asynchronously
-      command_cb_async(cmdbase, cmd);
+      if (cmdbase->ready_tail)
+	cmdbase->ready_tail->next = list;
+      else
+	cmdbase->ready = list;
+
+      for (cmd = list; cmd->next; cmd = cmd->next)
+	; /* EMPTY */
+      cmdbase->ready_tail = cmd;
     }
-  else
+
+  for (n = 0; cmdbase->ready && n < COMMANDS_BATCH_MAX; n++)
     {
-      // Command is executed synchronously, caller is waiting until signaled that the execution finished
-      command_cb_sync(cmdbase, cmd);
+      cmd = cmdbase->ready;
+      cmdbase->ready = cmd->next;
+      if (!cmdbase->ready)
+	cmdbase->ready_tail = NULL;
+
+      metrics_gauge_add(cmdbase->depth, -1);
+
+      if (cmd->nonblock)
+	command_cb_async(cmdbase, cmd);
+      else if (command_cb_sync(cmdbase, cmd))
+	return; // Note cmdbase may be invalid now, see command_cb_sync()
     }
+
+  // Let other events in before running the rest
+  if (cmdbase->ready)
+    event_active(cmdbase->resume_event, 0, 0);
+}
+
+/*
+ * Event callback function
+ *
+ * Function is triggered by libevent when the command loop is woken up by
+ * send_command(), or to continue with the queued commands.
+ */
+static void
+command_cb(int fd, short what, void *arg)
+{
+  struct commands_base *cmdbase = arg;
+
+  // Must come first, the next wakeup is for commands queued after this
+  if (what & EV_READ)
+    wakeup_drain(cmdbase);
+
+  commands_run(cmdbase);
 }
 
 /*
- * Writes the given command to the command pipe
+ * Queues the given command and wakes up the command loop, if it isn't about to
+ * run commands anyway
  */
 static int
 send_command(struct commands_base *cmdbase, struct command *cmd)
 {
-  int ret;
+  struct command *head;
 
   if (!cmd->func)
     {
@@ -156,12 +297,15 @@ send_command(struct commands_base *cmdbase, struct command *cmd)
       return -1;
     }
 
-  ret = write(cmdbase->command_pipe[1], &cmd, sizeof(cmd));
-  if (ret != sizeof(cmd))
-    {
-      DPRINTF(E_LOG, L_MAIN, "Bad write to command pipe (write incomplete)\n");
-      return -1;
-    }
+  head = __atomic_load_n(&cmdbase->incoming, __ATOMIC_RELAXED);
+  do
+    cmd->next = head;
+  while (!__atomic_compare_exchange_n(&cmdbase->incoming, &head, cmd, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  metrics_gauge_add(cmdbase->depth, 1);
+
+  if (!head)
+    wakeup_write(cmdbase);
 
   return 0;
 }
@@ -185,53 +329,118 @@ commands_base_new(struct event_base *evbase, command_exit_cb exit_cb)
       return NULL;
     }
 
-#ifdef HAVE_PIPE2
-  ret = pipe2(cmdbase->command_pipe, O_CLOEXEC);
+#ifdef HAVE_EVENTFD
+  ret = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  cmdbase->wakeup_fd[0] = ret;
+  cmdbase->wakeup_fd[1] = ret;
 #else
-  ret = pipe(cmdbase->command_pipe);
+# ifdef HAVE_PIPE2
+  ret = pipe2(cmdbase->wakeup_fd, O_CLOEXEC | O_NONBLOCK);
+# else
+  ret = pipe(cmdbase->wakeup_fd);
+  if (ret == 0)
+    {
+      fcntl(cmdbase->wakeup_fd[0], F_SETFL, O_NONBLOCK);
+      fcntl(cmdbase->wakeup_fd[1], F_SETFL, O_NONBLOCK);
+    }
+# endif
 #endif
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_MAIN, "Could not create command pipe: %s\n", strerror(errno));
+      DPRINTF(E_LOG, L_MAIN, "Could not create command wakeup fd: %s\n", strerror(errno));
       free(cmdbase);
       return NULL;
     }
 
-  cmdbase->command_event = event_new(evbase, cmdbase->command_pipe[0], EV_READ, command_cb, cmdbase);
-  if (!cmdbase->command_event)
+  cmdbase->command_event = event_new(evbase, cmdbase->wakeup_fd[0], EV_READ | EV_PERSIST, command_cb, cmdbase);
+  cmdbase->resume_event = event_new(evbase, -1, 0, command_cb, cmdbase);
+  if (!cmdbase->command_event || !cmdbase->resume_event)
     {
       DPRINTF(E_LOG, L_MAIN, "Could not create cmd event\n");
-      close(cmdbase->command_pipe[0]);
-      close(cmdbase->command_pipe[1]);
-      free(cmdbase);
-      return NULL;
+      goto error;
     }
 
   ret = event_add(cmdbase->command_event, NULL);
   if (ret != 0)
     {
       DPRINTF(E_LOG, L_MAIN, "Could not add cmd event\n");
-      close(cmdbase->command_pipe[0]);
-      close(cmdbase->command_pipe[1]);
-      free(cmdbase);
-      return NULL;
+      goto error;
     }
 
   cmdbase->evbase = evbase;
   cmdbase->exit_cb = exit_cb;
 
   return cmdbase;
+
+ error:
+  if (cmdbase->command_event)
+    event_free(cmdbase->command_event);
+  if (cmdbase->resume_event)
+    event_free(cmdbase->resume_event);
+  close(cmdbase->wakeup_fd[0]);
+  if (cmdbase->wakeup_fd[1] != cmdbase->wakeup_fd[0])
+    close(cmdbase->wakeup_fd[1]);
+  free(cmdbase);
+  return NULL;
 }
 
 /*
- * Frees the command base and closes the (internally used) pipes
+ * Exports the number of queued commands as a gauge labeled with the name of
+ * the thread that runs them.
+ *
+ * @param cmdbase The command base
+ * @param thread_name Name of the thread, e.g. "player"
+ */
+void
+commands_base_metrics(struct commands_base *cmdbase, const char *thread_name)
+{
+  char labels[64];
+
+  if (!cmdbase)
+    return;
+
+  snprintf(labels, sizeof(labels), "thread=\"%s\"", thread_name);
+
+  cmdbase->depth = metrics_register("forked_daapd_command_queue_depth", labels, METRICS_GAUGE,
+                                    "Commands waiting for the thread that runs them");
+}
+
+/*
+ * Frees the command base and closes the (internally used) wakeup fd. Async
+ * commands that didn't run are dropped.
  */
 int
 commands_base_free(struct commands_base *cmdbase)
 {
+  struct command *lists[2];
+  struct command *cmd;
+  struct command *next;
+  int i;
+
   event_free(cmdbase->command_event);
-  close(cmdbase->command_pipe[0]);
-  close(cmdbase->command_pipe[1]);
+  event_free(cmdbase->resume_event);
+  close(cmdbase->wakeup_fd[0]);
+  if (cmdbase->wakeup_fd[1] != cmdbase->wakeup_fd[0])
+    close(cmdbase->wakeup_fd[1]);
+
+  // No one can be waiting for sync commands anymore, so only async ones left
+  lists[0] = cmdbase->ready;
+  lists[1] = __atomic_exchange_n(&cmdbase->incoming, NULL, __ATOMIC_ACQUIRE);
+  for (i = 0; i < 2; i++)
+    {
+      for (cmd = lists[i]; cmd; cmd = next)
+	{
+	  next = cmd->next;
+	  if (!cmd->nonblock)
+	    continue;
+
+	  free(cmd->arg);
+	  command_release(cmd);
+	}
+    }
+
+  metrics_gauge_set(cmdbase->depth, 0);
+
   free(cmdbase);
 
   return 0;
@@ -291,10 +500,11 @@ commands_exec_end(struct commands_base *cmdbase, int retvalue)
   cmdbase->current_cmd = NULL;
 
   /* Process commands again */
-  event_add(cmdbase->command_event, NULL);
+  event_active(cmdbase->resume_event, 0, 0);
 
-  CHECK_ERR(L_MAIN, pthread_cond_signal(&current_cmd->cond));
-  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&current_cmd->lck));
+  current_cmd->done = true;
+  CHECK_ERR(L_MAIN, pthread_cond_signal(current_cmd->cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(current_cmd->lck));
 }
 
 /*
@@ -316,16 +526,23 @@ commands_exec_sync(struct commands_base *cmdbase, command_function func, command
   struct command cmd;
   int ret;
 
+  // Kept for the lifetime of the thread instead of being made for every call
+  if (!sync_initialized)
+    {
+      CHECK_ERR(L_MAIN, mutex_init(&sync_lck));
+      CHECK_ERR(L_MAIN, pthread_cond_init(&sync_cond, NULL));
+      sync_initialized = true;
+    }
+
   memset(&cmd, 0, sizeof(struct command));
+  cmd.lck = &sync_lck;
+  cmd.cond = &sync_cond;
   cmd.func = func;
   cmd.func_bh = func_bh;
   cmd.arg = arg;
   cmd.nonblock = 0;
 
-  CHECK_ERR(L_MAIN, mutex_init(&cmd.lck));
-  CHECK_ERR(L_MAIN, pthread_cond_init(&cmd.cond, NULL));
-
-  CHECK_ERR(L_MAIN, pthread_mutex_lock(&cmd.lck));
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(cmd.lck));
 
   ret = send_command(cmdbase, &cmd);
   if (ret < 0)
@@ -335,12 +552,10 @@ commands_exec_sync(struct commands_base *cmdbase, command_function func, command
     }
   else
     {
-      CHECK_ERR(L_MAIN, pthread_cond_wait(&cmd.cond, &cmd.lck));
+      while (!cmd.done)
+	CHECK_ERR(L_MAIN, pthread_cond_wait(cmd.cond, cmd.lck));
     }
-  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&cmd.lck));
-
-  CHECK_ERR(L_MAIN, pthread_cond_destroy(&cmd.cond));
-  CHECK_ERR(L_MAIN, pthread_mutex_destroy(&cmd.lck));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(cmd.lck));
 
   return cmd.ret;
 }
@@ -362,7 +577,13 @@ commands_exec_async(struct commands_base *cmdbase, command_function func, void *
   struct command *cmd;
   int ret;
 
-  cmd = calloc(1, sizeof(struct command));
+  cmd = command_alloc();
+  if (!cmd)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Out of memory for command\n");
+      return -1;
+    }
+
   cmd->func = func;
   cmd->func_bh = NULL;
   cmd->arg = arg;
@@ -371,7 +592,7 @@ commands_exec_async(struct commands_base *cmdbase, command_function func, void *
   ret = send_command(cmdbase, cmd);
   if (ret < 0)
     {
-      free(cmd);
+      command_release(cmd);
       return -1;
     }
 
@@ -402,7 +623,7 @@ cmdloop_exit(void *arg, int *retval)
 }
 
 /*
- * Break the libevent loop for the given command base, closes the internally used pipes
+ * Break the libevent loop for the given command base, closes the internally used wakeup fd
  * and frees the command base.
  *
  * @param cmdbase The command base
@@ -35,6 +35,9 @@ struct commands_base;
 struct commands_base *
 commands_base_new(struct event_base *evbase, command_exit_cb exit_cb);
 
+void
+commands_base_metrics(struct commands_base *cmdbase, const char *thread_name);
+
 int
 commands_base_free(struct commands_base *cmdbase);
 
@@ -46,20 +46,38 @@ static cfg_opt_t sec_general[] =
   {
     CFG_STR("uid", "nobody", CFGF_NONE),
     CFG_STR("db_path", STATEDIR "/cache/" PACKAGE "/songs3.db", CFGF_NONE),
+    CFG_INT("zone", 0, CFGF_NONE),
     CFG_STR("logfile", STATEDIR "/log/" PACKAGE ".log", CFGF_NONE),
     CFG_INT_CB("loglevel", E_LOG, CFGF_NONE, &cb_loglevel),
+    CFG_BOOL("log_async", cfg_false, CFGF_NONE),
+    CFG_BOOL("metrics", cfg_false, CFGF_NONE),
     CFG_STR("admin_password", NULL, CFGF_NONE),
     CFG_INT("websocket_port", 3688, CFGF_NONE),
+    CFG_INT("websocket_interval", 100, CFGF_NONE),
+    CFG_INT("worker_threads", 2, CFGF_NONE),
+    CFG_INT("slow_request_threshold", 0, CFGF_NONE),
     CFG_STR_LIST("trusted_networks", "{localhost,192.168,fd}", CFGF_NONE),
     CFG_BOOL("ipv6", cfg_true, CFGF_NONE),
     CFG_STR("cache_path", STATEDIR "/cache/" PACKAGE "/cache.db", CFGF_NONE),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("cache_daap_memory", 16384, CFGF_NONE),
+    CFG_INT("cache_dmap_records", 8192, CFGF_NONE),
+    CFG_INT("cache_artwork_memory", 8192, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_true, CFGF_NONE),
+    CFG_INT("speaker_restore_days", 30, CFGF_NONE),
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     CFG_BOOL("high_resolution_clock", cfg_false, CFGF_NONE),
 #else
     CFG_BOOL("high_resolution_clock", cfg_true, CFGF_NONE),
 #endif
+    CFG_INT("preroll_seconds", 5, CFGF_NONE),
+    CFG_INT("readahead_seconds", 10, CFGF_NONE),
+    CFG_STR("audio_thread_scheduling", "default", CFGF_NONE),
+    CFG_INT("audio_thread_priority", 10, CFGF_NONE),
+    CFG_STR("audio_thread_cpus", NULL, CFGF_NONE),
+    CFG_INT("scan_thread_nice", 0, CFGF_NONE),
+    CFG_STR("scan_thread_cpus", NULL, CFGF_NONE),
+    CFG_STR("request_log", NULL, CFGF_NONE),
     // Hidden options
     CFG_INT("db_pragma_cache_size", -1, CFGF_NONE),
     CFG_STR("db_pragma_journal_mode", NULL, CFGF_NONE),
@@ -68,11 +86,22 @@ static cfg_opt_t sec_general[] =
     CFG_END()
   };
 
+/* library poll section structure */
+static cfg_opt_t sec_library_poll[] =
+  {
+    CFG_INT("interval", 300, CFGF_NONE),
+    CFG_END()
+  };
+
 /* library section structure */
 static cfg_opt_t sec_library[] =
   {
     CFG_STR("name", "My Music on %h", CFGF_NONE),
     CFG_INT("port", 3689, CFGF_NONE),
+    CFG_INT("httpd_threads", 4, CFGF_NONE),
+    CFG_INT("httpd_transcode_threads", 2, CFGF_NONE),
+    CFG_INT("gzip_level", 6, CFGF_NONE),
+    CFG_INT("gzip_level_large", 1, CFGF_NONE),
     CFG_STR("password", NULL, CFGF_NONE),
     CFG_STR_LIST("directories", NULL, CFGF_NONE),
     CFG_BOOL("follow_symlinks", cfg_true, CFGF_NONE),
@@ -91,14 +120,24 @@ static cfg_opt_t sec_library[] =
     CFG_STR("name_radio", "Radio", CFGF_NONE),
     CFG_STR_LIST("artwork_basenames", "{artwork,cover,Folder}", CFGF_NONE),
     CFG_BOOL("artwork_individual", cfg_false, CFGF_NONE),
+    CFG_INT_LIST("artwork_pregen_sizes", NULL, CFGF_NONE),
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf,.metadata}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
     CFG_BOOL("filescan_disable", cfg_false, CFGF_NONE),
+    CFG_BOOL("frontend", cfg_false, CFGF_NONE),
+    CFG_INT("scan_transaction_files", 1000, CFGF_NONE),
+    CFG_INT("scan_transaction_ms", 2000, CFGF_NONE),
+    CFG_INT("purge_batch_size", 1000, CFGF_NONE),
+    CFG_INT("scan_threads", 1, CFGF_NONE),
+    CFG_BOOL("native_metadata", cfg_true, CFGF_NONE),
     CFG_BOOL("itunes_overrides", cfg_false, CFGF_NONE),
     CFG_BOOL("itunes_smartpl", cfg_false, CFGF_NONE),
     CFG_STR_LIST("no_decode", NULL, CFGF_NONE),
     CFG_STR_LIST("force_decode", NULL, CFGF_NONE),
+    CFG_INT("decode_cache_size", 0, CFGF_NONE),
+    CFG_STR("decode_cache_dir", STATEDIR "/cache/" PACKAGE "/decoded", CFGF_NONE),
     CFG_BOOL("pipe_autostart", cfg_true, CFGF_NONE),
+    CFG_SEC("poll", sec_library_poll, CFGF_MULTI | CFGF_TITLE),
     CFG_END()
   };
 
@@ -111,6 +150,14 @@ static cfg_opt_t sec_audio[] =
     CFG_STR("card", "default", CFGF_NONE),
     CFG_STR("mixer", NULL, CFGF_NONE),
     CFG_STR("mixer_device", NULL, CFGF_NONE),
+    CFG_BOOL("software_volume", cfg_false, CFGF_NONE),
+    CFG_BOOL("mmap", cfg_false, CFGF_NONE),
+    CFG_INT("period_size", 0, CFGF_NONE),
+    CFG_INT("buffer_size", 0, CFGF_NONE),
+    CFG_INT("pulse_tlength", -1, CFGF_NONE),
+    CFG_INT("pulse_minreq", -1, CFGF_NONE),
+    CFG_INT("pulse_prebuf", -1, CFGF_NONE),
+    CFG_INT("dummy_devices", 1, CFGF_NONE),
     CFG_INT("offset", 0, CFGF_NONE),
     CFG_END()
   };
@@ -121,6 +168,8 @@ static cfg_opt_t sec_airplay[] =
     CFG_INT("max_volume", 11, CFGF_NONE),
     CFG_BOOL("exclude", cfg_false, CFGF_NONE),
     CFG_STR("password", NULL, CFGF_NONE),
+    CFG_BOOL("alac_compression", cfg_false, CFGF_NONE),
+    CFG_INT("verified_keep_seconds", 300, CFGF_NONE),
     CFG_END()
   };
 
@@ -129,6 +178,23 @@ static cfg_opt_t sec_fifo[] =
   {
     CFG_STR("nickname", "fifo", CFGF_NONE),
     CFG_STR("path", NULL, CFGF_NONE),
+    CFG_BOOL("software_volume", cfg_false, CFGF_NONE),
+    CFG_INT("buffer_ms", 1000, CFGF_NONE),
+    CFG_STR("overflow_policy", "flush", CFGF_NONE),
+    CFG_END()
+  };
+
+/* HTTP streaming section structure */
+static cfg_opt_t sec_streaming[] =
+  {
+    CFG_INT("backlog_seconds", 2, CFGF_NONE),
+    CFG_END()
+  };
+
+/* Chromecast section structure */
+static cfg_opt_t sec_chromecast[] =
+  {
+    CFG_STR("stream_format", "aac", CFGF_NONE),
     CFG_END()
   };
 
@@ -141,6 +207,7 @@ static cfg_opt_t sec_spotify[] =
     CFG_BOOL("base_playlist_disable", cfg_false, CFGF_NONE),
     CFG_BOOL("artist_override", cfg_false, CFGF_NONE),
     CFG_BOOL("album_override", cfg_false, CFGF_NONE),
+    CFG_INT("webapi_parallel_requests", 4, CFGF_NONE),
     CFG_END()
   };
 
@@ -154,6 +221,12 @@ static cfg_opt_t sec_sqlite[] =
     CFG_INT("pragma_mmap_size_library", -1, CFGF_NONE),
     CFG_INT("pragma_mmap_size_cache", -1, CFGF_NONE),
     CFG_BOOL("vacuum", cfg_true, CFGF_NONE),
+    CFG_INT("maintenance_idle", 300, CFGF_NONE),
+    CFG_INT("slow_query_threshold", 0, CFGF_NONE),
+    CFG_INT("auto_indexes", 0, CFGF_NONE),
+    CFG_INT("auto_index_max_size", 32, CFGF_NONE),
+    CFG_BOOL("in_memory", cfg_false, CFGF_NONE),
+    CFG_INT("persist_interval", 300, CFGF_NONE),
     CFG_END()
   };
 
@@ -165,6 +238,7 @@ static cfg_opt_t sec_mpd[] =
     CFG_BOOL("clear_queue_on_stop_disable", cfg_false, CFGF_NONE),
     CFG_BOOL("allow_modifying_stored_playlists", cfg_false, CFGF_NONE),
     CFG_STR("default_playlist_directory", NULL, CFGF_NONE),
+    CFG_BOOL("prewarm_list_cache", cfg_false, CFGF_NONE),
     CFG_END()
   };
 
@@ -176,6 +250,8 @@ static cfg_opt_t toplvl_cfg[] =
     CFG_SEC("audio", sec_audio, CFGF_NONE),
     CFG_SEC("airplay", sec_airplay, CFGF_MULTI | CFGF_TITLE),
     CFG_SEC("fifo", sec_fifo, CFGF_NONE),
+    CFG_SEC("streaming", sec_streaming, CFGF_NONE),
+    CFG_SEC("chromecast", sec_chromecast, CFGF_NONE),
     CFG_SEC("spotify", sec_spotify, CFGF_NONE),
     CFG_SEC("sqlite", sec_sqlite, CFGF_NONE),
     CFG_SEC("mpd", sec_mpd, CFGF_NONE),
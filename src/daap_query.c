@@ -34,6 +34,10 @@
 #include "DAAP2SQL.h"
 
 
+/* Remotes send the same few filters over and over, and the translation only
+   depends on the query string, so the resulting SQL is kept around */
+static struct string_cache daap_query_cache = STRING_CACHE_INITIALIZER(0);
+
 char *
 daap_query_parse_sql(const char *daap_query)
 {
@@ -61,6 +65,13 @@ daap_query_parse_sql(const char *daap_query)
       return NULL;
     }
 
+  ret = string_cache_get(&daap_query_cache, daap_query);
+  if (ret)
+    {
+      DPRINTF(E_SPAM, L_DAAP, "Cached DAAP SQL query for -%s-: -%s-\n", daap_query, ret);
+      return ret;
+    }
+
   DPRINTF(E_DBG, L_DAAP, "Trying DAAP query -%s-\n", daap_query);
 
 #if ANTLR3C_NEW_INPUT
@@ -133,6 +144,8 @@ daap_query_parse_sql(const char *daap_query)
     {
       DPRINTF(E_DBG, L_DAAP, "DAAP SQL query: -%s-\n", sql->chars);
       ret = strdup((char *)sql->chars);
+
+      string_cache_add(&daap_query_cache, daap_query, ret);
     }
   else
     {
@@ -28,6 +28,9 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -42,6 +45,7 @@
 #include "cache.h"
 #include "listener.h"
 #include "library.h"
+#include "metrics.h"
 #include "misc.h"
 #include "db.h"
 #include "db_init.h"
@@ -75,9 +79,18 @@ struct col_type_map {
   short type;
 };
 
+/* Files table column name and the matching struct db_media_file_info field
+ * (the field names are the column names)
+ */
+struct dbmfi_col_map {
+  const char *name;
+  ssize_t offset;
+};
+
 struct query_clause {
+  char *cols;
   char *where;
-  const char *order;
+  char *order;
   char *index;
 };
 
@@ -147,6 +160,10 @@ static const struct col_type_map mfi_cols_map[] =
     { mfi_offsetof(virtual_path),       DB_TYPE_STRING },
     { mfi_offsetof(directory_id),       DB_TYPE_INT },
     { mfi_offsetof(date_released),      DB_TYPE_INT },
+    { mfi_offsetof(title_sort_ord),     DB_TYPE_INT64 },
+    { mfi_offsetof(album_sort_ord),     DB_TYPE_INT64 },
+    { mfi_offsetof(album_artist_sort_ord), DB_TYPE_INT64 },
+    { mfi_offsetof(composer_sort_ord),  DB_TYPE_INT64 },
   };
 
 /* This list must be kept in sync with
@@ -175,68 +192,72 @@ static const struct col_type_map pli_cols_map[] =
  * - the order of the columns in the files table
  * - the name of the fields in struct db_media_file_info
  */
-static const ssize_t dbmfi_cols_map[] =
+static const struct dbmfi_col_map dbmfi_cols_map[] =
   {
-    dbmfi_offsetof(id),
-    dbmfi_offsetof(path),
-    dbmfi_offsetof(fname),
-    dbmfi_offsetof(title),
-    dbmfi_offsetof(artist),
-    dbmfi_offsetof(album),
-    dbmfi_offsetof(genre),
-    dbmfi_offsetof(comment),
-    dbmfi_offsetof(type),
-    dbmfi_offsetof(composer),
-    dbmfi_offsetof(orchestra),
-    dbmfi_offsetof(conductor),
-    dbmfi_offsetof(grouping),
-    dbmfi_offsetof(url),
-    dbmfi_offsetof(bitrate),
-    dbmfi_offsetof(samplerate),
-    dbmfi_offsetof(song_length),
-    dbmfi_offsetof(file_size),
-    dbmfi_offsetof(year),
-    dbmfi_offsetof(track),
-    dbmfi_offsetof(total_tracks),
-    dbmfi_offsetof(disc),
-    dbmfi_offsetof(total_discs),
-    dbmfi_offsetof(bpm),
-    dbmfi_offsetof(compilation),
-    dbmfi_offsetof(artwork),
-    dbmfi_offsetof(rating),
-    dbmfi_offsetof(play_count),
-    dbmfi_offsetof(seek),
-    dbmfi_offsetof(data_kind),
-    dbmfi_offsetof(item_kind),
-    dbmfi_offsetof(description),
-    dbmfi_offsetof(time_added),
-    dbmfi_offsetof(time_modified),
-    dbmfi_offsetof(time_played),
-    dbmfi_offsetof(db_timestamp),
-    dbmfi_offsetof(disabled),
-    dbmfi_offsetof(sample_count),
-    dbmfi_offsetof(codectype),
-    dbmfi_offsetof(idx),
-    dbmfi_offsetof(has_video),
-    dbmfi_offsetof(contentrating),
-    dbmfi_offsetof(bits_per_sample),
-    dbmfi_offsetof(album_artist),
-    dbmfi_offsetof(media_kind),
-    dbmfi_offsetof(tv_series_name),
-    dbmfi_offsetof(tv_episode_num_str),
-    dbmfi_offsetof(tv_network_name),
-    dbmfi_offsetof(tv_episode_sort),
-    dbmfi_offsetof(tv_season_num),
-    dbmfi_offsetof(songartistid),
-    dbmfi_offsetof(songalbumid),
-    dbmfi_offsetof(title_sort),
-    dbmfi_offsetof(artist_sort),
-    dbmfi_offsetof(album_sort),
-    dbmfi_offsetof(composer_sort),
-    dbmfi_offsetof(album_artist_sort),
-    dbmfi_offsetof(virtual_path),
-    dbmfi_offsetof(directory_id),
-    dbmfi_offsetof(date_released),
+    { "id", dbmfi_offsetof(id) },
+    { "path", dbmfi_offsetof(path) },
+    { "fname", dbmfi_offsetof(fname) },
+    { "title", dbmfi_offsetof(title) },
+    { "artist", dbmfi_offsetof(artist) },
+    { "album", dbmfi_offsetof(album) },
+    { "genre", dbmfi_offsetof(genre) },
+    { "comment", dbmfi_offsetof(comment) },
+    { "type", dbmfi_offsetof(type) },
+    { "composer", dbmfi_offsetof(composer) },
+    { "orchestra", dbmfi_offsetof(orchestra) },
+    { "conductor", dbmfi_offsetof(conductor) },
+    { "grouping", dbmfi_offsetof(grouping) },
+    { "url", dbmfi_offsetof(url) },
+    { "bitrate", dbmfi_offsetof(bitrate) },
+    { "samplerate", dbmfi_offsetof(samplerate) },
+    { "song_length", dbmfi_offsetof(song_length) },
+    { "file_size", dbmfi_offsetof(file_size) },
+    { "year", dbmfi_offsetof(year) },
+    { "track", dbmfi_offsetof(track) },
+    { "total_tracks", dbmfi_offsetof(total_tracks) },
+    { "disc", dbmfi_offsetof(disc) },
+    { "total_discs", dbmfi_offsetof(total_discs) },
+    { "bpm", dbmfi_offsetof(bpm) },
+    { "compilation", dbmfi_offsetof(compilation) },
+    { "artwork", dbmfi_offsetof(artwork) },
+    { "rating", dbmfi_offsetof(rating) },
+    { "play_count", dbmfi_offsetof(play_count) },
+    { "seek", dbmfi_offsetof(seek) },
+    { "data_kind", dbmfi_offsetof(data_kind) },
+    { "item_kind", dbmfi_offsetof(item_kind) },
+    { "description", dbmfi_offsetof(description) },
+    { "time_added", dbmfi_offsetof(time_added) },
+    { "time_modified", dbmfi_offsetof(time_modified) },
+    { "time_played", dbmfi_offsetof(time_played) },
+    { "db_timestamp", dbmfi_offsetof(db_timestamp) },
+    { "disabled", dbmfi_offsetof(disabled) },
+    { "sample_count", dbmfi_offsetof(sample_count) },
+    { "codectype", dbmfi_offsetof(codectype) },
+    { "idx", dbmfi_offsetof(idx) },
+    { "has_video", dbmfi_offsetof(has_video) },
+    { "contentrating", dbmfi_offsetof(contentrating) },
+    { "bits_per_sample", dbmfi_offsetof(bits_per_sample) },
+    { "album_artist", dbmfi_offsetof(album_artist) },
+    { "media_kind", dbmfi_offsetof(media_kind) },
+    { "tv_series_name", dbmfi_offsetof(tv_series_name) },
+    { "tv_episode_num_str", dbmfi_offsetof(tv_episode_num_str) },
+    { "tv_network_name", dbmfi_offsetof(tv_network_name) },
+    { "tv_episode_sort", dbmfi_offsetof(tv_episode_sort) },
+    { "tv_season_num", dbmfi_offsetof(tv_season_num) },
+    { "songartistid", dbmfi_offsetof(songartistid) },
+    { "songalbumid", dbmfi_offsetof(songalbumid) },
+    { "title_sort", dbmfi_offsetof(title_sort) },
+    { "artist_sort", dbmfi_offsetof(artist_sort) },
+    { "album_sort", dbmfi_offsetof(album_sort) },
+    { "composer_sort", dbmfi_offsetof(composer_sort) },
+    { "album_artist_sort", dbmfi_offsetof(album_artist_sort) },
+    { "virtual_path", dbmfi_offsetof(virtual_path) },
+    { "directory_id", dbmfi_offsetof(directory_id) },
+    { "date_released", dbmfi_offsetof(date_released) },
+    { "title_sort_ord", dbmfi_offsetof(title_sort_ord) },
+    { "album_sort_ord", dbmfi_offsetof(album_sort_ord) },
+    { "album_artist_sort_ord", dbmfi_offsetof(album_artist_sort_ord) },
+    { "composer_sort_ord", dbmfi_offsetof(composer_sort_ord) },
   };
 
 /* This list must be kept in sync with
@@ -308,17 +329,251 @@ static const char *sort_clause[] =
     "ORDER BY shuffle_pos ASC",
   };
 
+/* Same as sort_clause, but for queries on the files table the sort tags are
+ * ordered by their integer ranks (see db_sortkeys_update), which avoids
+ * running the DAAP collation for every comparison
+ */
+static const char *sort_clause_files[] =
+  {
+    "",
+    "ORDER BY f.title_sort_ord ASC",
+    "ORDER BY f.album_sort_ord ASC, f.disc ASC, f.track ASC",
+    "ORDER BY f.album_artist_sort_ord ASC, f.album_sort_ord ASC, f.disc ASC, f.track ASC",
+    "ORDER BY f.type ASC, f.parent_id ASC, f.special_id ASC, f.title ASC",
+    "ORDER BY f.year ASC",
+    "ORDER BY f.genre ASC",
+    "ORDER BY f.composer_sort_ord ASC",
+    "ORDER BY f.disc ASC",
+    "ORDER BY f.track ASC",
+    "ORDER BY f.virtual_path ASC",
+    "ORDER BY pos ASC",
+    "ORDER BY shuffle_pos ASC",
+  };
+
+/* The files columns of the sort_clause_files orders, in the same order, that a
+ * keyset cursor continues from (see db_query_cursor_make). The id is added as
+ * the last key.
+ */
+static const char *sort_keys[][5] =
+  {
+    { NULL },
+    { "title_sort_ord", NULL },
+    { "album_sort_ord", "disc", "track", NULL },
+    { "album_artist_sort_ord", "album_sort_ord", "disc", "track", NULL },
+    { NULL },
+    { "year", NULL },
+    { "genre", NULL },
+    { "composer_sort_ord", NULL },
+    { "disc", NULL },
+    { "track", NULL },
+    { "virtual_path", NULL },
+    { NULL },
+    { NULL },
+  };
+
 /* Shuffle RNG state */
 struct rng_ctx shuffle_rng;
 
 static char *db_path;
 static __thread sqlite3 *hdl;
 
+/* Prepared statements for queries that run very often (e.g. once per file
+ * during a rescan). They are prepared once per thread on first use and kept
+ * until db_perthread_deinit(), parameters are bound on each run.
+ */
+enum db_stmt_type
+{
+  DB_STMT_FILE_PING,
+  DB_STMT_FILE_PING_BYPATH,
+  DB_STMT_FILE_INC_PLAYCOUNT,
+  DB_STMT_FILE_ID_BYPATH,
+  DB_STMT_FILE_PATH_BYID,
+  DB_STMT_FILE_FETCH_BYID,
+  DB_STMT_QUEUE_SET_POS,
+  DB_STMT_QUEUE_SET_SHUFFLE_POS,
+  DB_STMT_MAX,
+};
+
+static const char *db_stmt_queries[DB_STMT_MAX] =
+  {
+    "UPDATE files SET db_timestamp = ?1, disabled = 0 WHERE id = ?2;",
+    "UPDATE files SET db_timestamp = ?1, disabled = 0 WHERE path = ?2 AND db_timestamp >= ?3;",
+    "UPDATE files SET play_count = play_count + 1, time_played = ?1, seek = 0 WHERE id = ?2;",
+    "SELECT f.id FROM files f WHERE f.path = ?1;",
+    "SELECT f.path FROM files f WHERE f.id = ?1;",
+    "SELECT f.* FROM files f WHERE f.id = ?1;",
+    "UPDATE queue SET pos = ?1, queue_version = ?2 WHERE id = ?3;",
+    "UPDATE queue SET shuffle_pos = ?1 WHERE id = ?2;",
+  };
+
+static __thread sqlite3_stmt *db_stmt_cache[DB_STMT_MAX];
+
+/* Full-text index for searches, see db_fts_init(). The trigram tokenizer
+ * makes "column MATCH x" behave like "column LIKE '%x%'", so it can replace
+ * substring searches, but only for values of three characters or more.
+ */
+#define DB_FTS_MIN_CHARS 3
+
+static const char *db_fts_columns[] =
+  {
+    "title", "artist", "album", "album_artist", "composer", "genre",
+  };
+
+static bool db_fts_enabled;
+
+/* Statement timing, see db_query_stats_cb(). Enabled by the sqlite section's
+ * slow_query_threshold option. Statements are aggregated with their literals
+ * replaced by '?', only the DB_QUERY_STATS_MAX most expensive are kept.
+ */
+#define DB_QUERY_STATS_MAX 50
+
+static struct db_query_stats db_query_stats[DB_QUERY_STATS_MAX];
+static int db_query_nstats;
+static pthread_mutex_t db_query_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+static int db_slow_query_ms;
+static struct metrics_metric *db_metric_duration;
+
+/* Index advisor, see db_index_advise(). The columns that the WHERE and ORDER
+ * BY clauses of statements on the files table use are counted together with
+ * the time the statements took. Enabled by the sqlite section's auto_indexes
+ * option, which is the number of indices it may create.
+ */
+#define DB_INDEX_PATTERNS_MAX 32
+#define DB_INDEX_COLS_MAX 6
+#define DB_INDEX_NAME_LEN 32
+// Observations of a pattern before it gets an index, and between runs
+#define DB_INDEX_MIN_COUNT 20
+#define DB_INDEX_RUN_EVERY 5000
+// Patterns that are already this fast don't need an index
+#define DB_INDEX_MIN_AVG_USEC 2000
+
+struct db_index_col
+{
+  char name[DB_INDEX_NAME_LEN];
+  char literal[24];   // Integer the column was always compared with, or ""
+  bool varies;
+};
+
+struct db_index_pattern
+{
+  struct db_index_col eq[DB_INDEX_COLS_MAX];
+  int neq;
+  char range[DB_INDEX_NAME_LEN];
+  char order[DB_INDEX_COLS_MAX][DB_INDEX_NAME_LEN];
+  int norder;
+
+  uint64_t count;
+  uint64_t total_usec;
+};
+
+static struct db_index_pattern db_index_patterns[DB_INDEX_PATTERNS_MAX];
+static int db_index_npatterns;
+static uint64_t db_index_observed;
+static pthread_mutex_t db_index_lck = PTHREAD_MUTEX_INITIALIZER;
+static int db_index_max;
+static int64_t db_index_max_bytes;
+
+/* Slow statement of this thread waiting to have its query plan logged */
+/* Queue batch of this thread, see db_queue_batch_begin() */
+static __thread bool db_queue_batch;
+static __thread int db_queue_batch_version;
+static __thread bool db_queue_batch_changed;
+static __thread int db_queue_batch_savepoints;
+
+static __thread char *db_slow_query;
+static __thread uint64_t db_slow_query_usec;
+static __thread bool db_slow_query_explaining;
+
+/* Fetch results of this thread's request, see db_arena_begin() */
+static __thread struct arena db_arena;
+static __thread int db_arena_depth;
+
+/* Tag strings of this thread's fetch results are interned, see db_intern_begin() */
+static __thread int db_intern_depth;
+
+/* Background maintenance, see db_maintenance_run(). Requests mark the time
+ * they were made in db_arena_begin(), so idle periods can be told.
+ */
+static int db_maintenance_tasks;
+static time_t db_request_last;
+
+/* In-memory mode (sqlite section's in_memory option): the library is copied
+ * from db_path into a shared in-memory database at startup, which all
+ * threads then open, and written back by db_persist(). db_memory_hdl keeps
+ * the in-memory database alive and is only used for the copies.
+ */
+#define DB_MEMORY_URI "file:forked-daapd-library?mode=memory&cache=shared"
+
+static sqlite3 *db_memory_hdl;
+static int db_memory_version;
+static int db_persist_secs;
+static pthread_mutex_t db_memory_lck = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cached item counts of smart playlists, see db_smartpl_count_items(). An
+ * entry is valid while no library change was made (db_revision) and for at
+ * most DB_SMARTPL_CACHE_SECS, since rules like "added in the last week" also
+ * change their result over time.
+ */
+#define DB_SMARTPL_CACHE_MAX 64
+#define DB_SMARTPL_CACHE_SECS 60
+
+struct db_smartpl_count {
+  char *query;
+  int count;
+  unsigned int revision;
+  time_t stamp;
+};
+
+static struct db_smartpl_count db_smartpl_cache[DB_SMARTPL_CACHE_MAX];
+static unsigned int db_revision;
+static unsigned int db_queue_revision;
+static pthread_mutex_t db_smartpl_cache_lck = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cache of directory ids by virtual path, see db_directory_id_byvirtualpath().
+ * Shared by all threads. Point writes through db_directory_* keep it current,
+ * bulk updates of the directories table clear it.
+ */
+#define DB_DIRCACHE_BUCKETS 4096
+#define DB_DIRCACHE_MAX 100000
+
+struct db_dircache_entry {
+  char *virtual_path;
+  int id;
+
+  struct db_dircache_entry *next;
+};
+
+static struct db_dircache_entry *db_dircache[DB_DIRCACHE_BUCKETS];
+static int db_dircache_count;
+static pthread_mutex_t db_dircache_lck = PTHREAD_MUTEX_INITIALIZER;
+
+/* Rows per batch of db_purge_batched() */
+static int db_purge_batch;
+
+/* Seconds the file_changes log is kept, remote clients holding a revision
+ * older than this get a full song list instead of a delta
+ */
+#define DB_FILE_CHANGES_KEEP (7 * 24 * 3600)
+
+/* Zone served by this instance; all queue queries are restricted to it */
+static int db_zone;
+
+/* Set if another instance scans the library into this database, see the
+ * library section's frontend option. This instance then only writes its
+ * queue, its admin keys and play counts, and leaves schema changes and
+ * maintenance to the scanning instance.
+ */
+static bool db_frontend;
+static char db_queue_version_key[32];
+
 
 /* Forward */
 static int
 db_pl_count_items(int id, int streams_only);
 
+static void
+db_dircache_clear(void);
+
 static int
 db_smartpl_count_items(const char *smartpl_query);
 
@@ -331,6 +586,12 @@ db_group_type_bypersistentid(int64_t persistentid);
 static int
 db_query_run(char *query, int free, short update_events);
 
+static void
+db_update_trigger(short update_events);
+
+static int
+db_get_one_int(const char *query);
+
 
 char *
 db_escape_string(const char *str)
@@ -376,6 +637,94 @@ db_mprintf(const char *fmt, ...)
   return query;
 }
 
+static bool
+db_fts_column_indexed(const char *column)
+{
+  int i;
+
+  for (i = 0; i < sizeof(db_fts_columns) / sizeof(db_fts_columns[0]); i++)
+    {
+      if (strcmp(column, db_fts_columns[i]) == 0)
+	return true;
+    }
+
+  return false;
+}
+
+/*
+ * Returns a condition for files where one of the given columns (space
+ * separated, e.g. "f.artist f.album f.title") contains value, using the
+ * full-text index. Returns NULL if the index can't be used, the caller should
+ * then fall back to LIKE. Free the result with free().
+ */
+char *
+db_fts_contains(const char *columns, const char *value)
+{
+  char *cols;
+  char *col;
+  char *ptr;
+  char *match;
+  char *m;
+  const char *v;
+  char *ret;
+  int nchars;
+
+  if (!__atomic_load_n(&db_fts_enabled, __ATOMIC_ACQUIRE) || !value)
+    return NULL;
+
+  // Count UTF-8 characters, trigrams need at least three
+  for (nchars = 0, v = value; *v; v++)
+    {
+      if ((*v & 0xC0) != 0x80)
+	nchars++;
+    }
+
+  if (nchars < DB_FTS_MIN_CHARS)
+    return NULL;
+
+  CHECK_NULL(L_DB, cols = strdup(columns));
+  CHECK_NULL(L_DB, match = malloc(strlen(columns) + 2 * strlen(value) + 8));
+
+  // Builds {col1 col2} : "value" with any " in value doubled
+  m = match;
+  *m++ = '{';
+  for (col = strtok_r(cols, " ", &ptr); col; col = strtok_r(NULL, " ", &ptr))
+    {
+      if (strncmp(col, "f.", 2) == 0)
+	col += 2;
+
+      if (!db_fts_column_indexed(col))
+	{
+	  free(cols);
+	  free(match);
+	  return NULL;
+	}
+
+      if (m[-1] != '{')
+	*m++ = ' ';
+      strcpy(m, col);
+      m += strlen(col);
+    }
+
+  strcpy(m, "} : \"");
+  m += strlen(m);
+  for (v = value; *v; v++)
+    {
+      if (*v == '"')
+	*m++ = '"';
+      *m++ = *v;
+    }
+  *m++ = '"';
+  *m = '\0';
+
+  ret = db_mprintf("f.id IN (SELECT rowid FROM files_fts WHERE files_fts MATCH '%q')", match);
+
+  free(cols);
+  free(match);
+
+  return ret;
+}
+
 int
 db_snprintf(char *s, int n, const char *fmt, ...)
 {
@@ -398,6 +747,57 @@ db_snprintf(char *s, int n, const char *fmt, ...)
   return 0;
 }
 
+static void *
+db_calloc(size_t size)
+{
+  if (db_arena_depth > 0)
+    return arena_calloc(&db_arena, size);
+
+  return calloc(1, size);
+}
+
+static char *
+db_strdup(const char *str)
+{
+  if (db_arena_depth > 0)
+    return arena_strdup(&db_arena, str);
+
+  return strdup(str);
+}
+
+// A caller may have replaced a field of an arena result with its own string,
+// so each pointer is checked
+static void
+db_free(void *ptr)
+{
+  if (!ptr)
+    return;
+
+  if (db_arena_depth > 0 && arena_contains(&db_arena, ptr))
+    return;
+
+  free(ptr);
+}
+
+static char *
+db_strdup_tag(const char *str)
+{
+  if (db_intern_depth > 0)
+    return strintern_get(str);
+
+  return db_strdup(str);
+}
+
+// Results may outlive db_intern_end(), so this doesn't depend on the depth
+static void
+db_free_tag(void *ptr)
+{
+  if (strintern_put(ptr))
+    return;
+
+  db_free(ptr);
+}
+
 void
 free_pi(struct pairing_info *pi, int content_only)
 {
@@ -420,33 +820,33 @@ free_mfi(struct media_file_info *mfi, int content_only)
   if (!mfi)
     return;
 
-  free(mfi->path);
-  free(mfi->fname);
-  free(mfi->title);
-  free(mfi->artist);
-  free(mfi->album);
-  free(mfi->genre);
-  free(mfi->comment);
-  free(mfi->type);
-  free(mfi->composer);
-  free(mfi->orchestra);
-  free(mfi->conductor);
-  free(mfi->grouping);
-  free(mfi->description);
-  free(mfi->codectype);
-  free(mfi->album_artist);
-  free(mfi->tv_series_name);
-  free(mfi->tv_episode_num_str);
-  free(mfi->tv_network_name);
-  free(mfi->title_sort);
-  free(mfi->artist_sort);
-  free(mfi->album_sort);
-  free(mfi->composer_sort);
-  free(mfi->album_artist_sort);
-  free(mfi->virtual_path);
+  db_free(mfi->path);
+  db_free(mfi->fname);
+  db_free(mfi->title);
+  db_free_tag(mfi->artist);
+  db_free_tag(mfi->album);
+  db_free_tag(mfi->genre);
+  db_free(mfi->comment);
+  db_free(mfi->type);
+  db_free_tag(mfi->composer);
+  db_free(mfi->orchestra);
+  db_free(mfi->conductor);
+  db_free(mfi->grouping);
+  db_free(mfi->description);
+  db_free(mfi->codectype);
+  db_free_tag(mfi->album_artist);
+  db_free(mfi->tv_series_name);
+  db_free(mfi->tv_episode_num_str);
+  db_free(mfi->tv_network_name);
+  db_free(mfi->title_sort);
+  db_free(mfi->artist_sort);
+  db_free(mfi->album_sort);
+  db_free(mfi->composer_sort);
+  db_free(mfi->album_artist_sort);
+  db_free(mfi->virtual_path);
 
   if (!content_only)
-    free(mfi);
+    db_free(mfi);
   else
     memset(mfi, 0, sizeof(struct media_file_info));
 }
@@ -502,24 +902,65 @@ free_queue_item(struct db_queue_item *queue_item, int content_only)
   if (!queue_item)
     return;
 
-  free(queue_item->path);
-  free(queue_item->virtual_path);
-  free(queue_item->title);
-  free(queue_item->artist);
-  free(queue_item->album_artist);
-  free(queue_item->album);
-  free(queue_item->genre);
-  free(queue_item->artist_sort);
-  free(queue_item->album_sort);
-  free(queue_item->album_artist_sort);
-  free(queue_item->artwork_url);
+  db_free(queue_item->path);
+  db_free(queue_item->virtual_path);
+  db_free(queue_item->title);
+  db_free_tag(queue_item->artist);
+  db_free_tag(queue_item->album_artist);
+  db_free_tag(queue_item->album);
+  db_free_tag(queue_item->genre);
+  db_free(queue_item->artist_sort);
+  db_free(queue_item->album_sort);
+  db_free(queue_item->album_artist_sort);
+  db_free(queue_item->artwork_url);
 
   if (!content_only)
-    free(queue_item);
+    db_free(queue_item);
   else
     memset(queue_item, 0, sizeof(struct db_queue_item));
 }
 
+void
+db_arena_begin(void)
+{
+  if (db_arena_depth == 0)
+    __atomic_store_n(&db_request_last, time(NULL), __ATOMIC_RELAXED);
+
+  db_arena_depth++;
+}
+
+void
+db_intern_begin(void)
+{
+  db_intern_depth++;
+}
+
+void
+db_intern_end(void)
+{
+  if (db_intern_depth == 0)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: db_intern_end() without db_intern_begin()\n");
+      return;
+    }
+
+  db_intern_depth--;
+}
+
+void
+db_arena_end(void)
+{
+  if (db_arena_depth == 0)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: db_arena_end() without db_arena_begin()\n");
+      return;
+    }
+
+  db_arena_depth--;
+  if (db_arena_depth == 0)
+    arena_reset(&db_arena);
+}
+
 void
 unicode_fixup_mfi(struct media_file_info *mfi)
 {
@@ -605,105 +1046,1074 @@ db_wait_unlock(void)
   return ret;
 }
 
-static int
-db_blocking_step(sqlite3_stmt *stmt)
+#if SQLITE_VERSION_NUMBER >= 3014000
+/* Replaces string and number literals with '?', so that statements built
+ * with different values are counted together
+ */
+static char *
+db_query_normalize(const char *query)
 {
-  int ret;
+  const char *p;
+  char *out;
+  char *o;
 
-  while ((ret = sqlite3_step(stmt)) == SQLITE_LOCKED)
+  out = malloc(strlen(query) + 1);
+  if (!out)
+    return NULL;
+
+  p = query;
+  o = out;
+  while (*p)
     {
-      ret = db_wait_unlock();
-      if (ret != SQLITE_OK)
+      if (*p == '\'')
 	{
-	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
-	  break;
+	  for (p++; *p; p++)
+	    {
+	      if (*p != '\'')
+		continue;
+	      if (*(p + 1) != '\'')
+		{
+		  p++;
+		  break;
+		}
+	      p++; // Escaped quote
+	    }
+
+	  *o++ = '?';
 	}
+      else if (isdigit((unsigned char)*p) && ((o == out) || !(isalnum((unsigned char)*(o - 1)) || (*(o - 1) == '_'))))
+	{
+	  while (isdigit((unsigned char)*p) || (*p == '.'))
+	    p++;
 
-      sqlite3_reset(stmt);
+	  *o++ = '?';
+	}
+      else
+	*o++ = *p++;
     }
 
-  return ret;
+  *o = '\0';
+
+  return out;
 }
 
-static int
-db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const char **end)
+static void
+db_query_stats_add(const char *sql, uint64_t usec)
 {
-  int ret;
+  struct db_query_stats *qs;
+  char *query;
+  int i;
 
-  while ((ret = sqlite3_prepare_v2(hdl, query, len, stmt, end)) == SQLITE_LOCKED)
+  query = db_query_normalize(sql);
+  if (!query)
+    return;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_query_stats_lck));
+
+  qs = NULL;
+  for (i = 0; i < db_query_nstats; i++)
     {
-      ret = db_wait_unlock();
-      if (ret != SQLITE_OK)
+      if (strcmp(db_query_stats[i].query, query) == 0)
 	{
-	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
+	  qs = &db_query_stats[i];
 	  break;
 	}
     }
 
-  return ret;
-}
-
-
-/* Modelled after sqlite3_exec() */
-static int
-db_exec(const char *query, char **errmsg)
-{
-  sqlite3_stmt *stmt;
-  int try;
-  int ret;
-
-  *errmsg = NULL;
+  if (qs)
+    {
+      free(query);
+    }
+  else if (db_query_nstats < DB_QUERY_STATS_MAX)
+    {
+      qs = &db_query_stats[db_query_nstats];
+      db_query_nstats++;
 
-  for (try = 0; try < 5; try++)
+      memset(qs, 0, sizeof(struct db_query_stats));
+      qs->query = query;
+    }
+  else
     {
-      ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-      if (ret != SQLITE_OK)
+      // Full, so evict the statement with the lowest total time if this one
+      // already took longer than that
+      qs = &db_query_stats[0];
+      for (i = 1; i < db_query_nstats; i++)
 	{
-	  *errmsg = sqlite3_mprintf("prepare failed: %s", sqlite3_errmsg(hdl));
-	  return ret;
+	  if (db_query_stats[i].total_usec < qs->total_usec)
+	    qs = &db_query_stats[i];
 	}
 
-      while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
-	; /* EMPTY */
-
-      sqlite3_finalize(stmt);
-
-      if (ret != SQLITE_SCHEMA)
-	break;
+      if (qs->total_usec < usec)
+	{
+	  free(qs->query);
+	  memset(qs, 0, sizeof(struct db_query_stats));
+	  qs->query = query;
+	}
+      else
+	{
+	  free(query);
+	  qs = NULL;
+	}
     }
 
-  if (ret != SQLITE_DONE)
+  if (qs)
     {
-      *errmsg = sqlite3_mprintf("step failed: %s", sqlite3_errmsg(hdl));
-      return ret;
+      qs->count++;
+      qs->total_usec += usec;
+      if (usec > qs->max_usec)
+	qs->max_usec = usec;
     }
 
-  return SQLITE_OK;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_query_stats_lck));
 }
 
-
-/* Maintenance and DB hygiene */
-static void
-db_analyze(void)
+/* Reads a column name, NULL if it doesn't fit */
+static const char *
+db_index_ident(const char *p, char *name)
 {
-  char *query = "ANALYZE;";
-  char *errmsg;
-  int ret;
+  size_t n;
 
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+  for (n = 0; isalnum((unsigned char)p[n]) || (p[n] == '_'); n++)
+    ;
 
-  ret = db_exec(query, &errmsg);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "ANALYZE failed: %s\n", errmsg);
+  if (n == 0 || n >= DB_INDEX_NAME_LEN)
+    return NULL;
 
-      sqlite3_free(errmsg);
-    }
+  memcpy(name, p, n);
+  name[n] = '\0';
+
+  return p + n;
 }
 
-/* Set names of default playlists according to config */
-static void
-db_set_cfg_names(void)
+static const char *
+db_index_find(const char *haystack, const char *needle, const char *end)
+{
+  const char *p;
+
+  p = strstr(haystack, needle);
+
+  return (p && p < end) ? p : NULL;
+}
+
+static int
+db_index_col_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct db_index_col *)a)->name, ((const struct db_index_col *)b)->name);
+}
+
+/* Gets the columns of the files table that a statement filters on with "=" or
+ * IN (eq), with a range (the first of those only, an index can't use more),
+ * and sorts by. Only plain AND conditions on "files f" are considered, other
+ * statements are left to the indices from db_init.c.
+ */
+static int
+db_index_parse(const char *sql, struct db_index_pattern *pat)
+{
+  struct db_index_col *col;
+  char name[DB_INDEX_NAME_LEN];
+  const char *from;
+  const char *where;
+  const char *order;
+  const char *end;
+  const char *p;
+  size_t n;
+  int i;
+
+  if (strncmp(sql, "SELECT ", strlen("SELECT ")) != 0)
+    return -1;
+
+  from = strstr(sql, " FROM files f ");
+  if (!from || strstr(from, " JOIN ") || strstr(from, "SELECT "))
+    return -1;
+
+  memset(pat, 0, sizeof(struct db_index_pattern));
+
+  end = from + strlen(from);
+  order = strstr(from, " ORDER BY ");
+  where = db_index_find(from, " WHERE ", order ? order : end);
+  if (where)
+    {
+      end = order ? order : end;
+      if ((p = db_index_find(where, " GROUP BY ", end)))
+	end = p;
+      if ((p = db_index_find(where, " LIMIT ", end)))
+	end = p;
+
+      if (db_index_find(where, " OR ", end))
+	return -1;
+
+      for (p = where; (p = db_index_find(p, "f.", end)); )
+	{
+	  if (isalnum((unsigned char)p[-1]) || (p[-1] == '_') || (p[-1] == '.'))
+	    {
+	      p += 2;
+	      continue;
+	    }
+
+	  p = db_index_ident(p + 2, name);
+	  if (!p)
+	    return -1;
+
+	  while (*p == ' ')
+	    p++;
+
+	  if ((p[0] == '=') || (strncmp(p, "IN ", 3) == 0) || (strncmp(p, "IN(", 3) == 0))
+	    {
+	      for (i = 0; i < pat->neq && strcmp(pat->eq[i].name, name) != 0; i++)
+		;
+	      if (i < pat->neq || pat->neq == DB_INDEX_COLS_MAX)
+		continue;
+
+	      col = &pat->eq[pat->neq++];
+	      strcpy(col->name, name);
+
+	      // Integer literals may go to the WHERE clause of a partial index
+	      if (p[0] != '=')
+		continue;
+	      for (p += (p[1] == '=') ? 2 : 1; *p == ' '; p++)
+		;
+	      n = strspn(p, "-0123456789");
+	      if (n > 0 && n < sizeof(col->literal) && !isalnum((unsigned char)p[n]) && p[n] != '.' && p[n] != '_')
+		memcpy(col->literal, p, n);
+	    }
+	  else if ((p[0] == '<') || (p[0] == '>') || (strncmp(p, "BETWEEN ", 8) == 0))
+	    {
+	      if (pat->range[0] == '\0' && p[1] != '>')
+		strcpy(pat->range, name);
+	    }
+	}
+
+      qsort(pat->eq, pat->neq, sizeof(struct db_index_col), db_index_col_cmp);
+    }
+
+  if (order)
+    {
+      for (p = order + strlen(" ORDER BY "); pat->norder < DB_INDEX_COLS_MAX; )
+	{
+	  if (strncmp(p, "f.", 2) != 0)
+	    break;
+
+	  p = db_index_ident(p + 2, name);
+	  if (!p)
+	    break;
+
+	  // A collation the index doesn't have makes it useless for sorting
+	  if (strncmp(p, " COLLATE", strlen(" COLLATE")) == 0)
+	    break;
+
+	  strcpy(pat->order[pat->norder++], name);
+
+	  if (strncmp(p, " ASC", 4) == 0)
+	    p += 4;
+	  else if (strncmp(p, " DESC", 5) == 0)
+	    p += 5;
+
+	  if (strncmp(p, ", ", 2) != 0)
+	    break;
+
+	  p += 2;
+	}
+    }
+
+  return (pat->neq + pat->norder > 0 || pat->range[0]) ? 0 : -1;
+}
+
+static bool
+db_index_pattern_equal(struct db_index_pattern *a, struct db_index_pattern *b)
+{
+  int i;
+
+  if (a->neq != b->neq || a->norder != b->norder || strcmp(a->range, b->range) != 0)
+    return false;
+
+  for (i = 0; i < a->neq; i++)
+    {
+      if (strcmp(a->eq[i].name, b->eq[i].name) != 0)
+	return false;
+    }
+
+  for (i = 0; i < a->norder; i++)
+    {
+      if (strcmp(a->order[i], b->order[i]) != 0)
+	return false;
+    }
+
+  return true;
+}
+
+static void
+db_index_pattern_add(const char *sql, uint64_t usec)
+{
+  struct db_index_pattern pat;
+  struct db_index_pattern *ip;
+  bool run;
+  int i;
+
+  if (db_index_parse(sql, &pat) < 0)
+    return;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_index_lck));
+
+  ip = NULL;
+  for (i = 0; i < db_index_npatterns; i++)
+    {
+      if (db_index_pattern_equal(&db_index_patterns[i], &pat))
+	{
+	  ip = &db_index_patterns[i];
+	  break;
+	}
+    }
+
+  if (ip)
+    {
+      // A column that isn't always compared with the same value is indexed
+      for (i = 0; i < ip->neq; i++)
+	{
+	  if (strcmp(ip->eq[i].literal, pat.eq[i].literal) != 0)
+	    ip->eq[i].varies = true;
+	}
+    }
+  else if (db_index_npatterns < DB_INDEX_PATTERNS_MAX)
+    {
+      ip = &db_index_patterns[db_index_npatterns++];
+      *ip = pat;
+    }
+  else
+    {
+      // Same eviction as for the statement stats
+      ip = &db_index_patterns[0];
+      for (i = 1; i < db_index_npatterns; i++)
+	{
+	  if (db_index_patterns[i].total_usec < ip->total_usec)
+	    ip = &db_index_patterns[i];
+	}
+
+      if (ip->total_usec < usec)
+	*ip = pat;
+      else
+	ip = NULL;
+    }
+
+  if (ip)
+    {
+      ip->count++;
+      ip->total_usec += usec;
+    }
+
+  db_index_observed++;
+  run = (db_index_observed % DB_INDEX_RUN_EVERY == 0);
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_index_lck));
+
+  if (run)
+    db_maintenance_schedule(DB_MAINTENANCE_AUTO_INDEX);
+}
+
+/* Called by SQLite when a statement finishes. Since we must not use the
+ * connection from here, logging the query plan of a slow statement is left to
+ * db_slow_query_log(), which runs at the next step or prepare.
+ */
+static int
+db_query_stats_cb(unsigned int type, void *arg, void *p, void *x)
+{
+  const char *sql;
+  uint64_t usec;
+
+  if ((type != SQLITE_TRACE_PROFILE) || db_slow_query_explaining)
+    return 0;
+
+  sql = sqlite3_sql((sqlite3_stmt *)p);
+  if (!sql)
+    return 0;
+
+  usec = *(sqlite3_int64 *)x / 1000;
+
+  metrics_histogram_observe(db_metric_duration, usec);
+
+  if (db_index_max > 0)
+    db_index_pattern_add(sql, usec);
+
+  // The trace may only be there for the metrics
+  if (db_slow_query_ms <= 0)
+    return 0;
+
+  db_query_stats_add(sql, usec);
+
+  if (!db_slow_query && (usec >= (uint64_t)db_slow_query_ms * 1000))
+    {
+      db_slow_query = strdup(sql);
+      db_slow_query_usec = usec;
+    }
+
+  return 0;
+}
+#endif
+
+static void
+db_slow_query_log(void)
+{
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  DPRINTF(E_WARN, L_DB, "Slow query (%" PRIu64 " ms): %s\n", db_slow_query_usec / 1000, db_slow_query);
+
+  query = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", db_slow_query);
+
+  free(db_slow_query);
+  db_slow_query = NULL;
+
+  if (!query)
+    return;
+
+  db_slow_query_explaining = true;
+
+  ret = sqlite3_prepare_v2(hdl, query, -1, &stmt, NULL);
+  if (ret == SQLITE_OK)
+    {
+      while (sqlite3_step(stmt) == SQLITE_ROW)
+	DPRINTF(E_WARN, L_DB, "Query plan: %s\n", (const char *)sqlite3_column_text(stmt, 3));
+
+      sqlite3_finalize(stmt);
+    }
+  else
+    DPRINTF(E_DBG, L_DB, "Could not get query plan: %s\n", sqlite3_errmsg(hdl));
+
+  db_slow_query_explaining = false;
+
+  sqlite3_free(query);
+}
+
+static int
+db_blocking_step(sqlite3_stmt *stmt)
+{
+  int ret;
+
+  while ((ret = sqlite3_step(stmt)) == SQLITE_LOCKED)
+    {
+      ret = db_wait_unlock();
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
+	  break;
+	}
+
+      sqlite3_reset(stmt);
+    }
+
+  if (db_slow_query)
+    db_slow_query_log();
+
+  return ret;
+}
+
+static int
+db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const char **end)
+{
+  int ret;
+
+  if (db_slow_query)
+    db_slow_query_log();
+
+  while ((ret = sqlite3_prepare_v2(hdl, query, len, stmt, end)) == SQLITE_LOCKED)
+    {
+      ret = db_wait_unlock();
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
+	  break;
+	}
+    }
+
+  return ret;
+}
+
+/* Returns the cached statement of the given type, preparing it if this thread
+ * hasn't used it before. Bind the parameters, step, then give it back with
+ * db_stmt_release().
+ */
+static sqlite3_stmt *
+db_stmt_get(enum db_stmt_type type)
+{
+  int ret;
+
+  if (db_stmt_cache[type])
+    return db_stmt_cache[type];
+
+  ret = db_blocking_prepare_v2(db_stmt_queries[type], -1, &db_stmt_cache[type], NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement '%s': %s\n", db_stmt_queries[type], sqlite3_errmsg(hdl));
+
+      db_stmt_cache[type] = NULL;
+      return NULL;
+    }
+
+  return db_stmt_cache[type];
+}
+
+static void
+db_stmt_release(sqlite3_stmt *stmt)
+{
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
+
+static void
+db_stmt_cache_clear(void)
+{
+  int i;
+
+  for (i = 0; i < DB_STMT_MAX; i++)
+    {
+      if (!db_stmt_cache[i])
+	continue;
+
+      sqlite3_finalize(db_stmt_cache[i]);
+      db_stmt_cache[i] = NULL;
+    }
+}
+
+
+/* Modelled after sqlite3_exec() */
+static int
+db_exec(const char *query, char **errmsg)
+{
+  sqlite3_stmt *stmt;
+  int try;
+  int ret;
+
+  *errmsg = NULL;
+
+  for (try = 0; try < 5; try++)
+    {
+      ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+      if (ret != SQLITE_OK)
+	{
+	  *errmsg = sqlite3_mprintf("prepare failed: %s", sqlite3_errmsg(hdl));
+	  return ret;
+	}
+
+      while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+	; /* EMPTY */
+
+      sqlite3_finalize(stmt);
+
+      if (ret != SQLITE_SCHEMA)
+	break;
+    }
+
+  if (ret != SQLITE_DONE)
+    {
+      *errmsg = sqlite3_mprintf("step failed: %s", sqlite3_errmsg(hdl));
+      return ret;
+    }
+
+  return SQLITE_OK;
+}
+
+
+/* Maintenance and DB hygiene */
+static void
+db_analyze(void)
+{
+  char *query = "ANALYZE;";
+  char *errmsg;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_exec(query, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "ANALYZE failed: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+    }
+}
+
+#define DB_INDEX_DEFS_MAX 64
+
+struct db_index_def
+{
+  char name[64];
+  char cols[DB_INDEX_COLS_MAX][DB_INDEX_NAME_LEN];
+  int ncols;
+};
+
+struct db_index_plan
+{
+  char name[DB_INDEX_NAME_LEN];
+  char cols[DB_INDEX_COLS_MAX * (DB_INDEX_NAME_LEN + 2)];
+  char where[DB_INDEX_COLS_MAX * (DB_INDEX_NAME_LEN + 32)];
+  char names[DB_INDEX_COLS_MAX][DB_INDEX_NAME_LEN];
+  int ncols;
+  int64_t bytes;
+};
+
+static int
+db_index_names_get(const char *query, struct db_index_def *defs, int max)
+{
+  sqlite3_stmt *stmt;
+  int n;
+  int ret;
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return 0;
+    }
+
+  for (n = 0; n < max && db_blocking_step(stmt) == SQLITE_ROW; n++)
+    {
+      snprintf(defs[n].name, sizeof(defs[n].name), "%s", (const char *)sqlite3_column_text(stmt, 0));
+      defs[n].ncols = 0;
+    }
+
+  sqlite3_finalize(stmt);
+
+  return n;
+}
+
+static void
+db_index_cols_get(struct db_index_def *def)
+{
+  sqlite3_stmt *stmt;
+  const char *name;
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf("PRAGMA index_info(%Q);", def->name);
+  if (!query)
+    return;
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    return;
+
+  // Expressions have no name and end what an index can be used for
+  while (def->ncols < DB_INDEX_COLS_MAX && db_blocking_step(stmt) == SQLITE_ROW)
+    {
+      name = (const char *)sqlite3_column_text(stmt, 2);
+      if (!name)
+	break;
+
+      snprintf(def->cols[def->ncols], DB_INDEX_NAME_LEN, "%s", name);
+      def->ncols++;
+    }
+
+  sqlite3_finalize(stmt);
+}
+
+/* An index serves the pattern if it starts with its eq columns, in any order,
+ * followed by the range or the first sort column
+ */
+static bool
+db_index_covered(struct db_index_pattern *pat, struct db_index_def *defs, int ndefs)
+{
+  const char *next;
+  int i;
+  int j;
+  int k;
+
+  next = pat->range[0] ? pat->range : (pat->norder > 0 ? pat->order[0] : NULL);
+
+  for (i = 0; i < ndefs; i++)
+    {
+      if (defs[i].ncols < pat->neq + (next ? 1 : 0))
+	continue;
+
+      for (j = 0; j < pat->neq; j++)
+	{
+	  for (k = 0; k < pat->neq && strcmp(defs[i].cols[j], pat->eq[k].name) != 0; k++)
+	    ;
+	  if (k == pat->neq)
+	    break;
+	}
+
+      if (j < pat->neq)
+	continue;
+
+      if (next && strcmp(defs[i].cols[pat->neq], next) != 0)
+	continue;
+
+      return true;
+    }
+
+  return false;
+}
+
+static void
+db_index_plan_col(struct db_index_plan *plan, const char *name)
+{
+  int i;
+
+  if (plan->ncols == DB_INDEX_COLS_MAX)
+    return;
+
+  for (i = 0; i < plan->ncols; i++)
+    {
+      if (strcmp(plan->names[i], name) == 0)
+	return;
+    }
+
+  strcpy(plan->names[plan->ncols], name);
+  snprintf(plan->cols + strlen(plan->cols), sizeof(plan->cols) - strlen(plan->cols), "%s%s", plan->ncols ? ", " : "", name);
+  plan->ncols++;
+}
+
+/* Makes the index for a pattern: eq columns that were always compared with
+ * the same integer (like disabled = 0) go to the WHERE clause of a partial
+ * index, the rest are the columns. Its size is estimated from the lengths of
+ * the values, so the total can be capped before anything is built.
+ */
+static int
+db_index_plan_make(struct db_index_plan *plan, struct db_index_pattern *pat)
+{
+  sqlite3_stmt *stmt;
+  char sum[DB_INDEX_COLS_MAX * (DB_INDEX_NAME_LEN + 20)];
+  char *query;
+  int64_t rows;
+  int i;
+  int ret;
+
+  memset(plan, 0, sizeof(struct db_index_plan));
+
+  for (i = 0; i < pat->neq; i++)
+    {
+      if (pat->eq[i].literal[0] && !pat->eq[i].varies)
+	snprintf(plan->where + strlen(plan->where), sizeof(plan->where) - strlen(plan->where), "%s%s = %s",
+		 plan->where[0] ? " AND " : "", pat->eq[i].name, pat->eq[i].literal);
+      else
+	db_index_plan_col(plan, pat->eq[i].name);
+    }
+
+  if (pat->range[0])
+    db_index_plan_col(plan, pat->range);
+
+  for (i = 0; i < pat->norder; i++)
+    db_index_plan_col(plan, pat->order[i]);
+
+  if (plan->ncols == 0)
+    return -1;
+
+  snprintf(plan->name, sizeof(plan->name), "idx_auto_%08x", djb_hash(plan->cols, strlen(plan->cols)) ^ djb_hash(plan->where, strlen(plan->where)));
+
+  sum[0] = '\0';
+  for (i = 0; i < plan->ncols; i++)
+    snprintf(sum + strlen(sum), sizeof(sum) - strlen(sum), "%sTOTAL(LENGTH(%s))", i ? " + " : "", plan->names[i]);
+
+  query = sqlite3_mprintf("SELECT COUNT(*), %s FROM files%s%s;", sum, plan->where[0] ? " WHERE " : "", plan->where);
+  if (!query)
+    return -1;
+
+  // Also fails if a column doesn't exist
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_DBG, L_DB, "Not indexing files(%s): %s\n", plan->cols, sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+
+  // Values plus rowid and record header, with room for the b-tree pages
+  rows = sqlite3_column_int64(stmt, 0);
+  plan->bytes = ((int64_t)sqlite3_column_double(stmt, 1) + rows * (10 + 2 * plan->ncols)) * 5 / 4;
+
+  sqlite3_finalize(stmt);
+
+  return 0;
+}
+
+static int
+db_index_pattern_cmp(const void *a, const void *b)
+{
+  const struct db_index_pattern *pa = a;
+  const struct db_index_pattern *pb = b;
+
+  if (pa->total_usec == pb->total_usec)
+    return 0;
+
+  return (pa->total_usec < pb->total_usec) ? 1 : -1;
+}
+
+/* Creates indices for the patterns that took the most time, as long as their
+ * statements are slow and the indices from db_init.c don't already serve
+ * them, and drops the ones made earlier that are no longer among the top
+ * auto_indexes patterns. An index is kept while its pattern is seen, even
+ * though its statements are then fast. Returns the number of new indices.
+ */
+static int
+db_index_advise(void)
+{
+  struct db_index_pattern pats[DB_INDEX_PATTERNS_MAX];
+  struct db_index_def defs[DB_INDEX_DEFS_MAX];
+  struct db_index_def autos[DB_INDEX_DEFS_MAX];
+  struct db_index_plan *plans;
+  struct db_index_plan plan;
+  uint64_t observed;
+  int64_t bytes;
+  bool exists;
+  char *query;
+  char *errmsg;
+  int npats;
+  int ndefs;
+  int nautos;
+  int nplans;
+  int created;
+  int i;
+  int j;
+  int ret;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_index_lck));
+  npats = db_index_npatterns;
+  memcpy(pats, db_index_patterns, npats * sizeof(struct db_index_pattern));
+  observed = db_index_observed;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_index_lck));
+
+  qsort(pats, npats, sizeof(struct db_index_pattern), db_index_pattern_cmp);
+
+  nautos = db_index_names_get("SELECT name FROM sqlite_master WHERE type = 'index' AND name GLOB 'idx_auto_*';", autos, DB_INDEX_DEFS_MAX);
+  ndefs = db_index_names_get("SELECT name FROM sqlite_master WHERE type = 'index' AND tbl_name = 'files' AND name NOT GLOB 'idx_auto_*';", defs, DB_INDEX_DEFS_MAX);
+  for (i = 0; i < ndefs; i++)
+    db_index_cols_get(&defs[i]);
+
+  CHECK_NULL(L_DB, plans = calloc(db_index_max + 1, sizeof(struct db_index_plan)));
+
+  nplans = 0;
+  bytes = 0;
+  for (i = 0; i < npats && nplans < db_index_max; i++)
+    {
+      if (pats[i].count < DB_INDEX_MIN_COUNT || db_index_covered(&pats[i], defs, ndefs))
+	continue;
+
+      if (db_index_plan_make(&plan, &pats[i]) < 0)
+	continue;
+
+      for (j = 0; j < nautos && strcmp(autos[j].name, plan.name) != 0; j++)
+	;
+      exists = (j < nautos);
+
+      if (!exists && pats[i].total_usec / pats[i].count < DB_INDEX_MIN_AVG_USEC)
+	continue;
+
+      for (j = 0; j < nplans && strcmp(plans[j].name, plan.name) != 0; j++)
+	;
+      if (j < nplans)
+	continue;
+
+      if (bytes + plan.bytes > db_index_max_bytes)
+	{
+	  DPRINTF(E_DBG, L_DB, "Not indexing files(%s), would exceed auto_index_max_size\n", plan.cols);
+	  continue;
+	}
+
+      bytes += plan.bytes;
+      plans[nplans++] = plan;
+    }
+
+  // Right after startup there is too little to go by for dropping
+  if (db_index_max == 0 || observed >= DB_INDEX_RUN_EVERY)
+    {
+      for (i = 0; i < nautos; i++)
+	{
+	  for (j = 0; j < nplans && strcmp(plans[j].name, autos[i].name) != 0; j++)
+	    ;
+	  if (j < nplans)
+	    continue;
+
+	  DPRINTF(E_LOG, L_DB, "Dropping index %s, no longer needed\n", autos[i].name);
+
+	  query = sqlite3_mprintf("DROP INDEX IF EXISTS %s;", autos[i].name);
+	  ret = db_exec(query, &errmsg);
+	  sqlite3_free(query);
+	  if (ret != SQLITE_OK)
+	    {
+	      DPRINTF(E_LOG, L_DB, "Could not drop index %s: %s\n", autos[i].name, errmsg);
+	      sqlite3_free(errmsg);
+	    }
+	}
+    }
+
+  created = 0;
+  for (i = 0; i < nplans; i++)
+    {
+      for (j = 0; j < nautos && strcmp(autos[j].name, plans[i].name) != 0; j++)
+	;
+      if (j < nautos)
+	continue;
+
+      DPRINTF(E_LOG, L_DB, "Creating index %s on files(%s)%s%s, about %" PRIi64 " kB\n",
+	      plans[i].name, plans[i].cols, plans[i].where[0] ? " WHERE " : "", plans[i].where, plans[i].bytes / 1024);
+
+      query = sqlite3_mprintf("CREATE INDEX IF NOT EXISTS %s ON files(%s)%s%s;", plans[i].name, plans[i].cols, plans[i].where[0] ? " WHERE " : "", plans[i].where);
+      ret = db_exec(query, &errmsg);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not create index %s: %s\n", plans[i].name, errmsg);
+	  sqlite3_free(errmsg);
+	  continue;
+	}
+
+      created++;
+    }
+
+  free(plans);
+
+  return created;
+}
+
+/* Hashes the definitions of our tables, indices and triggers, so a schema that
+ * was changed outside of an upgrade (or lost indices) is noticed at startup
+ * without having to check each object.
+ */
+static uint64_t
+db_schema_fingerprint(void)
+{
+#define Q_SCHEMA "SELECT type, name, sql FROM sqlite_master WHERE name NOT LIKE 'sqlite_%' AND name NOT GLOB 'idx_auto_*' ORDER BY type, name;"
+  sqlite3_stmt *stmt;
+  const unsigned char *text;
+  uint64_t hash;
+  int i;
+  int ret;
+
+  ret = db_blocking_prepare_v2(Q_SCHEMA, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return 0;
+    }
+
+  // FNV-1a
+  hash = 14695981039346656037ULL;
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    {
+      for (i = 0; i < 3; i++)
+	{
+	  text = sqlite3_column_text(stmt, i);
+	  for (; text && *text; text++)
+	    hash = (hash ^ *text) * 1099511628211ULL;
+
+	  hash = (hash ^ '\n') * 1099511628211ULL;
+	}
+    }
+
+  sqlite3_finalize(stmt);
+
+  return hash;
+#undef Q_SCHEMA
+}
+
+static void
+db_schema_fingerprint_save(void)
+{
+  db_admin_setint64(DB_ADMIN_SCHEMA_FINGERPRINT, (int64_t)db_schema_fingerprint());
+}
+
+void
+db_maintenance_schedule(int tasks)
+{
+  // The scanning instance takes care of the shared database
+  if (db_frontend)
+    return;
+
+  __atomic_or_fetch(&db_maintenance_tasks, tasks, __ATOMIC_RELEASE);
+}
+
+int
+db_maintenance_pending(void)
+{
+  return __atomic_load_n(&db_maintenance_tasks, __ATOMIC_ACQUIRE);
+}
+
+time_t
+db_maintenance_last_request(void)
+{
+  return __atomic_load_n(&db_request_last, __ATOMIC_RELAXED);
+}
+
+void
+db_maintenance_run(int tasks)
+{
+  struct timespec start;
+  struct timespec end;
+  char *errmsg;
+  int ret;
+
+  tasks &= db_maintenance_pending();
+  if (!tasks)
+    return;
+
+  // Cleared first, so what is scheduled while this runs isn't lost
+  __atomic_and_fetch(&db_maintenance_tasks, ~tasks, __ATOMIC_ACQ_REL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (tasks & DB_MAINTENANCE_INDICES)
+    {
+      DPRINTF(E_LOG, L_DB, "Rebuilding database indices, this may take some time...\n");
+
+      ret = db_init_indices(hdl);
+      if (ret < 0)
+	DPRINTF(E_LOG, L_DB, "Could not rebuild database indices\n");
+      else
+	db_schema_fingerprint_save();
+    }
+
+  if (tasks & DB_MAINTENANCE_FTS)
+    {
+      DPRINTF(E_LOG, L_DB, "Building full-text search index\n");
+
+      ret = db_exec("INSERT INTO files_fts (files_fts) VALUES ('rebuild');", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not build full-text search index: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	}
+      else
+	__atomic_store_n(&db_fts_enabled, true, __ATOMIC_RELEASE);
+    }
+
+  // New indices need statistics before the planner picks them
+  if ((tasks & DB_MAINTENANCE_AUTO_INDEX) && db_index_advise() > 0)
+    tasks |= DB_MAINTENANCE_ANALYZE;
+
+  if (tasks & DB_MAINTENANCE_ANALYZE)
+    db_analyze();
+
+  if (tasks & DB_MAINTENANCE_VACUUM)
+    {
+      DPRINTF(E_LOG, L_DB, "Now vacuuming database, this may take some time...\n");
+
+      ret = db_exec("VACUUM;", &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not VACUUM database: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	}
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  DPRINTF(E_LOG, L_DB, "Database maintenance done in %ld ms\n",
+	  (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+}
+
+/* Set names of default playlists according to config */
+static void
+db_set_cfg_names(void)
 {
 #define Q_TMPL "UPDATE playlists SET title = '%q' WHERE type = %d AND special_id = %d;"
   char *cfg_item[6] = { "name_library", "name_music", "name_movies", "name_tvshows", "name_podcasts", "name_audiobooks" };
@@ -753,64 +2163,125 @@ db_set_cfg_names(void)
 void
 db_hook_post_scan(void)
 {
-  DPRINTF(E_DBG, L_DB, "Running post-scan DB maintenance tasks...\n");
+  DPRINTF(E_DBG, L_DB, "Scheduling post-scan DB maintenance tasks\n");
 
-  db_analyze();
+  db_maintenance_schedule(DB_MAINTENANCE_ANALYZE);
 
-  DPRINTF(E_DBG, L_DB, "Done with post-scan DB maintenance\n");
+  if (db_index_max > 0)
+    db_maintenance_schedule(DB_MAINTENANCE_AUTO_INDEX);
 }
 
-void
-db_purge_cruft(time_t ref)
+/* Deletes the rows of the table that match cond in batches of rowid ranges,
+ * each in its own transaction, so that the purge after a rescan doesn't lock
+ * out clients until it is done. The table must have an integer id key.
+ * Returns the number of deleted rows or -1 on error.
+ */
+static int
+db_purge_batched(const char *table, const char *cond, short update_events)
 {
-#define Q_TMPL "DELETE FROM directories WHERE id >= %d AND db_timestamp < %" PRIi64 ";"
-  int i;
-  int ret;
   char *query;
-  char *queries_tmpl[4] =
+  int64_t first;
+  int max_id;
+  int total;
+  int ret;
+
+  query = sqlite3_mprintf("SELECT MAX(id) FROM %s;", table);
+  if (!query)
     {
-      "DELETE FROM playlistitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 ");",
-      "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 ");",
-      "DELETE FROM playlists WHERE type <> %d AND db_timestamp < %" PRIi64 ";",
-      "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 ";",
-    };
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
 
-  db_transaction_begin();
+  max_id = db_get_one_int(query);
+  sqlite3_free(query);
+  if (max_id <= 0)
+    return 0;
 
-  for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
+  DPRINTF(E_DBG, L_DB, "Purging %s where %s, %d rows per batch\n", table, cond, db_purge_batch);
+
+  total = 0;
+  for (first = 0; first < max_id; first += db_purge_batch)
     {
-      query = sqlite3_mprintf(queries_tmpl[i], PL_SPECIAL, (int64_t)ref);
+      query = sqlite3_mprintf("DELETE FROM %s WHERE id > %" PRIi64 " AND id <= %" PRIi64 " AND %s;", table, first, first + db_purge_batch, cond);
       if (!query)
 	{
 	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-	  db_transaction_end();
-	  return;
+	  return -1;
 	}
 
-      DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", query);
+      db_transaction_begin();
 
-      ret = db_query_run(query, 1, 0);
-      if (ret == 0)
-	DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
+      ret = db_query_run(query, 1, update_events);
+      if (ret < 0)
+	{
+	  db_transaction_rollback();
+	  return -1;
+	}
+
+      total += sqlite3_changes(hdl);
+
+      db_transaction_end();
+
+      // Let threads waiting for the lock in before the next batch
+      sched_yield();
     }
 
-  query = sqlite3_mprintf(Q_TMPL, DIR_MAX, (int64_t)ref);
-  if (!query)
+  return total;
+}
+
+void
+db_purge_cruft(time_t ref)
+{
+  char *cond[6];
+  int i;
+  int ret;
+
+  // Playlist items first, as they are found through the files and playlists
+  cond[0] = sqlite3_mprintf("EXISTS (SELECT 1 FROM playlists p WHERE p.id = playlistitems.playlistid AND p.type <> %d AND p.db_timestamp < %" PRIi64 ")", PL_SPECIAL, (int64_t)ref);
+  cond[1] = sqlite3_mprintf("EXISTS (SELECT 1 FROM files f WHERE f.path = playlistitems.filepath AND f.db_timestamp < %" PRIi64 ")", (int64_t)ref);
+  cond[2] = sqlite3_mprintf("type <> %d AND db_timestamp < %" PRIi64, PL_SPECIAL, (int64_t)ref);
+  cond[3] = sqlite3_mprintf("db_timestamp < %" PRIi64, (int64_t)ref);
+  cond[4] = sqlite3_mprintf("id >= %d AND db_timestamp < %" PRIi64, DIR_MAX, (int64_t)ref);
+  cond[5] = sqlite3_mprintf("time < %" PRIi64, (int64_t)ref - DB_FILE_CHANGES_KEEP);
+
+  for (i = 0; i < (sizeof(cond) / sizeof(cond[0])); i++)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
-      db_transaction_end();
-      return;
+      if (!cond[i])
+	{
+	  DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+	  goto out;
+	}
     }
 
-  DPRINTF(E_DBG, L_DB, "Running purge query '%s'\n", query);
+  ret = db_purge_batched("playlistitems", cond[0], 0);
+  if (ret > 0)
+    DPRINTF(E_DBG, L_DB, "Purged %d items of old playlists\n", ret);
 
-  ret = db_query_run(query, 1, LISTENER_DATABASE);
-  if (ret == 0)
-    DPRINTF(E_DBG, L_DB, "Purged %d rows\n", sqlite3_changes(hdl));
+  ret = db_purge_batched("playlistitems", cond[1], 0);
+  if (ret > 0)
+    DPRINTF(E_DBG, L_DB, "Purged %d playlist items of old files\n", ret);
 
-  db_transaction_end();
+  ret = db_purge_batched("playlists", cond[2], LISTENER_DATABASE);
+  if (ret > 0)
+    DPRINTF(E_DBG, L_DB, "Purged %d playlists\n", ret);
 
-#undef Q_TMPL
+  ret = db_purge_batched("files", cond[3], LISTENER_DATABASE);
+  if (ret > 0)
+    DPRINTF(E_DBG, L_DB, "Purged %d files\n", ret);
+
+  ret = db_purge_batched("directories", cond[4], LISTENER_DATABASE);
+  if (ret > 0)
+    DPRINTF(E_DBG, L_DB, "Purged %d directories\n", ret);
+
+  ret = db_purge_batched("file_changes", cond[5], 0);
+  if (ret > 0)
+    DPRINTF(E_DBG, L_DB, "Purged %d old file changes\n", ret);
+
+  db_dircache_clear();
+
+ out:
+  for (i = 0; i < (sizeof(cond) / sizeof(cond[0])); i++)
+    sqlite3_free(cond[i]);
 }
 
 void
@@ -889,6 +2360,8 @@ db_purge_all(void)
 
   sqlite3_free(query);
 
+  db_dircache_clear();
+
 #undef Q_TMPL_PL
 #undef Q_TMPL_DIR
 }
@@ -941,6 +2414,12 @@ db_transaction_begin(void)
   char *errmsg;
   int ret;
 
+  if (db_queue_batch)
+    {
+      query = "SAVEPOINT batch_nested;";
+      db_queue_batch_savepoints++;
+    }
+
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
   ret = db_exec(query, &errmsg);
@@ -959,6 +2438,18 @@ db_transaction_end(void)
   char *errmsg;
   int ret;
 
+  if (db_queue_batch)
+    {
+      if (db_queue_batch_savepoints == 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Transaction end without begin in queue batch, BUG!\n");
+	  return;
+	}
+
+      query = "RELEASE batch_nested;";
+      db_queue_batch_savepoints--;
+    }
+
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
   ret = db_exec(query, &errmsg);
@@ -977,6 +2468,28 @@ db_transaction_rollback(void)
   char *errmsg;
   int ret;
 
+  if (db_queue_batch)
+    {
+      if (db_queue_batch_savepoints == 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Transaction rollback without begin in queue batch, BUG!\n");
+	  return;
+	}
+
+      // Rolling back to a savepoint leaves it open, so it must also be released
+      query = "ROLLBACK TO batch_nested;";
+      ret = db_exec(query, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "SQL error running '%s': %s\n", query, errmsg);
+
+	  sqlite3_free(errmsg);
+	}
+
+      query = "RELEASE batch_nested;";
+      db_queue_batch_savepoints--;
+    }
+
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
   ret = db_exec(query, &errmsg);
@@ -986,6 +2499,8 @@ db_transaction_rollback(void)
 
       sqlite3_free(errmsg);
     }
+  // Directories added in the transaction may be cached
+  db_dircache_clear();
 }
 
 static void
@@ -994,29 +2509,113 @@ db_free_query_clause(struct query_clause *qc)
   if (!qc)
     return;
 
+  free(qc->cols);
   sqlite3_free(qc->where);
+  sqlite3_free(qc->order);
   sqlite3_free(qc->index);
   free(qc);
 }
 
+/* Builds the column list for a files query. Without any requested fields
+ * (qp->fields == 0) that is all columns, otherwise just the requested ones
+ * in files table order - the id is always included.
+ */
+static char *
+db_build_query_cols(struct query_params *qp)
+{
+  char *cols;
+  size_t len;
+  int i;
+  int j;
+
+  if (!qp->fields)
+    return strdup("f.*");
+
+  qp->fields |= 1;
+
+  // A keyset cursor is made from the values of the sort keys
+  if ((qp->type == Q_ITEMS) || (qp->type == Q_GROUP_ITEMS))
+    {
+      for (j = 0; sort_keys[qp->sort][j]; j++)
+	{
+	  for (i = 0; i < sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]); i++)
+	    {
+	      if (strcmp(dbmfi_cols_map[i].name, sort_keys[qp->sort][j]) == 0)
+		qp->fields |= (uint64_t)1 << i;
+	    }
+	}
+    }
+
+  len = 1;
+  for (i = 0; i < sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]); i++)
+    {
+      if (qp->fields & ((uint64_t)1 << i))
+	len += strlen(dbmfi_cols_map[i].name) + 4;
+    }
+
+  cols = calloc(1, len);
+  if (!cols)
+    return NULL;
+
+  for (i = 0; i < sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]); i++)
+    {
+      if (!(qp->fields & ((uint64_t)1 << i)))
+	continue;
+
+      if (cols[0] != '\0')
+	strcat(cols, ", ");
+      strcat(cols, "f.");
+      strcat(cols, dbmfi_cols_map[i].name);
+    }
+
+  return cols;
+}
+
+/* Keyset pagination is possible for lists of files in one of the sort orders
+ * that have sort_keys
+ */
+static bool
+db_query_is_keyset(struct query_params *qp)
+{
+  if ((qp->type != Q_ITEMS) && (qp->type != Q_GROUP_ITEMS))
+    return false;
+
+  return (sort_keys[qp->sort][0] != NULL);
+}
+
 static struct query_clause *
 db_build_query_clause(struct query_params *qp)
 {
   struct query_clause *qc;
+  bool keyset;
 
   qc = calloc(1, sizeof(struct query_clause));
   if (!qc)
     goto error;
 
-  if (qp->filter)
+  qc->cols = db_build_query_cols(qp);
+  if (!qc->cols)
+    goto error;
+
+  keyset = db_query_is_keyset(qp);
+
+  if (qp->filter && keyset && qp->cursor)
+    qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s AND %s", qp->filter, qp->cursor);
+  else if (keyset && qp->cursor)
+    qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s", qp->cursor);
+  else if (qp->filter)
     qc->where = sqlite3_mprintf("WHERE f.disabled = 0 AND %s", qp->filter);
   else
     qc->where = sqlite3_mprintf("WHERE f.disabled = 0");
 
-  if (qp->sort)
-    qc->order = sort_clause[qp->sort];
+  // With the id as tie breaker the order is the same from one page to the
+  // next, which a cursor requires. The sort indices cover it for free.
+  if (keyset)
+    qc->order = sqlite3_mprintf("%s, f.id ASC", sort_clause_files[qp->sort]);
+  else if (qp->sort)
+    qc->order = sqlite3_mprintf("%s", sort_clause_files[qp->sort]);
   else
-    qc->order = "";
+    qc->order = sqlite3_mprintf("");
 
   switch (qp->idx_type)
     {
@@ -1037,7 +2636,7 @@ db_build_query_clause(struct query_params *qp)
 	break;
     }
 
-  if (!qc->where || !qc->index)
+  if (!qc->where || !qc->order || !qc->index)
     goto error;
 
   return qc;
@@ -1083,7 +2682,7 @@ db_build_query_items(struct query_params *qp)
     return NULL;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s;", qc->where);
-  query = sqlite3_mprintf("SELECT f.* FROM files f %s %s %s;", qc->where, qc->order, qc->index);
+  query = sqlite3_mprintf("SELECT %s FROM files f %s %s %s;", qc->cols, qc->where, qc->order, qc->index);
 
   db_free_query_clause(qc);
 
@@ -1147,7 +2746,7 @@ db_build_query_plitems_plain(struct query_params *qp)
     return NULL;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d;", qc->where, qp->id);
-  query = sqlite3_mprintf("SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d ORDER BY pi.id ASC %s;", qc->where, qp->id, qc->index);
+  query = sqlite3_mprintf("SELECT %s FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d ORDER BY pi.id ASC %s;", qc->cols, qc->where, qp->id, qc->index);
 
   db_free_query_clause(qc);
 
@@ -1166,7 +2765,7 @@ db_build_query_plitems_smart(struct query_params *qp, char *smartpl_query)
     return NULL;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND %s;", qc->where, smartpl_query);
-  query = sqlite3_mprintf("SELECT f.* FROM files f %s AND %s %s %s;", qc->where, smartpl_query, qc->order, qc->index);
+  query = sqlite3_mprintf("SELECT %s FROM files f %s AND %s %s %s;", qc->cols, qc->where, smartpl_query, qc->order, qc->index);
 
   db_free_query_clause(qc);
 
@@ -1223,6 +2822,20 @@ db_build_query_group_albums(struct query_params *qp)
   if (!qc)
     return NULL;
 
+  // Without a filter the counts maintained in the groups table can be used, the
+  // album details are taken from one of the album's files
+  if (!qp->filter)
+    {
+      count = sqlite3_mprintf("SELECT COUNT(*) FROM groups g WHERE g.type = 1 AND g.songs > 0;");
+      query = sqlite3_mprintf("SELECT g.id, g.persistentid, f.album, f.album_sort, g.songs, 1, f.album_artist, f.songartistid, g.song_length FROM groups g"
+			      " JOIN files f ON f.id = (SELECT id FROM files WHERE songalbumid = g.persistentid AND disabled = 0 LIMIT 1)"
+			      " WHERE g.type = 1 AND g.songs > 0 %s %s;", qc->order, qc->index);
+
+      db_free_query_clause(qc);
+
+      return db_build_query_check(qp, count, query);
+    }
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songalbumid) FROM files f WHERE f.disabled = 0;");
   query = sqlite3_mprintf("SELECT g.id, g.persistentid, f.album, f.album_sort, COUNT(f.id), 1, f.album_artist, f.songartistid, SUM(f.song_length) FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s GROUP BY f.songalbumid %s %s;", qc->where, qc->order, qc->index);
 
@@ -1242,6 +2855,18 @@ db_build_query_group_artists(struct query_params *qp)
   if (!qc)
     return NULL;
 
+  if (!qp->filter)
+    {
+      count = sqlite3_mprintf("SELECT COUNT(*) FROM groups g WHERE g.type = 2 AND g.songs > 0;");
+      query = sqlite3_mprintf("SELECT g.id, g.persistentid, f.album_artist, f.album_artist_sort, g.songs, g.albums, f.album_artist, f.songartistid, g.song_length FROM groups g"
+			      " JOIN files f ON f.id = (SELECT id FROM files WHERE songartistid = g.persistentid AND disabled = 0 LIMIT 1)"
+			      " WHERE g.type = 2 AND g.songs > 0 %s %s;", qc->order, qc->index);
+
+      db_free_query_clause(qc);
+
+      return db_build_query_check(qp, count, query);
+    }
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songartistid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT g.id, g.persistentid, f.album_artist, f.album_artist_sort, COUNT(f.id), COUNT(DISTINCT f.songalbumid), f.album_artist, f.songartistid, SUM(f.song_length) FROM files f JOIN groups g ON f.songartistid = g.persistentid %s GROUP BY f.songartistid %s %s;", qc->where, qc->order, qc->index);
 
@@ -1268,12 +2893,12 @@ db_build_query_group_items(struct query_params *qp)
     {
       case G_ALBUMS:
 	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songalbumid = %" PRIi64 ";", qc->where, qp->persistentid);
-	query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.songalbumid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+	query = sqlite3_mprintf("SELECT %s FROM files f %s AND f.songalbumid = %" PRIi64 " %s %s;", qc->cols, qc->where, qp->persistentid, qc->order, qc->index);
 	break;
 
       case G_ARTISTS:
 	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songartistid = %" PRIi64 ";", qc->where, qp->persistentid);
-	query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.songartistid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+	query = sqlite3_mprintf("SELECT %s FROM files f %s AND f.songartistid = %" PRIi64 " %s %s;", qc->cols, qc->where, qp->persistentid, qc->order, qc->index);
 	break;
 
       default:
@@ -1328,6 +2953,79 @@ db_build_query_group_dirs(struct query_params *qp)
   return db_build_query_check(qp, count, query);
 }
 
+/* The browse table can answer a browse query if the filter only looks at the
+ * browsed value and the media kind, which is what clients usually send
+ */
+static bool
+db_browse_filter_ok(const char *filter, const char *field, const char *group_field)
+{
+  const char *p;
+  size_t len;
+
+  if (!filter)
+    return true;
+
+  for (p = strstr(filter, "f."); p; p = strstr(p + 2, "f."))
+    {
+      if ((p > filter) && (isalnum(p[-1]) || p[-1] == '_'))
+	continue;
+
+      for (len = 0; isalnum(p[2 + len]) || p[2 + len] == '_'; len++)
+	;
+
+      if ((len == strlen("media_kind")) && (strncmp(p + 2, "media_kind", len) == 0))
+	continue;
+      if ((len == strlen(field)) && (strncmp(p + 2, field, len) == 0))
+	continue;
+      if ((len == strlen(group_field)) && (strncmp(p + 2, group_field, len) == 0))
+	continue;
+
+      return false;
+    }
+
+  return true;
+}
+
+static char *
+db_build_query_browse_table(struct query_params *qp, struct query_clause *qc, const char *field, const char *group_field)
+{
+  char *from;
+  char *where;
+  char *count;
+  char *query;
+
+  // The browse table as a files-like relation, so the filter applies as is
+  if (strcmp(field, group_field) == 0)
+    from = sqlite3_mprintf("(SELECT value AS %s, media_kind FROM browse WHERE type = %d AND songs > 0) f",
+			   field, qp->type & ~Q_F_BROWSE);
+  else
+    from = sqlite3_mprintf("(SELECT value AS %s, sort_value AS %s, media_kind FROM browse WHERE type = %d AND songs > 0) f",
+			   field, group_field, qp->type & ~Q_F_BROWSE);
+
+  if (qp->filter)
+    where = sqlite3_mprintf("WHERE %s", qp->filter);
+  else
+    where = sqlite3_mprintf("");
+
+  if (!from || !where)
+    {
+      sqlite3_free(from);
+      sqlite3_free(where);
+      return db_build_query_check(qp, NULL, NULL);
+    }
+
+  count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.%s) FROM %s %s;", field, from, where);
+  if (qp->sort)
+    query = sqlite3_mprintf("SELECT f.%s, f.%s FROM %s %s GROUP BY f.%s ORDER BY f.%s ASC %s;", field, group_field, from, where, group_field, group_field, qc->index);
+  else
+    query = sqlite3_mprintf("SELECT f.%s, f.%s FROM %s %s GROUP BY f.%s %s;", field, group_field, from, where, group_field, qc->index);
+
+  sqlite3_free(from);
+  sqlite3_free(where);
+
+  return db_build_query_check(qp, count, query);
+}
+
 static char *
 db_build_query_browse(struct query_params *qp, const char *field, const char *group_field)
 {
@@ -1339,6 +3037,14 @@ db_build_query_browse(struct query_params *qp, const char *field, const char *gr
   if (!qc)
     return NULL;
 
+  // Artists, albums, genres and composers have a precomputed table
+  if ((qp->type >= Q_BROWSE_ARTISTS) && (qp->type <= Q_BROWSE_COMPOSERS) && db_browse_filter_ok(qp->filter, field, group_field))
+    {
+      query = db_build_query_browse_table(qp, qc, field, group_field);
+      db_free_query_clause(qc);
+      return query;
+    }
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.%s) FROM files f %s AND f.%s != '';", field, qc->where, field);
   query = sqlite3_mprintf("SELECT f.%s, f.%s FROM files f %s AND f.%s != '' GROUP BY f.%s %s %s;", field, group_field, qc->where, field, group_field, qc->order, qc->index);
 
@@ -1368,95 +3074,83 @@ db_build_query_count_items(struct query_params *qp)
   return query;
 }
 
-int
-db_query_start(struct query_params *qp)
+// Returns the statement for the query and sets qp->results
+static char *
+db_build_query(struct query_params *qp)
 {
-  sqlite3_stmt *stmt;
-  char *query;
-  int ret;
-
-  qp->stmt = NULL;
-  qp->results = -1;
-
   switch (qp->type)
     {
       case Q_ITEMS:
-	query = db_build_query_items(qp);
-	break;
+	return db_build_query_items(qp);
 
       case Q_PL:
-	query = db_build_query_pls(qp);
-	break;
+	return db_build_query_pls(qp);
 
       case Q_FIND_PL:
-	query = db_build_query_find_pls(qp);
-	break;
+	return db_build_query_find_pls(qp);
 
       case Q_PLITEMS:
-	query = db_build_query_plitems(qp);
-	break;
+	return db_build_query_plitems(qp);
 
       case Q_GROUP_ALBUMS:
-	query = db_build_query_group_albums(qp);
-	break;
+	return db_build_query_group_albums(qp);
 
       case Q_GROUP_ARTISTS:
-	query = db_build_query_group_artists(qp);
-	break;
+	return db_build_query_group_artists(qp);
 
       case Q_GROUP_ITEMS:
-	query = db_build_query_group_items(qp);
-	break;
+	return db_build_query_group_items(qp);
 
       case Q_GROUP_DIRS:
-	query = db_build_query_group_dirs(qp);
-	break;
+	return db_build_query_group_dirs(qp);
 
       case Q_BROWSE_ALBUMS:
-	query = db_build_query_browse(qp, "album", "album_sort");
-	break;
+	return db_build_query_browse(qp, "album", "album_sort");
 
       case Q_BROWSE_ARTISTS:
-	query = db_build_query_browse(qp, "album_artist", "album_artist_sort");
-	break;
+	return db_build_query_browse(qp, "album_artist", "album_artist_sort");
 
       case Q_BROWSE_GENRES:
-	query = db_build_query_browse(qp, "genre", "genre");
-	break;
+	return db_build_query_browse(qp, "genre", "genre");
 
       case Q_BROWSE_COMPOSERS:
-	query = db_build_query_browse(qp, "composer", "composer_sort");
-	break;
+	return db_build_query_browse(qp, "composer", "composer_sort");
 
       case Q_BROWSE_YEARS:
-	query = db_build_query_browse(qp, "year", "year");
-	break;
+	return db_build_query_browse(qp, "year", "year");
 
       case Q_BROWSE_DISCS:
-	query = db_build_query_browse(qp, "disc", "disc");
-	break;
+	return db_build_query_browse(qp, "disc", "disc");
 
       case Q_BROWSE_TRACKS:
-	query = db_build_query_browse(qp, "track", "track");
-	break;
+	return db_build_query_browse(qp, "track", "track");
 
       case Q_BROWSE_VPATH:
-	query = db_build_query_browse(qp, "virtual_path", "virtual_path");
-	break;
+	return db_build_query_browse(qp, "virtual_path", "virtual_path");
 
       case Q_BROWSE_PATH:
-	query = db_build_query_browse(qp, "path", "path");
-	break;
+	return db_build_query_browse(qp, "path", "path");
 
       case Q_COUNT_ITEMS:
-	query = db_build_query_count_items(qp);
-	break;
+	return db_build_query_count_items(qp);
 
       default:
 	DPRINTF(E_LOG, L_DB, "Unknown query type\n");
-	return -1;
+	return NULL;
     }
+}
+
+int
+db_query_start(struct query_params *qp)
+{
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
 
+  qp->stmt = NULL;
+  qp->results = -1;
+
+  query = db_build_query(qp);
   if (!query)
     return -1;
 
@@ -1488,6 +3182,148 @@ db_query_end(struct query_params *qp)
   qp->stmt = NULL;
 }
 
+static int
+db_query_stats_cmp(const void *a, const void *b)
+{
+  const struct db_query_stats *qa = a;
+  const struct db_query_stats *qb = b;
+
+  if (qa->total_usec == qb->total_usec)
+    return 0;
+
+  return (qa->total_usec < qb->total_usec) ? 1 : -1;
+}
+
+/* Returns the number of entries in *stats, which is sorted by total time and
+ * must be freed with db_query_stats_free(). The threshold is 0 if statement
+ * timing is disabled.
+ */
+int
+db_query_stats_get(struct db_query_stats **stats, int *threshold_ms)
+{
+  struct db_query_stats *qs;
+  int n;
+  int i;
+
+  *threshold_ms = db_slow_query_ms;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_query_stats_lck));
+
+  n = db_query_nstats;
+  qs = calloc(n + 1, sizeof(struct db_query_stats));
+  if (!qs)
+    {
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&db_query_stats_lck));
+      DPRINTF(E_LOG, L_DB, "Out of memory for query stats\n");
+      return -1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      qs[i] = db_query_stats[i];
+      qs[i].query = strdup(db_query_stats[i].query);
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_query_stats_lck));
+
+  qsort(qs, n, sizeof(struct db_query_stats), db_query_stats_cmp);
+
+  *stats = qs;
+  return n;
+}
+
+/* Like db_query_stats_get(), but the entries are the column patterns of the
+ * index advisor, described as WHERE and ORDER BY clauses. Returns 0 entries
+ * if auto_indexes is disabled.
+ */
+int
+db_index_patterns_get(struct db_query_stats **stats)
+{
+  struct db_query_stats *qs;
+  struct db_index_pattern *ip;
+  struct evbuffer *evbuf;
+  int n;
+  int i;
+  int j;
+
+  CHECK_NULL(L_DB, evbuf = evbuffer_new());
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_index_lck));
+
+  n = db_index_npatterns;
+  qs = calloc(n + 1, sizeof(struct db_query_stats));
+  if (!qs)
+    {
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&db_index_lck));
+      evbuffer_free(evbuf);
+      DPRINTF(E_LOG, L_DB, "Out of memory for index patterns\n");
+      return -1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      ip = &db_index_patterns[i];
+
+      for (j = 0; j < ip->neq; j++)
+	evbuffer_add_printf(evbuf, "%s%s = %s", j ? " AND " : "WHERE ", ip->eq[j].name,
+			    (ip->eq[j].literal[0] && !ip->eq[j].varies) ? ip->eq[j].literal : "?");
+      if (ip->range[0])
+	evbuffer_add_printf(evbuf, "%s%s > ?", ip->neq ? " AND " : "WHERE ", ip->range);
+      for (j = 0; j < ip->norder; j++)
+	evbuffer_add_printf(evbuf, "%s%s", j ? ", " : ((ip->neq || ip->range[0]) ? " ORDER BY " : "ORDER BY "), ip->order[j]);
+
+      qs[i].query = strndup((char *)evbuffer_pullup(evbuf, -1), evbuffer_get_length(evbuf));
+      qs[i].count = ip->count;
+      qs[i].total_usec = ip->total_usec;
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_index_lck));
+  evbuffer_free(evbuf);
+
+  qsort(qs, n, sizeof(struct db_query_stats), db_query_stats_cmp);
+
+  *stats = qs;
+  return n;
+}
+
+void
+db_query_stats_free(struct db_query_stats *stats, int n)
+{
+  int i;
+
+  if (!stats)
+    return;
+
+  for (i = 0; i < n; i++)
+    free(stats[i].query);
+
+  free(stats);
+}
+
+unsigned int
+db_revision_get(void)
+{
+  return __atomic_load_n(&db_revision, __ATOMIC_ACQUIRE);
+}
+
+unsigned int
+db_queue_revision_get(void)
+{
+  return __atomic_load_n(&db_queue_revision, __ATOMIC_ACQUIRE);
+}
+
+/* Counts the library revision up before passing the notification on to the
+ * library, so that cached results of library queries are redone
+ */
+static void
+db_update_trigger(short update_events)
+{
+  if (update_events & LISTENER_DATABASE)
+    __atomic_add_fetch(&db_revision, 1, __ATOMIC_RELEASE);
+
+  library_update_trigger(update_events);
+}
+
 /*
  * Utility function for running write queries (INSERT, UPDATE, DELETE). If you
  * set free to non-zero, the function will free the query. If you set
@@ -1528,17 +3364,48 @@ db_query_run(char *query, int free, short update_events)
   cache_daap_resume();
 
   if (update_events && changes > 0)
-    library_update_trigger(update_events);
+    db_update_trigger(update_events);
 
   return ((ret != SQLITE_OK) ? -1 : 0);
 }
 
+/* Same as db_query_run(), but for a write query from the statement cache with
+ * parameters already bound. Returns the number of changed rows or -1 on error.
+ */
+static int
+db_stmt_run(sqlite3_stmt *stmt, short update_events)
+{
+  int changes = 0;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", sqlite3_sql(stmt));
+
+  cache_daap_suspend();
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_DB, "Error '%s' while runnning '%s'\n", sqlite3_errmsg(hdl), sqlite3_sql(stmt));
+  else
+    changes = sqlite3_changes(hdl);
+
+  db_stmt_release(stmt);
+
+  cache_daap_resume();
+
+  if (update_events && changes > 0)
+    db_update_trigger(update_events);
+
+  return ((ret != SQLITE_DONE) ? -1 : changes);
+}
+
 int
 db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
 {
   int ncols;
   char **strcol;
+  int slot;
   int i;
+  int j;
   int ret;
 
   memset(dbmfi, 0, sizeof(struct db_media_file_info));
@@ -1570,22 +3437,152 @@ db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi)
 
   ncols = sqlite3_column_count(qp->stmt);
 
-  if (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]) != ncols)
+  if (!qp->fields)
     {
-      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with schema\n");
-      return -1;
+      if (sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]) != ncols)
+	{
+	  DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with schema\n");
+	  return -1;
+	}
+
+      for (i = 0; i < ncols; i++)
+	{
+	  strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i].offset);
+
+	  *strcol = (char *)sqlite3_column_text(qp->stmt, i);
+	}
+
+      return 0;
     }
 
-  for (i = 0; i < ncols; i++)
+  // Projected query: the result columns are the requested fields in map
+  // order. Integer values are handed out as is, without the round trip via
+  // a string, except for the id which callers use to detect the end.
+  for (i = 0, j = 0; (i < sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0])) && (j < ncols); i++)
     {
-      strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i]);
+      if (!(qp->fields & ((uint64_t)1 << i)))
+	continue;
 
-      *strcol = (char *)sqlite3_column_text(qp->stmt, i);
+      slot = dbmfi_slot(dbmfi_cols_map[i].offset);
+
+      if ((i != 0) && (sqlite3_column_type(qp->stmt, j) == SQLITE_INTEGER))
+	{
+	  dbmfi->intval[slot] = sqlite3_column_int64(qp->stmt, j);
+	  dbmfi->ints |= ((uint64_t)1 << slot);
+	}
+      else
+	{
+	  strcol = (char **) ((char *)dbmfi + dbmfi_cols_map[i].offset);
+
+	  *strcol = (char *)sqlite3_column_text(qp->stmt, j);
+	}
+
+      j++;
+    }
+
+  if (j != ncols)
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: dbmfi column map out of sync with projected query\n");
+      return -1;
     }
 
   return 0;
 }
 
+/* Makes a cursor for qp->cursor from the last row of a page, so that the
+ * query for the next page can continue right after it, instead of having
+ * SQLite skip all rows up to qp->offset. The row must include the sort
+ * columns. Returns NULL if the query can't be paginated like this, otherwise
+ * the caller must free the cursor.
+ */
+char *
+db_query_cursor_make(struct query_params *qp, struct db_media_file_info *dbmfi)
+{
+  const char **keys;
+  const char *val;
+  char *cursor;
+  char *prev;
+  char buf[32];
+  ssize_t offset;
+  int32_t id;
+  int nkeys;
+  int i;
+  int j;
+  int ret;
+
+  if (!db_query_is_keyset(qp) || !dbmfi->id)
+    return NULL;
+
+  ret = safe_atoi32(dbmfi->id, &id);
+  if (ret < 0)
+    return NULL;
+
+  keys = sort_keys[qp->sort];
+  for (nkeys = 0; keys[nkeys]; nkeys++)
+    ;
+
+  // Built from the last key out: (k1 > v1 OR (k1 = v1 AND (k2 > v2 OR ...)))
+  cursor = db_mprintf("f.id > %d", id);
+
+  for (i = nkeys - 1; i >= 0; i--)
+    {
+      offset = -1;
+      for (j = 0; j < sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]); j++)
+	{
+	  if (strcmp(dbmfi_cols_map[j].name, keys[i]) == 0)
+	    {
+	      offset = dbmfi_cols_map[j].offset;
+	      break;
+	    }
+	}
+
+      if (offset < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "BUG: Sort key '%s' is not a files column\n", keys[i]);
+	  free(cursor);
+	  return NULL;
+	}
+
+      if (dbmfi_has_int(dbmfi, offset))
+	{
+	  snprintf(buf, sizeof(buf), "%" PRIi64, dbmfi_int(dbmfi, offset));
+	  val = buf;
+	}
+      else
+	val = *(char **) ((char *)dbmfi + offset);
+
+      prev = cursor;
+
+      // NULL sorts first, so nothing comes before a NULL key
+      if (val)
+	cursor = db_mprintf("(f.%s > %Q OR (f.%s = %Q AND %s))", keys[i], val, keys[i], val, prev);
+      else
+	cursor = db_mprintf("(f.%s IS NOT NULL OR (f.%s IS NULL AND %s))", keys[i], keys[i], prev);
+
+      free(prev);
+    }
+
+  return cursor;
+}
+
+int
+db_query_field_add(struct query_params *qp, ssize_t dbmfi_offset)
+{
+  int i;
+
+  for (i = 0; i < sizeof(dbmfi_cols_map) / sizeof(dbmfi_cols_map[0]); i++)
+    {
+      if (dbmfi_cols_map[i].offset == dbmfi_offset)
+	{
+	  qp->fields |= ((uint64_t)1 << i);
+	  return 0;
+	}
+    }
+
+  DPRINTF(E_LOG, L_DB, "BUG: Unknown dbmfi field offset %zd\n", dbmfi_offset);
+  return -1;
+}
+
 int
 db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli, int with_itemcount)
 {
@@ -1897,46 +3894,47 @@ db_files_get_album_count(void)
 void
 db_file_inc_playcount(int id)
 {
-#define Q_TMPL "UPDATE files SET play_count = play_count + 1, time_played = %" PRIi64 ", seek = 0 WHERE id = %d;"
-  char *query;
+  sqlite3_stmt *stmt;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  stmt = db_stmt_get(DB_STMT_FILE_INC_PLAYCOUNT);
+  if (!stmt)
+    return;
 
-      return;
-    }
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, id);
 
-  db_query_run(query, 1, 0);
-#undef Q_TMPL
+  db_stmt_run(stmt, 0);
 }
 
 void
 db_file_ping(int id)
 {
-#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE id = %d;"
-  char *query;
+  sqlite3_stmt *stmt;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), id);
+  stmt = db_stmt_get(DB_STMT_FILE_PING);
+  if (!stmt)
+    return;
 
-  db_query_run(query, 1, 0);
-#undef Q_TMPL
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_int(stmt, 2, id);
+
+  db_stmt_run(stmt, 0);
 }
 
 int
 db_file_ping_bypath(const char *path, time_t mtime_max)
 {
-#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE path = '%q' AND db_timestamp >= %" PRIi64 ";"
-  char *query;
-  int ret;
+  sqlite3_stmt *stmt;
 
-  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL), path, (int64_t)mtime_max);
+  stmt = db_stmt_get(DB_STMT_FILE_PING_BYPATH);
+  if (!stmt)
+    return -1;
 
-  ret = db_query_run(query, 1, 0);
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 3, (int64_t)mtime_max);
 
-  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
-#undef Q_TMPL
+  return db_stmt_run(stmt, 0);
 }
 
 void
@@ -1956,34 +3954,216 @@ db_file_ping_bymatch(const char *path, int isdir)
 #undef Q_TMPL_NODIR
 }
 
-char *
-db_file_path_byid(int id)
+/* Pings the given files, in statements of up to DB_PING_IDS_MAX ids */
+#define DB_PING_IDS_MAX 500
+
+int
+db_file_ping_byids(const int *ids, int nids)
 {
-#define Q_TMPL "SELECT f.path FROM files f WHERE f.id = %d;"
   char *query;
+  size_t size;
+  size_t len;
+  int64_t now;
+  int i;
+  int j;
+  int ret;
+
+  now = (int64_t)time(NULL);
+
+  // Room for the statement and DB_PING_IDS_MAX ids of up to 11 chars plus ", "
+  size = 128 + DB_PING_IDS_MAX * 13;
+  CHECK_NULL(L_DB, query = malloc(size));
+
+  ret = 0;
+  for (i = 0; i < nids; i += DB_PING_IDS_MAX)
+    {
+      len = snprintf(query, size, "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE id IN (%d", now, ids[i]);
+      for (j = i + 1; (j < nids) && (j < i + DB_PING_IDS_MAX); j++)
+	len += snprintf(query + len, size - len, ", %d", ids[j]);
+      snprintf(query + len, size - len, ");");
+
+      ret = db_query_run(query, 0, 0);
+      if (ret < 0)
+	break;
+    }
+
+  free(query);
+
+  return ret;
+}
+
+static int
+db_file_stamps_query(char *query, struct db_file_stamp **stamps)
+{
+  struct db_file_stamp *tmp;
   sqlite3_stmt *stmt;
-  char *res;
+  int nalloc;
+  int n;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
+  *stamps = NULL;
+
   if (!query)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
 
-      return NULL;
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  nalloc = 0;
+  n = 0;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      if (n == nalloc)
+	{
+	  nalloc = nalloc ? 2 * nalloc : 64;
+	  CHECK_NULL(L_DB, tmp = realloc(*stamps, nalloc * sizeof(struct db_file_stamp)));
+	  *stamps = tmp;
+	}
+
+      (*stamps)[n].id = sqlite3_column_int(stmt, 0);
+      (*stamps)[n].path = strdup((char *)sqlite3_column_text(stmt, 1));
+      (*stamps)[n].db_timestamp = sqlite3_column_int64(stmt, 2);
+      n++;
+    }
+
+  sqlite3_finalize(stmt);
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      db_file_stamps_free(*stamps, n);
+      *stamps = NULL;
+      return -1;
+    }
+
+  return n;
+}
+
+/* Gets id, path and library timestamp of the files in a directory, sorted by
+ * path (byte order), so that a directory scan can check which files changed
+ * without a query per file. Returns the number of files or -1 on error.
+ */
+int
+db_file_stamps_bydir(int dir_id, struct db_file_stamp **stamps)
+{
+#define Q_TMPL "SELECT f.id, f.path, f.db_timestamp FROM files f WHERE f.directory_id = %d ORDER BY f.path;"
+
+  return db_file_stamps_query(sqlite3_mprintf(Q_TMPL, dir_id), stamps);
+
+#undef Q_TMPL
+}
+
+/* Same as above, but for all enabled files in the library */
+int
+db_file_stamps_all(struct db_file_stamp **stamps)
+{
+#define Q_TMPL "SELECT f.id, f.path, f.db_timestamp FROM files f WHERE f.disabled = 0;"
+
+  return db_file_stamps_query(sqlite3_mprintf(Q_TMPL), stamps);
+
+#undef Q_TMPL
+}
+
+/* Ids of the files that were deleted or disabled at or after the given time,
+ * and are still gone. Returns the number of ids, caller must free *ids.
+ */
+int
+db_file_changes_deleted(int64_t since, int **ids)
+{
+#define Q_TMPL "SELECT DISTINCT c.id FROM file_changes c WHERE c.time >= %" PRIi64 " AND c.deleted = 1" \
+               " AND NOT EXISTS (SELECT 1 FROM files f WHERE f.id = c.id AND f.disabled = 0);"
+  sqlite3_stmt *stmt;
+  char *query;
+  int *tmp;
+  int nalloc;
+  int n;
+  int ret;
+
+  *ids = NULL;
+
+  query = sqlite3_mprintf(Q_TMPL, since);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
     }
 
   DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
 
-      sqlite3_free(query);
-      return NULL;
+  nalloc = 0;
+  n = 0;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      if (n == nalloc)
+	{
+	  nalloc = nalloc ? 2 * nalloc : 64;
+	  CHECK_NULL(L_DB, tmp = realloc(*ids, nalloc * sizeof(int)));
+	  *ids = tmp;
+	}
+
+      (*ids)[n] = sqlite3_column_int(stmt, 0);
+      n++;
+    }
+
+  sqlite3_finalize(stmt);
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      free(*ids);
+      *ids = NULL;
+      return -1;
     }
 
+  return n;
+
+#undef Q_TMPL
+}
+
+void
+db_file_stamps_free(struct db_file_stamp *stamps, int nstamps)
+{
+  int i;
+
+  for (i = 0; i < nstamps; i++)
+    free(stamps[i].path);
+
+  free(stamps);
+}
+
+char *
+db_file_path_byid(int id)
+{
+  sqlite3_stmt *stmt;
+  char *res;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_FILE_PATH_BYID);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_int(stmt, 1, id);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", sqlite3_sql(stmt), id);
+
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
@@ -1992,8 +4172,7 @@ db_file_path_byid(int id)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
-      sqlite3_free(query);
+      db_stmt_release(stmt);
       return NULL;
     }
 
@@ -2006,33 +4185,17 @@ db_file_path_byid(int id)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
-  sqlite3_free(query);
+  db_stmt_release(stmt);
 
   return res;
-
-#undef Q_TMPL
 }
 
+/* Steps a statement that selects a file id, but doesn't finalize it */
 static int
-db_file_id_byquery(const char *query)
+db_file_id_bystmt(sqlite3_stmt *stmt)
 {
-  sqlite3_stmt *stmt;
   int ret;
 
-  if (!query)
-    return 0;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      return 0;
-    }
-
   ret = db_blocking_step(stmt);
   if (ret != SQLITE_ROW)
     {
@@ -2041,7 +4204,6 @@ db_file_id_byquery(const char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
       return 0;
     }
 
@@ -2052,33 +4214,54 @@ db_file_id_byquery(const char *query)
     ; /* EMPTY */
 #endif
 
-  sqlite3_finalize(stmt);
-
   return ret;
 }
 
-int
-db_file_id_bypath(const char *path)
+static int
+db_file_id_byquery(const char *query)
 {
-#define Q_TMPL "SELECT f.id FROM files f WHERE f.path = '%q';"
-  char *query;
+  sqlite3_stmt *stmt;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL, path);
   if (!query)
+    return 0;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, strlen(query) + 1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
 
       return 0;
     }
 
-  ret = db_file_id_byquery(query);
+  ret = db_file_id_bystmt(stmt);
 
-  sqlite3_free(query);
+  sqlite3_finalize(stmt);
 
   return ret;
+}
 
-#undef Q_TMPL
+int
+db_file_id_bypath(const char *path)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+
+  stmt = db_stmt_get(DB_STMT_FILE_ID_BYPATH);
+  if (!stmt)
+    return 0;
+
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (path '%s')\n", sqlite3_sql(stmt), path);
+
+  ret = db_file_id_bystmt(stmt);
+
+  db_stmt_release(stmt);
+
+  return ret;
 }
 
 int
@@ -2153,11 +4336,11 @@ db_file_id_by_virtualpath_match(const char *path)
 #undef Q_TMPL
 }
 
+/* Steps a statement that selects a single row from files, but doesn't finalize it */
 static struct media_file_info *
-db_file_fetch_byquery(char *query)
+db_file_fetch_bystmt(sqlite3_stmt *stmt)
 {
   struct media_file_info *mfi;
-  sqlite3_stmt *stmt;
   int ncols;
   char *cval;
   uint32_t *ival;
@@ -2167,27 +4350,13 @@ db_file_fetch_byquery(char *query)
   int i;
   int ret;
 
-  if (!query)
-    return NULL;
-
-  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-
-  mfi = calloc(1, sizeof(struct media_file_info));
+  mfi = db_calloc(sizeof(struct media_file_info));
   if (!mfi)
     {
       DPRINTF(E_LOG, L_DB, "Could not allocate struct media_file_info, out of memory\n");
       return NULL;
     }
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
-
-      free(mfi);
-      return NULL;
-    }
-
   ret = db_blocking_step(stmt);
 
   if (ret != SQLITE_ROW)
@@ -2197,8 +4366,7 @@ db_file_fetch_byquery(char *query)
       else
 	DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
 
-      sqlite3_finalize(stmt);
-      free(mfi);
+      db_free(mfi);
       return NULL;
     }
 
@@ -2208,8 +4376,7 @@ db_file_fetch_byquery(char *query)
     {
       DPRINTF(E_LOG, L_DB, "BUG: mfi column map out of sync with schema\n");
 
-      sqlite3_finalize(stmt);
-      free(mfi);
+      db_free(mfi);
       return NULL;
     }
 
@@ -2245,15 +4412,21 @@ db_file_fetch_byquery(char *query)
 	    strval = (char **) ((char *)mfi + mfi_cols_map[i].offset);
 
 	    cval = (char *)sqlite3_column_text(stmt, i);
-	    if (cval)
-	      *strval = strdup(cval);
+	    if (!cval)
+	      break;
+
+	    if (mfi_cols_map[i].offset == mfi_offsetof(artist) || mfi_cols_map[i].offset == mfi_offsetof(album)
+		|| mfi_cols_map[i].offset == mfi_offsetof(album_artist) || mfi_cols_map[i].offset == mfi_offsetof(genre)
+		|| mfi_cols_map[i].offset == mfi_offsetof(composer))
+	      *strval = db_strdup_tag(cval);
+	    else
+	      *strval = db_strdup(cval);
 	    break;
 
 	  default:
 	    DPRINTF(E_LOG, L_DB, "BUG: Unknown type %d in mfi column map\n", mfi_cols_map[i].type);
 
 	    free_mfi(mfi, 0);
-	    sqlite3_finalize(stmt);
 	    return NULL;
 	}
     }
@@ -2263,6 +4436,31 @@ db_file_fetch_byquery(char *query)
     ; /* EMPTY */
 #endif
 
+  return mfi;
+}
+
+static struct media_file_info *
+db_file_fetch_byquery(char *query)
+{
+  struct media_file_info *mfi;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  if (!query)
+    return NULL;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      return NULL;
+    }
+
+  mfi = db_file_fetch_bystmt(stmt);
+
   sqlite3_finalize(stmt);
 
   return mfi;
@@ -2271,25 +4469,22 @@ db_file_fetch_byquery(char *query)
 struct media_file_info *
 db_file_fetch_byid(int id)
 {
-#define Q_TMPL "SELECT f.* FROM files f WHERE f.id = %d;"
   struct media_file_info *mfi;
-  char *query;
+  sqlite3_stmt *stmt;
+
+  stmt = db_stmt_get(DB_STMT_FILE_FETCH_BYID);
+  if (!stmt)
+    return NULL;
 
-  query = sqlite3_mprintf(Q_TMPL, id);
-  if (!query)
-    {
-      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+  sqlite3_bind_int(stmt, 1, id);
 
-      return NULL;
-    }
+  DPRINTF(E_DBG, L_DB, "Running query '%s' (id %d)\n", sqlite3_sql(stmt), id);
 
-  mfi = db_file_fetch_byquery(query);
+  mfi = db_file_fetch_bystmt(stmt);
 
-  sqlite3_free(query);
+  db_stmt_release(stmt);
 
   return mfi;
-
-#undef Q_TMPL
 }
 
 struct media_file_info *
@@ -2316,6 +4511,11 @@ db_file_fetch_byvirtualpath(const char *virtual_path)
 #undef Q_TMPL
 }
 
+/* Looks up the rank of a sort tag for db_file_add/db_file_update. New values
+ * get NULL until db_sortkeys_update() has ranked them.
+ */
+#define Q_SORTKEY_ORD "(SELECT ordinal FROM sortkeys WHERE value = TRIM(%Q))"
+
 int
 db_file_add(struct media_file_info *mfi)
 {
@@ -2327,7 +4527,8 @@ db_file_add(struct media_file_info *mfi)
                " media_kind, tv_series_name, tv_episode_num_str, tv_network_name, tv_episode_sort, tv_season_num, " \
                " songartistid, songalbumid, " \
                " title_sort, artist_sort, album_sort, composer_sort, album_artist_sort, virtual_path," \
-               " directory_id, date_released) " \
+               " directory_id, date_released," \
+               " title_sort_ord, album_sort_ord, album_artist_sort_ord, composer_sort_ord) " \
                " VALUES (NULL, '%q', '%q', TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), %Q, TRIM(%Q)," \
                " TRIM(%Q), TRIM(%Q), TRIM(%Q), %Q, %d, %d, %d, %" PRIi64 ", %d, %d," \
                " %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d," \
@@ -2335,7 +4536,8 @@ db_file_add(struct media_file_info *mfi)
                " %Q, %d, %d, %d, %d, TRIM(%Q)," \
                " %d, TRIM(%Q), TRIM(%Q), TRIM(%Q), %d, %d," \
                " daap_songalbumid(LOWER(TRIM(%Q)), ''), daap_songalbumid(LOWER(TRIM(%Q)), LOWER(TRIM(%Q))), " \
-               " TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), %d, %d);"
+               " TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), TRIM(%Q), %d, %d," \
+               " " Q_SORTKEY_ORD ", " Q_SORTKEY_ORD ", " Q_SORTKEY_ORD ", " Q_SORTKEY_ORD ");"
 
   char *query;
   char *errmsg;
@@ -2370,7 +4572,8 @@ db_file_add(struct media_file_info *mfi)
 			  mfi->media_kind, mfi->tv_series_name, mfi->tv_episode_num_str,
 			  mfi->tv_network_name, mfi->tv_episode_sort, mfi->tv_season_num,
 			  mfi->album_artist, mfi->album_artist, mfi->album, mfi->title_sort, mfi->artist_sort, mfi->album_sort,
-			  mfi->composer_sort, mfi->album_artist_sort, mfi->virtual_path, mfi->directory_id, mfi->date_released);
+			  mfi->composer_sort, mfi->album_artist_sort, mfi->virtual_path, mfi->directory_id, mfi->date_released,
+			  mfi->title_sort, mfi->album_sort, mfi->album_artist_sort, mfi->composer_sort);
 
   if (!query)
     {
@@ -2392,7 +4595,7 @@ db_file_add(struct media_file_info *mfi)
 
   sqlite3_free(query);
 
-  library_update_trigger(LISTENER_DATABASE);
+  db_update_trigger(LISTENER_DATABASE);
 
   return 0;
 
@@ -2415,7 +4618,9 @@ db_file_update(struct media_file_info *mfi)
 	       " tv_network_name = TRIM(%Q), tv_episode_sort = %d, tv_season_num = %d," \
 	       " songartistid = daap_songalbumid(LOWER(TRIM(%Q)), ''), songalbumid = daap_songalbumid(LOWER(TRIM(%Q)), LOWER(TRIM(%Q)))," \
 	       " title_sort = TRIM(%Q), artist_sort = TRIM(%Q), album_sort = TRIM(%Q), composer_sort = TRIM(%Q), album_artist_sort = TRIM(%Q)," \
-	       " virtual_path = TRIM(%Q), directory_id = %d, date_released = %d" \
+	       " virtual_path = TRIM(%Q), directory_id = %d, date_released = %d," \
+	       " title_sort_ord = " Q_SORTKEY_ORD ", album_sort_ord = " Q_SORTKEY_ORD "," \
+	       " album_artist_sort_ord = " Q_SORTKEY_ORD ", composer_sort_ord = " Q_SORTKEY_ORD \
 	       " WHERE id = %d;"
 
   char *query;
@@ -2449,6 +4654,7 @@ db_file_update(struct media_file_info *mfi)
 			  mfi->title_sort, mfi->artist_sort, mfi->album_sort,
 			  mfi->composer_sort, mfi->album_artist_sort,
 			  mfi->virtual_path, mfi->directory_id, mfi->date_released,
+			  mfi->title_sort, mfi->album_sort, mfi->album_artist_sort, mfi->composer_sort,
 			  mfi->id);
 
   if (!query)
@@ -2471,7 +4677,7 @@ db_file_update(struct media_file_info *mfi)
 
   sqlite3_free(query);
 
-  library_update_trigger(LISTENER_DATABASE);
+  db_update_trigger(LISTENER_DATABASE);
 
   return 0;
 
@@ -2669,8 +4875,30 @@ static int
 db_smartpl_count_items(const char *smartpl_query)
 {
 #define Q_TMPL "SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s;"
+  struct db_smartpl_count *entry;
+  unsigned int revision;
   char *query;
+  time_t now;
   int ret;
+  int i;
+
+  revision = __atomic_load_n(&db_revision, __ATOMIC_ACQUIRE);
+  now = time(NULL);
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache_lck));
+
+  for (i = 0; i < DB_SMARTPL_CACHE_MAX && db_smartpl_cache[i].query; i++)
+    {
+      entry = &db_smartpl_cache[i];
+      if ((entry->revision == revision) && (now - entry->stamp < DB_SMARTPL_CACHE_SECS) && (strcmp(entry->query, smartpl_query) == 0))
+	{
+	  ret = entry->count;
+	  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache_lck));
+	  return ret;
+	}
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache_lck));
 
   query = sqlite3_mprintf(Q_TMPL, smartpl_query);
 
@@ -2684,6 +4912,40 @@ db_smartpl_count_items(const char *smartpl_query)
 
   sqlite3_free(query);
 
+  if (ret < 0)
+    return ret;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache_lck));
+
+  // Reuse the entry of the same query or an outdated one, else the oldest
+  entry = &db_smartpl_cache[0];
+  for (i = 0; i < DB_SMARTPL_CACHE_MAX; i++)
+    {
+      if (!db_smartpl_cache[i].query || (strcmp(db_smartpl_cache[i].query, smartpl_query) == 0))
+	{
+	  entry = &db_smartpl_cache[i];
+	  break;
+	}
+
+      if ((db_smartpl_cache[i].revision != revision) || (db_smartpl_cache[i].stamp < entry->stamp))
+	entry = &db_smartpl_cache[i];
+    }
+
+  if (!entry->query || (strcmp(entry->query, smartpl_query) != 0))
+    {
+      free(entry->query);
+      entry->query = strdup(smartpl_query);
+    }
+
+  if (entry->query)
+    {
+      entry->count = ret;
+      entry->revision = revision;
+      entry->stamp = now;
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache_lck));
+
   return ret;
 
 #undef Q_TMPL
@@ -3199,38 +5461,31 @@ db_pl_enable_bycookie(uint32_t cookie, const char *path)
 /* Groups */
 
 // Remove album and artist entries in the groups table that are not longer referenced from the files table
+// (the song counts are kept up to date by triggers on the files table)
 int
 db_groups_cleanup()
 {
-#define Q_TMPL_ALBUM "DELETE FROM groups WHERE type = 1 AND NOT persistentid IN (SELECT songalbumid from files WHERE disabled = 0);"
-#define Q_TMPL_ARTIST "DELETE FROM groups WHERE type = 2 AND NOT persistentid IN (SELECT songartistid from files WHERE disabled = 0);"
   int ret;
 
-  db_transaction_begin();
+  ret = db_purge_batched("groups", "type = 1 AND songs <= 0", LISTENER_DATABASE);
+  if (ret < 0)
+    return -1;
 
-  ret = db_query_run(Q_TMPL_ALBUM, 0, LISTENER_DATABASE);
+  DPRINTF(E_DBG, L_DB, "Removed album group-entries: %d\n", ret);
+
+  ret = db_purge_batched("groups", "type = 2 AND songs <= 0", LISTENER_DATABASE);
   if (ret < 0)
-    {
-      db_transaction_rollback();
-      return -1;
-    }
+    return -1;
 
-  DPRINTF(E_DBG, L_DB, "Removed album group-entries: %d\n", sqlite3_changes(hdl));
+  DPRINTF(E_DBG, L_DB, "Removed artist group-entries: %d\n", ret);
 
-  ret = db_query_run(Q_TMPL_ARTIST, 0, LISTENER_DATABASE);
+  ret = db_purge_batched("browse", "songs <= 0", 0);
   if (ret < 0)
-    {
-      db_transaction_rollback();
-      return -1;
-    }
+    return -1;
 
-  DPRINTF(E_DBG, L_DB, "Removed artist group-entries: %d\n", sqlite3_changes(hdl));
-  db_transaction_end();
+  DPRINTF(E_DBG, L_DB, "Removed browse entries: %d\n", ret);
 
   return 0;
-
-#undef Q_TMPL_ALBUM
-#undef Q_TMPL_ARTIST
 }
 
 static enum group_type
@@ -3288,6 +5543,215 @@ db_group_type_bypersistentid(int64_t persistentid)
 #undef Q_TMPL
 }
 
+/* Spacing between sort ordinals when they are (re)numbered, leaves room for
+ * values that sort between existing ones without renumbering
+ */
+#define DB_SORTKEY_GAP ((int64_t)1 << 20)
+
+struct db_sortkey
+{
+  int64_t rowid;
+  int64_t ordinal;
+  bool changed;
+};
+
+static int
+db_sortkeys_assign(struct db_sortkey *keys, int nkeys)
+{
+  int64_t prev;
+  int64_t next;
+  int64_t step;
+  int first;
+  int i;
+  int j;
+
+  prev = 0;
+  for (i = 0; i < nkeys; i = j)
+    {
+      if (keys[i].ordinal != 0)
+	{
+	  // Existing ordinals must be ascending, otherwise the collation changed
+	  if (keys[i].ordinal <= prev)
+	    return -1;
+
+	  prev = keys[i].ordinal;
+	  j = i + 1;
+	  continue;
+	}
+
+      // Run of new keys from i to j - 1, number them evenly between neighbours
+      first = i;
+      for (j = i; (j < nkeys) && (keys[j].ordinal == 0); j++)
+	;
+
+      next = (j < nkeys) ? keys[j].ordinal : prev + (int64_t)(j - first + 1) * DB_SORTKEY_GAP;
+      step = (next - prev) / (j - first + 1);
+      if (step == 0)
+	return -1;
+
+      for (i = first; i < j; i++)
+	{
+	  prev += step;
+	  keys[i].ordinal = prev;
+	  keys[i].changed = true;
+	}
+    }
+
+  return 0;
+}
+
+/* Ranks the title/album/album artist/composer sort tags once with the DAAP
+ * collation, so that queries can sort files by integer instead of comparing
+ * strings. New values are slotted in between their neighbours; only if there
+ * is no room left all values are renumbered.
+ */
+int
+db_sortkeys_update(void)
+{
+#define Q_NEW "INSERT OR IGNORE INTO sortkeys (value, ordinal)"				\
+	      " SELECT title_sort, 0 FROM files WHERE title_sort_ord IS NULL AND title_sort IS NOT NULL"		\
+	      " UNION SELECT album_sort, 0 FROM files WHERE album_sort_ord IS NULL AND album_sort IS NOT NULL"	\
+	      " UNION SELECT album_artist_sort, 0 FROM files WHERE album_artist_sort_ord IS NULL AND album_artist_sort IS NOT NULL" \
+	      " UNION SELECT composer_sort, 0 FROM files WHERE composer_sort_ord IS NULL AND composer_sort IS NOT NULL;"
+#define Q_KEYS "SELECT rowid, ordinal FROM sortkeys ORDER BY value COLLATE DAAP;"
+#define Q_SET "UPDATE sortkeys SET ordinal = ? WHERE rowid = ?;"
+#define Q_FILES_ALL "UPDATE files SET %s_ord = (SELECT ordinal FROM sortkeys WHERE value = files.%s);"
+#define Q_FILES_NEW "UPDATE files SET %s_ord = (SELECT ordinal FROM sortkeys WHERE value = files.%s) WHERE %s_ord IS NULL AND %s IS NOT NULL;"
+  const char *cols[] = { "title_sort", "album_sort", "album_artist_sort", "composer_sort" };
+  struct db_sortkey *keys;
+  struct db_sortkey *tmp;
+  sqlite3_stmt *stmt;
+  char *query;
+  bool renumber;
+  int nalloc;
+  int nkeys;
+  int nnew;
+  int i;
+  int ret;
+
+  db_transaction_begin();
+
+  ret = db_query_run(Q_NEW, 0, 0);
+  if (ret < 0)
+    goto error;
+
+  nnew = sqlite3_changes(hdl);
+
+  keys = NULL;
+  nkeys = 0;
+  renumber = false;
+
+  if (nnew > 0)
+    {
+      ret = db_blocking_prepare_v2(Q_KEYS, -1, &stmt, NULL);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+	  goto error;
+	}
+
+      nalloc = 0;
+      while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+	{
+	  if (nkeys == nalloc)
+	    {
+	      nalloc = nalloc ? 2 * nalloc : 1024;
+	      CHECK_NULL(L_DB, tmp = realloc(keys, nalloc * sizeof(struct db_sortkey)));
+	      keys = tmp;
+	    }
+
+	  keys[nkeys].rowid = sqlite3_column_int64(stmt, 0);
+	  keys[nkeys].ordinal = sqlite3_column_int64(stmt, 1);
+	  keys[nkeys].changed = false;
+	  nkeys++;
+	}
+
+      sqlite3_finalize(stmt);
+
+      if (ret != SQLITE_DONE)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+	  goto error_free;
+	}
+
+      ret = db_sortkeys_assign(keys, nkeys);
+      if (ret < 0)
+	{
+	  DPRINTF(E_DBG, L_DB, "Renumbering %d sort keys\n", nkeys);
+
+	  renumber = true;
+	  for (i = 0; i < nkeys; i++)
+	    {
+	      keys[i].ordinal = (int64_t)(i + 1) * DB_SORTKEY_GAP;
+	      keys[i].changed = true;
+	    }
+	}
+
+      ret = db_blocking_prepare_v2(Q_SET, -1, &stmt, NULL);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+	  goto error_free;
+	}
+
+      for (i = 0; i < nkeys; i++)
+	{
+	  if (!keys[i].changed)
+	    continue;
+
+	  sqlite3_bind_int64(stmt, 1, keys[i].ordinal);
+	  sqlite3_bind_int64(stmt, 2, keys[i].rowid);
+
+	  ret = db_blocking_step(stmt);
+	  if (ret != SQLITE_DONE)
+	    {
+	      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+	      sqlite3_finalize(stmt);
+	      goto error_free;
+	    }
+
+	  sqlite3_reset(stmt);
+	}
+
+      sqlite3_finalize(stmt);
+      free(keys);
+      keys = NULL;
+    }
+
+  // Also picks up files whose value was already ranked but that were added
+  // before the ranking, e.g. after a schema upgrade
+  for (i = 0; i < sizeof(cols) / sizeof(cols[0]); i++)
+    {
+      if (renumber)
+	query = sqlite3_mprintf(Q_FILES_ALL, cols[i], cols[i]);
+      else
+	query = sqlite3_mprintf(Q_FILES_NEW, cols[i], cols[i], cols[i], cols[i]);
+
+      ret = db_query_run(query, 1, 0);
+      if (ret < 0)
+	goto error;
+    }
+
+  db_transaction_end();
+
+  if (nnew > 0)
+    DPRINTF(E_DBG, L_DB, "Ranked %d new sort keys\n", nnew);
+
+  return 0;
+
+ error_free:
+  free(keys);
+ error:
+  db_transaction_rollback();
+  return -1;
+
+#undef Q_NEW
+#undef Q_KEYS
+#undef Q_SET
+#undef Q_FILES_ALL
+#undef Q_FILES_NEW
+}
+
 int
 db_group_persistentid_byid(int id, int64_t *persistentid)
 {
@@ -3345,6 +5809,87 @@ db_group_persistentid_byid(int id, int64_t *persistentid)
 
 
 /* Directories */
+static void
+db_dircache_clear(void)
+{
+  struct db_dircache_entry *entry;
+  int i;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dircache_lck));
+
+  for (i = 0; i < DB_DIRCACHE_BUCKETS; i++)
+    {
+      while ((entry = db_dircache[i]))
+	{
+	  db_dircache[i] = entry->next;
+	  free(entry->virtual_path);
+	  free(entry);
+	}
+    }
+
+  db_dircache_count = 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dircache_lck));
+}
+
+static int
+db_dircache_get(const char *virtual_path)
+{
+  struct db_dircache_entry *entry;
+  int id;
+
+  id = 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dircache_lck));
+
+  for (entry = db_dircache[djb_hash(virtual_path, strlen(virtual_path)) % DB_DIRCACHE_BUCKETS]; entry; entry = entry->next)
+    {
+      if (strcmp(entry->virtual_path, virtual_path) == 0)
+	{
+	  id = entry->id;
+	  break;
+	}
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dircache_lck));
+
+  return id;
+}
+
+static void
+db_dircache_set(const char *virtual_path, int id)
+{
+  struct db_dircache_entry *entry;
+  unsigned int bucket;
+
+  if (db_dircache_count >= DB_DIRCACHE_MAX)
+    db_dircache_clear();
+
+  bucket = djb_hash(virtual_path, strlen(virtual_path)) % DB_DIRCACHE_BUCKETS;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_dircache_lck));
+
+  for (entry = db_dircache[bucket]; entry; entry = entry->next)
+    {
+      if (strcmp(entry->virtual_path, virtual_path) == 0)
+	break;
+    }
+
+  if (!entry)
+    {
+      CHECK_NULL(L_DB, entry = calloc(1, sizeof(struct db_dircache_entry)));
+      CHECK_NULL(L_DB, entry->virtual_path = strdup(virtual_path));
+
+      entry->next = db_dircache[bucket];
+      db_dircache[bucket] = entry;
+      db_dircache_count++;
+    }
+
+  entry->id = id;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_dircache_lck));
+}
+
 int
 db_directory_id_byvirtualpath(char *virtual_path)
 {
@@ -3352,6 +5897,10 @@ db_directory_id_byvirtualpath(char *virtual_path)
   char *query;
   int ret;
 
+  ret = db_dircache_get(virtual_path);
+  if (ret > 0)
+    return ret;
+
   query = sqlite3_mprintf(Q_TMPL, virtual_path);
   if (!query)
     {
@@ -3364,6 +5913,9 @@ db_directory_id_byvirtualpath(char *virtual_path)
 
   sqlite3_free(query);
 
+  if (ret > 0)
+    db_dircache_set(virtual_path, ret);
+
   return ret;
 
 #undef Q_TMPL
@@ -3440,6 +5992,8 @@ db_directory_enum_fetch(struct directory_enum *de, struct directory_info *di)
   disabled = sqlite3_column_int64(de->stmt, 3);
   di->disabled = (disabled != 0);
   di->parent_id = sqlite3_column_int(de->stmt, 4);
+  di->mtime = sqlite3_column_int64(de->stmt, 5);
+  di->entries = sqlite3_column_int(de->stmt, 6);
 
   return 0;
 }
@@ -3454,6 +6008,51 @@ db_directory_enum_end(struct directory_enum *de)
   de->stmt = NULL;
 }
 
+/* Returns the directory with the given id, or NULL. Free with free_di(). */
+struct directory_info *
+db_directory_fetch_byid(int id)
+{
+#define Q_TMPL "SELECT * FROM directories WHERE id = %d;"
+  struct directory_enum de;
+  struct directory_info di;
+  struct directory_info *result;
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, id);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return NULL;
+    }
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return NULL;
+    }
+
+  de.stmt = stmt;
+  result = NULL;
+
+  ret = db_directory_enum_fetch(&de, &di);
+  if ((ret == 0) && di.virtual_path)
+    {
+      CHECK_NULL(L_DB, result = malloc(sizeof(struct directory_info)));
+      *result = di;
+      result->virtual_path = strdup(di.virtual_path);
+    }
+
+  db_directory_enum_end(&de);
+
+  return result;
+
+#undef Q_TMPL
+}
+
 static int
 db_directory_add(struct directory_info *di, int *id)
 {
@@ -3502,6 +6101,8 @@ db_directory_add(struct directory_info *di, int *id)
       return -1;
     }
 
+  db_dircache_set(di->virtual_path, *id);
+
   DPRINTF(E_DBG, L_DB, "Added directory '%s' with id %d\n", di->virtual_path, *id);
 
   return 0;
@@ -3577,6 +6178,21 @@ db_directory_addorupdate(char *virtual_path, int disabled, int parent_id)
   return id;
 }
 
+/* Saves the mtime and the number of entries of a scanned directory, which
+ * the polling of directories compares with to find changes
+ */
+int
+db_directory_stamp(int id, int64_t mtime, uint32_t entries)
+{
+#define Q_TMPL "UPDATE directories SET mtime = %" PRIi64 ", entries = %u WHERE id = %d;"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, mtime, entries, id);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
 void
 db_directory_ping_bymatch(char *virtual_path)
 {
@@ -3604,6 +6220,9 @@ db_directory_disable_bymatch(char *path, enum strip_type strip, uint32_t cookie)
   query = sqlite3_mprintf(Q_TMPL, vpath_striplen + 1, disabled, path, path, path);
 
   db_query_run(query, 1, LISTENER_DATABASE);
+
+  // The paths are rewritten in the table, so the cached ones are stale
+  db_dircache_clear();
 #undef Q_TMPL
 }
 
@@ -3618,6 +6237,8 @@ db_directory_enable_bycookie(uint32_t cookie, char *path)
 
   ret = db_query_run(query, 1, LISTENER_DATABASE);
 
+  db_dircache_clear();
+
   return ((ret < 0) ? -1 : sqlite3_changes(hdl));
 #undef Q_TMPL
 }
@@ -3758,6 +6379,8 @@ db_spotify_purge(void)
   if (ret == 0)
     DPRINTF(E_DBG, L_DB, "Disabled spotify directory\n");
 
+  db_dircache_clear();
+
 #undef Q_TMPL
 }
 
@@ -3959,7 +6582,33 @@ db_admin_getint(const char *key)
       return 0;
     }
 
-  return value;
+  return value;
+}
+
+/* The library revision is counted up each time the library changes, so that
+ * frontends sharing the database notice it (see library.c). Counted in SQL,
+ * since more than one instance may change the library.
+ */
+int
+db_library_revision_bump(void)
+{
+#define Q_INIT "INSERT OR IGNORE INTO admin (key, value) VALUES ('" DB_ADMIN_DB_REVISION "', '0');"
+#define Q_BUMP "UPDATE admin SET value = value + 1 WHERE key = '" DB_ADMIN_DB_REVISION "';"
+  int ret;
+
+  ret = db_query_run(Q_INIT, 0, 0);
+  if (ret == 0)
+    ret = db_query_run(Q_BUMP, 0, 0);
+
+  return ret;
+#undef Q_BUMP
+#undef Q_INIT
+}
+
+int64_t
+db_library_revision_get(void)
+{
+  return db_admin_getint64(DB_ADMIN_DB_REVISION);
 }
 
 int64_t
@@ -3994,10 +6643,20 @@ db_admin_delete(const char *key)
 int
 db_speaker_save(struct output_device *device)
 {
-#define Q_TMPL "INSERT OR REPLACE INTO speakers (id, selected, volume, name, auth_key) VALUES (%" PRIi64 ", %d, %d, %Q, %Q);"
+#define Q_TMPL "INSERT OR REPLACE INTO speakers (id, selected, volume, name, auth_key, type, mdns_name, mdns_txt, v4_address, v4_port, v6_address, v6_port, offset_ms, endpoints_seen)" \
+               " VALUES (%" PRIi64 ", %d, %d, %Q, %Q, %d, %Q, %Q, %Q, %d, %Q, %d, %d," \
+               " CASE WHEN %d THEN %" PRIi64 " ELSE COALESCE((SELECT endpoints_seen FROM speakers WHERE id = %" PRIi64 "), 0) END);"
   char *query;
+  bool seen;
 
-  query = sqlite3_mprintf(Q_TMPL, device->id, device->selected, device->volume, device->name, device->auth_key);
+  // Endpoints of a restored device are only what we saved, not a sighting
+  seen = !device->restored && (device->v4_address || device->v6_address);
+
+  query = sqlite3_mprintf(Q_TMPL, device->id, device->selected, device->volume, device->name, device->auth_key,
+			  device->type, device->mdns_name, device->mdns_txt,
+			  device->v4_address, device->v4_address ? device->v4_port : 0,
+			  device->v6_address, device->v6_address ? device->v6_port : 0,
+			  device->offset_ms, seen, (int64_t)time(NULL), device->id);
 
   return db_query_run(query, 1, 0);
 #undef Q_TMPL
@@ -4006,7 +6665,7 @@ db_speaker_save(struct output_device *device)
 int
 db_speaker_get(struct output_device *device, uint64_t id)
 {
-#define Q_TMPL "SELECT s.selected, s.volume, s.name, s.auth_key FROM speakers s WHERE s.id = %" PRIi64 ";"
+#define Q_TMPL "SELECT s.selected, s.volume, s.name, s.auth_key, s.offset_ms FROM speakers s WHERE s.id = %" PRIi64 ";"
   sqlite3_stmt *stmt;
   char *query;
   int ret;
@@ -4048,6 +6707,8 @@ db_speaker_get(struct output_device *device, uint64_t id)
   free(device->auth_key);
   device->auth_key = safe_strdup((char *)sqlite3_column_text(stmt, 3));
 
+  device->offset_ms = sqlite3_column_int(stmt, 4);
+
 #ifdef DB_PROFILE
   while (db_blocking_step(stmt) == SQLITE_ROW)
     ; /* EMPTY */
@@ -4064,12 +6725,151 @@ db_speaker_get(struct output_device *device, uint64_t id)
 #undef Q_TMPL
 }
 
+int
+db_speaker_enum_endpoints(enum output_types type, time_t seen_since, db_speaker_endpoint_cb cb, void *arg)
+{
+#define Q_TMPL "SELECT s.mdns_name, s.mdns_txt, s.v4_address, s.v4_port, s.v6_address, s.v6_port FROM speakers s" \
+               " WHERE s.type = %d AND s.mdns_name IS NOT NULL AND (s.v4_address IS NOT NULL OR s.v6_address IS NOT NULL)" \
+               " AND s.endpoints_seen >= %" PRIi64 ";"
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, type, (int64_t)seen_since);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(query);
+      return -1;
+    }
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      cb((char *)sqlite3_column_text(stmt, 0), (char *)sqlite3_column_text(stmt, 1),
+	 (char *)sqlite3_column_text(stmt, 2), sqlite3_column_int(stmt, 3),
+	 (char *)sqlite3_column_text(stmt, 4), sqlite3_column_int(stmt, 5), arg);
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return (ret == SQLITE_DONE) ? 0 : -1;
+
+#undef Q_TMPL
+}
+
 void
 db_speaker_clear_all(void)
 {
   db_query_run("UPDATE speakers SET selected = 0;", 0, 0);
 }
 
+/* Scrobbles */
+int
+db_scrobble_add(struct scrobble_info *si, int max_queued)
+{
+#define Q_TMPL "INSERT INTO scrobbles (artist, title, album, album_artist, track, duration, timestamp)" \
+               " VALUES (%Q, %Q, %Q, %Q, %d, %d, %" PRIi64 ");"
+#define Q_TRIM "DELETE FROM scrobbles WHERE id <= (SELECT MAX(id) FROM scrobbles) - %d;"
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, si->artist, si->title, si->album, si->album_artist, si->track, si->duration, si->timestamp);
+
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0 || max_queued <= 0)
+    return ret;
+
+  // If we have been offline for very long, the oldest go
+  query = sqlite3_mprintf(Q_TRIM, max_queued);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TRIM
+#undef Q_TMPL
+}
+
+int
+db_scrobble_enum(int limit, db_scrobble_cb cb, void *arg)
+{
+#define Q_TMPL "SELECT s.id, s.artist, s.title, s.album, s.album_artist, s.track, s.duration, s.timestamp FROM scrobbles s" \
+               " ORDER BY s.id LIMIT %d;"
+  struct scrobble_info si;
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL, limit);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(query);
+      return -1;
+    }
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      si.id = sqlite3_column_int64(stmt, 0);
+      si.artist = (char *)sqlite3_column_text(stmt, 1);
+      si.title = (char *)sqlite3_column_text(stmt, 2);
+      si.album = (char *)sqlite3_column_text(stmt, 3);
+      si.album_artist = (char *)sqlite3_column_text(stmt, 4);
+      si.track = sqlite3_column_int(stmt, 5);
+      si.duration = sqlite3_column_int(stmt, 6);
+      si.timestamp = sqlite3_column_int64(stmt, 7);
+
+      cb(&si, arg);
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return (ret == SQLITE_DONE) ? 0 : -1;
+
+#undef Q_TMPL
+}
+
+int
+db_scrobble_delete_upto(int64_t id)
+{
+#define Q_TMPL "DELETE FROM scrobbles WHERE id <= %" PRIi64 ";"
+  char *query;
+
+  query = sqlite3_mprintf(Q_TMPL, id);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
+int
+db_scrobble_count(void)
+{
+  return db_get_one_int("SELECT COUNT(*) FROM scrobbles;");
+}
+
 /* Queue */
 
 /*
@@ -4083,9 +6883,16 @@ queue_transaction_begin()
 
   db_transaction_begin();
 
-  queue_version = db_admin_getint(DB_ADMIN_QUEUE_VERSION);
+  // All changes of a batch get the same version
+  if (db_queue_batch && db_queue_batch_version > 0)
+    return db_queue_batch_version;
+
+  queue_version = db_admin_getint(db_queue_version_key);
   queue_version++;
 
+  if (db_queue_batch)
+    db_queue_batch_version = queue_version;
+
   return queue_version;
 }
 
@@ -4107,12 +6914,18 @@ queue_transaction_end(int retval, int queue_version)
   if (retval != 0)
     goto error;
 
-  ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
+  ret = db_admin_setint(db_queue_version_key, queue_version);
   if (ret < 0)
     goto error;
 
   db_transaction_end();
-  listener_notify(LISTENER_QUEUE);
+  __atomic_add_fetch(&db_queue_revision, 1, __ATOMIC_RELEASE);
+
+  // Notified when the batch is committed
+  if (db_queue_batch)
+    db_queue_batch_changed = true;
+  else
+    listener_notify(LISTENER_QUEUE);
   return;
 
  error:
@@ -4122,35 +6935,95 @@ queue_transaction_end(int retval, int queue_version)
 static int
 queue_reshuffle(uint32_t item_id, int queue_version);
 
+/* Inserts the files of the query with one INSERT ... SELECT, so that the
+ * values don't take a trip through strings for every file. SQLite inserts the
+ * rows in the order of the query and gives them consecutive ids (the queue id
+ * is AUTOINCREMENT), so their positions are set afterwards from the ids. Items
+ * at or after pos are moved behind the new items.
+ *
+ * @in  qp            Query for files (Q_ITEMS, Q_PLITEMS or Q_GROUP_ITEMS),
+ *                    qp->results is set to the number of files
+ * @in  pos           Position of the first new item
+ * @in  shuffle_pos   Shuffle position of the first new item
+ * @in  queue_version Queue version of the new items
+ * @out last_id       Item id of the last new item (if any)
+ * @return            0 on success, -1 on failure
+ */
 static int
-queue_add_file(struct db_media_file_info *dbmfi, int pos, int shuffle_pos, int queue_version)
+queue_add_query(struct query_params *qp, int pos, int shuffle_pos, int queue_version, int *last_id)
 {
 #define Q_TMPL "INSERT INTO queue "							\
 		    "(id, file_id, song_length, data_kind, media_kind, "		\
 		    "pos, shuffle_pos, path, virtual_path, title, "			\
 		    "artist, album_artist, album, genre, songalbumid, "			\
 		    "time_modified, artist_sort, album_sort, album_artist_sort, year, "	\
-		    "track, disc, queue_version)" 					\
-		"VALUES"                                           			\
-		    "(NULL, %s, %s, %s, %s, "						\
-		    "%d, %d, %Q, %Q, %Q, "						\
-		    "%Q, %Q, %Q, %Q, %s, "						\
-		    "%s, %Q, %Q, %Q, %s, "						\
-		    "%s, %s, %d);"
-
+		    "track, disc, queue_version, zone_id) "				\
+		"SELECT "								\
+		    "NULL, f.id, f.song_length, f.data_kind, f.media_kind, "		\
+		    "0, 0, f.path, f.virtual_path, f.title, "				\
+		    "f.artist, f.album_artist, f.album, f.genre, f.songalbumid, "	\
+		    "f.time_modified, f.artist_sort, f.album_sort, f.album_artist_sort, f.year, " \
+		    "f.track, f.disc, %d, %d "						\
+		"FROM (%s) f;"
+#define Q_SHIFT "UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos >= %d AND id < %d AND zone_id = %d;"
+#define Q_POS "UPDATE queue SET pos = %d + id - %d, shuffle_pos = %d + id - %d WHERE id >= %d AND zone_id = %d;"
+  uint64_t fields;
+  char *files_query;
   char *query;
+  size_t len;
+  int first_id;
+  int count;
   int ret;
 
-  query = sqlite3_mprintf(Q_TMPL,
-			  dbmfi->id, dbmfi->song_length, dbmfi->data_kind, dbmfi->media_kind,
-			  pos, pos, dbmfi->path, dbmfi->virtual_path, dbmfi->title,
-			  dbmfi->artist, dbmfi->album_artist, dbmfi->album, dbmfi->genre, dbmfi->songalbumid,
-			  dbmfi->time_modified, dbmfi->artist_sort, dbmfi->album_sort, dbmfi->album_artist_sort, dbmfi->year,
-			  dbmfi->track, dbmfi->disc, queue_version);
+  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUP_ITEMS))
+    {
+      DPRINTF(E_LOG, L_DB, "Query type %d can't be added to the queue\n", qp->type);
+      return -1;
+    }
+
+  // All columns, however the caller set up the query
+  fields = qp->fields;
+  qp->fields = 0;
+  qp->results = -1;
+  files_query = db_build_query(qp);
+  qp->fields = fields;
+  if (!files_query)
+    return -1;
+
+  DPRINTF(E_DBG, L_DB, "Player queue query returned %d items\n", qp->results);
+
+  if (qp->results == 0)
+    {
+      sqlite3_free(files_query);
+      return 0;
+    }
+
+  // Can't be a subquery with the trailing semicolon
+  len = strlen(files_query);
+  if (len > 0 && files_query[len - 1] == ';')
+    files_query[len - 1] = '\0';
+
+  query = sqlite3_mprintf(Q_TMPL, queue_version, db_zone, files_query);
+  sqlite3_free(files_query);
+
   ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    return -1;
 
-  return ret;
+  *last_id = (int) sqlite3_last_insert_rowid(hdl);
+  count = sqlite3_changes(hdl);
+  first_id = *last_id - count + 1;
+
+  query = sqlite3_mprintf(Q_SHIFT, count, queue_version, pos, first_id, db_zone);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    return -1;
+
+  query = sqlite3_mprintf(Q_POS, pos, first_id, shuffle_pos, first_id, first_id, db_zone);
 
+  return db_query_run(query, 1, 0);
+#undef Q_POS
+#undef Q_SHIFT
 #undef Q_TMPL
 }
 
@@ -4206,13 +7079,51 @@ db_queue_update_item(struct db_queue_item *qi)
  * @param item_id Files are added after item with this id
  * @return 0 on success, -1 on failure
  */
+void
+db_queue_batch_begin(void)
+{
+  if (db_queue_batch)
+    {
+      DPRINTF(E_LOG, L_DB, "Queue batch already running, BUG!\n");
+      return;
+    }
+
+  db_transaction_begin();
+
+  db_queue_batch = true;
+  db_queue_batch_version = 0;
+  db_queue_batch_changed = false;
+  db_queue_batch_savepoints = 0;
+}
+
+void
+db_queue_batch_end(void)
+{
+  if (!db_queue_batch)
+    return;
+
+  if (db_queue_batch_savepoints > 0)
+    DPRINTF(E_LOG, L_DB, "Queue batch ended with %d open transactions, BUG!\n", db_queue_batch_savepoints);
+
+  db_queue_batch = false;
+
+  db_transaction_end();
+
+  if (!db_queue_batch_changed)
+    return;
+
+  // Again after the commit, so that nothing another thread cached from the
+  // uncommitted state is considered current
+  __atomic_add_fetch(&db_queue_revision, 1, __ATOMIC_RELEASE);
+  listener_notify(LISTENER_QUEUE);
+}
+
 int
 db_queue_add_by_queryafteritemid(struct query_params *qp, uint32_t item_id)
 {
   int queue_version;
-  struct db_media_file_info dbmfi;
-  char *query;
   int shuffle_pos;
+  int last_id;
   int pos;
   int ret;
 
@@ -4235,36 +7146,8 @@ db_queue_add_by_queryafteritemid(struct query_params *qp, uint32_t item_id)
       goto end_transaction;
     }
 
-  // Start query for new items from files table
-  ret = db_query_start(qp);
-  if (ret < 0)
-    goto end_transaction;
-
-  DPRINTF(E_DBG, L_DB, "Player queue query returned %d items\n", qp->results);
-
-  // Update pos for all items after the item with item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos + %d, queue_version = %d WHERE pos > %d;", qp->results, queue_version, (pos - 1));
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Iterate over new items from files table and insert into queue
-  while (((ret = db_query_fetch_file(qp, &dbmfi)) == 0) && (dbmfi.id))
-    {
-      ret = queue_add_file(&dbmfi, pos, shuffle_pos, queue_version);
-
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DB, "Failed to add song with id %s (%s) to queue\n", dbmfi.id, dbmfi.title);
-	  break;
-	}
-
-      DPRINTF(E_DBG, L_DB, "Added song with id %s (%s) to queue\n", dbmfi.id, dbmfi.title);
-      shuffle_pos++;
-      pos++;
-    }
-
-  db_query_end(qp);
+  // Also moves the items after the item with item_id
+  ret = queue_add_query(qp, pos, shuffle_pos, queue_version, &last_id);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -4289,7 +7172,6 @@ db_queue_add_by_queryafteritemid(struct query_params *qp, uint32_t item_id)
 int
 db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id)
 {
-  struct db_media_file_info dbmfi;
   int queue_version;
   int pos;
   int new_item_id;
@@ -4304,40 +7186,16 @@ db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id)
       goto end_transaction;
     }
 
-  ret = db_query_start(qp);
+  ret = queue_add_query(qp, pos, pos, queue_version, &new_item_id);
   if (ret < 0)
     goto end_transaction;
 
-  DPRINTF(E_DBG, L_DB, "Player queue query returned %d items\n", qp->results);
-
   if (qp->results == 0)
     {
-      db_query_end(qp);
       db_transaction_end();
       return 0;
     }
 
-  while (((ret = db_query_fetch_file(qp, &dbmfi)) == 0) && (dbmfi.id))
-    {
-      ret = queue_add_file(&dbmfi, pos, pos, queue_version);
-
-      if (ret < 0)
-	{
-	  DPRINTF(E_DBG, L_DB, "Failed to add song id %s (%s)\n", dbmfi.id, dbmfi.title);
-	  break;
-	}
-
-      DPRINTF(E_DBG, L_DB, "Added song id %s (%s) to queue\n", dbmfi.id, dbmfi.title);
-      pos++;
-    }
-
-  db_query_end(qp);
-
-  if (ret < 0)
-    goto end_transaction;
-
-  new_item_id = (int) sqlite3_last_insert_rowid(hdl);
-
   // Reshuffle after adding new items
   if (reshuffle)
     {
@@ -4408,13 +7266,13 @@ db_queue_add_item(struct db_queue_item *queue_item, char reshuffle, uint32_t ite
 		    "pos, shuffle_pos, path, virtual_path, title, "			\
 		    "artist, album_artist, album, genre, songalbumid, "			\
 		    "time_modified, artist_sort, album_sort, album_artist_sort, year, "	\
-		    "track, disc, queue_version)" 					\
+		    "track, disc, queue_version, zone_id)" 				\
 		"VALUES"                                           			\
 		    "(NULL, %d, %d, %d, %d, "						\
 		    "%d, %d, %Q, %Q, %Q, "						\
 		    "%Q, %Q, %Q, %Q, %d, "						\
 		    "%d, %Q, %Q, %Q, %d, "						\
-		    "%d, %d, %d);"
+		    "%d, %d, %d, %d);"
 
   int queue_version;
   char *query;
@@ -4436,7 +7294,7 @@ db_queue_add_item(struct db_queue_item *queue_item, char reshuffle, uint32_t ite
 			  pos, pos, queue_item->path, queue_item->virtual_path, queue_item->title,
 			  queue_item->artist, queue_item->album_artist, queue_item->album, queue_item->genre, queue_item->songalbumid,
 			  queue_item->time_modified, queue_item->artist_sort, queue_item->album_sort, queue_item->album_artist_sort, queue_item->year,
-			  queue_item->track, queue_item->disc, queue_version);
+			  queue_item->track, queue_item->disc, queue_version, db_zone);
   ret = db_query_run(query, 1, 0);
   if (ret < 0)
     goto end_transaction;
@@ -4460,10 +7318,11 @@ db_queue_add_item(struct db_queue_item *queue_item, char reshuffle, uint32_t ite
 static int
 queue_enum_start(struct query_params *qp)
 {
-#define Q_TMPL "SELECT * FROM queue f WHERE %s %s;"
+#define Q_TMPL "SELECT * FROM queue f WHERE f.zone_id = %d AND (%s) %s %s;"
   sqlite3_stmt *stmt;
   char *query;
   const char *orderby;
+  char limit[64];
   int ret;
 
   qp->stmt = NULL;
@@ -4473,10 +7332,17 @@ queue_enum_start(struct query_params *qp)
   else
     orderby = sort_clause[S_POS];
 
+  if (qp->limit > 0)
+    snprintf(limit, sizeof(limit), "LIMIT %d OFFSET %d", qp->limit, qp->offset);
+  else if (qp->offset > 0)
+    snprintf(limit, sizeof(limit), "LIMIT -1 OFFSET %d", qp->offset);
+  else
+    limit[0] = '\0';
+
   if (qp->filter)
-    query = sqlite3_mprintf(Q_TMPL, qp->filter, orderby);
+    query = sqlite3_mprintf(Q_TMPL, db_zone, qp->filter, orderby, limit);
   else
-    query = sqlite3_mprintf(Q_TMPL, "1=1", orderby);
+    query = sqlite3_mprintf(Q_TMPL, db_zone, "1=1", orderby, limit);
 
   if (!query)
     {
@@ -4512,7 +7378,19 @@ strdup_if(char *str, int cond)
     return NULL;
 
   if (cond)
-    return strdup(str);
+    return db_strdup(str);
+
+  return str;
+}
+
+static inline char *
+strdup_tag_if(char *str, int cond)
+{
+  if (str == NULL)
+    return NULL;
+
+  if (cond)
+    return db_strdup_tag(str);
 
   return str;
 }
@@ -4552,10 +7430,10 @@ queue_enum_fetch(struct query_params *qp, struct db_queue_item *queue_item, int
   queue_item->path = strdup_if((char *)sqlite3_column_text(qp->stmt, 7), keep_item);
   queue_item->virtual_path = strdup_if((char *)sqlite3_column_text(qp->stmt, 8), keep_item);
   queue_item->title = strdup_if((char *)sqlite3_column_text(qp->stmt, 9), keep_item);
-  queue_item->artist = strdup_if((char *)sqlite3_column_text(qp->stmt, 10), keep_item);
-  queue_item->album_artist = strdup_if((char *)sqlite3_column_text(qp->stmt, 11), keep_item);
-  queue_item->album = strdup_if((char *)sqlite3_column_text(qp->stmt, 12), keep_item);
-  queue_item->genre = strdup_if((char *)sqlite3_column_text(qp->stmt, 13), keep_item);
+  queue_item->artist = strdup_tag_if((char *)sqlite3_column_text(qp->stmt, 10), keep_item);
+  queue_item->album_artist = strdup_tag_if((char *)sqlite3_column_text(qp->stmt, 11), keep_item);
+  queue_item->album = strdup_tag_if((char *)sqlite3_column_text(qp->stmt, 12), keep_item);
+  queue_item->genre = strdup_tag_if((char *)sqlite3_column_text(qp->stmt, 13), keep_item);
   queue_item->songalbumid = sqlite3_column_int64(qp->stmt, 14);
   queue_item->time_modified = sqlite3_column_int(qp->stmt, 15);
   queue_item->artist_sort = strdup_if((char *)sqlite3_column_text(qp->stmt, 16), keep_item);
@@ -4624,16 +7502,16 @@ db_queue_get_pos(uint32_t item_id, char shuffle)
 int
 db_queue_get_pos_byfileid(uint32_t file_id, char shuffle)
 {
-#define Q_TMPL "SELECT pos FROM queue WHERE file_id = %d LIMIT 1;"
-#define Q_TMPL_SHUFFLE "SELECT shuffle_pos FROM queue WHERE file_id = %d LIMIT 1;"
+#define Q_TMPL "SELECT pos FROM queue WHERE file_id = %d AND zone_id = %d LIMIT 1;"
+#define Q_TMPL_SHUFFLE "SELECT shuffle_pos FROM queue WHERE file_id = %d AND zone_id = %d LIMIT 1;"
 
   char *query;
   int pos;
 
   if (shuffle)
-    query = sqlite3_mprintf(Q_TMPL_SHUFFLE, file_id);
+    query = sqlite3_mprintf(Q_TMPL_SHUFFLE, file_id, db_zone);
   else
-    query = sqlite3_mprintf(Q_TMPL, file_id);
+    query = sqlite3_mprintf(Q_TMPL, file_id, db_zone);
 
   pos = db_get_one_int(query);
 
@@ -4673,7 +7551,7 @@ db_queue_fetch_byitemid(uint32_t item_id)
   struct db_queue_item *queue_item;
   int ret;
 
-  queue_item = calloc(1, sizeof(struct db_queue_item));
+  queue_item = db_calloc(sizeof(struct db_queue_item));
   if (!queue_item)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
@@ -4708,7 +7586,7 @@ db_queue_fetch_byfileid(uint32_t file_id)
   int ret;
 
   memset(&qp, 0, sizeof(struct query_params));
-  queue_item = calloc(1, sizeof(struct db_queue_item));
+  queue_item = db_calloc(sizeof(struct db_queue_item));
   if (!queue_item)
     {
       DPRINTF(E_LOG, L_DB, "Out of memory for queue_item\n");
@@ -4781,7 +7659,7 @@ db_queue_fetch_bypos(uint32_t pos, char shuffle)
   struct db_queue_item *queue_item;
   int ret;
 
-  queue_item = calloc(1, sizeof(struct db_queue_item));
+  queue_item = db_calloc(sizeof(struct db_queue_item));
   if (!queue_item)
     {
       DPRINTF(E_LOG, L_MAIN, "Out of memory for queue_item\n");
@@ -4844,7 +7722,7 @@ db_queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle)
 
   DPRINTF(E_DBG, L_DB, "Fetch by pos: pos (%d) relative to item with id (%d)\n", pos, item_id);
 
-  queue_item = calloc(1, sizeof(struct db_queue_item));
+  queue_item = db_calloc(sizeof(struct db_queue_item));
   if (!queue_item)
     {
       DPRINTF(E_LOG, L_MAIN, "Out of memory for queue_item\n");
@@ -4890,14 +7768,17 @@ db_queue_fetch_prev(uint32_t item_id, char shuffle)
 static int
 queue_fix_pos(enum sort_type sort, int queue_version)
 {
-#define Q_TMPL "UPDATE queue SET %q = %d, queue_version = %d WHERE id = %d and %q <> %d;"
-
   struct query_params qp;
   struct db_queue_item queue_item;
-  char *query;
+  sqlite3_stmt *stmt;
+  uint32_t item_pos;
   int pos;
   int ret;
 
+  stmt = db_stmt_get((sort == S_SHUFFLE_POS) ? DB_STMT_QUEUE_SET_SHUFFLE_POS : DB_STMT_QUEUE_SET_POS);
+  if (!stmt)
+    return -1;
+
   memset(&qp, 0, sizeof(struct query_params));
   qp.sort = sort;
 
@@ -4910,14 +7791,21 @@ queue_fix_pos(enum sort_type sort, int queue_version)
   pos = 0;
   while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0))
     {
-      if (queue_item.pos != pos)
+      item_pos = (sort == S_SHUFFLE_POS) ? queue_item.shuffle_pos : queue_item.pos;
+      if (item_pos != pos)
         {
+	  // Changes of the shuffled order don't change the item version (see
+	  // queue_move_item)
+	  sqlite3_bind_int(stmt, 1, pos);
 	  if (sort == S_SHUFFLE_POS)
-	    query = sqlite3_mprintf(Q_TMPL, "shuffle_pos", pos, queue_version, queue_item.id, "shuffle_pos", pos);
+	    sqlite3_bind_int(stmt, 2, queue_item.id);
 	  else
-	    query = sqlite3_mprintf(Q_TMPL, "pos", pos, queue_version, queue_item.id, "pos", pos);
+	    {
+	      sqlite3_bind_int(stmt, 2, queue_version);
+	      sqlite3_bind_int(stmt, 3, queue_item.id);
+	    }
 
-	  ret = db_query_run(query, 1, 0);
+	  ret = db_stmt_run(stmt, 0);
 	  if (ret < 0)
 	    {
 	      DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", queue_item.id);
@@ -4929,9 +7817,7 @@ queue_fix_pos(enum sort_type sort, int queue_version)
     }
 
   db_query_end(&qp);
-  return ret;
-
-#undef Q_TMPL
+  return (ret < 0) ? -1 : 0;
 }
 
 /*
@@ -4941,15 +7827,17 @@ queue_fix_pos(enum sort_type sort, int queue_version)
 int
 db_queue_cleanup()
 {
-#define Q_TMPL "DELETE FROM queue WHERE NOT file_id IN (SELECT id from files WHERE disabled = 0);"
+#define Q_TMPL "DELETE FROM queue WHERE zone_id = %d AND NOT file_id IN (SELECT id from files WHERE disabled = 0);"
 
   int queue_version;
+  char *query;
   int deleted;
   int ret;
 
   queue_version = queue_transaction_begin();
 
-  ret = db_query_run(Q_TMPL, 0, 0);
+  query = sqlite3_mprintf(Q_TMPL, db_zone);
+  ret = db_query_run(query, 1, 0);
   if (ret < 0)
     goto end_transaction;
 
@@ -4991,7 +7879,7 @@ db_queue_clear(uint32_t keep_item_id)
 
   queue_version = queue_transaction_begin();
 
-  query = sqlite3_mprintf("DELETE FROM queue where id <> %d;", keep_item_id);
+  query = sqlite3_mprintf("DELETE FROM queue where id <> %d AND zone_id = %d;", keep_item_id, db_zone);
   ret = db_query_run(query, 1, 0);
 
   if (ret == 0 && keep_item_id)
@@ -5020,7 +7908,7 @@ queue_delete_item(struct db_queue_item *queue_item, int queue_version)
     }
 
   // Update pos for all items after the item with given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item->pos);
+  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d AND zone_id = %d;", queue_version, queue_item->pos, db_zone);
   ret = db_query_run(query, 1, 0);
   if (ret < 0)
     {
@@ -5028,7 +7916,7 @@ queue_delete_item(struct db_queue_item *queue_item, int queue_version)
     }
 
   // Update shuffle_pos for all items after the item with given item_id
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, queue_item->shuffle_pos);
+  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1 WHERE shuffle_pos > %d AND zone_id = %d;", queue_item->shuffle_pos, db_zone);
   ret = db_query_run(query, 1, 0);
   if (ret < 0)
     {
@@ -5078,12 +7966,14 @@ db_queue_delete_bypos(uint32_t pos, int count)
 
   // Remove item with the given item_id
   to_pos = pos + count;
-  query = sqlite3_mprintf("DELETE FROM queue where pos >= %d AND pos < %d;", pos, to_pos);
+  query = sqlite3_mprintf("DELETE FROM queue where pos >= %d AND pos < %d AND zone_id = %d;", pos, to_pos, db_zone);
   ret = db_query_run(query, 1, 0);
   if (ret < 0)
     goto end_transaction;
 
-  ret = queue_fix_pos(S_POS, queue_version);
+  // The deleted items were consecutive in the normal order, so just close the gap
+  query = sqlite3_mprintf("UPDATE queue SET pos = pos - %d, queue_version = %d WHERE pos >= %d AND zone_id = %d;", count, queue_version, to_pos, db_zone);
+  ret = db_query_run(query, 1, 0);
   if (ret < 0)
     goto end_transaction;
 
@@ -5123,6 +8013,42 @@ db_queue_delete_byposrelativetoitem(uint32_t pos, uint32_t item_id, char shuffle
   return ret;
 }
 
+/*
+ * Moves the queue item with the given id from pos_from to pos_to, in the normal
+ * or the shuffled order. Only the items between the two positions are shifted,
+ * so a short move in a long queue only touches a few rows.
+ *
+ * The queue_version of an item records when its content or its pos last
+ * changed (what MPD's plchanges reports), so it is left alone when only the
+ * shuffled order changes.
+ */
+static int
+queue_move_item(uint32_t item_id, int pos_from, int pos_to, char shuffle, int queue_version)
+{
+#define Q_TMPL "UPDATE queue SET %s = CASE WHEN id = %d THEN %d ELSE %s %s 1 END%s WHERE zone_id = %d AND %s >= %d AND %s <= %d;"
+  const char *col;
+  char *version;
+  char *query;
+
+  if (pos_from == pos_to)
+    return 0;
+
+  col = shuffle ? "shuffle_pos" : "pos";
+  version = shuffle ? sqlite3_mprintf("") : sqlite3_mprintf(", queue_version = %d", queue_version);
+  if (!version)
+    return -1;
+
+  if (pos_from < pos_to)
+    query = sqlite3_mprintf(Q_TMPL, col, item_id, pos_to, col, "-", version, db_zone, col, pos_from, col, pos_to);
+  else
+    query = sqlite3_mprintf(Q_TMPL, col, item_id, pos_to, col, "+", version, db_zone, col, pos_to, col, pos_from);
+
+  sqlite3_free(version);
+
+  return db_query_run(query, 1, 0);
+#undef Q_TMPL
+}
+
 /*
  * Moves the queue item with the given id to the given position (zero-based).
  *
@@ -5135,7 +8061,6 @@ int
 db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
 {
   int queue_version;
-  char *query;
   int pos_from;
   int ret;
 
@@ -5149,33 +8074,7 @@ db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
       goto end_transaction;
     }
 
-  // Update pos for all items after the item with given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, pos_from);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, pos_from);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
-
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move_item(item_id, pos_from, pos_to, shuffle, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -5195,7 +8094,6 @@ db_queue_move_bypos(int pos_from, int pos_to)
 {
   int queue_version;
   struct db_queue_item queue_item;
-  char *query;
   int ret;
 
   queue_version = queue_transaction_begin();
@@ -5211,21 +8109,7 @@ db_queue_move_bypos(int pos_from, int pos_to)
       return 0;
     }
 
-  // Update pos for all items after the item with given position
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, queue_item.id);
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move_item(queue_item.id, queue_item.pos, pos_to, 0, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -5247,7 +8131,6 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
 {
   int queue_version;
   struct db_queue_item queue_item;
-  char *query;
   int pos_move_from;
   int pos_move_to;
   int ret;
@@ -5304,33 +8187,7 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
       return 0;
     }
 
-  // Update pos for all items after the item with given position
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, queue_item.shuffle_pos);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_move_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_move_to);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
-
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move_item(queue_item.id, (shuffle ? queue_item.shuffle_pos : queue_item.pos), pos_move_to, shuffle, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -5350,6 +8207,7 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
 static int
 queue_reshuffle(uint32_t item_id, int queue_version)
 {
+  sqlite3_stmt *stmt;
   char *query;
   int pos;
   int count;
@@ -5362,14 +8220,6 @@ queue_reshuffle(uint32_t item_id, int queue_version)
 
   DPRINTF(E_DBG, L_DB, "Reshuffle queue after item with item-id: %d\n", item_id);
 
-  // Reset the shuffled order and mark all items as changed
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = pos, queue_version = %d;", queue_version);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    {
-      return -1;
-    }
-
   pos = 0;
   if (item_id > 0)
     {
@@ -5382,6 +8232,15 @@ queue_reshuffle(uint32_t item_id, int queue_version)
       pos++; // Do not reshuffle the base item
     }
 
+  // Reset the shuffled order up to the base item, the items after it get their
+  // new shuffle_pos below
+  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = pos WHERE pos < %d AND zone_id = %d;", pos, db_zone);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    {
+      return -1;
+    }
+
   count = db_queue_get_count();
 
   len = count - pos;
@@ -5403,14 +8262,26 @@ queue_reshuffle(uint32_t item_id, int queue_version)
   if (ret < 0)
     {
       sqlite3_free(qp.filter);
+      free(shuffle_pos);
+      return -1;
+    }
+
+  stmt = db_stmt_get(DB_STMT_QUEUE_SET_SHUFFLE_POS);
+  if (!stmt)
+    {
+      db_query_end(&qp);
+      sqlite3_free(qp.filter);
+      free(shuffle_pos);
       return -1;
     }
 
   i = 0;
   while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0) && (i < len))
     {
-      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d where id = %d;", shuffle_pos[i], queue_item.id);
-      ret = db_query_run(query, 1, 0);
+      sqlite3_bind_int(stmt, 1, shuffle_pos[i]);
+      sqlite3_bind_int(stmt, 2, queue_item.id);
+
+      ret = db_stmt_run(stmt, 0);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DB, "Failed to delete item with item-id: %d\n", queue_item.id);
@@ -5422,6 +8293,7 @@ queue_reshuffle(uint32_t item_id, int queue_version)
 
   db_query_end(&qp);
   sqlite3_free(qp.filter);
+  free(shuffle_pos);
 
   if (ret < 0)
     {
@@ -5458,7 +8330,27 @@ db_queue_reshuffle(uint32_t item_id)
 int
 db_queue_get_count()
 {
-  return db_get_one_int("SELECT COUNT(*) FROM queue;");
+  char *query;
+  int count;
+
+  query = sqlite3_mprintf("SELECT COUNT(*) FROM queue WHERE zone_id = %d;", db_zone);
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+      return -1;
+    }
+
+  count = db_get_one_int(query);
+
+  sqlite3_free(query);
+
+  return count;
+}
+
+int
+db_queue_get_version(void)
+{
+  return db_admin_getint(db_queue_version_key);
 }
 
 
@@ -6146,7 +9038,10 @@ db_perthread_init(void)
   int synchronous;
   int mmap_size;
 
-  ret = sqlite3_open(db_path, &hdl);
+  if (db_memory_hdl)
+    ret = sqlite3_open_v2(DB_MEMORY_URI, &hdl, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+  else
+    ret = sqlite3_open(db_path, &hdl);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not open '%s': %s\n", db_path, sqlite3_errmsg(hdl));
@@ -6155,6 +9050,11 @@ db_perthread_init(void)
       return -1;
     }
 
+#if SQLITE_VERSION_NUMBER >= 3014000
+  if (db_slow_query_ms > 0 || db_index_max > 0 || db_metric_duration)
+    sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_query_stats_cb, NULL);
+#endif
+
   ret = sqlite3_enable_load_extension(hdl, 1);
   if (ret != SQLITE_OK)
     {
@@ -6226,6 +9126,149 @@ db_perthread_init(void)
   return 0;
 }
 
+/* Copies the main database of src to dst with the backup API */
+static int
+db_backup(sqlite3 *dst, sqlite3 *src)
+{
+  sqlite3_backup *backup;
+  int ret;
+
+  backup = sqlite3_backup_init(dst, "main", src, "main");
+  if (!backup)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not start database copy: %s\n", sqlite3_errmsg(dst));
+      return -1;
+    }
+
+  while (((ret = sqlite3_backup_step(backup, -1)) == SQLITE_BUSY) || (ret == SQLITE_LOCKED))
+    sqlite3_sleep(10);
+
+  sqlite3_backup_finish(backup);
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Database copy failed: %s\n", sqlite3_errstr(ret));
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Changes whenever another connection commits to the in-memory database */
+static int
+db_memory_data_version(void)
+{
+  sqlite3_stmt *stmt;
+  int version;
+  int ret;
+
+  ret = sqlite3_prepare_v2(db_memory_hdl, "PRAGMA data_version;", -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    return -1;
+
+  version = -1;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int(stmt, 0);
+
+  sqlite3_finalize(stmt);
+
+  return version;
+}
+
+static int
+db_memory_load(void)
+{
+  sqlite3 *disk;
+  int ret;
+
+  ret = sqlite3_open_v2(DB_MEMORY_URI, &db_memory_hdl, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not create in-memory database: %s\n", sqlite3_errmsg(db_memory_hdl));
+      goto error;
+    }
+
+  ret = sqlite3_open(db_path, &disk);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not open '%s': %s\n", db_path, sqlite3_errmsg(disk));
+      sqlite3_close(disk);
+      goto error;
+    }
+
+  ret = db_backup(db_memory_hdl, disk);
+  sqlite3_close(disk);
+  if (ret < 0)
+    goto error;
+
+  db_memory_version = db_memory_data_version();
+
+  DPRINTF(E_LOG, L_DB, "Loaded database '%s' into memory\n", db_path);
+
+  return 0;
+
+ error:
+  sqlite3_close(db_memory_hdl);
+  db_memory_hdl = NULL;
+  return -1;
+}
+
+/* Thread: any
+ *
+ * In in-memory mode, writes the database back to db_path if it was changed
+ * since the last time. Does nothing otherwise.
+ */
+int
+db_persist(void)
+{
+  sqlite3 *disk;
+  int version;
+  int ret;
+
+  if (!db_memory_hdl)
+    return 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_memory_lck));
+
+  version = db_memory_data_version();
+  if ((version >= 0) && (version == db_memory_version))
+    {
+      DPRINTF(E_DBG, L_DB, "In-memory database unchanged, not writing it to disk\n");
+      ret = 0;
+      goto out;
+    }
+
+  ret = sqlite3_open(db_path, &disk);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not open '%s': %s\n", db_path, sqlite3_errmsg(disk));
+      sqlite3_close(disk);
+      ret = -1;
+      goto out;
+    }
+
+  ret = db_backup(disk, db_memory_hdl);
+  sqlite3_close(disk);
+  if (ret < 0)
+    goto out;
+
+  db_memory_version = version;
+
+  DPRINTF(E_DBG, L_DB, "Wrote in-memory database to '%s'\n", db_path);
+
+ out:
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_memory_lck));
+
+  return ret;
+}
+
+/* Seconds between calls of db_persist(), 0 if the database is not in memory */
+int
+db_persist_interval(void)
+{
+  return (db_memory_hdl) ? db_persist_secs : 0;
+}
+
 void
 db_perthread_deinit(void)
 {
@@ -6234,6 +9277,14 @@ db_perthread_deinit(void)
   if (!hdl)
     return;
 
+  db_stmt_cache_clear();
+
+  free(db_slow_query);
+  db_slow_query = NULL;
+
+  arena_free(&db_arena);
+  db_arena_depth = 0;
+
   /* Tear down anything that's in flight */
   while ((stmt = sqlite3_next_stmt(hdl, 0)))
     sqlite3_finalize(stmt);
@@ -6247,21 +9298,25 @@ db_perthread_deinit(void)
 static int
 db_check_version(void)
 {
-#define Q_VACUUM "VACUUM;"
   char *errmsg;
   int db_ver_major;
   int db_ver_minor;
   int db_ver;
-  int vacuum;
   int ret;
 
-  vacuum = cfg_getbool(cfg_getsec(cfg, "sqlite"), "vacuum");
+  if (cfg_getbool(cfg_getsec(cfg, "sqlite"), "vacuum"))
+    db_maintenance_schedule(DB_MAINTENANCE_VACUUM);
 
   db_ver_major = db_admin_getint(DB_ADMIN_SCHEMA_VERSION_MAJOR);
   if (!db_ver_major)
     db_ver_major = db_admin_getint(DB_ADMIN_SCHEMA_VERSION); // Pre schema v15.1
 
-  if (!db_ver_major)
+  if (!db_ver_major && db_frontend)
+    {
+      DPRINTF(E_FATAL, L_DB, "No library database at '%s', the scanning instance must create it first\n", db_path);
+      return -1;
+    }
+  else if (!db_ver_major)
     return 1; // Will create new database
 
   db_ver_minor = db_admin_getint(DB_ADMIN_SCHEMA_VERSION_MINOR);
@@ -6278,6 +9333,11 @@ db_check_version(void)
     {
       DPRINTF(E_FATAL, L_DB, "Database schema v%d is newer than the supported version\n", db_ver_major);
 
+      return -1;
+    }
+  else if (db_ver < (SCHEMA_VERSION_MAJOR * 100 + SCHEMA_VERSION_MINOR) && db_frontend)
+    {
+      DPRINTF(E_FATAL, L_DB, "Database schema v%d.%d is outdated, the scanning instance must be upgraded first\n", db_ver_major, db_ver_minor);
       return -1;
     }
   else if (db_ver < (SCHEMA_VERSION_MAJOR * 100 + SCHEMA_VERSION_MINOR))
@@ -6309,21 +9369,6 @@ db_check_version(void)
 	  return -1;
 	}
 
-      ret = db_init_indices(hdl);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DB, "Database upgrade errored out, rolling back changes ...\n");
-	  ret = sqlite3_exec(hdl, "ROLLBACK TRANSACTION;", NULL, NULL, &errmsg);
-	  if (ret != SQLITE_OK)
-	    {
-	      DPRINTF(E_LOG, L_DB, "DB error while running 'ROLLBACK TRANSACTION': %s\n",  errmsg);
-
-	      sqlite3_free(errmsg);
-	    }
-
-	  return -1;
-	}
-
       ret = sqlite3_exec(hdl, "COMMIT TRANSACTION;", NULL, NULL, &errmsg);
       if (ret != SQLITE_OK)
 	{
@@ -6335,37 +9380,131 @@ db_check_version(void)
 
       DPRINTF(E_LOG, L_DB, "Upgrading schema to v%d.%d completed\n", SCHEMA_VERSION_MAJOR, SCHEMA_VERSION_MINOR);
 
-      vacuum = 1;
+      // The upgrade may have dropped indices, they are rebuilt by the library
+      // thread before its first scan, the rest waits until we are idle
+      db_maintenance_schedule(DB_MAINTENANCE_INDICES | DB_MAINTENANCE_ANALYZE | DB_MAINTENANCE_VACUUM);
     }
 
-  if (vacuum)
-    {
-      DPRINTF(E_LOG, L_DB, "Now vacuuming database, this may take some time...\n");
+  return 0;
+}
+
+/*
+ * Sets up the full-text search index. It is not part of the schema because it
+ * needs an SQLite with FTS5 and the trigram tokenizer (3.34+). If that's not
+ * available we just keep using LIKE for searches.
+ */
+static void
+db_fts_init(void)
+{
+#define Q_FTS_COLS "title, artist, album, album_artist, composer, genre"
+#define Q_FTS_NEW "new.id, new.title, new.artist, new.album, new.album_artist, new.composer, new.genre"
+#define Q_FTS_OLD "'delete', old.id, old.title, old.artist, old.album, old.album_artist, old.composer, old.genre"
+  char *queries[] =
+    {
+      "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5(" Q_FTS_COLS ", content='files', content_rowid='id', tokenize='trigram');",
+      "CREATE TRIGGER IF NOT EXISTS files_fts_insert AFTER INSERT ON files FOR EACH ROW"
+      " BEGIN"
+      "   INSERT INTO files_fts (rowid, " Q_FTS_COLS ") VALUES (" Q_FTS_NEW ");"
+      " END;",
+      "CREATE TRIGGER IF NOT EXISTS files_fts_delete AFTER DELETE ON files FOR EACH ROW"
+      " BEGIN"
+      "   INSERT INTO files_fts (files_fts, rowid, " Q_FTS_COLS ") VALUES (" Q_FTS_OLD ");"
+      " END;",
+      "CREATE TRIGGER IF NOT EXISTS files_fts_update AFTER UPDATE OF " Q_FTS_COLS " ON files FOR EACH ROW"
+      " BEGIN"
+      "   INSERT INTO files_fts (files_fts, rowid, " Q_FTS_COLS ") VALUES (" Q_FTS_OLD ");"
+      "   INSERT INTO files_fts (rowid, " Q_FTS_COLS ") VALUES (" Q_FTS_NEW ");"
+      " END;",
+    };
+  char *errmsg;
+  int nfiles;
+  int nindexed;
+  int i;
+  int ret;
+
+  __atomic_store_n(&db_fts_enabled, false, __ATOMIC_RELEASE);
 
-      ret = sqlite3_exec(hdl, Q_VACUUM, NULL, NULL, &errmsg);
+  for (i = 0; i < sizeof(queries) / sizeof(queries[0]); i++)
+    {
+      ret = db_exec(queries[i], &errmsg);
       if (ret != SQLITE_OK)
 	{
-	  DPRINTF(E_LOG, L_DB, "Could not VACUUM database: %s\n", errmsg);
+	  DPRINTF(E_LOG, L_DB, "Could not create full-text search index, searches will be slow: %s\n", errmsg);
 
 	  sqlite3_free(errmsg);
-	  return -1;
+	  return;
 	}
     }
 
-  return 0;
+  // If the index is new, or the files table was rebuilt by a schema upgrade
+  // (which drops our triggers), the index is out of sync and must be rebuilt
+  nfiles = db_get_one_int("SELECT COUNT(*) FROM files;");
+  nindexed = db_get_one_int("SELECT COUNT(*) FROM files_fts_docsize;");
+  if (nfiles != nindexed)
+    {
+      // Searches use LIKE until the index is built
+      DPRINTF(E_LOG, L_DB, "Full-text search index is out of date, will rebuild it for %d files when idle\n", nfiles);
+
+      db_maintenance_schedule(DB_MAINTENANCE_FTS);
+      return;
+    }
 
-#undef Q_VACUUM
+  __atomic_store_n(&db_fts_enabled, true, __ATOMIC_RELEASE);
+
+#undef Q_FTS_COLS
+#undef Q_FTS_NEW
+#undef Q_FTS_OLD
 }
 
 int
 db_init(void)
 {
+  char *query;
+  bool new_db;
   int files;
   int pls;
   int ret;
 
   db_path = cfg_getstr(cfg_getsec(cfg, "general"), "db_path");
 
+  db_frontend = cfg_getbool(cfg_getsec(cfg, "library"), "frontend");
+
+  db_zone = cfg_getint(cfg_getsec(cfg, "general"), "zone");
+  if (db_zone < 0)
+    {
+      DPRINTF(E_FATAL, L_DB, "Invalid zone %d in config, must be 0 or higher\n", db_zone);
+      return -1;
+    }
+  else if (db_zone > 0)
+    snprintf(db_queue_version_key, sizeof(db_queue_version_key), "%s_%d", DB_ADMIN_QUEUE_VERSION, db_zone);
+  else
+    snprintf(db_queue_version_key, sizeof(db_queue_version_key), "%s", DB_ADMIN_QUEUE_VERSION);
+
+  db_purge_batch = cfg_getint(cfg_getsec(cfg, "library"), "purge_batch_size");
+  if (db_purge_batch <= 0)
+    db_purge_batch = INT_MAX;
+
+  db_slow_query_ms = cfg_getint(cfg_getsec(cfg, "sqlite"), "slow_query_threshold");
+  db_index_max = cfg_getint(cfg_getsec(cfg, "sqlite"), "auto_indexes");
+  if (db_index_max < 0)
+    db_index_max = 0;
+  db_index_max_bytes = (int64_t)1024 * 1024 * cfg_getint(cfg_getsec(cfg, "sqlite"), "auto_index_max_size");
+#if SQLITE_VERSION_NUMBER >= 3014000
+  db_metric_duration = metrics_register("forked_daapd_db_statement_duration_seconds", NULL, METRICS_HISTOGRAM, "Time SQLite spent running statements");
+#endif
+#if SQLITE_VERSION_NUMBER < 3014000
+  if (db_slow_query_ms > 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Slow query logging requires SQLite 3.14 or later, disabling\n");
+      db_slow_query_ms = 0;
+    }
+  if (db_index_max > 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Automatic indices require SQLite 3.14 or later, disabling\n");
+      db_index_max = 0;
+    }
+#endif
+
   ret = sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
   if (ret != SQLITE_OK)
     {
@@ -6388,6 +9527,19 @@ db_init(void)
       return -1;
     }
 
+  if (cfg_getbool(cfg_getsec(cfg, "sqlite"), "in_memory") && db_frontend)
+    DPRINTF(E_LOG, L_DB, "A frontend can't load the database into memory, it wouldn't see the changes of the scanning instance\n");
+  else if (cfg_getbool(cfg_getsec(cfg, "sqlite"), "in_memory"))
+    {
+      db_persist_secs = cfg_getint(cfg_getsec(cfg, "sqlite"), "persist_interval");
+      if (db_persist_secs <= 0)
+	db_persist_secs = 300;
+
+      ret = db_memory_load();
+      if (ret < 0)
+	DPRINTF(E_LOG, L_DB, "Loading the database into memory failed, using it from disk\n");
+    }
+
   ret = db_perthread_init();
   if (ret < 0)
     return ret;
@@ -6400,7 +9552,8 @@ db_init(void)
       db_perthread_deinit();
       return -1;
     }
-  else if (ret > 0)
+  new_db = (ret > 0);
+  if (new_db)
     {
       DPRINTF(E_LOG, L_DB, "Could not check database version, trying DB init\n");
 
@@ -6413,13 +9566,47 @@ db_init(void)
 	}
     }
 
-  db_analyze();
+  db_fts_init();
+
+  // Quick check for a schema that doesn't look like the one we last verified,
+  // fixing it is left to the background maintenance
+  if (db_frontend)
+    ; // Checked by the scanning instance
+  else if (db_schema_fingerprint() != (uint64_t)db_admin_getint64(DB_ADMIN_SCHEMA_FINGERPRINT))
+    {
+      if (db_maintenance_pending() & DB_MAINTENANCE_INDICES)
+	; // Upgraded, saved after the rebuild
+      else if (new_db)
+	db_schema_fingerprint_save();
+      else
+	{
+	  DPRINTF(E_LOG, L_DB, "Database schema differs from the last verified one, indices will be rebuilt\n");
+	  db_maintenance_schedule(DB_MAINTENANCE_INDICES | DB_MAINTENANCE_ANALYZE);
+	}
+    }
+
+  // Indices made while auto_indexes was enabled are dropped when it isn't
+  if (db_index_max <= 0 && db_get_one_int("SELECT COUNT(*) FROM sqlite_master WHERE type = 'index' AND name GLOB 'idx_auto_*';") > 0)
+    db_maintenance_schedule(DB_MAINTENANCE_AUTO_INDEX);
 
-  db_set_cfg_names();
+  // Sort ranks and playlist names are kept up to date by the scanning instance
+  if (!db_frontend)
+    {
+      db_sortkeys_update();
+      db_set_cfg_names();
+    }
+
+  // Zones other than 0 get their queue version key on first start
+  if (db_zone > 0)
+    {
+      query = sqlite3_mprintf("INSERT OR IGNORE INTO admin (key, value) VALUES ('%q', '0');", db_queue_version_key);
+      db_query_run(query, 1, 0);
+    }
 
   files = db_files_get_count();
   pls = db_pl_get_count();
-  db_admin_setint64(DB_ADMIN_START_TIME, (int64_t) time(NULL));
+  if (!db_frontend)
+    db_admin_setint64(DB_ADMIN_START_TIME, (int64_t) time(NULL));
 
   db_perthread_deinit();
 
@@ -6433,5 +9620,12 @@ db_init(void)
 void
 db_deinit(void)
 {
+  if (db_memory_hdl)
+    {
+      db_persist();
+      sqlite3_close(db_memory_hdl);
+      db_memory_hdl = NULL;
+    }
+
   sqlite3_shutdown();
 }
@@ -68,9 +68,15 @@ enum query_type {
 #define DB_ADMIN_SCHEMA_VERSION "schema_version"
 #define DB_ADMIN_QUEUE_VERSION "queue_version"
 #define DB_ADMIN_DB_UPDATE "db_update"
+#define DB_ADMIN_DB_REVISION "db_revision"
 #define DB_ADMIN_START_TIME "start_time"
+#define DB_ADMIN_SCHEMA_FINGERPRINT "schema_fingerprint"
 #define DB_ADMIN_LASTFM_SESSION_KEY "lastfm_sk"
 #define DB_ADMIN_SPOTIFY_REFRESH_TOKEN "spotify_refresh_token"
+#define DB_ADMIN_SCAN_START "scan_start"
+#define DB_ADMIN_SCAN_ROOT "scan_root"
+#define DB_ADMIN_SCAN_DIR "scan_dir"
+#define DB_ADMIN_SCAN_DIRS "scan_dirs"
 
 /* Max value for media_file_info->rating (valid range is from 0 to 100) */
 #define DB_FILES_RATING_MAX 100
@@ -87,6 +93,18 @@ struct query_params {
 
   char *filter;
 
+  /* Keyset pagination for Q_ITEMS and Q_GROUP_ITEMS: only return the rows
+   * after the one the cursor was made from with db_query_cursor_make(). Use
+   * with I_FIRST instead of I_SUB. The cursor is also in the count, so
+   * results is the number of the remaining rows. Owned by the caller.
+   */
+  char *cursor;
+
+  /* Files queries only: bitmask of the columns to fetch, set with
+   * db_query_field_add(). 0 means all columns as strings.
+   */
+  uint64_t fields;
+
   /* Query results, filled in by query_start */
   int results;
 
@@ -199,6 +217,12 @@ struct media_file_info {
 
   uint32_t directory_id; /* Id of directory */
   uint32_t date_released;
+
+  /* Integer ranks of the sort tags, see db_sortkeys_update() */
+  int64_t title_sort_ord;
+  int64_t album_sort_ord;
+  int64_t album_artist_sort_ord;
+  int64_t composer_sort_ord;
 };
 
 #define mfi_offsetof(field) offsetof(struct media_file_info, field)
@@ -278,6 +302,9 @@ struct db_group_info {
 
 #define dbgri_offsetof(field) offsetof(struct db_group_info, field)
 
+/* Number of string fields in struct db_media_file_info */
+#define DBMFI_NFIELDS 64
+
 struct db_media_file_info {
   char *id;
   char *path;
@@ -339,15 +366,35 @@ struct db_media_file_info {
   char *virtual_path;
   char *directory_id;
   char *date_released;
+  char *title_sort_ord;
+  char *album_sort_ord;
+  char *album_artist_sort_ord;
+  char *composer_sort_ord;
+
+  /* Projected queries (query_params.fields != 0) return integer columns here
+   * instead of in the string fields above, indexed by field slot.
+   */
+  uint64_t ints;
+  int64_t intval[DBMFI_NFIELDS];
 };
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
+#define dbmfi_slot(offset) ((offset) / sizeof(char *))
+#define dbmfi_has_int(dbmfi, offset) ((dbmfi)->ints & ((uint64_t)1 << dbmfi_slot(offset)))
+#define dbmfi_int(dbmfi, offset) ((dbmfi)->intval[dbmfi_slot(offset)])
 
 enum strip_type {
   STRIP_NONE,
   STRIP_PATH,
 };
 
+/* Library timestamp of a file, see db_file_stamps_bydir() */
+struct db_file_stamp {
+  int id;
+  char *path;
+  int64_t db_timestamp;
+};
+
 struct watch_info {
   int wd;
   char *path;
@@ -369,6 +416,13 @@ struct filecount_info {
   uint64_t length;
 };
 
+struct db_query_stats {
+  char *query;          // Statement with the literals replaced by '?'
+  uint64_t count;
+  uint64_t total_usec;
+  uint64_t max_usec;
+};
+
 /* Directory ids must be in sync with the ids in Q_DIR* in db_init.c */
 enum directory_ids {
   DIR_ROOT = 1,
@@ -384,6 +438,19 @@ struct directory_info {
   uint32_t db_timestamp;
   uint32_t disabled;
   uint32_t parent_id;
+  int64_t mtime;      // Of the directory when it was last scanned
+  uint32_t entries;   // Number of entries in the directory at that time
+};
+
+struct scrobble_info {
+  int64_t id;
+  char *artist;
+  char *title;
+  char *album;
+  char *album_artist;
+  uint32_t track;
+  uint32_t duration;  // Seconds
+  int64_t timestamp;  // When playback started
 };
 
 struct directory_enum {
@@ -446,6 +513,9 @@ db_escape_string(const char *str); // TODO Remove this, use db_mprintf instead
 char *
 db_mprintf(const char *fmt, ...);
 
+char *
+db_fts_contains(const char *columns, const char *value);
+
 int
 db_snprintf(char *s, int n, const char *fmt, ...);
 
@@ -467,10 +537,63 @@ free_query_params(struct query_params *qp, int content_only);
 void
 free_queue_item(struct db_queue_item *queue_item, int content_only);
 
+/* Between db_arena_begin() and db_arena_end() the file and queue item fetch
+ * functions of the calling thread allocate their results from an arena, which
+ * db_arena_end() releases in one go instead of freeing each string. The
+ * results must still be given to free_mfi()/free_queue_item(), and none of
+ * them may be kept (or handed to another thread) past db_arena_end(). Calls
+ * nest, the arena is released by the outermost db_arena_end().
+ */
+void
+db_arena_begin(void);
+
+void
+db_arena_end(void);
+
+/* Between db_intern_begin() and db_intern_end() the file and queue item fetch
+ * functions of the calling thread intern the artist, album, album artist,
+ * genre and composer (see strintern_get()), so results that are kept in memory
+ * share the values that repeat. The results can be kept as long as needed, but
+ * those strings may only be released through free_mfi()/free_queue_item(),
+ * not free()'d or swapped out. Calls nest.
+ */
+void
+db_intern_begin(void);
+
+void
+db_intern_end(void);
+
 void
 unicode_fixup_mfi(struct media_file_info *mfi);
 
 /* Maintenance and DB hygiene */
+enum db_maintenance_task
+{
+  DB_MAINTENANCE_INDICES = (1 << 0),
+  DB_MAINTENANCE_FTS     = (1 << 1),
+  DB_MAINTENANCE_ANALYZE = (1 << 2),
+  DB_MAINTENANCE_VACUUM  = (1 << 3),
+  DB_MAINTENANCE_AUTO_INDEX = (1 << 4),
+};
+
+/* Startup only checks the schema version and fingerprint, the slow work
+ * (index rebuild after an upgrade, ANALYZE, VACUUM) is scheduled here and run
+ * by the library thread with db_maintenance_run() when the server is idle.
+ */
+void
+db_maintenance_schedule(int tasks);
+
+int
+db_maintenance_pending(void);
+
+/* Time of the last DAAP/DACP/JSON/MPD request */
+time_t
+db_maintenance_last_request(void);
+
+/* Runs those of the given tasks that are pending, in the calling thread */
+void
+db_maintenance_run(int tasks);
+
 void
 db_hook_post_scan(void);
 
@@ -480,7 +603,17 @@ db_purge_cruft(time_t ref);
 void
 db_purge_all(void);
 
-/* Transactions */
+/* In-memory counters that change with every library/queue modification, so
+ * they can be used to validate cached replies without querying the db. They
+ * start over on restart.
+ */
+unsigned int
+db_revision_get(void);
+
+unsigned int
+db_queue_revision_get(void);
+
+/* Transactions, while a queue batch is running they are savepoints within it */
 void
 db_transaction_begin(void);
 
@@ -500,6 +633,21 @@ db_query_end(struct query_params *qp);
 int
 db_query_fetch_file(struct query_params *qp, struct db_media_file_info *dbmfi);
 
+char *
+db_query_cursor_make(struct query_params *qp, struct db_media_file_info *dbmfi);
+
+int
+db_query_field_add(struct query_params *qp, ssize_t dbmfi_offset);
+
+int
+db_query_stats_get(struct db_query_stats **stats, int *threshold_ms);
+
+int
+db_index_patterns_get(struct db_query_stats **stats);
+
+void
+db_query_stats_free(struct db_query_stats *stats, int n);
+
 int
 db_query_fetch_pl(struct query_params *qp, struct db_playlist_info *dbpli, int with_itemcount);
 
@@ -537,6 +685,21 @@ db_file_ping_bypath(const char *path, time_t mtime_max);
 void
 db_file_ping_bymatch(const char *path, int isdir);
 
+int
+db_file_ping_byids(const int *ids, int nids);
+
+int
+db_file_stamps_bydir(int dir_id, struct db_file_stamp **stamps);
+
+int
+db_file_stamps_all(struct db_file_stamp **stamps);
+
+void
+db_file_stamps_free(struct db_file_stamp *stamps, int nstamps);
+
+int
+db_file_changes_deleted(int64_t since, int **ids);
+
 char *
 db_file_path_byid(int id);
 
@@ -650,6 +813,10 @@ db_pl_enable_bycookie(uint32_t cookie, const char *path);
 int
 db_groups_cleanup();
 
+/* Sort ordinals */
+int
+db_sortkeys_update(void);
+
 int
 db_group_persistentid_byid(int id, int64_t *persistentid);
 
@@ -667,12 +834,18 @@ db_directory_enum_fetch(struct directory_enum *de, struct directory_info *di);
 void
 db_directory_enum_end(struct directory_enum *de);
 
+struct directory_info *
+db_directory_fetch_byid(int id);
+
 int
 db_directory_addorupdate(char *virtual_path, int disabled, int parent_id);
 
 void
 db_directory_ping_bymatch(char *virtual_path);
 
+int
+db_directory_stamp(int id, int64_t mtime, uint32_t entries);
+
 void
 db_directory_disable_bymatch(char *path, enum strip_type strip, uint32_t cookie);
 
@@ -723,6 +896,12 @@ db_admin_getint64(const char *key);
 int
 db_admin_delete(const char *key);
 
+int
+db_library_revision_bump(void);
+
+int64_t
+db_library_revision_get(void);
+
 /* Speakers/outputs */
 int
 db_speaker_save(struct output_device *device);
@@ -730,9 +909,33 @@ db_speaker_save(struct output_device *device);
 int
 db_speaker_get(struct output_device *device, uint64_t id);
 
+// Called for each speaker of a type with the last known mDNS service name, TXT
+// record (see outputs_device_mdns_set) and addresses, by db_speaker_enum_endpoints
+typedef void (*db_speaker_endpoint_cb)(const char *mdns_name, const char *mdns_txt, const char *v4_address, int v4_port, const char *v6_address, int v6_port, void *arg);
+
+// Only speakers that mDNS announced at seen_since or later are enumerated
+int
+db_speaker_enum_endpoints(enum output_types type, time_t seen_since, db_speaker_endpoint_cb cb, void *arg);
+
 void
 db_speaker_clear_all(void);
 
+/* Scrobbles waiting to be sent */
+int
+db_scrobble_add(struct scrobble_info *si, int max_queued);
+
+// Called for each of the oldest scrobbles by db_scrobble_enum, in order
+typedef void (*db_scrobble_cb)(struct scrobble_info *si, void *arg);
+
+int
+db_scrobble_enum(int limit, db_scrobble_cb cb, void *arg);
+
+int
+db_scrobble_delete_upto(int64_t id);
+
+int
+db_scrobble_count(void);
+
 /* Queue */
 int
 db_queue_update_item(struct db_queue_item *queue_item);
@@ -743,6 +946,17 @@ db_queue_add_by_queryafteritemid(struct query_params *qp, uint32_t item_id);
 int
 db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id);
 
+/* Runs the queue changes the calling thread makes until db_queue_batch_end()
+ * in one transaction, with one new queue version and one LISTENER_QUEUE
+ * notification at the end. Batches don't nest, and in between the thread must
+ * not wait for other threads that write to the db.
+ */
+void
+db_queue_batch_begin(void);
+
+void
+db_queue_batch_end(void);
+
 int
 db_queue_add_by_playlistid(int plid, char reshuffle, uint32_t item_id);
 
@@ -809,6 +1023,9 @@ db_queue_reshuffle(uint32_t item_id);
 int
 db_queue_get_count();
 
+int
+db_queue_get_version(void);
+
 int
 db_queue_get_pos(uint32_t item_id, char shuffle);
 
@@ -868,6 +1085,12 @@ db_perthread_init(void);
 void
 db_perthread_deinit(void);
 
+int
+db_persist(void);
+
+int
+db_persist_interval(void);
+
 int
 db_init(void);
 
@@ -93,7 +93,11 @@
   "   album_artist_sort  VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   virtual_path       VARCHAR(4096) DEFAULT NULL,"	\
   "   directory_id       INTEGER DEFAULT 0,"		\
-  "   date_released      INTEGER DEFAULT 0"             \
+  "   date_released      INTEGER DEFAULT 0,"            \
+  "   title_sort_ord     INTEGER DEFAULT NULL,"		\
+  "   album_sort_ord     INTEGER DEFAULT NULL,"		\
+  "   album_artist_sort_ord INTEGER DEFAULT NULL,"	\
+  "   composer_sort_ord  INTEGER DEFAULT NULL"		\
   ");"
 
 #define T_PL					\
@@ -125,9 +129,23 @@
   "   type           INTEGER NOT NULL,"					\
   "   name           VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
   "   persistentid   INTEGER NOT NULL,"					\
+  "   songs          INTEGER DEFAULT 0,"				\
+  "   albums         INTEGER DEFAULT 0,"				\
+  "   song_length    INTEGER DEFAULT 0,"				\
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
+#define T_BROWSE							\
+  "CREATE TABLE IF NOT EXISTS browse ("					\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"			\
+  "   type           INTEGER NOT NULL,"					\
+  "   value          VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
+  "   sort_value     VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
+  "   media_kind     INTEGER NOT NULL,"					\
+  "   songs          INTEGER DEFAULT 0,"				\
+  "CONSTRAINT browse_unique_value UNIQUE (type, value, sort_value, media_kind)" \
+  ");"
+
 #define T_PAIRINGS					\
   "CREATE TABLE IF NOT EXISTS pairings("		\
   "   remote         VARCHAR(64) PRIMARY KEY NOT NULL,"	\
@@ -141,7 +159,16 @@
   "   selected       INTEGER NOT NULL,"			\
   "   volume         INTEGER NOT NULL,"			\
   "   name           VARCHAR(255) DEFAULT NULL,"        \
-  "   auth_key       VARCHAR(2048) DEFAULT NULL"        \
+  "   auth_key       VARCHAR(2048) DEFAULT NULL,"       \
+  "   type           INTEGER DEFAULT 0,"                \
+  "   mdns_name      VARCHAR(255) DEFAULT NULL,"        \
+  "   mdns_txt       VARCHAR(4096) DEFAULT NULL,"       \
+  "   v4_address     VARCHAR(64) DEFAULT NULL,"         \
+  "   v4_port        INTEGER DEFAULT 0,"                \
+  "   v6_address     VARCHAR(64) DEFAULT NULL,"         \
+  "   v6_port        INTEGER DEFAULT 0,"                \
+  "   offset_ms      INTEGER DEFAULT 0,"                \
+  "   endpoints_seen INTEGER DEFAULT 0"                 \
   ");"
 
 #define T_INOTIFY					\
@@ -157,7 +184,37 @@
   "   virtual_path        VARCHAR(4096) NOT NULL,"		\
   "   db_timestamp        INTEGER DEFAULT 0,"			\
   "   disabled            INTEGER DEFAULT 0,"			\
-  "   parent_id           INTEGER DEFAULT 0"			\
+  "   parent_id           INTEGER DEFAULT 0,"			\
+  "   mtime               INTEGER DEFAULT 0,"			\
+  "   entries             INTEGER DEFAULT 0"			\
+  ");"
+
+#define T_SCROBBLES						\
+  "CREATE TABLE IF NOT EXISTS scrobbles ("			\
+  "   id                  INTEGER PRIMARY KEY AUTOINCREMENT,"	\
+  "   artist              VARCHAR(1024) NOT NULL,"		\
+  "   title               VARCHAR(1024) NOT NULL,"		\
+  "   album               VARCHAR(1024) DEFAULT NULL,"		\
+  "   album_artist        VARCHAR(1024) DEFAULT NULL,"		\
+  "   track               INTEGER DEFAULT 0,"			\
+  "   duration            INTEGER DEFAULT 0,"			\
+  "   timestamp           INTEGER NOT NULL"			\
+  ");"
+
+/* Log of files that were deleted or disabled (or enabled again), so that DAAP
+ * clients can be told which items to remove, see db_file_changes_deleted()
+ */
+#define T_FILE_CHANGES						\
+  "CREATE TABLE IF NOT EXISTS file_changes ("			\
+  "   id                  INTEGER NOT NULL,"			\
+  "   time                INTEGER NOT NULL,"			\
+  "   deleted             INTEGER NOT NULL"			\
+  ");"
+
+#define T_SORTKEYS						\
+  "CREATE TABLE IF NOT EXISTS sortkeys ("			\
+  "   value               VARCHAR(1024) PRIMARY KEY NOT NULL,"	\
+  "   ordinal             INTEGER NOT NULL"			\
   ");"
 
 #define T_QUEUE								\
@@ -185,21 +242,111 @@
   "   track               INTEGER DEFAULT 0,"				\
   "   disc                INTEGER DEFAULT 0,"				\
   "   artwork_url         VARCHAR(4096) DEFAULT NULL,"			\
-  "   queue_version       INTEGER DEFAULT 0"				\
+  "   queue_version       INTEGER DEFAULT 0,"				\
+  "   zone_id             INTEGER DEFAULT 0"				\
   ");"
 
+/* The triggers keep the groups table in sync with files, including the number
+ * of songs, albums (for artists) and the total length of the enabled files
+ */
 #define TRG_GROUPS_INSERT_FILES						\
   "CREATE TRIGGER update_groups_new_file AFTER INSERT ON files FOR EACH ROW" \
   " BEGIN"								\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);" \
+  "   UPDATE groups SET albums = albums + 1 WHERE NEW.disabled = 0 AND type = 2 AND persistentid = NEW.songartistid" \
+  "     AND (SELECT songs FROM groups WHERE type = 1 AND persistentid = NEW.songalbumid) = 0;" \
+  "   UPDATE groups SET songs = songs + 1, song_length = song_length + NEW.song_length WHERE NEW.disabled = 0" \
+  "     AND ((type = 1 AND persistentid = NEW.songalbumid) OR (type = 2 AND persistentid = NEW.songartistid));" \
   " END;"
 
 #define TRG_GROUPS_UPDATE_FILES						\
-  "CREATE TRIGGER update_groups_update_file AFTER UPDATE OF songalbumid ON files FOR EACH ROW" \
+  "CREATE TRIGGER update_groups_update_file AFTER UPDATE OF songalbumid, songartistid, song_length, disabled ON files FOR EACH ROW" \
+  " WHEN OLD.songalbumid IS NOT NEW.songalbumid OR OLD.songartistid IS NOT NEW.songartistid" \
+  "   OR OLD.song_length IS NOT NEW.song_length OR (OLD.disabled = 0) IS NOT (NEW.disabled = 0)" \
   " BEGIN"								\
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);" \
+  "   UPDATE groups SET songs = songs - 1, song_length = song_length - OLD.song_length WHERE OLD.disabled = 0" \
+  "     AND ((type = 1 AND persistentid = OLD.songalbumid) OR (type = 2 AND persistentid = OLD.songartistid));" \
+  "   UPDATE groups SET albums = albums - 1 WHERE OLD.disabled = 0 AND type = 2 AND persistentid = OLD.songartistid" \
+  "     AND (SELECT songs FROM groups WHERE type = 1 AND persistentid = OLD.songalbumid) = 0;" \
+  "   UPDATE groups SET albums = albums + 1 WHERE NEW.disabled = 0 AND type = 2 AND persistentid = NEW.songartistid" \
+  "     AND (SELECT songs FROM groups WHERE type = 1 AND persistentid = NEW.songalbumid) = 0;" \
+  "   UPDATE groups SET songs = songs + 1, song_length = song_length + NEW.song_length WHERE NEW.disabled = 0" \
+  "     AND ((type = 1 AND persistentid = NEW.songalbumid) OR (type = 2 AND persistentid = NEW.songartistid));" \
+  " END;"
+
+#define TRG_GROUPS_DELETE_FILES						\
+  "CREATE TRIGGER update_groups_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   UPDATE groups SET songs = songs - 1, song_length = song_length - OLD.song_length WHERE OLD.disabled = 0" \
+  "     AND ((type = 1 AND persistentid = OLD.songalbumid) OR (type = 2 AND persistentid = OLD.songartistid));" \
+  "   UPDATE groups SET albums = albums - 1 WHERE OLD.disabled = 0 AND type = 2 AND persistentid = OLD.songartistid" \
+  "     AND (SELECT songs FROM groups WHERE type = 1 AND persistentid = OLD.songalbumid) = 0;" \
+  " END;"
+
+/* Distinct values for the browse queries, types are Q_BROWSE_* & ~Q_F_BROWSE */
+#define TRG_BROWSE_ADD(type, col, sortcol)				\
+  "   INSERT OR IGNORE INTO browse (type, value, sort_value, media_kind)" \
+  "     SELECT " #type ", NEW." col ", IFNULL(NEW." sortcol ", NEW." col "), NEW.media_kind" \
+  "     WHERE NEW.disabled = 0 AND NEW." col " != '';"			\
+  "   UPDATE browse SET songs = songs + 1 WHERE NEW.disabled = 0 AND NEW." col " != ''" \
+  "     AND type = " #type " AND value = NEW." col " AND sort_value = IFNULL(NEW." sortcol ", NEW." col ")" \
+  "     AND media_kind = NEW.media_kind;"
+
+#define TRG_BROWSE_DEL(type, col, sortcol)				\
+  "   UPDATE browse SET songs = songs - 1 WHERE OLD.disabled = 0 AND OLD." col " != ''" \
+  "     AND type = " #type " AND value = OLD." col " AND sort_value = IFNULL(OLD." sortcol ", OLD." col ")" \
+  "     AND media_kind = OLD.media_kind;"
+
+#define TRG_BROWSE_INSERT_FILES						\
+  "CREATE TRIGGER update_browse_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  TRG_BROWSE_ADD(1, "album_artist", "album_artist_sort")		\
+  TRG_BROWSE_ADD(2, "album", "album_sort")				\
+  TRG_BROWSE_ADD(3, "genre", "genre")					\
+  TRG_BROWSE_ADD(4, "composer", "composer_sort")			\
+  " END;"
+
+#define TRG_BROWSE_UPDATE_FILES						\
+  "CREATE TRIGGER update_browse_update_file AFTER UPDATE OF album_artist, album_artist_sort, album, album_sort," \
+  "   genre, composer, composer_sort, media_kind, disabled ON files FOR EACH ROW" \
+  " WHEN OLD.album_artist IS NOT NEW.album_artist OR OLD.album_artist_sort IS NOT NEW.album_artist_sort" \
+  "   OR OLD.album IS NOT NEW.album OR OLD.album_sort IS NOT NEW.album_sort OR OLD.genre IS NOT NEW.genre" \
+  "   OR OLD.composer IS NOT NEW.composer OR OLD.composer_sort IS NOT NEW.composer_sort" \
+  "   OR OLD.media_kind IS NOT NEW.media_kind OR (OLD.disabled = 0) IS NOT (NEW.disabled = 0)" \
+  " BEGIN"								\
+  TRG_BROWSE_DEL(1, "album_artist", "album_artist_sort")		\
+  TRG_BROWSE_DEL(2, "album", "album_sort")				\
+  TRG_BROWSE_DEL(3, "genre", "genre")					\
+  TRG_BROWSE_DEL(4, "composer", "composer_sort")			\
+  TRG_BROWSE_ADD(1, "album_artist", "album_artist_sort")		\
+  TRG_BROWSE_ADD(2, "album", "album_sort")				\
+  TRG_BROWSE_ADD(3, "genre", "genre")					\
+  TRG_BROWSE_ADD(4, "composer", "composer_sort")			\
+  " END;"
+
+#define TRG_BROWSE_DELETE_FILES						\
+  "CREATE TRIGGER update_browse_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  TRG_BROWSE_DEL(1, "album_artist", "album_artist_sort")		\
+  TRG_BROWSE_DEL(2, "album", "album_sort")				\
+  TRG_BROWSE_DEL(3, "genre", "genre")					\
+  TRG_BROWSE_DEL(4, "composer", "composer_sort")			\
+  " END;"
+
+#define TRG_CHANGES_DELETE_FILES					\
+  "CREATE TRIGGER log_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   INSERT INTO file_changes (id, time, deleted) VALUES (OLD.id, CAST(strftime('%s', 'now') AS INTEGER), 1);" \
+  " END;"
+
+#define TRG_CHANGES_UPDATE_FILES					\
+  "CREATE TRIGGER log_disable_file AFTER UPDATE OF disabled ON files FOR EACH ROW" \
+  " WHEN (OLD.disabled = 0) IS NOT (NEW.disabled = 0)"		\
+  " BEGIN"								\
+  "   INSERT INTO file_changes (id, time, deleted) VALUES (NEW.id, CAST(strftime('%s', 'now') AS INTEGER), NEW.disabled <> 0);" \
   " END;"
 
 #define Q_PL1								\
@@ -266,14 +413,24 @@ static const struct db_init_query db_init_table_queries[] =
     { T_PL,        "create table playlists" },
     { T_PLITEMS,   "create table playlistitems" },
     { T_GROUPS,    "create table groups" },
+    { T_BROWSE,    "create table browse" },
     { T_PAIRINGS,  "create table pairings" },
     { T_SPEAKERS,  "create table speakers" },
     { T_INOTIFY,   "create table inotify" },
     { T_DIRECTORIES, "create table directories" },
     { T_QUEUE,     "create table queue" },
+    { T_SORTKEYS,  "create table sortkeys" },
+    { T_SCROBBLES, "create table scrobbles" },
+    { T_FILE_CHANGES, "create table file_changes" },
 
     { TRG_GROUPS_INSERT_FILES,    "create trigger update_groups_new_file" },
     { TRG_GROUPS_UPDATE_FILES,    "create trigger update_groups_update_file" },
+    { TRG_GROUPS_DELETE_FILES,    "create trigger update_groups_delete_file" },
+    { TRG_BROWSE_INSERT_FILES,    "create trigger update_browse_new_file" },
+    { TRG_BROWSE_UPDATE_FILES,    "create trigger update_browse_update_file" },
+    { TRG_BROWSE_DELETE_FILES,    "create trigger update_browse_delete_file" },
+    { TRG_CHANGES_DELETE_FILES,   "create trigger log_delete_file" },
+    { TRG_CHANGES_UPDATE_FILES,   "create trigger log_disable_file" },
 
     { Q_PL1,       "create default playlist" },
     { Q_PL2,       "create default smart playlist 'Music'" },
@@ -319,7 +476,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_BROWSE_COMPOSERS */
 #define I_COMPOSER				\
-  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, media_kind, composer_sort);"
+  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, media_kind, composer_sort_ord);"
 
 /* Used by Q_BROWSE_GENRES */
 #define I_GENRE					\
@@ -327,7 +484,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_PLITEMS for smart playlists */
 #define I_TITLE					\
-  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, media_kind, title_sort);"
+  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, media_kind, title_sort_ord);"
 
 #define I_ALBUM					\
   "CREATE INDEX IF NOT EXISTS idx_album ON files(album, album_sort);"
@@ -366,10 +523,13 @@ static const struct db_init_query db_init_table_queries[] =
   "CREATE INDEX IF NOT EXISTS idx_dir_parentid ON directories(parent_id);"
 
 #define I_QUEUE_POS				\
-  "CREATE INDEX IF NOT EXISTS idx_queue_pos ON queue(pos);"
+  "CREATE INDEX IF NOT EXISTS idx_queue_pos ON queue(zone_id, pos);"
 
 #define I_QUEUE_SHUFFLEPOS				\
-  "CREATE INDEX IF NOT EXISTS idx_queue_shufflepos ON queue(shuffle_pos);"
+  "CREATE INDEX IF NOT EXISTS idx_queue_shufflepos ON queue(zone_id, shuffle_pos);"
+
+#define I_FILE_CHANGES_TIME				\
+  "CREATE INDEX IF NOT EXISTS idx_file_changes_time ON file_changes(time);"
 
 static const struct db_init_query db_init_index_queries[] =
   {
@@ -405,6 +565,8 @@ static const struct db_init_query db_init_index_queries[] =
 
     { I_QUEUE_POS,  "create queue pos index" },
     { I_QUEUE_SHUFFLEPOS,  "create queue shuffle pos index" },
+
+    { I_FILE_CHANGES_TIME, "create file changes time index" },
   };
 
 int
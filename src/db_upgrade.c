@@ -1626,6 +1626,406 @@ static const struct db_upgrade_query db_upgrade_V1906_queries[] =
   };
 
 
+/* Upgrade from schema v19.06 to v19.07 */
+
+#define U_V1907_ALTER_QUEUE_ADD_ZONEID \
+  "ALTER TABLE queue ADD COLUMN zone_id INTEGER DEFAULT 0;"
+
+#define U_V1907_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1907_SCVER_MINOR			\
+  "UPDATE admin SET value = '07' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1907_queries[] =
+  {
+    { U_V1907_ALTER_QUEUE_ADD_ZONEID, "alter table queue add column zone_id" },
+
+    { U_V1907_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1907_SCVER_MINOR,    "set schema_version_minor to 07" },
+  };
+
+
+/* Upgrade from schema v19.07 to v19.08 */
+
+#define U_V1908_ALTER_SPEAKERS_ADD_TYPE \
+  "ALTER TABLE speakers ADD COLUMN type INTEGER DEFAULT 0;"
+#define U_V1908_ALTER_SPEAKERS_ADD_MDNS_NAME \
+  "ALTER TABLE speakers ADD COLUMN mdns_name VARCHAR(255) DEFAULT NULL;"
+#define U_V1908_ALTER_SPEAKERS_ADD_MDNS_TXT \
+  "ALTER TABLE speakers ADD COLUMN mdns_txt VARCHAR(4096) DEFAULT NULL;"
+#define U_V1908_ALTER_SPEAKERS_ADD_V4_ADDRESS \
+  "ALTER TABLE speakers ADD COLUMN v4_address VARCHAR(64) DEFAULT NULL;"
+#define U_V1908_ALTER_SPEAKERS_ADD_V4_PORT \
+  "ALTER TABLE speakers ADD COLUMN v4_port INTEGER DEFAULT 0;"
+#define U_V1908_ALTER_SPEAKERS_ADD_V6_ADDRESS \
+  "ALTER TABLE speakers ADD COLUMN v6_address VARCHAR(64) DEFAULT NULL;"
+#define U_V1908_ALTER_SPEAKERS_ADD_V6_PORT \
+  "ALTER TABLE speakers ADD COLUMN v6_port INTEGER DEFAULT 0;"
+
+#define U_V1908_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1908_SCVER_MINOR			\
+  "UPDATE admin SET value = '08' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1908_queries[] =
+  {
+    { U_V1908_ALTER_SPEAKERS_ADD_TYPE,       "alter table speakers add column type" },
+    { U_V1908_ALTER_SPEAKERS_ADD_MDNS_NAME,  "alter table speakers add column mdns_name" },
+    { U_V1908_ALTER_SPEAKERS_ADD_MDNS_TXT,   "alter table speakers add column mdns_txt" },
+    { U_V1908_ALTER_SPEAKERS_ADD_V4_ADDRESS, "alter table speakers add column v4_address" },
+    { U_V1908_ALTER_SPEAKERS_ADD_V4_PORT,    "alter table speakers add column v4_port" },
+    { U_V1908_ALTER_SPEAKERS_ADD_V6_ADDRESS, "alter table speakers add column v6_address" },
+    { U_V1908_ALTER_SPEAKERS_ADD_V6_PORT,    "alter table speakers add column v6_port" },
+
+    { U_V1908_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1908_SCVER_MINOR,    "set schema_version_minor to 08" },
+  };
+
+
+/* Upgrade from schema v19.08 to v19.09 */
+
+#define U_V1909_ALTER_SPEAKERS_ADD_OFFSET_MS \
+  "ALTER TABLE speakers ADD COLUMN offset_ms INTEGER DEFAULT 0;"
+
+#define U_V1909_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1909_SCVER_MINOR			\
+  "UPDATE admin SET value = '09' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1909_queries[] =
+  {
+    { U_V1909_ALTER_SPEAKERS_ADD_OFFSET_MS, "alter table speakers add column offset_ms" },
+
+    { U_V1909_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1909_SCVER_MINOR,    "set schema_version_minor to 09" },
+  };
+
+
+/* Upgrade from schema v19.09 to v19.10 */
+
+#define U_V1910_ALTER_GROUPS_ADD_SONGS \
+  "ALTER TABLE groups ADD COLUMN songs INTEGER DEFAULT 0;"
+#define U_V1910_ALTER_GROUPS_ADD_ALBUMS \
+  "ALTER TABLE groups ADD COLUMN albums INTEGER DEFAULT 0;"
+#define U_V1910_ALTER_GROUPS_ADD_SONG_LENGTH \
+  "ALTER TABLE groups ADD COLUMN song_length INTEGER DEFAULT 0;"
+
+#define U_V1910_DROP_TRG_GROUPS_INSERT_FILES \
+  "DROP TRIGGER IF EXISTS update_groups_new_file;"
+#define U_V1910_DROP_TRG_GROUPS_UPDATE_FILES \
+  "DROP TRIGGER IF EXISTS update_groups_update_file;"
+
+#define U_V1910_TRG_GROUPS_INSERT_FILES						\
+  "CREATE TRIGGER update_groups_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
+  "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);" \
+  "   UPDATE groups SET albums = albums + 1 WHERE NEW.disabled = 0 AND type = 2 AND persistentid = NEW.songartistid" \
+  "     AND (SELECT songs FROM groups WHERE type = 1 AND persistentid = NEW.songalbumid) = 0;" \
+  "   UPDATE groups SET songs = songs + 1, song_length = song_length + NEW.song_length WHERE NEW.disabled = 0" \
+  "     AND ((type = 1 AND persistentid = NEW.songalbumid) OR (type = 2 AND persistentid = NEW.songartistid));" \
+  " END;"
+
+#define U_V1910_TRG_GROUPS_UPDATE_FILES						\
+  "CREATE TRIGGER update_groups_update_file AFTER UPDATE OF songalbumid, songartistid, song_length, disabled ON files FOR EACH ROW" \
+  " WHEN OLD.songalbumid IS NOT NEW.songalbumid OR OLD.songartistid IS NOT NEW.songartistid" \
+  "   OR OLD.song_length IS NOT NEW.song_length OR (OLD.disabled = 0) IS NOT (NEW.disabled = 0)" \
+  " BEGIN"								\
+  "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (1, NEW.album, NEW.songalbumid);" \
+  "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);" \
+  "   UPDATE groups SET songs = songs - 1, song_length = song_length - OLD.song_length WHERE OLD.disabled = 0" \
+  "     AND ((type = 1 AND persistentid = OLD.songalbumid) OR (type = 2 AND persistentid = OLD.songartistid));" \
+  "   UPDATE groups SET albums = albums - 1 WHERE OLD.disabled = 0 AND type = 2 AND persistentid = OLD.songartistid" \
+  "     AND (SELECT songs FROM groups WHERE type = 1 AND persistentid = OLD.songalbumid) = 0;" \
+  "   UPDATE groups SET albums = albums + 1 WHERE NEW.disabled = 0 AND type = 2 AND persistentid = NEW.songartistid" \
+  "     AND (SELECT songs FROM groups WHERE type = 1 AND persistentid = NEW.songalbumid) = 0;" \
+  "   UPDATE groups SET songs = songs + 1, song_length = song_length + NEW.song_length WHERE NEW.disabled = 0" \
+  "     AND ((type = 1 AND persistentid = NEW.songalbumid) OR (type = 2 AND persistentid = NEW.songartistid));" \
+  " END;"
+
+#define U_V1910_TRG_GROUPS_DELETE_FILES						\
+  "CREATE TRIGGER update_groups_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   UPDATE groups SET songs = songs - 1, song_length = song_length - OLD.song_length WHERE OLD.disabled = 0" \
+  "     AND ((type = 1 AND persistentid = OLD.songalbumid) OR (type = 2 AND persistentid = OLD.songartistid));" \
+  "   UPDATE groups SET albums = albums - 1 WHERE OLD.disabled = 0 AND type = 2 AND persistentid = OLD.songartistid" \
+  "     AND (SELECT songs FROM groups WHERE type = 1 AND persistentid = OLD.songalbumid) = 0;" \
+  " END;"
+
+// The indices are dropped during the upgrade, so aggregate into a temp table
+// keyed by persistentid instead of using a correlated subquery on files
+#define U_V1910_CREATE_AGG \
+  "CREATE TEMP TABLE groups_agg (id INTEGER PRIMARY KEY NOT NULL, songs INTEGER, albums INTEGER, song_length INTEGER);"
+#define U_V1910_AGG_ALBUMS \
+  "INSERT INTO groups_agg SELECT songalbumid, COUNT(*), 0, SUM(song_length) FROM files WHERE disabled = 0 GROUP BY songalbumid;"
+#define U_V1910_UPDATE_ALBUMS \
+  "UPDATE groups SET songs = IFNULL((SELECT songs FROM groups_agg WHERE id = persistentid), 0)," \
+  " song_length = IFNULL((SELECT song_length FROM groups_agg WHERE id = persistentid), 0) WHERE type = 1;"
+#define U_V1910_CLEAR_AGG \
+  "DELETE FROM groups_agg;"
+#define U_V1910_AGG_ARTISTS \
+  "INSERT INTO groups_agg SELECT songartistid, COUNT(*), COUNT(DISTINCT songalbumid), SUM(song_length) FROM files WHERE disabled = 0 GROUP BY songartistid;"
+#define U_V1910_UPDATE_ARTISTS \
+  "UPDATE groups SET songs = IFNULL((SELECT songs FROM groups_agg WHERE id = persistentid), 0)," \
+  " albums = IFNULL((SELECT albums FROM groups_agg WHERE id = persistentid), 0)," \
+  " song_length = IFNULL((SELECT song_length FROM groups_agg WHERE id = persistentid), 0) WHERE type = 2;"
+#define U_V1910_DROP_AGG \
+  "DROP TABLE groups_agg;"
+
+#define U_V1910_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1910_SCVER_MINOR			\
+  "UPDATE admin SET value = '10' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1910_queries[] =
+  {
+    { U_V1910_ALTER_GROUPS_ADD_SONGS, "alter table groups add column songs" },
+    { U_V1910_ALTER_GROUPS_ADD_ALBUMS, "alter table groups add column albums" },
+    { U_V1910_ALTER_GROUPS_ADD_SONG_LENGTH, "alter table groups add column song_length" },
+    { U_V1910_DROP_TRG_GROUPS_INSERT_FILES, "drop trigger update_groups_new_file" },
+    { U_V1910_DROP_TRG_GROUPS_UPDATE_FILES, "drop trigger update_groups_update_file" },
+    { U_V1910_TRG_GROUPS_INSERT_FILES, "create trigger update_groups_new_file" },
+    { U_V1910_TRG_GROUPS_UPDATE_FILES, "create trigger update_groups_update_file" },
+    { U_V1910_TRG_GROUPS_DELETE_FILES, "create trigger update_groups_delete_file" },
+    { U_V1910_CREATE_AGG, "create temp table groups_agg" },
+    { U_V1910_AGG_ALBUMS, "aggregate album groups" },
+    { U_V1910_UPDATE_ALBUMS, "update album groups" },
+    { U_V1910_CLEAR_AGG, "clear temp table groups_agg" },
+    { U_V1910_AGG_ARTISTS, "aggregate artist groups" },
+    { U_V1910_UPDATE_ARTISTS, "update artist groups" },
+    { U_V1910_DROP_AGG, "drop temp table groups_agg" },
+
+    { U_V1910_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1910_SCVER_MINOR,    "set schema_version_minor to 10" },
+  };
+
+
+#define U_V1911_ALTER_FILES_ADD_TITLE_SORT_ORD \
+  "ALTER TABLE files ADD COLUMN title_sort_ord INTEGER DEFAULT NULL;"
+#define U_V1911_ALTER_FILES_ADD_ALBUM_SORT_ORD \
+  "ALTER TABLE files ADD COLUMN album_sort_ord INTEGER DEFAULT NULL;"
+#define U_V1911_ALTER_FILES_ADD_ALBUM_ARTIST_SORT_ORD \
+  "ALTER TABLE files ADD COLUMN album_artist_sort_ord INTEGER DEFAULT NULL;"
+#define U_V1911_ALTER_FILES_ADD_COMPOSER_SORT_ORD \
+  "ALTER TABLE files ADD COLUMN composer_sort_ord INTEGER DEFAULT NULL;"
+
+// The ordinals are assigned by db_sortkeys_update() at startup
+#define U_V1911_CREATE_TABLE_SORTKEYS				\
+  "CREATE TABLE IF NOT EXISTS sortkeys ("			\
+  "   value               VARCHAR(1024) PRIMARY KEY NOT NULL,"	\
+  "   ordinal             INTEGER NOT NULL"			\
+  ");"
+
+#define U_V1911_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1911_SCVER_MINOR			\
+  "UPDATE admin SET value = '11' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1911_queries[] =
+  {
+    { U_V1911_ALTER_FILES_ADD_TITLE_SORT_ORD, "alter table files add column title_sort_ord" },
+    { U_V1911_ALTER_FILES_ADD_ALBUM_SORT_ORD, "alter table files add column album_sort_ord" },
+    { U_V1911_ALTER_FILES_ADD_ALBUM_ARTIST_SORT_ORD, "alter table files add column album_artist_sort_ord" },
+    { U_V1911_ALTER_FILES_ADD_COMPOSER_SORT_ORD, "alter table files add column composer_sort_ord" },
+    { U_V1911_CREATE_TABLE_SORTKEYS, "create table sortkeys" },
+
+    { U_V1911_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1911_SCVER_MINOR,    "set schema_version_minor to 11" },
+  };
+
+
+#define U_V1912_CREATE_TABLE_BROWSE					\
+  "CREATE TABLE IF NOT EXISTS browse ("					\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"			\
+  "   type           INTEGER NOT NULL,"					\
+  "   value          VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
+  "   sort_value     VARCHAR(1024) NOT NULL COLLATE DAAP,"		\
+  "   media_kind     INTEGER NOT NULL,"					\
+  "   songs          INTEGER DEFAULT 0,"				\
+  "CONSTRAINT browse_unique_value UNIQUE (type, value, sort_value, media_kind)" \
+  ");"
+
+#define U_V1912_BROWSE_ADD(type, col, sortcol)				\
+  "   INSERT OR IGNORE INTO browse (type, value, sort_value, media_kind)" \
+  "     SELECT " #type ", NEW." col ", IFNULL(NEW." sortcol ", NEW." col "), NEW.media_kind" \
+  "     WHERE NEW.disabled = 0 AND NEW." col " != '';"			\
+  "   UPDATE browse SET songs = songs + 1 WHERE NEW.disabled = 0 AND NEW." col " != ''" \
+  "     AND type = " #type " AND value = NEW." col " AND sort_value = IFNULL(NEW." sortcol ", NEW." col ")" \
+  "     AND media_kind = NEW.media_kind;"
+
+#define U_V1912_BROWSE_DEL(type, col, sortcol)				\
+  "   UPDATE browse SET songs = songs - 1 WHERE OLD.disabled = 0 AND OLD." col " != ''" \
+  "     AND type = " #type " AND value = OLD." col " AND sort_value = IFNULL(OLD." sortcol ", OLD." col ")" \
+  "     AND media_kind = OLD.media_kind;"
+
+#define U_V1912_TRG_BROWSE_INSERT_FILES					\
+  "CREATE TRIGGER update_browse_new_file AFTER INSERT ON files FOR EACH ROW" \
+  " BEGIN"								\
+  U_V1912_BROWSE_ADD(1, "album_artist", "album_artist_sort")		\
+  U_V1912_BROWSE_ADD(2, "album", "album_sort")				\
+  U_V1912_BROWSE_ADD(3, "genre", "genre")				\
+  U_V1912_BROWSE_ADD(4, "composer", "composer_sort")			\
+  " END;"
+
+#define U_V1912_TRG_BROWSE_UPDATE_FILES					\
+  "CREATE TRIGGER update_browse_update_file AFTER UPDATE OF album_artist, album_artist_sort, album, album_sort," \
+  "   genre, composer, composer_sort, media_kind, disabled ON files FOR EACH ROW" \
+  " WHEN OLD.album_artist IS NOT NEW.album_artist OR OLD.album_artist_sort IS NOT NEW.album_artist_sort" \
+  "   OR OLD.album IS NOT NEW.album OR OLD.album_sort IS NOT NEW.album_sort OR OLD.genre IS NOT NEW.genre" \
+  "   OR OLD.composer IS NOT NEW.composer OR OLD.composer_sort IS NOT NEW.composer_sort" \
+  "   OR OLD.media_kind IS NOT NEW.media_kind OR (OLD.disabled = 0) IS NOT (NEW.disabled = 0)" \
+  " BEGIN"								\
+  U_V1912_BROWSE_DEL(1, "album_artist", "album_artist_sort")		\
+  U_V1912_BROWSE_DEL(2, "album", "album_sort")				\
+  U_V1912_BROWSE_DEL(3, "genre", "genre")				\
+  U_V1912_BROWSE_DEL(4, "composer", "composer_sort")			\
+  U_V1912_BROWSE_ADD(1, "album_artist", "album_artist_sort")		\
+  U_V1912_BROWSE_ADD(2, "album", "album_sort")				\
+  U_V1912_BROWSE_ADD(3, "genre", "genre")				\
+  U_V1912_BROWSE_ADD(4, "composer", "composer_sort")			\
+  " END;"
+
+#define U_V1912_TRG_BROWSE_DELETE_FILES					\
+  "CREATE TRIGGER update_browse_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  U_V1912_BROWSE_DEL(1, "album_artist", "album_artist_sort")		\
+  U_V1912_BROWSE_DEL(2, "album", "album_sort")				\
+  U_V1912_BROWSE_DEL(3, "genre", "genre")				\
+  U_V1912_BROWSE_DEL(4, "composer", "composer_sort")			\
+  " END;"
+
+#define U_V1912_BROWSE_FILL(type, col, sortcol)				\
+  "INSERT OR IGNORE INTO browse (type, value, sort_value, media_kind, songs)" \
+  " SELECT " #type ", " col ", IFNULL(" sortcol ", " col "), media_kind, COUNT(*) FROM files" \
+  " WHERE disabled = 0 AND " col " != '' GROUP BY 2, 3, 4;"
+
+#define U_V1912_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1912_SCVER_MINOR			\
+  "UPDATE admin SET value = '12' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1912_queries[] =
+  {
+    { U_V1912_CREATE_TABLE_BROWSE, "create table browse" },
+    { U_V1912_BROWSE_FILL(1, "album_artist", "album_artist_sort"), "fill browse with album artists" },
+    { U_V1912_BROWSE_FILL(2, "album", "album_sort"), "fill browse with albums" },
+    { U_V1912_BROWSE_FILL(3, "genre", "genre"), "fill browse with genres" },
+    { U_V1912_BROWSE_FILL(4, "composer", "composer_sort"), "fill browse with composers" },
+    { U_V1912_TRG_BROWSE_INSERT_FILES, "create trigger update_browse_new_file" },
+    { U_V1912_TRG_BROWSE_UPDATE_FILES, "create trigger update_browse_update_file" },
+    { U_V1912_TRG_BROWSE_DELETE_FILES, "create trigger update_browse_delete_file" },
+
+    { U_V1912_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1912_SCVER_MINOR,    "set schema_version_minor to 12" },
+  };
+
+
+#define U_V1913_ALTER_DIR_ADD_MTIME \
+  "ALTER TABLE directories ADD COLUMN mtime INTEGER DEFAULT 0;"
+#define U_V1913_ALTER_DIR_ADD_ENTRIES \
+  "ALTER TABLE directories ADD COLUMN entries INTEGER DEFAULT 0;"
+
+#define U_V1913_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1913_SCVER_MINOR			\
+  "UPDATE admin SET value = '13' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1913_queries[] =
+  {
+    { U_V1913_ALTER_DIR_ADD_MTIME,   "alter table directories add column mtime" },
+    { U_V1913_ALTER_DIR_ADD_ENTRIES, "alter table directories add column entries" },
+
+    { U_V1913_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1913_SCVER_MINOR,    "set schema_version_minor to 13" },
+  };
+
+
+#define U_V1914_CREATE_TABLE_SCROBBLES					\
+  "CREATE TABLE IF NOT EXISTS scrobbles ("			\
+  "   id                  INTEGER PRIMARY KEY AUTOINCREMENT,"	\
+  "   artist              VARCHAR(1024) NOT NULL,"		\
+  "   title               VARCHAR(1024) NOT NULL,"		\
+  "   album               VARCHAR(1024) DEFAULT NULL,"		\
+  "   album_artist        VARCHAR(1024) DEFAULT NULL,"		\
+  "   track               INTEGER DEFAULT 0,"			\
+  "   duration            INTEGER DEFAULT 0,"			\
+  "   timestamp           INTEGER NOT NULL"			\
+  ");"
+
+#define U_V1914_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1914_SCVER_MINOR			\
+  "UPDATE admin SET value = '14' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1914_queries[] =
+  {
+    { U_V1914_CREATE_TABLE_SCROBBLES, "create table scrobbles" },
+
+    { U_V1914_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1914_SCVER_MINOR,    "set schema_version_minor to 14" },
+  };
+
+
+#define U_V1915_CREATE_TABLE_FILE_CHANGES				\
+  "CREATE TABLE IF NOT EXISTS file_changes ("			\
+  "   id                  INTEGER NOT NULL,"			\
+  "   time                INTEGER NOT NULL,"			\
+  "   deleted             INTEGER NOT NULL"			\
+  ");"
+
+#define U_V1915_TRG_CHANGES_DELETE_FILES				\
+  "CREATE TRIGGER log_delete_file AFTER DELETE ON files FOR EACH ROW" \
+  " BEGIN"								\
+  "   INSERT INTO file_changes (id, time, deleted) VALUES (OLD.id, CAST(strftime('%s', 'now') AS INTEGER), 1);" \
+  " END;"
+
+#define U_V1915_TRG_CHANGES_UPDATE_FILES				\
+  "CREATE TRIGGER log_disable_file AFTER UPDATE OF disabled ON files FOR EACH ROW" \
+  " WHEN (OLD.disabled = 0) IS NOT (NEW.disabled = 0)"		\
+  " BEGIN"								\
+  "   INSERT INTO file_changes (id, time, deleted) VALUES (NEW.id, CAST(strftime('%s', 'now') AS INTEGER), NEW.disabled <> 0);" \
+  " END;"
+
+#define U_V1915_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1915_SCVER_MINOR			\
+  "UPDATE admin SET value = '15' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1915_queries[] =
+  {
+    { U_V1915_CREATE_TABLE_FILE_CHANGES, "create table file_changes" },
+    { U_V1915_TRG_CHANGES_DELETE_FILES,  "create trigger log_delete_file" },
+    { U_V1915_TRG_CHANGES_UPDATE_FILES,  "create trigger log_disable_file" },
+
+    { U_V1915_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1915_SCVER_MINOR,    "set schema_version_minor to 15" },
+  };
+
+
+/* Upgrade from schema v19.15 to v19.16 */
+
+#define U_V1916_ALTER_SPEAKERS_ADD_ENDPOINTS_SEEN \
+  "ALTER TABLE speakers ADD COLUMN endpoints_seen INTEGER DEFAULT 0;"
+// The endpoints saved so far count as seen now, so they don't expire at once
+#define U_V1916_SPEAKERS_SET_ENDPOINTS_SEEN \
+  "UPDATE speakers SET endpoints_seen = CAST(strftime('%s', 'now') AS INTEGER)" \
+  " WHERE v4_address IS NOT NULL OR v6_address IS NOT NULL;"
+
+#define U_V1916_SCVER_MAJOR			\
+  "UPDATE admin SET value = '19' WHERE key = 'schema_version_major';"
+#define U_V1916_SCVER_MINOR			\
+  "UPDATE admin SET value = '16' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_V1916_queries[] =
+  {
+    { U_V1916_ALTER_SPEAKERS_ADD_ENDPOINTS_SEEN, "alter table speakers add column endpoints_seen" },
+    { U_V1916_SPEAKERS_SET_ENDPOINTS_SEEN,       "set speakers endpoints_seen" },
+
+    { U_V1916_SCVER_MAJOR,    "set schema_version_major to 19" },
+    { U_V1916_SCVER_MINOR,    "set schema_version_minor to 16" },
+  };
+
+
 int
 db_upgrade(sqlite3 *hdl, int db_ver)
 {
@@ -1778,6 +2178,76 @@ db_upgrade(sqlite3 *hdl, int db_ver)
       if (ret < 0)
 	return -1;
 
+      /* FALLTHROUGH */
+
+    case 1906:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1907_queries, sizeof(db_upgrade_V1907_queries) / sizeof(db_upgrade_V1907_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1907:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1908_queries, sizeof(db_upgrade_V1908_queries) / sizeof(db_upgrade_V1908_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1908:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1909_queries, sizeof(db_upgrade_V1909_queries) / sizeof(db_upgrade_V1909_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1909:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1910_queries, sizeof(db_upgrade_V1910_queries) / sizeof(db_upgrade_V1910_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1910:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1911_queries, sizeof(db_upgrade_V1911_queries) / sizeof(db_upgrade_V1911_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1911:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1912_queries, sizeof(db_upgrade_V1912_queries) / sizeof(db_upgrade_V1912_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1912:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1913_queries, sizeof(db_upgrade_V1913_queries) / sizeof(db_upgrade_V1913_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1913:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1914_queries, sizeof(db_upgrade_V1914_queries) / sizeof(db_upgrade_V1914_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1914:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1915_queries, sizeof(db_upgrade_V1915_queries) / sizeof(db_upgrade_V1915_queries[0]));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 1915:
+      ret = db_generic_upgrade(hdl, db_upgrade_V1916_queries, sizeof(db_upgrade_V1916_queries) / sizeof(db_upgrade_V1916_queries[0]));
+      if (ret < 0)
+	return -1;
+
       break;
 
     default:
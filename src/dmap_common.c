@@ -20,13 +20,17 @@
 # include <config.h>
 #endif
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 
 #include "db.h"
 #include "misc.h"
 #include "httpd.h"
 #include "logger.h"
+#include "cache.h"
 #include "dmap_common.h"
 
 
@@ -49,6 +53,54 @@ dmap_find_field_wrapper(const char *str, int len)
   return dmap_find_field(str, len);
 }
 
+static const struct dmap_field *
+dmap_find_field_bytag(const uint8_t *tag)
+{
+  int nfields;
+  int i;
+
+  for (i = 0, nfields = sizeof(dmap_fields) / sizeof(dmap_fields[0]); i < nfields; i++)
+    {
+      if (memcmp(dmap_fields[i].tag, tag, 4) == 0)
+	return &dmap_fields[i];
+    }
+
+  return NULL;
+}
+
+int
+dmap_find_int(const uint8_t *data, size_t len, const char *tag, int64_t *val)
+{
+  const struct dmap_field *df;
+  uint32_t flen;
+  int i;
+
+  while (len >= 8)
+    {
+      flen = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) | ((uint32_t)data[6] << 8) | data[7];
+      if (flen > len - 8)
+	return -1;
+
+      if (memcmp(data, tag, 4) == 0 && flen >= 1 && flen <= 8)
+	{
+	  *val = 0;
+	  for (i = 0; i < flen; i++)
+	    *val = (*val << 8) | data[8 + i];
+
+	  return 0;
+	}
+
+      df = dmap_find_field_bytag(data);
+      if (df && df->type == DMAP_TYPE_LIST && dmap_find_int(data + 8, flen, tag, val) == 0)
+	return 0;
+
+      data += 8 + flen;
+      len -= 8 + flen;
+    }
+
+  return -1;
+}
+
 void
 dmap_add_container(struct evbuffer *evbuf, const char *tag, int len)
 {
@@ -210,142 +262,361 @@ dmap_add_string(struct evbuffer *evbuf, const char *tag, const char *str)
     evbuffer_add(evbuf, str, len);
 }
 
-void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval)
+/* Value of a non-string field, from the string if given. Returns -1 if the
+ * type is not supported.
+ */
+static int
+dmap_field_value(const struct dmap_field *df, char *strval, int64_t intval, int64_t *val)
 {
   union {
     int32_t v_i32;
     uint32_t v_u32;
     int64_t v_i64;
     uint64_t v_u64;
-  } val;
+  } v;
   int ret;
 
-  if (strval && (df->type != DMAP_TYPE_STRING))
+  switch (df->type)
     {
-      switch (df->type)
-	{
-	  case DMAP_TYPE_DATE:
-	  case DMAP_TYPE_UBYTE:
-	  case DMAP_TYPE_USHORT:
-	  case DMAP_TYPE_UINT:
-	    ret = safe_atou32(strval, &val.v_u32);
+      case DMAP_TYPE_DATE:
+      case DMAP_TYPE_UBYTE:
+      case DMAP_TYPE_USHORT:
+      case DMAP_TYPE_UINT:
+	if (strval)
+	  {
+	    ret = safe_atou32(strval, &v.v_u32);
 	    if (ret < 0)
-	      val.v_u32 = 0;
-	    break;
+	      v.v_u32 = 0;
+	  }
+	else
+	  v.v_u32 = intval;
+
+	*val = v.v_u32;
+	return 0;
 
-	  case DMAP_TYPE_BYTE:
-	  case DMAP_TYPE_SHORT:
-	  case DMAP_TYPE_INT:
-	    ret = safe_atoi32(strval, &val.v_i32);
+      case DMAP_TYPE_BYTE:
+      case DMAP_TYPE_SHORT:
+      case DMAP_TYPE_INT:
+	if (strval)
+	  {
+	    ret = safe_atoi32(strval, &v.v_i32);
 	    if (ret < 0)
-	      val.v_i32 = 0;
-	    break;
+	      v.v_i32 = 0;
+	  }
+	else
+	  v.v_i32 = intval;
 
-	  case DMAP_TYPE_ULONG:
-	    ret = safe_atou64(strval, &val.v_u64);
+	*val = v.v_i32;
+	return 0;
+
+      case DMAP_TYPE_ULONG:
+	if (strval)
+	  {
+	    ret = safe_atou64(strval, &v.v_u64);
 	    if (ret < 0)
-	      val.v_u64 = 0;
-	    break;
+	      v.v_u64 = 0;
+	  }
+	else
+	  v.v_u64 = intval;
+
+	*val = v.v_u64;
+	return 0;
 
-	  case DMAP_TYPE_LONG:
-	    ret = safe_atoi64(strval, &val.v_i64);
+      case DMAP_TYPE_LONG:
+	if (strval)
+	  {
+	    ret = safe_atoi64(strval, &v.v_i64);
 	    if (ret < 0)
-	      val.v_i64 = 0;
-	    break;
+	      v.v_i64 = 0;
+	  }
+	else
+	  v.v_i64 = intval;
+
+	*val = v.v_i64;
+	return 0;
+
+      /* DMAP_TYPE_VERSION & DMAP_TYPE_LIST not handled here */
+      default:
+	DPRINTF(E_LOG, L_DAAP, "Unsupported DMAP type %d for DMAP field %s\n", df->type, df->desc);
+	return -1;
+    }
+}
 
-	  /* DMAP_TYPE_VERSION & DMAP_TYPE_LIST not handled here */
-	  default:
-	    DPRINTF(E_LOG, L_DAAP, "Unsupported DMAP type %d for DMAP field %s\n", df->type, df->desc);
-	    return;
-	}
+void
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval)
+{
+  int64_t val;
+
+  if (df->type == DMAP_TYPE_STRING)
+    {
+      if (strval)
+	dmap_add_string(evbuf, df->tag, strval);
+      return;
     }
-  else if (!strval && (df->type != DMAP_TYPE_STRING))
+
+  if (dmap_field_value(df, strval, intval, &val) < 0 || val == 0)
+    return;
+
+  switch (df->type)
     {
-      switch (df->type)
-	{
-	  case DMAP_TYPE_DATE:
-	  case DMAP_TYPE_UBYTE:
-	  case DMAP_TYPE_USHORT:
-	  case DMAP_TYPE_UINT:
-	    val.v_u32 = intval;
-	    break;
+      case DMAP_TYPE_UBYTE:
+      case DMAP_TYPE_BYTE:
+	dmap_add_char(evbuf, df->tag, val);
+	break;
 
-	  case DMAP_TYPE_BYTE:
-	  case DMAP_TYPE_SHORT:
-	  case DMAP_TYPE_INT:
-	    val.v_i32 = intval;
-	    break;
+      case DMAP_TYPE_USHORT:
+      case DMAP_TYPE_SHORT:
+	dmap_add_short(evbuf, df->tag, val);
+	break;
 
-	  case DMAP_TYPE_ULONG:
-	    val.v_u64 = intval;
-	    break;
+      case DMAP_TYPE_DATE:
+      case DMAP_TYPE_UINT:
+      case DMAP_TYPE_INT:
+	dmap_add_int(evbuf, df->tag, val);
+	break;
 
-	  case DMAP_TYPE_LONG:
-	    val.v_i64 = intval;
-	    break;
+      case DMAP_TYPE_ULONG:
+      case DMAP_TYPE_LONG:
+	dmap_add_long(evbuf, df->tag, val);
+	break;
 
-	  /* DMAP_TYPE_VERSION & DMAP_TYPE_LIST not handled here */
-	  default:
-	    DPRINTF(E_LOG, L_DAAP, "Unsupported DMAP type %d for DMAP field %s\n", df->type, df->desc);
-	    return;
-	}
+      default:
+	break;
+    }
+}
+
+
+/* ------------------------------ DMAP writer ------------------------------ */
+
+// Smallest step the writer buffer grows by
+#define DMAP_WRITER_CHUNK 65536
+
+// Replies smaller than this are copied to the evbuffer instead of handing it
+// the writer buffer, which is then kept for the next reply
+#define DMAP_WRITER_COPY_MAX 4096
+
+static inline void
+writer_u32(uint8_t *p, uint32_t val)
+{
+  p[0] = (val >> 24) & 0xff;
+  p[1] = (val >> 16) & 0xff;
+  p[2] = (val >> 8) & 0xff;
+  p[3] = val & 0xff;
+}
+
+// Returns room for len bytes at the end of the buffer, which then count as written
+static uint8_t *
+writer_space(struct dmap_writer *w, size_t len)
+{
+  uint8_t *p;
+  size_t size;
+
+  if (w->len + len > w->size)
+    {
+      size = w->size ? 2 * w->size : w->chunk;
+      if (size < w->len + len)
+	size = w->len + len;
+
+      CHECK_NULL(L_DMAP, w->data = realloc(w->data, size));
+      w->size = size;
+    }
+
+  p = w->data + w->len;
+  w->len += len;
+
+  return p;
+}
+
+// The tag and length of a field, followed by room for the value
+static uint8_t *
+writer_field(struct dmap_writer *w, const char *tag, uint32_t len)
+{
+  uint8_t *p;
+
+  p = writer_space(w, 8 + len);
+
+  memcpy(p, tag, 4);
+  writer_u32(p + 4, len);
+
+  return p + 8;
+}
+
+void
+dmap_writer_init(struct dmap_writer *w, size_t chunk)
+{
+  memset(w, 0, sizeof(struct dmap_writer));
+
+  w->chunk = chunk ? chunk : DMAP_WRITER_CHUNK;
+}
+
+void
+dmap_writer_free(struct dmap_writer *w)
+{
+  free(w->data);
+
+  w->data = NULL;
+  w->len = 0;
+  w->size = 0;
+}
+
+void
+dmap_writer_reset(struct dmap_writer *w)
+{
+  w->len = 0;
+}
+
+size_t
+dmap_writer_container_begin(struct dmap_writer *w, const char *tag)
+{
+  size_t offset;
+
+  offset = w->len;
+  writer_field(w, tag, 0);
+
+  return offset;
+}
+
+void
+dmap_writer_container_end(struct dmap_writer *w, size_t offset)
+{
+  writer_u32(w->data + offset + 4, w->len - offset - 8);
+}
+
+void
+dmap_writer_raw(struct dmap_writer *w, const void *data, size_t len)
+{
+  memcpy(writer_space(w, len), data, len);
+}
+
+void
+dmap_writer_long(struct dmap_writer *w, const char *tag, int64_t val)
+{
+  uint8_t *p;
+
+  p = writer_field(w, tag, 8);
+
+  writer_u32(p, (uint64_t)val >> 32);
+  writer_u32(p + 4, val & 0xffffffff);
+}
+
+void
+dmap_writer_int(struct dmap_writer *w, const char *tag, int val)
+{
+  writer_u32(writer_field(w, tag, 4), val);
+}
+
+void
+dmap_writer_short(struct dmap_writer *w, const char *tag, short val)
+{
+  uint8_t *p;
+
+  p = writer_field(w, tag, 2);
+
+  p[0] = (val >> 8) & 0xff;
+  p[1] = val & 0xff;
+}
+
+void
+dmap_writer_char(struct dmap_writer *w, const char *tag, char val)
+{
+  *writer_field(w, tag, 1) = val;
+}
+
+void
+dmap_writer_literal(struct dmap_writer *w, const char *tag, const char *str, int len)
+{
+  uint8_t *p;
+
+  if (!str || len < 0)
+    len = 0;
+
+  p = writer_field(w, tag, len);
+  if (len > 0)
+    memcpy(p, str, len);
+}
+
+void
+dmap_writer_string(struct dmap_writer *w, const char *tag, const char *str)
+{
+  dmap_writer_literal(w, tag, str, str ? strlen(str) : 0);
+}
+
+void
+dmap_writer_field(struct dmap_writer *w, const struct dmap_field *df, char *strval, int64_t intval)
+{
+  int64_t val;
+
+  if (df->type == DMAP_TYPE_STRING)
+    {
+      if (strval)
+	dmap_writer_string(w, df->tag, strval);
+      return;
     }
 
+  if (dmap_field_value(df, strval, intval, &val) < 0 || val == 0)
+    return;
+
   switch (df->type)
     {
       case DMAP_TYPE_UBYTE:
-	if (val.v_u32)
-	  dmap_add_char(evbuf, df->tag, val.v_u32);
-	break;
-
       case DMAP_TYPE_BYTE:
-	if (val.v_i32)
-	  dmap_add_char(evbuf, df->tag, val.v_i32);
+	dmap_writer_char(w, df->tag, val);
 	break;
 
       case DMAP_TYPE_USHORT:
-	if (val.v_u32)
-	  dmap_add_short(evbuf, df->tag, val.v_u32);
-	break;
-
       case DMAP_TYPE_SHORT:
-	if (val.v_i32)
-	  dmap_add_short(evbuf, df->tag, val.v_i32);
+	dmap_writer_short(w, df->tag, val);
 	break;
 
       case DMAP_TYPE_DATE:
       case DMAP_TYPE_UINT:
-	if (val.v_u32)
-	  dmap_add_int(evbuf, df->tag, val.v_u32);
-	break;
-
       case DMAP_TYPE_INT:
-	if (val.v_i32)
-	  dmap_add_int(evbuf, df->tag, val.v_i32);
+	dmap_writer_int(w, df->tag, val);
 	break;
 
       case DMAP_TYPE_ULONG:
-	if (val.v_u64)
-	  dmap_add_long(evbuf, df->tag, val.v_u64);
-	break;
-
       case DMAP_TYPE_LONG:
-	if (val.v_i64)
-	  dmap_add_long(evbuf, df->tag, val.v_i64);
+	dmap_writer_long(w, df->tag, val);
 	break;
 
-      case DMAP_TYPE_STRING:
-	if (strval)
-	  dmap_add_string(evbuf, df->tag, strval);
+      default:
 	break;
+    }
+}
+
+static void
+writer_data_free(const void *data, size_t len, void *arg)
+{
+  free((void *)data);
+}
+
+int
+dmap_writer_move(struct dmap_writer *w, struct evbuffer *evbuf)
+{
+  int ret;
+
+  if (w->len == 0)
+    return 0;
 
-      case DMAP_TYPE_VERSION:
-      case DMAP_TYPE_LIST:
-	return;
+  if (w->len < DMAP_WRITER_COPY_MAX)
+    {
+      ret = evbuffer_add(evbuf, w->data, w->len);
+      w->len = 0;
+      return ret;
     }
+
+  ret = evbuffer_add_reference(evbuf, w->data, w->len, writer_data_free, NULL);
+  if (ret < 0)
+    return -1;
+
+  w->data = NULL;
+  w->len = 0;
+  w->size = 0;
+
+  return 0;
 }
 
+
 void
 dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errmsg)
 {
@@ -385,23 +656,166 @@ dmap_send_error(struct evhttp_request *req, const char *container, const char *e
 }
 
 
+/* Integer value of a dbmfi field, whether the query returned it typed or as
+ * a string
+ */
+static int
+dbmfi_int32_get(struct db_media_file_info *dbmfi, ssize_t offset, int32_t *val)
+{
+  char **strval;
+
+  if (dbmfi_has_int(dbmfi, offset))
+    {
+      *val = dbmfi_int(dbmfi, offset);
+      return 0;
+    }
+
+  strval = (char **) ((char *)dbmfi + offset);
+  if (!(*strval))
+    return -1;
+
+  return safe_atoi32(*strval, val);
+}
+
+static int
+dbmfi_int64_get(struct db_media_file_info *dbmfi, ssize_t offset, int64_t *val)
+{
+  char **strval;
+
+  if (dbmfi_has_int(dbmfi, offset))
+    {
+      *val = dbmfi_int(dbmfi, offset);
+      return 0;
+    }
+
+  strval = (char **) ((char *)dbmfi + offset);
+  if (!(*strval))
+    return -1;
+
+  return safe_atoi64(*strval, val);
+}
+
+/* Finds the key of the item in the record cache. The meta list points to the
+ * static field table, so the pointers identify the meta set. The scanner
+ * updates db_timestamp when it saves the item, but play count and rating are
+ * updated without it, so they are also in the stamp.
+ */
+static int
+record_key_get(uint32_t *id, uint32_t *meta_hash, uint64_t *stamp, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+{
+  int64_t db_timestamp;
+  int32_t play_count;
+  int32_t rating;
+  int32_t val;
+  int ret;
+
+  ret = dbmfi_int32_get(dbmfi, dbmfi_offsetof(id), &val);
+  if (ret < 0)
+    return -1;
+
+  *id = val;
+
+  ret = dbmfi_int64_get(dbmfi, dbmfi_offsetof(db_timestamp), &db_timestamp);
+  if (ret < 0)
+    return -1;
+
+  if (dbmfi_int32_get(dbmfi, dbmfi_offsetof(play_count), &play_count) < 0)
+    play_count = 0;
+  if (dbmfi_int32_get(dbmfi, dbmfi_offsetof(rating), &rating) < 0)
+    rating = 0;
+
+  *meta_hash = djb_hash(meta, nmeta * sizeof(*meta));
+  *meta_hash = (*meta_hash * 33) + (sort_tags ? 2 : 0) + (force_wav ? 1 : 0);
+
+  // Ratings are 0-100
+  *stamp = ((uint64_t)(uint32_t)db_timestamp << 32) | (uint32_t)(play_count * 101 + rating);
+
+  return 0;
+}
+
+/* Which of the tags that don't come from the dbmfi columns the meta list asks
+ * for, so that mikd and asdk can be written first
+ */
+static void
+meta_extra_get(int *want_mikd, int *want_asdk, int *want_ased, const struct dmap_field **meta, int nmeta)
+{
+  const struct dmap_field_map *dfm;
+  int i;
+
+  // No specific meta tags requested, send out everything
+  if (nmeta <= 0)
+    {
+      *want_mikd = 1;
+      *want_asdk = 1;
+      *want_ased = 1;
+      return;
+    }
+
+  *want_mikd = 0;
+  *want_asdk = 0;
+  *want_ased = 0;
+
+  for (i = 0; i < nmeta; i++)
+    {
+      dfm = meta[i]->dfm;
+      if (!dfm)
+	break;
+
+      if (dfm == &dfm_dmap_mikd)
+	*want_mikd = 1;
+      else if (dfm == &dfm_dmap_asdk)
+	*want_asdk = 1;
+      else if (dfm == &dfm_dmap_ased)
+	*want_ased = 1;
+    }
+}
+
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+dmap_encode_file_metadata(struct dmap_writer *songlist, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
 {
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
   char **strval;
   char *ptr;
+  char buf[32];
+  size_t offset;
+  uint32_t id;
+  uint32_t meta_hash;
+  uint64_t stamp;
   int32_t val;
+  int64_t intval;
+  int is_int;
   int want_mikd;
   int want_asdk;
   int want_ased;
+  int use_cache;
   int i;
   int ret;
 
-  want_mikd = 0;
-  want_asdk = 0;
-  want_ased = 0;
+  use_cache = (record_key_get(&id, &meta_hash, &stamp, dbmfi, meta, nmeta, sort_tags, force_wav) == 0);
+  if (use_cache && (cache_dmap_record_get(songlist, id, meta_hash, stamp) == 0))
+    return 0;
+
+  meta_extra_get(&want_mikd, &want_asdk, &want_ased, meta, nmeta);
+
+  // The length is patched in when the item is done
+  offset = dmap_writer_container_begin(songlist, "mlit");
+
+  if (want_mikd)
+    {
+      /* dmap.itemkind must come first */
+      ret = dbmfi_int32_get(dbmfi, dbmfi_offsetof(item_kind), &val);
+      if (ret < 0)
+	val = 2; /* music by default */
+      dmap_writer_char(songlist, "mikd", val);
+    }
+  if (want_asdk)
+    {
+      ret = dbmfi_int32_get(dbmfi, dbmfi_offsetof(data_kind), &val);
+      if (ret < 0)
+	val = 0;
+      dmap_writer_char(songlist, "asdk", val);
+    }
 
   i = -1;
   while (1)
@@ -431,47 +845,45 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 	  dfm = dmap_fields[i].dfm;
 	}
 
-      /* Extradata not in media_file_info but flag for reply */
-      if (dfm == &dfm_dmap_ased)
-	{
-	  want_ased = 1;
-	  continue;
-	}
+      /* Written above or below */
+      if (dfm == &dfm_dmap_ased || dfm == &dfm_dmap_mikd || dfm == &dfm_dmap_asdk)
+	continue;
 
       /* Not in struct media_file_info */
       if (dfm->mfi_offset < 0)
 	continue;
 
-      /* Will be prepended to the list */
-      if (dfm == &dfm_dmap_mikd)
-	{
-	  /* item kind */
-	  want_mikd = 1;
-	  continue;
-	}
-      else if (dfm == &dfm_dmap_asdk)
-	{
-	  /* data kind */
-	  want_asdk = 1;
-	  continue;
-	}
-
       DPRINTF(E_SPAM, L_DAAP, "Investigating %s\n", df->desc);
 
       strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
+      is_int = dbmfi_has_int(dbmfi, dfm->mfi_offset);
 
-      if (!(*strval) || (**strval == '\0'))
+      if (!is_int && (!(*strval) || (**strval == '\0')))
 	continue;
 
+      intval = 0;
+
+      /* Typed value from a projected query, only string tags need it as text */
+      if (is_int)
+	{
+	  intval = dbmfi_int(dbmfi, dfm->mfi_offset);
+
+	  if (df->type == DMAP_TYPE_STRING)
+	    {
+	      snprintf(buf, sizeof(buf), "%" PRIi64, intval);
+	      ptr = buf;
+	      strval = &ptr;
+	      is_int = 0;
+	    }
+	}
+
       /* Here's one exception ... codectype (ascd) is actually an integer */
       if (dfm == &dfm_dmap_ascd)
 	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
+	  dmap_writer_literal(songlist, df->tag, *strval, 4);
 	  continue;
 	}
 
-      val = 0;
-
       if (force_wav)
 	{
 	  switch (dfm->mfi_offset)
@@ -483,12 +895,14 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
 	      case dbmfi_offsetof(bitrate):
 		val = 0;
-		ret = safe_atoi32(dbmfi->samplerate, &val);
+		ret = dbmfi_int32_get(dbmfi, dbmfi_offsetof(samplerate), &val);
 		if ((ret < 0) || (val == 0))
 		  val = 1411;
 		else
 		  val = (val * 8) / 250;
 
+		intval = val;
+		is_int = 0;
 		ptr = NULL;
 		strval = &ptr;
 		break;
@@ -503,7 +917,7 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 	    }
 	}
 
-      dmap_add_field(song, df, *strval, val);
+      dmap_writer_field(songlist, df, (is_int) ? NULL : *strval, intval);
 
       DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
     }
@@ -511,128 +925,66 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
   /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
   if (want_ased)
     {
-      dmap_add_short(song, "ased", 1);
-      dmap_add_short(song, "asac", 1);
+      dmap_writer_short(songlist, "ased", 1);
+      dmap_writer_short(songlist, "asac", 1);
     }
 
   if (sort_tags)
     {
-      dmap_add_string(song, "assn", dbmfi->title_sort);
-      dmap_add_string(song, "assa", dbmfi->artist_sort);
-      dmap_add_string(song, "assu", dbmfi->album_sort);
-      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+      dmap_writer_string(songlist, "assn", dbmfi->title_sort);
+      dmap_writer_string(songlist, "assa", dbmfi->artist_sort);
+      dmap_writer_string(songlist, "assu", dbmfi->album_sort);
+      dmap_writer_string(songlist, "assl", dbmfi->album_artist_sort);
 
       if (dbmfi->composer_sort)
-	dmap_add_string(song, "assc", dbmfi->composer_sort);
-    }
-
-  val = 0;
-  if (want_mikd)
-    val += 9;
-  if (want_asdk)
-    val += 9;
-
-  dmap_add_container(songlist, "mlit", evbuffer_get_length(song) + val);
-
-  /* Prepend mikd & asdk if needed */
-  if (want_mikd)
-    {
-      /* dmap.itemkind must come first */
-      ret = safe_atoi32(dbmfi->item_kind, &val);
-      if (ret < 0)
-	val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
-    }
-  if (want_asdk)
-    {
-      ret = safe_atoi32(dbmfi->data_kind, &val);
-      if (ret < 0)
-	val = 0;
-      dmap_add_char(songlist, "asdk", val);
+	dmap_writer_string(songlist, "assc", dbmfi->composer_sort);
     }
 
-  ret = evbuffer_add_buffer(songlist, song);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_DAAP, "Could not add song to song list\n");
+  dmap_writer_container_end(songlist, offset);
 
-      return -1;
-    }
+  if (use_cache)
+    cache_dmap_record_add(id, meta_hash, stamp, songlist->data + offset, songlist->len - offset);
 
   return 0;
 }
 
 int
-dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item)
+dmap_encode_queue_metadata(struct dmap_writer *songlist, struct db_queue_item *queue_item)
 {
-  int32_t val;
-  int want_mikd;
-  int want_asdk;
-  int want_ased;
-  int ret;
-
-  dmap_add_int(song, "miid", queue_item->file_id);
-  dmap_add_string(song, "minm", queue_item->title);
-  dmap_add_long(song, "mper", queue_item->file_id);
-  dmap_add_int(song, "mcti", queue_item->file_id);
-  dmap_add_string(song, "asal", queue_item->album);
-  dmap_add_long(song, "asai", queue_item->songalbumid);
-  dmap_add_string(song, "asaa", queue_item->album_artist);
-  dmap_add_string(song, "asar", queue_item->artist);
-  dmap_add_int(song, "asdm", queue_item->time_modified);
-  dmap_add_short(song, "asdn", queue_item->disc);
-  dmap_add_string(song, "asgn", queue_item->genre);
-  dmap_add_int(song, "astm", queue_item->song_length);
-  dmap_add_short(song, "astn", queue_item->track);
-  dmap_add_short(song, "asyr", queue_item->year);
-  dmap_add_int(song, "aeMK", queue_item->media_kind);
-  dmap_add_char(song, "aeMk", queue_item->media_kind);
-
-  dmap_add_string(song, "asfm", "wav");
-  dmap_add_short(song, "asbr", 1411);
-  dmap_add_string(song, "asdt", "wav audio file");
-
-  want_mikd = 1;/* Will be prepended to the list *//* item kind */
-  want_asdk = 1;/* Will be prepended to the list *//* data kind */
-  want_ased = 1;/* Extradata not in media_file_info but flag for reply */
+  size_t offset;
+
+  offset = dmap_writer_container_begin(songlist, "mlit");
+
+  /* dmap.itemkind must come first, music by default */
+  dmap_writer_char(songlist, "mikd", 2);
+  dmap_writer_char(songlist, "asdk", 2);
+
+  dmap_writer_int(songlist, "miid", queue_item->file_id);
+  dmap_writer_string(songlist, "minm", queue_item->title);
+  dmap_writer_long(songlist, "mper", queue_item->file_id);
+  dmap_writer_int(songlist, "mcti", queue_item->file_id);
+  dmap_writer_string(songlist, "asal", queue_item->album);
+  dmap_writer_long(songlist, "asai", queue_item->songalbumid);
+  dmap_writer_string(songlist, "asaa", queue_item->album_artist);
+  dmap_writer_string(songlist, "asar", queue_item->artist);
+  dmap_writer_int(songlist, "asdm", queue_item->time_modified);
+  dmap_writer_short(songlist, "asdn", queue_item->disc);
+  dmap_writer_string(songlist, "asgn", queue_item->genre);
+  dmap_writer_int(songlist, "astm", queue_item->song_length);
+  dmap_writer_short(songlist, "astn", queue_item->track);
+  dmap_writer_short(songlist, "asyr", queue_item->year);
+  dmap_writer_int(songlist, "aeMK", queue_item->media_kind);
+  dmap_writer_char(songlist, "aeMk", queue_item->media_kind);
+
+  dmap_writer_string(songlist, "asfm", "wav");
+  dmap_writer_short(songlist, "asbr", 1411);
+  dmap_writer_string(songlist, "asdt", "wav audio file");
 
   /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
-  if (want_ased)
-    {
-      dmap_add_short(song, "ased", 1);
-      dmap_add_short(song, "asac", 1);
-    }
-
-  val = 0;
-  if (want_mikd)
-    val += 9;
-  if (want_asdk)
-    val += 9;
-
-  dmap_add_container(songlist, "mlit", evbuffer_get_length(song) + val);
-
-  /* Prepend mikd & asdk if needed */
-  if (want_mikd)
-    {
-      /* dmap.itemkind must come first */
-      val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
-    }
-  if (want_asdk)
-    {
-      ret = queue_item->data_kind;
-      if (ret < 0)
-	val = 0;
-      dmap_add_char(songlist, "asdk", val);
-    }
+  dmap_writer_short(songlist, "ased", 1);
+  dmap_writer_short(songlist, "asac", 1);
 
-  ret = evbuffer_add_buffer(songlist, song);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_DAAP, "Could not add song to song list\n");
-
-      return -1;
-    }
+  dmap_writer_container_end(songlist, offset);
 
   return 0;
 }
@@ -73,7 +73,68 @@ void
 dmap_add_string(struct evbuffer *evbuf, const char *tag, const char *str);
 
 void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval);
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval);
+
+/* A DMAP writer encodes into one contiguous buffer that grows in large steps,
+ * so that container lengths can be patched in place once the contents are
+ * known, and items don't need their own buffers. Allocation failure is fatal,
+ * like for the evbuffer functions above.
+ */
+struct dmap_writer {
+  uint8_t *data;
+  size_t len;
+  size_t size;
+  size_t chunk;
+};
+
+// chunk is the smallest step the buffer grows by, 0 for the default
+void
+dmap_writer_init(struct dmap_writer *w, size_t chunk);
+
+void
+dmap_writer_free(struct dmap_writer *w);
+
+// Discards what was written, but keeps the buffer
+void
+dmap_writer_reset(struct dmap_writer *w);
+
+// Returns the offset of the container, which must be given to _end() when
+// its contents have been written
+size_t
+dmap_writer_container_begin(struct dmap_writer *w, const char *tag);
+
+void
+dmap_writer_container_end(struct dmap_writer *w, size_t offset);
+
+void
+dmap_writer_raw(struct dmap_writer *w, const void *data, size_t len);
+
+void
+dmap_writer_long(struct dmap_writer *w, const char *tag, int64_t val);
+
+void
+dmap_writer_int(struct dmap_writer *w, const char *tag, int val);
+
+void
+dmap_writer_short(struct dmap_writer *w, const char *tag, short val);
+
+void
+dmap_writer_char(struct dmap_writer *w, const char *tag, char val);
+
+void
+dmap_writer_literal(struct dmap_writer *w, const char *tag, const char *str, int len);
+
+void
+dmap_writer_string(struct dmap_writer *w, const char *tag, const char *str);
+
+void
+dmap_writer_field(struct dmap_writer *w, const struct dmap_field *df, char *strval, int64_t intval);
+
+/* Moves what was written to the end of evbuf. Large buffers are handed over
+ * to the evbuffer without a copy, the writer then starts a new one.
+ */
+int
+dmap_writer_move(struct dmap_writer *w, struct evbuffer *evbuf);
 
 void
 dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errmsg);
@@ -81,11 +142,17 @@ dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errms
 void
 dmap_send_error(struct evhttp_request *req, const char *container, const char *errmsg);
 
+/* Finds the first field with the tag in a DMAP reply, also inside containers,
+ * and gets its value if it is an integer. Returns 0 if found, otherwise -1.
+ */
+int
+dmap_find_int(const uint8_t *data, size_t len, const char *tag, int64_t *val);
+
 
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
+dmap_encode_file_metadata(struct dmap_writer *songlist, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
 
 int
-dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item);
+dmap_encode_queue_metadata(struct dmap_writer *songlist, struct db_queue_item *queue_item);
 
 #endif /* !__DMAP_HELPERS_H__ */
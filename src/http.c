@@ -31,6 +31,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_PTHREAD_NP_H
+# include <pthread_np.h>
+#endif
 
 #include <libavutil/opt.h>
 
@@ -44,6 +48,7 @@
 #include "httpd.h"
 #include "logger.h"
 #include "misc.h"
+#include "commands.h"
 
 /* Formats we can read so far */
 #define PLAYLIST_UNK 0
@@ -304,6 +309,69 @@ http_client_request_impl(struct http_client_ctx *ctx)
 }
 
 #ifdef HAVE_LIBCURL
+/* ------------------------------ Shared handle ------------------------------ */
+/*
+ * All our curl handles share connections, DNS lookups and TLS sessions, so
+ * that requests to the same host don't need a new handshake each time. The
+ * share is used from many threads, so curl needs us to do the locking.
+ */
+
+static CURLSH *curl_share;
+static pthread_mutex_t curl_share_lck[CURL_LOCK_DATA_LAST];
+
+static void
+curl_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+  pthread_mutex_lock(&curl_share_lck[data]);
+}
+
+static void
+curl_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+  pthread_mutex_unlock(&curl_share_lck[data]);
+}
+
+static int
+share_init(void)
+{
+  int i;
+
+  curl_share = curl_share_init();
+  if (!curl_share)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl share handle\n");
+      return -1;
+    }
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    CHECK_ERR(L_HTTP, pthread_mutex_init(&curl_share_lck[i], NULL));
+
+  curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock);
+  curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+  curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+  curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+  return 0;
+}
+
+static void
+share_deinit(void)
+{
+  int i;
+
+  if (!curl_share)
+    return;
+
+  curl_share_cleanup(curl_share);
+  curl_share = NULL;
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_destroy(&curl_share_lck[i]);
+}
+
 static size_t
 curl_request_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
@@ -327,35 +395,37 @@ curl_request_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
   return realsize;
 }
 
-static int
-https_client_request_impl(struct http_client_ctx *ctx)
+static CURL *
+curl_handle_new(struct http_client_ctx *ctx, struct curl_slist **headers)
 {
   CURL *curl;
-  CURLcode res;
-  struct curl_slist *headers;
   struct onekeyval *okv;
   char header[1024];
 
+  *headers = NULL;
+
   curl = curl_easy_init();
   if (!curl)
     {
       DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl handle\n");
-      return -1;
+      return NULL;
     }
 
   curl_easy_setopt(curl, CURLOPT_URL, ctx->url);
   curl_easy_setopt(curl, CURLOPT_USERAGENT, "forked-daapd/" VERSION);
 
+  if (curl_share)
+    curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+
   if (ctx->output_headers)
     {
-      headers = NULL;
       for (okv = ctx->output_headers->head; okv; okv = okv->next)
 	{
 	  snprintf(header, sizeof(header), "%s: %s", okv->name, okv->value);
-	  headers = curl_slist_append(headers, header);
+	  *headers = curl_slist_append(*headers, header);
         }
 
-      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
     }
 
   if (ctx->output_body)
@@ -366,6 +436,20 @@ https_client_request_impl(struct http_client_ctx *ctx)
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_request_cb);
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, ctx);
 
+  return curl;
+}
+
+static int
+https_client_request_impl(struct http_client_ctx *ctx)
+{
+  CURL *curl;
+  CURLcode res;
+  struct curl_slist *headers;
+
+  curl = curl_handle_new(ctx, &headers);
+  if (!curl)
+    return -1;
+
   /* Make request */
   DPRINTF(E_INFO, L_HTTP, "Making request for %s\n", ctx->url);
 
@@ -374,13 +458,505 @@ https_client_request_impl(struct http_client_ctx *ctx)
     {
       DPRINTF(E_LOG, L_HTTP, "Request to %s failed: %s\n", ctx->url, curl_easy_strerror(res));
       curl_easy_cleanup(curl);
+      curl_slist_free_all(headers);
       return -1;
     }
 
   curl_easy_cleanup(curl);
+  curl_slist_free_all(headers);
+
+  return 0;
+}
+
+/* State of one request made by http_client_request_multi() */
+struct multi_request
+{
+  struct http_client_ctx *ctx;
+  CURL *curl;
+  struct curl_slist *headers;
+  int retry_after;
+  int attempts;
+  bool done;
+};
+
+// Max number of times a request is retried when the server says 429 or 503
+#define HTTP_CLIENT_MULTI_RETRIES 5
+// Seconds to wait before retrying if the server didn't say
+#define HTTP_CLIENT_MULTI_RETRY_WAIT 1
+
+static size_t
+curl_multi_header_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  struct multi_request *req = userdata;
+  size_t realsize;
+  int32_t val;
+  char buf[32];
+  size_t len;
+
+  realsize = size * nmemb;
+  len = strlen("Retry-After:");
+
+  // Only the delay-seconds form, the HTTP-date form falls back to the default
+  if ((realsize > len) && (realsize - len < sizeof(buf)) && (strncasecmp(ptr, "Retry-After:", len) == 0))
+    {
+      memcpy(buf, ptr + len, realsize - len);
+      buf[realsize - len] = '\0';
+      if ((safe_atoi32(buf, &val) == 0) && (val > 0))
+	req->retry_after = val;
+    }
+
+  return realsize;
+}
+
+static int
+multi_request_start(CURLM *multi, struct multi_request *req)
+{
+  req->curl = curl_handle_new(req->ctx, &req->headers);
+  if (!req->curl)
+    return -1;
+
+  curl_easy_setopt(req->curl, CURLOPT_HEADERFUNCTION, curl_multi_header_cb);
+  curl_easy_setopt(req->curl, CURLOPT_HEADERDATA, req);
+  curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+
+  req->retry_after = 0;
+  req->attempts++;
+
+  DPRINTF(E_INFO, L_HTTP, "Making request for %s\n", req->ctx->url);
+
+  curl_multi_add_handle(multi, req->curl);
+
+  return 0;
+}
+
+static void
+multi_request_stop(CURLM *multi, struct multi_request *req)
+{
+  curl_multi_remove_handle(multi, req->curl);
+  curl_easy_cleanup(req->curl);
+  curl_slist_free_all(req->headers);
+
+  req->curl = NULL;
+  req->headers = NULL;
+}
+
+/* Thread: any */
+static int
+https_client_request_multi_impl(struct http_client_ctx **ctxs, int nctxs, int parallel)
+{
+  struct multi_request *reqs;
+  struct multi_request *req;
+  CURLM *multi;
+  CURLMsg *msg;
+  CURLcode res;
+  long code;
+  time_t hold_until;
+  int running;
+  int active;
+  int ndone;
+  int nfailed;
+  int msgs_left;
+  int i;
+
+  multi = curl_multi_init();
+  if (!multi)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl multi handle\n");
+      return -1;
+    }
+
+  CHECK_NULL(L_HTTP, reqs = calloc(nctxs, sizeof(struct multi_request)));
+  for (i = 0; i < nctxs; i++)
+    reqs[i].ctx = ctxs[i];
+
+  hold_until = 0;
+  active = 0;
+  ndone = 0;
+  nfailed = 0;
+
+  while (ndone < nctxs)
+    {
+      // Start more requests, unless the server told us to hold back
+      if (time(NULL) < hold_until)
+	{
+	  if (active == 0)
+	    sleep(1);
+	}
+      else
+	{
+	  for (i = 0; (i < nctxs) && (active < parallel); i++)
+	    {
+	      req = &reqs[i];
+	      if (req->done || req->curl)
+		continue;
+
+	      if (multi_request_start(multi, req) < 0)
+		{
+		  req->ctx->ret = -1;
+		  req->done = true;
+		  ndone++;
+		  nfailed++;
+		  continue;
+		}
+
+	      active++;
+	    }
+	}
+
+      curl_multi_perform(multi, &running);
+      curl_multi_wait(multi, NULL, 0, 100, NULL);
+
+      while ((msg = curl_multi_info_read(multi, &msgs_left)))
+	{
+	  if (msg->msg != CURLMSG_DONE)
+	    continue;
+
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+	  res = msg->data.result;
+	  code = 0;
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+
+	  multi_request_stop(multi, req);
+	  active--;
+
+	  if ((res == CURLE_OK) && ((code == 429) || (code == 503)) && (req->attempts <= HTTP_CLIENT_MULTI_RETRIES))
+	    {
+	      if (req->retry_after == 0)
+		req->retry_after = HTTP_CLIENT_MULTI_RETRY_WAIT;
+
+	      DPRINTF(E_WARN, L_HTTP, "Server asked to retry %s in %d sec (HTTP %ld)\n", req->ctx->url, req->retry_after, code);
+
+	      // The limit is for all our requests, not just this one
+	      if (time(NULL) + req->retry_after > hold_until)
+		hold_until = time(NULL) + req->retry_after;
+
+	      if (req->ctx->input_body)
+		evbuffer_drain(req->ctx->input_body, evbuffer_get_length(req->ctx->input_body));
+	      continue;
+	    }
+
+	  if (res != CURLE_OK)
+	    {
+	      DPRINTF(E_LOG, L_HTTP, "Request to %s failed: %s\n", req->ctx->url, curl_easy_strerror(res));
+	      req->ctx->ret = -1;
+	      nfailed++;
+	    }
+	  else
+	    req->ctx->ret = 0;
+
+	  req->done = true;
+	  ndone++;
+	}
+    }
+
+  free(reqs);
+  curl_multi_cleanup(multi);
+
+  return nfailed;
+}
+
+
+/* ------------------------------ Async client ------------------------------ */
+/*
+ * Requests made with http_client_request_async() are run by a curl multi
+ * handle in a thread of its own, which is driven by libevent through curl's
+ * socket interface.
+ */
+
+struct async_request
+{
+  struct http_client_ctx *ctx;
+  http_client_cb cb;
+  void *cb_arg;
+
+  CURL *curl;
+  struct curl_slist *headers;
+
+  struct async_request *next;
+};
+
+static pthread_t tid_httpc;
+static struct event_base *evbase_httpc;
+static struct commands_base *cmdbase;
+static CURLM *async_multi;
+static struct event *async_timer;
+static struct async_request *async_requests;
+
+static void
+async_request_free(struct async_request *areq)
+{
+  struct async_request *p;
+
+  if (areq == async_requests)
+    async_requests = areq->next;
+  else
+    {
+      for (p = async_requests; p && p->next != areq; p = p->next)
+	; /* EMPTY */
+
+      if (p)
+	p->next = areq->next;
+    }
+
+  if (areq->curl)
+    {
+      curl_multi_remove_handle(async_multi, areq->curl);
+      curl_easy_cleanup(areq->curl);
+    }
+
+  curl_slist_free_all(areq->headers);
+  free(areq);
+}
+
+static void
+async_request_done(struct async_request *areq, int ret)
+{
+  areq->ctx->ret = ret;
+
+  areq->cb(areq->ctx, areq->cb_arg);
+
+  async_request_free(areq);
+}
+
+static void
+async_check_done(void)
+{
+  struct async_request *areq;
+  CURLMsg *msg;
+  int msgs_left;
+
+  while ((msg = curl_multi_info_read(async_multi, &msgs_left)))
+    {
+      if (msg->msg != CURLMSG_DONE)
+	continue;
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&areq);
+
+      if (msg->data.result != CURLE_OK)
+	{
+	  DPRINTF(E_LOG, L_HTTP, "Request to %s failed: %s\n", areq->ctx->url, curl_easy_strerror(msg->data.result));
+	  async_request_done(areq, -1);
+	}
+      else
+	async_request_done(areq, 0);
+    }
+}
+
+static void
+async_socket_event_cb(int fd, short what, void *arg)
+{
+  int flags;
+  int running;
+
+  flags = 0;
+  if (what & EV_READ)
+    flags |= CURL_CSELECT_IN;
+  if (what & EV_WRITE)
+    flags |= CURL_CSELECT_OUT;
+
+  curl_multi_socket_action(async_multi, fd, flags, &running);
+
+  async_check_done();
+}
+
+static void
+async_timer_event_cb(int fd, short what, void *arg)
+{
+  int running;
+
+  curl_multi_socket_action(async_multi, CURL_SOCKET_TIMEOUT, 0, &running);
+
+  async_check_done();
+}
+
+// Called by curl when it wants us to change what we are watching on a socket
+static int
+async_socket_cb(CURL *curl, curl_socket_t s, int what, void *userp, void *socketp)
+{
+  struct event *ev = socketp;
+  short flags;
+
+  if (what == CURL_POLL_REMOVE)
+    {
+      if (ev)
+	event_free(ev);
+
+      return 0;
+    }
+
+  flags = EV_PERSIST;
+  if (what & CURL_POLL_IN)
+    flags |= EV_READ;
+  if (what & CURL_POLL_OUT)
+    flags |= EV_WRITE;
+
+  if (ev)
+    {
+      event_del(ev);
+      event_assign(ev, evbase_httpc, s, flags, async_socket_event_cb, NULL);
+    }
+  else
+    {
+      ev = event_new(evbase_httpc, s, flags, async_socket_event_cb, NULL);
+      if (!ev)
+	return -1;
+
+      curl_multi_assign(async_multi, s, ev);
+    }
+
+  event_add(ev, NULL);
 
   return 0;
 }
+
+// Called by curl when it wants to be called back after timeout_ms
+static int
+async_timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+  struct timeval tv;
+
+  if (timeout_ms < 0)
+    {
+      evtimer_del(async_timer);
+      return 0;
+    }
+
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  evtimer_add(async_timer, &tv);
+
+  return 0;
+}
+
+/* Thread: httpc */
+static enum command_state
+async_request_add(void *arg, int *retval)
+{
+  struct async_request *areq = arg;
+
+  areq->curl = curl_handle_new(areq->ctx, &areq->headers);
+  if (!areq->curl)
+    goto error;
+
+  curl_easy_setopt(areq->curl, CURLOPT_PRIVATE, areq);
+
+  DPRINTF(E_INFO, L_HTTP, "Making async request for %s\n", areq->ctx->url);
+
+  areq->next = async_requests;
+  async_requests = areq;
+
+  // The request is freed by async_request_done(), so we return
+  // COMMAND_PENDING to keep the commands base from freeing it
+  if (curl_multi_add_handle(async_multi, areq->curl) != CURLM_OK)
+    {
+      async_request_done(areq, -1);
+      *retval = -1;
+      return COMMAND_PENDING;
+    }
+
+  *retval = 0;
+  return COMMAND_PENDING;
+
+ error:
+  areq->ctx->ret = -1;
+  areq->cb(areq->ctx, areq->cb_arg);
+  curl_slist_free_all(areq->headers);
+  *retval = -1;
+  return COMMAND_END;
+}
+
+static void *
+httpc(void *arg)
+{
+  event_base_dispatch(evbase_httpc);
+
+  // Whatever wasn't done when we were told to stop is cancelled
+  while (async_requests)
+    async_request_done(async_requests, -1);
+
+  pthread_exit(NULL);
+}
+
+static int
+async_init(void)
+{
+  int ret;
+
+  evbase_httpc = event_base_new();
+  if (!evbase_httpc)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Could not create an event base\n");
+      goto evbase_fail;
+    }
+
+  async_timer = evtimer_new(evbase_httpc, async_timer_event_cb, NULL);
+  if (!async_timer)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Could not create http client timer\n");
+      goto timer_fail;
+    }
+
+  async_multi = curl_multi_init();
+  if (!async_multi)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl multi handle\n");
+      goto multi_fail;
+    }
+
+  curl_multi_setopt(async_multi, CURLMOPT_SOCKETFUNCTION, async_socket_cb);
+  curl_multi_setopt(async_multi, CURLMOPT_TIMERFUNCTION, async_timer_cb);
+
+  cmdbase = commands_base_new(evbase_httpc, NULL);
+
+  ret = pthread_create(&tid_httpc, NULL, httpc, NULL);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Could not spawn http client thread: %s\n", strerror(errno));
+      goto thread_fail;
+    }
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(tid_httpc, "httpc");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(tid_httpc, "httpc");
+#endif
+
+  return 0;
+
+ thread_fail:
+  commands_base_free(cmdbase);
+  curl_multi_cleanup(async_multi);
+ multi_fail:
+  event_free(async_timer);
+ timer_fail:
+  event_base_free(evbase_httpc);
+  evbase_httpc = NULL;
+ evbase_fail:
+  return -1;
+}
+
+static void
+async_deinit(void)
+{
+  int ret;
+
+  if (!evbase_httpc)
+    return;
+
+  commands_base_destroy(cmdbase);
+
+  ret = pthread_join(tid_httpc, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_HTTP, "Could not join http client thread: %s\n", strerror(errno));
+      return;
+    }
+
+  curl_multi_cleanup(async_multi);
+  event_free(async_timer);
+  event_base_free(evbase_httpc);
+  evbase_httpc = NULL;
+}
 #endif /* HAVE_LIBCURL */
 
 int
@@ -398,6 +974,92 @@ http_client_request(struct http_client_ctx *ctx)
   return -1;
 }
 
+int
+http_client_request_multi(struct http_client_ctx **ctxs, int nctxs, int parallel)
+{
+  int nfailed;
+  int i;
+
+  if (nctxs <= 0)
+    return 0;
+
+#ifdef HAVE_LIBCURL
+  // The multi interface is only for https, so check that all are
+  for (i = 0; i < nctxs; i++)
+    {
+      if (strncmp(ctxs[i]->url, "https:", strlen("https:")) != 0)
+	break;
+    }
+
+  if ((i == nctxs) && (parallel > 1))
+    return https_client_request_multi_impl(ctxs, nctxs, parallel);
+#endif
+
+  nfailed = 0;
+  for (i = 0; i < nctxs; i++)
+    {
+      ctxs[i]->ret = http_client_request(ctxs[i]);
+      if (ctxs[i]->ret < 0)
+	nfailed++;
+    }
+
+  return nfailed;
+}
+
+int
+http_client_request_async(struct http_client_ctx *ctx, http_client_cb cb, void *cb_arg)
+{
+#ifdef HAVE_LIBCURL
+  struct async_request *areq;
+
+  if (cmdbase && (strncmp(ctx->url, "http", strlen("http")) == 0))
+    {
+      CHECK_NULL(L_HTTP, areq = calloc(1, sizeof(struct async_request)));
+      areq->ctx = ctx;
+      areq->cb = cb;
+      areq->cb_arg = cb_arg;
+
+      return commands_exec_async(cmdbase, async_request_add, areq);
+    }
+#endif
+
+  // No async client, so the caller will have to wait
+  ctx->ret = http_client_request(ctx);
+  cb(ctx, cb_arg);
+
+  return 0;
+}
+
+int
+http_client_init(void)
+{
+#ifdef HAVE_LIBCURL
+  int ret;
+
+  ret = share_init();
+  if (ret < 0)
+    return -1;
+
+  ret = async_init();
+  if (ret < 0)
+    {
+      share_deinit();
+      return -1;
+    }
+#endif
+
+  return 0;
+}
+
+void
+http_client_deinit(void)
+{
+#ifdef HAVE_LIBCURL
+  async_deinit();
+  share_deinit();
+#endif
+}
+
 char *
 http_form_urlencode(struct keyval *kv)
 {
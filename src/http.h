@@ -34,6 +34,8 @@ struct http_client_ctx
   void *evbase;
 };
 
+typedef void (*http_client_cb)(struct http_client_ctx *ctx, void *arg);
+
 struct http_icy_metadata
 {
   uint32_t id;
@@ -62,6 +64,44 @@ struct http_icy_metadata
 int
 http_client_request(struct http_client_ctx *ctx);
 
+/* Makes a number of requests concurrently, with at most "parallel" of them
+ * in flight. If the server replies 429 or 503, the request is retried after
+ * the time given in Retry-After, and no new requests are started until then.
+ * The result of each request is in ctx->ret (0 or -1).
+ *
+ * @param ctxs array of request params, see above
+ * @param nctxs number of requests
+ * @param parallel max number of requests at the same time
+ * @return number of failed requests, -1 if an error occurred
+ */
+int
+http_client_request_multi(struct http_client_ctx **ctxs, int nctxs, int parallel);
+
+/* Makes a request without waiting for the reply. The request is made by the
+ * http client thread, which also calls cb when done (or failed), with the
+ * result in ctx->ret. So the callback should be quick, and hand the result
+ * over to the caller's own thread (e.g. with worker_execute). The ctx must
+ * stay valid until cb has been called. Requests that are still pending at
+ * shutdown get cb with ctx->ret = -1. Without libcurl the request is made
+ * right away, and cb is called before returning.
+ *
+ * @param ctx HTTP request params, see above
+ * @param cb callback for the result
+ * @param cb_arg argument for the callback
+ * @return 0 if the request was queued, -1 if an error occurred
+ */
+int
+http_client_request_async(struct http_client_ctx *ctx, http_client_cb cb, void *cb_arg);
+
+/* Sets up the connection, DNS and TLS session cache shared by the http client
+ * requests, and starts the thread for async requests
+ */
+int
+http_client_init(void);
+
+void
+http_client_deinit(void);
+
 
 /* Converts the keyval dictionary to a application/x-www-form-urlencoded string.
  * The values will be uri_encoded. Example output: "key1=foo%20bar&key2=123".
@@ -32,6 +32,7 @@
 # include <pthread_np.h>
 #endif
 #include <time.h>
+#include <dirent.h>
 #include <sys/param.h>
 #include <sys/queue.h>
 #include <sys/types.h>
@@ -43,6 +44,7 @@
 # include <sys/eventfd.h>
 #endif
 #include <event2/event.h>
+#include <event2/buffer.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
 #ifdef HAVE_LIBEVENT2_OLD
@@ -50,12 +52,17 @@
 # include <event2/bufferevent_struct.h>
 #endif
 #include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+# include <libdeflate.h>
+#endif
 
 #include "logger.h"
 #include "db.h"
 #include "conffile.h"
 #include "misc.h"
+#include "metrics.h"
 #include "worker.h"
+#include "commands.h"
 #include "httpd.h"
 #include "httpd_rsp.h"
 #include "httpd_daap.h"
@@ -63,6 +70,7 @@
 #include "httpd_jsonapi.h"
 #include "httpd_streaming.h"
 #include "httpd_oauth.h"
+#include "reqlog.h"
 #include "transcode.h"
 #ifdef LASTFM
 # include "lastfm.h"
@@ -73,6 +81,13 @@
 
 
 #define STREAM_CHUNK_SIZE (64 * 1024)
+// Raw files are sent from the page cache with sendfile, so the chunks can be
+// larger, they just need to be small enough to keep track of the progress
+#define STREAM_FILE_CHUNK_SIZE (1024 * 1024)
+// Replies larger than this are compressed with gzip_level_large
+#define GZIP_LARGE_SIZE (1024 * 1024)
+// Replies from the httpd thread larger than this are compressed by the pool
+#define GZIP_POOL_SIZE (64 * 1024)
 #define ERR_PAGE "<html>\n<head>\n" \
   "<title>%d %s</title>\n" \
   "</head>\n<body>\n" \
@@ -87,6 +102,9 @@ struct content_type_map {
 struct stream_ctx {
   struct evhttp_request *req;
   uint8_t *buf;
+#ifndef HAVE_LIBEVENT2_OLD
+  struct evbuffer_file_segment *seg;
+#endif
   struct evbuffer *evbuf;
   struct event *ev;
   int id;
@@ -98,6 +116,67 @@ struct stream_ctx {
   off_t end_offset;
   int marked;
   struct transcode_ctx *xcode;
+  enum transcode_profile profile;
+  int cache_fd;
+  char *cache_tmp;
+
+  // If transcoding is done by the pool, see xcode_thread(). Guarded by
+  // xcode_lck, and while xcode_busy the pool owns xcode and the cache file.
+  struct evbuffer *xcode_out;
+  int xcode_ret;
+  bool xcode_done;
+  bool xcode_busy;
+  bool xcode_ended;
+  struct stream_ctx *xcode_next;
+};
+
+/* A reply the httpd thread sends in chunks, see httpd_send_reply_chunked() */
+struct chunked_ctx {
+  struct evhttp_request *req;
+  int code;
+  char *reason;
+  bool gzip;
+  z_stream strm;
+  httpd_chunk_cb cb;
+  void *cb_arg;
+  struct evbuffer *in;
+  struct evbuffer *out;
+  struct event *ev;
+};
+
+/* Request handlers, for the request time metrics */
+enum httpd_handler {
+  HTTPD_HANDLER_DACP,
+  HTTPD_HANDLER_DAAP,
+  HTTPD_HANDLER_JSON,
+  HTTPD_HANDLER_STREAMING,
+  HTTPD_HANDLER_OAUTH,
+  HTTPD_HANDLER_RSP,
+  HTTPD_HANDLER_METRICS,
+  HTTPD_HANDLER_FILE,
+  HTTPD_HANDLER_MAX,
+};
+
+static const char *httpd_handler_names[HTTPD_HANDLER_MAX] =
+  {
+    "dacp", "daap", "json", "streaming", "oauth", "rsp", "metrics", "file",
+  };
+
+/* Timing of the phases of the request the thread is handling, see
+ * httpd_trace_phase(). Phases with the same name are added up.
+ */
+#define HTTPD_TRACE_PHASES_MAX 8
+
+struct httpd_trace {
+  bool active;
+  uint32_t id;
+  uint64_t start;
+  uint64_t last;
+  int nphases;
+  struct {
+    const char *name;
+    uint64_t usec;
+  } phases[HTTPD_TRACE_PHASES_MAX];
 };
 
 static const struct content_type_map ext2ctype[] =
@@ -130,14 +209,129 @@ static pthread_t tid_httpd;
 
 static const char *allow_origin;
 static int httpd_port;
+static time_t httpd_start;
+// Set by main when all subsystems are up, until then only files are served
+static bool httpd_is_ready;
+static char *decode_cache_dir;
+static int64_t decode_cache_max;
+static int gzip_level = 6;
+static int gzip_level_large = 1;
+static struct metrics_metric *httpd_metrics[HTTPD_HANDLER_MAX];
+
+// Requests slower than this are logged with their phases, 0 disables tracing
+static int httpd_trace_threshold_ms;
+static uint32_t httpd_trace_next_id;
+static __thread struct httpd_trace httpd_trace;
 
 #ifdef HAVE_LIBEVENT2_OLD
 struct stream_ctx *g_st;
 #endif
 
+/* A request made by the httpd thread's evhttp, but handled by the pool. It
+ * may also be a reply from the httpd thread that the pool should gzip, then
+ * body is set instead of parsed.
+ */
+struct httpd_deferred
+{
+  struct evhttp_request *req;
+  struct httpd_uri_parsed *parsed;
+
+  struct evbuffer *body;
+  int code;
+  char *reason;
+
+  // Copy of the peer, since the connection may go away while we work
+  char *peer_address;
+  unsigned short peer_port;
+
+  bool replied;
+
+  struct httpd_deferred *next;
+};
+
+/* A reply from the pool, which the httpd thread sends */
+struct httpd_deferred_reply
+{
+  struct evhttp_request *req;
+  int code;
+  char *reason;
+  struct evbuffer *evbuf;
+  bool is_error;
+};
+
+static pthread_t *tid_pool;
+static int pool_size;
+static bool pool_exit;
+static pthread_mutex_t pool_lck;
+static pthread_cond_t pool_cond;
+static struct httpd_deferred *pool_queue;
+static struct httpd_deferred *pool_queue_tail;
+// The request a pool thread is handling
+static pthread_key_t pool_current;
+
+// Threads that transcode streams
+static pthread_t *tid_xcode;
+static int xcode_pool_size;
+static bool xcode_exit;
+static pthread_mutex_t xcode_lck;
+static pthread_cond_t xcode_cond;
+static struct stream_ctx *xcode_queue;
+static struct stream_ctx *xcode_queue_tail;
+// For passing replies back to the httpd thread
+static struct commands_base *httpd_cmdbase;
+
 
 /* -------------------------------- HELPERS --------------------------------- */
 
+static const char *
+method_name(enum evhttp_cmd_type type)
+{
+  switch (type)
+    {
+      case EVHTTP_REQ_GET:
+	return "GET";
+      case EVHTTP_REQ_POST:
+	return "POST";
+      case EVHTTP_REQ_PUT:
+	return "PUT";
+      case EVHTTP_REQ_DELETE:
+	return "DELETE";
+      case EVHTTP_REQ_HEAD:
+	return "HEAD";
+      case EVHTTP_REQ_OPTIONS:
+	return "OPTIONS";
+      default:
+	return "UNKNOWN";
+    }
+}
+
+/* Gets the address of the client, which in a pool thread must not come from
+ * the connection, since the httpd thread may free it if the client hangs up
+ */
+static int
+peer_get(struct evhttp_request *req, char **address, unsigned short *port)
+{
+  struct httpd_deferred *d;
+  struct evhttp_connection *evcon;
+  ev_uint16_t evport;
+
+  d = pool_size ? pthread_getspecific(pool_current) : NULL;
+  if (d && d->req == req)
+    {
+      *address = d->peer_address;
+      *port = d->peer_port;
+      return 0;
+    }
+
+  evcon = evhttp_request_get_connection(req);
+  if (!evcon)
+    return -1;
+
+  evhttp_connection_get_peer(evcon, address, &evport);
+  *port = evport;
+  return 0;
+}
+
 static int
 path_is_legal(const char *path)
 {
@@ -255,6 +449,100 @@ httpd_fixup_uri(struct evhttp_request *req)
 
 /* --------------------------- REQUEST HELPERS ------------------------------ */
 
+/* Parses a "bytes=start-end" Range header for a file of the given size. Either
+ * start or end may be left out ("bytes=500-" and "bytes=-500" for the last 500
+ * bytes). Of multiple ranges only the first is served, and invalid headers are
+ * ignored, as per RFC 7233.
+ *
+ * @out start    First byte of the range
+ * @out end      Last byte of the range (inclusive)
+ * @return       1 if the range should be served, 0 if the whole file should be
+ *               served (start and end are then set to that), -1 if the range
+ *               can't be satisfied (caller should reply 416)
+ */
+static int
+range_parse(struct evkeyvalq *input_headers, off_t size, int64_t *start, int64_t *end)
+{
+  const char *param;
+  const char *p;
+  char *endp;
+  long long first;
+  long long last;
+
+  *start = 0;
+  *end = size - 1;
+
+  param = evhttp_find_header(input_headers, "Range");
+  if (!param)
+    return 0;
+
+  DPRINTF(E_DBG, L_HTTPD, "Found Range header: %s\n", param);
+
+  if (strncasecmp(param, "bytes=", strlen("bytes=")) != 0)
+    goto invalid;
+
+  p = param + strlen("bytes=");
+  while (*p == ' ')
+    p++;
+
+  // Suffix range, i.e. the last n bytes
+  if (*p == '-')
+    {
+      errno = 0;
+      last = strtoll(p + 1, &endp, 10);
+      if ((errno != 0) || (endp == p + 1) || (last < 0))
+	goto invalid;
+
+      if ((last == 0) || (size <= 0))
+	return -1;
+
+      *start = (last < size) ? size - last : 0;
+      return 1;
+    }
+
+  errno = 0;
+  first = strtoll(p, &endp, 10);
+  if ((errno != 0) || (endp == p) || (first < 0) || (*endp != '-'))
+    goto invalid;
+
+  p = endp + 1;
+  last = -1;
+  if (*p != '\0' && *p != ',')
+    {
+      errno = 0;
+      last = strtoll(p, &endp, 10);
+      if ((errno != 0) || (endp == p) || (last < first))
+	goto invalid;
+    }
+
+  if (first >= size)
+    return -1;
+
+  *start = first;
+  if ((last >= 0) && (last < size))
+    *end = last;
+
+  return 1;
+
+ invalid:
+  DPRINTF(E_LOG, L_HTTPD, "Invalid Range header, will serve the whole file (%s)\n", param);
+  return 0;
+}
+
+static void
+range_not_satisfiable(struct evhttp_request *req, off_t size)
+{
+  struct evkeyvalq *output_headers;
+  char buf[64];
+
+  output_headers = evhttp_request_get_output_headers(req);
+
+  snprintf(buf, sizeof(buf), "bytes */%" PRIi64, (int64_t)size);
+  evhttp_add_header(output_headers, "Content-Range", buf);
+
+  evhttp_send_error(req, 416, "Range Not Satisfiable");
+}
+
 static void
 serve_file(struct evhttp_request *req, const char *uri)
 {
@@ -266,11 +554,14 @@ serve_file(struct evhttp_request *req, const char *uri)
   struct evkeyvalq *input_headers;
   struct evkeyvalq *output_headers;
   struct stat sb;
+  int64_t start;
+  int64_t end;
+  int range;
   int fd;
   int i;
-  uint8_t buf[4096];
   const char *modified_since;
   char last_modified[1000];
+  char crange[96];
   struct tm *tm_modified;
   int ret;
 
@@ -366,6 +657,13 @@ serve_file(struct evhttp_request *req, const char *uri)
       return;
     }
 
+  range = range_parse(input_headers, sb.st_size, &start, &end);
+  if (range < 0)
+    {
+      range_not_satisfiable(req, sb.st_size);
+      return;
+    }
+
   evbuf = evbuffer_new();
   if (!evbuf)
     {
@@ -385,21 +683,19 @@ serve_file(struct evhttp_request *req, const char *uri)
       return;
     }
 
-  ret = evbuffer_expand(evbuf, sb.st_size);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Out of memory for htdocs-file\n");
-      goto out_fail;
-    }
-
-  while ((ret = read(fd, buf, sizeof(buf))) > 0)
-    evbuffer_add(evbuf, buf, ret);
-
-  if (ret < 0)
+  // The evbuffer takes over the fd, and libevent will use sendfile or mmap to
+  // send the file, so it is neither read nor copied here
+  if (end >= start)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not read file into evbuffer\n");
-      goto out_fail;
+      ret = evbuffer_add_file(evbuf, fd, start, end - start + 1);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not add %s to evbuffer\n", path);
+	  goto out_fail;
+	}
     }
+  else
+    close(fd);
 
   ctype = "application/octet-stream";
   ext = strrchr(path, '.');
@@ -421,11 +717,19 @@ serve_file(struct evhttp_request *req, const char *uri)
   // Allow browsers to cache the file
   evhttp_add_header(output_headers, "Cache-Control", "private");
   evhttp_add_header(output_headers, "Last-Modified", last_modified);
+  evhttp_add_header(output_headers, "Accept-Ranges", "bytes");
+
+  if (range > 0)
+    {
+      snprintf(crange, sizeof(crange), "bytes %" PRIi64 "-%" PRIi64 "/%" PRIi64, start, end, (int64_t)sb.st_size);
+      evhttp_add_header(output_headers, "Content-Range", crange);
 
-  httpd_send_reply(req, HTTP_OK, "OK", evbuf, HTTPD_SEND_NO_GZIP);
+      httpd_send_reply(req, 206, "Partial Content", evbuf, HTTPD_SEND_NO_GZIP);
+    }
+  else
+    httpd_send_reply(req, HTTP_OK, "OK", evbuf, HTTPD_SEND_NO_GZIP);
 
   evbuffer_free(evbuf);
-  close(fd);
   return;
 
  out_fail:
@@ -435,179 +739,719 @@ serve_file(struct evhttp_request *req, const char *uri)
 }
 
 
-/* ---------------------------- STREAM HANDLING ----------------------------- */
-
-static void
-stream_end(struct stream_ctx *st, int failed)
-{
-  struct evhttp_connection *evcon;
+/* -------------------------- DECODED FILES CACHE --------------------------- */
 
-  evcon = evhttp_request_get_connection(st->req);
+/* Files that clients need decoded are written to the cache directory while
+ * they are streamed, named by file id, profile and mtime of the source file.
+ * When complete, the next request for them can be served like a raw file.
+ * Size is kept in check by the worker, which removes the least recently used.
+ */
 
-  if (evcon)
-    evhttp_connection_set_closecb(evcon, NULL, NULL);
+struct decode_cache_entry {
+  char *path;
+  off_t size;
+  time_t mtime;
+};
 
-  if (!failed)
-    evhttp_send_reply_end(st->req);
+static int
+decode_cache_entry_cmp(const void *a, const void *b)
+{
+  const struct decode_cache_entry *ea = a;
+  const struct decode_cache_entry *eb = b;
 
-  evbuffer_free(st->evbuf);
-  event_free(st->ev);
+  return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
 
-  if (st->xcode)
-    transcode_cleanup(&st->xcode);
-  else
-    {
-      free(st->buf);
-      close(st->fd);
-    }
+static int
+decode_cache_path(char *path, size_t len, int id, enum transcode_profile profile, uint32_t mtime)
+{
+  int ret;
 
-#ifdef HAVE_LIBEVENT2_OLD
-  if (g_st == st)
-    g_st = NULL;
-#endif
+  ret = snprintf(path, len, "%s/%d-%d-%" PRIu32 ".cache", decode_cache_dir, id, (int)profile, mtime);
+  if ((ret < 0) || (ret >= len))
+    return -1;
 
-  free(st);
+  return 0;
 }
 
+// Thread: worker
 static void
-stream_end_register(struct stream_ctx *st)
+decode_cache_evict_cb(void *arg)
 {
-  if (!st->marked
-      && (st->stream_size > ((st->size * 50) / 100))
-      && (st->offset > ((st->size * 80) / 100)))
+  struct decode_cache_entry *entries;
+  struct decode_cache_entry *tmp;
+  struct dirent *de;
+  struct stat sb;
+  DIR *dir;
+  char path[PATH_MAX];
+  int64_t total;
+  size_t len;
+  int nalloc;
+  int n;
+  int i;
+
+  dir = opendir(decode_cache_dir);
+  if (!dir)
     {
-      st->marked = 1;
-      worker_execute(playcount_inc_cb, &st->id, sizeof(int), 0);
-#ifdef LASTFM
-      worker_execute(scrobble_cb, &st->id, sizeof(int), 1);
-#endif
+      DPRINTF(E_LOG, L_HTTPD, "Could not open decode cache dir '%s': %s\n", decode_cache_dir, strerror(errno));
+      return;
     }
-}
-
-static void
-stream_chunk_resched_cb(struct evhttp_connection *evcon, void *arg)
-{
-  struct stream_ctx *st;
-  struct timeval tv;
-  int ret;
-
-  st = (struct stream_ctx *)arg;
 
-  evutil_timerclear(&tv);
-  ret = event_add(st->ev, &tv);
-  if (ret < 0)
+  entries = NULL;
+  nalloc = 0;
+  n = 0;
+  total = 0;
+  while ((de = readdir(dir)))
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming\n");
-
-      stream_end(st, 0);
-    }
-}
+      if (de->d_name[0] == '.')
+	continue;
 
-#ifdef HAVE_LIBEVENT2_OLD
-static void
-stream_chunk_resched_cb_wrapper(struct bufferevent *bufev, void *arg)
-{
-  if (g_st)
-    stream_chunk_resched_cb(NULL, g_st);
-}
-#endif
+      if (snprintf(path, sizeof(path), "%s/%s", decode_cache_dir, de->d_name) >= sizeof(path))
+	continue;
 
-static void
-stream_chunk_xcode_cb(int fd, short event, void *arg)
-{
-  struct stream_ctx *st;
-  struct timeval tv;
-  int xcoded;
-  int ret;
+      if ((stat(path, &sb) < 0) || !S_ISREG(sb.st_mode))
+	continue;
 
-  st = (struct stream_ctx *)arg;
+      // Files being written, or leftovers from streams that were interrupted
+      // by a shutdown
+      len = strlen(de->d_name);
+      if (len < 6 || strcmp(de->d_name + len - 6, ".cache") != 0)
+	{
+	  if (sb.st_mtime < time(NULL) - 24 * 3600)
+	    unlink(path);
+	  continue;
+	}
 
-  xcoded = transcode(st->evbuf, NULL, st->xcode, STREAM_CHUNK_SIZE);
-  if (xcoded <= 0)
-    {
-      if (xcoded == 0)
-	DPRINTF(E_INFO, L_HTTPD, "Done streaming transcoded file id %d\n", st->id);
-      else
-	DPRINTF(E_LOG, L_HTTPD, "Transcoding error, file id %d\n", st->id);
+      if (n == nalloc)
+	{
+	  nalloc = nalloc ? 2 * nalloc : 64;
+	  CHECK_NULL(L_HTTPD, tmp = realloc(entries, nalloc * sizeof(struct decode_cache_entry)));
+	  entries = tmp;
+	}
 
-      stream_end(st, 0);
-      return;
+      entries[n].path = strdup(path);
+      entries[n].size = sb.st_size;
+      entries[n].mtime = sb.st_mtime;
+      total += sb.st_size;
+      n++;
     }
 
-  DPRINTF(E_DBG, L_HTTPD, "Got %d bytes from transcode; streaming file id %d\n", xcoded, st->id);
+  closedir(dir);
 
-  /* Consume transcoded data until we meet start_offset */
-  if (st->start_offset > st->offset)
+  if (total > decode_cache_max)
     {
-      ret = st->start_offset - st->offset;
-
-      if (ret < xcoded)
-	{
-	  evbuffer_drain(st->evbuf, ret);
-	  st->offset += ret;
+      qsort(entries, n, sizeof(struct decode_cache_entry), decode_cache_entry_cmp);
 
-	  ret = xcoded - ret;
-	}
-      else
+      for (i = 0; (i < n) && (total > decode_cache_max); i++)
 	{
-	  evbuffer_drain(st->evbuf, xcoded);
-	  st->offset += xcoded;
+	  DPRINTF(E_DBG, L_HTTPD, "Removing '%s' from decode cache\n", entries[i].path);
 
-	  goto consume;
+	  if (unlink(entries[i].path) == 0)
+	    total -= entries[i].size;
 	}
     }
-  else
-    ret = xcoded;
 
-#ifdef HAVE_LIBEVENT2_OLD
-  evhttp_send_reply_chunk(st->req, st->evbuf);
+  DPRINTF(E_DBG, L_HTTPD, "Decode cache has %d files, %" PRIi64 " MB\n", n, total / (1024 * 1024));
 
-  struct evhttp_connection *evcon = evhttp_request_get_connection(st->req);
-  struct bufferevent *bufev = evhttp_connection_get_bufferevent(evcon);
+  for (i = 0; i < n; i++)
+    free(entries[i].path);
+  free(entries);
+}
 
-  g_st = st; // Can't pass st to callback so use global - limits libevent 2.0 to a single stream
-  bufev->writecb = stream_chunk_resched_cb_wrapper;
-#else
-  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_chunk_resched_cb, st);
-#endif
+/* Returns an fd for the cached decoded file, and marks the file as used. If
+ * not cached, -1 is returned.
+ */
+static int
+decode_cache_open(int id, enum transcode_profile profile, uint32_t mtime, off_t *size)
+{
+  char path[PATH_MAX];
+  struct stat sb;
+  int fd;
 
-  st->offset += ret;
+  if (decode_cache_max == 0)
+    return -1;
 
-  stream_end_register(st);
+  if (decode_cache_path(path, sizeof(path), id, profile, mtime) < 0)
+    return -1;
 
-  return;
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
 
- consume: /* reschedule immediately - consume up to start_offset */
-  evutil_timerclear(&tv);
-  ret = event_add(st->ev, &tv);
-  if (ret < 0)
+  if (fstat(fd, &sb) < 0)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming (xcode)\n");
-
-      stream_end(st, 0);
-      return;
+      close(fd);
+      return -1;
     }
+
+  futimens(fd, NULL);
+
+  *size = sb.st_size;
+  return fd;
 }
 
+/* Starts writing the decoded output of the stream to a temporary file, which
+ * decode_cache_commit() will move into place when complete
+ */
 static void
-stream_chunk_raw_cb(int fd, short event, void *arg)
+decode_cache_create(struct stream_ctx *st, int id, enum transcode_profile profile, uint32_t mtime)
 {
-  struct stream_ctx *st;
-  size_t chunk_size;
+  char path[PATH_MAX];
   int ret;
 
-  st = (struct stream_ctx *)arg;
+  if (decode_cache_max == 0)
+    return;
+
+  ret = decode_cache_path(path, sizeof(path), id, profile, mtime);
+  if ((ret < 0) || (strlen(path) + strlen(".XXXXXX") >= sizeof(path)))
+    return;
+
+  strcat(path, ".XXXXXX");
+
+  st->cache_fd = mkstemp(path);
+  if (st->cache_fd < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not create decode cache file '%s': %s\n", path, strerror(errno));
+      return;
+    }
+
+  st->cache_tmp = strdup(path);
+  st->profile = profile;
+}
+
+static void
+decode_cache_abort(struct stream_ctx *st)
+{
+  if (st->cache_fd < 0)
+    return;
+
+  close(st->cache_fd);
+  unlink(st->cache_tmp);
+  free(st->cache_tmp);
+
+  st->cache_fd = -1;
+  st->cache_tmp = NULL;
+}
+
+static void
+decode_cache_write(struct stream_ctx *st, struct evbuffer *evbuf)
+{
+  struct evbuffer_iovec *iovec;
+  ssize_t written;
+  int n;
+  int i;
+
+  if (st->cache_fd < 0)
+    return;
+
+  n = evbuffer_peek(evbuf, -1, NULL, NULL, 0);
+  if (n <= 0)
+    return;
+
+  CHECK_NULL(L_HTTPD, iovec = malloc(n * sizeof(struct evbuffer_iovec)));
+
+  n = evbuffer_peek(evbuf, -1, NULL, iovec, n);
+  for (i = 0; i < n; i++)
+    {
+      written = write(st->cache_fd, iovec[i].iov_base, iovec[i].iov_len);
+      if (written != iovec[i].iov_len)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not write to decode cache file '%s': %s\n", st->cache_tmp, strerror(errno));
+	  decode_cache_abort(st);
+	  break;
+	}
+    }
+
+  free(iovec);
+}
+
+static void
+decode_cache_le32_write(int fd, uint32_t val, off_t offset)
+{
+  uint8_t le32[4];
+
+  le32[0] = val & 0xff;
+  le32[1] = (val >> 8) & 0xff;
+  le32[2] = (val >> 16) & 0xff;
+  le32[3] = (val >> 24) & 0xff;
+
+  if (pwrite(fd, le32, sizeof(le32), offset) != sizeof(le32))
+    DPRINTF(E_LOG, L_HTTPD, "Could not update wav header in decode cache file: %s\n", strerror(errno));
+}
+
+static void
+decode_cache_commit(struct stream_ctx *st)
+{
+  char *path;
+  off_t size;
+  int ret;
+
+  if (st->cache_fd < 0)
+    return;
+
+  // The wav header has the size that transcode estimated, now we know it
+  size = lseek(st->cache_fd, 0, SEEK_END);
+  if ((st->profile == XCODE_PCM16_HEADER) && (size > 44) && (size < UINT32_MAX))
+    {
+      decode_cache_le32_write(st->cache_fd, size - 8, 4);   // RIFF chunk size
+      decode_cache_le32_write(st->cache_fd, size - 44, 40); // data chunk size
+    }
+
+  close(st->cache_fd);
+  st->cache_fd = -1;
+
+  // Strip the mkstemp suffix to get the final name
+  path = strdup(st->cache_tmp);
+  *strrchr(path, '.') = '\0';
+
+  ret = rename(st->cache_tmp, path);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not move decode cache file to '%s': %s\n", path, strerror(errno));
+      unlink(st->cache_tmp);
+    }
+  else
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Added '%s' to decode cache (%" PRIi64 " bytes)\n", path, (int64_t)size);
+      worker_execute(decode_cache_evict_cb, NULL, 0, 0, WORKER_PRIO_NORMAL);
+    }
+
+  free(path);
+  free(st->cache_tmp);
+  st->cache_tmp = NULL;
+}
+
+static void
+decode_cache_init(void)
+{
+  cfg_t *lib;
+  int ret;
+
+  lib = cfg_getsec(cfg, "library");
+
+  decode_cache_max = (int64_t)cfg_getint(lib, "decode_cache_size") * 1024 * 1024;
+  decode_cache_dir = cfg_getstr(lib, "decode_cache_dir");
+  if (decode_cache_max <= 0 || !decode_cache_dir)
+    {
+      decode_cache_max = 0;
+      return;
+    }
+
+  ret = mkdir(decode_cache_dir, 0700);
+  if ((ret < 0) && (errno != EEXIST))
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not create decode cache dir '%s', disabling cache: %s\n", decode_cache_dir, strerror(errno));
+      decode_cache_max = 0;
+      return;
+    }
+
+  DPRINTF(E_INFO, L_HTTPD, "Caching up to %" PRIi64 " MB of decoded files in '%s'\n", decode_cache_max / (1024 * 1024), decode_cache_dir);
+
+  worker_execute(decode_cache_evict_cb, NULL, 0, 0, WORKER_PRIO_NORMAL);
+}
+
+/* ------------------------- STREAM TRANSCODE POOL -------------------------- */
+
+/* Transcoding streams is done by a pool of threads, so that it doesn't hold up
+ * the httpd thread. Each stream has at most one chunk being made ahead of what
+ * the httpd thread is sending, and the streams take turns, so the pool size is
+ * the max number of concurrent transcodes.
+ */
+
+/* Thread: xcode */
+static void *
+xcode_thread(void *arg)
+{
+  struct stream_ctx *st;
+  struct evbuffer *evbuf;
+  int ret;
+
+  CHECK_NULL(L_HTTPD, evbuf = evbuffer_new());
+
+  for (;;)
+    {
+      CHECK_ERR(L_HTTPD, pthread_mutex_lock(&xcode_lck));
+
+      while (!xcode_queue && !xcode_exit)
+	CHECK_ERR(L_HTTPD, pthread_cond_wait(&xcode_cond, &xcode_lck));
+
+      if (xcode_exit)
+	{
+	  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&xcode_lck));
+	  break;
+	}
+
+      st = xcode_queue;
+      xcode_queue = st->xcode_next;
+      if (!xcode_queue)
+	xcode_queue_tail = NULL;
+
+      // stream_end() was called while queued, so we just wake the httpd thread
+      // so it can free the stream
+      if (st->xcode_ended)
+	{
+	  st->xcode_busy = false;
+	  event_active(st->ev, 0, 0);
+	  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&xcode_lck));
+	  continue;
+	}
+
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&xcode_lck));
+
+      // The stream is ours until xcode_busy is cleared
+      ret = transcode(evbuf, NULL, st->xcode, STREAM_CHUNK_SIZE);
+      if (ret > 0)
+	decode_cache_write(st, evbuf);
+
+      CHECK_ERR(L_HTTPD, pthread_mutex_lock(&xcode_lck));
+
+      evbuffer_add_buffer(st->xcode_out, evbuf);
+      st->xcode_ret = ret;
+      st->xcode_done = (ret <= 0);
+      st->xcode_busy = false;
+
+      // Under the lock, since the httpd thread may free st as soon as it sees
+      // that we are done with it
+      event_active(st->ev, 0, 0);
+
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&xcode_lck));
+    }
+
+  evbuffer_free(evbuf);
+
+  pthread_exit(NULL);
+}
+
+/* Thread: httpd. Must be called with xcode_lck held. */
+static void
+xcode_enqueue(struct stream_ctx *st)
+{
+  st->xcode_busy = true;
+  st->xcode_next = NULL;
+
+  if (xcode_queue_tail)
+    xcode_queue_tail->xcode_next = st;
+  else
+    xcode_queue = st;
+  xcode_queue_tail = st;
+
+  CHECK_ERR(L_HTTPD, pthread_cond_signal(&xcode_cond));
+}
+
+static int
+xcode_pool_init(int nthreads)
+{
+  int ret;
+  int i;
+
+  xcode_pool_size = 0;
+  if (nthreads <= 0)
+    return 0;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_init(&xcode_lck, NULL));
+  CHECK_ERR(L_HTTPD, pthread_cond_init(&xcode_cond, NULL));
 
-  if (st->end_offset && (st->offset > st->end_offset))
+  CHECK_NULL(L_HTTPD, tid_xcode = calloc(nthreads, sizeof(pthread_t)));
+
+  xcode_exit = false;
+  for (i = 0; i < nthreads; i++)
+    {
+      ret = pthread_create(&tid_xcode[i], NULL, xcode_thread, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not spawn httpd transcode thread: %s\n", strerror(ret));
+	  break;
+	}
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(tid_xcode[i], "httpd_xcode");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(tid_xcode[i], "httpd_xcode");
+#endif
+    }
+
+  // Could be that we got fewer than we asked for, that's ok
+  xcode_pool_size = i;
+
+  DPRINTF(E_DBG, L_HTTPD, "Started %d httpd transcode threads\n", xcode_pool_size);
+
+  return 0;
+}
+
+/* Thread: main (after the httpd thread has stopped) */
+static void
+xcode_pool_deinit(void)
+{
+  int i;
+
+  if (!tid_xcode)
+    return;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&xcode_lck));
+  xcode_exit = true;
+  CHECK_ERR(L_HTTPD, pthread_cond_broadcast(&xcode_cond));
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&xcode_lck));
+
+  for (i = 0; i < xcode_pool_size; i++)
+    pthread_join(tid_xcode[i], NULL);
+
+  xcode_queue = NULL;
+  xcode_queue_tail = NULL;
+
+  free(tid_xcode);
+  tid_xcode = NULL;
+  xcode_pool_size = 0;
+
+  CHECK_ERR(L_HTTPD, pthread_cond_destroy(&xcode_cond));
+  CHECK_ERR(L_HTTPD, pthread_mutex_destroy(&xcode_lck));
+}
+
+
+/* ---------------------------- STREAM HANDLING ----------------------------- */
+
+static void
+stream_free(struct stream_ctx *st)
+{
+  if (st->xcode_out)
+    evbuffer_free(st->xcode_out);
+  evbuffer_free(st->evbuf);
+  event_free(st->ev);
+
+  // Incomplete, e.g. because the client went away
+  decode_cache_abort(st);
+
+  if (st->xcode)
+    transcode_cleanup(&st->xcode);
+#ifndef HAVE_LIBEVENT2_OLD
+  else if (st->seg)
+    evbuffer_file_segment_free(st->seg); // Closes st->fd when no longer in use
+#endif
+  else
+    {
+      free(st->buf);
+      close(st->fd);
+    }
+
+#ifdef HAVE_LIBEVENT2_OLD
+  if (g_st == st)
+    g_st = NULL;
+#endif
+
+  free(st);
+}
+
+static void
+stream_end(struct stream_ctx *st, int failed)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(st->req);
+
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  if (!failed)
+    evhttp_send_reply_end(st->req);
+
+  // If a transcode thread is working on the stream, it will wake us when done,
+  // and then stream_chunk_xcode_cb() frees the stream
+  if (st->xcode_out)
     {
+      CHECK_ERR(L_HTTPD, pthread_mutex_lock(&xcode_lck));
+      st->xcode_ended = st->xcode_busy;
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&xcode_lck));
+
+      if (st->xcode_ended)
+	return;
+    }
+
+  stream_free(st);
+}
+
+static void
+stream_end_register(struct stream_ctx *st)
+{
+  if (!st->marked
+      && (st->stream_size > ((st->size * 50) / 100))
+      && (st->offset > ((st->size * 80) / 100)))
+    {
+      st->marked = 1;
+      worker_execute(playcount_inc_cb, &st->id, sizeof(int), 0, WORKER_PRIO_NORMAL);
+#ifdef LASTFM
+      worker_execute(scrobble_cb, &st->id, sizeof(int), 1, WORKER_PRIO_BACKGROUND);
+#endif
+    }
+}
+
+static void
+stream_chunk_resched_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct stream_ctx *st;
+  struct timeval tv;
+  int ret;
+
+  st = (struct stream_ctx *)arg;
+
+  evutil_timerclear(&tv);
+  ret = event_add(st->ev, &tv);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming\n");
+
+      stream_end(st, 0);
+    }
+}
+
+#ifdef HAVE_LIBEVENT2_OLD
+static void
+stream_chunk_resched_cb_wrapper(struct bufferevent *bufev, void *arg)
+{
+  if (g_st)
+    stream_chunk_resched_cb(NULL, g_st);
+}
+#endif
+
+static void
+stream_chunk_xcode_cb(int fd, short event, void *arg)
+{
+  struct stream_ctx *st;
+  struct timeval tv;
+  bool busy;
+  bool done;
+  int xcoded;
+  int ret;
+
+  st = (struct stream_ctx *)arg;
+
+  if (st->xcode_out)
+    {
+      CHECK_ERR(L_HTTPD, pthread_mutex_lock(&xcode_lck));
+
+      if (st->xcode_ended)
+	{
+	  busy = st->xcode_busy;
+	  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&xcode_lck));
+	  if (!busy)
+	    stream_free(st);
+	  return;
+	}
+
+      evbuffer_add_buffer(st->evbuf, st->xcode_out);
+      xcoded = evbuffer_get_length(st->evbuf);
+      done = st->xcode_done;
+      if (xcoded == 0 && done)
+	xcoded = st->xcode_ret;
+
+      // Start on the next chunk while this one is sent
+      if (!st->xcode_busy && !done)
+	xcode_enqueue(st);
+
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&xcode_lck));
+
+      // The pool wakes us when it has something
+      if (xcoded == 0 && !done)
+	return;
+    }
+  else
+    {
+      xcoded = transcode(st->evbuf, NULL, st->xcode, STREAM_CHUNK_SIZE);
+      if (xcoded > 0)
+	decode_cache_write(st, st->evbuf);
+    }
+
+  if (xcoded <= 0)
+    {
+      if (xcoded == 0)
+	{
+	  DPRINTF(E_INFO, L_HTTPD, "Done streaming transcoded file id %d\n", st->id);
+	  decode_cache_commit(st);
+	}
+      else
+	DPRINTF(E_LOG, L_HTTPD, "Transcoding error, file id %d\n", st->id);
+
+      stream_end(st, 0);
+      return;
+    }
+
+  DPRINTF(E_DBG, L_HTTPD, "Got %d bytes from transcode; streaming file id %d\n", xcoded, st->id);
+
+  // The cache was given what is skipped to get to start_offset as well, since
+  // it needs it all
+  /* Consume transcoded data until we meet start_offset */
+  if (st->start_offset > st->offset)
+    {
+      ret = st->start_offset - st->offset;
+
+      if (ret < xcoded)
+	{
+	  evbuffer_drain(st->evbuf, ret);
+	  st->offset += ret;
+
+	  ret = xcoded - ret;
+	}
+      else
+	{
+	  evbuffer_drain(st->evbuf, xcoded);
+	  st->offset += xcoded;
+
+	  goto consume;
+	}
+    }
+  else
+    ret = xcoded;
+
+#ifdef HAVE_LIBEVENT2_OLD
+  evhttp_send_reply_chunk(st->req, st->evbuf);
+
+  struct evhttp_connection *evcon = evhttp_request_get_connection(st->req);
+  struct bufferevent *bufev = evhttp_connection_get_bufferevent(evcon);
+
+  g_st = st; // Can't pass st to callback so use global - limits libevent 2.0 to a single stream
+  bufev->writecb = stream_chunk_resched_cb_wrapper;
+#else
+  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_chunk_resched_cb, st);
+#endif
+
+  st->offset += ret;
+
+  stream_end_register(st);
+
+  return;
+
+ consume: /* reschedule immediately - consume up to start_offset */
+  evutil_timerclear(&tv);
+  ret = event_add(st->ev, &tv);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming (xcode)\n");
+
+      stream_end(st, 0);
+      return;
+    }
+}
+
+static void
+stream_chunk_raw_cb(int fd, short event, void *arg)
+{
+  struct stream_ctx *st;
+  size_t chunk_size;
+  int ret;
+
+  st = (struct stream_ctx *)arg;
+
+  if (st->offset > st->end_offset)
+    {
+      DPRINTF(E_INFO, L_HTTPD, "Done streaming file id %d\n", st->id);
+
       stream_end(st, 0);
       return;
     }
 
-  if (st->end_offset && ((st->offset + STREAM_CHUNK_SIZE) > (st->end_offset + 1)))
+#ifdef HAVE_LIBEVENT2_OLD
+  if ((st->offset + STREAM_CHUNK_SIZE) > (st->end_offset + 1))
     chunk_size = st->end_offset + 1 - st->offset;
   else
-    chunk_size = STREAM_CHUNK_SIZE;  
+    chunk_size = STREAM_CHUNK_SIZE;
 
   ret = read(st->fd, st->buf, chunk_size);
   if (ret <= 0)
@@ -624,71 +1468,460 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
   DPRINTF(E_DBG, L_HTTPD, "Read %d bytes; streaming file id %d\n", ret, st->id);
 
   evbuffer_add(st->evbuf, st->buf, ret);
+#else
+  if ((st->offset + STREAM_FILE_CHUNK_SIZE) > (st->end_offset + 1))
+    chunk_size = st->end_offset + 1 - st->offset;
+  else
+    chunk_size = STREAM_FILE_CHUNK_SIZE;
+
+  // Only adds a reference to the file segment, the data is sent with sendfile
+  // (or from a mmap) when the connection is ready for it
+  ret = evbuffer_add_file_segment(st->evbuf, st->seg, st->offset, chunk_size);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Streaming error, file id %d\n", st->id);
+
+      stream_end(st, 0);
+      return;
+    }
+
+  ret = chunk_size;
+
+  DPRINTF(E_DBG, L_HTTPD, "Queued %d bytes; streaming file id %d\n", ret, st->id);
+#endif
+
+#ifdef HAVE_LIBEVENT2_OLD
+  evhttp_send_reply_chunk(st->req, st->evbuf);
+
+  struct evhttp_connection *evcon = evhttp_request_get_connection(st->req);
+  struct bufferevent *bufev = evhttp_connection_get_bufferevent(evcon);
+
+  g_st = st; // Can't pass st to callback so use global - limits libevent 2.0 to a single stream
+  bufev->writecb = stream_chunk_resched_cb_wrapper;
+#else
+  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_chunk_resched_cb, st);
+#endif
+
+  st->offset += ret;
+
+  stream_end_register(st);
+}
+
+static void
+stream_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct stream_ctx *st;
+
+  st = (struct stream_ctx *)arg;
+
+  DPRINTF(E_WARN, L_HTTPD, "Connection failed; stopping streaming of file ID %d\n", st->id);
+
+  /* Stop streaming */
+  event_del(st->ev);
+
+  stream_end(st, 1);
+}
+
+
+/* ---------------------------- MAIN HTTPD THREAD --------------------------- */
+
+static void *
+httpd(void *arg)
+{
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Error: DB init failed\n");
+
+      pthread_exit(NULL);
+    }
+
+  event_base_dispatch(evbase_httpd);
+
+  if (!httpd_exit)
+    DPRINTF(E_FATAL, L_HTTPD, "HTTPd event loop terminated ahead of time!\n");
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+static void
+exit_cb(int fd, short event, void *arg)
+{
+  event_base_loopbreak(evbase_httpd);
+
+  httpd_exit = 1;
+}
+
+/* ------------------------------- HTTPD POOL ------------------------------- */
+/*
+ * Requests that can take a while, but don't need the httpd event loop (library
+ * queries, artwork and static files), are handled by a pool of threads, so
+ * that they don't hold up e.g. DACP commands from remotes. The connections
+ * stay with the httpd thread, which also sends the replies, since evhttp is
+ * not thread safe. Long-lived requests (streaming and the DAAP/DACP update
+ * long polls) always stay in the httpd thread.
+ */
+
+static void
+request_dispatch(struct evhttp_request *req, struct httpd_uri_parsed *parsed);
+
+/* Thread: httpd */
+static enum command_state
+deferred_reply_send(void *arg, int *retval)
+{
+  struct httpd_deferred_reply *r = arg;
+
+  if (r->is_error)
+    evhttp_send_error(r->req, r->code, r->reason);
+  else
+    evhttp_send_reply(r->req, r->code, r->reason, r->evbuf);
+
+  evbuffer_free(r->evbuf);
+  free(r->reason);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+/* Thread: any. If the request is being handled by the current pool thread
+ * then the reply is passed to the httpd thread, otherwise sent right away.
+ */
+static void
+reply_send(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf, bool is_error)
+{
+  struct httpd_deferred_reply *r;
+  struct httpd_deferred *d;
+
+  d = pool_size ? pthread_getspecific(pool_current) : NULL;
+  if (!d || d->req != req)
+    {
+      if (is_error)
+	evhttp_send_error(req, code, reason);
+      else
+	evhttp_send_reply(req, code, reason, evbuf);
+      return;
+    }
+
+  CHECK_NULL(L_HTTPD, r = calloc(1, sizeof(struct httpd_deferred_reply)));
+  CHECK_NULL(L_HTTPD, r->evbuf = evbuffer_new());
+
+  r->req = req;
+  r->code = code;
+  r->reason = safe_strdup(reason);
+  r->is_error = is_error;
+
+  // Like evhttp_send_reply, this leaves the caller's buffer drained
+  if (evbuf)
+    evbuffer_add_buffer(r->evbuf, evbuf);
+
+  d->replied = true;
+
+  commands_exec_async(httpd_cmdbase, deferred_reply_send, r);
+}
+
+bool
+httpd_request_is_deferred(struct evhttp_request *req)
+{
+  struct httpd_deferred *d;
+
+  d = pool_size ? pthread_getspecific(pool_current) : NULL;
+
+  return (d && d->req == req);
+}
+
+static void
+deferred_free(struct httpd_deferred *d)
+{
+  httpd_uri_free(d->parsed);
+  if (d->body)
+    evbuffer_free(d->body);
+  free(d->reason);
+  free(d->peer_address);
+  free(d);
+}
+
+/* Thread: pool */
+static void
+deferred_gzip_send(struct httpd_deferred *d)
+{
+  struct evkeyvalq *output_headers;
+  struct evbuffer *gzbuf;
+
+  gzbuf = httpd_gzip_deflate(d->body);
+  if (!gzbuf)
+    {
+      reply_send(d->req, d->code, d->reason, d->body, false);
+      return;
+    }
+
+  output_headers = evhttp_request_get_output_headers(d->req);
+  evhttp_add_header(output_headers, "Content-Encoding", "gzip");
+
+  reply_send(d->req, d->code, d->reason, gzbuf, false);
+
+  evbuffer_free(gzbuf);
+}
+
+/* Thread: httpd */
+static bool
+request_is_deferrable(struct evhttp_request *req, struct httpd_uri_parsed *parsed)
+{
+  const char *last;
+
+  if (pool_size == 0)
+    return false;
+
+  // Library queries and artwork, but not /databases/1/items/2.mp3 which is a
+  // stream, or login, update and the like, which change the DAAP sessions
+  if (daap_is_request(parsed->path))
+    {
+      if (strncmp(parsed->path, "/databases", strlen("/databases")) != 0)
+	return false;
+
+      last = strrchr(parsed->path, '/');
+      return !(last && strchr(last, '.'));
+    }
+
+  if (rsp_is_request(parsed->path))
+    return (strncmp(parsed->path, "/rsp/stream/", strlen("/rsp/stream/")) != 0);
+
+  if (jsonapi_is_request(parsed->path))
+    return (evhttp_request_get_command(req) == EVHTTP_REQ_GET) &&
+           ((strncmp(parsed->path, "/api/library", strlen("/api/library")) == 0) ||
+            (strncmp(parsed->path, "/api/search", strlen("/api/search")) == 0));
+
+  if (dacp_is_request(parsed->path) || streaming_is_request(parsed->path) || oauth_is_request(parsed->path))
+    return false;
+
+  // Web interface files
+  return true;
+}
+
+static void
+pool_enqueue(struct httpd_deferred *d)
+{
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&pool_lck));
+
+  if (pool_queue_tail)
+    pool_queue_tail->next = d;
+  else
+    pool_queue = d;
+  pool_queue_tail = d;
 
-#ifdef HAVE_LIBEVENT2_OLD
-  evhttp_send_reply_chunk(st->req, st->evbuf);
+  CHECK_ERR(L_HTTPD, pthread_cond_signal(&pool_cond));
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&pool_lck));
+}
 
-  struct evhttp_connection *evcon = evhttp_request_get_connection(st->req);
-  struct bufferevent *bufev = evhttp_connection_get_bufferevent(evcon);
+/* Thread: httpd */
+static void
+request_defer(struct evhttp_request *req, struct httpd_uri_parsed *parsed)
+{
+  struct httpd_deferred *d;
+  char *addr;
+  unsigned short port;
 
-  g_st = st; // Can't pass st to callback so use global - limits libevent 2.0 to a single stream
-  bufev->writecb = stream_chunk_resched_cb_wrapper;
-#else
-  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_chunk_resched_cb, st);
-#endif
+  CHECK_NULL(L_HTTPD, d = calloc(1, sizeof(struct httpd_deferred)));
 
-  st->offset += ret;
+  d->req = req;
+  d->parsed = parsed;
+  if (peer_get(req, &addr, &port) == 0)
+    {
+      d->peer_address = safe_strdup(addr);
+      d->peer_port = port;
+    }
 
-  stream_end_register(st);
+  pool_enqueue(d);
 }
 
-static void
-stream_fail_cb(struct evhttp_connection *evcon, void *arg)
+/* Thread: any. Large replies from the httpd thread are gzipped by the pool, so
+ * that the httpd thread can get on with other requests. Returns false if the
+ * caller should gzip the reply itself.
+ */
+static bool
+reply_gzip_defer(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf)
 {
-  struct stream_ctx *st;
+  struct httpd_deferred *d;
 
-  st = (struct stream_ctx *)arg;
+  if (pool_size == 0 || evbuffer_get_length(evbuf) < GZIP_POOL_SIZE || !pthread_equal(pthread_self(), tid_httpd))
+    return false;
 
-  DPRINTF(E_WARN, L_HTTPD, "Connection failed; stopping streaming of file ID %d\n", st->id);
+  CHECK_NULL(L_HTTPD, d = calloc(1, sizeof(struct httpd_deferred)));
+  CHECK_NULL(L_HTTPD, d->body = evbuffer_new());
 
-  /* Stop streaming */
-  event_del(st->ev);
+  d->req = req;
+  d->code = code;
+  d->reason = safe_strdup(reason);
 
-  stream_end(st, 1);
-}
+  // Like evhttp_send_reply, this leaves the caller's buffer drained
+  evbuffer_add_buffer(d->body, evbuf);
 
+  pool_enqueue(d);
 
-/* ---------------------------- MAIN HTTPD THREAD --------------------------- */
+  return true;
+}
 
 static void *
-httpd(void *arg)
+pool_thread(void *arg)
 {
+  struct httpd_deferred *d;
   int ret;
 
   ret = db_perthread_init();
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Error: DB init failed\n");
+      DPRINTF(E_LOG, L_HTTPD, "Error: DB init failed (httpd pool)\n");
 
       pthread_exit(NULL);
     }
 
-  event_base_dispatch(evbase_httpd);
+  for (;;)
+    {
+      CHECK_ERR(L_HTTPD, pthread_mutex_lock(&pool_lck));
 
-  if (!httpd_exit)
-    DPRINTF(E_FATAL, L_HTTPD, "HTTPd event loop terminated ahead of time!\n");
+      while (!pool_queue && !pool_exit)
+	CHECK_ERR(L_HTTPD, pthread_cond_wait(&pool_cond, &pool_lck));
+
+      if (pool_exit)
+	{
+	  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&pool_lck));
+	  break;
+	}
+
+      d = pool_queue;
+      pool_queue = d->next;
+      if (!pool_queue)
+	pool_queue_tail = NULL;
+
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&pool_lck));
+
+      pthread_setspecific(pool_current, d);
+
+      if (d->body)
+	deferred_gzip_send(d);
+      else
+	request_dispatch(d->req, d->parsed);
+
+      if (!d->replied)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Bug! No reply to deferred request '%s'\n", d->parsed ? d->parsed->uri : "(gzip)");
+	  reply_send(d->req, HTTP_INTERNAL, "Internal Server Error", NULL, true);
+	}
+
+      pthread_setspecific(pool_current, NULL);
+
+      deferred_free(d);
+    }
 
   db_perthread_deinit();
 
   pthread_exit(NULL);
 }
 
+static int
+pool_init(int nthreads)
+{
+  int ret;
+  int i;
+
+  pool_size = 0;
+  if (nthreads <= 0)
+    return 0;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_init(&pool_lck, NULL));
+  CHECK_ERR(L_HTTPD, pthread_cond_init(&pool_cond, NULL));
+  CHECK_ERR(L_HTTPD, pthread_key_create(&pool_current, NULL));
+
+  httpd_cmdbase = commands_base_new(evbase_httpd, NULL);
+  commands_base_metrics(httpd_cmdbase, "httpd");
+
+  CHECK_NULL(L_HTTPD, tid_pool = calloc(nthreads, sizeof(pthread_t)));
+
+  pool_exit = false;
+  for (i = 0; i < nthreads; i++)
+    {
+      ret = pthread_create(&tid_pool[i], NULL, pool_thread, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not spawn httpd pool thread: %s\n", strerror(ret));
+	  break;
+	}
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(tid_pool[i], "httpd_pool");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(tid_pool[i], "httpd_pool");
+#endif
+    }
+
+  // Could be that we got fewer than we asked for, that's ok
+  pool_size = i;
+
+  DPRINTF(E_DBG, L_HTTPD, "Started %d httpd pool threads\n", pool_size);
+
+  return 0;
+}
+
+/* Thread: main (after the httpd thread has stopped) */
 static void
-exit_cb(int fd, short event, void *arg)
+pool_deinit(void)
 {
-  event_base_loopbreak(evbase_httpd);
+  struct httpd_deferred *d;
+  int i;
 
-  httpd_exit = 1;
+  if (!tid_pool)
+    return;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&pool_lck));
+  pool_exit = true;
+  CHECK_ERR(L_HTTPD, pthread_cond_broadcast(&pool_cond));
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&pool_lck));
+
+  for (i = 0; i < pool_size; i++)
+    pthread_join(tid_pool[i], NULL);
+
+  // Requests that never got to a thread
+  while ((d = pool_queue))
+    {
+      pool_queue = d->next;
+      deferred_free(d);
+    }
+  pool_queue_tail = NULL;
+
+  commands_base_free(httpd_cmdbase);
+  httpd_cmdbase = NULL;
+
+  free(tid_pool);
+  tid_pool = NULL;
+  pool_size = 0;
+
+  pthread_key_delete(pool_current);
+  CHECK_ERR(L_HTTPD, pthread_cond_destroy(&pool_cond));
+  CHECK_ERR(L_HTTPD, pthread_mutex_destroy(&pool_lck));
+}
+
+static void
+request_record(struct evhttp_request *req, const char *uri)
+{
+  struct evkeyvalq *input_headers;
+  char session[64];
+  char *address;
+  unsigned short port;
+
+  if (peer_get(req, &address, &port) < 0)
+    return;
+
+  snprintf(session, sizeof(session), "%s:%u", address, port);
+
+  input_headers = evhttp_request_get_input_headers(req);
+  reqlog_http(session, method_name(evhttp_request_get_command(req)), uri,
+	      evhttp_find_header(input_headers, "User-Agent"),
+	      evhttp_find_header(input_headers, "Client-DAAP-Version"),
+	      evhttp_find_header(input_headers, "Accept-Encoding"),
+	      evhttp_request_get_input_buffer(req));
 }
 
 static void
@@ -735,48 +1968,156 @@ httpd_gen_cb(struct evhttp_request *req, void *arg)
   if (!parsed || !parsed->path || (strcmp(parsed->path, "/") == 0))
     {
       httpd_redirect_to_admin(req);
-      goto out;
+      httpd_uri_free(parsed);
+      return;
+    }
+
+  if (reqlog_enabled())
+    request_record(req, uri);
+
+  // The pool frees parsed when done
+  if (request_is_deferrable(req, parsed))
+    {
+      request_defer(req, parsed);
+      return;
+    }
+
+  request_dispatch(req, parsed);
+
+  httpd_uri_free(parsed);
+}
+
+static void
+metrics_request(struct evhttp_request *req)
+{
+  struct evkeyvalq *output_headers;
+  struct evbuffer *evbuf;
+
+  if (!metrics_enabled())
+    {
+      httpd_send_error(req, HTTP_NOTFOUND, "Not Found");
+      return;
+    }
+
+  if (!httpd_admin_check_auth(req))
+    return;
+
+  CHECK_NULL(L_HTTPD, evbuf = evbuffer_new());
+
+  metrics_render(evbuf);
+
+  output_headers = evhttp_request_get_output_headers(req);
+  evhttp_add_header(output_headers, "Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+  evhttp_add_header(output_headers, "Cache-Control", "no-cache");
+
+  httpd_send_reply(req, HTTP_OK, "OK", evbuf, 0);
+
+  evbuffer_free(evbuf);
+}
+
+/* The server listens before the player, library etc. have started, so the
+ * handlers that use them are told to come back. The web interface itself can
+ * be loaded, and gets a "starting" state from the JSON API.
+ */
+static bool
+starting_reply(struct evhttp_request *req, struct httpd_uri_parsed *parsed)
+{
+  struct evkeyvalq *headers;
+  struct evbuffer *evbuf;
+
+  if (__atomic_load_n(&httpd_is_ready, __ATOMIC_ACQUIRE))
+    return false;
+
+  if (!dacp_is_request(parsed->path) && !daap_is_request(parsed->path) && !jsonapi_is_request(parsed->path)
+      && !streaming_is_request(parsed->path) && !oauth_is_request(parsed->path) && !rsp_is_request(parsed->path)
+      && strcmp(parsed->path, "/metrics") != 0)
+    return false;
+
+  DPRINTF(E_DBG, L_HTTPD, "Still starting, not handling '%s'\n", parsed->uri);
+
+  headers = evhttp_request_get_output_headers(req);
+  evhttp_add_header(headers, "Retry-After", "2");
+
+  if (!jsonapi_is_request(parsed->path))
+    {
+      httpd_send_error(req, HTTP_SERVUNAVAIL, "Starting");
+      return true;
     }
 
+  CHECK_NULL(L_HTTPD, evbuf = evbuffer_new());
+  evbuffer_add_printf(evbuf, "{\"state\":\"starting\"}");
+
+  evhttp_add_header(headers, "Content-Type", "application/json");
+  httpd_send_reply(req, HTTP_SERVUNAVAIL, "Starting", evbuf, HTTPD_SEND_NO_GZIP);
+
+  evbuffer_free(evbuf);
+
+  return true;
+}
+
+static void
+request_dispatch(struct evhttp_request *req, struct httpd_uri_parsed *parsed)
+{
+  enum httpd_handler handler;
+  uint64_t start;
+
+  if (starting_reply(req, parsed))
+    return;
+
+  start = metrics_clock_usec();
+
+  httpd_trace_begin();
+
   /* Dispatch protocol-specific handlers */
   if (dacp_is_request(parsed->path))
     {
+      handler = HTTPD_HANDLER_DACP;
       dacp_request(req, parsed);
-      goto out;
     }
   else if (daap_is_request(parsed->path))
     {
+      handler = HTTPD_HANDLER_DAAP;
       daap_request(req, parsed);
-      goto out;
     }
   else if (jsonapi_is_request(parsed->path))
     {
+      handler = HTTPD_HANDLER_JSON;
       jsonapi_request(req, parsed);
-      goto out;
     }
   else if (streaming_is_request(parsed->path))
     {
+      handler = HTTPD_HANDLER_STREAMING;
       streaming_request(req, parsed);
-      goto out;
     }
   else if (oauth_is_request(parsed->path))
     {
+      handler = HTTPD_HANDLER_OAUTH;
       oauth_request(req, parsed);
-      goto out;
     }
   else if (rsp_is_request(parsed->path))
     {
+      handler = HTTPD_HANDLER_RSP;
       rsp_request(req, parsed);
-      goto out;
     }
+  else if (strcmp(parsed->path, "/metrics") == 0)
+    {
+      handler = HTTPD_HANDLER_METRICS;
+      metrics_request(req);
+    }
+  else
+    {
+      DPRINTF(E_DBG, L_HTTPD, "HTTP request: '%s'\n", parsed->uri);
 
-  DPRINTF(E_DBG, L_HTTPD, "HTTP request: '%s'\n", parsed->uri);
+      /* Serve web interface files */
+      handler = HTTPD_HANDLER_FILE;
+      serve_file(req, parsed->path);
+    }
 
-  /* Serve web interface files */
-  serve_file(req, parsed->path);
+  // Time until the handler returns, so replies it completes later (like DAAP
+  // update requests or streams) only count with the time to set them up
+  metrics_histogram_observe(httpd_metrics[handler], metrics_clock_usec() - start);
 
- out:
-  httpd_uri_free(parsed);
+  httpd_trace_end(httpd_handler_names[handler], parsed->uri, evhttp_find_header(evhttp_request_get_input_headers(req), "User-Agent"));
 }
 
 
@@ -878,7 +2219,6 @@ struct httpd_request *
 httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed, const char *user_agent, struct httpd_uri_map *uri_map)
 {
   struct httpd_request *hreq;
-  struct evhttp_connection *evcon;
   struct evkeyvalq *headers;
   int req_method;
   int i;
@@ -897,10 +2237,8 @@ httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_par
       headers = evhttp_request_get_input_headers(req);
       hreq->user_agent = evhttp_find_header(headers, "User-Agent");
 
-      evcon = evhttp_request_get_connection(req);
-      if (evcon)
-	evhttp_connection_get_peer(evcon, &hreq->peer_address, &hreq->peer_port);
-      else
+      ret = peer_get(req, &hreq->peer_address, &hreq->peer_port);
+      if (ret < 0)
 	DPRINTF(E_LOG, L_HTTPD, "Connection to client lost or missing\n");
 
       req_method = evhttp_request_get_command(req);
@@ -935,6 +2273,7 @@ void
 httpd_stream_file(struct evhttp_request *req, int id)
 {
   struct media_file_info *mfi;
+  struct transcode_source_params params;
   struct stream_ctx *st;
   void (*stream_cb)(int fd, short event, void *arg);
   struct stat sb;
@@ -942,56 +2281,21 @@ httpd_stream_file(struct evhttp_request *req, int id)
   struct evhttp_connection *evcon;
   struct evkeyvalq *input_headers;
   struct evkeyvalq *output_headers;
-  const char *param;
-  const char *param_end;
   const char *ua;
   const char *client_codecs;
   char buf[64];
   int64_t offset;
   int64_t end_offset;
+#ifdef HAVE_LIBEVENT2_OLD
   off_t pos;
+#endif
   int transcode;
+  int cached;
+  int range;
   int ret;
 
-  offset = 0;
-  end_offset = 0;
-
   input_headers = evhttp_request_get_input_headers(req);
 
-  param = evhttp_find_header(input_headers, "Range");
-  if (param)
-    {
-      DPRINTF(E_DBG, L_HTTPD, "Found Range header: %s\n", param);
-
-      /* Start offset */
-      ret = safe_atoi64(param + strlen("bytes="), &offset);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_HTTPD, "Invalid start offset, will stream whole file (%s)\n", param);
-	  offset = 0;
-	}
-      /* End offset, if any */
-      else
-	{
-	  param_end = strchr(param, '-');
-	  if (param_end && (strlen(param_end) > 1))
-	    {
-	      ret = safe_atoi64(param_end + 1, &end_offset);
-	      if (ret < 0)
-		{
-		  DPRINTF(E_LOG, L_HTTPD, "Invalid end offset, will stream to end of file (%s)\n", param);
-		  end_offset = 0;
-		}
-
-	      if (end_offset < offset)
-		{
-		  DPRINTF(E_LOG, L_HTTPD, "End offset < start offset, will stream to end of file (%" PRIi64 " < %" PRIi64 ")\n", end_offset, offset);
-		  end_offset = 0;
-		}
-	    }
-	}
-    }
-
   mfi = db_file_fetch_byid(id);
   if (!mfi)
     {
@@ -1019,12 +2323,25 @@ httpd_stream_file(struct evhttp_request *req, int id)
     }
   memset(st, 0, sizeof(struct stream_ctx));
   st->fd = -1;
+  st->cache_fd = -1;
 
   ua = evhttp_find_header(input_headers, "User-Agent");
   client_codecs = evhttp_find_header(input_headers, "Accept-Codecs");
 
   transcode = transcode_needed(ua, client_codecs, mfi->codectype);
 
+  // If it was decoded before it can be streamed like a raw file
+  cached = 0;
+  if (transcode)
+    {
+      st->fd = decode_cache_open(mfi->id, XCODE_PCM16_HEADER, mfi->time_modified, &st->size);
+      if (st->fd >= 0)
+	{
+	  cached = 1;
+	  transcode = 0;
+	}
+    }
+
   output_headers = evhttp_request_get_output_headers(req);
 
   if (transcode)
@@ -1033,7 +2350,10 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
       stream_cb = stream_chunk_xcode_cb;
 
-      st->xcode = transcode_setup(XCODE_PCM16_HEADER, mfi->data_kind, mfi->path, mfi->song_length, &st->size);
+      params.samplerate = mfi->samplerate;
+      params.bits_per_sample = mfi->bits_per_sample;
+
+      st->xcode = transcode_setup(XCODE_PCM16_HEADER, mfi->data_kind, mfi->path, mfi->song_length, &st->size, &params);
       if (!st->xcode)
 	{
 	  DPRINTF(E_WARN, L_HTTPD, "Transcoding setup failed, aborting streaming\n");
@@ -1043,14 +2363,20 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	  goto out_free_st;
 	}
 
+      decode_cache_create(st, mfi->id, XCODE_PCM16_HEADER, mfi->time_modified);
+
+      if (xcode_pool_size > 0)
+	CHECK_NULL(L_HTTPD, st->xcode_out = evbuffer_new());
+
       if (!evhttp_find_header(output_headers, "Content-Type"))
 	evhttp_add_header(output_headers, "Content-Type", "audio/wav");
     }
   else
     {
       /* Stream the raw file */
-      DPRINTF(E_INFO, L_HTTPD, "Preparing to stream %s\n", mfi->path);
+      DPRINTF(E_INFO, L_HTTPD, "Preparing to stream %s%s\n", mfi->path, cached ? " (decoded, from cache)" : "");
 
+#ifdef HAVE_LIBEVENT2_OLD
       st->buf = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
       if (!st->buf)
 	{
@@ -1058,12 +2384,14 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
 	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
 
-	  goto out_free_st;
+	  goto out_cleanup;
 	}
+#endif
 
       stream_cb = stream_chunk_raw_cb;
 
-      st->fd = open(mfi->path, O_RDONLY);
+      if (!cached)
+	st->fd = open(mfi->path, O_RDONLY);
       if (st->fd < 0)
 	{
 	  DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", mfi->path, strerror(errno));
@@ -1073,7 +2401,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	  goto out_cleanup;
 	}
 
-      ret = stat(mfi->path, &sb);
+      ret = fstat(st->fd, &sb);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_HTTPD, "Could not stat() %s: %s\n", mfi->path, strerror(errno));
@@ -1084,23 +2412,30 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	}
       st->size = sb.st_size;
 
-      pos = lseek(st->fd, offset, SEEK_SET);
-      if (pos == (off_t) -1)
+#ifndef HAVE_LIBEVENT2_OLD
+      // The segment takes over the fd, and the chunks we add from it are sent
+      // without copying them through userspace
+      st->seg = evbuffer_file_segment_new(st->fd, 0, st->size, EVBUF_FS_CLOSE_ON_FREE);
+      if (!st->seg)
 	{
-	  DPRINTF(E_LOG, L_HTTPD, "Could not seek into %s: %s\n", mfi->path, strerror(errno));
+	  DPRINTF(E_LOG, L_HTTPD, "Could not create file segment for %s\n", mfi->path);
 
-	  evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
 
 	  goto out_cleanup;
 	}
-      st->offset = offset;
-      st->end_offset = end_offset;
+#endif
 
+      if (cached)
+	{
+	  if (!evhttp_find_header(output_headers, "Content-Type"))
+	    evhttp_add_header(output_headers, "Content-Type", "audio/wav");
+	}
       /* Content-Type for video files is different than for audio files
        * and overrides whatever may have been set previously, like
        * application/x-dmap-tagged when we're speaking DAAP.
        */
-      if (mfi->has_video)
+      else if (mfi->has_video)
 	{
 	  /* Front Row and others expect video/<type> */
 	  ret = snprintf(buf, sizeof(buf), "video/%s", mfi->type);
@@ -1124,7 +2459,41 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	  else
 	    evhttp_add_header(output_headers, "Content-Type", buf);
 	}
+
+      evhttp_add_header(output_headers, "Accept-Ranges", "bytes");
+    }
+
+  range = range_parse(input_headers, st->size, &offset, &end_offset);
+  if (range < 0)
+    {
+      evhttp_remove_header(output_headers, "Content-Type");
+      range_not_satisfiable(req, st->size);
+
+      goto out_cleanup;
+    }
+
+  // The size of a transcoded stream is an estimate and it can only be seeked
+  // by transcoding up to the offset, so a range from the start just gets the
+  // whole stream
+  if (transcode && (offset == 0))
+    range = 0;
+
+#ifdef HAVE_LIBEVENT2_OLD
+  if (!transcode)
+    {
+      pos = lseek(st->fd, offset, SEEK_SET);
+      if (pos == (off_t) -1)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not seek into %s: %s\n", mfi->path, strerror(errno));
+
+	  evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+
+	  goto out_cleanup;
+	}
     }
+#endif
+  st->offset = offset;
+  st->end_offset = end_offset;
 
   st->evbuf = evbuffer_new();
   if (!st->evbuf)
@@ -1162,10 +2531,10 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
   st->id = mfi->id;
   st->start_offset = offset;
-  st->stream_size = st->size;
+  st->stream_size = end_offset + 1 - offset;
   st->req = req;
 
-  if ((offset == 0) && (end_offset == 0))
+  if (range == 0)
     {
       /* If we are not decoding, send the Content-Length. We don't do
        * that if we are decoding because we can only guesstimate the
@@ -1184,21 +2553,15 @@ httpd_stream_file(struct evhttp_request *req, int id)
     }
   else
     {
-      if (offset > 0)
-	st->stream_size -= offset;
-      if (end_offset > 0)
-	st->stream_size -= (st->size - end_offset);
-
       DPRINTF(E_DBG, L_HTTPD, "Stream request with range %" PRIi64 "-%" PRIi64 "\n", offset, end_offset);
 
-      ret = snprintf(buf, sizeof(buf), "bytes %" PRIi64 "-%" PRIi64 "/%" PRIi64,
-		     offset, (end_offset) ? end_offset : (int64_t)st->size, (int64_t)st->size);
+      ret = snprintf(buf, sizeof(buf), "bytes %" PRIi64 "-%" PRIi64 "/%" PRIi64, offset, end_offset, (int64_t)st->size);
       if ((ret < 0) || (ret >= sizeof(buf)))
 	DPRINTF(E_LOG, L_HTTPD, "Content-Range too large for buffer, dropping\n");
       else
 	evhttp_add_header(output_headers, "Content-Range", buf);
 
-      ret = snprintf(buf, sizeof(buf), "%" PRIi64, ((end_offset) ? end_offset + 1 : (int64_t)st->size) - offset);
+      ret = snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)st->stream_size);
       if ((ret < 0) || (ret >= sizeof(buf)))
 	DPRINTF(E_LOG, L_HTTPD, "Content-Length too large for buffer, dropping\n");
       else
@@ -1228,20 +2591,85 @@ httpd_stream_file(struct evhttp_request *req, int id)
   return;
 
  out_cleanup:
+  decode_cache_abort(st);
   if (st->evbuf)
     evbuffer_free(st->evbuf);
+  if (st->xcode_out)
+    evbuffer_free(st->xcode_out);
   if (st->xcode)
     transcode_cleanup(&st->xcode);
   if (st->buf)
     free(st->buf);
+#ifndef HAVE_LIBEVENT2_OLD
+  if (st->seg)
+    evbuffer_file_segment_free(st->seg);
+  else if (st->fd > 0)
+    close(st->fd);
+#else
   if (st->fd > 0)
     close(st->fd);
+#endif
  out_free_st:
   free(st);
  out_free_mfi:
   free_mfi(mfi, 0);
 }
 
+#ifdef HAVE_LIBDEFLATE
+// libdeflate is a lot faster than zlib, but can only compress whole buffers
+struct evbuffer *
+httpd_gzip_deflate(struct evbuffer *in)
+{
+  struct libdeflate_compressor *compressor;
+  struct evbuffer *out;
+  struct evbuffer_iovec iovec[1];
+  size_t len;
+  size_t bound;
+  int ret;
+
+  len = evbuffer_get_length(in);
+
+  compressor = libdeflate_alloc_compressor((len > GZIP_LARGE_SIZE) ? gzip_level_large : gzip_level);
+  if (!compressor)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "libdeflate setup failed\n");
+      return NULL;
+    }
+
+  bound = libdeflate_gzip_compress_bound(compressor, len);
+
+  out = evbuffer_new();
+  if (!out)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
+      goto out_compressor_free;
+    }
+
+  ret = evbuffer_reserve_space(out, bound, iovec, 1);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply\n");
+      goto out_evbuf_free;
+    }
+
+  iovec[0].iov_len = libdeflate_gzip_compress(compressor, evbuffer_pullup(in, -1), len, iovec[0].iov_base, bound);
+  if (iovec[0].iov_len == 0)
+    goto out_evbuf_free;
+
+  evbuffer_commit_space(out, iovec, 1);
+  libdeflate_free_compressor(compressor);
+
+  return out;
+
+ out_evbuf_free:
+  evbuffer_free(out);
+
+ out_compressor_free:
+  libdeflate_free_compressor(compressor);
+
+  return NULL;
+}
+#else
 struct evbuffer *
 httpd_gzip_deflate(struct evbuffer *in)
 {
@@ -1255,7 +2683,7 @@ httpd_gzip_deflate(struct evbuffer *in)
   strm.opaque = Z_NULL;
 
   // Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default)
-  ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  ret = deflateInit2(&strm, (evbuffer_get_length(in) > GZIP_LARGE_SIZE) ? gzip_level_large : gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
   if (ret != Z_OK)
     {
       DPRINTF(E_LOG, L_HTTPD, "zlib setup failed: %s\n", zError(ret));
@@ -1304,6 +2732,147 @@ httpd_gzip_deflate(struct evbuffer *in)
 
   return NULL;
 }
+#endif
+
+bool
+httpd_etag_check(struct evhttp_request *req, const char *tag)
+{
+  struct evkeyvalq *headers;
+  const char *match;
+  const char *p;
+  char etag[128];
+  size_t len;
+  int ret;
+
+  ret = snprintf(etag, sizeof(etag), "\"%lx-%s\"", (unsigned long)httpd_start, tag);
+  if ((ret < 0) || (ret >= sizeof(etag)))
+    return false;
+
+  len = ret;
+
+  headers = evhttp_request_get_output_headers(req);
+  evhttp_add_header(headers, "ETag", etag);
+
+  headers = evhttp_request_get_input_headers(req);
+  match = evhttp_find_header(headers, "If-None-Match");
+  if (!match)
+    return false;
+
+  // A list of tags, which may be weak (W/"...") or "*"
+  for (p = match; *p; p++)
+    {
+      if (*p == ' ' || *p == '\t' || *p == ',')
+	continue;
+
+      if (*p == '*')
+	return true;
+
+      if (strncmp(p, "W/", 2) == 0)
+	p += 2;
+
+      if ((strncmp(p, etag, len) == 0) && (p[len] == '\0' || p[len] == ',' || p[len] == ' '))
+	return true;
+
+      p = strchr(p, ',');
+      if (!p)
+	break;
+    }
+
+  return false;
+}
+
+void
+httpd_trace_begin(void)
+{
+  if (__atomic_load_n(&httpd_trace_threshold_ms, __ATOMIC_RELAXED) <= 0)
+    {
+      httpd_trace.active = false;
+      return;
+    }
+
+  httpd_trace.active = true;
+  httpd_trace.id = __atomic_add_fetch(&httpd_trace_next_id, 1, __ATOMIC_RELAXED);
+  httpd_trace.start = metrics_clock_usec();
+  httpd_trace.last = httpd_trace.start;
+  httpd_trace.nphases = 0;
+}
+
+void
+httpd_trace_phase(const char *phase)
+{
+  uint64_t now;
+  int i;
+
+  if (!httpd_trace.active)
+    return;
+
+  now = metrics_clock_usec();
+
+  for (i = 0; i < httpd_trace.nphases; i++)
+    {
+      if (strcmp(httpd_trace.phases[i].name, phase) == 0)
+	break;
+    }
+
+  if (i == httpd_trace.nphases)
+    {
+      if (i == HTTPD_TRACE_PHASES_MAX)
+	return; // Counted as the next phase that fits
+
+      httpd_trace.phases[i].name = phase;
+      httpd_trace.phases[i].usec = 0;
+      httpd_trace.nphases++;
+    }
+
+  httpd_trace.phases[i].usec += now - httpd_trace.last;
+  httpd_trace.last = now;
+}
+
+void
+httpd_trace_end(const char *handler, const char *uri, const char *user_agent)
+{
+  char phases[256];
+  uint64_t total;
+  int threshold_ms;
+  int len;
+  int i;
+
+  if (!httpd_trace.active)
+    return;
+
+  httpd_trace.active = false;
+
+  threshold_ms = __atomic_load_n(&httpd_trace_threshold_ms, __ATOMIC_RELAXED);
+  total = metrics_clock_usec() - httpd_trace.start;
+  if ((threshold_ms <= 0) || (total < (uint64_t)threshold_ms * 1000))
+    return;
+
+  phases[0] = '\0';
+  for (i = 0, len = 0; (i < httpd_trace.nphases) && (len < sizeof(phases)); i++)
+    len += snprintf(phases + len, sizeof(phases) - len, "%s %.1f, ", httpd_trace.phases[i].name, httpd_trace.phases[i].usec / 1000.0);
+
+  if (len < sizeof(phases))
+    snprintf(phases + len, sizeof(phases) - len, "other %.1f", (metrics_clock_usec() - httpd_trace.last) / 1000.0);
+
+  if (user_agent)
+    DPRINTF(E_LOG, L_HTTPD, "Slow %s request #%" PRIu32 " took %" PRIu64 " ms (%s ms): '%s', user agent '%s'\n",
+	    handler, httpd_trace.id, total / 1000, phases, uri ? uri : "", user_agent);
+  else
+    DPRINTF(E_LOG, L_HTTPD, "Slow %s request #%" PRIu32 " took %" PRIu64 " ms (%s ms): '%s'\n",
+	    handler, httpd_trace.id, total / 1000, phases, uri ? uri : "");
+}
+
+void
+httpd_trace_threshold_set(int threshold_ms)
+{
+  __atomic_store_n(&httpd_trace_threshold_ms, (threshold_ms > 0) ? threshold_ms : 0, __ATOMIC_RELAXED);
+}
+
+int
+httpd_trace_threshold_get(void)
+{
+  return __atomic_load_n(&httpd_trace_threshold_ms, __ATOMIC_RELAXED);
+}
 
 void
 httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf, enum httpd_send_flags flags)
@@ -1317,6 +2886,9 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
   if (!req)
     return;
 
+  // Whatever the handler didn't mark itself
+  httpd_trace_phase("handler");
+
   input_headers = evhttp_request_get_input_headers(req);
   output_headers = evhttp_request_get_output_headers(req);
 
@@ -1329,12 +2901,18 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
   if (allow_origin)
     evhttp_add_header(output_headers, "Access-Control-Allow-Origin", allow_origin);
 
-  if (do_gzip && (gzbuf = httpd_gzip_deflate(evbuf)))
+  if (do_gzip && reply_gzip_defer(req, code, reason, evbuf))
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Gzipping response in the pool\n");
+    }
+  else if (do_gzip && (gzbuf = httpd_gzip_deflate(evbuf)))
     {
       DPRINTF(E_DBG, L_HTTPD, "Gzipping response\n");
 
+      httpd_trace_phase("gzip");
+
       evhttp_add_header(output_headers, "Content-Encoding", "gzip");
-      evhttp_send_reply(req, code, reason, gzbuf);
+      reply_send(req, code, reason, gzbuf, false);
       evbuffer_free(gzbuf);
 
       // Drain original buffer, as would be after evhttp_send_reply()
@@ -1342,9 +2920,270 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
     }
   else
     {
-      evhttp_send_reply(req, code, reason, evbuf);
+      reply_send(req, code, reason, evbuf, false);
+    }
+
+  httpd_trace_phase("send");
+}
+
+/* --------------------------- CHUNKED REPLIES ----------------------------- */
+
+#ifdef HAVE_LIBEVENT2_OLD
+// No evhttp_send_reply_chunk_with_cb, so the body is sent in one go
+void
+httpd_send_reply_chunked(struct evhttp_request *req, int code, const char *reason, httpd_chunk_cb cb, void *cb_arg, enum httpd_send_flags flags)
+{
+  struct evbuffer *evbuf;
+  int ret;
+
+  CHECK_NULL(L_HTTPD, evbuf = evbuffer_new());
+
+  while (req && ((ret = cb(evbuf, cb_arg)) == 0))
+    ;
+
+  if (req && (ret < 0))
+    httpd_send_error(req, HTTP_INTERNAL, "Internal Server Error");
+  else if (req)
+    httpd_send_reply(req, code, reason, evbuf, flags);
+
+  cb(NULL, cb_arg);
+  evbuffer_free(evbuf);
+}
+#else
+
+static int
+chunked_deflate(z_stream *strm, struct evbuffer *out, struct evbuffer *in, int flush)
+{
+  struct evbuffer_iovec iovec[1];
+  int ret;
+
+  strm->next_in = evbuffer_pullup(in, -1);
+  strm->avail_in = evbuffer_get_length(in);
+
+  // If deflate fills the output space there may be more pending
+  do
+    {
+      ret = evbuffer_reserve_space(out, STREAM_CHUNK_SIZE, iovec, 1);
+      if (ret < 0)
+	return -1;
+
+      strm->next_out = iovec[0].iov_base;
+      strm->avail_out = iovec[0].iov_len;
+
+      ret = deflate(strm, flush);
+      if (ret == Z_STREAM_ERROR)
+	return -1;
+
+      iovec[0].iov_len -= strm->avail_out;
+      evbuffer_commit_space(out, iovec, 1);
+    }
+  while (strm->avail_out == 0);
+
+  evbuffer_drain(in, evbuffer_get_length(in));
+
+  return 0;
+}
+
+static void
+chunked_free(struct chunked_ctx *ctx)
+{
+  ctx->cb(NULL, ctx->cb_arg);
+
+  if (ctx->gzip)
+    deflateEnd(&ctx->strm);
+
+  if (ctx->ev)
+    event_free(ctx->ev);
+  evbuffer_free(ctx->in);
+  evbuffer_free(ctx->out);
+  free(ctx->reason);
+  free(ctx);
+}
+
+/* Thread: httpd. If failed < 0 the reply can't be completed, so the connection
+ * is closed, if > 0 the client is already gone.
+ */
+static void
+chunked_end(struct chunked_ctx *ctx, int failed)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(ctx->req);
+
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  if (failed == 0)
+    evhttp_send_reply_end(ctx->req);
+  else if (failed < 0 && evcon)
+    evhttp_connection_free(evcon);
+
+  chunked_free(ctx);
+}
+
+static void
+chunked_resched_cb(struct evhttp_connection *evcon, void *arg);
+
+static void
+chunked_next_cb(int fd, short event, void *arg)
+{
+  struct chunked_ctx *ctx = arg;
+  int ret;
+
+  // Gzip may hold back output, so iterate until there is something to send
+  ret = 0;
+  while ((ret == 0) && (evbuffer_get_length(ctx->out) == 0))
+    {
+      ret = ctx->cb(ctx->in, ctx->cb_arg);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Error creating chunked reply, closing connection\n");
+	  chunked_end(ctx, -1);
+	  return;
+	}
+
+      if (!ctx->gzip)
+	evbuffer_add_buffer(ctx->out, ctx->in);
+      else if (chunked_deflate(&ctx->strm, ctx->out, ctx->in, (ret == 0) ? Z_NO_FLUSH : Z_FINISH) < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Error gzipping chunked reply, closing connection\n");
+	  chunked_end(ctx, -1);
+	  return;
+	}
+    }
+
+  if (ret == 0)
+    {
+      evhttp_send_reply_chunk_with_cb(ctx->req, ctx->out, chunked_resched_cb, ctx);
+      return;
+    }
+
+  if (evbuffer_get_length(ctx->out) > 0)
+    evhttp_send_reply_chunk(ctx->req, ctx->out);
+
+  chunked_end(ctx, 0);
+}
+
+static void
+chunked_resched_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct chunked_ctx *ctx = arg;
+  struct timeval tv;
+  int ret;
+
+  evutil_timerclear(&tv);
+  ret = event_add(ctx->ev, &tv);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for chunked reply\n");
+
+      chunked_end(ctx, -1);
+    }
+}
+
+static void
+chunked_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct chunked_ctx *ctx = arg;
+
+  DPRINTF(E_WARN, L_HTTPD, "Connection failed; stopping chunked reply\n");
+
+  event_del(ctx->ev);
+
+  chunked_end(ctx, 1);
+}
+
+/* Thread: httpd */
+static void
+chunked_start(struct chunked_ctx *ctx)
+{
+  struct evkeyvalq *output_headers;
+  struct evhttp_connection *evcon;
+  struct timeval tv;
+
+  ctx->ev = event_new(evbase_httpd, -1, EV_TIMEOUT, chunked_next_cb, ctx);
+  evutil_timerclear(&tv);
+  if (!ctx->ev || (event_add(ctx->ev, &tv) < 0))
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not add one-shot event for chunked reply\n");
+
+      evhttp_send_error(ctx->req, HTTP_SERVUNAVAIL, "Internal Server Error");
+      chunked_free(ctx);
+      return;
+    }
+
+  output_headers = evhttp_request_get_output_headers(ctx->req);
+
+  if (allow_origin)
+    evhttp_add_header(output_headers, "Access-Control-Allow-Origin", allow_origin);
+  if (ctx->gzip)
+    evhttp_add_header(output_headers, "Content-Encoding", "gzip");
+
+  evhttp_send_reply_start(ctx->req, ctx->code, ctx->reason);
+
+  evcon = evhttp_request_get_connection(ctx->req);
+
+  evhttp_connection_set_closecb(evcon, chunked_fail_cb, ctx);
+}
+
+static enum command_state
+deferred_chunked_start(void *arg, int *retval)
+{
+  chunked_start(arg);
+
+  *retval = 0;
+  return COMMAND_PENDING; // Not COMMAND_END, because chunked_end frees ctx
+}
+
+void
+httpd_send_reply_chunked(struct evhttp_request *req, int code, const char *reason, httpd_chunk_cb cb, void *cb_arg, enum httpd_send_flags flags)
+{
+  struct chunked_ctx *ctx;
+  struct httpd_deferred *d;
+  struct evkeyvalq *input_headers;
+  const char *param;
+  int ret;
+
+  if (!req)
+    {
+      cb(NULL, cb_arg);
+      return;
+    }
+
+  CHECK_NULL(L_HTTPD, ctx = calloc(1, sizeof(struct chunked_ctx)));
+  CHECK_NULL(L_HTTPD, ctx->in = evbuffer_new());
+  CHECK_NULL(L_HTTPD, ctx->out = evbuffer_new());
+
+  ctx->req = req;
+  ctx->code = code;
+  ctx->reason = safe_strdup(reason);
+  ctx->cb = cb;
+  ctx->cb_arg = cb_arg;
+
+  input_headers = evhttp_request_get_input_headers(req);
+  if (!(flags & HTTPD_SEND_NO_GZIP) && (param = evhttp_find_header(input_headers, "Accept-Encoding")) &&
+      (strstr(param, "gzip") || strstr(param, "*")))
+    {
+      // Chunked replies are large, so use the level for those
+      ret = deflateInit2(&ctx->strm, gzip_level_large, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+      if (ret != Z_OK)
+	DPRINTF(E_LOG, L_HTTPD, "zlib setup failed: %s\n", zError(ret));
+      else
+	ctx->gzip = true;
+    }
+
+  d = pool_size ? pthread_getspecific(pool_current) : NULL;
+  if (!d || d->req != req)
+    {
+      chunked_start(ctx);
+      return;
     }
+
+  d->replied = true;
+
+  commands_exec_async(httpd_cmdbase, deferred_chunked_start, ctx);
 }
+#endif /* HAVE_LIBEVENT2_OLD */
 
 // This is a modified version of evhttp_send_error (credit libevent)
 void
@@ -1355,7 +3194,7 @@ httpd_send_error(struct evhttp_request* req, int error, const char* reason)
 
   if (!allow_origin)
     {
-      evhttp_send_error(req, error, reason);
+      reply_send(req, error, reason, NULL, true);
       return;
     }
 
@@ -1373,7 +3212,7 @@ httpd_send_error(struct evhttp_request* req, int error, const char* reason)
   else
     evbuffer_add_printf(evbuf, ERR_PAGE, error, reason, reason);
 
-  evhttp_send_reply(req, error, reason, evbuf);
+  reply_send(req, error, reason, evbuf, false);
 
   if (evbuf)
     evbuffer_free(evbuf);
@@ -1418,23 +3257,23 @@ httpd_redirect_to_index(struct evhttp_request *req, const char *uri)
 bool
 httpd_admin_check_auth(struct evhttp_request *req)
 {
-  struct evhttp_connection *evcon;
   char *addr;
-  uint16_t port;
+  unsigned short port;
   const char *passwd;
   int ret;
 
-  evcon = evhttp_request_get_connection(req);
-  if (!evcon)
+  ret = peer_get(req, &addr, &port);
+  if (ret < 0)
     {
       DPRINTF(E_LOG, L_HTTPD, "Connection to client lost or missing\n");
       return false;
     }
 
-  evhttp_connection_get_peer(evcon, &addr, &port);
-
   if (peer_address_is_trusted(addr))
-    return true;
+    {
+      httpd_trace_phase("auth");
+      return true;
+    }
 
   passwd = cfg_getstr(cfg_getsec(cfg, "general"), "admin_password");
   if (!passwd)
@@ -1458,6 +3297,8 @@ httpd_admin_check_auth(struct evhttp_request *req)
 
   DPRINTF(E_DBG, L_HTTPD, "Authentication successful\n");
 
+  httpd_trace_phase("auth");
+
   return true;
 }
 
@@ -1560,15 +3401,33 @@ httpd_basic_auth(struct evhttp_request *req, const char *user, const char *passw
   return -1;
 }
 
+void
+httpd_ready(void)
+{
+  __atomic_store_n(&httpd_is_ready, true, __ATOMIC_RELEASE);
+}
+
 /* Thread: main */
 int
 httpd_init(const char *webroot)
 {
   struct stat sb;
+  char labels[64];
   int v6enabled;
+  int i;
   int ret;
 
   httpd_exit = 0;
+  httpd_start = time(NULL);
+
+  for (i = 0; i < HTTPD_HANDLER_MAX; i++)
+    {
+      snprintf(labels, sizeof(labels), "handler=\"%s\"", httpd_handler_names[i]);
+      httpd_metrics[i] = metrics_register("forked_daapd_http_request_duration_seconds", labels, METRICS_HISTOGRAM,
+                                          "Time spent handling requests, by handler (mpd is the MPD protocol)");
+    }
+
+  httpd_trace_threshold_set(cfg_getint(cfg_getsec(cfg, "general"), "slow_request_threshold"));
 
   DPRINTF(E_DBG, L_HTTPD, "Starting web server with root directory '%s'\n", webroot);
   ret = lstat(webroot, &sb);
@@ -1727,6 +3586,30 @@ httpd_init(const char *webroot)
 
   evhttp_set_gencb(evhttpd, httpd_gen_cb, NULL);
 
+  gzip_level = cfg_getint(cfg_getsec(cfg, "library"), "gzip_level");
+  if (gzip_level < 1 || gzip_level > 9)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Invalid gzip_level %d, using 6\n", gzip_level);
+      gzip_level = 6;
+    }
+
+  gzip_level_large = cfg_getint(cfg_getsec(cfg, "library"), "gzip_level_large");
+  if (gzip_level_large < 1 || gzip_level_large > 9)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Invalid gzip_level_large %d, using 1\n", gzip_level_large);
+      gzip_level_large = 1;
+    }
+
+  decode_cache_init();
+
+  ret = pool_init(cfg_getint(cfg_getsec(cfg, "library"), "httpd_threads"));
+  if (ret < 0)
+    goto pool_fail;
+
+  ret = xcode_pool_init(cfg_getint(cfg_getsec(cfg, "library"), "httpd_transcode_threads"));
+  if (ret < 0)
+    goto xcode_pool_fail;
+
   ret = pthread_create(&tid_httpd, NULL, httpd, NULL);
   if (ret != 0)
     {
@@ -1744,6 +3627,10 @@ httpd_init(const char *webroot)
   return 0;
 
  thread_fail:
+  xcode_pool_deinit();
+ xcode_pool_fail:
+  pool_deinit();
+ pool_fail:
  bind_fail:
   evhttp_free(evhttpd);
  event_fail:
@@ -1808,6 +3695,9 @@ httpd_deinit(void)
       return;
     }
 
+  xcode_pool_deinit();
+  pool_deinit();
+
   streaming_deinit();
 #ifdef HAVE_LIBWEBSOCKETS
   websocket_deinit();
@@ -100,6 +100,56 @@ httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_par
 void
 httpd_stream_file(struct evhttp_request *req, int id);
 
+/*
+ * Returns true if the request is being handled by one of the httpd pool
+ * threads. Such requests must not keep pointers to state that the httpd thread
+ * may free, e.g. sessions.
+ */
+bool
+httpd_request_is_deferred(struct evhttp_request *req);
+
+/*
+ * Adds an ETag header to the reply and checks it against the If-None-Match
+ * header of the request, so that replies that are made from the library can
+ * be revalidated without making them. The tag is made unique to this run of
+ * the server, since the revision numbers that callers use start over.
+ *
+ * @in  req      The evhttp request struct
+ * @in  tag      Identifies the version of the resource, e.g. from the id,
+ *               the size and the library revision (unquoted)
+ * @return       true if the client has this version, the caller should then
+ *               reply HTTP_NOTMODIFIED without a body
+ */
+bool
+httpd_etag_check(struct evhttp_request *req, const char *tag);
+
+/*
+ * Timing spans of a request, for finding out why some requests are slow. The
+ * calling thread's request is timed from httpd_trace_begin(), and each call to
+ * httpd_trace_phase() adds the time since the previous call to the given phase
+ * (e.g. "auth", "db", "encode"). httpd_trace_end() then logs the request with
+ * its phases, if it took longer than the threshold. The functions do nothing
+ * while the threshold is 0, which is the default (see slow_request_threshold
+ * in the config file and /api/request-trace in the JSON API).
+ *
+ * Names of phases must be string literals. The httpd requests are traced by
+ * httpd, the MPD commands by mpd.
+ */
+void
+httpd_trace_begin(void);
+
+void
+httpd_trace_phase(const char *phase);
+
+void
+httpd_trace_end(const char *handler, const char *uri, const char *user_agent);
+
+void
+httpd_trace_threshold_set(int threshold_ms);
+
+int
+httpd_trace_threshold_get(void);
+
 /*
  * Gzips an evbuffer
  *
@@ -125,6 +175,32 @@ httpd_gzip_deflate(struct evbuffer *in);
 void
 httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf, enum httpd_send_flags flags);
 
+/*
+ * Callback for httpd_send_reply_chunked(), called from the httpd thread each
+ * time the client has received the previous chunk. It should add the next part
+ * of the body to evbuf and return 0 if there is more to come, 1 when done, or
+ * -1 on error, in which case the connection is closed, since the reply can't be
+ * completed. Finally it is called with evbuf NULL, also if the client hangs
+ * up, so that arg can be freed.
+ */
+typedef int (*httpd_chunk_cb)(struct evbuffer *evbuf, void *arg);
+
+/*
+ * Like httpd_send_reply, but the body is produced by the callback and sent
+ * with chunked transfer encoding, so that large replies don't have to be held
+ * in memory. Should be thread safe.
+ *
+ * @in  req      The evhttp request struct
+ * @in  code     HTTP code, e.g. 200
+ * @in  reason   A brief explanation of the error - if NULL the standard meaning
+                 of the error code will be used
+ * @in  cb       Produces the body, see above
+ * @in  cb_arg   Argument for cb
+ * @in  flags    See flags above
+ */
+void
+httpd_send_reply_chunked(struct evhttp_request *req, int code, const char *reason, httpd_chunk_cb cb, void *cb_arg, enum httpd_send_flags flags);
+
 /*
  * This is a substitute for evhttp_send_error that should be used whenever an
  * error may be returned to a browser. It will set CORS headers as appropriate,
@@ -157,6 +233,13 @@ httpd_admin_check_auth(struct evhttp_request *req);
 int
 httpd_basic_auth(struct evhttp_request *req, const char *user, const char *passwd, const char *realm);
 
+/* Lets requests through to the handlers, before this (while the other
+ * subsystems are starting) only web interface files are served and everything
+ * else gets a 503 "starting" reply.
+ */
+void
+httpd_ready(void);
+
 int
 httpd_init(const char *webroot);
 
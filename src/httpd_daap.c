@@ -37,9 +37,15 @@
 #include <inttypes.h>
 #include <time.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <uninorm.h>
 #include <unistd.h>
+#include <fcntl.h>
+
+#ifdef HAVE_EVENTFD
+# include <sys/eventfd.h>
+#endif
 
 #include <event2/event.h>
 
@@ -53,6 +59,7 @@
 #include "daap_query.h"
 #include "dmap_common.h"
 #include "cache.h"
+#include "listener.h"
 
 
 /* httpd event base, from httpd.c */
@@ -66,18 +73,30 @@ extern struct event_base *evbase_httpd;
  * new sessions - see daap_session_cleanup().
  */
 #define DAAP_SESSION_MAX 200
+#define DAAP_SESSION_BUCKETS 256               // Power of two
 #define DAAP_SESSION_TIMEOUT 604800            // One week in seconds
 /* We announce this timeout to the client when returning server capabilities */
 #define DAAP_SESSION_TIMEOUT_CAPABILITY 1800   // 30 minutes
 /* Update requests refresh interval in seconds */
 #define DAAP_UPDATE_REFRESH  0
+/* Library changes within this many seconds are announced as one revision */
+#define DAAP_UPDATE_COALESCE 1
+/* Number of recent revisions that clients can request a delta song list for */
+#define DAAP_REVISIONS 32
 
 /* Database number for the Radio item */
 #define DAAP_DB_RADIO 2
 
+/* Song lists that encode to more than this are not built in memory, instead
+ * they are measured and then sent in chunks of about DAAP_SONGLIST_CHUNK_SIZE
+ */
+#define DAAP_SONGLIST_STREAM_BYTES (4 * 1024 * 1024)
+#define DAAP_SONGLIST_CHUNK_SIZE (64 * 1024)
+
 /* Errors that the reply handlers may return */
 enum daap_reply_result
 {
+  DAAP_REPLY_NOT_MODIFIED    =  5,
   DAAP_REPLY_LOGOUT          =  4,
   DAAP_REPLY_NONE            =  3,
   DAAP_REPLY_NO_CONTENT      =  2,
@@ -95,6 +114,11 @@ struct daap_session {
   time_t mtime;
   bool is_remote;
 
+  // Hash bucket chain
+  struct daap_session *hnext;
+
+  // List ordered by mtime, most recently used first
+  struct daap_session *prev;
   struct daap_session *next;
 };
 
@@ -104,9 +128,18 @@ struct daap_update_request {
   /* Refresh tiemout */
   struct event *timeout;
 
+  struct daap_update_request *prev;
   struct daap_update_request *next;
 };
 
+/* When a library revision was announced, so the changes since then can be
+ * found through the files' db_timestamp and the file_changes log
+ */
+struct daap_revision {
+  int rev;
+  time_t time;
+};
+
 struct sort_ctx {
   struct evbuffer *headerlist;
   int16_t mshc;
@@ -115,20 +148,66 @@ struct sort_ctx {
   uint32_t misc_mshn;
 };
 
+/* A song list that is sent in chunks. The query is run a second time by the
+ * httpd thread, which encodes the items as the client takes them.
+ */
+struct songlist_stream {
+  struct query_params qp;
+  const struct dmap_field **meta;
+  int nmeta;
+  int sort_headers;
+
+  bool is_remote;
+  char *user_agent;
+  char *client_codecs;
+  char *last_codectype;
+  int transcode;
+
+  struct dmap_writer songlist;
+  // Container headers up to and including mlcl, NULL once sent
+  struct evbuffer *header;
+  // The mshl container (if sort headers were requested)
+  struct evbuffer *trailer;
+  // Bytes of the mlcl container that are still to be sent
+  size_t remaining;
+};
+
 
 /* Default meta tags if not provided in the query */
 static char *default_meta_plsongs = "dmap.itemkind,dmap.itemid,dmap.itemname,dmap.containeritemid,dmap.parentcontainerid";
 static char *default_meta_pl = "dmap.itemid,dmap.itemname,dmap.persistentid,com.apple.itunes.smart-playlist";
 static char *default_meta_group = "dmap.itemname,dmap.persistentid,daap.songalbumartist";
 
-/* DAAP session tracking */
-static struct daap_session *daap_sessions;
-
-/* Update requests */
+/* DAAP session tracking. Sessions are only added and removed by the httpd
+ * thread, but the httpd pool threads also look them up. Lookups go through the
+ * hash table, and since every lookup moves the session to the head of the
+ * mtime list, stale sessions can be expired from the tail without a scan.
+ */
+static struct daap_session *daap_session_hash[DAAP_SESSION_BUCKETS];
+static struct daap_session *daap_sessions;      // Most recently used
+static struct daap_session *daap_sessions_tail; // Least recently used
+static int daap_sessions_count;
+static pthread_mutex_t daap_sessions_lck = PTHREAD_MUTEX_INITIALIZER;
+
+/* Update requests. The revisions are written by the httpd thread, and read
+ * by the httpd pool threads when serving delta song lists.
+ */
 static int current_rev;
+static struct daap_revision daap_revisions[DAAP_REVISIONS];
+static pthread_mutex_t daap_rev_lck = PTHREAD_MUTEX_INITIALIZER;
 static struct daap_update_request *update_requests;
 static struct timeval daap_update_refresh_tv = { DAAP_UPDATE_REFRESH, 0 };
 
+/* Library change notification */
+#ifdef HAVE_EVENTFD
+static int update_efd;
+#else
+static int update_pipe[2];
+#endif
+static struct event *updateev;
+static struct event *update_coalesce_ev;
+static struct timeval daap_update_coalesce_tv = { DAAP_UPDATE_COALESCE, 0 };
+
 
 /* -------------------------- SESSION HANDLING ------------------------------ */
 
@@ -141,74 +220,103 @@ daap_session_free(struct daap_session *s)
   free(s);
 }
 
-static void
-daap_session_remove(struct daap_session *s)
+static inline struct daap_session **
+daap_session_bucket(int id)
 {
-  struct daap_session *ptr;
-  struct daap_session *prev;
-
-  prev = NULL;
-  for (ptr = daap_sessions; ptr; ptr = ptr->next)
-    {
-      if (ptr == s)
-	break;
+  return &daap_session_hash[(uint32_t)id & (DAAP_SESSION_BUCKETS - 1)];
+}
 
-      prev = ptr;
-    }
+static struct daap_session *
+daap_session_get(int id)
+{
+  struct daap_session *s;
 
-  if (!ptr)
+  for (s = *daap_session_bucket(id); s; s = s->hnext)
     {
-      DPRINTF(E_LOG, L_DAAP, "Error: Request to remove non-existent or ad-hoc session. BUG!\n");
-      return;
+      if (id == s->id)
+	return s;
     }
 
-  if (!prev)
+  return NULL;
+}
+
+static void
+daap_session_unlink(struct daap_session *s)
+{
+  if (s->prev)
+    s->prev->next = s->next;
+  else
     daap_sessions = s->next;
+
+  if (s->next)
+    s->next->prev = s->prev;
   else
-    prev->next = s->next;
+    daap_sessions_tail = s->prev;
 
-  daap_session_free(s);
+  s->prev = NULL;
+  s->next = NULL;
 }
 
-static struct daap_session *
-daap_session_get(int id)
+static void
+daap_session_link(struct daap_session *s)
 {
-  struct daap_session *s;
+  s->prev = NULL;
+  s->next = daap_sessions;
+
+  if (daap_sessions)
+    daap_sessions->prev = s;
+  else
+    daap_sessions_tail = s;
+
+  daap_sessions = s;
+}
 
-  for (s = daap_sessions; s; s = s->next)
+/* Removes the session with the id of s, which may be a copy */
+static void
+daap_session_remove(struct daap_session *s)
+{
+  struct daap_session **link;
+  struct daap_session *ptr;
+
+  for (link = daap_session_bucket(s->id); (ptr = *link); link = &ptr->hnext)
     {
-      if (id == s->id)
-	return s;
+      if (ptr->id == s->id)
+	break;
     }
 
-  return NULL;
+  if (!ptr)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Error: Request to remove non-existent or ad-hoc session. BUG!\n");
+      return;
+    }
+
+  *link = ptr->hnext;
+  daap_session_unlink(ptr);
+  daap_sessions_count--;
+
+  daap_session_free(ptr);
 }
 
 /* Removes stale sessions and also drops the oldest sessions if DAAP_SESSION_MAX
- * will otherwise be exceeded
+ * will otherwise be exceeded. The list is ordered by mtime, so only the
+ * sessions that are actually removed are visited.
  */
 static void
 daap_session_cleanup(void)
 {
   struct daap_session *s;
-  struct daap_session *next;
   time_t now;
-  int count;
 
-  count = 0;
   now = time(NULL);
 
-  for (s = daap_sessions; s; s = next)
+  while ((s = daap_sessions_tail))
     {
-      count++;
-      next = s->next;
+      if ((difftime(now, s->mtime) <= DAAP_SESSION_TIMEOUT) && (daap_sessions_count < DAAP_SESSION_MAX))
+	break;
 
-      if ((difftime(now, s->mtime) > DAAP_SESSION_TIMEOUT) || (count > DAAP_SESSION_MAX))
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Cleaning up DAAP session (id %d)\n", s->id);
+      DPRINTF(E_LOG, L_DAAP, "Cleaning up DAAP session (id %d)\n", s->id);
 
-	  daap_session_remove(s);
-	}
+      daap_session_remove(s);
     }
 }
 
@@ -217,6 +325,8 @@ daap_session_add(bool is_remote, int request_session_id)
 {
   struct daap_session *s;
 
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&daap_sessions_lck));
+
   daap_session_cleanup();
 
   CHECK_NULL(L_DAAP, s = calloc(1, sizeof(struct daap_session)));
@@ -227,6 +337,7 @@ daap_session_add(bool is_remote, int request_session_id)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Session id requested in login (%d) is not available\n", request_session_id);
 	  free(s);
+	  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&daap_sessions_lck));
 	  return NULL;
 	}
 
@@ -241,10 +352,49 @@ daap_session_add(bool is_remote, int request_session_id)
 
   s->is_remote = is_remote;
 
-  if (daap_sessions)
-    s->next = daap_sessions;
+  s->hnext = *daap_session_bucket(s->id);
+  *daap_session_bucket(s->id) = s;
 
-  daap_sessions = s;
+  daap_session_link(s);
+  daap_sessions_count++;
+
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&daap_sessions_lck));
+
+  return s;
+}
+
+/* Finds the session and refreshes it. If copy is set, the session is copied
+ * to it and the copy is returned, for callers that are not the httpd thread.
+ */
+static struct daap_session *
+daap_session_find(int id, struct daap_session *copy)
+{
+  struct daap_session *s;
+
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&daap_sessions_lck));
+
+  s = daap_session_get(id);
+  if (s)
+    {
+      s->mtime = time(NULL);
+
+      if (s != daap_sessions)
+	{
+	  daap_session_unlink(s);
+	  daap_session_link(s);
+	}
+    }
+
+  if (s && copy)
+    {
+      *copy = *s;
+      copy->hnext = NULL;
+      copy->prev = NULL;
+      copy->next = NULL;
+      s = copy;
+    }
+
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&daap_sessions_lck));
 
   return s;
 }
@@ -262,27 +412,84 @@ update_free(struct daap_update_request *ur)
 }
 
 static void
-update_remove(struct daap_update_request *ur)
+update_add(struct daap_update_request *ur)
 {
-  struct daap_update_request *p;
+  ur->prev = NULL;
+  ur->next = update_requests;
+  if (update_requests)
+    update_requests->prev = ur;
 
-  if (ur == update_requests)
-    update_requests = ur->next;
+  update_requests = ur;
+}
+
+static void
+update_remove(struct daap_update_request *ur)
+{
+  if (ur->prev)
+    ur->prev->next = ur->next;
   else
-    {
-      for (p = update_requests; p && (p->next != ur); p = p->next)
-	;
+    update_requests = ur->next;
 
-      if (!p)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "WARNING: struct daap_update_request not found in list; BUG!\n");
-	  return;
-	}
+  if (ur->next)
+    ur->next->prev = ur->prev;
+
+  update_free(ur);
+}
+
+static void
+update_reply_make(struct evbuffer *reply, int rev)
+{
+  CHECK_ERR(L_DAAP, evbuffer_expand(reply, 32));
+
+  /* Send back current revision */
+  dmap_add_container(reply, "mupd", 24);
+  dmap_add_int(reply, "mstt", 200); /* 12 */
+  dmap_add_int(reply, "musr", rev); /* 12 */
+}
+
+/* Thread: httpd */
+static void
+revision_new(void)
+{
+  struct daap_revision *r;
+
+  pthread_mutex_lock(&daap_rev_lck);
 
-      p->next = ur->next;
+  current_rev++;
+
+  r = &daap_revisions[current_rev % DAAP_REVISIONS];
+  r->rev = current_rev;
+  r->time = time(NULL);
+
+  pthread_mutex_unlock(&daap_rev_lck);
+}
+
+/* Gets the time a revision was announced to the clients, returns -1 if the
+ * revision is not one of the last DAAP_REVISIONS.
+ */
+static int
+revision_time_get(time_t *t, int rev)
+{
+  struct daap_revision *r;
+  int ret;
+
+  if (rev <= 0)
+    return -1;
+
+  pthread_mutex_lock(&daap_rev_lck);
+
+  r = &daap_revisions[rev % DAAP_REVISIONS];
+  if (r->rev == rev)
+    {
+      *t = r->time;
+      ret = 0;
     }
+  else
+    ret = -1;
 
-  update_free(ur);
+  pthread_mutex_unlock(&daap_rev_lck);
+
+  return ret;
 }
 
 static void
@@ -295,23 +502,119 @@ update_refresh_cb(int fd, short event, void *arg)
   ur = (struct daap_update_request *)arg;
 
   CHECK_NULL(L_DAAP, reply = evbuffer_new());
-  CHECK_ERR(L_DAAP, evbuffer_expand(reply, 32));
 
-  current_rev++;
+  revision_new();
 
-  /* Send back current revision */
-  dmap_add_container(reply, "mupd", 24);
-  dmap_add_int(reply, "mstt", 200);         /* 12 */
-  dmap_add_int(reply, "musr", current_rev); /* 12 */
+  update_reply_make(reply, current_rev);
 
   evcon = evhttp_request_get_connection(ur->req);
   evhttp_connection_set_closecb(evcon, NULL, NULL);
 
   httpd_send_reply(ur->req, HTTP_OK, "OK", reply, 0);
 
+  evbuffer_free(reply);
+
   update_remove(ur);
 }
 
+/* Announces a new revision to all the parked update requests. The reply is
+ * only made once, and each request just gets a copy of it.
+ */
+static void
+update_coalesce_cb(int fd, short event, void *arg)
+{
+  struct daap_update_request *ur;
+  struct evhttp_connection *evcon;
+  struct evbuffer *reply;
+  struct evbuffer *evbuf;
+  uint8_t *buf;
+  size_t len;
+  int n;
+
+  revision_new();
+
+  if (!update_requests)
+    return;
+
+  CHECK_NULL(L_DAAP, reply = evbuffer_new());
+  CHECK_NULL(L_DAAP, evbuf = evbuffer_new());
+
+  update_reply_make(reply, current_rev);
+
+  buf = evbuffer_pullup(reply, -1);
+  len = evbuffer_get_length(reply);
+
+  for (n = 0, ur = update_requests; update_requests; ur = update_requests, n++)
+    {
+      update_requests = ur->next;
+
+      evcon = evhttp_request_get_connection(ur->req);
+      if (evcon)
+	evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+      evbuffer_add(evbuf, buf, len);
+      httpd_send_reply(ur->req, HTTP_OK, "OK", evbuf, 0);
+
+      update_free(ur);
+    }
+
+  DPRINTF(E_DBG, L_DAAP, "Announced library revision %d to %d client(s)\n", current_rev, n);
+
+  evbuffer_free(evbuf);
+  evbuffer_free(reply);
+}
+
+/* Thread: httpd */
+static void
+update_notify_cb(int fd, short what, void *arg)
+{
+  int ret;
+
+#ifdef HAVE_EVENTFD
+  eventfd_t count;
+
+  ret = eventfd_read(update_efd, &count);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not read library update event counter: %s\n", strerror(errno));
+
+      goto readd;
+    }
+#else
+  int dummy;
+
+  read(update_pipe[0], &dummy, sizeof(dummy));
+#endif
+
+  // Changes usually come in bursts, so wait for the rest before announcing
+  if (!evtimer_pending(update_coalesce_ev, NULL))
+    evtimer_add(update_coalesce_ev, &daap_update_coalesce_tv);
+
+ readd:
+  ret = event_add(updateev, NULL);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DAAP, "Couldn't re-add event for library update\n");
+}
+
+/* Thread: any thread making library changes */
+static void
+daap_library_update_handler(short event_mask)
+{
+  int ret;
+
+#ifdef HAVE_EVENTFD
+  ret = eventfd_write(update_efd, 1);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_DAAP, "Could not send library update event: %s\n", strerror(errno));
+#else
+  int dummy = 42;
+
+  ret = write(update_pipe[1], &dummy, sizeof(dummy));
+  if (ret != sizeof(dummy))
+    DPRINTF(E_LOG, L_DAAP, "Could not write to library update fd: %s\n", strerror(errno));
+#endif
+}
+
 static void
 update_fail_cb(struct evhttp_connection *evcon, void *arg)
 {
@@ -673,11 +976,47 @@ parse_meta(const struct dmap_field ***out_meta, const char *param)
   return nmeta;
 }
 
+/* Restricts a song list query to the columns needed to encode the requested
+ * meta tags, plus what the reply loop itself looks at
+ */
+static void
+query_fields_set(struct query_params *qp, const struct dmap_field **meta, int nmeta, int sort_headers)
+{
+  int i;
+
+  for (i = 0; i < nmeta; i++)
+    {
+      if (!meta[i]->dfm)
+	break;
+
+      if (meta[i]->dfm->mfi_offset >= 0)
+	db_query_field_add(qp, meta[i]->dfm->mfi_offset);
+    }
+
+  db_query_field_add(qp, dbmfi_offsetof(fname));
+  db_query_field_add(qp, dbmfi_offsetof(codectype));
+  db_query_field_add(qp, dbmfi_offsetof(samplerate));
+  // For validating the cached records of the items
+  db_query_field_add(qp, dbmfi_offsetof(db_timestamp));
+
+  if (sort_headers)
+    {
+      db_query_field_add(qp, dbmfi_offsetof(title_sort));
+      db_query_field_add(qp, dbmfi_offsetof(artist_sort));
+      db_query_field_add(qp, dbmfi_offsetof(album_sort));
+      db_query_field_add(qp, dbmfi_offsetof(album_artist_sort));
+      db_query_field_add(qp, dbmfi_offsetof(composer_sort));
+    }
+}
+
 static void
 daap_reply_send(struct httpd_request *hreq, enum daap_reply_result result)
 {
   switch (result)
     {
+      case DAAP_REPLY_NOT_MODIFIED:
+	httpd_send_reply(hreq->req, HTTP_NOTMODIFIED, "Not Modified", NULL, HTTPD_SEND_NO_GZIP);
+	break;
       case DAAP_REPLY_LOGOUT:
 	httpd_send_reply(hreq->req, 204, "Logout Successful", hreq->reply, 0);
 	break;
@@ -976,7 +1315,9 @@ daap_reply_logout(struct httpd_request *hreq)
   if (!hreq->extra_data)
     return DAAP_REPLY_FORBIDDEN;
 
+  CHECK_ERR(L_DAAP, pthread_mutex_lock(&daap_sessions_lck));
   daap_session_remove(hreq->extra_data);
+  CHECK_ERR(L_DAAP, pthread_mutex_unlock(&daap_sessions_lck));
 
   hreq->extra_data = NULL;
 
@@ -1016,14 +1357,12 @@ daap_reply_update(struct httpd_request *hreq)
       return DAAP_REPLY_ERROR;
     }
 
-  if (reqd_rev == 1) /* Or revision is not valid */
+  /* Clients that are behind (or ask with 1 or a revision from before a
+   * restart) get the current revision right away
+   */
+  if (reqd_rev != current_rev)
     {
-      CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 32));
-
-      /* Send back current revision */
-      dmap_add_container(hreq->reply, "mupd", 24);
-      dmap_add_int(hreq->reply, "mstt", 200);         /* 12 */
-      dmap_add_int(hreq->reply, "musr", current_rev); /* 12 */
+      update_reply_make(hreq->reply, current_rev);
 
       return DAAP_REPLY_OK;
     }
@@ -1056,11 +1395,9 @@ daap_reply_update(struct httpd_request *hreq)
 	}
     }
 
-  /* NOTE: we may need to keep reqd_rev in there too */
   ur->req = hreq->req;
 
-  ur->next = update_requests;
-  update_requests = ur;
+  update_add(ur);
 
   /* If the connection fails before we have an update to push out
    * to the client, we need to know.
@@ -1153,21 +1490,207 @@ daap_reply_dblist(struct httpd_request *hreq)
   return DAAP_REPLY_OK;
 }
 
+/* For a song list request with a "delta" revision, restricts the query to the
+ * items that were added or changed since that revision, and makes an mudl
+ * container with the ids of the items that were deleted. Returns -1 if the
+ * full list must be sent.
+ */
+static int
+songlist_delta_set(struct query_params *qp, struct evbuffer **deleted, struct httpd_request *hreq)
+{
+  const char *param;
+  char *filter;
+  int *ids;
+  time_t t;
+  int delta;
+  int n;
+  int i;
+  int ret;
+
+  param = evhttp_find_header(hreq->query, "delta");
+  if (!param)
+    return -1;
+
+  ret = safe_atoi32(param, &delta);
+  if (ret < 0 || delta <= 0)
+    return -1;
+
+  ret = revision_time_get(&t, delta);
+  if (ret < 0)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Revision %d is too old for a delta song list, sending all items\n", delta);
+      return -1;
+    }
+
+  n = db_file_changes_deleted(t, &ids);
+  if (n < 0)
+    return -1;
+
+  CHECK_NULL(L_DAAP, *deleted = evbuffer_new());
+  CHECK_ERR(L_DAAP, evbuffer_expand(*deleted, 8 + 12 * n));
+
+  dmap_add_container(*deleted, "mudl", 12 * n);
+  for (i = 0; i < n; i++)
+    dmap_add_int(*deleted, "miid", ids[i]); /* 12 */
+
+  free(ids);
+
+  // Items are changed if they were saved by a scan or got enabled again
+  if (qp->filter)
+    filter = safe_asprintf("%s AND (f.db_timestamp >= %" PRIi64 " OR f.id IN (SELECT id FROM file_changes WHERE time >= %" PRIi64 " AND deleted = 0))", qp->filter, (int64_t)t, (int64_t)t);
+  else
+    filter = safe_asprintf("(f.db_timestamp >= %" PRIi64 " OR f.id IN (SELECT id FROM file_changes WHERE time >= %" PRIi64 " AND deleted = 0))", (int64_t)t, (int64_t)t);
+
+  free(qp->filter);
+  qp->filter = filter;
+
+  DPRINTF(E_DBG, L_DAAP, "Delta song list since revision %d, %d deleted items\n", delta, n);
+
+  return 0;
+}
+
+static void
+songlist_transcode_set(int *transcode, char **last_codectype, struct db_media_file_info *dbmfi, bool is_remote, const char *user_agent, const char *client_codecs)
+{
+  if (!dbmfi->codectype)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi->fname);
+
+      *transcode = 0;
+    }
+  else if (is_remote)
+    {
+      *transcode = 1;
+    }
+  else if (!*last_codectype || (strcmp(*last_codectype, dbmfi->codectype) != 0))
+    {
+      *transcode = transcode_needed(user_agent, client_codecs, dbmfi->codectype);
+
+      free(*last_codectype);
+      *last_codectype = strdup(dbmfi->codectype);
+    }
+}
+
+static void
+songlist_stream_free(struct songlist_stream *sls)
+{
+  db_query_end(&sls->qp);
+  free_query_params(&sls->qp, 1);
+  free(sls->meta);
+  free(sls->user_agent);
+  free(sls->client_codecs);
+  free(sls->last_codectype);
+  dmap_writer_free(&sls->songlist);
+  if (sls->header)
+    evbuffer_free(sls->header);
+  if (sls->trailer)
+    evbuffer_free(sls->trailer);
+  free(sls);
+}
+
+/* Thread: httpd */
+static int
+songlist_stream_cb(struct evbuffer *evbuf, void *arg)
+{
+  struct songlist_stream *sls = arg;
+  struct db_media_file_info dbmfi;
+  size_t len;
+  int ret;
+
+  if (!evbuf)
+    {
+      songlist_stream_free(sls);
+      return 0;
+    }
+
+  if (sls->header)
+    {
+      ret = db_query_start(&sls->qp);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not start query for chunked song list\n");
+	  return -1;
+	}
+
+      evbuffer_add_buffer(evbuf, sls->header);
+      evbuffer_free(sls->header);
+      sls->header = NULL;
+    }
+
+  while (evbuffer_get_length(evbuf) + sls->songlist.len < DAAP_SONGLIST_CHUNK_SIZE)
+    {
+      ret = db_query_fetch_file(&sls->qp, &dbmfi);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Error fetching results for chunked song list\n");
+	  return -1;
+	}
+
+      if (!dbmfi.id)
+	break;
+
+      songlist_transcode_set(&sls->transcode, &sls->last_codectype, &dbmfi, sls->is_remote, sls->user_agent, sls->client_codecs);
+
+      len = sls->songlist.len;
+
+      ret = dmap_encode_file_metadata(&sls->songlist, &dbmfi, sls->meta, sls->nmeta, sls->sort_headers, sls->transcode);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
+	  return -1;
+	}
+
+      // The container lengths have been sent, so if the library changed since
+      // we measured it, all we can do is give up
+      len = sls->songlist.len - len;
+      if (len > sls->remaining)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Library changed while sending song list, aborting\n");
+	  return -1;
+	}
+
+      sls->remaining -= len;
+    }
+
+  ret = dmap_writer_move(&sls->songlist, evbuf);
+  if (ret < 0)
+    return -1;
+
+  if (evbuffer_get_length(evbuf) >= DAAP_SONGLIST_CHUNK_SIZE)
+    return 0;
+
+  if (sls->remaining > 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Library changed while sending song list, aborting\n");
+      return -1;
+    }
+
+  if (sls->trailer)
+    evbuffer_add_buffer(evbuf, sls->trailer);
+
+  DPRINTF(E_DBG, L_DAAP, "Done sending chunked song list\n");
+
+  return 1;
+}
+
 static enum daap_reply_result
 daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 {
   struct query_params qp;
   struct db_media_file_info dbmfi;
-  struct evbuffer *song;
-  struct evbuffer *songlist;
+  struct dmap_writer songlist;
+  struct evbuffer *deleted;
   struct evkeyvalq *headers;
   struct daap_session *s;
   const struct dmap_field **meta;
   struct sort_ctx *sctx;
+  struct songlist_stream *sls;
   const char *param;
   const char *client_codecs;
   const char *tag;
   char *last_codectype;
+  size_t streamlen;
+  size_t dellen;
   size_t len;
   int nmeta;
   int sort_headers;
@@ -1198,12 +1721,16 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       query_params_set(&qp, &sort_headers, hreq, Q_ITEMS);
     }
 
-  CHECK_NULL(L_DAAP, songlist = evbuffer_new());
-  CHECK_NULL(L_DAAP, song = evbuffer_new());
+  meta = NULL;
+  deleted = NULL;
+  dellen = 0;
+
+  if (playlist == -1 && songlist_delta_set(&qp, &deleted, hreq) == 0)
+    dellen = evbuffer_get_length(deleted);
+
+  dmap_writer_init(&songlist, 0);
   CHECK_NULL(L_DAAP, sctx = daap_sort_context_new());
   CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 61));
-  CHECK_ERR(L_DAAP, evbuffer_expand(songlist, 4096));
-  CHECK_ERR(L_DAAP, evbuffer_expand(song, 512));
 
   param = evhttp_find_header(hreq->query, "meta");
   if (!param)
@@ -1220,21 +1747,25 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       if (nmeta < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
+	  meta = NULL;
 	  goto error;
 	}
     }
   else
-    {
-      meta = NULL;
-      nmeta = 0;
-    }
+    nmeta = 0;
+
+  // Without a meta list everything is sent, so then fetch all columns
+  if (nmeta > 0)
+    query_fields_set(&qp, meta, nmeta, sort_headers);
+
+  httpd_trace_phase("query");
 
   ret = db_query_start(&qp);
+  httpd_trace_phase("db");
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
 
-      free(meta);
       dmap_error_make(hreq->reply, tag, "Could not start query");
       goto error;
     }
@@ -1247,30 +1778,18 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
     }
 
   nsongs = 0;
+  streamlen = 0;
+  transcode = 0;
   last_codectype = NULL;
   while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
     {
-      nsongs++;
+      httpd_trace_phase("db");
 
-      if (!dbmfi.codectype)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
-
-	  transcode = 0;
-	}
-      else if (s->is_remote)
-	{
-	  transcode = 1;
-	}
-      else if (!last_codectype || (strcmp(last_codectype, dbmfi.codectype) != 0))
-	{
-	  transcode = transcode_needed(hreq->user_agent, client_codecs, dbmfi.codectype);
+      nsongs++;
 
-	  free(last_codectype);
-	  last_codectype = strdup(dbmfi.codectype);
-	}
+      songlist_transcode_set(&transcode, &last_codectype, &dbmfi, s->is_remote, hreq->user_agent, client_codecs);
 
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers, transcode);
+      ret = dmap_encode_file_metadata(&songlist, &dbmfi, meta, nmeta, sort_headers, transcode);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
@@ -1279,6 +1798,15 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	  break;
 	}
 
+      // Once the list gets too large we only measure it, the items will then
+      // be encoded again while the reply is sent in chunks (not possible for
+      // the cache, which has no request)
+      if (hreq->req && (streamlen > 0 || songlist.len > DAAP_SONGLIST_STREAM_BYTES))
+	{
+	  streamlen += songlist.len;
+	  dmap_writer_reset(&songlist);
+	}
+
       if (sort_headers)
 	{
 	  ret = daap_sort_build(sctx, dbmfi.title_sort);
@@ -1292,12 +1820,13 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
    	}
 
       DPRINTF(E_SPAM, L_DAAP, "Done with song\n");
+
+      httpd_trace_phase("encode");
     }
 
   DPRINTF(E_DBG, L_DAAP, "Done with song list, %d songs\n", nsongs);
 
   free(last_codectype);
-  free(meta);
   db_query_end(&qp);
 
   if (ret == -100)
@@ -1312,15 +1841,72 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       goto error;
     }
 
+  if (streamlen > 0)
+    {
+      DPRINTF(E_DBG, L_DAAP, "Song list is %zu bytes, sending it in chunks\n", streamlen);
+
+      CHECK_NULL(L_DAAP, sls = calloc(1, sizeof(struct songlist_stream)));
+
+      // The stream takes over the query params, meta and the songlist writer
+      sls->qp = qp;
+      sls->meta = meta;
+      sls->nmeta = nmeta;
+      sls->sort_headers = sort_headers;
+      sls->is_remote = s->is_remote;
+      sls->user_agent = safe_strdup(hreq->user_agent);
+      sls->client_codecs = safe_strdup(client_codecs);
+      sls->songlist = songlist;
+      CHECK_NULL(L_DAAP, sls->header = evbuffer_new());
+      sls->remaining = streamlen;
+
+      if (sort_headers)
+	{
+	  daap_sort_finalize(sctx);
+	  dmap_add_container(sls->header, tag, streamlen + dellen + evbuffer_get_length(sctx->headerlist) + 61);
+	}
+      else
+	dmap_add_container(sls->header, tag, streamlen + dellen + 53);
+
+      dmap_add_int(sls->header, "mstt", 200);        /* 12 */
+      dmap_add_char(sls->header, "muty", 0);         /* 9 */
+      dmap_add_int(sls->header, "mtco", qp.results); /* 12 */
+      dmap_add_int(sls->header, "mrco", nsongs);     /* 12 */
+      dmap_add_container(sls->header, "mlcl", streamlen); /* 8 */
+
+      // The deleted items (if a delta) and the sort headers follow the list
+      if (deleted || sort_headers)
+	CHECK_NULL(L_DAAP, sls->trailer = evbuffer_new());
+
+      if (deleted)
+	{
+	  CHECK_ERR(L_DAAP, evbuffer_add_buffer(sls->trailer, deleted));
+	  evbuffer_free(deleted);
+	}
+
+      if (sort_headers)
+	{
+	  dmap_add_container(sls->trailer, "mshl", evbuffer_get_length(sctx->headerlist)); /* 8 */
+	  CHECK_ERR(L_DAAP, evbuffer_add_buffer(sls->trailer, sctx->headerlist));
+	}
+
+      daap_sort_context_free(sctx);
+
+      httpd_send_reply_chunked(hreq->req, HTTP_OK, "OK", songlist_stream_cb, sls, 0);
+
+      return DAAP_REPLY_NONE;
+    }
+
+  free(meta);
+
   /* Add header to evbuf, add songlist to evbuf */
-  len = evbuffer_get_length(songlist);
+  len = songlist.len;
   if (sort_headers)
     {
       daap_sort_finalize(sctx);
-      dmap_add_container(hreq->reply, tag, len + evbuffer_get_length(sctx->headerlist) + 61);
+      dmap_add_container(hreq->reply, tag, len + dellen + evbuffer_get_length(sctx->headerlist) + 61);
     }
   else
-    dmap_add_container(hreq->reply, tag, len + 53);
+    dmap_add_container(hreq->reply, tag, len + dellen + 53);
 
   dmap_add_int(hreq->reply, "mstt", 200);        /* 12 */
   dmap_add_char(hreq->reply, "muty", 0);         /* 9 */
@@ -1328,7 +1914,13 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
   dmap_add_int(hreq->reply, "mrco", nsongs);     /* 12 */
   dmap_add_container(hreq->reply, "mlcl", len); /* 8 */
 
-  CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, songlist));
+  CHECK_ERR(L_DAAP, dmap_writer_move(&songlist, hreq->reply));
+
+  if (deleted)
+    {
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, deleted));
+      evbuffer_free(deleted);
+    }
 
   if (sort_headers)
     {
@@ -1339,16 +1931,17 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
     }
 
   daap_sort_context_free(sctx);
-  evbuffer_free(song);
-  evbuffer_free(songlist);
+  dmap_writer_free(&songlist);
   free_query_params(&qp, 1);
 
   return DAAP_REPLY_OK;
 
  error:
+  free(meta);
+  if (deleted)
+    evbuffer_free(deleted);
   daap_sort_context_free(sctx);
-  evbuffer_free(song);
-  evbuffer_free(songlist);
+  dmap_writer_free(&songlist);
   free_query_params(&qp, 1);
 
   return DAAP_REPLY_ERROR;
@@ -1437,7 +2030,10 @@ daap_reply_playlists(struct httpd_request *hreq)
       goto error;
     }
 
+  httpd_trace_phase("query");
+
   ret = db_query_start(&qp);
+  httpd_trace_phase("db");
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
@@ -1450,6 +2046,8 @@ daap_reply_playlists(struct httpd_request *hreq)
   npls = 0;
   while (((ret = db_query_fetch_pl(&qp, &dbpli, 1)) == 0) && (dbpli.id))
     {
+      httpd_trace_phase("db");
+
       plid = 1;
       if (safe_atoi32(dbpli.id, &plid) != 0)
 	continue;
@@ -1541,6 +2139,8 @@ daap_reply_playlists(struct httpd_request *hreq)
 
       DPRINTF(E_SPAM, L_DAAP, "Done with playlist\n");
 
+      httpd_trace_phase("encode");
+
       len = evbuffer_get_length(playlist);
       dmap_add_container(playlistlist, "mlit", len);
       ret = evbuffer_add_buffer(playlistlist, playlist);
@@ -1663,7 +2263,10 @@ daap_reply_groups(struct httpd_request *hreq)
       goto error;
     }
 
+  httpd_trace_phase("query");
+
   ret = db_query_start(&qp);
+  httpd_trace_phase("db");
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
@@ -1676,6 +2279,8 @@ daap_reply_groups(struct httpd_request *hreq)
   ngrp = 0;
   while ((ret = db_query_fetch_group(&qp, &dbgri)) == 0)
     {
+      httpd_trace_phase("db");
+
       /* Don't add item if no name (eg blank album name) */
       if (strlen(dbgri.itemname) == 0)
 	continue;
@@ -1740,6 +2345,8 @@ daap_reply_groups(struct httpd_request *hreq)
 
       DPRINTF(E_SPAM, L_DAAP, "Done with group\n");
 
+      httpd_trace_phase("encode");
+
       len = evbuffer_get_length(group);
       dmap_add_container(grouplist, "mlit", len);
       ret = evbuffer_add_buffer(grouplist, group);
@@ -1861,7 +2468,10 @@ daap_reply_browse(struct httpd_request *hreq)
   CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 52));
   CHECK_ERR(L_DAAP, evbuffer_expand(itemlist, 1024)); // Just a starting alloc, it'll expand as needed
 
+  httpd_trace_phase("query");
+
   ret = db_query_start(&qp);
+  httpd_trace_phase("db");
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
@@ -1873,6 +2483,8 @@ daap_reply_browse(struct httpd_request *hreq)
   nitems = 0;
   while (((ret = db_query_fetch_string_sort(&qp, &browse_item, &sort_item)) == 0) && (browse_item))
     {
+      httpd_trace_phase("db");
+
       nitems++;
 
       if (sort_headers)
@@ -1886,6 +2498,8 @@ daap_reply_browse(struct httpd_request *hreq)
 	}
 
       dmap_add_string(itemlist, "mlit", browse_item);
+
+      httpd_trace_phase("encode");
     }
 
   db_query_end(&qp);
@@ -1942,8 +2556,10 @@ daap_reply_extra_data(struct httpd_request *hreq)
 {
   struct evkeyvalq *headers;
   char clen[32];
+  char etag[96];
   const char *param;
   char *ctype;
+  bool is_group;
   size_t len;
   int id;
   int max_w;
@@ -1989,9 +2605,21 @@ daap_reply_extra_data(struct httpd_request *hreq)
       max_h = 0;
     }
 
-  if (strcmp(hreq->uri_parsed->path_parts[2], "groups") == 0)
+  is_group = (strcmp(hreq->uri_parsed->path_parts[2], "groups") == 0);
+
+  // The artwork can only change with the library or with the artwork cache,
+  // so clients (e.g. the web interface) can revalidate without us having to
+  // look up and rescale the image
+  snprintf(etag, sizeof(etag), "art-%c%d-%dx%d-%u-%u", is_group ? 'g' : 'i', id, max_w, max_h, db_revision_get(), cache_artwork_generation());
+
+  headers = evhttp_request_get_output_headers(hreq->req);
+  evhttp_add_header(headers, "Cache-Control", "private, max-age=3600");
+  if (httpd_etag_check(hreq->req, etag))
+    return DAAP_REPLY_NOT_MODIFIED;
+
+  if (is_group)
     ret = artwork_get_group(hreq->reply, id, max_w, max_h);
-  else if (strcmp(hreq->uri_parsed->path_parts[2], "items") == 0)
+  else
     ret = artwork_get_item(hreq->reply, id, max_w, max_h);
 
   len = evbuffer_get_length(hreq->reply);
@@ -2013,7 +2641,6 @@ daap_reply_extra_data(struct httpd_request *hreq)
 	goto no_artwork;
     }
 
-  headers = evhttp_request_get_output_headers(hreq->req);
   evhttp_remove_header(headers, "Content-Type");
   evhttp_add_header(headers, "Content-Type", ctype);
   snprintf(clen, sizeof(clen), "%ld", (long)len);
@@ -2226,6 +2853,7 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
   struct timespec start;
   struct timespec end;
   struct daap_session session;
+  struct daap_session session_copy;
   const char *param;
   int32_t id;
   int ret;
@@ -2250,10 +2878,11 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
       if (ret < 0)
 	DPRINTF(E_LOG, L_DAAP, "Ignoring non-numeric session id in DAAP request: '%s'\n", uri_parsed->uri);
       else
-	hreq->extra_data = daap_session_get(id);
+	hreq->extra_data = daap_session_find(id, httpd_request_is_deferred(req) ? &session_copy : NULL);
     }
 
   ret = daap_request_authorize(hreq);
+  httpd_trace_phase("auth");
   if (ret < 0)
     {
       httpd_send_error(req, 403, "Forbidden");
@@ -2283,6 +2912,7 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   // Try the cache
   ret = cache_daap_get(hreq->reply, uri_parsed->uri);
+  httpd_trace_phase("cache");
   if (ret == 0)
     {
       // The cache will return the data gzipped, so httpd_send_reply won't need to do it
@@ -2297,7 +2927,9 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
   // No dice, let's call the handler so it can construct a reply and then send it (note that the reply may be an error)
   clock_gettime(CLOCK_MONOTONIC, &start);
 
+  db_arena_begin();
   ret = hreq->handler(hreq);
+  db_arena_end();
 
   daap_reply_send(hreq, ret);
 
@@ -2344,14 +2976,7 @@ daap_is_request(const char *path)
 int
 daap_session_is_valid(int id)
 {
-  struct daap_session *session;
-
-  session = daap_session_get(id);
-
-  if (session)
-    session->mtime = time(NULL);
-
-  return session ? 1 : 0;
+  return daap_session_find(id, NULL) ? 1 : 0;
 }
 
 // Thread: Cache
@@ -2386,7 +3011,9 @@ daap_reply_build(const char *uri, const char *user_agent, int is_remote)
 
   CHECK_NULL(L_DAAP, hreq->reply = evbuffer_new());
 
+  db_arena_begin();
   ret = hreq->handler(hreq);
+  db_arena_end();
   if (ret < 0)
     {
       evbuffer_free(hreq->reply);
@@ -2411,9 +3038,12 @@ daap_init(void)
   int ret;
 
   srand((unsigned)time(NULL));
-  current_rev = 2;
+  current_rev = 1;
   update_requests = NULL;
 
+  memset(daap_revisions, 0, sizeof(daap_revisions));
+  revision_new();
+
   for (i = 0; daap_handlers[i].handler; i++)
     {
       ret = regcomp(&daap_handlers[i].preg, daap_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
@@ -2426,7 +3056,60 @@ daap_init(void)
         }
     }
 
+#ifdef HAVE_EVENTFD
+  update_efd = eventfd(0, EFD_CLOEXEC);
+  if (update_efd < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not create update eventfd: %s\n", strerror(errno));
+
+      goto fd_fail;
+    }
+
+  updateev = event_new(evbase_httpd, update_efd, EV_READ, update_notify_cb, NULL);
+#else
+# ifdef HAVE_PIPE2
+  ret = pipe2(update_pipe, O_CLOEXEC);
+# else
+  ret = pipe(update_pipe);
+# endif
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not create update pipe: %s\n", strerror(errno));
+
+      goto fd_fail;
+    }
+
+  updateev = event_new(evbase_httpd, update_pipe[0], EV_READ, update_notify_cb, NULL);
+#endif /* HAVE_EVENTFD */
+  update_coalesce_ev = evtimer_new(evbase_httpd, update_coalesce_cb, NULL);
+  if (!updateev || !update_coalesce_ev)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not create update event\n");
+
+      goto event_fail;
+    }
+  event_add(updateev, NULL);
+
+  listener_add(daap_library_update_handler, LISTENER_DATABASE, NULL);
+
   return 0;
+
+ event_fail:
+  if (updateev)
+    event_free(updateev);
+  if (update_coalesce_ev)
+    event_free(update_coalesce_ev);
+#ifdef HAVE_EVENTFD
+  close(update_efd);
+#else
+  close(update_pipe[0]);
+  close(update_pipe[1]);
+#endif
+ fd_fail:
+  for (i = 0; daap_handlers[i].handler; i++)
+    regfree(&daap_handlers[i].preg);
+
+  return -1;
 }
 
 void
@@ -2437,6 +3120,8 @@ daap_deinit(void)
   struct evhttp_connection *evcon;
   int i;
 
+  listener_remove(daap_library_update_handler);
+
   for (i = 0; daap_handlers[i].handler; i++)
     regfree(&daap_handlers[i].preg);
 
@@ -2446,6 +3131,10 @@ daap_deinit(void)
       daap_session_free(s);
     }
 
+  daap_sessions_tail = NULL;
+  daap_sessions_count = 0;
+  memset(daap_session_hash, 0, sizeof(daap_session_hash));
+
   for (ur = update_requests; update_requests; ur = update_requests)
     {
       update_requests = ur->next;
@@ -2459,4 +3148,14 @@ daap_deinit(void)
 
       update_free(ur);
     }
+
+  event_free(update_coalesce_ev);
+  event_free(updateev);
+
+#ifdef HAVE_EVENTFD
+  close(update_efd);
+#else
+  close(update_pipe[0]);
+  close(update_pipe[1]);
+#endif
 }
@@ -43,6 +43,7 @@
 #include "misc.h"
 #include "conffile.h"
 #include "artwork.h"
+#include "cache.h"
 #include "dmap_common.h"
 #include "db.h"
 #include "daap_query.h"
@@ -58,6 +59,50 @@ struct dacp_update_request {
   struct dacp_update_request *next;
 };
 
+/* A reply that is made once and then added to the replies of all the clients
+ * by reference, see dacp_shared_add()
+ */
+struct dacp_shared_reply {
+  int refcount;
+  size_t len;
+  uint8_t data[];
+};
+
+/* Now playing artwork at one of the sizes that the clients asked for */
+struct dacp_artwork_entry {
+  uint32_t id;
+  int max_w;
+  int max_h;
+  int format;
+  struct dacp_shared_reply *reply;
+};
+
+/* The Up Next items of playqueue-contents, encoded once per queue revision and
+ * now playing item. Replies take the first items of it, as many as the span.
+ */
+struct dacp_queue_reply {
+  unsigned int queue_revision;
+  uint32_t item_id;
+  uint32_t plid;
+  char shuffle;
+
+  /* False if the now playing item was not found in the queue */
+  bool found;
+
+  /* Number of items, and where each of them ends in the reply */
+  int count;
+  size_t *item_end;
+
+  struct dacp_shared_reply *reply;
+};
+
+/* Remote asks for the status again right after it got it through the update
+ * request, so a status made less than this many seconds ago is reused
+ */
+#define DACP_PLAYSTATUS_MAXAGE 1
+/* Number of now playing artwork sizes we keep */
+#define DACP_ARTWORK_CACHE 4
+
 typedef void (*dacp_propget)(struct evbuffer *evbuf, struct player_status *status, struct db_queue_item *queue_item);
 typedef void (*dacp_propset)(const char *value, struct evkeyvalq *query);
 
@@ -136,6 +181,17 @@ static int current_rev;
 /* Play status update requests */
 static struct dacp_update_request *update_requests;
 
+/* The current play status and now playing artwork, made once per player state
+ * change and shared by all the clients. Only used by the httpd thread.
+ */
+static struct dacp_shared_reply *playstatus_reply;
+static time_t playstatus_reply_time;
+static struct dacp_artwork_entry artwork_cache[DACP_ARTWORK_CACHE];
+static int artwork_cache_next;
+
+/* Encoded queue for playqueue-contents, also only used by the httpd thread */
+static struct dacp_queue_reply queue_reply;
+
 /* Seek timer */
 static struct event *seek_timer;
 static int seek_target;
@@ -578,6 +634,216 @@ dacp_request_authorize(struct httpd_request *hreq)
 }
 
 
+/* ----------------------------- SHARED REPLIES ----------------------------- */
+
+static struct dacp_shared_reply *
+dacp_shared_new(struct evbuffer *evbuf)
+{
+  struct dacp_shared_reply *sr;
+  size_t len;
+
+  len = evbuffer_get_length(evbuf);
+
+  sr = malloc(sizeof(struct dacp_shared_reply) + len);
+  if (!sr)
+    {
+      DPRINTF(E_LOG, L_DACP, "Out of memory for shared reply\n");
+      return NULL;
+    }
+
+  sr->refcount = 1;
+  sr->len = evbuffer_remove(evbuf, sr->data, len);
+
+  return sr;
+}
+
+static void
+dacp_shared_unref_cb(const void *data, size_t datalen, void *extra)
+{
+  struct dacp_shared_reply *sr = extra;
+
+  sr->refcount--;
+  if (sr->refcount == 0)
+    free(sr);
+}
+
+static void
+dacp_shared_unref(struct dacp_shared_reply **sr)
+{
+  if (!*sr)
+    return;
+
+  dacp_shared_unref_cb((*sr)->data, (*sr)->len, *sr);
+  *sr = NULL;
+}
+
+/* Adds the first len bytes of the shared reply */
+static int
+dacp_shared_add_part(struct evbuffer *evbuf, struct dacp_shared_reply *sr, size_t len)
+{
+  int ret;
+
+  sr->refcount++;
+
+  ret = evbuffer_add_reference(evbuf, sr->data, len, dacp_shared_unref_cb, sr);
+  if (ret < 0)
+    sr->refcount--;
+
+  return ret;
+}
+
+static int
+dacp_shared_add(struct evbuffer *evbuf, struct dacp_shared_reply *sr)
+{
+  return dacp_shared_add_part(evbuf, sr, sr->len);
+}
+
+static void
+artwork_cache_clear(void)
+{
+  int i;
+
+  for (i = 0; i < DACP_ARTWORK_CACHE; i++)
+    dacp_shared_unref(&artwork_cache[i].reply);
+
+  artwork_cache_next = 0;
+}
+
+static struct dacp_artwork_entry *
+artwork_cache_get(uint32_t id, int max_w, int max_h)
+{
+  int i;
+
+  for (i = 0; i < DACP_ARTWORK_CACHE; i++)
+    {
+      if (artwork_cache[i].reply && artwork_cache[i].id == id && artwork_cache[i].max_w == max_w && artwork_cache[i].max_h == max_h)
+	return &artwork_cache[i];
+    }
+
+  return NULL;
+}
+
+static struct dacp_artwork_entry *
+artwork_cache_add(uint32_t id, int max_w, int max_h, int format, struct evbuffer *evbuf)
+{
+  struct dacp_artwork_entry *entry;
+
+  entry = &artwork_cache[artwork_cache_next];
+  artwork_cache_next = (artwork_cache_next + 1) % DACP_ARTWORK_CACHE;
+
+  dacp_shared_unref(&entry->reply);
+
+  entry->reply = dacp_shared_new(evbuf);
+  if (!entry->reply)
+    return NULL;
+
+  entry->id = id;
+  entry->max_w = max_w;
+  entry->max_h = max_h;
+  entry->format = format;
+
+  return entry;
+}
+
+static void
+queue_reply_clear(void)
+{
+  dacp_shared_unref(&queue_reply.reply);
+  free(queue_reply.item_end);
+
+  memset(&queue_reply, 0, sizeof(struct dacp_queue_reply));
+}
+
+/* Encodes the items after the now playing item, unless the cached ones are
+ * still current
+ */
+static int
+queue_reply_get(struct player_status *status)
+{
+  struct query_params qp;
+  struct db_queue_item queue_item;
+  struct evbuffer *songlist;
+  unsigned int queue_revision;
+  size_t *item_end;
+  int size;
+  int count;
+  int ret;
+
+  // Read before the queue, so changes while enumerating make the result stale
+  queue_revision = db_queue_revision_get();
+
+  if (queue_reply.reply && queue_reply.queue_revision == queue_revision && queue_reply.item_id == status->item_id
+      && queue_reply.plid == status->plid && queue_reply.shuffle == status->shuffle)
+    return 0;
+
+  queue_reply_clear();
+
+  memset(&qp, 0, sizeof(struct query_params));
+
+  if (status->shuffle)
+    qp.sort = S_SHUFFLE_POS;
+
+  ret = db_queue_enum_start(&qp);
+  if (ret < 0)
+    return -1;
+
+  CHECK_NULL(L_DACP, songlist = evbuffer_new());
+
+  item_end = NULL;
+  size = 0;
+  count = 0; // Position in the queue relative to the now playing item
+  while ((db_queue_enum_fetch(&qp, &queue_item) == 0) && (queue_item.id > 0))
+    {
+      if (status->item_id == 0 || status->item_id == queue_item.id)
+	{
+	  count = 1;
+	}
+      else if (count > 0)
+	{
+	  ret = playqueuecontents_add_queue_item(songlist, &queue_item, count, status->plid);
+	  if (ret < 0)
+	    goto error;
+
+	  if (count > size)
+	    {
+	      size = size ? 2 * size : 64;
+	      CHECK_NULL(L_DACP, item_end = realloc(item_end, size * sizeof(size_t)));
+	    }
+
+	  item_end[count - 1] = evbuffer_get_length(songlist);
+	  count++;
+	}
+    }
+
+  db_queue_enum_end(&qp);
+
+  queue_reply.reply = dacp_shared_new(songlist);
+  evbuffer_free(songlist);
+  if (!queue_reply.reply)
+    {
+      free(item_end);
+      return -1;
+    }
+
+  queue_reply.queue_revision = queue_revision;
+  queue_reply.item_id = status->item_id;
+  queue_reply.plid = status->plid;
+  queue_reply.shuffle = status->shuffle;
+  queue_reply.found = (count > 0);
+  queue_reply.count = (count > 0) ? count - 1 : 0;
+  queue_reply.item_end = item_end;
+
+  return 0;
+
+ error:
+  db_queue_enum_end(&qp);
+  evbuffer_free(songlist);
+  free(item_end);
+
+  return -1;
+}
+
+
 /* ---------------------- UPDATE REQUESTS HANDLERS -------------------------- */
 
 static int
@@ -646,15 +912,43 @@ make_playstatusupdate(struct evbuffer *evbuf)
   return 0;
 }
 
+/* Gets the current play status, made at most DACP_PLAYSTATUS_MAXAGE ago, or
+ * made now if force is set. Returns NULL on error.
+ */
+static struct dacp_shared_reply *
+playstatus_reply_get(bool force)
+{
+  struct evbuffer *update;
+  time_t now;
+  int ret;
+
+  now = time(NULL);
+  if (playstatus_reply && !force && (now - playstatus_reply_time < DACP_PLAYSTATUS_MAXAGE))
+    return playstatus_reply;
+
+  dacp_shared_unref(&playstatus_reply);
+
+  CHECK_NULL(L_DACP, update = evbuffer_new());
+
+  ret = make_playstatusupdate(update);
+  if (ret == 0)
+    {
+      playstatus_reply = dacp_shared_new(update);
+      playstatus_reply_time = now;
+    }
+
+  evbuffer_free(update);
+
+  return playstatus_reply;
+}
+
 static void
 playstatusupdate_cb(int fd, short what, void *arg)
 {
   struct dacp_update_request *ur;
+  struct dacp_shared_reply *sr;
   struct evbuffer *evbuf;
-  struct evbuffer *update;
   struct evhttp_connection *evcon;
-  uint8_t *buf;
-  size_t len;
   int ret;
 
 #ifdef HAVE_EVENTFD
@@ -673,19 +967,20 @@ playstatusupdate_cb(int fd, short what, void *arg)
   read(update_pipe[0], &dummy, sizeof(dummy));
 #endif
 
+  // The status and the now playing artwork are made again on the next request
+  dacp_shared_unref(&playstatus_reply);
+  artwork_cache_clear();
+
   if (!update_requests)
     goto readd;
 
-  CHECK_NULL(L_DACP, evbuf = evbuffer_new());
-  CHECK_NULL(L_DACP, update = evbuffer_new());
-
   current_rev++;
 
-  ret = make_playstatusupdate(update);
-  if (ret < 0)
-    goto out_free_update;
+  sr = playstatus_reply_get(true);
+  if (!sr)
+    goto readd;
 
-  len = evbuffer_get_length(update);
+  CHECK_NULL(L_DACP, evbuf = evbuffer_new());
 
   for (ur = update_requests; update_requests; ur = update_requests)
     {
@@ -695,21 +990,15 @@ playstatusupdate_cb(int fd, short what, void *arg)
       if (evcon)
 	evhttp_connection_set_closecb(evcon, NULL, NULL);
 
-      // Only copy buffer if we actually need to reuse it
-      if (ur->next)
-	{
-	  buf = evbuffer_pullup(update, -1);
-	  evbuffer_add(evbuf, buf, len);
-	  httpd_send_reply(ur->req, HTTP_OK, "OK", evbuf, 0);
-	}
+      ret = dacp_shared_add(evbuf, sr);
+      if (ret < 0)
+	httpd_send_error(ur->req, 500, "Internal Server Error");
       else
-	httpd_send_reply(ur->req, HTTP_OK, "OK", update, 0);
+	httpd_send_reply(ur->req, HTTP_OK, "OK", evbuf, 0);
 
       free(ur);
     }
 
- out_free_update:
-  evbuffer_free(update);
   evbuffer_free(evbuf);
  readd:
   ret = event_add(updateev, NULL);
@@ -1629,8 +1918,6 @@ dacp_reply_playqueuecontents(struct httpd_request *hreq)
   int count;
   int ret;
   int start_index;
-  struct query_params qp;
-  struct db_queue_item queue_item;
 
   /* /ctrl-int/1/playqueue-contents?span=50&session-id=... */
 
@@ -1683,33 +1970,18 @@ dacp_reply_playqueuecontents(struct httpd_request *hreq)
     }
   else
     {
-      memset(&qp, 0, sizeof(struct query_params));
-
-      if (status.shuffle)
-	qp.sort = S_SHUFFLE_POS;
-
-      ret = db_queue_enum_start(&qp);
+      ret = queue_reply_get(&status);
       if (ret < 0)
 	goto error;
 
-      //FIXME [queue] Check count value
-      while ((db_queue_enum_fetch(&qp, &queue_item) == 0) && (queue_item.id > 0))
+      if (queue_reply.found)
 	{
-	  if (status.item_id == 0 || status.item_id == queue_item.id)
-	    {
-	      count = 1;
-	    }
-	  else if (count > 0)
-	    {
-	      ret = playqueuecontents_add_queue_item(songlist, &queue_item, count, status.plid);
-	      if (ret < 0)
-		goto error;
+	  count = (span < queue_reply.count) ? span : queue_reply.count;
+	  if (count > 0)
+	    CHECK_ERR(L_DACP, dacp_shared_add_part(songlist, queue_reply.reply, queue_reply.item_end[count - 1]));
 
-	      count++;
-	    }
+	  count++;
 	}
-
-      db_queue_enum_end(&qp);
     }
 
   /* Playlists are hist, curr and main. */
@@ -2110,6 +2382,7 @@ static int
 dacp_reply_playstatusupdate(struct httpd_request *hreq)
 {
   struct dacp_update_request *ur;
+  struct dacp_shared_reply *sr;
   struct evhttp_connection *evcon;
   const char *param;
   int reqd_rev;
@@ -2139,13 +2412,15 @@ dacp_reply_playstatusupdate(struct httpd_request *hreq)
 
   if ((reqd_rev == 0) || (reqd_rev == 1))
     {
-      ret = make_playstatusupdate(hreq->reply);
-      if (ret < 0)
-	httpd_send_error(hreq->req, 500, "Internal Server Error");
-      else
-	httpd_send_reply(hreq->req, HTTP_OK, "OK", hreq->reply, 0);
+      sr = playstatus_reply_get(false);
+      if (!sr || (dacp_shared_add(hreq->reply, sr) < 0))
+	{
+	  httpd_send_error(hreq->req, 500, "Internal Server Error");
+	  return -1;
+	}
 
-      return ret;
+      httpd_send_reply(hreq->req, HTTP_OK, "OK", hreq->reply, 0);
+      return 0;
     }
 
   /* Else, just let the request hang until we have changes to push back */
@@ -2177,7 +2452,9 @@ static int
 dacp_reply_nowplayingartwork(struct httpd_request *hreq)
 {
   char clen[32];
+  char etag[64];
   struct evkeyvalq *headers;
+  struct dacp_artwork_entry *entry;
   const char *param;
   char *ctype;
   size_t len;
@@ -2222,7 +2499,33 @@ dacp_reply_nowplayingartwork(struct httpd_request *hreq)
   if (ret < 0)
     goto no_artwork;
 
-  ret = artwork_get_item(hreq->reply, id, max_w, max_h);
+  // Remotes poll this on every status change, mostly for the same track
+  snprintf(etag, sizeof(etag), "np-%u-%dx%d-%u-%u", id, max_w, max_h, db_revision_get(), cache_artwork_generation());
+
+  headers = evhttp_request_get_output_headers(hreq->req);
+  if (httpd_etag_check(hreq->req, etag))
+    {
+      httpd_send_reply(hreq->req, HTTP_NOTMODIFIED, "Not Modified", NULL, HTTPD_SEND_NO_GZIP);
+      return 0;
+    }
+
+  // All the Remotes ask for the same sizes, so the artwork is only rescaled
+  // for the first one after a change
+  entry = artwork_cache_get(id, max_w, max_h);
+  if (!entry)
+    {
+      ret = artwork_get_item(hreq->reply, id, max_w, max_h);
+      if ((ret == ART_FMT_PNG || ret == ART_FMT_JPEG) && (entry = artwork_cache_add(id, max_w, max_h, ret, hreq->reply)))
+	DPRINTF(E_DBG, L_DACP, "Cached now playing artwork for %u at %dx%d\n", id, max_w, max_h);
+    }
+
+  if (entry)
+    {
+      ret = entry->format;
+      if (dacp_shared_add(hreq->reply, entry->reply) < 0)
+	ret = -1;
+    }
+
   len = evbuffer_get_length(hreq->reply);
 
   switch (ret)
@@ -2242,7 +2545,6 @@ dacp_reply_nowplayingartwork(struct httpd_request *hreq)
 	goto no_artwork;
     }
 
-  headers = evhttp_request_get_output_headers(hreq->req);
   evhttp_remove_header(headers, "Content-Type");
   evhttp_add_header(headers, "Content-Type", ctype);
   snprintf(clen, sizeof(clen), "%ld", (long)len);
@@ -2629,7 +2931,9 @@ dacp_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   CHECK_NULL(L_DACP, hreq->reply = evbuffer_new());
 
+  db_arena_begin();
   hreq->handler(hreq);
+  db_arena_end();
 
   evbuffer_free(hreq->reply);
   free(hreq);
@@ -2711,7 +3015,7 @@ dacp_init(void)
       return -1;
     }
 
-  listener_add(dacp_playstatus_update_handler, LISTENER_PLAYER);
+  listener_add(dacp_playstatus_update_handler, LISTENER_PLAYER, NULL);
 
   return 0;
 
@@ -2736,6 +3040,10 @@ dacp_deinit(void)
 
   event_free(seek_timer);
 
+  dacp_shared_unref(&playstatus_reply);
+  artwork_cache_clear();
+  queue_reply_clear();
+
   for (i = 0; dacp_handlers[i].handler; i++)
     regfree(&dacp_handlers[i].preg);
 
@@ -31,10 +31,14 @@
 #endif
 #include <json.h>
 #include <regex.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "httpd_jsonapi.h"
+#include "cache.h"
 #include "conffile.h"
 #include "db.h"
 #ifdef LASTFM
@@ -180,6 +184,122 @@ jsonapi_reply_config(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+/*
+ * Endpoint to retrieve the database statement timing statistics
+ */
+static int
+jsonapi_reply_query_stats(struct httpd_request *hreq)
+{
+  struct db_query_stats *stats;
+  json_object *reply;
+  json_object *queries;
+  json_object *query;
+  int threshold_ms;
+  int nstats;
+  int i;
+
+  nstats = db_query_stats_get(&stats, &threshold_ms);
+  if (nstats < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Error getting query stats.\n");
+      return HTTP_INTERNAL;
+    }
+
+  reply = json_object_new_object();
+
+  json_object_object_add(reply, "enabled", json_object_new_boolean(threshold_ms > 0));
+  json_object_object_add(reply, "slow_query_threshold_ms", json_object_new_int(threshold_ms));
+
+  queries = json_object_new_array();
+  for (i = 0; i < nstats; i++)
+    {
+      query = json_object_new_object();
+      json_object_object_add(query, "query", json_object_new_string(stats[i].query));
+      json_object_object_add(query, "count", json_object_new_int64(stats[i].count));
+      json_object_object_add(query, "total_us", json_object_new_int64(stats[i].total_usec));
+      json_object_object_add(query, "avg_us", json_object_new_int64(stats[i].total_usec / stats[i].count));
+      json_object_object_add(query, "max_us", json_object_new_int64(stats[i].max_usec));
+      json_object_array_add(queries, query);
+    }
+  json_object_object_add(reply, "queries", queries);
+
+  db_query_stats_free(stats, nstats);
+
+  nstats = db_index_patterns_get(&stats);
+  if (nstats < 0)
+    {
+      jparse_free(reply);
+      return HTTP_INTERNAL;
+    }
+
+  queries = json_object_new_array();
+  for (i = 0; i < nstats; i++)
+    {
+      query = json_object_new_object();
+      json_object_object_add(query, "pattern", json_object_new_string(stats[i].query));
+      json_object_object_add(query, "count", json_object_new_int64(stats[i].count));
+      json_object_object_add(query, "total_us", json_object_new_int64(stats[i].total_usec));
+      json_object_array_add(queries, query);
+    }
+  json_object_object_add(reply, "index_patterns", queries);
+
+  db_query_stats_free(stats, nstats);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply)));
+
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+/*
+ * Endpoints to get and set the threshold of the slow request log
+ */
+static int
+jsonapi_reply_request_trace(struct httpd_request *hreq)
+{
+  json_object *reply;
+  int threshold_ms;
+
+  threshold_ms = httpd_trace_threshold_get();
+
+  reply = json_object_new_object();
+
+  json_object_object_add(reply, "enabled", json_object_new_boolean(threshold_ms > 0));
+  json_object_object_add(reply, "slow_request_threshold_ms", json_object_new_int(threshold_ms));
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply)));
+
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_request_trace_set(struct httpd_request *hreq)
+{
+  const char *param;
+  int threshold_ms;
+  int ret;
+
+  param = evhttp_find_header(hreq->query, "slow_request_threshold_ms");
+  if (!param)
+    return HTTP_BADREQUEST;
+
+  ret = safe_atoi32(param, &threshold_ms);
+  if (ret < 0 || threshold_ms < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Invalid slow request threshold '%s'\n", param);
+      return HTTP_BADREQUEST;
+    }
+
+  httpd_trace_threshold_set(threshold_ms);
+
+  DPRINTF(E_LOG, L_WEB, "Slow request threshold set to %d ms\n", threshold_ms);
+
+  return HTTP_NOCONTENT;
+}
+
 /*
  * Endpoint to retrieve informations about the library
  *
@@ -190,7 +310,9 @@ jsonapi_reply_config(struct httpd_request *hreq)
  *  "albums": 151,
  *  "songs": 3085,
  *  "db_playtime": 687824,
- *  "updating": false
+ *  "updating": false,
+ *  "scan": { "running": false, "elapsed_sec": 41, "dirs_visited": 312, ... },
+ *  "daap_cache": { "memory_hits": 120, "db_hits": 4, "misses": 9, ... }
  *}
  */
 static int
@@ -198,10 +320,14 @@ jsonapi_reply_library(struct httpd_request *hreq)
 {
   struct query_params qp;
   struct filecount_info fci;
+  struct library_scan_stats stats;
+  struct cache_daap_stats cache_stats;
   int artists;
   int albums;
   bool is_scanning;
   json_object *jreply;
+  json_object *jscan;
+  json_object *jcache;
   int ret;
 
   // Fetch values for response
@@ -229,6 +355,47 @@ jsonapi_reply_library(struct httpd_request *hreq)
   json_object_object_add(jreply, "db_playtime", json_object_new_int64((fci.length / 1000)));
   json_object_object_add(jreply, "updating", json_object_new_boolean(is_scanning));
 
+  library_scan_stats_get(&stats);
+  if (stats.start)
+    {
+      CHECK_NULL(L_WEB, jscan = json_object_new_object());
+
+      json_object_object_add(jscan, "running", json_object_new_boolean(stats.running));
+      json_object_object_add(jscan, "elapsed_sec", json_object_new_int64((stats.running ? time(NULL) : stats.end) - stats.start));
+      json_object_object_add(jscan, "dirs_visited", json_object_new_int64(stats.dirs_visited));
+      json_object_object_add(jscan, "files_probed", json_object_new_int64(stats.files_probed));
+      json_object_object_add(jscan, "files_skipped", json_object_new_int64(stats.files_skipped));
+      json_object_object_add(jscan, "files_saved", json_object_new_int64(stats.files_saved));
+      json_object_object_add(jscan, "files_per_sec", json_object_new_double(stats.files_per_sec));
+      json_object_object_add(jscan, "eta_sec", json_object_new_int(stats.eta_sec));
+      json_object_object_add(jscan, "probe_p50_us", json_object_new_int64(stats.probe_usec_p50));
+      json_object_object_add(jscan, "probe_p90_us", json_object_new_int64(stats.probe_usec_p90));
+      json_object_object_add(jscan, "probe_p99_us", json_object_new_int64(stats.probe_usec_p99));
+      json_object_object_add(jscan, "probe_max_us", json_object_new_int64(stats.probe_usec_max));
+      if (stats.probe_slowest)
+	json_object_object_add(jscan, "probe_slowest", json_object_new_string(stats.probe_slowest));
+      json_object_object_add(jscan, "db_write_ms", json_object_new_int64(stats.db_write_usec / 1000));
+
+      json_object_object_add(jreply, "scan", jscan);
+    }
+
+  free(stats.probe_slowest);
+
+  cache_daap_stats_get(&cache_stats);
+
+  CHECK_NULL(L_WEB, jcache = json_object_new_object());
+  json_object_object_add(jcache, "memory_hits", json_object_new_int64(cache_stats.mem_hits));
+  json_object_object_add(jcache, "db_hits", json_object_new_int64(cache_stats.db_hits));
+  json_object_object_add(jcache, "misses", json_object_new_int64(cache_stats.misses));
+  json_object_object_add(jcache, "memory_evictions", json_object_new_int64(cache_stats.mem_evictions));
+  json_object_object_add(jcache, "memory_entries", json_object_new_int(cache_stats.mem_entries));
+  json_object_object_add(jcache, "memory_bytes", json_object_new_int64(cache_stats.mem_bytes));
+  json_object_object_add(jcache, "record_hits", json_object_new_int64(cache_stats.record_hits));
+  json_object_object_add(jcache, "record_misses", json_object_new_int64(cache_stats.record_misses));
+  json_object_object_add(jcache, "record_entries", json_object_new_int(cache_stats.record_entries));
+  json_object_object_add(jcache, "record_bytes", json_object_new_int64(cache_stats.record_bytes));
+  json_object_object_add(jreply, "daap_cache", jcache);
+
   CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
 
   jparse_free(jreply);
@@ -477,12 +644,98 @@ jsonapi_reply_lastfm_logout(struct httpd_request *hreq)
   return HTTP_NOCONTENT;
 }
 
+/*
+ * Reads the "offset" and "limit" query parameters of list endpoints. A limit
+ * of 0 means no limit.
+ */
+static int
+paging_get(struct httpd_request *hreq, int *offset, int *limit)
+{
+  const char *param;
+
+  *offset = 0;
+  *limit = 0;
+
+  param = evhttp_find_header(hreq->query, "offset");
+  if (param && (safe_atoi32(param, offset) < 0 || *offset < 0))
+    {
+      DPRINTF(E_LOG, L_WEB, "Invalid value for query parameter 'offset' (%s)\n", param);
+      return -1;
+    }
+
+  param = evhttp_find_header(hreq->query, "limit");
+  if (param && (safe_atoi32(param, limit) < 0 || *limit < 0))
+    {
+      DPRINTF(E_LOG, L_WEB, "Invalid value for query parameter 'limit' (%s)\n", param);
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * Checks if name is in the comma separated list of the "fields" query
+ * parameter. All fields are wanted if the parameter is not given.
+ */
+static bool
+field_wanted(const char *fields, const char *name)
+{
+  const char *p;
+  size_t len;
+
+  if (!fields)
+    return true;
+
+  len = strlen(name);
+  for (p = fields; (p = strstr(p, name)); p += len)
+    {
+      if ((p == fields || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))
+	return true;
+    }
+
+  return false;
+}
+
+/*
+ * Returns a copy of obj with only the keys that are in fields (and takes over
+ * obj, so the caller shouldn't free it)
+ */
+static json_object *
+fields_filter(json_object *obj, const char *fields)
+{
+  json_object *filtered;
+
+  if (!fields)
+    return obj;
+
+  filtered = json_object_new_object();
+
+  json_object_object_foreach(obj, key, val)
+    {
+      if (field_wanted(fields, key))
+	json_object_object_add(filtered, key, json_object_get(val));
+    }
+
+  jparse_free(obj);
+
+  return filtered;
+}
+
 struct outputs_param
 {
   json_object *output;
   uint64_t output_id;
 };
 
+struct outputs_list
+{
+  json_object *outputs;
+  const char *fields;
+  int offset;
+  int limit;
+  int count;
+};
+
 static json_object *
 speaker_to_json(struct spk_info *spk)
 {
@@ -500,6 +753,7 @@ speaker_to_json(struct spk_info *spk)
   json_object_object_add(output, "requires_auth", json_object_new_boolean(spk->requires_auth));
   json_object_object_add(output, "needs_auth_key", json_object_new_boolean(spk->needs_auth_key));
   json_object_object_add(output, "volume", json_object_new_int(spk->absvol));
+  json_object_object_add(output, "offset_ms", json_object_new_int(spk->offset_ms));
 
   return output;
 }
@@ -507,13 +761,16 @@ speaker_to_json(struct spk_info *spk)
 static void
 speaker_enum_cb(struct spk_info *spk, void *arg)
 {
-  json_object *outputs;
+  struct outputs_list *list = arg;
   json_object *output;
+  int n;
 
-  outputs = arg;
+  n = list->count++;
+  if ((n < list->offset) || (list->limit > 0 && n >= list->offset + list->limit))
+    return;
 
-  output = speaker_to_json(spk);
-  json_object_array_add(outputs, output);
+  output = fields_filter(speaker_to_json(spk), list->fields);
+  json_object_array_add(list->outputs, output);
 }
 
 static void
@@ -575,6 +832,7 @@ jsonapi_reply_outputs_put_byid(struct httpd_request *hreq)
   json_object* request;
   bool selected;
   int volume;
+  int offset_ms;
   int ret;
 
   ret = safe_atou64(hreq->uri_parsed->path_parts[2], &output_id);
@@ -611,6 +869,12 @@ jsonapi_reply_outputs_put_byid(struct httpd_request *hreq)
       ret = player_volume_setabs_speaker(output_id, volume);
     }
 
+  if (ret == 0 && jparse_contains_key(request, "offset_ms", json_type_int))
+    {
+      offset_ms = jparse_int_from_obj(request, "offset_ms");
+      ret = player_speaker_offset_set(output_id, offset_ms);
+    }
+
   jparse_free(request);
 
   if (ret < 0)
@@ -625,15 +889,24 @@ jsonapi_reply_outputs_put_byid(struct httpd_request *hreq)
 static int
 jsonapi_reply_outputs(struct httpd_request *hreq)
 {
-  json_object *outputs;
+  struct outputs_list list;
   json_object *jreply;
+  int ret;
 
-  outputs = json_object_new_array();
+  memset(&list, 0, sizeof(struct outputs_list));
 
-  player_speaker_enumerate(speaker_enum_cb, outputs);
+  ret = paging_get(hreq, &list.offset, &list.limit);
+  if (ret < 0)
+    return HTTP_BADREQUEST;
+
+  list.fields = evhttp_find_header(hreq->query, "fields");
+  list.outputs = json_object_new_array();
+
+  player_speaker_enumerate(speaker_enum_cb, &list);
 
   jreply = json_object_new_object();
-  json_object_object_add(jreply, "outputs", outputs);
+  json_object_object_add(jreply, "outputs", list.outputs);
+  json_object_object_add(jreply, "total", json_object_new_int(list.count));
 
   CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
 
@@ -867,61 +1140,226 @@ jsonapi_reply_player(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
-static json_object *
-queue_item_to_json(struct db_queue_item *queue_item)
+static int
+jsonapi_reply_player_stats(struct httpd_request *hreq)
 {
-  json_object *item;
-
-  item = json_object_new_object();
-
-  json_object_object_add(item, "id", json_object_new_int(queue_item->id));
-  json_object_object_add(item, "position", json_object_new_int(queue_item->pos));
-  json_object_object_add(item, "shuffle_position", json_object_new_int(queue_item->shuffle_pos));
-
-  json_object_object_add(item, "file_id", json_object_new_int(queue_item->file_id));
-  json_object_object_add(item, "path", json_object_new_string(queue_item->path));
-  json_object_object_add(item, "virtual_path", json_object_new_string(queue_item->virtual_path));
-
-  json_object_object_add(item, "title", json_object_new_string(queue_item->title));
-  json_object_object_add(item, "artist", json_object_new_string(queue_item->artist));
-  json_object_object_add(item, "albumartist", json_object_new_string(queue_item->album_artist));
-  json_object_object_add(item, "album", json_object_new_string(queue_item->album));
-  json_object_object_add(item, "genre", json_object_new_string(queue_item->genre));
-  json_object_object_add(item, "artist_sort", json_object_new_string(queue_item->artist_sort));
-  json_object_object_add(item, "albumartist_sort", json_object_new_string(queue_item->album_artist_sort));
-  json_object_object_add(item, "album_sort", json_object_new_string(queue_item->album_sort));
-  json_object_object_add(item, "year", json_object_new_int(queue_item->year));
-  json_object_object_add(item, "length_ms", json_object_new_int(queue_item->song_length));
-
-  return item;
+  struct player_stats stats;
+  json_object *reply;
+  json_object *lateness;
+  json_object *bucket;
+  json_object *outputs;
+  json_object *output;
+  int ret;
+  int i;
+
+  ret = player_get_stats(&stats);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Error getting player stats.\n");
+      return HTTP_INTERNAL;
+    }
+
+  reply = json_object_new_object();
+
+  json_object_object_add(reply, "ticks", json_object_new_int64(stats.ticks));
+  json_object_object_add(reply, "overruns", json_object_new_int64(stats.overruns));
+  json_object_object_add(reply, "overrun_ticks", json_object_new_int64(stats.overrun_ticks));
+  json_object_object_add(reply, "resets", json_object_new_int(stats.resets));
+  json_object_object_add(reply, "aborts", json_object_new_int(stats.aborts));
+  json_object_object_add(reply, "underruns", json_object_new_int(stats.underruns));
+  json_object_object_add(reply, "lateness_max_us", json_object_new_int64(stats.lateness_max_us));
+  json_object_object_add(reply, "switches", json_object_new_int(stats.switches));
+  json_object_object_add(reply, "switch_avg_us", json_object_new_int64(stats.switches ? stats.switch_total_us / stats.switches : 0));
+  json_object_object_add(reply, "switch_max_us", json_object_new_int64(stats.switch_max_us));
+
+  lateness = json_object_new_array();
+  for (i = 0; i < PLAYER_STATS_LATENESS_BUCKETS; i++)
+    {
+      bucket = json_object_new_object();
+      if (stats.lateness_bound_ms[i] > 0)
+	json_object_object_add(bucket, "below_ms", json_object_new_int(stats.lateness_bound_ms[i]));
+      json_object_object_add(bucket, "ticks", json_object_new_int64(stats.lateness[i]));
+      json_object_array_add(lateness, bucket);
+    }
+  json_object_object_add(reply, "lateness", lateness);
+
+  json_object_object_add(reply, "input_buffered", json_object_new_int64(stats.input_buffered));
+  json_object_object_add(reply, "input_buffered_min", json_object_new_int64(stats.input_buffered_min));
+  json_object_object_add(reply, "input_size", json_object_new_int64(stats.input_size));
+
+  outputs = json_object_new_array();
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      output = json_object_new_object();
+      json_object_object_add(output, "type", json_object_new_string(stats.outputs[i].name));
+      json_object_object_add(output, "writes", json_object_new_int64(stats.outputs[i].writes));
+      json_object_object_add(output, "write_avg_us", json_object_new_int64(stats.outputs[i].writes ? stats.outputs[i].total_us / stats.outputs[i].writes : 0));
+      json_object_object_add(output, "write_max_us", json_object_new_int64(stats.outputs[i].max_us));
+      json_object_object_add(output, "drops", json_object_new_int64(stats.outputs[i].drops));
+      json_object_object_add(output, "queued", json_object_new_int(stats.outputs[i].queued));
+      json_object_array_add(outputs, output);
+    }
+  json_object_object_add(reply, "outputs", outputs);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply)));
+
+  jparse_free(reply);
+
+  return HTTP_OK;
+}
+
+/* Queue items are written straight into the reply, without building a json-c
+ * tree, so that long queues don't need the memory twice
+ */
+enum queue_field_type
+{
+  QUEUE_FIELD_UINT32,
+  QUEUE_FIELD_STRING,
+};
+
+struct queue_field
+{
+  const char *name;
+  enum queue_field_type type;
+  size_t offset;
+};
+
+#define qi_offsetof(field) offsetof(struct db_queue_item, field)
+
+static const struct queue_field queue_fields[] =
+  {
+    { "id",               QUEUE_FIELD_UINT32, qi_offsetof(id) },
+    { "position",         QUEUE_FIELD_UINT32, qi_offsetof(pos) },
+    { "shuffle_position", QUEUE_FIELD_UINT32, qi_offsetof(shuffle_pos) },
+    { "file_id",          QUEUE_FIELD_UINT32, qi_offsetof(file_id) },
+    { "path",             QUEUE_FIELD_STRING, qi_offsetof(path) },
+    { "virtual_path",     QUEUE_FIELD_STRING, qi_offsetof(virtual_path) },
+    { "title",            QUEUE_FIELD_STRING, qi_offsetof(title) },
+    { "artist",           QUEUE_FIELD_STRING, qi_offsetof(artist) },
+    { "albumartist",      QUEUE_FIELD_STRING, qi_offsetof(album_artist) },
+    { "album",            QUEUE_FIELD_STRING, qi_offsetof(album) },
+    { "genre",            QUEUE_FIELD_STRING, qi_offsetof(genre) },
+    { "artist_sort",      QUEUE_FIELD_STRING, qi_offsetof(artist_sort) },
+    { "albumartist_sort", QUEUE_FIELD_STRING, qi_offsetof(album_artist_sort) },
+    { "album_sort",       QUEUE_FIELD_STRING, qi_offsetof(album_sort) },
+    { "year",             QUEUE_FIELD_UINT32, qi_offsetof(year) },
+    { "length_ms",        QUEUE_FIELD_UINT32, qi_offsetof(song_length) },
+  };
+
+static void
+json_string_add(struct evbuffer *evbuf, const char *str)
+{
+  const char *p;
+  const char *start;
+
+  evbuffer_add(evbuf, "\"", 1);
+
+  if (!str)
+    str = "";
+
+
+  for (start = p = str; *p; p++)
+    {
+      if ((unsigned char)*p >= 0x20 && *p != '"' && *p != '\\')
+	continue;
+
+      evbuffer_add(evbuf, start, p - start);
+      start = p + 1;
+
+      switch (*p)
+	{
+	  case '"':
+	    evbuffer_add(evbuf, "\\\"", 2);
+	    break;
+	  case '\\':
+	    evbuffer_add(evbuf, "\\\\", 2);
+	    break;
+	  case '\n':
+	    evbuffer_add(evbuf, "\\n", 2);
+	    break;
+	  case '\r':
+	    evbuffer_add(evbuf, "\\r", 2);
+	    break;
+	  case '\t':
+	    evbuffer_add(evbuf, "\\t", 2);
+	    break;
+	  default:
+	    evbuffer_add_printf(evbuf, "\\u%04x", (unsigned char)*p);
+	    break;
+	}
+    }
+
+  evbuffer_add(evbuf, start, p - start);
+  evbuffer_add(evbuf, "\"", 1);
+}
+
+static void
+queue_item_write(struct evbuffer *evbuf, struct db_queue_item *queue_item, const char *fields)
+{
+  const struct queue_field *qf;
+  char *ptr;
+  bool first;
+  int i;
+
+  evbuffer_add(evbuf, "{", 1);
+
+  first = true;
+  for (i = 0; i < (sizeof(queue_fields) / sizeof(queue_fields[0])); i++)
+    {
+      qf = &queue_fields[i];
+      if (!field_wanted(fields, qf->name))
+	continue;
+
+      evbuffer_add_printf(evbuf, "%s\"%s\":", first ? "" : ",", qf->name);
+      first = false;
+
+      ptr = (char *)queue_item + qf->offset;
+      if (qf->type == QUEUE_FIELD_UINT32)
+	evbuffer_add_printf(evbuf, "%" PRIu32, *(uint32_t *)ptr);
+      else
+	json_string_add(evbuf, *(char **)ptr);
+    }
+
+  evbuffer_add(evbuf, "}", 1);
 }
 
 static int
 jsonapi_reply_queue(struct httpd_request *hreq)
 {
   struct query_params query_params;
+  struct evkeyvalq *headers;
   const char *param;
+  const char *fields;
+  char etag[64];
   uint32_t item_id;
   int start_pos, end_pos;
   int version;
   int count;
+  int nitems;
   struct db_queue_item queue_item;
-  json_object *reply;
-  json_object *items;
-  json_object *item;
   int ret = 0;
 
+  // Queue items include library metadata, so both revisions go into the tag
+  if (hreq->req)
+    {
+      snprintf(etag, sizeof(etag), "queue-%u-%u", db_queue_revision_get(), db_revision_get());
+
+      headers = evhttp_request_get_output_headers(hreq->req);
+      evhttp_add_header(headers, "Cache-Control", "private, no-cache");
+      if (httpd_etag_check(hreq->req, etag))
+	return HTTP_NOTMODIFIED;
+    }
+
   memset(&query_params, 0, sizeof(struct query_params));
-  reply = json_object_new_object();
 
-  version = db_admin_getint(DB_ADMIN_QUEUE_VERSION);
-  count = db_queue_get_count();
+  ret = paging_get(hreq, &query_params.offset, &query_params.limit);
+  if (ret < 0)
+    return HTTP_BADREQUEST;
 
-  json_object_object_add(reply, "version", json_object_new_int(version));
-  json_object_object_add(reply, "count", json_object_new_int(count));
+  fields = evhttp_find_header(hreq->query, "fields");
 
-  items = json_object_new_array();
-  json_object_object_add(reply, "items", items);
+  version = db_queue_get_version();
+  count = db_queue_get_count();
 
   param = evhttp_find_header(hreq->query, "sort");
   if (param && strcmp(param, "shuffle") == 0)
@@ -956,23 +1394,25 @@ jsonapi_reply_queue(struct httpd_request *hreq)
   if (ret < 0)
     goto db_start_error;
 
+  evbuffer_add_printf(hreq->reply, "{\"version\":%d,\"count\":%d,\"items\":[", version, count);
+
+  nitems = 0;
   while ((ret = db_queue_enum_fetch(&query_params, &queue_item)) == 0 && queue_item.id > 0)
     {
-      item = queue_item_to_json(&queue_item);
-      if (!item)
-	goto error;
+      if (nitems > 0)
+	evbuffer_add(hreq->reply, ",", 1);
 
-      json_object_array_add(items, item);
+      queue_item_write(hreq->reply, &queue_item, fields);
+      nitems++;
     }
 
-  ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
-    DPRINTF(E_LOG, L_WEB, "outputs: Couldn't add outputs to response buffer.\n");
+    DPRINTF(E_LOG, L_WEB, "queue: Error fetching queue items\n");
+  else if ((ret = evbuffer_add_printf(hreq->reply, "]}")) < 0)
+    DPRINTF(E_LOG, L_WEB, "queue: Couldn't add queue items to response buffer.\n");
 
- error:
   db_queue_enum_end(&query_params);
  db_start_error:
-  jparse_free(reply);
   free(query_params.filter);
 
   if (ret < 0)
@@ -1082,6 +1522,9 @@ static struct httpd_uri_map adm_handlers[] =
     { EVHTTP_REQ_GET,    "^/api/config$",               jsonapi_reply_config },
     { EVHTTP_REQ_GET,    "^/api/library$",              jsonapi_reply_library },
     { EVHTTP_REQ_GET,    "^/api/update$",               jsonapi_reply_update },
+    { EVHTTP_REQ_GET,    "^/api/query-stats$",          jsonapi_reply_query_stats },
+    { EVHTTP_REQ_GET,    "^/api/request-trace$",        jsonapi_reply_request_trace },
+    { EVHTTP_REQ_PUT,    "^/api/request-trace$",        jsonapi_reply_request_trace_set },
     { EVHTTP_REQ_POST,   "^/api/spotify-login$",        jsonapi_reply_spotify_login },
     { EVHTTP_REQ_GET,    "^/api/spotify$",              jsonapi_reply_spotify },
     { EVHTTP_REQ_GET,    "^/api/pairing$",              jsonapi_reply_pairing_get },
@@ -1107,6 +1550,7 @@ static struct httpd_uri_map adm_handlers[] =
     { EVHTTP_REQ_PUT,    "^/api/player/consume$",       jsonapi_reply_player_consume },
     { EVHTTP_REQ_PUT,    "^/api/player/volume$",        jsonapi_reply_player_volume },
     { EVHTTP_REQ_GET,    "^/api/player$",               jsonapi_reply_player },
+    { EVHTTP_REQ_GET,    "^/api/player/stats$",         jsonapi_reply_player_stats },
 
     { EVHTTP_REQ_GET,    "^/api/queue$",                jsonapi_reply_queue },
 
@@ -1139,7 +1583,10 @@ jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   CHECK_NULL(L_WEB, hreq->reply = evbuffer_new());
 
+  // The handlers don't keep what they fetch, so it can all go at once
+  db_arena_begin();
   status_code = hreq->handler(hreq);
+  db_arena_end();
 
   switch (status_code)
     {
@@ -1151,6 +1598,9 @@ jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
       case HTTP_NOCONTENT:           /* 204 No Content */
 	httpd_send_reply(req, status_code, "No Content", hreq->reply, 0);
 	break;
+      case HTTP_NOTMODIFIED:         /* 304 Not Modified */
+	httpd_send_reply(req, status_code, "Not Modified", NULL, HTTPD_SEND_NO_GZIP);
+	break;
 
       case HTTP_BADREQUEST:          /* 400 Bad Request */
 	httpd_send_error(req, status_code, "Bad Request");
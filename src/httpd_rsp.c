@@ -23,6 +23,7 @@
 # include <config.h>
 #endif
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +45,10 @@
 #define RSP_VERSION "1.0"
 #define RSP_XML_ROOT "?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\" ?"
 
+// Item lists longer than this are sent in chunks of about RSP_CHUNK_SIZE
+#define RSP_STREAM_ITEMS 1000
+#define RSP_CHUNK_SIZE (64 * 1024)
+
 
 #define F_FULL     (1 << 0)
 #define F_BROWSE   (1 << 1)
@@ -57,6 +62,19 @@ struct field_map {
   int flags;
 };
 
+/* An item list that is sent in chunks. The query is run a second time by the
+ * httpd thread, which writes the items as the client takes them.
+ */
+struct rsp_stream {
+  struct query_params qp;
+  // F_* mode for lists of songs, 0 for browse lists
+  int mode;
+  char *user_agent;
+  char *client_codecs;
+  // Status block and opening tags, NULL once sent
+  struct evbuffer *header;
+};
+
 static const struct field_map pl_fields[] =
   {
     { "id",           dbpli_offsetof(id),           F_ALWAYS },
@@ -154,6 +172,223 @@ mxml_to_evbuf(mxml_node_t *tree)
   return evbuf;
 }
 
+/* The item lists are written as text straight into the reply, since a tree of
+ * mxml nodes for a whole library takes a lot of memory
+ */
+static void
+xml_text_add(struct evbuffer *evbuf, const char *text)
+{
+  const char *start;
+  const char *p;
+  const char *esc;
+
+  for (start = p = text; *p; p++)
+    {
+      switch (*p)
+	{
+	  case '&':
+	    esc = "&amp;";
+	    break;
+	  case '<':
+	    esc = "&lt;";
+	    break;
+	  case '>':
+	    esc = "&gt;";
+	    break;
+	  default:
+	    continue;
+	}
+
+      evbuffer_add(evbuf, start, p - start);
+      evbuffer_add(evbuf, esc, strlen(esc));
+      start = p + 1;
+    }
+
+  evbuffer_add(evbuf, start, p - start);
+}
+
+static void
+xml_element_add(struct evbuffer *evbuf, const char *name, const char *text)
+{
+  evbuffer_add_printf(evbuf, "<%s>", name);
+  xml_text_add(evbuf, text);
+  evbuffer_add_printf(evbuf, "</%s>", name);
+}
+
+static void
+rsp_items_header_add(struct evbuffer *evbuf, int records, int totalrecords)
+{
+  evbuffer_add_printf(evbuf, "<%s>", RSP_XML_ROOT);
+  evbuffer_add_printf(evbuf, "<response><status>");
+  evbuffer_add_printf(evbuf, "<errorcode>0</errorcode><errorstring></errorstring>");
+  evbuffer_add_printf(evbuf, "<records>%d</records><totalrecords>%d</totalrecords>", records, totalrecords);
+  evbuffer_add_printf(evbuf, "</status><items>");
+}
+
+static void
+rsp_items_footer_add(struct evbuffer *evbuf)
+{
+  evbuffer_add_printf(evbuf, "</items></response>");
+}
+
+static void
+rsp_item_add(struct evbuffer *evbuf, struct db_media_file_info *dbmfi, int mode, const char *ua, const char *client_codecs)
+{
+  char **strval;
+  int transcode;
+  int32_t bitrate;
+  int i;
+  int ret;
+
+  transcode = transcode_needed(ua, client_codecs, dbmfi->codectype);
+
+  evbuffer_add_printf(evbuf, "<item>");
+
+  for (i = 0; rsp_fields[i].field; i++)
+    {
+      if (!(rsp_fields[i].flags & mode))
+	continue;
+
+      strval = (char **) ((char *)dbmfi + rsp_fields[i].offset);
+
+      if (!(*strval) || (strlen(*strval) == 0))
+	continue;
+
+      if (!transcode)
+	{
+	  xml_element_add(evbuf, rsp_fields[i].field, *strval);
+	  continue;
+	}
+
+      switch (rsp_fields[i].offset)
+	{
+	  case dbmfi_offsetof(type):
+	    xml_element_add(evbuf, rsp_fields[i].field, "wav");
+	    break;
+
+	  case dbmfi_offsetof(bitrate):
+	    bitrate = 0;
+	    ret = safe_atoi32(dbmfi->samplerate, &bitrate);
+	    if ((ret < 0) || (bitrate == 0))
+	      bitrate = 1411;
+	    else
+	      bitrate = (bitrate * 8) / 250;
+
+	    evbuffer_add_printf(evbuf, "<%s>%d</%s>", rsp_fields[i].field, bitrate, rsp_fields[i].field);
+	    break;
+
+	  case dbmfi_offsetof(description):
+	    xml_element_add(evbuf, rsp_fields[i].field, "wav audio file");
+	    break;
+
+	  case dbmfi_offsetof(codectype):
+	    xml_element_add(evbuf, rsp_fields[i].field, "wav");
+	    xml_element_add(evbuf, "original_codec", *strval);
+	    break;
+
+	  default:
+	    xml_element_add(evbuf, rsp_fields[i].field, *strval);
+	    break;
+	}
+    }
+
+  evbuffer_add_printf(evbuf, "</item>");
+}
+
+/*
+ * Adds up to about size bytes of items from the query to evbuf
+ *
+ * @return 1 if all items were added, 0 if there are more, -1 on error
+ */
+static int
+rsp_items_fetch(struct evbuffer *evbuf, struct query_params *qp, int mode, const char *ua, const char *client_codecs, size_t size)
+{
+  struct db_media_file_info dbmfi;
+  char *browse_item;
+  int ret;
+
+  while (evbuffer_get_length(evbuf) < size)
+    {
+      if (mode)
+	{
+	  ret = db_query_fetch_file(qp, &dbmfi);
+	  if (ret < 0)
+	    return -1;
+	  if (!dbmfi.id)
+	    return 1;
+
+	  rsp_item_add(evbuf, &dbmfi, mode, ua, client_codecs);
+	}
+      else
+	{
+	  ret = db_query_fetch_string(qp, &browse_item);
+	  if (ret < 0)
+	    return -1;
+	  if (!browse_item)
+	    return 1;
+
+	  xml_element_add(evbuf, "item", browse_item);
+	}
+    }
+
+  return 0;
+}
+
+static void
+rsp_stream_free(struct rsp_stream *rs)
+{
+  db_query_end(&rs->qp);
+  free_query_params(&rs->qp, 1);
+  free(rs->user_agent);
+  free(rs->client_codecs);
+  if (rs->header)
+    evbuffer_free(rs->header);
+  free(rs);
+}
+
+/* Thread: httpd */
+static int
+rsp_stream_cb(struct evbuffer *evbuf, void *arg)
+{
+  struct rsp_stream *rs = arg;
+  int ret;
+
+  if (!evbuf)
+    {
+      rsp_stream_free(rs);
+      return 0;
+    }
+
+  if (rs->header)
+    {
+      ret = db_query_start(&rs->qp);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_RSP, "Could not start query for chunked item list\n");
+	  return -1;
+	}
+
+      evbuffer_add_buffer(evbuf, rs->header);
+      evbuffer_free(rs->header);
+      rs->header = NULL;
+    }
+
+  ret = rsp_items_fetch(evbuf, &rs->qp, rs->mode, rs->user_agent, rs->client_codecs, RSP_CHUNK_SIZE);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_RSP, "Error fetching results for chunked item list\n");
+      return -1;
+    }
+  else if (ret == 0)
+    return 0;
+
+  rsp_items_footer_add(evbuf);
+
+  DPRINTF(E_DBG, L_RSP, "Done sending chunked item list\n");
+
+  return 1;
+}
+
 static void
 rsp_send_error(struct evhttp_request *req, char *errmsg)
 {
@@ -253,11 +488,24 @@ query_params_set(struct query_params *qp, struct httpd_request *hreq)
   return 0;
 }
 
+static void
+rsp_send_evbuf(struct evhttp_request *req, struct evbuffer *evbuf)
+{
+  struct evkeyvalq *headers;
+
+  headers = evhttp_request_get_output_headers(req);
+  evhttp_add_header(headers, "Content-Type", "text/xml; charset=utf-8");
+  evhttp_add_header(headers, "Connection", "close");
+
+  httpd_send_reply(req, HTTP_OK, "OK", evbuf, 0);
+
+  evbuffer_free(evbuf);
+}
+
 static void
 rsp_send_reply(struct evhttp_request *req, mxml_node_t *reply)
 {
   struct evbuffer *evbuf;
-  struct evkeyvalq *headers;
 
   evbuf = mxml_to_evbuf(reply);
   mxmlDelete(reply);
@@ -269,13 +517,83 @@ rsp_send_reply(struct evhttp_request *req, mxml_node_t *reply)
       return;
     }
 
-  headers = evhttp_request_get_output_headers(req);
-  evhttp_add_header(headers, "Content-Type", "text/xml; charset=utf-8");
-  evhttp_add_header(headers, "Connection", "close");
+  rsp_send_evbuf(req, evbuf);
+}
 
-  httpd_send_reply(req, HTTP_OK, "OK", evbuf, 0);
+/*
+ * Sends the items of a started query, in chunks if there are many. Takes over
+ * the query params.
+ *
+ * @in  mode     F_* flags for lists of songs, 0 for browse lists
+ */
+static int
+rsp_send_items(struct httpd_request *hreq, struct query_params *qp, int mode)
+{
+  struct rsp_stream *rs;
+  struct evbuffer *evbuf;
+  struct evkeyvalq *headers;
+  const char *ua;
+  const char *client_codecs;
+  int records;
+  int ret;
 
-  evbuffer_free(evbuf);
+  if (qp->offset > qp->results)
+    records = 0;
+  else if (qp->limit > (qp->results - qp->offset))
+    records = qp->results - qp->offset;
+  else
+    records = qp->limit;
+
+  headers = evhttp_request_get_input_headers(hreq->req);
+  ua = evhttp_find_header(headers, "User-Agent");
+  client_codecs = evhttp_find_header(headers, "Accept-Codecs");
+
+  CHECK_NULL(L_RSP, evbuf = evbuffer_new());
+
+  rsp_items_header_add(evbuf, records, qp->results);
+
+  if (((qp->limit > 0) ? records : qp->results - qp->offset) > RSP_STREAM_ITEMS)
+    {
+      DPRINTF(E_DBG, L_RSP, "Item list has %d items, sending it in chunks\n", qp->results);
+
+      db_query_end(qp);
+
+      CHECK_NULL(L_RSP, rs = calloc(1, sizeof(struct rsp_stream)));
+
+      rs->qp = *qp;
+      rs->mode = mode;
+      rs->user_agent = safe_strdup(ua);
+      rs->client_codecs = safe_strdup(client_codecs);
+      rs->header = evbuf;
+
+      headers = evhttp_request_get_output_headers(hreq->req);
+      evhttp_add_header(headers, "Content-Type", "text/xml; charset=utf-8");
+      evhttp_add_header(headers, "Connection", "close");
+
+      httpd_send_reply_chunked(hreq->req, HTTP_OK, "OK", rsp_stream_cb, rs, 0);
+
+      return 0;
+    }
+
+  ret = rsp_items_fetch(evbuf, qp, mode, ua, client_codecs, SIZE_MAX);
+
+  db_query_end(qp);
+  free_query_params(qp, 1);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_RSP, "Error fetching results\n");
+
+      evbuffer_free(evbuf);
+      rsp_send_error(hreq->req, "Error fetching query results");
+      return -1;
+    }
+
+  rsp_items_footer_add(evbuf);
+
+  rsp_send_evbuf(hreq->req, evbuf);
+
+  return 0;
 }
 
 static int
@@ -460,22 +778,8 @@ static int
 rsp_reply_playlist(struct httpd_request *hreq)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
-  struct evkeyvalq *headers;
   const char *param;
-  const char *ua;
-  const char *client_codecs;
-  char **strval;
-  mxml_node_t *reply;
-  mxml_node_t *status;
-  mxml_node_t *items;
-  mxml_node_t *item;
-  mxml_node_t *node;
   int mode;
-  int records;
-  int transcode;
-  int32_t bitrate;
-  int i;
   int ret;
 
   memset(&qp, 0, sizeof(struct query_params));
@@ -524,138 +828,13 @@ rsp_reply_playlist(struct httpd_request *hreq)
       return -1;
     }
 
-  if (qp.offset > qp.results)
-    records = 0;
-  else if (qp.limit > (qp.results - qp.offset))
-    records = qp.results - qp.offset;
-  else
-    records = qp.limit;
-
-  /* We'd use mxmlNewXML(), but then we can't put any attributes
-   * on the root node and we need some.
-   */
-  reply = mxmlNewElement(MXML_NO_PARENT, RSP_XML_ROOT);
-
-  node = mxmlNewElement(reply, "response");
-  status = mxmlNewElement(node, "status");
-  items = mxmlNewElement(node, "items");
-
-  /* Status block */
-  node = mxmlNewElement(status, "errorcode");
-  mxmlNewText(node, 0, "0");
-
-  node = mxmlNewElement(status, "errorstring");
-  mxmlNewText(node, 0, "");
-
-  node = mxmlNewElement(status, "records");
-  mxmlNewTextf(node, 0, "%d", records);
-
-  node = mxmlNewElement(status, "totalrecords");
-  mxmlNewTextf(node, 0, "%d", qp.results);
-
-  /* Items block (all items) */
-  while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
-    {
-      headers = evhttp_request_get_input_headers(hreq->req);
-
-      ua = evhttp_find_header(headers, "User-Agent");
-      client_codecs = evhttp_find_header(headers, "Accept-Codecs");
-
-      transcode = transcode_needed(ua, client_codecs, dbmfi.codectype);
-
-      /* Item block (one item) */
-      item = mxmlNewElement(items, "item");
-
-      for (i = 0; rsp_fields[i].field; i++)
-	{
-	  if (!(rsp_fields[i].flags & mode))
-	    continue;
-
-	  strval = (char **) ((char *)&dbmfi + rsp_fields[i].offset);
-
-	  if (!(*strval) || (strlen(*strval) == 0))
-	    continue;
-
-	  node = mxmlNewElement(item, rsp_fields[i].field);
-
-	  if (!transcode)
-	    mxmlNewText(node, 0, *strval);
-	  else
-	    {
-	      switch (rsp_fields[i].offset)
-		{
-		  case dbmfi_offsetof(type):
-		    mxmlNewText(node, 0, "wav");
-		    break;
-
-		  case dbmfi_offsetof(bitrate):
-		    bitrate = 0;
-		    ret = safe_atoi32(dbmfi.samplerate, &bitrate);
-		    if ((ret < 0) || (bitrate == 0))
-		      bitrate = 1411;
-		    else
-		      bitrate = (bitrate * 8) / 250;
-
-		    mxmlNewTextf(node, 0, "%d", bitrate);
-		    break;
-
-		  case dbmfi_offsetof(description):
-		    mxmlNewText(node, 0, "wav audio file");
-		    break;
-
-		  case dbmfi_offsetof(codectype):
-		    mxmlNewText(node, 0, "wav");
-
-		    node = mxmlNewElement(item, "original_codec");
-		    mxmlNewText(node, 0, *strval);
-		    break;
-
-		  default:
-		    mxmlNewText(node, 0, *strval);
-		    break;
-		}
-	    }
-	}
-    }
-
-  if (qp.filter)
-    free(qp.filter);
-
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_RSP, "Error fetching results\n");
-
-      mxmlDelete(reply);
-      db_query_end(&qp);
-      rsp_send_error(hreq->req, "Error fetching query results");
-      return -1;
-    }
-
-  /* HACK
-   * Add a dummy empty string to the items element if there is no data
-   * to return - this prevents mxml from sending out an empty <items/>
-   * tag that the SoundBridge does not handle. It's hackish, but it works.
-   */
-  if (qp.results == 0)
-    mxmlNewText(items, 0, "");
-
-  db_query_end(&qp);
-
-  rsp_send_reply(hreq->req, reply);
-
-  return 0;
+  return rsp_send_items(hreq, &qp, mode);
 }
 
 static int
 rsp_reply_browse(struct httpd_request *hreq)
 {
   struct query_params qp;
-  char *browse_item;
-  mxml_node_t *reply;
-  mxml_node_t *status;
-  mxml_node_t *items;
-  mxml_node_t *node;
-  int records;
   int ret;
 
   memset(&qp, 0, sizeof(struct query_params));
@@ -699,68 +878,7 @@ rsp_reply_browse(struct httpd_request *hreq)
       return -1;
     }
 
-  if (qp.offset > qp.results)
-    records = 0;
-  else if (qp.limit > (qp.results - qp.offset))
-    records = qp.results - qp.offset;
-  else
-    records = qp.limit;
-
-  /* We'd use mxmlNewXML(), but then we can't put any attributes
-   * on the root node and we need some.
-   */
-  reply = mxmlNewElement(MXML_NO_PARENT, RSP_XML_ROOT);
-
-  node = mxmlNewElement(reply, "response");
-  status = mxmlNewElement(node, "status");
-  items = mxmlNewElement(node, "items");
-
-  /* Status block */
-  node = mxmlNewElement(status, "errorcode");
-  mxmlNewText(node, 0, "0");
-
-  node = mxmlNewElement(status, "errorstring");
-  mxmlNewText(node, 0, "");
-
-  node = mxmlNewElement(status, "records");
-  mxmlNewTextf(node, 0, "%d", records);
-
-  node = mxmlNewElement(status, "totalrecords");
-  mxmlNewTextf(node, 0, "%d", qp.results);
-
-  /* Items block (all items) */
-  while (((ret = db_query_fetch_string(&qp, &browse_item)) == 0) && (browse_item))
-    {
-      node = mxmlNewElement(items, "item");
-      mxmlNewText(node, 0, browse_item);
-    }
-
-  if (qp.filter)
-    free(qp.filter);
-
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_RSP, "Error fetching results\n");
-
-      mxmlDelete(reply);
-      db_query_end(&qp);
-      rsp_send_error(hreq->req, "Error fetching query results");
-      return -1;
-    }
-
-  /* HACK
-   * Add a dummy empty string to the items element if there is no data
-   * to return - this prevents mxml from sending out an empty <items/>
-   * tag that the SoundBridge does not handle. It's hackish, but it works.
-   */
-  if (qp.results == 0)
-    mxmlNewText(items, 0, "");
-
-  db_query_end(&qp);
-
-  rsp_send_reply(hreq->req, reply);
-
-  return 0;
+  return rsp_send_items(hreq, &qp, 0);
 }
 
 static int
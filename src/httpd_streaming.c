@@ -49,41 +49,267 @@ extern struct event_base *evbase_httpd;
 // Should prevent that we keep transcoding to dead connections
 #define STREAMING_CONNECTION_TIMEOUT 60
 
-// Linked list of mp3 streaming requests
+// An encoded chunk that is shared by the output buffers of all the clients and
+// the backlog, freed when the last of them has let go of it
+struct streaming_segment {
+  int refcount;
+  // Samples of audio in the segment, for keeping track of the backlog length
+  int nsamples;
+  struct streaming_segment *next;
+  size_t len;
+  uint8_t data[];
+};
+
+// The formats we can stream, the encoders are only created when a client asks
+// for the format, and freed again when the last of its clients is gone
+struct streaming_format {
+  enum transcode_profile profile;
+  const char *path;
+  const char *content_type;
+
+  // Set by init if libav can encode to this format
+  int supported;
+
+  // Only while there are clients (nsessions > 0)
+  struct encode_ctx *encode_ctx;
+  struct evbuffer *encoded_data;
+  // The container header (e.g. Ogg and FLAC), sent to each client first
+  uint8_t *header;
+  size_t header_len;
+  int nsessions;
+
+  // The most recent segments, sent as a burst to new clients so that they can
+  // fill their buffer and start playing right away. Since the encoder output
+  // consists of whole packets, so does each segment.
+  struct streaming_segment *backlog_head;
+  struct streaming_segment *backlog_tail;
+  int backlog_samples;
+  // Samples encoded since the last segment was made
+  int pending_samples;
+};
+
+static struct streaming_format streaming_formats[] =
+{
+  { XCODE_MP3,  "/stream.mp3",  "audio/mpeg" },
+  { XCODE_AAC,  "/stream.aac",  "audio/aac" },
+  { XCODE_OPUS, "/stream.opus", "audio/ogg" },
+  { XCODE_FLAC, "/stream.flac", "audio/flac" },
+};
+
+// Linked list of streaming requests
 struct streaming_session {
   struct evhttp_request *req;
+  struct streaming_format *format;
   struct streaming_session *next;
 };
 static struct streaming_session *streaming_sessions;
 
 static int streaming_initialized;
 
-// Buffers and interval for sending silence when playback is paused
-static uint8_t *streaming_silence_data;
-static size_t streaming_silence_size;
+// Max length of the backlog, from the config (in samples)
+static int streaming_backlog_max;
+
+// Interval for sending silence when playback is paused
 static struct timeval streaming_silence_tv = { STREAMING_SILENCE_INTERVAL, 0 };
 
-// Input buffer, output buffer and encoding ctx for transcode
+// Input buffer for transcode
 static uint8_t streaming_rawbuf[STREAMING_RAWBUF_SIZE];
-static struct encode_ctx *streaming_encode_ctx;
-static struct evbuffer *streaming_encoded_data;
 
-// Used for pushing events and data from the player
+// Used for pushing events and data from the player. The event only has a
+// timeout for sending silence while playback is paused, so that streaming
+// doesn't wake up while the player is stopped.
 static struct event *streamingev;
 static struct player_status streaming_player_status;
-static int streaming_player_changed;
 static int streaming_pipe[2];
 
+static struct streaming_format *
+streaming_format_find(const char *path)
+{
+  const char *ptr;
+  int i;
+
+  ptr = strrchr(path, '/');
+  if (!ptr)
+    return NULL;
+
+  for (i = 0; i < (sizeof(streaming_formats) / sizeof(streaming_formats[0])); i++)
+    {
+      if (strcasecmp(ptr, streaming_formats[i].path) == 0)
+	return &streaming_formats[i];
+    }
+
+  return NULL;
+}
+
+// Thread: httpd (all the refcounting happens there, so no locking needed)
+static void
+streaming_segment_unref_cb(const void *data, size_t datalen, void *extra)
+{
+  struct streaming_segment *segment = extra;
+
+  segment->refcount--;
+  if (segment->refcount == 0)
+    free(segment);
+}
+
+static void
+streaming_backlog_add(struct streaming_format *format, struct streaming_segment *segment)
+{
+  struct streaming_segment *head;
+
+  segment->refcount++;
+  segment->next = NULL;
+
+  if (format->backlog_tail)
+    format->backlog_tail->next = segment;
+  else
+    format->backlog_head = segment;
+
+  format->backlog_tail = segment;
+  format->backlog_samples += segment->nsamples;
+
+  // Trim from the front while what remains is still long enough
+  while ((head = format->backlog_head) && head->next && (format->backlog_samples - head->nsamples >= streaming_backlog_max))
+    {
+      format->backlog_head = head->next;
+      format->backlog_samples -= head->nsamples;
+      streaming_segment_unref_cb(head->data, head->len, head);
+    }
+}
+
+static void
+streaming_backlog_clear(struct streaming_format *format)
+{
+  struct streaming_segment *segment;
+
+  while ((segment = format->backlog_head))
+    {
+      format->backlog_head = segment->next;
+      streaming_segment_unref_cb(segment->data, segment->len, segment);
+    }
+
+  format->backlog_tail = NULL;
+  format->backlog_samples = 0;
+}
+
+// Gives a new client the backlog in one go. The client's output buffer just
+// references the segments, so this is cheap even with many clients.
+static void
+streaming_backlog_send(struct evhttp_request *req, struct streaming_format *format)
+{
+  struct streaming_segment *segment;
+  struct evbuffer *evbuf;
+  int ret;
+
+  if (!format->backlog_head)
+    return;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    return;
+
+  for (segment = format->backlog_head; segment; segment = segment->next)
+    {
+      segment->refcount++;
+
+      ret = evbuffer_add_reference(evbuf, segment->data, segment->len, streaming_segment_unref_cb, segment);
+      if (ret < 0)
+	{
+	  segment->refcount--;
+	  break;
+	}
+    }
+
+  evhttp_send_reply_chunk(req, evbuf);
+
+  evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+  evbuffer_free(evbuf);
+}
+
+static void
+streaming_format_stop(struct streaming_format *format)
+{
+  transcode_encode_cleanup(&format->encode_ctx);
+
+  streaming_backlog_clear(format);
+  format->pending_samples = 0;
+
+  if (format->encoded_data)
+    evbuffer_free(format->encoded_data);
+  format->encoded_data = NULL;
+
+  free(format->header);
+  format->header = NULL;
+  format->header_len = 0;
+}
+
+static int
+streaming_format_start(struct streaming_format *format)
+{
+  struct decode_ctx *decode_ctx;
+  int ret;
+
+  decode_ctx = transcode_decode_setup_raw();
+  if (!decode_ctx)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Could not create decoding context\n");
+      return -1;
+    }
+
+  format->encode_ctx = transcode_encode_setup(format->profile, decode_ctx, NULL, 0, 0);
+  transcode_decode_cleanup(&decode_ctx);
+  if (!format->encode_ctx)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Could not create encoder for %s\n", format->path);
+      return -1;
+    }
+
+  format->encoded_data = evbuffer_new();
+  if (!format->encoded_data)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Out of memory for encoded_data\n");
+      goto fail;
+    }
+
+  // Keep the header so that we can also give it to clients that connect later
+  ret = transcode_encode_header(format->encoded_data, format->encode_ctx);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Could not get header for %s\n", format->path);
+      goto fail;
+    }
+
+  format->header_len = evbuffer_get_length(format->encoded_data);
+  if (format->header_len == 0)
+    return 0;
+
+  format->header = malloc(format->header_len);
+  if (!format->header)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Out of memory for stream header\n");
+      goto fail;
+    }
+
+  evbuffer_remove(format->encoded_data, format->header, format->header_len);
+
+  return 0;
+
+ fail:
+  streaming_format_stop(format);
+  return -1;
+}
+
 static void
 streaming_fail_cb(struct evhttp_connection *evcon, void *arg)
 {
   struct streaming_session *this;
   struct streaming_session *session;
   struct streaming_session *prev;
+  struct streaming_format *format;
 
   this = (struct streaming_session *)arg;
 
-  DPRINTF(E_WARN, L_STREAMING, "Connection failed; stopping mp3 streaming to client\n");
+  DPRINTF(E_WARN, L_STREAMING, "Connection failed; stopping streaming to client\n");
 
   prev = NULL;
   for (session = streaming_sessions; session; session = session->next)
@@ -106,8 +332,16 @@ streaming_fail_cb(struct evhttp_connection *evcon, void *arg)
   else
     prev->next = session->next;
 
+  format = session->format;
   free(session);
 
+  format->nsessions--;
+  if (format->nsessions == 0)
+    {
+      DPRINTF(E_DBG, L_STREAMING, "No more clients for %s, stopping encoder\n", format->path);
+      streaming_format_stop(format);
+    }
+
   if (!streaming_sessions)
     {
       DPRINTF(E_INFO, L_STREAMING, "No more clients, will stop streaming\n");
@@ -115,14 +349,102 @@ streaming_fail_cb(struct evhttp_connection *evcon, void *arg)
     }
 }
 
+static int
+streaming_format_encode(struct streaming_format *format)
+{
+  void *frame;
+  int ret;
+
+  frame = transcode_frame_new(format->profile, streaming_rawbuf, STREAMING_RAWBUF_SIZE);
+  if (!frame)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Could not convert raw PCM to frame\n");
+      return -1;
+    }
+
+  ret = transcode_encode(format->encoded_data, format->encode_ctx, frame, 0);
+  transcode_frame_free(frame);
+  if (ret < 0)
+    return -1;
+
+  format->pending_samples += BTOS(STREAMING_RAWBUF_SIZE);
+
+  return ret;
+}
+
 static void
-streaming_send_cb(evutil_socket_t fd, short event, void *arg)
+streaming_format_send(struct streaming_format *format)
 {
   struct streaming_session *session;
+  struct streaming_segment *segment;
   struct evbuffer *evbuf;
-  void *frame;
-  uint8_t *buf;
-  int len;
+  size_t len;
+  int ret;
+
+  len = evbuffer_get_length(format->encoded_data);
+  if (len == 0)
+    return;
+
+  // The encoded data is copied once to a segment, which the clients' output
+  // buffers then reference, so an extra client only costs a chain entry
+  segment = malloc(sizeof(struct streaming_segment) + len);
+  evbuf = evbuffer_new();
+  if (!segment || !evbuf)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Out of memory for streaming segment\n");
+
+      free(segment);
+      if (evbuf)
+	evbuffer_free(evbuf);
+      evbuffer_drain(format->encoded_data, len);
+      return;
+    }
+
+  ret = evbuffer_remove(format->encoded_data, segment->data, len);
+  segment->len = (ret > 0) ? ret : 0;
+  segment->nsamples = format->pending_samples;
+  segment->next = NULL;
+
+  format->pending_samples = 0;
+
+  // Holds a reference while sending, so the segment survives a client whose
+  // buffer drains right away
+  segment->refcount = 1;
+
+  for (session = streaming_sessions; session; session = session->next)
+    {
+      if (session->format != format)
+	continue;
+
+      segment->refcount++;
+
+      ret = evbuffer_add_reference(evbuf, segment->data, segment->len, streaming_segment_unref_cb, segment);
+      if (ret < 0)
+	{
+	  segment->refcount--;
+	  continue;
+	}
+
+      evhttp_send_reply_chunk(session->req, evbuf);
+
+      // Any leftover means evhttp did not take it, don't let it go to the next client
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+    }
+
+  evbuffer_free(evbuf);
+
+  if (streaming_backlog_max > 0)
+    streaming_backlog_add(format, segment);
+
+  streaming_segment_unref_cb(segment->data, segment->len, segment);
+}
+
+static void
+streaming_send_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct streaming_format *format;
+  int remaining;
+  int i;
   int ret;
 
   // Player wrote data to the pipe (EV_READ)
@@ -135,59 +457,71 @@ streaming_send_cb(evutil_socket_t fd, short event, void *arg)
       if (!streaming_sessions)
 	return;
 
-      frame = transcode_frame_new(XCODE_MP3, streaming_rawbuf, STREAMING_RAWBUF_SIZE);
-      if (!frame)
+      for (i = 0; i < (sizeof(streaming_formats) / sizeof(streaming_formats[0])); i++)
 	{
-	  DPRINTF(E_LOG, L_STREAMING, "Could not convert raw PCM to frame\n");
-	  return;
+	  format = &streaming_formats[i];
+	  if (format->encode_ctx)
+	    streaming_format_encode(format);
 	}
-
-      ret = transcode_encode(streaming_encoded_data, streaming_encode_ctx, frame, 0);
-      transcode_frame_free(frame);
-      if (ret < 0)
-	return;
     }
-  // Event timed out, let's see what the player is doing and send silence if it is paused
+  // Event timed out, send silence if playback is (still) paused
   else
     {
-      if (streaming_player_changed)
-	{
-	  streaming_player_changed = 0;
-	  player_get_status(&streaming_player_status);
-	}
-
       if (!streaming_sessions)
 	return;
 
       if (streaming_player_status.status != PLAY_PAUSED)
 	return;
 
-      evbuffer_add(streaming_encoded_data, streaming_silence_data, streaming_silence_size);
-    }
-
-  len = evbuffer_get_length(streaming_encoded_data);
+      // Silence is encoded per format, since e.g. the Ogg muxer needs
+      // timestamps that continue from the audio
+      memset(streaming_rawbuf, 0, STREAMING_RAWBUF_SIZE);
 
-  // Send data
-  evbuf = evbuffer_new();
-  for (session = streaming_sessions; session; session = session->next)
-    {
-      if (session->next)
+      for (i = 0; i < (sizeof(streaming_formats) / sizeof(streaming_formats[0])); i++)
 	{
-	  buf = evbuffer_pullup(streaming_encoded_data, -1);
-	  evbuffer_add(evbuf, buf, len);
-	  evhttp_send_reply_chunk(session->req, evbuf);
+	  format = &streaming_formats[i];
+	  if (!format->encode_ctx)
+	    continue;
+
+	  for (remaining = STREAMING_SILENCE_INTERVAL * STOB(44100); remaining > STREAMING_RAWBUF_SIZE; remaining -= STREAMING_RAWBUF_SIZE)
+	    {
+	      ret = streaming_format_encode(format);
+	      if (ret < 0)
+		break;
+	    }
 	}
-      else
-	evhttp_send_reply_chunk(session->req, streaming_encoded_data);
     }
-  evbuffer_free(evbuf);
+
+  for (i = 0; i < (sizeof(streaming_formats) / sizeof(streaming_formats[0])); i++)
+    {
+      format = &streaming_formats[i];
+      if (format->encode_ctx)
+	streaming_format_send(format);
+    }
 }
 
-// Thread: player (not fully thread safe, but hey...)
+// Thread: httpd
+static void
+streaming_event_add(void)
+{
+  if (!streaming_sessions)
+    return;
+
+  event_del(streamingev);
+
+  if (streaming_player_status.status == PLAY_PAUSED)
+    event_add(streamingev, &streaming_silence_tv);
+  else
+    event_add(streamingev, NULL);
+}
+
+// Thread: httpd (the listener is added with evbase_httpd)
 static void
 player_change_cb(short event_mask)
 {
-  streaming_player_changed = 1;
+  player_get_status(&streaming_player_status);
+
+  streaming_event_add();
 }
 
 // Thread: player (also prone to race conditions, mostly during deinit)
@@ -213,31 +547,57 @@ int
 streaming_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 {
   struct streaming_session *session;
+  struct streaming_format *format;
   struct evhttp_connection *evcon;
   struct evkeyvalq *output_headers;
+  struct evbuffer *evbuf;
   cfg_t *lib;
   const char *name;
   char *address;
   ev_uint16_t port;
+  int ret;
 
-  if (!streaming_initialized)
+  format = streaming_format_find(uri_parsed->path);
+  if (!streaming_initialized || !format || !format->supported)
     {
-      DPRINTF(E_LOG, L_STREAMING, "Got mp3 streaming request, but cannot encode to mp3\n");
+      DPRINTF(E_LOG, L_STREAMING, "Got streaming request for '%s', but cannot encode to that format\n", uri_parsed->path);
 
       evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
       return -1;
     }
 
+  if (!format->encode_ctx)
+    {
+      ret = streaming_format_start(format);
+      if (ret < 0)
+	{
+	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+	  return -1;
+	}
+    }
+
+  session = malloc(sizeof(struct streaming_session));
+  if (!session)
+    {
+      DPRINTF(E_LOG, L_STREAMING, "Out of memory for streaming request\n");
+
+      if (format->nsessions == 0)
+	streaming_format_stop(format);
+
+      evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+      return -1;
+    }
+
   evcon = evhttp_request_get_connection(req);
   evhttp_connection_get_peer(evcon, &address, &port);
 
-  DPRINTF(E_INFO, L_STREAMING, "Beginning mp3 streaming to %s:%d\n", address, (int)port);
+  DPRINTF(E_INFO, L_STREAMING, "Beginning %s streaming to %s:%d\n", format->path + strlen("/stream."), address, (int)port);
 
   lib = cfg_getsec(cfg, "library");
   name = cfg_getstr(lib, "name");
 
   output_headers = evhttp_request_get_output_headers(req);
-  evhttp_add_header(output_headers, "Content-Type", "audio/mpeg");
+  evhttp_add_header(output_headers, "Content-Type", format->content_type);
   evhttp_add_header(output_headers, "Server", "forked-daapd/" VERSION);
   evhttp_add_header(output_headers, "Cache-Control", "no-cache");
   evhttp_add_header(output_headers, "Pragma", "no-cache");
@@ -247,22 +607,33 @@ streaming_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parse
   // TODO ICY metaint
   evhttp_send_reply_start(req, HTTP_OK, "OK");
 
-  session = malloc(sizeof(struct streaming_session));
-  if (!session)
+  // Clients joining a running stream won't have seen the container header
+  if (format->header_len > 0)
     {
-      DPRINTF(E_LOG, L_STREAMING, "Out of memory for streaming request\n");
-
-      evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
-      return -1;
+      evbuf = evbuffer_new();
+      if (evbuf)
+	{
+	  evbuffer_add(evbuf, format->header, format->header_len);
+	  evhttp_send_reply_chunk(req, evbuf);
+	  evbuffer_free(evbuf);
+	}
     }
 
-  if (!streaming_sessions)
-    event_add(streamingev, &streaming_silence_tv);
+  streaming_backlog_send(req, format);
 
   session->req = req;
+  session->format = format;
   session->next = streaming_sessions;
   streaming_sessions = session;
 
+  if (!session->next)
+    {
+      player_get_status(&streaming_player_status);
+      streaming_event_add();
+    }
+
+  format->nsessions++;
+
   evhttp_connection_set_timeout(evcon, STREAMING_CONNECTION_TIMEOUT);
   evhttp_connection_set_closecb(evcon, streaming_fail_cb, session);
 
@@ -272,21 +643,16 @@ streaming_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parse
 int
 streaming_is_request(const char *path)
 {
-  char *ptr;
-
-  ptr = strrchr(path, '/');
-  if (ptr && (strcasecmp(ptr, "/stream.mp3") == 0))
-    return 1;
-
-  return 0;
+  return (streaming_format_find(path) != NULL);
 }
 
 int
 streaming_init(void)
 {
   struct decode_ctx *decode_ctx;
-  void *frame;
-  int remaining;
+  struct encode_ctx *encode_ctx;
+  int nsupported;
+  int i;
   int ret;
 
   decode_ctx = transcode_decode_setup_raw();
@@ -296,14 +662,30 @@ streaming_init(void)
       return -1;
     }
 
-  streaming_encode_ctx = transcode_encode_setup(XCODE_MP3, decode_ctx, NULL, 0, 0);
-  transcode_decode_cleanup(&decode_ctx);
-  if (!streaming_encode_ctx)
+  // Check which formats libav can encode, the actual encoders are created on request
+  nsupported = 0;
+  for (i = 0; i < (sizeof(streaming_formats) / sizeof(streaming_formats[0])); i++)
     {
-      DPRINTF(E_LOG, L_STREAMING, "Will not be able to stream mp3, libav does not support mp3 encoding\n");
-      return -1;
+      encode_ctx = transcode_encode_setup(streaming_formats[i].profile, decode_ctx, NULL, 0, 0);
+      if (!encode_ctx)
+	{
+	  DPRINTF(E_LOG, L_STREAMING, "Will not be able to stream %s, libav does not support the encoder\n", streaming_formats[i].path);
+	  continue;
+	}
+
+      transcode_encode_cleanup(&encode_ctx);
+
+      streaming_formats[i].supported = 1;
+      nsupported++;
     }
 
+  transcode_decode_cleanup(&decode_ctx);
+
+  if (nsupported == 0)
+    return -1;
+
+  streaming_backlog_max = cfg_getint(cfg_getsec(cfg, "streaming"), "backlog_seconds") * 44100;
+
   // Non-blocking because otherwise httpd and player thread may deadlock
 #ifdef HAVE_PIPE2
   ret = pipe2(streaming_pipe, O_CLOEXEC | O_NONBLOCK);
@@ -322,81 +704,32 @@ streaming_init(void)
     }
 
   // Listen to playback changes so we don't have to poll to check for pausing
-  ret = listener_add(player_change_cb, LISTENER_PLAYER);
+  ret = listener_add(player_change_cb, LISTENER_PLAYER, evbase_httpd);
   if (ret < 0)
     {
       DPRINTF(E_FATAL, L_STREAMING, "Could not add listener\n");
       goto listener_fail;
     }
 
-  // Initialize buffer for encoded mp3 audio and event for pipe reading
-  streaming_encoded_data = evbuffer_new();
+  // Initialize event for pipe reading
   streamingev = event_new(evbase_httpd, streaming_pipe[0], EV_TIMEOUT | EV_READ | EV_PERSIST, streaming_send_cb, NULL);
-  if (!streaming_encoded_data || !streamingev)
+  if (!streamingev)
     {
-      DPRINTF(E_LOG, L_STREAMING, "Out of memory for encoded_data or event\n");
+      DPRINTF(E_LOG, L_STREAMING, "Out of memory for event\n");
       goto event_fail;
     }
 
-  // Encode some silence which will be used for playback pause and put in a permanent buffer
-  remaining = STREAMING_SILENCE_INTERVAL * STOB(44100);
-  while (remaining > STREAMING_RAWBUF_SIZE)
-    {
-      frame = transcode_frame_new(XCODE_MP3, streaming_rawbuf, STREAMING_RAWBUF_SIZE);
-      if (!frame)
-	{
-	  DPRINTF(E_LOG, L_STREAMING, "Could not convert raw PCM to frame\n");
-	  goto silence_fail;
-	}
-
-      ret = transcode_encode(streaming_encoded_data, streaming_encode_ctx, frame, 0);
-      transcode_frame_free(frame);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_STREAMING, "Could not encode silence buffer\n");
-	  goto silence_fail;
-	}
-
-      remaining -= STREAMING_RAWBUF_SIZE;
-    }
-
-  streaming_silence_size = evbuffer_get_length(streaming_encoded_data);
-  if (streaming_silence_size == 0)
-    {
-      DPRINTF(E_LOG, L_STREAMING, "The encoder didn't encode any silence\n");
-      goto silence_fail;
-    }
-
-  streaming_silence_data = malloc(streaming_silence_size);
-  if (!streaming_silence_data)
-    {
-      DPRINTF(E_LOG, L_STREAMING, "Out of memory for streaming_silence_data\n");
-      goto silence_fail;
-    }
-
-  ret = evbuffer_remove(streaming_encoded_data, streaming_silence_data, streaming_silence_size);
-  if (ret != streaming_silence_size)
-    {
-      DPRINTF(E_LOG, L_STREAMING, "Unknown error while copying silence buffer\n");
-      free(streaming_silence_data);
-      goto silence_fail;
-    }
-
   // All done
   streaming_initialized = 1;
 
   return 0;
 
- silence_fail:
-  event_free(streamingev);
-  evbuffer_free(streaming_encoded_data);
  event_fail:
   listener_remove(player_change_cb);
  listener_fail:
   close(streaming_pipe[0]);
   close(streaming_pipe[1]);
  pipe_fail:
-  transcode_encode_cleanup(&streaming_encode_ctx);
 
   return -1;
 }
@@ -406,6 +739,7 @@ streaming_deinit(void)
 {
   struct streaming_session *session;
   struct streaming_session *next;
+  int i;
 
   if (!streaming_initialized)
     return;
@@ -429,7 +763,9 @@ streaming_deinit(void)
   close(streaming_pipe[0]);
   close(streaming_pipe[1]);
 
-  transcode_encode_cleanup(&streaming_encode_ctx);
-  evbuffer_free(streaming_encoded_data);
-  free(streaming_silence_data);
+  for (i = 0; i < (sizeof(streaming_formats) / sizeof(streaming_formats[0])); i++)
+    {
+      streaming_formats[i].nsessions = 0;
+      streaming_format_stop(&streaming_formats[i]);
+    }
 }
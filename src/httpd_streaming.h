@@ -4,7 +4,8 @@
 
 #include "httpd.h"
 
-/* httpd_streaming takes care of incoming requests to /stream.mp3
+/* httpd_streaming takes care of incoming requests to /stream.mp3 (and .aac,
+ * .opus and .flac)
  * It will receive decoded audio from the player, and encode it, and
  * stream it to one or more clients. It will not be available
  * if a suitable ffmpeg/libav encoder is not present at runtime.
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -37,12 +38,18 @@
 
 #include "misc.h"
 #include "logger.h"
+#include "conffile.h"
 #include "input.h"
 
-// Disallow further writes to the buffer when its size is larger than this threshold
-#define INPUT_BUFFER_THRESHOLD STOB(88200)
-// How long (in sec) to wait for player read before looping in playback thread
-#define INPUT_LOOP_TIMEOUT 1
+// How much must be in the input buffer before playback (re)starts (2 seconds
+// of audio). The buffer itself can be larger, see readahead_seconds.
+#define INPUT_BUFFER_START STOB(88200)
+// Max number of EOF/error/metadata markers that can be pending in the buffer
+#define INPUT_MARKERS_MAX 16
+// How long (in ms) to wait in the playback thread before checking if there is
+// room in the input buffer. The player does not signal when it has read from
+// the buffer, since that would mean locking in every tick.
+#define INPUT_LOOP_TIMEOUT_MS 20
 
 #define DEBUG 1 //TODO disable
 
@@ -64,23 +71,57 @@ static struct input_definition *inputs[] = {
     NULL
 };
 
+struct input_marker
+{
+  // Stream position (total bytes written to the buffer) the flags apply to
+  uint64_t pos;
+  short flags;
+};
+
+// The buffer is written by the input thread and read by the player thread
+// without locking (only writers lock, see input_lock). Instead of the flags
+// given to input_write() being stored with the data, they are passed side-band
+// as markers, which the reader picks up when it reaches the marker position.
 struct input_buffer
 {
   // Raw pcm stream data
-  struct evbuffer *evbuf;
+  struct ringbuffer ring;
 
-  // If non-zero, remaining length of buffer until EOF
-  size_t eof;
-  // If non-zero, remaining length of buffer until read error occurred
-  size_t error;
-  // If non-zero, remaining length of buffer until (possible) new metadata
-  size_t metadata;
+  // Total number of bytes written (only changed by the writer) and read (only
+  // changed by the reader), used for the marker positions
+  uint64_t written;
+  uint64_t read;
 
-  // Optional callback to player if buffer is full
-  input_cb full_cb;
+  // Queue of markers, also single-producer/single-consumer
+  struct input_marker markers[INPUT_MARKERS_MAX];
+  unsigned int marker_write;
+  unsigned int marker_read;
+};
+
+// While the player is still playing the current source, the next source can be
+// opened and decoded in the background (pre-rolled). The decoded data goes to
+// a staging buffer, which becomes the input buffer when the current source
+// reaches EOF. Access is protected by input_lock.
+struct input_preroll
+{
+  // The source being pre-rolled (owned by the player)
+  struct player_source *ps;
+
+  // Thread that opens and decodes the source, becomes the input thread when
+  // the player switches to the source
+  pthread_t tid;
 
-  // Locks for sharing the buffer between input and player thread
-  pthread_mutex_t mutex;
+  // Staging buffer
+  struct input_buffer *buffer;
+
+  // Result of the source setup, valid when setup_complete is set
+  int setup_ret;
+  bool setup_complete;
+
+  // Set when the player abandons the pre-roll
+  bool loop_break;
+
+  // Signals setup completion
   pthread_cond_t cond;
 };
 
@@ -88,11 +129,27 @@ struct input_buffer
 // Input thread
 static pthread_t tid_input;
 
-// Input buffer
-static struct input_buffer input_buffer;
+// The buffer the player reads from and the staging buffer for the pre-roll.
+// The player swaps them when it switches to a pre-rolled source.
+static struct input_buffer input_buffers[2];
+static struct input_buffer *input_buffer;
+
+// Pre-rolled next source
+static struct input_preroll input_preroll;
+
+// Serializes writers, and protects the buffer pointers and the pre-roll state.
+// Not used by the player when reading from the input buffer.
+static pthread_mutex_t input_lock;
+static pthread_cond_t input_cond;
+
+// Optional callback to player if buffer is full
+static input_cb input_full_cb;
+
+// Size of the input buffers, the sources read this far ahead of playback
+static size_t input_buffer_size;
 
 // Timeout waiting in playback loop
-static struct timespec input_loop_timeout = { INPUT_LOOP_TIMEOUT, 0 };
+static struct timespec input_loop_timeout = { 0, INPUT_LOOP_TIMEOUT_MS * 1000000 };
 
 #ifdef DEBUG
 static size_t debug_elapsed;
@@ -101,47 +158,107 @@ static size_t debug_elapsed;
 
 /* ------------------------------ MISC HELPERS ---------------------------- */
 
-static short
-flags_set(size_t len)
+// Writer: moves as much of evbuf to the buffer as there is room for
+static void
+buffer_write(struct input_buffer *buffer, struct evbuffer *evbuf)
 {
-  short flags = 0;
+  struct evbuffer_iovec iov;
+  size_t len;
+  int n;
 
-  if (input_buffer.error)
+  while (evbuffer_get_length(evbuf) > 0)
     {
-      if (len >= input_buffer.error)
-	{
-	  flags |= INPUT_FLAG_ERROR;
-	  input_buffer.error = 0;
-	}
-      else
-	input_buffer.error -= len;
+      n = evbuffer_peek(evbuf, -1, NULL, &iov, 1);
+      if (n < 1)
+	break;
+
+      len = ringbuffer_write(&buffer->ring, iov.iov_base, iov.iov_len);
+      evbuffer_drain(evbuf, len);
+
+      buffer->written += len;
+
+      if (len < iov.iov_len)
+	break;
     }
+}
 
-  if (input_buffer.eof)
+// Writer: adds a marker at the current write position
+static void
+buffer_marker_add(struct input_buffer *buffer, short flags)
+{
+  unsigned int write_idx;
+  unsigned int read_idx;
+  unsigned int next_idx;
+
+  flags &= (INPUT_FLAG_EOF | INPUT_FLAG_ERROR | INPUT_FLAG_METADATA);
+  if (!flags)
+    return;
+
+  write_idx = __atomic_load_n(&buffer->marker_write, __ATOMIC_RELAXED);
+  read_idx = __atomic_load_n(&buffer->marker_read, __ATOMIC_ACQUIRE);
+
+  next_idx = (write_idx + 1) % INPUT_MARKERS_MAX;
+  if (next_idx == read_idx)
     {
-      if (len >= input_buffer.eof)
-	{
-	  flags |= INPUT_FLAG_EOF;
-	  input_buffer.eof = 0;
-	}
-      else
-	input_buffer.eof -= len;
+      DPRINTF(E_LOG, L_PLAYER, "Bug! Too many markers in input buffer, dropping flags %d\n", flags);
+      return;
     }
 
-  if (input_buffer.metadata)
+  buffer->markers[write_idx].pos = buffer->written;
+  buffer->markers[write_idx].flags = flags;
+
+  __atomic_store_n(&buffer->marker_write, next_idx, __ATOMIC_RELEASE);
+}
+
+// Reader: returns the flags of the markers that have been reached
+static short
+buffer_markers_get(struct input_buffer *buffer)
+{
+  unsigned int write_idx;
+  unsigned int read_idx;
+  short flags;
+
+  read_idx = __atomic_load_n(&buffer->marker_read, __ATOMIC_RELAXED);
+  write_idx = __atomic_load_n(&buffer->marker_write, __ATOMIC_ACQUIRE);
+
+  flags = 0;
+  while ((read_idx != write_idx) && (buffer->markers[read_idx].pos <= buffer->read))
     {
-      if (len >= input_buffer.metadata)
-	{
-	  flags |= INPUT_FLAG_METADATA;
-	  input_buffer.metadata = 0;
-	}
-      else
-	input_buffer.metadata -= len;
+      flags |= buffer->markers[read_idx].flags;
+      read_idx = (read_idx + 1) % INPUT_MARKERS_MAX;
     }
 
+  __atomic_store_n(&buffer->marker_read, read_idx, __ATOMIC_RELEASE);
+
   return flags;
 }
 
+// Reader: discards all data in the buffer, returns number of bytes discarded
+static size_t
+buffer_flush(struct input_buffer *buffer, short *flags)
+{
+  size_t len;
+
+  len = ringbuffer_read(NULL, SIZE_MAX, &buffer->ring);
+  buffer->read += len;
+
+  *flags = buffer_markers_get(buffer);
+
+  return len;
+}
+
+// Must only be called when there are no readers or writers
+static void
+buffer_reset(struct input_buffer *buffer)
+{
+  ringbuffer_reset(&buffer->ring);
+
+  buffer->written = 0;
+  buffer->read = 0;
+  buffer->marker_write = 0;
+  buffer->marker_read = 0;
+}
+
 static int
 map_data_kind(int data_kind)
 {
@@ -197,6 +314,24 @@ source_check_and_map(struct player_source *ps, const char *action, char check_se
   return type;
 }
 
+// Must be called with the input lock held
+static bool
+is_preroll_thread(void)
+{
+  return input_preroll.ps && pthread_equal(pthread_self(), input_preroll.tid);
+}
+
+// Must be called with the input lock held
+static void
+preroll_reset(void)
+{
+  input_preroll.ps = NULL;
+  input_preroll.tid = 0;
+  input_preroll.setup_ret = 0;
+  input_preroll.setup_complete = false;
+  input_preroll.loop_break = false;
+}
+
 /* ----------------------------- PLAYBACK LOOP ---------------------------- */
 /*                               Thread: input                              */
 
@@ -208,6 +343,8 @@ playback(void *arg)
   int type;
   int ret;
 
+  thread_sched_set(THREAD_CLASS_AUDIO);
+
   type = source_check_and_map(ps, "start", 1);
   if ((type < 0) || (inputs[type]->disabled))
     goto thread_exit;
@@ -225,70 +362,254 @@ playback(void *arg)
   pthread_exit(NULL);
 }
 
+// Same as playback(), except that the source is also set up here, so that the
+// player thread doesn't have to wait for e.g. a slow network share
+static void *
+preroll(void *arg)
+{
+  struct player_source *ps = arg;
+  bool loop_break;
+  int type;
+  int ret;
+
+  thread_sched_set(THREAD_CLASS_AUDIO);
+
+  ret = -1;
+  type = source_check_and_map(ps, "preroll", 0);
+  if ((type >= 0) && !inputs[type]->disabled)
+    ret = inputs[type]->setup ? inputs[type]->setup(ps) : 0;
+
+  pthread_mutex_lock(&input_lock);
+
+  input_preroll.setup_ret = ret;
+  input_preroll.setup_complete = true;
+  loop_break = input_preroll.loop_break;
+
+  pthread_cond_broadcast(&input_preroll.cond);
+  pthread_mutex_unlock(&input_lock);
+
+  if ((ret < 0) || loop_break)
+    goto thread_exit;
+
+  ret = inputs[type]->start(ps);
+  if (ret < 0)
+    input_write(NULL, INPUT_FLAG_ERROR);
+
+#ifdef DEBUG
+  DPRINTF(E_DBG, L_PLAYER, "Pre-roll playback loop stopped (break is %d, ret %d)\n", input_loop_break, ret);
+#endif
+
+ thread_exit:
+  pthread_exit(NULL);
+}
+
 void
 input_wait(void)
 {
   struct timespec ts;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_lock);
 
   ts = timespec_reltoabs(input_loop_timeout);
-  pthread_cond_timedwait(&input_buffer.cond, &input_buffer.mutex, &ts);
+  pthread_cond_timedwait(&input_cond, &input_lock, &ts);
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_mutex_unlock(&input_lock);
 }
 
 // Called by input modules from within the playback loop
 int
 input_write(struct evbuffer *evbuf, short flags)
 {
+  struct input_buffer *buffer;
   struct timespec ts;
-  int ret;
+  input_cb full_cb;
+  bool is_preroll;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_lock);
 
-  while ( (!input_loop_break) && (evbuffer_get_length(input_buffer.evbuf) > INPUT_BUFFER_THRESHOLD) && evbuf )
+  for (;;)
     {
-      if (input_buffer.full_cb)
+      // A pre-rolling source writes to the staging buffer until the player
+      // switches to it, so this must be checked every time we have waited
+      is_preroll = is_preroll_thread();
+      buffer = is_preroll ? input_preroll.buffer : input_buffer;
+
+      if ((is_preroll && input_preroll.loop_break) || (!is_preroll && input_loop_break))
+	break;
+
+      if (evbuf)
+	buffer_write(buffer, evbuf);
+
+      // Enough buffered for the player to start, or the buffer is full. The
+      // callback is made without the lock, since it will wait for the player
+      // thread, which might be waiting for the lock.
+      if (!is_preroll && input_full_cb &&
+	  ((ringbuffer_len(&buffer->ring) >= INPUT_BUFFER_START) || (evbuf && evbuffer_get_length(evbuf) > 0)))
 	{
-	  input_buffer.full_cb();
-	  input_buffer.full_cb = NULL;
+	  full_cb = input_full_cb;
+	  input_full_cb = NULL;
+
+	  pthread_mutex_unlock(&input_lock);
+	  full_cb();
+	  pthread_mutex_lock(&input_lock);
+	  continue;
 	}
 
+      if (!evbuf || (evbuffer_get_length(evbuf) == 0))
+	break;
+
       if (flags & INPUT_FLAG_NONBLOCK)
 	{
-	  pthread_mutex_unlock(&input_buffer.mutex);
+	  pthread_mutex_unlock(&input_lock);
 	  return EAGAIN;
 	}
 
       ts = timespec_reltoabs(input_loop_timeout);
-      pthread_cond_timedwait(&input_buffer.cond, &input_buffer.mutex, &ts);
+      pthread_cond_timedwait(&input_cond, &input_lock, &ts);
     }
 
-  if (input_loop_break)
+  // Pre-roll was abandoned, make the playback loop end
+  if (is_preroll && input_preroll.loop_break)
     {
-      pthread_mutex_unlock(&input_buffer.mutex);
+      pthread_mutex_unlock(&input_lock);
+      return -1;
+    }
+
+  if (!is_preroll && input_loop_break)
+    {
+      pthread_mutex_unlock(&input_lock);
       return 0;
     }
 
-  if (evbuf)
-    ret = evbuffer_add_buffer(input_buffer.evbuf, evbuf);
-  else
-    ret = 0;
+  buffer_marker_add(buffer, flags);
 
-  if (ret < 0)
-    DPRINTF(E_LOG, L_PLAYER, "Error adding stream data to input buffer\n");
+  pthread_mutex_unlock(&input_lock);
+
+  return 0;
+}
+
+
+ssize_t
+input_write_fd(int fd, size_t size, short flags)
+{
+  struct input_buffer *buffer;
+  struct timespec ts;
+  input_cb full_cb;
+  bool is_preroll;
+  ssize_t got;
+
+  pthread_mutex_lock(&input_lock);
+
+  for (;;)
+    {
+      is_preroll = is_preroll_thread();
+      buffer = is_preroll ? input_preroll.buffer : input_buffer;
+
+      if ((is_preroll && input_preroll.loop_break) || (!is_preroll && input_loop_break))
+	{
+	  pthread_mutex_unlock(&input_lock);
+	  errno = ECANCELED;
+	  return -1;
+	}
+
+      if (ringbuffer_space(&buffer->ring) > 0)
+	break;
+
+      // Buffer is full, see input_write()
+      if (!is_preroll && input_full_cb)
+	{
+	  full_cb = input_full_cb;
+	  input_full_cb = NULL;
+
+	  pthread_mutex_unlock(&input_lock);
+	  full_cb();
+	  pthread_mutex_lock(&input_lock);
+	  continue;
+	}
+
+      if (flags & INPUT_FLAG_NONBLOCK)
+	{
+	  pthread_mutex_unlock(&input_lock);
+	  errno = EAGAIN;
+	  return -1;
+	}
+
+      ts = timespec_reltoabs(input_loop_timeout);
+      pthread_cond_timedwait(&input_cond, &input_lock, &ts);
+    }
+
+  got = ringbuffer_write_fd(&buffer->ring, fd, size);
+  if (got <= 0)
+    {
+      pthread_mutex_unlock(&input_lock);
+      return got;
+    }
+
+  buffer->written += got;
+  buffer_marker_add(buffer, flags);
+
+  full_cb = NULL;
+  if (!is_preroll && input_full_cb && (ringbuffer_len(&buffer->ring) >= INPUT_BUFFER_START))
+    {
+      full_cb = input_full_cb;
+      input_full_cb = NULL;
+    }
+
+  pthread_mutex_unlock(&input_lock);
+
+  if (full_cb)
+    full_cb();
+
+  return got;
+}
+
+int
+input_write_frames(const void *frames, int nframes, size_t frame_size, short flags)
+{
+  struct input_buffer *buffer;
+  input_cb full_cb;
+  bool is_preroll;
+  size_t space;
+  int n;
+
+  pthread_mutex_lock(&input_lock);
+
+  is_preroll = is_preroll_thread();
+  buffer = is_preroll ? input_preroll.buffer : input_buffer;
+
+  if ((is_preroll && input_preroll.loop_break) || (!is_preroll && input_loop_break))
+    {
+      pthread_mutex_unlock(&input_lock);
+      errno = ECANCELED;
+      return -1;
+    }
+
+  // Only whole frames, the source will deliver the rest again
+  space = ringbuffer_space(&buffer->ring);
+  n = (space / frame_size < (size_t)nframes) ? space / frame_size : nframes;
+  if (n > 0)
+    {
+      ringbuffer_write(&buffer->ring, frames, n * frame_size);
 
-  if (!input_buffer.error && (flags & INPUT_FLAG_ERROR))
-    input_buffer.error = evbuffer_get_length(input_buffer.evbuf);
-  if (!input_buffer.eof && (flags & INPUT_FLAG_EOF))
-    input_buffer.eof = evbuffer_get_length(input_buffer.evbuf);
-  if (!input_buffer.metadata && (flags & INPUT_FLAG_METADATA))
-    input_buffer.metadata = evbuffer_get_length(input_buffer.evbuf);
+      buffer->written += n * frame_size;
+      buffer_marker_add(buffer, flags);
+    }
+
+  // Same as input_write(), the full callback runs when there is enough to play
+  // or when no more fits
+  full_cb = NULL;
+  if (!is_preroll && input_full_cb && (n < nframes || ringbuffer_len(&buffer->ring) >= INPUT_BUFFER_START))
+    {
+      full_cb = input_full_cb;
+      input_full_cb = NULL;
+    }
+
+  pthread_mutex_unlock(&input_lock);
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  if (full_cb)
+    full_cb();
 
-  return ret;
+  return n;
 }
 
 
@@ -298,7 +619,7 @@ input_write(struct evbuffer *evbuf, short flags)
 int
 input_read(void *data, size_t size, short *flags)
 {
-  int len;
+  size_t len;
 
   *flags = 0;
 
@@ -308,29 +629,20 @@ input_read(void *data, size_t size, short *flags)
       return -1;
     }
 
-  pthread_mutex_lock(&input_buffer.mutex);
-
 #ifdef DEBUG
   debug_elapsed += size;
   if (debug_elapsed > STOB(441000)) // 10 sec
     {
-      DPRINTF(E_DBG, L_PLAYER, "Input buffer has %zu bytes\n", evbuffer_get_length(input_buffer.evbuf));
+      DPRINTF(E_DBG, L_PLAYER, "Input buffer has %zu bytes\n", ringbuffer_len(&input_buffer->ring));
       debug_elapsed = 0;
     }
 #endif
 
-  len = evbuffer_remove(input_buffer.evbuf, data, size);
-  if (len < 0)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Error reading stream data from input buffer\n");
-      goto out_unlock;
-    }
+  // No locking, we are the only reader
+  len = ringbuffer_read(data, size, &input_buffer->ring);
+  input_buffer->read += len;
 
-  *flags = flags_set(len);
-
- out_unlock:
-  pthread_cond_signal(&input_buffer.cond);
-  pthread_mutex_unlock(&input_buffer.mutex);
+  *flags = buffer_markers_get(input_buffer);
 
   return len;
 }
@@ -338,10 +650,18 @@ input_read(void *data, size_t size, short *flags)
 void
 input_buffer_full_cb(input_cb cb)
 {
-  pthread_mutex_lock(&input_buffer.mutex);
-  input_buffer.full_cb = cb;
+  pthread_mutex_lock(&input_lock);
+  input_full_cb = cb;
+
+  pthread_mutex_unlock(&input_lock);
+}
+
+size_t
+input_buffer_level(size_t *size)
+{
+  *size = input_buffer_size;
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  return ringbuffer_len(&input_buffer->ring);
 }
 
 int
@@ -359,6 +679,170 @@ input_setup(struct player_source *ps)
   return inputs[type]->setup(ps);
 }
 
+int
+input_preroll_start(struct player_source *ps)
+{
+  int type;
+  int ret;
+
+  if (input_preroll.ps)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Bug! Pre-roll called, but already pre-rolling '%s'\n", input_preroll.ps->path);
+      return -1;
+    }
+
+  type = source_check_and_map(ps, "preroll", 0);
+  if ((type < 0) || (inputs[type]->disabled))
+    return -1;
+
+  // The staging buffer has no readers or writers at this point
+  buffer_reset(input_preroll.buffer);
+
+  // Holding the lock makes sure that input_preroll.tid is set before the new
+  // thread can make its first input_write()
+  pthread_mutex_lock(&input_lock);
+
+  input_preroll.ps = ps;
+
+  ret = pthread_create(&input_preroll.tid, NULL, preroll, ps);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not spawn pre-roll thread: %s\n", strerror(ret));
+      preroll_reset();
+      pthread_mutex_unlock(&input_lock);
+      return -1;
+    }
+
+  pthread_mutex_unlock(&input_lock);
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(input_preroll.tid, "input");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(input_preroll.tid, "input");
+#endif
+
+  DPRINTF(E_DBG, L_PLAYER, "Pre-rolling '%s' (id=%d, item-id=%d)\n", ps->path, ps->id, ps->item_id);
+
+  return 0;
+}
+
+int
+input_preroll_switch(struct player_source *ps_prev, struct player_source *ps)
+{
+  struct input_buffer *buffer;
+  short flags;
+  int type;
+  int ret;
+
+  if (!ps || (ps != input_preroll.ps))
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Bug! Pre-roll switch called with a source that is not pre-rolled\n");
+      return -1;
+    }
+
+  pthread_mutex_lock(&input_lock);
+
+  while (!input_preroll.setup_complete)
+    pthread_cond_wait(&input_preroll.cond, &input_lock);
+
+  ret = input_preroll.setup_ret;
+
+  pthread_mutex_unlock(&input_lock);
+
+  if (ret < 0)
+    {
+      input_preroll_stop();
+      return -1;
+    }
+
+  // The previous source is at EOF, so its playback loop will end by itself. We
+  // must not set input_loop_break, since that would also end the loop of the
+  // pre-rolled source.
+  if (tid_input)
+    {
+      ret = pthread_join(tid_input, NULL);
+      if (ret != 0)
+	DPRINTF(E_LOG, L_PLAYER, "Could not join input thread: %s\n", strerror(ret));
+
+      tid_input = 0;
+    }
+
+  if (ps_prev)
+    {
+      type = source_check_and_map(ps_prev, "stop", 1);
+      if ((type >= 0) && !inputs[type]->disabled && inputs[type]->stop)
+	inputs[type]->stop(ps_prev);
+    }
+
+  // Anything left after EOF is stale
+  buffer_flush(input_buffer, &flags);
+
+  pthread_mutex_lock(&input_lock);
+
+  // Swap, so the staging buffer becomes the input buffer. The pre-roll thread
+  // is now the input thread, and since it checks which buffer to use every time
+  // it writes, it will continue with the (same) buffer that it filled so far.
+  buffer = input_buffer;
+  input_buffer = input_preroll.buffer;
+  input_preroll.buffer = buffer;
+
+  tid_input = input_preroll.tid;
+
+  preroll_reset();
+
+  pthread_cond_broadcast(&input_cond);
+  pthread_mutex_unlock(&input_lock);
+
+#ifdef DEBUG
+  DPRINTF(E_DBG, L_PLAYER, "Switched to pre-rolled source, input buffer has %zu bytes\n", ringbuffer_len(&input_buffer->ring));
+#endif
+
+  return 0;
+}
+
+void
+input_preroll_stop(void)
+{
+  struct player_source *ps;
+  pthread_t tid;
+  int type;
+  int ret;
+
+  pthread_mutex_lock(&input_lock);
+
+  ps = input_preroll.ps;
+  tid = input_preroll.tid;
+  if (!ps)
+    {
+      pthread_mutex_unlock(&input_lock);
+      return;
+    }
+
+  input_preroll.loop_break = true;
+
+  pthread_cond_broadcast(&input_cond);
+  pthread_mutex_unlock(&input_lock);
+
+  ret = pthread_join(tid, NULL);
+  if (ret != 0)
+    DPRINTF(E_LOG, L_PLAYER, "Could not join pre-roll thread: %s\n", strerror(ret));
+
+  pthread_mutex_lock(&input_lock);
+  preroll_reset();
+  pthread_mutex_unlock(&input_lock);
+
+  if (ps->setup_done)
+    {
+      type = source_check_and_map(ps, "stop", 1);
+      if ((type >= 0) && !inputs[type]->disabled && inputs[type]->stop)
+	inputs[type]->stop(ps);
+    }
+
+#ifdef DEBUG
+  DPRINTF(E_DBG, L_PLAYER, "Pre-roll of '%s' stopped\n", ps->path);
+#endif
+}
+
 int
 input_start(struct player_source *ps)
 {
@@ -401,12 +885,12 @@ input_pause(struct player_source *ps)
   if (!tid_input)
     return -1;
 
-  pthread_mutex_lock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_lock);
 
   input_loop_break = 1;
 
-  pthread_cond_signal(&input_buffer.cond);
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_cond_broadcast(&input_cond);
+  pthread_mutex_unlock(&input_lock);
 
   // TODO What if input thread is hanging waiting for source? Kill thread?
   ret = pthread_join(tid_input, NULL);
@@ -467,20 +951,11 @@ input_flush(short *flags)
 {
   size_t len;
 
-  pthread_mutex_lock(&input_buffer.mutex);
-
-  len = evbuffer_get_length(input_buffer.evbuf);
-
-  evbuffer_drain(input_buffer.evbuf, len);
-
-  *flags = flags_set(len);
-
-  input_buffer.error = 0;
-  input_buffer.eof = 0;
-  input_buffer.metadata = 0;
-  input_buffer.full_cb = NULL;
+  len = buffer_flush(input_buffer, flags);
 
-  pthread_mutex_unlock(&input_buffer.mutex);
+  pthread_mutex_lock(&input_lock);
+  input_full_cb = NULL;
+  pthread_mutex_unlock(&input_lock);
 
 #ifdef DEBUG
   DPRINTF(E_DBG, L_PLAYER, "Flushing %zu bytes with flags %d\n", len, *flags);
@@ -540,16 +1015,27 @@ input_init(void)
   int i;
 
   // Prepare input buffer
-  pthread_mutex_init(&input_buffer.mutex, NULL);
-  pthread_cond_init(&input_buffer.cond, NULL);
+  pthread_mutex_init(&input_lock, NULL);
+  pthread_cond_init(&input_cond, NULL);
+  pthread_cond_init(&input_preroll.cond, NULL);
 
-  input_buffer.evbuf = evbuffer_new();
-  if (!input_buffer.evbuf)
+  input_buffer_size = STOB(44100 * cfg_getint(cfg_getsec(cfg, "general"), "readahead_seconds"));
+  if (input_buffer_size < INPUT_BUFFER_START)
+    input_buffer_size = INPUT_BUFFER_START;
+
+  for (i = 0; i < (sizeof(input_buffers) / sizeof(input_buffers[0])); i++)
     {
-      DPRINTF(E_LOG, L_PLAYER, "Out of memory for input buffer\n");
-      return -1;
+      ret = ringbuffer_init(&input_buffers[i].ring, input_buffer_size);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_PLAYER, "Out of memory for input buffer\n");
+	  return -1;
+	}
     }
 
+  input_buffer = &input_buffers[0];
+  input_preroll.buffer = &input_buffers[1];
+
   no_input = 1;
   for (i = 0; inputs[i]; i++)
     {
@@ -583,6 +1069,8 @@ input_deinit(void)
 {
   int i;
 
+  input_preroll_stop();
+
   input_stop(NULL);
 
   for (i = 0; inputs[i]; i++)
@@ -594,9 +1082,11 @@ input_deinit(void)
         inputs[i]->deinit();
     }
 
-  pthread_cond_destroy(&input_buffer.cond);
-  pthread_mutex_destroy(&input_buffer.mutex);
+  pthread_cond_destroy(&input_preroll.cond);
+  pthread_cond_destroy(&input_cond);
+  pthread_mutex_destroy(&input_lock);
 
-  evbuffer_free(input_buffer.evbuf);
+  for (i = 0; i < (sizeof(input_buffers) / sizeof(input_buffers[0])); i++)
+    ringbuffer_free(&input_buffers[i].ring, 1);
 }
 
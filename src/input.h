@@ -46,6 +46,10 @@ struct player_source
   enum media_kind media_kind;
   char *path;
 
+  /* Audio parameters found by the library scan, 0 if not known */
+  uint32_t samplerate;
+  uint32_t bits_per_sample;
+
   /* Start time of the media item as rtp-time
      The stream-start is the rtp-time the media item did or would have
      started playing (after seek or pause), therefor the elapsed time of the
@@ -76,6 +80,10 @@ struct player_source
    */
   int setup_done;
 
+  /* Player has already tried to pre-roll the source that follows this one
+   */
+  int preroll_checked;
+
   struct player_source *play_next;
 };
 
@@ -153,6 +161,35 @@ int input_loop_break;
 int
 input_write(struct evbuffer *evbuf, short flags);
 
+/*
+ * Same as input_write(), except that the data is read from fd directly into
+ * the input buffer, without copying it through an evbuffer. Waits for room in
+ * the buffer, but will not wait for the fd, so that should be non-blocking.
+ *
+ * @in  fd       File descriptor to read from
+ * @in  size     Max number of bytes to read
+ * @in  flags    One or more INPUT_FLAG_*, applied if data was read
+ * @return       Bytes read, 0 on eof, -1 on error (errno is EAGAIN if no data
+ *               was available, or ECANCELED if the loop should end)
+ */
+ssize_t
+input_write_fd(int fd, size_t size, short flags);
+
+/*
+ * Writes as many whole frames as there is room for without waiting, for
+ * sources like libspotify that call back with the data and deliver whatever
+ * was not consumed again. The data goes straight into the input buffer.
+ *
+ * @in  frames     Raw audio data
+ * @in  nframes    Number of frames in data
+ * @in  frame_size Bytes per frame
+ * @in  flags      One or more INPUT_FLAG_*, applied if frames were written
+ * @return         Frames written (0 if the buffer is full), -1 if the loop
+ *                 should end
+ */
+int
+input_write_frames(const void *frames, int nframes, size_t frame_size, short flags);
+
 /*
  * Input modules can use this to wait in the playback loop (like input_write()
  * would have done)
@@ -181,12 +218,48 @@ input_read(void *data, size_t size, short *flags);
 void
 input_buffer_full_cb(input_cb cb);
 
+/*
+ * Gets the fill level of the input buffer. Only the player thread is allowed
+ * to call this, since it is the only reader of the buffer.
+ *
+ * @out size     Capacity of the buffer in bytes
+ * @return       Number of bytes currently in the buffer
+ */
+size_t
+input_buffer_level(size_t *size);
+
 /*
  * Initializes the given player source for playback
  */
 int
 input_setup(struct player_source *ps);
 
+/*
+ * Sets up the given player source and starts its playback loop in a separate
+ * thread, so that it can be ready when the current source reaches EOF. Until
+ * input_preroll_switch() is called, the data goes to a staging buffer and not
+ * to the input buffer. Only one source can be pre-rolled at a time.
+ */
+int
+input_preroll_start(struct player_source *ps);
+
+/*
+ * Makes the pre-rolled source the one feeding the input buffer, i.e. after
+ * this the source is playing as if input_setup() and input_start() had been
+ * called. Must only be called when ps_prev has reached EOF, ps_prev will be
+ * cleaned up as with input_stop(). Returns -1 if the setup of the pre-rolled
+ * source failed, in which case ps_prev is left untouched.
+ */
+int
+input_preroll_switch(struct player_source *ps_prev, struct player_source *ps);
+
+/*
+ * Stops pre-rolling (if running) and cleans up the pre-rolled player source.
+ * The player source itself must be freed by the caller.
+ */
+void
+input_preroll_stop(void);
+
 /*
  * Tells the input to start or resume playback, i.e. after calling this function
  * the input buffer will begin to fill up, and should be read periodically with
@@ -18,23 +18,230 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <event2/buffer.h>
 
 #include "transcode.h"
 #include "http.h"
 #include "misc.h"
+#include "logger.h"
 #include "input.h"
 
+// If an internet stream fails, we make this many attempts to set it up again,
+// HTTP_RECONNECT_INTERVAL ms apart, before giving up. Meanwhile the player
+// continues playing what is in the input buffer.
+#define HTTP_RECONNECT_TRIES 10
+#define HTTP_RECONNECT_INTERVAL 2000
+
+// Protects ps->input_ctx of http sources, since the player thread reads the
+// metadata while the input thread may be replacing the context
+static pthread_mutex_t http_ctx_lck;
+
+// Max bytes read from a wav file in one go
+#define FILE_RAW_READ_MAX 16384
+
+// A wav file with audio in the output format of the player (PCM 44.1 kHz 16
+// bit stereo) is read straight into the input buffer, skipping ffmpeg
+struct file_raw
+{
+  int fd;
+  off_t data_start;
+  off_t data_end;
+  off_t pos;
+};
+
+struct file_ctx
+{
+  // Only one of these is set
+  struct transcode_ctx *xcode;
+  struct file_raw *raw;
+};
+
+static uint32_t
+le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t
+le16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+// Returns an open wav file positioned at the start of the audio data, or NULL
+// if the file isn't a wav the player can take as it is
+static struct file_raw *
+file_raw_open(struct player_source *ps)
+{
+  struct file_raw *raw;
+  struct stat sb;
+  uint8_t hdr[16];
+  uint32_t chunk_len;
+  off_t pos;
+  const char *ext;
+  bool fmt_ok;
+  int fd;
+
+  ext = strrchr(ps->path, '.');
+  if (ps->samplerate != 44100 || ps->bits_per_sample != 16 || !ext || strcasecmp(ext, ".wav") != 0)
+    return NULL;
+
+  fd = open(ps->path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &sb) < 0 || read(fd, hdr, 12) != 12 || memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0)
+    goto out_close;
+
+  fmt_ok = false;
+  pos = 12;
+  for (;;)
+    {
+      if (pread(fd, hdr, 8, pos) != 8)
+	goto out_close;
+
+      chunk_len = le32(hdr + 4);
+
+      if (memcmp(hdr, "fmt ", 4) == 0)
+	{
+	  // Only plain PCM, i.e. not WAVE_FORMAT_EXTENSIBLE
+	  if (chunk_len < 16 || pread(fd, hdr, 16, pos + 8) != 16)
+	    goto out_close;
+
+	  fmt_ok = (le16(hdr) == 1 && le16(hdr + 2) == 2 && le32(hdr + 4) == 44100 && le16(hdr + 14) == 16);
+	  if (!fmt_ok)
+	    goto out_close;
+	}
+      else if (memcmp(hdr, "data", 4) == 0)
+	break;
+
+      // Chunks are padded to an even length
+      pos += 8 + chunk_len + (chunk_len & 1);
+    }
+
+  if (!fmt_ok)
+    goto out_close;
+
+  CHECK_NULL(L_PLAYER, raw = calloc(1, sizeof(struct file_raw)));
+
+  raw->fd = fd;
+  raw->data_start = pos + 8;
+  raw->data_end = raw->data_start + chunk_len;
+
+  // Some writers leave the length at 0 or at the max if they don't know it
+  if (chunk_len == 0 || chunk_len == UINT32_MAX || raw->data_end > sb.st_size)
+    raw->data_end = sb.st_size;
+
+  raw->pos = raw->data_start;
+  if (lseek(fd, raw->pos, SEEK_SET) < 0)
+    {
+      free(raw);
+      goto out_close;
+    }
+
+  DPRINTF(E_DBG, L_PLAYER, "Reading '%s' without decoding\n", ps->path);
+
+  return raw;
+
+ out_close:
+  close(fd);
+  return NULL;
+}
+
+static void
+file_raw_close(struct file_raw *raw)
+{
+  close(raw->fd);
+  free(raw);
+}
+
+static int
+file_raw_start(struct file_raw *raw)
+{
+  size_t len;
+  ssize_t got;
+
+  while (!input_loop_break)
+    {
+      len = raw->data_end - raw->pos;
+      if (len > FILE_RAW_READ_MAX)
+	len = FILE_RAW_READ_MAX;
+      else if (len == 0)
+	{
+	  input_write(NULL, INPUT_FLAG_EOF);
+	  return 0;
+	}
+
+      got = input_write_fd(raw->fd, len, 0);
+      if (got < 0 && errno == ECANCELED)
+	return 0;
+      else if (got < 0)
+	{
+	  DPRINTF(E_LOG, L_PLAYER, "Could not read wav file: %s\n", strerror(errno));
+	  return -1;
+	}
+      else if (got == 0) // File was truncated
+	{
+	  input_write(NULL, INPUT_FLAG_EOF);
+	  return 0;
+	}
+
+      raw->pos += got;
+    }
+
+  return 0;
+}
+
+static int
+file_raw_seek(struct file_raw *raw, int seek_ms)
+{
+  off_t pos;
+
+  // Whole frames of 4 bytes
+  pos = raw->data_start + ((off_t)seek_ms * 44100 / 1000) * 4;
+  if (pos > raw->data_end)
+    pos = raw->data_end;
+
+  if (lseek(raw->fd, pos, SEEK_SET) < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not seek in wav file: %s\n", strerror(errno));
+      return -1;
+    }
+
+  raw->pos = pos;
+
+  return (pos - raw->data_start) / 4 * 1000 / 44100;
+}
+
 static int
 setup(struct player_source *ps)
 {
-  ps->input_ctx = transcode_setup(XCODE_PCM16_NOHEADER, ps->data_kind, ps->path, ps->len_ms, NULL);
-  if (!ps->input_ctx)
-    return -1;
+  struct transcode_source_params params = { ps->samplerate, ps->bits_per_sample };
+  struct file_ctx *ctx;
+
+  CHECK_NULL(L_PLAYER, ctx = calloc(1, sizeof(struct file_ctx)));
+
+  ctx->raw = file_raw_open(ps);
+  if (!ctx->raw)
+    ctx->xcode = transcode_setup(XCODE_PCM16_NOHEADER, ps->data_kind, ps->path, ps->len_ms, NULL, &params);
 
+  if (!ctx->raw && !ctx->xcode)
+    {
+      free(ctx);
+      return -1;
+    }
+
+  ps->input_ctx = ctx;
   ps->setup_done = 1;
 
   return 0;
@@ -51,17 +258,27 @@ setup_http(struct player_source *ps)
   free(ps->path);
   ps->path = url;
 
-  return setup(ps);
+  ps->input_ctx = transcode_setup(XCODE_PCM16_NOHEADER, ps->data_kind, ps->path, ps->len_ms, NULL, NULL);
+  if (!ps->input_ctx)
+    return -1;
+
+  ps->setup_done = 1;
+
+  return 0;
 }
 
 static int
 start(struct player_source *ps)
 {
+  struct file_ctx *ctx = ps->input_ctx;
   struct evbuffer *evbuf;
   short flags;
   int ret;
   int icy_timer;
 
+  if (ctx->raw)
+    return file_raw_start(ctx->raw);
+
   evbuf = evbuffer_new();
 
   ret = -1;
@@ -70,7 +287,7 @@ start(struct player_source *ps)
     {
       // We set "wanted" to 1 because the read size doesn't matter to us
       // TODO optimize?
-      ret = transcode(evbuf, &icy_timer, ps->input_ctx, 1);
+      ret = transcode(evbuf, &icy_timer, ctx->xcode, 1);
       if (ret < 0)
 	break;
 
@@ -87,6 +304,87 @@ start(struct player_source *ps)
   return ret;
 }
 
+// Sets up the stream again after an error (or after eof for a live stream).
+// Returns -1 if the stream could not be set up or if the loop should end.
+static int
+reconnect_http(struct player_source *ps)
+{
+  struct transcode_ctx *ctx;
+  int i;
+  int j;
+
+  for (i = 0; i < HTTP_RECONNECT_TRIES; i++)
+    {
+      // Sleep in small steps, so we notice if playback is stopped
+      for (j = 0; (j < HTTP_RECONNECT_INTERVAL / 100) && !input_loop_break; j++)
+	usleep(100000);
+
+      if (input_loop_break)
+	return -1;
+
+      DPRINTF(E_LOG, L_PLAYER, "Reconnecting to '%s' (attempt %d of %d)\n", ps->path, i + 1, HTTP_RECONNECT_TRIES);
+
+      ctx = transcode_setup(XCODE_PCM16_NOHEADER, ps->data_kind, ps->path, ps->len_ms, NULL, NULL);
+      if (!ctx)
+	continue;
+
+      pthread_mutex_lock(&http_ctx_lck);
+      swap_pointers((char **)&ps->input_ctx, (char **)&ctx);
+      pthread_mutex_unlock(&http_ctx_lck);
+
+      transcode_cleanup(&ctx);
+      return 0;
+    }
+
+  DPRINTF(E_LOG, L_PLAYER, "Giving up reconnecting to '%s'\n", ps->path);
+
+  return -1;
+}
+
+static int
+start_http(struct player_source *ps)
+{
+  struct evbuffer *evbuf;
+  short flags;
+  int ret;
+  int icy_timer;
+
+  evbuf = evbuffer_new();
+
+  ret = -1;
+  flags = 0;
+  while (!input_loop_break && !(flags & INPUT_FLAG_EOF))
+    {
+      ret = transcode(evbuf, &icy_timer, ps->input_ctx, 1);
+
+      // A live stream (no length) never ends by itself, so both errors and eof
+      // mean that we lost the connection
+      if ((ret < 0 || (ret == 0 && ps->len_ms == 0)) && !input_loop_break)
+	{
+	  DPRINTF(E_WARN, L_PLAYER, "Lost connection to '%s'\n", ps->path);
+
+	  ret = reconnect_http(ps);
+	  if (ret < 0)
+	    break;
+
+	  continue;
+	}
+      else if (ret < 0)
+	break;
+
+      flags = ((ret == 0) ? INPUT_FLAG_EOF : 0) |
+               (icy_timer ? INPUT_FLAG_METADATA : 0);
+
+      ret = input_write(evbuf, flags);
+      if (ret < 0)
+	break;
+    }
+
+  evbuffer_free(evbuf);
+
+  return ret;
+}
+
 static int
 stop(struct player_source *ps)
 {
@@ -100,10 +398,33 @@ stop(struct player_source *ps)
   return 0;
 }
 
+static int
+stop_file(struct player_source *ps)
+{
+  struct file_ctx *ctx = ps->input_ctx;
+
+  if (ctx->raw)
+    file_raw_close(ctx->raw);
+  else
+    transcode_cleanup(&ctx->xcode);
+
+  free(ctx);
+
+  ps->input_ctx = NULL;
+  ps->setup_done = 0;
+
+  return 0;
+}
+
 static int
 seek(struct player_source *ps, int seek_ms)
 {
-  return transcode_seek(ps->input_ctx, seek_ms);
+  struct file_ctx *ctx = ps->input_ctx;
+
+  if (ctx->raw)
+    return file_raw_seek(ctx->raw, seek_ms);
+
+  return transcode_seek(ctx->xcode, seek_ms);
 }
 
 static int
@@ -112,7 +433,9 @@ metadata_get_http(struct input_metadata *metadata, struct player_source *ps, uin
   struct http_icy_metadata *m;
   int changed;
 
-  m = transcode_metadata(ps->input_ctx, &changed);
+  pthread_mutex_lock(&http_ctx_lck);
+  m = ps->input_ctx ? transcode_metadata(ps->input_ctx, &changed) : NULL;
+  pthread_mutex_unlock(&http_ctx_lck);
   if (!m)
     return -1;
 
@@ -134,6 +457,18 @@ metadata_get_http(struct input_metadata *metadata, struct player_source *ps, uin
   return 0;
 }
 
+static int
+init_http(void)
+{
+  return mutex_init(&http_ctx_lck);
+}
+
+static void
+deinit_http(void)
+{
+  pthread_mutex_destroy(&http_ctx_lck);
+}
+
 struct input_definition input_file =
 {
   .name = "file",
@@ -141,7 +476,7 @@ struct input_definition input_file =
   .disabled = 0,
   .setup = setup,
   .start = start,
-  .stop = stop,
+  .stop = stop_file,
   .seek = seek,
 };
 
@@ -151,7 +486,9 @@ struct input_definition input_http =
   .type = INPUT_TYPE_HTTP,
   .disabled = 0,
   .setup = setup_http,
-  .start = start,
+  .start = start_http,
   .stop = stop,
   .metadata_get = metadata_get_http,
+  .init = init_http,
+  .deinit = deinit_http,
 };
@@ -62,6 +62,9 @@
 #define PIPE_MAX_WATCH 4
 // Max number of bytes to read from a pipe at a time
 #define PIPE_READ_MAX 65536
+// Size we ask the kernel to use for the pipe buffer (default is usually 64 kB,
+// which is only 0.4 seconds of 44.1/16 audio)
+#define PIPE_BUFFER_SIZE 262144
 // Max number of bytes to buffer from metadata pipes
 #define PIPE_METADATA_BUFLEN_MAX 262144
 
@@ -166,6 +169,11 @@ pipe_open(const char *path, bool silent)
       return -1;
     }
 
+#ifdef F_SETPIPE_SZ
+  if (fcntl(fd, F_SETPIPE_SZ, PIPE_BUFFER_SIZE) < 0)
+    DPRINTF(E_DBG, L_PLAYER, "Could not set pipe buffer size of '%s': %s\n", path, strerror(errno));
+#endif
+
   return fd;
 }
 
@@ -801,7 +809,7 @@ setup(struct player_source *ps)
   pipe->fd = fd;
   pipe->is_autostarted = (ps->id == pipe_autostart_id);
 
-  worker_execute(pipe_metadata_watch_add, ps->path, strlen(ps->path) + 1, 0);
+  worker_execute(pipe_metadata_watch_add, ps->path, strlen(ps->path) + 1, 0, WORKER_PRIO_NORMAL);
 
   ps->input_ctx = pipe;
   ps->setup_done = 1;
@@ -813,24 +821,19 @@ static int
 start(struct player_source *ps)
 {
   struct pipe *pipe = ps->input_ctx;
-  struct evbuffer *evbuf;
   short flags;
   int ret;
 
-  evbuf = evbuffer_new();
-  if (!evbuf)
-    {
-      DPRINTF(E_LOG, L_PLAYER, "Out of memory for pipe evbuf\n");
-      return -1;
-    }
-
   ret = -1;
   while (!input_loop_break)
     {
-      ret = evbuffer_read(evbuf, pipe->fd, PIPE_READ_MAX);
+      // The data goes straight from the pipe to the input buffer
+      flags = (pipe_metadata_is_new ? INPUT_FLAG_METADATA : 0);
+
+      ret = input_write_fd(pipe->fd, PIPE_READ_MAX, flags);
       if ((ret == 0) && (pipe->is_autostarted))
 	{
-	  input_write(evbuf, INPUT_FLAG_EOF); // Autostop
+	  input_write(NULL, INPUT_FLAG_EOF); // Autostop
 	  break;
 	}
       else if ((ret == 0) || ((ret < 0) && (errno == EAGAIN)))
@@ -838,22 +841,23 @@ start(struct player_source *ps)
 	  input_wait();
 	  continue;
 	}
+      else if ((ret < 0) && (errno == ECANCELED))
+	{
+	  ret = 0;
+	  break;
+	}
       else if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_PLAYER, "Could not read from pipe '%s': %s\n", ps->path, strerror(errno));
 	  break;
 	}
 
-      flags = (pipe_metadata_is_new ? INPUT_FLAG_METADATA : 0);
-      pipe_metadata_is_new = 0;
+      if (flags)
+	pipe_metadata_is_new = 0;
 
-      ret = input_write(evbuf, flags);
-      if (ret < 0)
-	break;
+      ret = 0;
     }
 
-  evbuffer_free(evbuf);
-
   return ret;
 }
 
@@ -876,7 +880,7 @@ stop(struct player_source *ps)
     }
 
   if (pipe_metadata)
-    worker_execute(pipe_metadata_watch_del, NULL, 0, 0);
+    worker_execute(pipe_metadata_watch_del, NULL, 0, 0, WORKER_PRIO_NORMAL);
 
   pipe_free(pipe);
 
@@ -927,7 +931,7 @@ init(void)
   if (pipe_autostart)
     {
       pipe_listener_cb(0);
-      CHECK_ERR(L_PLAYER, listener_add(pipe_listener_cb, LISTENER_DATABASE));
+      CHECK_ERR(L_PLAYER, listener_add(pipe_listener_cb, LISTENER_DATABASE, NULL));
     }
 
   return 0;
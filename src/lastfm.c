@@ -29,6 +29,7 @@
 #include <time.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/param.h>
 
 #include <gcrypt.h>
 #include <mxml.h>
@@ -43,6 +44,38 @@
 #include "logger.h"
 #include "misc.h"
 #include "http.h"
+#include "worker.h"
+
+// Max number of scrobbles in one request, as allowed by Last.fm
+#define LASTFM_SCROBBLE_BATCH 50
+// Max number of scrobbles we keep while Last.fm can't be reached
+#define LASTFM_SCROBBLE_QUEUE_MAX 10000
+// Seconds to wait after a failed scrobble request, doubled for each failure
+#define LASTFM_RETRY_MIN 60
+#define LASTFM_RETRY_MAX 3600
+
+// Last.fm error codes that we handle
+#define LASTFM_ERROR_INVALID_SESSION 9
+#define LASTFM_ERROR_OFFLINE 11
+#define LASTFM_ERROR_UNAVAILABLE 16
+#define LASTFM_ERROR_RATE_LIMIT 29
+
+struct scrobble_param
+{
+  char name[32];
+  char *value;
+};
+
+struct scrobble_batch
+{
+  struct scrobble_param params[LASTFM_SCROBBLE_BATCH * 7 + 3];
+  int nparams;
+
+  int64_t last_id;
+  int count;
+
+  struct http_client_ctx ctx;
+};
 
 // LastFM becomes disabled if we get a scrobble, try initialising session,
 // but can't (probably no session key in db because user does not use LastFM)
@@ -61,6 +94,11 @@ static const char *auth_url = "https://ws.audioscrobbler.com/2.0/";
 // Session key
 static char *lastfm_session_key = NULL;
 
+// Sending of the scrobble queue (only touched by the worker thread)
+static bool scrobble_sending;
+static int scrobble_retry_delay;
+static time_t scrobble_retry_at;
+
 
 
 /* --------------------------------- HELPERS ------------------------------- */
@@ -120,7 +158,7 @@ param_sign(struct keyval *kv)
 /* --------------------------------- MAIN --------------------------------- */
 
 static int
-response_process(struct http_client_ctx *ctx, char **errmsg)
+response_process(struct http_client_ctx *ctx, char **errmsg, int *errcode)
 {
   mxml_node_t *tree;
   mxml_node_t *s_node;
@@ -155,6 +193,8 @@ response_process(struct http_client_ctx *ctx, char **errmsg)
 
       if (errmsg)
 	*errmsg = trimwhitespace(mxmlGetOpaque(e_node));
+      if (errcode && mxmlElementGetAttr(e_node, "code"))
+	safe_atoi32(mxmlElementGetAttr(e_node, "code"), errcode);
 
       mxmlDelete(tree);
       return -1;
@@ -243,7 +283,7 @@ request_post(const char *url, struct keyval *kv, char **errmsg)
   if (ret < 0)
     goto out_free_ctx;
 
-  ret = response_process(&ctx, errmsg);
+  ret = response_process(&ctx, errmsg, NULL);
 
  out_free_ctx:
   free(ctx.output_body);
@@ -252,14 +292,238 @@ request_post(const char *url, struct keyval *kv, char **errmsg)
   return ret;
 }
 
+/* ------------------------------ SCROBBLE QUEUE ---------------------------- */
+/*                                Thread: worker                              */
+
+static void
+scrobble_send(void);
+
+static void
+batch_param_add(struct scrobble_batch *batch, const char *name, int i, const char *value)
+{
+  struct scrobble_param *param;
+
+  if (!value || value[0] == '\0')
+    return;
+
+  param = &batch->params[batch->nparams++];
+  if (i < 0)
+    snprintf(param->name, sizeof(param->name), "%s", name);
+  else
+    snprintf(param->name, sizeof(param->name), "%s[%d]", name, i);
+  param->value = strdup(value);
+}
+
+static void
+batch_add(struct scrobble_info *si, void *arg)
+{
+  struct scrobble_batch *batch = arg;
+  char buf[32];
+  int i;
+
+  i = batch->count;
+
+  batch_param_add(batch, "album", i, si->album);
+  batch_param_add(batch, "albumArtist", i, si->album_artist);
+  batch_param_add(batch, "artist", i, si->artist);
+  if (si->duration)
+    {
+      snprintf(buf, sizeof(buf), "%" PRIu32, si->duration);
+      batch_param_add(batch, "duration", i, buf);
+    }
+  snprintf(buf, sizeof(buf), "%" PRIi64, si->timestamp);
+  batch_param_add(batch, "timestamp", i, buf);
+  batch_param_add(batch, "track", i, si->title);
+  if (si->track)
+    {
+      snprintf(buf, sizeof(buf), "%" PRIu32, si->track);
+      batch_param_add(batch, "trackNumber", i, buf);
+    }
+
+  batch->last_id = si->id;
+  batch->count++;
+}
+
+static int
+batch_param_cmp(const void *a, const void *b)
+{
+  const struct scrobble_param *pa = a;
+  const struct scrobble_param *pb = b;
+
+  return strcmp(pa->name, pb->name);
+}
+
+static void
+batch_free(struct scrobble_batch *batch)
+{
+  int i;
+
+  for (i = 0; i < batch->nparams; i++)
+    free(batch->params[i].value);
+
+  free(batch->ctx.output_body);
+  if (batch->ctx.input_body)
+    evbuffer_free(batch->ctx.input_body);
+
+  free(batch);
+}
+
+static void
+scrobble_retry_cb(void *arg)
+{
+  scrobble_retry_at = 0;
+  scrobble_send();
+}
+
+static void
+scrobble_backoff(void)
+{
+  if (scrobble_retry_delay == 0)
+    scrobble_retry_delay = LASTFM_RETRY_MIN;
+  else if (scrobble_retry_delay < LASTFM_RETRY_MAX)
+    scrobble_retry_delay = MIN(2 * scrobble_retry_delay, LASTFM_RETRY_MAX);
+
+  DPRINTF(E_LOG, L_LASTFM, "Scrobbles will be kept and sent again in %d sec\n", scrobble_retry_delay);
+
+  scrobble_retry_at = time(NULL) + scrobble_retry_delay;
+  worker_execute(scrobble_retry_cb, NULL, 0, scrobble_retry_delay, WORKER_PRIO_BACKGROUND);
+}
+
+static void
+scrobble_sent(void *arg)
+{
+  struct scrobble_batch *batch = *(struct scrobble_batch **)arg;
+  int errcode;
+  int ret;
+
+  scrobble_sending = false;
+
+  if (batch->ctx.ret < 0)
+    {
+      DPRINTF(E_LOG, L_LASTFM, "Could not reach LastFM\n");
+      batch_free(batch);
+      scrobble_backoff();
+      return;
+    }
+
+  errcode = 0;
+  ret = response_process(&batch->ctx, NULL, &errcode);
+  if (ret < 0)
+    {
+      if (errcode == LASTFM_ERROR_OFFLINE || errcode == LASTFM_ERROR_UNAVAILABLE || errcode == LASTFM_ERROR_RATE_LIMIT || errcode == 0)
+	{
+	  batch_free(batch);
+	  scrobble_backoff();
+	  return;
+	}
+
+      if (errcode == LASTFM_ERROR_INVALID_SESSION)
+	{
+	  // Queue is kept, it will be sent when the user logs in again
+	  DPRINTF(E_LOG, L_LASTFM, "LastFM session is no longer valid, please log in again\n");
+	  lastfm_disabled = true;
+	  batch_free(batch);
+	  return;
+	}
+
+      // Any other error means LastFM will never accept the batch
+      DPRINTF(E_LOG, L_LASTFM, "Dropping %d scrobbles rejected by LastFM (error %d)\n", batch->count, errcode);
+    }
+  else
+    DPRINTF(E_DBG, L_LASTFM, "Sent %d scrobbles to LastFM\n", batch->count);
+
+  db_scrobble_delete_upto(batch->last_id);
+  batch_free(batch);
+
+  scrobble_retry_delay = 0;
+
+  // Continue with the next batch, if any
+  scrobble_send();
+}
+
+/* Thread: httpc */
+static void
+scrobble_request_cb(struct http_client_ctx *ctx, void *arg)
+{
+  struct scrobble_batch *batch = arg;
+
+  worker_execute(scrobble_sent, &batch, sizeof(struct scrobble_batch *), 0, WORKER_PRIO_BACKGROUND);
+}
+
+/* Sends the oldest queued scrobbles in one request. Only one request at a time,
+ * so that the queue is sent in order.
+ */
+static void
+scrobble_send(void)
+{
+  struct scrobble_batch *batch;
+  struct keyval *kv;
+  int ret;
+  int i;
+
+  if (lastfm_disabled || scrobble_sending || (time(NULL) < scrobble_retry_at))
+    return;
+
+  CHECK_NULL(L_LASTFM, batch = calloc(1, sizeof(struct scrobble_batch)));
+
+  ret = db_scrobble_enum(LASTFM_SCROBBLE_BATCH, batch_add, batch);
+  if (ret < 0 || batch->count == 0)
+    goto out_free_batch;
+
+  kv = keyval_alloc();
+  if (!kv)
+    goto out_free_batch;
+
+  batch_param_add(batch, "api_key", -1, lastfm_api_key);
+  batch_param_add(batch, "method", -1, "track.scrobble");
+  batch_param_add(batch, "sk", -1, lastfm_session_key);
+
+  // API requires that we MD5 sign sorted params
+  qsort(batch->params, batch->nparams, sizeof(struct scrobble_param), batch_param_cmp);
+
+  ret = 1;
+  for (i = 0; ret && i < batch->nparams; i++)
+    ret = (keyval_add(kv, batch->params[i].name, batch->params[i].value) == 0);
+
+  if (!ret || param_sign(kv) < 0)
+    goto out_free_kv;
+
+  batch->ctx.output_body = http_form_urlencode(kv);
+  if (!batch->ctx.output_body)
+    goto out_free_kv;
+
+  keyval_clear(kv);
+  free(kv);
+
+  batch->ctx.url = api_url;
+  batch->ctx.input_body = evbuffer_new();
+
+  DPRINTF(E_INFO, L_LASTFM, "Sending %d scrobbles to LastFM\n", batch->count);
+
+  scrobble_sending = true;
+
+  ret = http_client_request_async(&batch->ctx, scrobble_request_cb, batch);
+  if (ret < 0)
+    {
+      scrobble_sending = false;
+      batch_free(batch);
+      scrobble_backoff();
+    }
+
+  return;
+
+ out_free_kv:
+  keyval_clear(kv);
+  free(kv);
+ out_free_batch:
+  batch_free(batch);
+}
+
 static int
 scrobble(int id)
 {
   struct media_file_info *mfi;
-  struct keyval *kv;
-  char duration[4];
-  char trackNumber[4];
-  char timestamp[16];
+  struct scrobble_info si;
   int ret;
 
   mfi = db_file_fetch_byid(id);
@@ -281,44 +545,28 @@ scrobble(int id)
   if (strcmp(mfi->artist, "Unknown artist") == 0)
     goto noscrobble;
 
-  kv = keyval_alloc();
-  if (!kv)
-    goto noscrobble;
+  memset(&si, 0, sizeof(struct scrobble_info));
+  si.artist = mfi->artist;
+  si.title = mfi->title;
+  si.album = mfi->album;
+  si.album_artist = mfi->album_artist;
+  si.track = mfi->track;
+  si.duration = mfi->song_length / 1000;
+  si.timestamp = (int64_t)time(NULL);
 
-  snprintf(duration, sizeof(duration), "%" PRIu32, mfi->song_length);
-  snprintf(trackNumber, sizeof(trackNumber), "%" PRIu32, mfi->track);
-  snprintf(timestamp, sizeof(timestamp), "%" PRIi64, (int64_t)time(NULL));
+  DPRINTF(E_INFO, L_LASTFM, "Scrobbling '%s' by '%s'\n", mfi->title, mfi->artist);
 
-  ret = (
-	  (keyval_add(kv, "album", mfi->album) == 0) &&
-	  (keyval_add(kv, "albumArtist", mfi->album_artist) == 0) &&
-	  (keyval_add(kv, "api_key", lastfm_api_key) == 0) &&
-	  (keyval_add(kv, "artist", mfi->artist) == 0) &&
-	  (keyval_add(kv, "duration", duration) == 0) &&
-	  (keyval_add(kv, "method", "track.scrobble") == 0) &&
-	  (keyval_add(kv, "sk", lastfm_session_key) == 0) &&
-	  (keyval_add(kv, "timestamp", timestamp) == 0) &&
-	  (keyval_add(kv, "track", mfi->title) == 0) &&
-	  (keyval_add(kv, "trackNumber", trackNumber) == 0)
-      );
+  // The queue survives restarts and LastFM being unavailable
+  ret = db_scrobble_add(&si, LASTFM_SCROBBLE_QUEUE_MAX);
 
   free_mfi(mfi, 0);
 
-  if (!ret)
-    {
-      keyval_clear(kv);
-      free(kv);
-      return -1;
-    }
-
-  DPRINTF(E_INFO, L_LASTFM, "Scrobbling '%s' by '%s'\n", keyval_get(kv, "track"), keyval_get(kv, "artist"));
-
-  ret = request_post(api_url, kv, NULL);
+  if (ret < 0)
+    return -1;
 
-  keyval_clear(kv);
-  free(kv);
+  scrobble_send();
 
-  return ret;
+  return 0;
 
  noscrobble:
   free_mfi(mfi, 0);
@@ -372,6 +620,10 @@ lastfm_login_user(const char *user, const char *password, char **errmsg)
   // Send the login request
   ret = request_post(auth_url, kv, errmsg);
 
+  // Send whatever was scrobbled while we were logged out
+  if (ret == 0)
+    worker_execute(scrobble_retry_cb, NULL, 0, 0, WORKER_PRIO_BACKGROUND);
+
  out_free_kv:
   keyval_clear(kv);
   free(kv);
@@ -427,8 +679,13 @@ lastfm_init(void)
     {
       DPRINTF(E_DBG, L_LASTFM, "No valid LastFM session key\n");
       lastfm_disabled = true;
+      return 0;
     }
 
+  // Send scrobbles left in the queue from before
+  if (db_scrobble_count() > 0)
+    worker_execute(scrobble_retry_cb, NULL, 0, 10, WORKER_PRIO_BACKGROUND);
+
   return 0;
 }
 
@@ -25,6 +25,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <inttypes.h>
 #include <pthread.h>
 #ifdef HAVE_PTHREAD_NP_H
 # include <pthread_np.h>
@@ -32,6 +33,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unictype.h>
 #include <uninorm.h>
 #include <unistr.h>
@@ -44,6 +46,7 @@
 #include "conffile.h"
 #include "db.h"
 #include "logger.h"
+#include "metrics.h"
 #include "misc.h"
 #include "listener.h"
 #include "player.h"
@@ -90,11 +93,60 @@ static bool scanning;
 static struct timeval library_update_wait = { 5, 0 };
 static struct event *updateev;
 
+// Writes the in-memory library database back to disk, see db_persist()
+static struct timeval persist_wait;
+static struct event *persistev;
+
+// Checks for pending database maintenance, see db_maintenance_schedule()
+static struct timeval maintenance_wait = { 60, 0 };
+static struct event *maintenanceev;
+static int maintenance_idle;
+
+// Set if this instance is a frontend of another instance that scans the
+// library into the shared database. Frontends don't scan, instead they poll
+// the library revision and notify their listeners when it has changed.
+#define LIBRARY_FRONTEND_POLL_SECS 2
+static bool frontend;
+static struct timeval frontend_wait = { LIBRARY_FRONTEND_POLL_SECS, 0 };
+static struct event *frontendev;
+static int64_t frontend_revision;
+
 // Counts the number of changes made to the database between to DATABASE
 // event notifications
 static unsigned int deferred_update_notifications;
 static short deferred_update_events;
 
+// Scan session, see library_scan_session_begin(). Bulk scans write in one
+// transaction per this many files or milliseconds, whatever comes first, so
+// that we don't need a journal sync for every file.
+struct scan_session
+{
+  bool active;
+  unsigned int nfiles;
+  unsigned int nfiles_total;
+  struct timespec start;
+};
+
+static struct scan_session scan_session;
+static unsigned int scan_session_files;
+static unsigned int scan_session_ms;
+
+// Progress counters of the running or last scan, see library_scan_stats_get().
+// They are updated from the scan thread and from the probe workers, so they
+// are guarded by a mutex. While scanning, listeners get a LISTENER_SCAN event
+// at most every SCAN_STATS_NOTIFY_SECS seconds.
+#define SCAN_STATS_NOTIFY_SECS 2
+#define SCAN_STATS_BUCKETS 40
+
+static struct library_scan_stats scan_stats;
+static uint64_t scan_stats_probe_hist[SCAN_STATS_BUCKETS];
+static char scan_stats_slowest[PATH_MAX];
+static time_t scan_stats_notified;
+
+// Start of the interrupted scan we are resuming, see scan_checkpoint_begin()
+static time_t scan_resume_start;
+static pthread_mutex_t scan_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+
 static bool
 handle_deferred_update_notifications(void)
 {
@@ -106,6 +158,11 @@ handle_deferred_update_notifications(void)
 
       deferred_update_notifications = 0;
       db_admin_setint64(DB_ADMIN_DB_UPDATE, (int64_t) time(NULL));
+
+      // Lets frontends know, and keeps a frontend from notifying its own
+      // listeners twice about the change
+      db_library_revision_bump();
+      frontend_revision = db_library_revision_get();
     }
 
   return ret;
@@ -378,6 +435,9 @@ fixup_tags(struct media_file_info *mfi)
 void
 library_add_media(struct media_file_info *mfi)
 {
+  struct timespec start;
+  struct timespec end;
+
   if (!mfi->path || !mfi->fname)
     {
       DPRINTF(E_LOG, L_LIB, "Ignoring media file with missing values (path='%s', fname='%s', data_kind='%d')\n",
@@ -401,10 +461,19 @@ library_add_media(struct media_file_info *mfi)
 
   fixup_tags(mfi);
 
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   if (mfi->id == 0)
     db_file_add(mfi);
   else
     db_file_update(mfi);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  scan_stats.files_saved++;
+  scan_stats.db_write_usec += (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
 }
 
 int
@@ -555,12 +624,358 @@ library_add_queue_item(struct media_file_info *mfi)
   return db_queue_add_item(&queue_item, 0, 0);
 }
 
+/*
+ * Scan sessions (thread: library)
+ *
+ * A scan session groups the database writes of a bulk scan in transactions.
+ * Call library_scan_session_step() after each file written, it will commit
+ * the current transaction and begin a new one after scan_transaction_files
+ * files or scan_transaction_ms milliseconds. Update notifications are
+ * deferred while scanning, so there will be a single one when the scan is
+ * over.
+ */
+void
+library_scan_session_begin(void)
+{
+  if (scan_session.active)
+    {
+      DPRINTF(E_LOG, L_LIB, "Bug! Scan session already begun\n");
+      return;
+    }
+
+  scan_session.active = true;
+  scan_session.nfiles = 0;
+  scan_session.nfiles_total = 0;
+  clock_gettime(CLOCK_MONOTONIC, &scan_session.start);
+
+  db_transaction_begin();
+}
+
+/*
+ * @return true if the transaction was committed, otherwise false
+ */
+bool
+library_scan_session_step(void)
+{
+  struct timespec now;
+  unsigned int elapsed_ms;
+
+  if (!scan_session.active)
+    return false;
+
+  scan_session.nfiles++;
+  scan_session.nfiles_total++;
+
+  if (scan_session.nfiles < scan_session_files)
+    {
+      if (scan_session_ms == 0)
+	return false;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed_ms = (now.tv_sec - scan_session.start.tv_sec) * 1000 + (now.tv_nsec - scan_session.start.tv_nsec) / 1000000;
+      if (elapsed_ms < scan_session_ms)
+	return false;
+    }
+
+  DPRINTF(E_DBG, L_LIB, "Committing scan transaction of %u files (%u total)\n", scan_session.nfiles, scan_session.nfiles_total);
+
+  db_transaction_end();
+  db_transaction_begin();
+
+  scan_session.nfiles = 0;
+  clock_gettime(CLOCK_MONOTONIC, &scan_session.start);
+
+  return true;
+}
+
+/*
+ * @return total number of files in the session
+ */
+unsigned int
+library_scan_session_end(void)
+{
+  if (!scan_session.active)
+    return 0;
+
+  db_transaction_end();
+
+  scan_session.active = false;
+
+  return scan_session.nfiles_total;
+}
+
+static void
+scan_stats_begin(void)
+{
+  int expected;
+
+  expected = db_files_get_count();
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+
+  memset(&scan_stats, 0, sizeof(struct library_scan_stats));
+  memset(scan_stats_probe_hist, 0, sizeof(scan_stats_probe_hist));
+  scan_stats_slowest[0] = '\0';
+
+  scan_stats.running = true;
+  scan_stats.start = time(NULL);
+  scan_stats.files_expected = (expected > 0) ? expected : 0;
+  scan_stats_notified = scan_stats.start;
+
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+}
+
+static void
+scan_stats_end(void)
+{
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+
+  scan_stats.running = false;
+  scan_stats.end = time(NULL);
+
+  DPRINTF(E_LOG, L_LIB, "Scan visited %" PRIu64 " directories, probed %" PRIu64 " files (slowest %" PRIu64 " ms: '%s'), skipped %" PRIu64 " unchanged files, spent %" PRIu64 " ms writing to the database\n",
+	  scan_stats.dirs_visited, scan_stats.files_probed, scan_stats.probe_usec_max / 1000, scan_stats_slowest,
+	  scan_stats.files_skipped, scan_stats.db_write_usec / 1000);
+
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+}
+
+// Must be called with scan_stats_lck locked
+static bool
+scan_stats_notify_due(void)
+{
+  time_t now;
+
+  if (!scan_stats.running)
+    return false;
+
+  now = time(NULL);
+  if (now - scan_stats_notified < SCAN_STATS_NOTIFY_SECS)
+    return false;
+
+  scan_stats_notified = now;
+  return true;
+}
+
+// Must be called with scan_stats_lck locked
+static uint64_t
+scan_stats_percentile(unsigned int pct)
+{
+  uint64_t total;
+  uint64_t sum;
+  uint64_t bound;
+  int i;
+
+  for (i = 0, total = 0; i < SCAN_STATS_BUCKETS; i++)
+    total += scan_stats_probe_hist[i];
+
+  if (total == 0)
+    return 0;
+
+  for (i = 0, sum = 0; i < SCAN_STATS_BUCKETS; i++)
+    {
+      sum += scan_stats_probe_hist[i];
+      if (sum * 100 >= total * pct)
+	break;
+    }
+
+  bound = (uint64_t)1 << (i + 1);
+
+  return (bound < scan_stats.probe_usec_max) ? bound : scan_stats.probe_usec_max;
+}
+
+/*
+ * Counts a directory visited by the scan
+ */
+void
+library_scan_stats_dir(void)
+{
+  bool notify;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  scan_stats.dirs_visited++;
+  notify = scan_stats_notify_due();
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+
+  if (notify)
+    listener_notify(LISTENER_SCAN);
+}
+
+/*
+ * Counts files that were unchanged, so they were only pinged
+ */
+void
+library_scan_stats_skipped(unsigned int nfiles)
+{
+  bool notify;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+  scan_stats.files_skipped += nfiles;
+  notify = scan_stats_notify_due();
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+
+  if (notify)
+    listener_notify(LISTENER_SCAN);
+}
+
+/*
+ * Counts a file probed for metadata, and the time it took. Safe to call from
+ * any thread.
+ */
+void
+library_scan_stats_probe(const char *path, uint64_t usec)
+{
+  bool notify;
+  int i;
+
+  for (i = 0; (i < SCAN_STATS_BUCKETS - 1) && (usec >> (i + 1)); i++)
+    ;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+
+  scan_stats.files_probed++;
+  scan_stats_probe_hist[i]++;
+
+  if (usec > scan_stats.probe_usec_max)
+    {
+      scan_stats.probe_usec_max = usec;
+      snprintf(scan_stats_slowest, sizeof(scan_stats_slowest), "%s", path);
+    }
+
+  notify = scan_stats_notify_due();
+
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+
+  if (notify)
+    listener_notify(LISTENER_SCAN);
+}
+
+/*
+ * Gets the progress of the running scan, or the result of the last scan. The
+ * caller must free stats->probe_slowest.
+ */
+void
+library_scan_stats_get(struct library_scan_stats *stats)
+{
+  time_t elapsed;
+  uint64_t done;
+
+  CHECK_ERR(L_LIB, pthread_mutex_lock(&scan_stats_lck));
+
+  *stats = scan_stats;
+
+  stats->probe_usec_p50 = scan_stats_percentile(50);
+  stats->probe_usec_p90 = scan_stats_percentile(90);
+  stats->probe_usec_p99 = scan_stats_percentile(99);
+  stats->probe_slowest = scan_stats_slowest[0] ? strdup(scan_stats_slowest) : NULL;
+
+  CHECK_ERR(L_LIB, pthread_mutex_unlock(&scan_stats_lck));
+
+  stats->files_per_sec = 0;
+  stats->eta_sec = stats->running ? -1 : 0;
+
+  if (!stats->start)
+    return;
+
+  elapsed = (stats->running ? time(NULL) : stats->end) - stats->start;
+  done = stats->files_probed + stats->files_skipped;
+  if (elapsed > 0)
+    stats->files_per_sec = (double)done / elapsed;
+
+  if (stats->running && (stats->files_per_sec > 0) && (stats->files_expected > done))
+    stats->eta_sec = (stats->files_expected - done) / stats->files_per_sec;
+}
+
+/* The scan stats start over with each scan, so they are all gauges */
+static void
+scan_stats_metrics_cb(struct evbuffer *evbuf)
+{
+  struct library_scan_stats stats;
+
+  library_scan_stats_get(&stats);
+  free(stats.probe_slowest);
+
+  metrics_print_family(evbuf, "forked_daapd_scan_running", METRICS_GAUGE, "Whether a library scan is running");
+  metrics_print_value(evbuf, "forked_daapd_scan_running", NULL, stats.running);
+
+  metrics_print_family(evbuf, "forked_daapd_scan_files", METRICS_GAUGE, "Files handled by the running or last library scan");
+  metrics_print_value(evbuf, "forked_daapd_scan_files", "state=\"probed\"", stats.files_probed);
+  metrics_print_value(evbuf, "forked_daapd_scan_files", "state=\"skipped\"", stats.files_skipped);
+  metrics_print_value(evbuf, "forked_daapd_scan_files", "state=\"saved\"", stats.files_saved);
+
+  metrics_print_family(evbuf, "forked_daapd_scan_files_per_second", METRICS_GAUGE, "Throughput of the running or last library scan");
+  evbuffer_add_printf(evbuf, "forked_daapd_scan_files_per_second %.2f\n", stats.files_per_sec);
+
+  metrics_print_family(evbuf, "forked_daapd_scan_probe_seconds", METRICS_GAUGE, "Approximate metadata probe time percentiles of the running or last library scan");
+  metrics_print_seconds(evbuf, "forked_daapd_scan_probe_seconds", "quantile=\"0.5\"", stats.probe_usec_p50);
+  metrics_print_seconds(evbuf, "forked_daapd_scan_probe_seconds", "quantile=\"0.9\"", stats.probe_usec_p90);
+  metrics_print_seconds(evbuf, "forked_daapd_scan_probe_seconds", "quantile=\"0.99\"", stats.probe_usec_p99);
+  metrics_print_seconds(evbuf, "forked_daapd_scan_probe_seconds", "quantile=\"1\"", stats.probe_usec_max);
+
+  metrics_print_family(evbuf, "forked_daapd_scan_db_write_seconds", METRICS_GAUGE, "Time the running or last library scan spent writing to the database");
+  metrics_print_seconds(evbuf, "forked_daapd_scan_db_write_seconds", NULL, stats.db_write_usec);
+}
+
+/*
+ * The start time of a scan is saved in the admin table until the scan is
+ * complete. If the server is stopped during a scan, the next scan resumes
+ * with the old start time as the purge reference. Everything seen by either
+ * run has been pinged since then, so the purge is still correct, and sources
+ * can skip what they had completed before (see library_scan_resuming()).
+ */
+static time_t
+scan_checkpoint_begin(time_t starttime, bool allow_resume)
+{
+  int64_t prev;
+
+  prev = allow_resume ? db_admin_getint64(DB_ADMIN_SCAN_START) : 0;
+  if ((prev > 0) && (prev < starttime))
+    {
+      DPRINTF(E_LOG, L_LIB, "Resuming library scan that was interrupted (started %.f sec ago)\n", difftime(starttime, (time_t)prev));
+
+      scan_resume_start = prev;
+      return prev;
+    }
+
+  scan_resume_start = 0;
+  db_admin_setint64(DB_ADMIN_SCAN_START, (int64_t) starttime);
+
+  return starttime;
+}
+
+/* Returns true if the scan was completed */
+static bool
+scan_checkpoint_end(void)
+{
+  scan_resume_start = 0;
+
+  if (library_is_exiting())
+    {
+      DPRINTF(E_LOG, L_LIB, "Library scan interrupted, will resume at next start\n");
+      return false;
+    }
+
+  db_admin_setint64(DB_ADMIN_SCAN_START, 0);
+  return true;
+}
+
+/*
+ * @return the start time of the interrupted scan that the running scan is
+ *         resuming, or 0 if it is not a resumed scan
+ */
+time_t
+library_scan_resuming(void)
+{
+  return scan_resume_start;
+}
+
 static void
 purge_cruft(time_t start)
 {
   DPRINTF(E_DBG, L_LIB, "Purging old library content\n");
   db_purge_cruft(start);
   db_groups_cleanup();
+  db_sortkeys_update();
   db_queue_cleanup();
 
   DPRINTF(E_DBG, L_LIB, "Purging old artwork content\n");
@@ -571,12 +986,15 @@ static enum command_state
 rescan(void *arg, int *ret)
 {
   time_t starttime;
+  time_t purgetime;
   time_t endtime;
   int i;
 
   DPRINTF(E_LOG, L_LIB, "Library rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  purgetime = scan_checkpoint_begin(starttime, true);
+  scan_stats_begin();
 
   for (i = 0; sources[i]; i++)
     {
@@ -591,10 +1009,13 @@ rescan(void *arg, int *ret)
 	}
     }
 
-  purge_cruft(starttime);
+  // Don't purge after an incomplete scan, what wasn't seen yet would be lost
+  if (scan_checkpoint_end())
+    purge_cruft(purgetime);
 
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
+  scan_stats_end();
   scanning = false;
 
   if (handle_deferred_update_notifications())
@@ -616,6 +1037,8 @@ fullrescan(void *arg, int *ret)
   DPRINTF(E_LOG, L_LIB, "Library full-rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  scan_checkpoint_begin(starttime, false); // Everything is purged anyway
+  scan_stats_begin();
 
   player_playback_stop();
   db_queue_clear(0);
@@ -634,8 +1057,11 @@ fullrescan(void *arg, int *ret)
 	}
     }
 
+  scan_checkpoint_end();
+
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library full-rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
+  scan_stats_end();
   scanning = false;
 
   if (handle_deferred_update_notifications())
@@ -655,11 +1081,63 @@ update_trigger_cb(int fd, short what, void *arg)
 {
   if (handle_deferred_update_notifications())
     {
+      // Rank sort tags of files added since the last scan
+      db_sortkeys_update();
+
       listener_notify(deferred_update_events);
       deferred_update_events = 0;
     }
 }
 
+static void
+persist_cb(int fd, short what, void *arg)
+{
+  db_persist();
+
+  evtimer_add(persistev, &persist_wait);
+}
+
+static void
+maintenance_cb(int fd, short what, void *arg)
+{
+  struct player_status status;
+
+  if (!db_maintenance_pending() || scanning)
+    goto readd;
+
+  if (maintenance_idle > 0)
+    {
+      if (time(NULL) - db_maintenance_last_request() < maintenance_idle)
+	goto readd;
+
+      player_get_status(&status);
+      if (status.status != PLAY_STOPPED)
+	goto readd;
+    }
+
+  db_maintenance_run(db_maintenance_pending());
+
+ readd:
+  evtimer_add(maintenanceev, &maintenance_wait);
+}
+
+static void
+frontend_poll_cb(int fd, short what, void *arg)
+{
+  int64_t revision;
+
+  revision = db_library_revision_get();
+  if (revision != frontend_revision)
+    {
+      DPRINTF(E_DBG, L_LIB, "Library revision changed by scanning instance (%" PRIi64 " -> %" PRIi64 ")\n", frontend_revision, revision);
+
+      frontend_revision = revision;
+      listener_notify(LISTENER_UPDATE | LISTENER_DATABASE);
+    }
+
+  evtimer_add(frontendev, &frontend_wait);
+}
+
 static enum command_state
 update_trigger(void *arg, int *retval)
 {
@@ -684,6 +1162,12 @@ update_trigger(void *arg, int *retval)
 void
 library_rescan()
 {
+  if (frontend)
+    {
+      DPRINTF(E_INFO, L_LIB, "Library is scanned by another instance, ignoring request to trigger a new init scan\n");
+      return;
+    }
+
   if (scanning)
     {
       DPRINTF(E_INFO, L_LIB, "Scan already running, ignoring request to trigger a new init scan\n");
@@ -697,6 +1181,12 @@ library_rescan()
 void
 library_fullrescan()
 {
+  if (frontend)
+    {
+      DPRINTF(E_INFO, L_LIB, "Library is scanned by another instance, ignoring request to trigger a new full rescan\n");
+      return;
+    }
+
   if (scanning)
     {
       DPRINTF(E_INFO, L_LIB, "Scan already running, ignoring request to trigger a new full rescan\n");
@@ -711,13 +1201,17 @@ static void
 initscan()
 {
   time_t starttime;
+  time_t purgetime;
   time_t endtime;
   bool clear_queue_disabled;
+  bool completed;
   int i;
 
   scanning = true;
   starttime = time(NULL);
   listener_notify(LISTENER_UPDATE);
+  purgetime = scan_checkpoint_begin(starttime, true);
+  scan_stats_begin();
 
   // Only clear the queue if enabled (default) in config
   clear_queue_disabled = cfg_getbool(cfg_getsec(cfg, "mpd"), "clear_queue_on_stop_disable");
@@ -732,9 +1226,11 @@ initscan()
 	sources[i]->initscan();
     }
 
-  if (! (cfg_getbool(cfg_getsec(cfg, "library"), "filescan_disable")))
+  completed = scan_checkpoint_end();
+
+  if (completed && !(cfg_getbool(cfg_getsec(cfg, "library"), "filescan_disable")))
     {
-      purge_cruft(starttime);
+      purge_cruft(purgetime);
 
       DPRINTF(E_DBG, L_LIB, "Running post library scan jobs\n");
       db_hook_post_scan();
@@ -743,6 +1239,7 @@ initscan()
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library init scan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
 
+  scan_stats_end();
   scanning = false;
 
   if (handle_deferred_update_notifications())
@@ -967,6 +1464,8 @@ library(void *arg)
     }
 #endif
 
+  thread_sched_set(THREAD_CLASS_SCAN);
+
   ret = db_perthread_init();
   if (ret < 0)
     {
@@ -975,7 +1474,21 @@ library(void *arg)
       pthread_exit(NULL);
     }
 
-  initscan();
+  if (frontend)
+    {
+      frontend_revision = db_library_revision_get();
+
+      if (!cfg_getbool(cfg_getsec(cfg, "mpd"), "clear_queue_on_stop_disable"))
+	db_queue_clear(0);
+    }
+  else
+    {
+      // Scanning without the indices would be very slow, so after an upgrade
+      // they can't wait for an idle period
+      db_maintenance_run(DB_MAINTENANCE_INDICES);
+
+      initscan();
+    }
 
   event_base_dispatch(evbase_lib);
 
@@ -997,11 +1510,43 @@ library_init(void)
   scan_exit = false;
   scanning = false;
 
+  ret = cfg_getint(cfg_getsec(cfg, "library"), "scan_transaction_files");
+  scan_session_files = (ret > 0) ? ret : 1;
+  ret = cfg_getint(cfg_getsec(cfg, "library"), "scan_transaction_ms");
+  scan_session_ms = (ret > 0) ? ret : 0;
+
   CHECK_NULL(L_LIB, evbase_lib = event_base_new());
   CHECK_NULL(L_LIB, updateev = evtimer_new(evbase_lib, update_trigger_cb, NULL));
 
+  persist_wait.tv_sec = db_persist_interval();
+  if (persist_wait.tv_sec > 0)
+    {
+      CHECK_NULL(L_LIB, persistev = evtimer_new(evbase_lib, persist_cb, NULL));
+      evtimer_add(persistev, &persist_wait);
+    }
+
+  maintenance_idle = cfg_getint(cfg_getsec(cfg, "sqlite"), "maintenance_idle");
+  CHECK_NULL(L_LIB, maintenanceev = evtimer_new(evbase_lib, maintenance_cb, NULL));
+  evtimer_add(maintenanceev, &maintenance_wait);
+
+  frontend = cfg_getbool(cfg_getsec(cfg, "library"), "frontend");
+  if (frontend)
+    {
+      DPRINTF(E_LOG, L_LIB, "Running as library frontend, the library is scanned by another instance\n");
+
+      CHECK_NULL(L_LIB, frontendev = evtimer_new(evbase_lib, frontend_poll_cb, NULL));
+      evtimer_add(frontendev, &frontend_wait);
+    }
+
   for (i = 0; sources[i]; i++)
     {
+      // The sources would add to the library, which is up to the scanner
+      if (frontend)
+	{
+	  sources[i]->disabled = 1;
+	  continue;
+	}
+
       if (!sources[i]->init)
 	continue;
 
@@ -1011,6 +1556,8 @@ library_init(void)
     }
 
   CHECK_NULL(L_LIB, cmdbase = commands_base_new(evbase_lib, NULL));
+  commands_base_metrics(cmdbase, "library");
+  metrics_collector_add(scan_stats_metrics_cb);
 
   CHECK_ERR(L_LIB, pthread_create(&tid_library, NULL, library, NULL));
 
@@ -1047,5 +1594,11 @@ library_deinit()
       sources[i]->deinit();
     }
 
+  if (persistev)
+    event_free(persistev);
+  if (frontendev)
+    event_free(frontendev);
+  event_free(maintenanceev);
+
   event_base_free(evbase_lib);
 }
@@ -20,6 +20,7 @@
 #define SRC_LIBRARY_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
@@ -87,6 +88,35 @@ struct library_source
   int (*queue_save)(const char *virtual_path);
 };
 
+/*
+ * Progress of the running (or the last) library scan, see library_scan_stats_get()
+ */
+struct library_scan_stats
+{
+  bool running;
+  time_t start;
+  time_t end;
+
+  uint64_t dirs_visited;
+  uint64_t files_probed;
+  uint64_t files_skipped;   // Unchanged files that only got pinged
+  uint64_t files_saved;     // Files written to the library
+  uint64_t files_expected;  // Size of the library when the scan began
+
+  // Metadata probe times, percentiles are the upper bound of a power of two
+  // bucket, so they are approximate
+  uint64_t probe_usec_p50;
+  uint64_t probe_usec_p90;
+  uint64_t probe_usec_p99;
+  uint64_t probe_usec_max;
+  char *probe_slowest;      // Path of the slowest file, caller must free
+
+  uint64_t db_write_usec;
+
+  double files_per_sec;
+  int eta_sec;              // -1 if unknown
+};
+
 
 void
 library_add_media(struct media_file_info *mfi);
@@ -100,6 +130,30 @@ library_scan_media(const char *path, struct media_file_info *mfi);
 int
 library_add_queue_item(struct media_file_info *mfi);
 
+void
+library_scan_session_begin(void);
+
+bool
+library_scan_session_step(void);
+
+unsigned int
+library_scan_session_end(void);
+
+void
+library_scan_stats_dir(void);
+
+void
+library_scan_stats_skipped(unsigned int nfiles);
+
+void
+library_scan_stats_probe(const char *path, uint64_t usec);
+
+void
+library_scan_stats_get(struct library_scan_stats *stats);
+
+time_t
+library_scan_resuming(void);
+
 void
 library_rescan();
 
@@ -76,6 +76,8 @@
 #define F_SCAN_RESCAN  (1 << 1)
 #define F_SCAN_FAST    (1 << 2)
 #define F_SCAN_MOVED   (1 << 3)
+#define F_SCAN_RESUME  (1 << 4)
+#define F_SCAN_POLL    (1 << 5)
 
 #define F_SCAN_TYPE_FILE         (1 << 0)
 #define F_SCAN_TYPE_PODCAST      (1 << 1)
@@ -135,9 +137,88 @@ static struct deferred_file *filestack;
 static struct event *deferred_inoev;
 #endif
 
+/* Events read from inotify are queued and processed together after
+ * INOTIFY_BATCH_WAIT (or when INOTIFY_BATCH_MAX are queued), in one
+ * transaction. Repeated events for a file that is being written, like
+ * IN_CREATE -> n x IN_ATTRIB -> IN_CLOSE_WRITE, are merged into one.
+ */
+#define INOTIFY_BATCH_MAX 1000
+#define INOTIFY_MERGE_MASK (IN_CREATE | IN_ATTRIB | IN_CLOSE_WRITE)
+
+struct queued_event
+{
+  struct queued_event *next;
+  /* variable sized, must be at the end */
+  struct inotify_event ie;
+};
+
+static struct timeval inotify_batch_wait = { 1, 0 };
+static struct event *batch_inoev;
+static struct queued_event *inoqueue;
+static struct queued_event *inoqueue_tail;
+static int inoqueue_len;
+
 /* Count of files scanned during a bulk scan */
 static int counter;
 
+/* Library timestamps of the files in the directory that is being bulk scanned.
+ * Unchanged files are collected and pinged in one go when the directory is
+ * done, instead of a db_file_ping_bypath() per file.
+ */
+struct dir_stamps {
+  struct db_file_stamp *stamps;
+  int nstamps;
+  int *ping_ids;
+  int nping_ids;
+};
+
+static struct dir_stamps dirstamps;
+
+/* Checkpoint of a bulk scan, so that a scan interrupted by a restart can be
+ * resumed. The library root being scanned and the number of directories
+ * completed in it (with the path of the last one) are saved in the admin
+ * table every SCAN_CHECKPOINT_SECS. When resuming, the completed roots and
+ * directories are walked again in the same order for the inotify watches and
+ * the playlists, but their media files are not looked at (F_SCAN_RESUME).
+ */
+#define SCAN_CHECKPOINT_SECS 30
+
+struct scan_checkpoint {
+  char *dir;     // Last completed directory of the root we are resuming
+  int nreplay;   // Number of directories left to walk without media files
+  int ndirs;     // Completed directories in the root being scanned
+  time_t saved;
+};
+
+static struct scan_checkpoint checkpoint;
+
+/* During a bulk scan the ffmpeg probing of media files can be done by a pool
+ * of worker threads (library:scan_threads). The library thread stays the only
+ * one writing to the database, it hands out the jobs and saves the results.
+ * The number of jobs in flight is limited to SCAN_JOBS_PER_WORKER per worker.
+ */
+#define SCAN_JOBS_PER_WORKER 4
+
+struct scan_job {
+  struct media_file_info mfi;
+  time_t mtime;
+  int ret;
+
+  struct scan_job *next;
+};
+
+static bool scan_native;
+static pthread_t *scan_workers;
+static int scan_nworkers;
+static bool scan_workers_exit;
+static struct scan_job *scan_jobs_todo;
+static struct scan_job *scan_jobs_todo_tail;
+static struct scan_job *scan_jobs_done;
+static int scan_jobs_pending;
+static pthread_mutex_t scan_jobs_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_jobs_todo_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_jobs_done_cond = PTHREAD_COND_INITIALIZER;
+
 /* When copying into the lib (eg. if a file is moved to the lib by copying into
  * a Samba network share) inotify might give us IN_CREATE -> n x IN_ATTRIB ->
  * IN_CLOSE_WRITE, but we don't want to do any scanning before the
@@ -453,6 +534,8 @@ process_deferred_playlists(void)
 {
   struct deferred_pl *pl;
 
+  file_index_build();
+
   while ((pl = playlists))
     {
       playlists = pl->next;
@@ -463,8 +546,276 @@ process_deferred_playlists(void)
       free(pl);
 
       if (library_is_exiting())
-	return;
+	break;
+    }
+
+  file_index_free();
+}
+
+/* Thread: scan and scan workers */
+static int
+scan_metadata_timed(const char *file, struct media_file_info *mfi)
+{
+  struct timespec start;
+  struct timespec end;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  ret = -1;
+  if (scan_native)
+    ret = scan_metadata_native(file, mfi);
+  if (ret < 0)
+    ret = scan_metadata_ffmpeg(file, mfi);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  library_scan_stats_probe(file, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+
+  return ret;
+}
+
+/* Thread: scan worker */
+static void *
+scan_worker(void *arg)
+{
+  struct scan_job *job;
+
+  thread_sched_set(THREAD_CLASS_SCAN);
+
+  for (;;)
+    {
+      CHECK_ERR(L_SCAN, pthread_mutex_lock(&scan_jobs_lck));
+
+      while (!scan_jobs_todo && !scan_workers_exit)
+	CHECK_ERR(L_SCAN, pthread_cond_wait(&scan_jobs_todo_cond, &scan_jobs_lck));
+
+      job = scan_jobs_todo;
+      if (job)
+	{
+	  scan_jobs_todo = job->next;
+	  if (!scan_jobs_todo)
+	    scan_jobs_todo_tail = NULL;
+	}
+
+      CHECK_ERR(L_SCAN, pthread_mutex_unlock(&scan_jobs_lck));
+
+      if (!job)
+	break;
+
+      job->ret = scan_metadata_timed(job->mfi.path, &job->mfi);
+
+      CHECK_ERR(L_SCAN, pthread_mutex_lock(&scan_jobs_lck));
+
+      job->next = scan_jobs_done;
+      scan_jobs_done = job;
+
+      CHECK_ERR(L_SCAN, pthread_cond_signal(&scan_jobs_done_cond));
+      CHECK_ERR(L_SCAN, pthread_mutex_unlock(&scan_jobs_lck));
+    }
+
+  pthread_exit(NULL);
+}
+
+/* Thread: scan */
+static void
+scan_workers_start(void)
+{
+  int nworkers;
+  int ret;
+
+  nworkers = cfg_getint(cfg_getsec(cfg, "library"), "scan_threads");
+  if (nworkers == 0)
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers <= 1)
+    return;
+
+  CHECK_NULL(L_SCAN, scan_workers = calloc(nworkers, sizeof(pthread_t)));
+
+  scan_workers_exit = false;
+  scan_jobs_pending = 0;
+
+  for (scan_nworkers = 0; scan_nworkers < nworkers; scan_nworkers++)
+    {
+      ret = pthread_create(&scan_workers[scan_nworkers], NULL, scan_worker, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Could not start scan worker thread: %s\n", strerror(ret));
+	  break;
+	}
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(scan_workers[scan_nworkers], "scan");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(scan_workers[scan_nworkers], "scan");
+#endif
+    }
+
+  DPRINTF(E_INFO, L_SCAN, "Probing media files with %d threads\n", scan_nworkers);
+
+  if (scan_nworkers == 0)
+    {
+      free(scan_workers);
+      scan_workers = NULL;
+    }
+}
+
+/* Thread: scan */
+static void
+scan_job_save(struct scan_job *job)
+{
+  if (job->ret == 0)
+    {
+      library_add_media(&job->mfi);
+
+      cache_artwork_ping(job->mfi.path, job->mtime, 0);
     }
+
+  free_mfi(&job->mfi, 1);
+  free(job);
+}
+
+/* Thread: scan
+ * Saves the probed files, if wait is set waits until there is at least one
+ */
+static void
+scan_jobs_collect(bool wait)
+{
+  struct scan_job *done;
+  struct scan_job *job;
+  struct scan_job *prev;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&scan_jobs_lck));
+
+  while (wait && !scan_jobs_done && scan_jobs_pending > 0)
+    CHECK_ERR(L_SCAN, pthread_cond_wait(&scan_jobs_done_cond, &scan_jobs_lck));
+
+  done = scan_jobs_done;
+  scan_jobs_done = NULL;
+
+  for (job = done; job; job = job->next)
+    scan_jobs_pending--;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&scan_jobs_lck));
+
+  // The list is newest first, save in scan order
+  for (prev = NULL; done; done = job)
+    {
+      job = done->next;
+      done->next = prev;
+      prev = done;
+    }
+
+  for (; prev; prev = job)
+    {
+      job = prev->next;
+      scan_job_save(prev);
+    }
+}
+
+/* Thread: scan
+ * Takes over the content of mfi
+ */
+static void
+scan_job_add(struct media_file_info *mfi, time_t mtime)
+{
+  struct scan_job *job;
+
+  CHECK_NULL(L_SCAN, job = calloc(1, sizeof(struct scan_job)));
+
+  job->mfi = *mfi;
+  job->mtime = mtime;
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&scan_jobs_lck));
+
+  if (scan_jobs_todo_tail)
+    scan_jobs_todo_tail->next = job;
+  else
+    scan_jobs_todo = job;
+  scan_jobs_todo_tail = job;
+  scan_jobs_pending++;
+
+  CHECK_ERR(L_SCAN, pthread_cond_signal(&scan_jobs_todo_cond));
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&scan_jobs_lck));
+
+  scan_jobs_collect(scan_jobs_pending >= SCAN_JOBS_PER_WORKER * scan_nworkers);
+}
+
+/* Thread: scan */
+static void
+scan_jobs_flush(void)
+{
+  while (scan_jobs_pending > 0)
+    scan_jobs_collect(true);
+}
+
+/* Thread: scan */
+static void
+scan_workers_stop(void)
+{
+  int i;
+
+  if (scan_nworkers == 0)
+    return;
+
+  scan_jobs_flush();
+
+  CHECK_ERR(L_SCAN, pthread_mutex_lock(&scan_jobs_lck));
+  scan_workers_exit = true;
+  CHECK_ERR(L_SCAN, pthread_cond_broadcast(&scan_jobs_todo_cond));
+  CHECK_ERR(L_SCAN, pthread_mutex_unlock(&scan_jobs_lck));
+
+  for (i = 0; i < scan_nworkers; i++)
+    pthread_join(scan_workers[i], NULL);
+
+  free(scan_workers);
+  scan_workers = NULL;
+  scan_nworkers = 0;
+}
+
+/* Thread: scan */
+static void
+dir_stamps_load(int dir_id)
+{
+  int ret;
+
+  memset(&dirstamps, 0, sizeof(struct dir_stamps));
+
+  ret = db_file_stamps_bydir(dir_id, &dirstamps.stamps);
+  if (ret <= 0)
+    return;
+
+  dirstamps.nstamps = ret;
+  CHECK_NULL(L_SCAN, dirstamps.ping_ids = calloc(dirstamps.nstamps, sizeof(int)));
+}
+
+static int
+dir_stamp_cmp(const void *key, const void *member)
+{
+  return strcmp(key, ((const struct db_file_stamp *)member)->path);
+}
+
+/* Thread: scan */
+static struct db_file_stamp *
+dir_stamp_get(const char *path)
+{
+  if (dirstamps.nstamps == 0)
+    return NULL;
+
+  return bsearch(path, dirstamps.stamps, dirstamps.nstamps, sizeof(struct db_file_stamp), dir_stamp_cmp);
+}
+
+/* Thread: scan */
+static void
+dir_stamps_ping(void)
+{
+  if (dirstamps.nping_ids > 0)
+    db_file_ping_byids(dirstamps.ping_ids, dirstamps.nping_ids);
+
+  db_file_stamps_free(dirstamps.stamps, dirstamps.nstamps);
+  free(dirstamps.ping_ids);
+
+  memset(&dirstamps, 0, sizeof(struct dir_stamps));
 }
 
 static void
@@ -472,20 +823,40 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 {
   bool is_bulkscan = (flags & F_SCAN_BULK);
   struct media_file_info mfi;
+  struct db_file_stamp *stamp;
   char virtual_path[PATH_MAX];
   int ret;
 
-  // Will return 0 if file is not in library or if file mtime is newer than library timestamp
-  // - note if mtime is 0 then we always scan the file
-  ret = db_file_ping_bypath(file, sb->st_mtime);
-  if ((sb->st_mtime != 0) && (ret != 0))
-    return;
+  stamp = is_bulkscan ? dir_stamp_get(file) : NULL;
+  if (stamp)
+    {
+      // Unchanged since the last scan, pinged with the rest of the directory
+      if ((sb->st_mtime != 0) && (stamp->db_timestamp >= sb->st_mtime))
+	{
+	  if (dirstamps.nping_ids < dirstamps.nstamps)
+	    dirstamps.ping_ids[dirstamps.nping_ids++] = stamp->id;
+
+	  library_scan_stats_skipped(1);
+	  return;
+	}
+    }
+  else
+    {
+      // Will return 0 if file is not in library or if file mtime is newer than library timestamp
+      // - note if mtime is 0 then we always scan the file
+      ret = db_file_ping_bypath(file, sb->st_mtime);
+      if ((sb->st_mtime != 0) && (ret != 0))
+	{
+	  library_scan_stats_skipped(1);
+	  return;
+	}
+    }
 
   // File is new or modified - (re)scan metadata and update file in library
   memset(&mfi, 0, sizeof(struct media_file_info));
 
   // Sets id=0 if file is not in the library already
-  mfi.id = db_file_id_bypath(file);
+  mfi.id = stamp ? stamp->id : db_file_id_bypath(file);
 
   mfi.fname = strdup(filename_from_path(file));
   mfi.path = strdup(file);
@@ -518,7 +889,13 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
       mfi.compilation = (type & F_SCAN_TYPE_COMPILATION);
       mfi.file_size = sb->st_size;
 
-      ret = scan_metadata_ffmpeg(file, &mfi);
+      if (is_bulkscan && scan_nworkers > 0)
+	{
+	  scan_job_add(&mfi, sb->st_mtime);
+	  return;
+	}
+
+      ret = scan_metadata_timed(file, &mfi);
       if (ret < 0)
 	{
 	  free_mfi(&mfi, 1);
@@ -541,17 +918,17 @@ process_file(char *file, struct stat *sb, int type, int flags, int dir_id)
   switch (file_type_get(file))
     {
       case FILE_REGULAR:
+	// Already saved by the scan that was interrupted
+	if (flags & F_SCAN_RESUME)
+	  break;
+
 	process_regular_file(file, sb, type, flags, dir_id);
 
 	counter++;
 
-	/* When in bulk mode, split transaction in pieces of 200 */
-	if ((flags & F_SCAN_BULK) && (counter % 200 == 0))
-	  {
-	    DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
-	    db_transaction_end();
-	    db_transaction_begin();
-	  }
+	/* When in bulk mode, the scan session splits the transaction in pieces */
+	if ((flags & F_SCAN_BULK) && library_scan_session_step())
+	  DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
 	break;
 
       case FILE_PLAYLIST:
@@ -728,13 +1105,19 @@ process_directory(char *path, int parent_id, int flags)
   int is_link;
   int follow_symlinks;
   struct watch_info wi;
+  enum file_type ft;
   int type;
   char virtual_path[PATH_MAX];
+  struct stat dir_sb;
+  uint32_t nentries;
   int dir_id;
+  int dfd;
   int ret;
 
   DPRINTF(E_DBG, L_SCAN, "Processing directory %s (flags = 0x%x)\n", path, flags);
 
+  library_scan_stats_dir();
+
   dirp = opendir(path);
   if (!dirp)
     {
@@ -766,6 +1149,18 @@ process_directory(char *path, int parent_id, int flags)
 
   follow_symlinks = cfg_getbool(cfg_getsec(cfg, "library"), "follow_symlinks");
 
+  if ((flags & F_SCAN_BULK) && !(flags & (F_SCAN_FAST | F_SCAN_RESUME)) && (dir_id > 0))
+    dir_stamps_load(dir_id);
+
+  dfd = dirfd(dirp);
+
+  // For the polling of directories, see poll_dir_changed()
+  ret = fstat(dfd, &dir_sb);
+  if (ret < 0)
+    dir_sb.st_mtime = 0;
+
+  nentries = 0;
+
   for (;;)
     {
       if (library_is_exiting())
@@ -786,6 +1181,8 @@ process_directory(char *path, int parent_id, int flags)
       if (de->d_name[0] == '.')
 	continue;
 
+      nentries++;
+
       ret = snprintf(entry, sizeof(entry), "%s/%s", path, de->d_name);
       if ((ret < 0) || (ret >= sizeof(entry)))
 	{
@@ -794,13 +1191,53 @@ process_directory(char *path, int parent_id, int flags)
 	  continue;
 	}
 
-      ret = read_attributes(resolved_path, entry, &sb, &is_link);
-      if (ret < 0)
+      // If readdir tells the type we can skip lstat, and for subdirectories
+      // and ignored files any stat at all. Regular files are stat'ed relative
+      // to the directory, which saves the path lookup.
+      if (de->d_type == DT_DIR)
 	{
-	  DPRINTF(E_LOG, L_SCAN, "Skipping %s, read_attributes() failed\n", entry);
-
+	  push_dir(&dirstack, entry, dir_id);
+	  continue;
+	}
+      else if (de->d_type == DT_LNK && !follow_symlinks)
+	{
+	  DPRINTF(E_DBG, L_SCAN, "Ignore symlink %s\n", entry);
 	  continue;
 	}
+      else if (de->d_type == DT_REG)
+	{
+	  if (flags & F_SCAN_FAST)
+	    continue;
+
+	  ft = file_type_get(entry);
+	  if (ft == FILE_IGNORE)
+	    {
+	      DPRINTF(E_DBG, L_SCAN, "Ignoring file: %s\n", entry);
+	      continue;
+	    }
+	  else if ((ft == FILE_REGULAR) && (flags & F_SCAN_RESUME))
+	    continue;
+
+	  ret = fstatat(dfd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Skipping %s, fstatat() failed: %s\n", entry, strerror(errno));
+	      continue;
+	    }
+
+	  strcpy(resolved_path, entry);
+	  is_link = 0;
+	}
+      else
+	{
+	  ret = read_attributes(resolved_path, entry, &sb, &is_link);
+	  if (ret < 0)
+	    {
+	      DPRINTF(E_LOG, L_SCAN, "Skipping %s, read_attributes() failed\n", entry);
+
+	      continue;
+	    }
+	}
 
       if (is_link && !follow_symlinks)
         {
@@ -821,8 +1258,17 @@ process_directory(char *path, int parent_id, int flags)
 	}
     }
 
+  dir_stamps_ping();
+
   closedir(dirp);
 
+  if ((dir_id > 0) && !library_is_exiting())
+    db_directory_stamp(dir_id, (int64_t)dir_sb.st_mtime, nentries);
+
+  // Polled directories already have their watch, if inotify works at all
+  if (flags & F_SCAN_POLL)
+    return;
+
   memset(&wi, 0, sizeof(struct watch_info));
 
   // Add inotify watch (for FreeBSD we limit the flags so only dirs will be
@@ -858,144 +1304,593 @@ process_parent_directories(char *path)
   char virtual_path[PATH_MAX];
   int ret;
 
-  dir_id = DIR_FILE;
+  dir_id = DIR_FILE;
+
+  ptr = path + 1;
+  while (ptr && (ptr = strchr(ptr, '/')))
+    {
+      if (strlen(ptr) <= 1)
+	{
+	  // Do not process trailing '/'
+	  break;
+	}
+
+      strncpy(buf, path, (ptr - path));
+      buf[(ptr - path)] = '\0';
+
+      ret = create_virtual_path(buf, virtual_path, sizeof(virtual_path));
+      if (ret < 0)
+	return 0;
+
+      dir_id = db_directory_addorupdate(virtual_path, 0, dir_id);
+      if (dir_id <= 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Insert or update of directory failed '%s'\n", virtual_path);
+
+	  return 0;
+	}
+
+      ptr++;
+    }
+
+  return dir_id;
+}
+
+/* Thread: scan */
+static int
+checkpoint_dir_flags(const char *root, const char *path, int flags)
+{
+  char virtual_path[PATH_MAX];
+  int ret;
+
+  if (checkpoint.nreplay == 0)
+    return flags;
+
+  checkpoint.nreplay--;
+  if ((checkpoint.nreplay > 0) || (strcmp(path, checkpoint.dir) == 0))
+    return flags | F_SCAN_RESUME;
+
+  // The walk order changed, so we may have skipped directories that weren't
+  // done. Ping the root so the purge at the end doesn't remove their files.
+  DPRINTF(E_LOG, L_SCAN, "Directories in %s changed since the interrupted scan, keeping its content until next scan\n", root);
+
+  db_file_ping_bymatch(root, 1);
+  db_pl_ping_bymatch(root, 1);
+  ret = create_virtual_path((char *)root, virtual_path, sizeof(virtual_path));
+  if (ret == 0)
+    db_directory_ping_bymatch(virtual_path);
+
+  return flags;
+}
+
+/* Thread: scan */
+static void
+checkpoint_dir_done(const char *path, int flags)
+{
+  time_t now;
+
+  checkpoint.ndirs++;
+
+  if (flags & (F_SCAN_FAST | F_SCAN_RESUME))
+    return;
+
+  now = time(NULL);
+  if (difftime(now, checkpoint.saved) < SCAN_CHECKPOINT_SECS)
+    return;
+
+  // The checkpoint must not get ahead of what is saved. It is written in the
+  // same transaction as the files, so they are committed together.
+  scan_jobs_flush();
+
+  db_admin_set(DB_ADMIN_SCAN_DIR, path);
+  db_admin_setint(DB_ADMIN_SCAN_DIRS, checkpoint.ndirs);
+
+  checkpoint.saved = now;
+}
+
+/* Thread: scan */
+static void
+process_directories(char *root, int parent_id, int flags)
+{
+  struct stacked_dir *dir;
+
+  checkpoint.ndirs = 0;
+  checkpoint.saved = time(NULL);
+
+  process_directory(root, parent_id, checkpoint_dir_flags(root, root, flags));
+  checkpoint_dir_done(root, flags);
+
+  if (library_is_exiting())
+    return;
+
+  while ((dir = pop_dir(&dirstack)))
+    {
+      process_directory(dir->path, dir->parent_id, checkpoint_dir_flags(root, dir->path, flags));
+      checkpoint_dir_done(dir->path, flags);
+
+      free(dir->path);
+      free(dir);
+
+      if (library_is_exiting())
+	return;
+    }
+}
+
+
+/* Thread: scan */
+static void
+bulk_scan(int flags)
+{
+  cfg_t *lib;
+  int ndirs;
+  char *path;
+  char *deref;
+  char *resume_root;
+  int resume_idx;
+  time_t start;
+  time_t end;
+  int parent_id;
+  int root_flags;
+  int i;
+  char virtual_path[PATH_MAX];
+  int ret;
+
+  start = time(NULL);
+
+  playlists = NULL;
+  dirstack = NULL;
+
+  if (!(flags & F_SCAN_FAST))
+    scan_workers_start();
+
+  lib = cfg_getsec(cfg, "library");
+
+  ndirs = cfg_size(lib, "directories");
+
+  // If we are resuming an interrupted scan, the roots before the one it was
+  // in are complete, and so are the first checkpoint.nreplay dirs of it
+  memset(&checkpoint, 0, sizeof(struct scan_checkpoint));
+  resume_idx = -1;
+  resume_root = NULL;
+  if (!(flags & F_SCAN_FAST) && library_scan_resuming())
+    resume_root = db_admin_get(DB_ADMIN_SCAN_ROOT);
+
+  for (i = 0; resume_root && (i < ndirs); i++)
+    {
+      if (strcmp(resume_root, cfg_getnstr(lib, "directories", i)) != 0)
+	continue;
+
+      resume_idx = i;
+      checkpoint.dir = db_admin_get(DB_ADMIN_SCAN_DIR);
+      checkpoint.nreplay = checkpoint.dir ? db_admin_getint(DB_ADMIN_SCAN_DIRS) : 0;
+
+      DPRINTF(E_LOG, L_SCAN, "Resuming bulk scan in %s after %d directories\n", resume_root, checkpoint.nreplay);
+      break;
+    }
+
+  free(resume_root);
+
+  for (i = 0; i < ndirs; i++)
+    {
+      path = cfg_getnstr(lib, "directories", i);
+
+      root_flags = flags;
+      if (i < resume_idx)
+	root_flags |= F_SCAN_RESUME;
+      else if (!(flags & F_SCAN_FAST))
+	{
+	  db_admin_set(DB_ADMIN_SCAN_ROOT, path);
+	  db_admin_set(DB_ADMIN_SCAN_DIR, "");
+	  db_admin_setint(DB_ADMIN_SCAN_DIRS, 0);
+	}
+
+      parent_id = process_parent_directories(path);
+
+      deref = realpath(path, NULL);
+      if (!deref)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Skipping library directory %s, could not dereference: %s\n", path, strerror(errno));
+
+	  /* Assume dir is mistakenly not mounted, so just disable everything and update timestamps */
+	  db_file_disable_bymatch(path, STRIP_NONE, 0);
+	  db_pl_disable_bymatch(path, STRIP_NONE, 0);
+	  db_directory_disable_bymatch(path, STRIP_NONE, 0);
+
+	  db_file_ping_bymatch(path, 1);
+	  db_pl_ping_bymatch(path, 1);
+	  ret = snprintf(virtual_path, sizeof(virtual_path), "/file:%s", path);
+	  if ((ret < 0) || (ret >= sizeof(virtual_path)))
+	    DPRINTF(E_LOG, L_SCAN, "Virtual path exceeds PATH_MAX (/file:%s)\n", path);
+	  else
+	    db_directory_ping_bymatch(virtual_path);
+
+	  continue;
+	}
+
+      counter = 0;
+      library_scan_session_begin();
+
+      process_directories(deref, parent_id, root_flags);
+
+      // Only used for the root we were resuming in
+      checkpoint.nreplay = 0;
+
+      // Save what the workers are still probing while in the scan session
+      scan_jobs_flush();
+      library_scan_session_end();
+
+      free(deref);
+
+      if (library_is_exiting())
+	break;
+    }
+
+  scan_workers_stop();
+
+  free(checkpoint.dir);
+  memset(&checkpoint, 0, sizeof(struct scan_checkpoint));
+
+  if (library_is_exiting())
+    return;
+
+  if (!(flags & F_SCAN_FAST) && playlists)
+    process_deferred_playlists();
+
+  if (library_is_exiting())
+    return;
+
+  if (dirstack)
+    DPRINTF(E_LOG, L_SCAN, "WARNING: unhandled leftover directories\n");
+
+  end = time(NULL);
+
+  if (flags & F_SCAN_FAST)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Bulk library scan completed in %.f sec (with file scan disabled)\n", difftime(end, start));
+    }
+  else
+    {
+      DPRINTF(E_LOG, L_SCAN, "Bulk library scan completed in %.f sec\n", difftime(end, start));
+    }
+}
+
+
+/* --------------------------- Directory polling -------------------------- */
+
+/* Library directories on network filesystems don't get inotify events, so
+ * they can be polled instead (library:poll sections). A poll stats the
+ * directories of the subtree that are in the database, and only reads a
+ * directory again if its mtime changed since it was scanned. If the mtime
+ * might not have caught a change, because it was within POLL_RACY_SECS of the
+ * scan, the entries are counted and compared.
+ */
+#define POLL_RACY_SECS 2
+
+struct poll_root {
+  char *path;
+  struct timeval interval;
+  struct event *ev;
+};
+
+struct poll_dir {
+  int id;
+  int parent_id;
+  char *path;
+  int64_t mtime;
+  uint32_t entries;
+  uint32_t scanned;
+  struct poll_dir *next;
+};
+
+static struct poll_root *poll_roots;
+static int poll_nroots;
+
+static int
+poll_dir_push(struct poll_dir **s, struct directory_info *di)
+{
+  struct poll_dir *pd;
+
+  if (strncmp(di->virtual_path, "/file:", strlen("/file:")) != 0)
+    return -1;
+
+  CHECK_NULL(L_SCAN, pd = calloc(1, sizeof(struct poll_dir)));
+  CHECK_NULL(L_SCAN, pd->path = strdup(di->virtual_path + strlen("/file:")));
+
+  pd->id = di->id;
+  pd->parent_id = di->parent_id;
+  pd->mtime = di->mtime;
+  pd->entries = di->entries;
+  pd->scanned = di->db_timestamp;
+
+  pd->next = *s;
+  *s = pd;
+
+  return 0;
+}
+
+static void
+poll_dir_free(struct poll_dir *pd)
+{
+  free(pd->path);
+  free(pd);
+}
+
+/* Collects the subdirectories first, since the walk writes to the table */
+static void
+poll_children_push(struct poll_dir **s, int parent_id)
+{
+  struct directory_enum de;
+  struct directory_info di;
+  struct poll_dir *children;
+  struct poll_dir *pd;
+  int ret;
+
+  memset(&de, 0, sizeof(struct directory_enum));
+  de.parent_id = parent_id;
+
+  ret = db_directory_enum_start(&de);
+  if (ret < 0)
+    return;
+
+  children = NULL;
+  while ((db_directory_enum_fetch(&de, &di) == 0) && di.virtual_path)
+    poll_dir_push(&children, &di);
+
+  db_directory_enum_end(&de);
+
+  while ((pd = children))
+    {
+      children = pd->next;
+      pd->next = *s;
+      *s = pd;
+    }
+}
+
+static int
+poll_count_entries(const char *path)
+{
+  DIR *dirp;
+  struct dirent *de;
+  int n;
+
+  dirp = opendir(path);
+  if (!dirp)
+    return -1;
+
+  n = 0;
+  while ((de = readdir(dirp)))
+    {
+      if (de->d_name[0] != '.')
+	n++;
+    }
+
+  closedir(dirp);
+
+  return n;
+}
 
-  ptr = path + 1;
-  while (ptr && (ptr = strchr(ptr, '/')))
-    {
-      if (strlen(ptr) <= 1)
-	{
-	  // Do not process trailing '/'
-	  break;
-	}
+static bool
+poll_dir_changed(struct poll_dir *pd, struct stat *sb)
+{
+  int n;
 
-      strncpy(buf, path, (ptr - path));
-      buf[(ptr - path)] = '\0';
+  if ((int64_t)sb->st_mtime != pd->mtime)
+    return true;
 
-      ret = create_virtual_path(buf, virtual_path, sizeof(virtual_path));
-      if (ret < 0)
-	return 0;
+  if (pd->mtime + POLL_RACY_SECS < (int64_t)pd->scanned)
+    return false;
 
-      dir_id = db_directory_addorupdate(virtual_path, 0, dir_id);
-      if (dir_id <= 0)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Insert or update of directory failed '%s'\n", virtual_path);
+  n = poll_count_entries(pd->path);
 
-	  return 0;
-	}
+  return (n >= 0) && (n != pd->entries);
+}
 
-      ptr++;
-    }
+/* Same as when inotify tells us a directory was deleted */
+static void
+poll_dir_removed(struct poll_dir *pd)
+{
+  DPRINTF(E_DBG, L_SCAN, "Directory removed: %s\n", pd->path);
 
-  return dir_id;
+  db_file_disable_bymatch(pd->path, STRIP_NONE, 0);
+  db_pl_disable_bymatch(pd->path, STRIP_NONE, 0);
+  db_directory_disable_bymatch(pd->path, STRIP_NONE, 0);
 }
 
 static void
-process_directories(char *root, int parent_id, int flags)
+poll_dir_rescan(struct poll_dir *pd, time_t start)
 {
   struct stacked_dir *dir;
+  struct db_file_stamp *stamps;
+  char virtual_path[PATH_MAX];
+  int nstamps;
+  int i;
+  int ret;
 
-  process_directory(root, parent_id, flags);
+  DPRINTF(E_DBG, L_SCAN, "Directory changed, rescanning: %s\n", pd->path);
 
-  if (library_is_exiting())
-    return;
+  process_directory(pd->path, pd->parent_id, F_SCAN_BULK | F_SCAN_POLL);
 
+  // New subdirectories are scanned here, the known ones are visited by the poll
   while ((dir = pop_dir(&dirstack)))
     {
-      process_directory(dir->path, dir->parent_id, flags);
+      ret = create_virtual_path(dir->path, virtual_path, sizeof(virtual_path));
+      if ((ret == 0) && (db_directory_id_byvirtualpath(virtual_path) <= 0))
+	process_directory(dir->path, dir->parent_id, F_SCAN_BULK);
 
       free(dir->path);
       free(dir);
+    }
 
-      if (library_is_exiting())
-	return;
+  // Files that weren't seen in the directory are gone
+  nstamps = db_file_stamps_bydir(pd->id, &stamps);
+  for (i = 0; i < nstamps; i++)
+    {
+      if (stamps[i].db_timestamp >= start)
+	continue;
+
+      DPRINTF(E_DBG, L_SCAN, "File deleted: %s\n", stamps[i].path);
+
+      db_file_delete_bypath(stamps[i].path);
+      cache_artwork_delete_by_path(stamps[i].path);
     }
-}
 
+  if (nstamps > 0)
+    db_file_stamps_free(stamps, nstamps);
+}
 
 /* Thread: scan */
 static void
-bulk_scan(int flags)
+poll_cb(int fd, short what, void *arg)
 {
-  cfg_t *lib;
-  int ndirs;
-  char *path;
+  struct poll_root *pr = arg;
+  struct directory_info *di;
+  struct poll_dir *pollstack;
+  struct poll_dir *pd;
+  struct stat sb;
+  char virtual_path[PATH_MAX];
   char *deref;
   time_t start;
-  time_t end;
-  int parent_id;
-  int i;
-  char virtual_path[PATH_MAX];
+  int nvisited;
+  int nchanged;
   int ret;
 
-  start = time(NULL);
+  deref = realpath(pr->path, NULL);
+  if (!deref)
+    {
+      DPRINTF(E_WARN, L_SCAN, "Skipping poll of %s, could not dereference: %s\n", pr->path, strerror(errno));
+      return;
+    }
+
+  ret = create_virtual_path(deref, virtual_path, sizeof(virtual_path));
+  free(deref);
+  if (ret < 0)
+    return;
+
+  di = db_directory_fetch_byid(db_directory_id_byvirtualpath(virtual_path));
+  if (!di)
+    {
+      DPRINTF(E_DBG, L_SCAN, "Skipping poll of %s, not scanned yet\n", pr->path);
+      return;
+    }
 
+  pollstack = NULL;
+  poll_dir_push(&pollstack, di);
+  free_di(di, 0);
+
+  start = time(NULL);
+  nvisited = 0;
+  nchanged = 0;
   playlists = NULL;
-  dirstack = NULL;
 
-  lib = cfg_getsec(cfg, "library");
+  db_transaction_begin();
 
-  ndirs = cfg_size(lib, "directories");
-  for (i = 0; i < ndirs; i++)
+  while ((pd = pollstack))
     {
-      path = cfg_getnstr(lib, "directories", i);
-
-      parent_id = process_parent_directories(path);
+      pollstack = pd->next;
 
-      deref = realpath(path, NULL);
-      if (!deref)
+      if (library_is_exiting())
 	{
-	  DPRINTF(E_LOG, L_SCAN, "Skipping library directory %s, could not dereference: %s\n", path, strerror(errno));
-
-	  /* Assume dir is mistakenly not mounted, so just disable everything and update timestamps */
-	  db_file_disable_bymatch(path, STRIP_NONE, 0);
-	  db_pl_disable_bymatch(path, STRIP_NONE, 0);
-	  db_directory_disable_bymatch(path, STRIP_NONE, 0);
+	  poll_dir_free(pd);
+	  continue;
+	}
 
-	  db_file_ping_bymatch(path, 1);
-	  db_pl_ping_bymatch(path, 1);
-	  ret = snprintf(virtual_path, sizeof(virtual_path), "/file:%s", path);
-	  if ((ret < 0) || (ret >= sizeof(virtual_path)))
-	    DPRINTF(E_LOG, L_SCAN, "Virtual path exceeds PATH_MAX (/file:%s)\n", path);
+      ret = stat(pd->path, &sb);
+      if ((ret < 0) || !S_ISDIR(sb.st_mode))
+	{
+	  // If the root is gone it is probably not mounted
+	  if ((ret < 0) && (errno != ENOENT || nvisited == 0))
+	    DPRINTF(E_LOG, L_SCAN, "Could not poll %s: %s\n", pd->path, strerror(errno));
 	  else
-	    db_directory_ping_bymatch(virtual_path);
+	    poll_dir_removed(pd);
 
+	  poll_dir_free(pd);
 	  continue;
 	}
 
-      counter = 0;
-      db_transaction_begin();
-
-      process_directories(deref, parent_id, flags);
-      db_transaction_end();
+      nvisited++;
 
-      free(deref);
+      if (poll_dir_changed(pd, &sb))
+	{
+	  poll_dir_rescan(pd, start);
+	  nchanged++;
+	}
 
-      if (library_is_exiting())
-	return;
+      poll_children_push(&pollstack, pd->id);
+      poll_dir_free(pd);
     }
 
-  if (!(flags & F_SCAN_FAST) && playlists)
+  if (playlists && !library_is_exiting())
     process_deferred_playlists();
 
-  if (library_is_exiting())
+  db_transaction_end();
+
+  DPRINTF((nchanged > 0) ? E_INFO : E_DBG, L_SCAN, "Polled %d directories in %s, %d changed\n", nvisited, pr->path, nchanged);
+}
+
+/* Thread: main */
+static void
+poll_init(void)
+{
+  cfg_t *lib;
+  cfg_t *sec;
+  int interval;
+  int n;
+  int i;
+
+  lib = cfg_getsec(cfg, "library");
+
+  n = cfg_size(lib, "poll");
+  if (n == 0)
     return;
 
-  if (dirstack)
-    DPRINTF(E_LOG, L_SCAN, "WARNING: unhandled leftover directories\n");
+  if (cfg_getbool(lib, "filescan_disable"))
+    {
+      DPRINTF(E_LOG, L_SCAN, "Directory polling is disabled, because filescan_disable is set\n");
+      return;
+    }
 
-  end = time(NULL);
+  CHECK_NULL(L_SCAN, poll_roots = calloc(n, sizeof(struct poll_root)));
+  poll_nroots = n;
 
-  if (flags & F_SCAN_FAST)
+  for (i = 0; i < n; i++)
     {
-      DPRINTF(E_LOG, L_SCAN, "Bulk library scan completed in %.f sec (with file scan disabled)\n", difftime(end, start));
+      sec = cfg_getnsec(lib, "poll", i);
+      interval = cfg_getint(sec, "interval");
+      if (interval <= 0)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Invalid poll interval for %s: %d\n", cfg_title(sec), interval);
+	  continue;
+	}
+
+      CHECK_NULL(L_SCAN, poll_roots[i].path = strdup(cfg_title(sec)));
+      poll_roots[i].interval.tv_sec = interval;
+
+      CHECK_NULL(L_SCAN, poll_roots[i].ev = event_new(evbase_lib, -1, EV_PERSIST, poll_cb, &poll_roots[i]));
+      event_add(poll_roots[i].ev, &poll_roots[i].interval);
+
+      DPRINTF(E_INFO, L_SCAN, "Polling %s for changes every %d sec\n", poll_roots[i].path, interval);
     }
-  else
+}
+
+/* Thread: main */
+static void
+poll_deinit(void)
+{
+  int i;
+
+  for (i = 0; i < poll_nroots; i++)
     {
-      DPRINTF(E_LOG, L_SCAN, "Bulk library scan completed in %.f sec\n", difftime(end, start));
+      if (poll_roots[i].ev)
+	event_free(poll_roots[i].ev);
+      free(poll_roots[i].path);
     }
+
+  free(poll_roots);
+  poll_roots = NULL;
+  poll_nroots = 0;
 }
 
+
 static int
 get_parent_dir_id(const char *path)
 {
@@ -1431,17 +2326,174 @@ process_inotify_file_defer(struct watch_info *wi, char *path, struct inotify_eve
 #endif
 
 
+/* Thread: scan */
+static void
+inotify_event_process(struct inotify_event *ie)
+{
+  struct watch_info wi;
+  char path[PATH_MAX];
+  int namelen;
+  int ret;
+
+  memset(&wi, 0, sizeof(struct watch_info));
+
+  /* ie[0] contains the inotify event information
+   * the memory space for ie[1+] contains the name of the file
+   * see the inotify documentation
+   */
+  wi.wd = ie->wd;
+  ret = db_watch_get_bywd(&wi);
+  if (ret < 0)
+    {
+      if (!(ie->mask & IN_IGNORED))
+	DPRINTF(E_LOG, L_SCAN, "No matching watch found, ignoring event (0x%x)\n", ie->mask);
+
+      return;
+    }
+
+  if (ie->mask & IN_IGNORED)
+    {
+      DPRINTF(E_DBG, L_SCAN, "%s deleted or backing filesystem unmounted!\n", wi.path);
+
+      db_watch_delete_bywd(ie->wd);
+      free(wi.path);
+      return;
+    }
+
+  path[0] = '\0';
+
+  ret = snprintf(path, PATH_MAX, "%s", wi.path);
+  if ((ret < 0) || (ret >= PATH_MAX))
+    {
+      DPRINTF(E_LOG, L_SCAN, "Skipping event under %s, PATH_MAX exceeded\n", wi.path);
+
+      free(wi.path);
+      return;
+    }
+
+  if (ie->len > 0)
+    {
+      namelen = PATH_MAX - ret;
+      ret = snprintf(path + ret, namelen, "/%s", ie->name);
+      if ((ret < 0) || (ret >= namelen))
+	{
+	  DPRINTF(E_LOG, L_SCAN, "Skipping %s/%s, PATH_MAX exceeded\n", wi.path, ie->name);
+
+	  free(wi.path);
+	  return;
+	}
+    }
+
+  /* ie->len == 0 catches events on the subject of the watch itself.
+   * As we only watch directories, this catches directories.
+   * General watch events like IN_UNMOUNT and IN_IGNORED do not come
+   * with the IN_ISDIR flag set.
+   */
+  if ((ie->mask & IN_ISDIR) || (ie->len == 0))
+    process_inotify_dir(&wi, path, ie);
+  else
+#ifdef __linux__
+    process_inotify_file(&wi, path, ie);
+#else
+    process_inotify_file_defer(&wi, path, ie);
+#endif
+  free(wi.path);
+}
+
+static void
+inotify_queue_free(void)
+{
+  struct queued_event *qe;
+
+  while ((qe = inoqueue))
+    {
+      inoqueue = qe->next;
+      free(qe);
+    }
+
+  inoqueue_tail = NULL;
+  inoqueue_len = 0;
+}
+
+/* Thread: scan */
+static void
+inotify_batch_cb(int fd, short what, void *arg)
+{
+  struct queued_event *queue;
+  struct queued_event *qe;
+
+  if (!inoqueue)
+    return;
+
+  DPRINTF(E_DBG, L_SCAN, "Processing %d queued inotify events\n", inoqueue_len);
+
+  // Events may be queued again while we process
+  queue = inoqueue;
+  inoqueue = NULL;
+  inoqueue_tail = NULL;
+  inoqueue_len = 0;
+
+  db_transaction_begin();
+
+  for (qe = queue; qe; qe = qe->next)
+    inotify_event_process(&qe->ie);
+
+  db_transaction_end();
+
+  while ((qe = queue))
+    {
+      queue = qe->next;
+      free(qe);
+    }
+}
+
+/* Returns true if ie could be merged into an event that is already queued,
+ * which is the case for the burst of events of a file that is being written
+ */
+static bool
+inotify_event_merge(struct inotify_event *ie)
+{
+  struct queued_event *qe;
+  struct queued_event *last;
+
+  if ((ie->mask & IN_ISDIR) || (ie->len == 0) || (ie->mask & ~INOTIFY_MERGE_MASK))
+    return false;
+
+  // Find the latest queued event for the same file
+  last = NULL;
+  for (qe = inoqueue; qe; qe = qe->next)
+    {
+      if ((qe->ie.wd == ie->wd) && (qe->ie.len > 0) && (strcmp(qe->ie.name, ie->name) == 0))
+	last = qe;
+    }
+
+  if (!last || (last->ie.mask & ~INOTIFY_MERGE_MASK))
+    return false;
+
+  if (ie->mask & IN_CLOSE_WRITE)
+    {
+      // The file is scanned anyway, the attribute check is not needed
+      last->ie.mask = (last->ie.mask | IN_CLOSE_WRITE) & ~IN_ATTRIB;
+      return true;
+    }
+
+  // IN_ATTRIB after IN_CREATE is ignored until the file is closed, and
+  // another IN_ATTRIB is a duplicate
+  if ((ie->mask & IN_ATTRIB) && !(last->ie.mask & IN_CLOSE_WRITE) && (last->ie.mask & (IN_CREATE | IN_ATTRIB)))
+    return true;
+
+  return false;
+}
+
 /* Thread: scan */
 static void
 inotify_cb(int fd, short event, void *arg)
 {
   struct inotify_event *ie;
-  struct watch_info wi;
+  struct queued_event *qe;
   uint8_t *buf;
   uint8_t *ptr;
-  char path[PATH_MAX];
   int size;
-  int namelen;
   int ret;
 
   /* Determine the amount of bytes to read from inotify */
@@ -1474,73 +2526,31 @@ inotify_cb(int fd, short event, void *arg)
     {
       ie = (struct inotify_event *)ptr;
 
-      memset(&wi, 0, sizeof(struct watch_info));
-
-      /* ie[0] contains the inotify event information
-       * the memory space for ie[1+] contains the name of the file
-       * see the inotify documentation
-       */
-      wi.wd = ie->wd;
-      ret = db_watch_get_bywd(&wi);
-      if (ret < 0)
-	{
-	  if (!(ie->mask & IN_IGNORED))
-	    DPRINTF(E_LOG, L_SCAN, "No matching watch found, ignoring event (0x%x)\n", ie->mask);
-
-	  continue;
-	}
-
-      if (ie->mask & IN_IGNORED)
-	{
-	  DPRINTF(E_DBG, L_SCAN, "%s deleted or backing filesystem unmounted!\n", wi.path);
-
-	  db_watch_delete_bywd(ie->wd);
-	  free(wi.path);
-	  continue;
-	}
-
-      path[0] = '\0';
-
-      ret = snprintf(path, PATH_MAX, "%s", wi.path);
-      if ((ret < 0) || (ret >= PATH_MAX))
+      if (inotify_event_merge(ie))
 	{
-	  DPRINTF(E_LOG, L_SCAN, "Skipping event under %s, PATH_MAX exceeded\n", wi.path);
-
-	  free(wi.path);
+	  DPRINTF(E_SPAM, L_SCAN, "Merged inotify event 0x%x for %s\n", ie->mask, ie->name);
 	  continue;
 	}
 
-      if (ie->len > 0)
-	{
-	  namelen = PATH_MAX - ret;
-	  ret = snprintf(path + ret, namelen, "/%s", ie->name);
-	  if ((ret < 0) || (ret >= namelen))
-	    {
-	      DPRINTF(E_LOG, L_SCAN, "Skipping %s/%s, PATH_MAX exceeded\n", wi.path, ie->name);
-
-	      free(wi.path);
-	      continue;
-	    }
-	}
+      CHECK_NULL(L_SCAN, qe = malloc(sizeof(struct queued_event) + ie->len));
+      memcpy(&qe->ie, ie, sizeof(struct inotify_event) + ie->len);
+      qe->next = NULL;
 
-      /* ie->len == 0 catches events on the subject of the watch itself.
-       * As we only watch directories, this catches directories.
-       * General watch events like IN_UNMOUNT and IN_IGNORED do not come
-       * with the IN_ISDIR flag set.
-       */
-      if ((ie->mask & IN_ISDIR) || (ie->len == 0))
-	process_inotify_dir(&wi, path, ie);
+      if (inoqueue_tail)
+	inoqueue_tail->next = qe;
       else
-#ifdef __linux__
-	process_inotify_file(&wi, path, ie);
-#else
-	process_inotify_file_defer(&wi, path, ie);
-#endif
-      free(wi.path);
+	inoqueue = qe;
+      inoqueue_tail = qe;
+      inoqueue_len++;
     }
 
   free(buf);
 
+  if (inoqueue_len >= INOTIFY_BATCH_MAX)
+    inotify_batch_cb(-1, 0, NULL);
+  else if (inoqueue && !evtimer_pending(batch_inoev, NULL))
+    evtimer_add(batch_inoev, &inotify_batch_wait);
+
   event_add(inoev, NULL);
 }
 
@@ -1557,6 +2567,7 @@ inofd_event_set(void)
     }
 
   inoev = event_new(evbase_lib, inofd, EV_READ, inotify_cb, NULL);
+  CHECK_NULL(L_SCAN, batch_inoev = evtimer_new(evbase_lib, inotify_batch_cb, NULL));
 
 #ifndef __linux__
   deferred_inoev = evtimer_new(evbase_lib, inotify_deferred_cb, NULL);
@@ -1578,6 +2589,9 @@ inofd_event_unset(void)
 #ifndef __linux__
   event_free(deferred_inoev);
 #endif
+  // Queued events refer to watches that are about to be cleared
+  inotify_queue_free();
+  event_free(batch_inoev);
   event_free(inoev);
   close(inofd);
 }
@@ -2026,12 +3040,16 @@ filescanner_init(void)
 {
   int ret;
 
+  scan_native = cfg_getbool(cfg_getsec(cfg, "library"), "native_metadata");
+
   ret = inofd_event_set();
   if (ret < 0)
     {
       return -1;
     }
 
+  poll_init();
+
   return 0;
 }
 
@@ -2039,6 +3057,7 @@ filescanner_init(void)
 static void
 filescanner_deinit(void)
 {
+  poll_deinit();
   inofd_event_unset();
 }
 
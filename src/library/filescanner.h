@@ -10,6 +10,9 @@
 int
 scan_metadata_ffmpeg(const char *file, struct media_file_info *mfi);
 
+int
+scan_metadata_native(const char *file, struct media_file_info *mfi);
+
 void
 scan_playlist(const char *file, time_t mtime, int dir_id);
 
@@ -57,4 +60,23 @@ strip_extension(const char *path);
 int
 parent_dir(const char **current, const char *path);
 
+/* Transient index of the library files by file name, so that playlist entries
+ * can be resolved without queries. Only built while the deferred playlists of
+ * a bulk scan are processed.
+ */
+void
+file_index_build(void);
+
+void
+file_index_free(void);
+
+/* Finds the library file best matching a path from a playlist, by file name
+ * and then by the number of parent directories in common.
+ *
+ * @in path        the path from the playlist
+ * @return         file id, -1 if no match, 0 if the index is not built
+ */
+int
+file_index_find(const char *path);
+
 #endif /* !__FILESCANNER_H__ */
@@ -37,10 +37,12 @@
 
 #include <plist/plist.h>
 
+#include <event2/buffer.h>
 #include <event2/http.h>
 
 #include "logger.h"
 #include "db.h"
+#include "library.h"
 #include "library/filescanner.h"
 #include "conffile.h"
 #include "misc.h"
@@ -57,6 +59,9 @@ struct itml_to_db_map {
 };
 struct itml_to_db_map **id_map;
 
+/* Time of the previous import of the XML being processed, 0 if none */
+static time_t itml_last_import;
+
 
 /* Mapping between iTunes library metadata keys and the offset
  * of the equivalent metadata field in struct media_file_info */
@@ -320,6 +325,15 @@ mfi_id_find(const char *path)
   int i;
   int ret;
 
+  ret = file_index_find(path);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "No file matches iTunes XML entry '%s'\n", path);
+      return -1;
+    }
+  else if (ret > 0)
+    return ret;
+
   ret = db_snprintf(filter, sizeof(filter), "f.fname = '%q' COLLATE NOCASE", filename_from_path(path));
   if (ret < 0)
     {
@@ -396,6 +410,8 @@ process_track_file(plist_t trk)
   uint32_t *intval;
   char *chrval;
   uint8_t boolean;
+  uint32_t date_modified;
+  int skip;
   int mfi_id;
   int i;
   int ret;
@@ -429,6 +445,15 @@ process_track_file(plist_t trk)
   if (!cfg_getbool(cfg_getsec(cfg, "library"), "itunes_overrides"))
     return mfi_id;
 
+  /* Tracks not modified in iTunes since the previous import already have the
+   * overrides, unless the file was rescanned in the meantime
+   */
+  ret = get_dictval_date_from_key(trk, "Date Modified", &date_modified);
+  if ((ret == 0) && itml_last_import && (date_modified < itml_last_import))
+    skip = 1;
+  else
+    skip = 0;
+
   /* Override our metadata with what's provided by iTunes */
   mfi = db_file_fetch_byid(mfi_id);
   if (!mfi)
@@ -438,6 +463,14 @@ process_track_file(plist_t trk)
       return mfi_id;
     }
 
+  if (skip && (mfi->time_modified < itml_last_import))
+    {
+      DPRINTF(E_SPAM, L_SCAN, "Track unchanged since last iTunes XML import, keeping metadata of file id %d\n", mfi_id);
+
+      free_mfi(mfi, 0);
+      return mfi_id;
+    }
+
   for (i = 0; md_map[i].key != NULL; i++)
     {
       switch (md_map[i].type)
@@ -533,119 +566,63 @@ process_track_stream(plist_t trk)
 }
 
 static int
-process_tracks(plist_t tracks)
+process_track(plist_t trk)
 {
-  plist_t trk;
-  plist_dict_iter iter;
   char *str;
   uint64_t trk_id;
   uint8_t disabled;
-  int ntracks;
-  int nloaded;
   int mfi_id;
   int ret;
 
-  if (plist_dict_get_size(tracks) == 0)
+  ret = get_dictval_int_from_key(trk, "Track ID", &trk_id);
+  if (ret < 0)
     {
-      DPRINTF(E_WARN, L_SCAN, "No tracks in iTunes library\n");
-      return 0;
+      DPRINTF(E_WARN, L_SCAN, "Track ID not found!\n");
+      return -1;
     }
 
-  db_transaction_begin();
-
-  ntracks = 0;
-  nloaded = 0;
-
-  iter = NULL;
-  plist_dict_new_iter(tracks, &iter);
-
-  plist_dict_next_item(tracks, iter, NULL, &trk);
-  while (trk)
+  ret = get_dictval_bool_from_key(trk, "Disabled", &disabled);
+  if (ret < 0)
     {
-      if (plist_get_node_type(trk) != PLIST_DICT)
-	{
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
-
-      ret = get_dictval_int_from_key(trk, "Track ID", &trk_id);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Track ID not found!\n");
-
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
-
-      ret = get_dictval_bool_from_key(trk, "Disabled", &disabled);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Malformed track record (id %" PRIu64 ")\n", trk_id);
-
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
-
-      if (disabled)
-	{
-	  DPRINTF(E_INFO, L_SCAN, "Track %" PRIu64 " disabled; skipping\n", trk_id);
-
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
-
-      ret = get_dictval_string_from_key(trk, "Track Type", &str);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Track %" PRIu64 " has no track type\n", trk_id);
+      DPRINTF(E_WARN, L_SCAN, "Malformed track record (id %" PRIu64 ")\n", trk_id);
+      return -1;
+    }
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  if (disabled)
+    {
+      DPRINTF(E_INFO, L_SCAN, "Track %" PRIu64 " disabled; skipping\n", trk_id);
+      return -1;
+    }
 
-      if (strcmp(str, "URL") == 0)
-	mfi_id = process_track_stream(trk);
-      else if (strcmp(str, "File") == 0)
-	mfi_id = process_track_file(trk);
-      else
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Unknown track type: '%s'\n", str);
+  ret = get_dictval_string_from_key(trk, "Track Type", &str);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_SCAN, "Track %" PRIu64 " has no track type\n", trk_id);
+      return -1;
+    }
 
-	  free(str);
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  if (strcmp(str, "URL") == 0)
+    mfi_id = process_track_stream(trk);
+  else if (strcmp(str, "File") == 0)
+    mfi_id = process_track_file(trk);
+  else
+    {
+      DPRINTF(E_LOG, L_SCAN, "Unknown track type: '%s'\n", str);
 
       free(str);
-
-      ntracks++;
-      if (ntracks % 200 == 0)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Processed %d tracks...\n", ntracks);
-	  db_transaction_end();
-	  db_transaction_begin();
-	}
-
-      if (mfi_id <= 0)
-	{
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
-
-      ret = id_map_add(trk_id, mfi_id);
-      if (ret < 0)
-	DPRINTF(E_LOG, L_SCAN, "Out of memory for itml -> db mapping\n");
-
-      nloaded++;
-
-      plist_dict_next_item(tracks, iter, NULL, &trk);
+      return -1;
     }
 
-  free(iter);
+  free(str);
 
-  db_transaction_end();
+  if (mfi_id <= 0)
+    return 0;
 
-  return nloaded;
+  ret = id_map_add(trk_id, mfi_id);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_SCAN, "Out of memory for itml -> db mapping\n");
+
+  return 1;
 }
 
 static void
@@ -659,7 +636,7 @@ process_pl_items(plist_t items, int pl_id, const char *name)
   int ntracks;
   int ret;
 
-  db_transaction_begin();
+  library_scan_session_begin();
 
   ntracks = 0;
 
@@ -690,15 +667,11 @@ process_pl_items(plist_t items, int pl_id, const char *name)
 	DPRINTF(E_WARN, L_SCAN, "Could not add ID %d to playlist '%s'\n", db_id, name);
 
       ntracks++;
-      if (ntracks % 200 == 0)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Processed %d tracks from playlist '%s'...\n", ntracks, name);
-	  db_transaction_end();
-	  db_transaction_begin();
-	}
+      if (library_scan_session_step())
+	DPRINTF(E_LOG, L_SCAN, "Processed %d tracks from playlist '%s'...\n", ntracks, name);
     }
 
-  db_transaction_end();
+  library_scan_session_end();
 }
 
 static int 
@@ -738,80 +711,477 @@ ignore_pl(plist_t pl, const char *name)
 }
 
 static void
-process_pls(plist_t playlists, const char *file)
+process_pl(plist_t pl, const char *file)
 {
-  plist_t pl;
   plist_t items;
   struct playlist_info *pli;
   char *name;
   uint64_t id;
   int pl_id;
-  uint32_t alen;
-  uint32_t i;
   char virtual_path[PATH_MAX];
   int ret;
 
-  alen = plist_array_get_size(playlists);
-  for (i = 0; i < alen; i++)
+  ret = get_dictval_int_from_key(pl, "Playlist ID", &id);
+  if (ret < 0)
     {
-      pl = plist_array_get_item(playlists, i);
+      DPRINTF(E_DBG, L_SCAN, "Playlist ID not found!\n");
+      return;
+    }
 
-      if (plist_get_node_type(pl) != PLIST_DICT)
-	continue;
+  ret = get_dictval_string_from_key(pl, "Name", &name);
+  if (ret < 0)
+    {
+      DPRINTF(E_DBG, L_SCAN, "Name not found!\n");
+      return;
+    }
 
-      ret = get_dictval_int_from_key(pl, "Playlist ID", &id);
-      if (ret < 0)
+  if (ignore_pl(pl, name))
+    {
+      free(name);
+      return;
+    }
+
+  ret = get_dictval_array_from_key(pl, "Playlist Items", &items);
+  if (ret < 0)
+    {
+      DPRINTF(E_INFO, L_SCAN, "Playlist '%s' has no items\n", name);
+
+      free(name);
+      return;
+    }
+
+  CHECK_NULL(L_SCAN, pli = calloc(1, sizeof(struct playlist_info)));
+
+  pli->type = PL_PLAIN;
+  pli->title = strdup(name);
+  pli->path = strdup(file);
+  snprintf(virtual_path, sizeof(virtual_path), "/file:%s/%s", file, name);
+  pli->virtual_path = strdup(virtual_path);
+
+  ret = db_pl_add(pli, &pl_id);
+  free_pli(pli, 0);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Error adding iTunes playlist '%s' (%s)\n", name, file);
+
+      free(name);
+      return;
+    }
+
+  DPRINTF(E_INFO, L_SCAN, "Added playlist as id %d\n", pl_id);
+
+  process_pl_items(items, pl_id, name);
+
+  free(name);
+}
+
+
+/* Streaming reader for the plist XML of the iTunes library. The file is only
+ * scanned for element boundaries here, so we never hold the whole document as
+ * a plist tree. Each track dict and each playlist dict is handed to libplist
+ * on its own and freed when processed, so memory use is bounded by the
+ * largest single playlist instead of by the size of the library.
+ */
+struct itml_reader {
+  const char *pos;
+  const char *end;
+};
+
+enum itml_tag {
+  ITML_TAG_EOF,
+  ITML_TAG_OPEN,
+  ITML_TAG_CLOSE,
+  ITML_TAG_EMPTY,
+};
+
+#define ITML_FRAGMENT_HEAD "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<plist version=\"1.0\">\n"
+#define ITML_FRAGMENT_TAIL "\n</plist>\n"
+
+/* Advances to the next element tag, skipping text, comments, processing
+ * instructions and the doctype. On return *start points to the '<' of the tag
+ * and r->pos to the char following the closing '>'.
+ */
+static enum itml_tag
+itml_next_tag(struct itml_reader *r, const char **name, size_t *namelen, const char **start)
+{
+  const char *p;
+  const char *gt;
+  enum itml_tag tag;
+
+  p = r->pos;
+  for (;;)
+    {
+      p = memchr(p, '<', r->end - p);
+      if (!p || (p + 1 >= r->end))
+	{
+	  r->pos = r->end;
+	  return ITML_TAG_EOF;
+	}
+
+      if ((p + 4 <= r->end) && (strncmp(p, "<!--", 4) == 0))
 	{
-	  DPRINTF(E_DBG, L_SCAN, "Playlist ID not found!\n");
+	  for (gt = p + 4; (gt = memchr(gt, '>', r->end - gt)); gt++)
+	    {
+	      if ((gt - p >= 6) && (gt[-1] == '-') && (gt[-2] == '-'))
+		break;
+	    }
+	  if (!gt)
+	    break;
+
+	  p = gt + 1;
 	  continue;
 	}
 
-      ret = get_dictval_string_from_key(pl, "Name", &name);
-      if (ret < 0)
+      gt = memchr(p, '>', r->end - p);
+      if (!gt)
+	break;
+
+      if ((p[1] == '?') || (p[1] == '!'))
+	{
+	  p = gt + 1;
+	  continue;
+	}
+
+      *start = p;
+      r->pos = gt + 1;
+
+      p++;
+      if (*p == '/')
+	{
+	  tag = ITML_TAG_CLOSE;
+	  p++;
+	}
+      else if (gt[-1] == '/')
+	tag = ITML_TAG_EMPTY;
+      else
+	tag = ITML_TAG_OPEN;
+
+      *name = p;
+      while ((p < gt) && (*p != '/') && (*p != ' ') && (*p != '\t') && (*p != '\r') && (*p != '\n'))
+	p++;
+      *namelen = p - *name;
+
+      return tag;
+    }
+
+  DPRINTF(E_LOG, L_SCAN, "Unterminated tag in iTunes XML\n");
+
+  r->pos = r->end;
+  return ITML_TAG_EOF;
+}
+
+static int
+itml_tag_is(const char *name, size_t namelen, const char *expected)
+{
+  return (namelen == strlen(expected)) && (strncmp(name, expected, namelen) == 0);
+}
+
+/* Advances past the close tag matching an already read open tag */
+static int
+itml_skip_element(struct itml_reader *r)
+{
+  const char *name;
+  const char *start;
+  size_t namelen;
+  int depth;
+
+  depth = 1;
+  while (depth > 0)
+    {
+      switch (itml_next_tag(r, &name, &namelen, &start))
+	{
+	  case ITML_TAG_OPEN:
+	    depth++;
+	    break;
+
+	  case ITML_TAG_CLOSE:
+	    depth--;
+	    break;
+
+	  case ITML_TAG_EMPTY:
+	    break;
+
+	  case ITML_TAG_EOF:
+	    return -1;
+	}
+    }
+
+  return 0;
+}
+
+/* Reads the text of a <key> element, the open tag must already be read */
+static int
+itml_read_key(struct itml_reader *r, char *key, size_t keylen)
+{
+  const char *name;
+  const char *start;
+  const char *text;
+  size_t namelen;
+  size_t len;
+
+  text = r->pos;
+  if (itml_next_tag(r, &name, &namelen, &start) != ITML_TAG_CLOSE)
+    return -1;
+
+  len = start - text;
+  if (len >= keylen)
+    len = keylen - 1;
+
+  memcpy(key, text, len);
+  key[len] = '\0';
+
+  return 0;
+}
+
+/* Parses a single element of the document with libplist */
+static plist_t
+itml_parse_fragment(const char *start, const char *end)
+{
+  plist_t node;
+  char *xml;
+  size_t len;
+
+  len = strlen(ITML_FRAGMENT_HEAD) + (end - start) + strlen(ITML_FRAGMENT_TAIL);
+
+  CHECK_NULL(L_SCAN, xml = malloc(len));
+
+  memcpy(xml, ITML_FRAGMENT_HEAD, strlen(ITML_FRAGMENT_HEAD));
+  memcpy(xml + strlen(ITML_FRAGMENT_HEAD), start, end - start);
+  memcpy(xml + strlen(ITML_FRAGMENT_HEAD) + (end - start), ITML_FRAGMENT_TAIL, strlen(ITML_FRAGMENT_TAIL));
+
+  node = NULL;
+  plist_from_xml(xml, len, &node);
+
+  free(xml);
+
+  if (node && (plist_get_node_type(node) != PLIST_DICT))
+    {
+      plist_free(node);
+      return NULL;
+    }
+
+  return node;
+}
+
+/* Processes the entries of the Tracks dict one at a time, the open tag of the
+ * dict must already be read
+ */
+static int
+itml_stream_tracks(struct itml_reader *r)
+{
+  plist_t trk;
+  const char *name;
+  const char *start;
+  size_t namelen;
+  int ntracks;
+  int nloaded;
+  int ret;
+
+  library_scan_session_begin();
+
+  ntracks = 0;
+  nloaded = 0;
+
+  for (;;)
+    {
+      ret = itml_next_tag(r, &name, &namelen, &start);
+      if ((ret == ITML_TAG_EOF) || (ret == ITML_TAG_CLOSE))
+	break;
+
+      if (ret != ITML_TAG_OPEN)
+	continue;
+
+      if (!itml_tag_is(name, namelen, "dict"))
 	{
-	  DPRINTF(E_DBG, L_SCAN, "Name not found!\n");
+	  if (itml_skip_element(r) < 0)
+	    break;
+
 	  continue;
 	}
 
-      if (ignore_pl(pl, name))
+      if (itml_skip_element(r) < 0)
+	break;
+
+      trk = itml_parse_fragment(start, r->pos);
+      if (!trk)
 	{
-	  free(name);
+	  DPRINTF(E_WARN, L_SCAN, "Could not parse track record in iTunes XML\n");
 	  continue;
 	}
 
-      ret = get_dictval_array_from_key(pl, "Playlist Items", &items);
+      ret = process_track(trk);
+      plist_free(trk);
       if (ret < 0)
+	continue;
+
+      ntracks++;
+      if (library_scan_session_step())
+	DPRINTF(E_LOG, L_SCAN, "Processed %d tracks...\n", ntracks);
+
+      if (ret > 0)
+	nloaded++;
+    }
+
+  library_scan_session_end();
+
+  if (ntracks == 0)
+    DPRINTF(E_WARN, L_SCAN, "No tracks in iTunes library\n");
+
+  return nloaded;
+}
+
+/* Processes the dicts of the Playlists array one at a time, the open tag of
+ * the array must already be read
+ */
+static void
+itml_stream_pls(struct itml_reader *r, const char *file)
+{
+  plist_t pl;
+  const char *name;
+  const char *start;
+  size_t namelen;
+  int ret;
+
+  for (;;)
+    {
+      ret = itml_next_tag(r, &name, &namelen, &start);
+      if ((ret == ITML_TAG_EOF) || (ret == ITML_TAG_CLOSE))
+	break;
+
+      if (ret != ITML_TAG_OPEN)
+	continue;
+
+      if (itml_skip_element(r) < 0)
+	break;
+
+      if (!itml_tag_is(name, namelen, "dict"))
+	continue;
+
+      pl = itml_parse_fragment(start, r->pos);
+      if (!pl)
 	{
-	  DPRINTF(E_INFO, L_SCAN, "Playlist '%s' has no items\n", name);
+	  DPRINTF(E_WARN, L_SCAN, "Could not parse playlist record in iTunes XML\n");
+	  continue;
+	}
 
-	  free(name);
+      process_pl(pl, file);
+      plist_free(pl);
+    }
+}
+
+static void
+itml_stream(const char *xml, size_t len, const char *file)
+{
+  struct itml_reader r;
+  struct itml_reader pls;
+  struct evbuffer *metabuf;
+  plist_t meta;
+  const char *name;
+  const char *start;
+  const char *keystart;
+  const char *metadata;
+  size_t namelen;
+  char key[64];
+  int have_pls;
+  int ntracks;
+  int ret;
+
+  r.pos = xml;
+  r.end = xml + len;
+
+  // Find the root dict
+  do
+    {
+      ret = itml_next_tag(&r, &name, &namelen, &start);
+    }
+  while ((ret != ITML_TAG_EOF) && !((ret == ITML_TAG_OPEN) && itml_tag_is(name, namelen, "dict")));
+
+  if (ret == ITML_TAG_EOF)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Malformed iTunes XML playlist '%s'\n", file);
+      return;
+    }
+
+  CHECK_NULL(L_SCAN, metabuf = evbuffer_new());
+  evbuffer_add(metabuf, "<dict>", strlen("<dict>"));
+
+  ntracks = -1;
+  have_pls = 0;
+  for (;;)
+    {
+      ret = itml_next_tag(&r, &name, &namelen, &keystart);
+      if ((ret == ITML_TAG_EOF) || (ret == ITML_TAG_CLOSE))
+	break;
+
+      if (ret != ITML_TAG_OPEN)
+	continue;
+
+      if (!itml_tag_is(name, namelen, "key"))
+	{
+	  itml_skip_element(&r);
 	  continue;
 	}
 
-      CHECK_NULL(L_SCAN, pli = calloc(1, sizeof(struct playlist_info)));
+      if (itml_read_key(&r, key, sizeof(key)) < 0)
+	break;
 
-      pli->type = PL_PLAIN;
-      pli->title = strdup(name);
-      pli->path = strdup(file);
-      snprintf(virtual_path, sizeof(virtual_path), "/file:%s/%s", file, name);
-      pli->virtual_path = strdup(virtual_path);
+      ret = itml_next_tag(&r, &name, &namelen, &start);
+      if ((ret == ITML_TAG_EOF) || (ret == ITML_TAG_CLOSE))
+	break;
 
-      ret = db_pl_add(pli, &pl_id);
-      free_pli(pli, 0);
-      if (ret < 0)
+      if ((ret == ITML_TAG_OPEN) && (strcmp(key, "Tracks") == 0) && itml_tag_is(name, namelen, "dict"))
 	{
-	  DPRINTF(E_LOG, L_SCAN, "Error adding iTunes playlist '%s' (%s)\n", name, file);
+	  // The meta data keys come first in the files written by iTunes
+	  evbuffer_add(metabuf, "</dict>", strlen("</dict>"));
+	  metadata = (const char *)evbuffer_pullup(metabuf, -1);
+	  meta = itml_parse_fragment(metadata, metadata + evbuffer_get_length(metabuf));
+	  if (!meta || (check_meta(meta) < 0))
+	    DPRINTF(E_WARN, L_SCAN, "Incomplete meta data in iTunes XML '%s'\n", file);
+	  if (meta)
+	    plist_free(meta);
+
+	  ntracks = itml_stream_tracks(&r);
+	  if (ntracks <= 0)
+	    break;
+
+	  DPRINTF(E_LOG, L_SCAN, "Loaded %d tracks from iTunes XML '%s'\n", ntracks, file);
+
+	  // Playlists found before the tracks, now we can process them
+	  if (have_pls)
+	    itml_stream_pls(&pls, file);
 
-	  free(name);
 	  continue;
 	}
 
-      DPRINTF(E_INFO, L_SCAN, "Added playlist as id %d\n", pl_id);
+      if ((ret == ITML_TAG_OPEN) && (strcmp(key, "Playlists") == 0) && itml_tag_is(name, namelen, "array"))
+	{
+	  have_pls = 1;
+	  pls = r;
 
-      process_pl_items(items, pl_id, name);
+	  if (ntracks > 0)
+	    itml_stream_pls(&r, file);
+	  else if (itml_skip_element(&r) < 0)
+	    break;
 
-      free(name);
+	  continue;
+	}
+
+      if ((ret == ITML_TAG_OPEN) && (itml_skip_element(&r) < 0))
+	break;
+
+      // Keep the small top level values so check_meta() can look at them
+      if (ntracks < 0)
+	evbuffer_add(metabuf, keystart, r.pos - keystart);
     }
+
+  evbuffer_free(metabuf);
+
+  if (ntracks < 0)
+    DPRINTF(E_LOG, L_SCAN, "Could not find Tracks dict in '%s'\n", file);
+  else if (ntracks == 0)
+    DPRINTF(E_LOG, L_SCAN, "No tracks loaded from iTunes XML '%s'\n", file);
+  else if (!have_pls)
+    DPRINTF(E_LOG, L_SCAN, "Could not find Playlists dict in '%s'\n", file);
 }
 
 
@@ -822,11 +1192,11 @@ scan_itunes_itml(const char *file, time_t mtime, int dir_id)
   struct stat sb;
   char buf[PATH_MAX];
   char *itml_xml;
-  plist_t itml;
-  plist_t node;
   int fd;
   int ret;
 
+  itml_last_import = 0;
+
   // This is special playlist that is disabled and only used for saving a timestamp
   pli = db_pl_fetch_bytitlepath(file, file);
   if (pli)
@@ -847,6 +1217,8 @@ scan_itunes_itml(const char *file, time_t mtime, int dir_id)
 
       DPRINTF(E_LOG, L_SCAN, "Modified iTunes XML found, processing '%s'\n", file);
 
+      itml_last_import = pli->db_timestamp;
+
       // Clear out everything, we will recreate
       db_pl_delete_bypath(file);
       free_pli(pli, 0);
@@ -896,6 +1268,8 @@ scan_itunes_itml(const char *file, time_t mtime, int dir_id)
       return;
     }
 
+  // The mapping is backed by the file, so pages we are done with can be
+  // dropped by the kernel while we read ahead
   itml_xml = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
   if (itml_xml == MAP_FAILED)
     {
@@ -905,82 +1279,27 @@ scan_itunes_itml(const char *file, time_t mtime, int dir_id)
       return;
     }
 
-  itml = NULL;
-  plist_from_xml(itml_xml, sb.st_size, &itml);
-
-  ret = munmap(itml_xml, sb.st_size);
-  if (ret < 0)
-    DPRINTF(E_LOG, L_SCAN, "Could not unmap iTunes library '%s': %s\n", file, strerror(errno));
-
-  close(fd);
-
-  if (!itml)
-    {
-      DPRINTF(E_LOG, L_SCAN, "iTunes XML playlist '%s' failed to parse\n", file);
-
-      return;
-    }
-
-  if (plist_get_node_type(itml) != PLIST_DICT)
-    {
-      DPRINTF(E_LOG, L_SCAN, "Malformed iTunes XML playlist '%s'\n", file);
-
-      plist_free(itml);
-      return;
-    }
-
-  /* Meta data */
-  ret = check_meta(itml);
-  if (ret < 0)
-    {
-      plist_free(itml);
-      return;
-    }
-
-  /* Tracks */
-  ret = get_dictval_dict_from_key(itml, "Tracks", &node);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_SCAN, "Could not find Tracks dict in '%s'\n", file);
-
-      plist_free(itml);
-      return;
-    }
+#ifdef MADV_SEQUENTIAL
+  madvise(itml_xml, sb.st_size, MADV_SEQUENTIAL);
+#endif
 
   id_map = calloc(ID_MAP_SIZE, sizeof(struct itml_to_db_map *));
   if (!id_map)
     {
       DPRINTF(E_FATAL, L_SCAN, "iTunes library parser could not allocate ID map\n");
 
-      plist_free(itml);
+      munmap(itml_xml, sb.st_size);
+      close(fd);
       return;
     }
 
-  ret = process_tracks(node);
-  if (ret <= 0)
-    {
-      DPRINTF(E_LOG, L_SCAN, "No tracks loaded from iTunes XML '%s'\n", file);
-
-      id_map_free();
-      plist_free(itml);
-      return;
-    }
+  itml_stream(itml_xml, sb.st_size, file);
 
-  DPRINTF(E_LOG, L_SCAN, "Loaded %d tracks from iTunes XML '%s'\n", ret, file);
+  id_map_free();
 
-  /* Playlists */
-  ret = get_dictval_array_from_key(itml, "Playlists", &node);
+  ret = munmap(itml_xml, sb.st_size);
   if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_SCAN, "Could not find Playlists dict in '%s'\n", file);
-
-      id_map_free();
-      plist_free(itml);
-      return;
-    }
-
-  process_pls(node, file);
+    DPRINTF(E_LOG, L_SCAN, "Could not unmap iTunes library '%s': %s\n", file, strerror(errno));
 
-  id_map_free();
-  plist_free(itml);
+  close(fd);
 }
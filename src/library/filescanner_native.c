@@ -0,0 +1,1536 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Fast path metadata readers for MP3 (ID3v2 with Xing/VBRI duration), FLAC
+ * (STREAMINFO and Vorbis comments) and MP4 audio (moov/udta/meta/ilst). They
+ * only read the header region of the file with a few pread()s, instead of
+ * probing the streams with libavformat. Anything they don't fully understand
+ * makes scan_metadata_native() fail, and the caller then falls back to
+ * scan_metadata_ffmpeg(), so the result should be the same as with ffmpeg.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "logger.h"
+#include "db.h"
+#include "misc.h"
+#include "library/filescanner.h"
+
+// Reads are done in windows of this size, and no single item may be larger
+#define NATIVE_WINDOW   65536
+#define NATIVE_PEEK_MAX (1024 * 1024)
+
+// Limits for walking the file structure, to bail out of garbage quickly
+#define NATIVE_MAX_ITEMS 512
+#define NATIVE_MAX_DEPTH 8
+
+struct native_ctx
+{
+  const char *path;
+  int fd;
+  int64_t size;
+
+  uint8_t *win;
+  int64_t win_offset;
+  size_t win_len;
+  size_t win_alloc;
+
+  // Collected metadata, merged into the caller's mfi on success
+  struct media_file_info tags;
+};
+
+enum native_tag
+{
+  TAG_STR,
+  TAG_TRACK,
+  TAG_DISC,
+  TAG_DATE,
+  TAG_INT,
+  TAG_COMMENT,
+  TAG_PICTURE,
+  TAG_GENRE,
+};
+
+struct native_key
+{
+  const char *key;
+  enum native_tag kind;
+  size_t offset;
+};
+
+/* Fields copied from the collected tags to the caller's mfi */
+static const size_t native_str_fields[] =
+  {
+    mfi_offsetof(title), mfi_offsetof(artist), mfi_offsetof(album_artist), mfi_offsetof(album),
+    mfi_offsetof(genre), mfi_offsetof(composer), mfi_offsetof(grouping), mfi_offsetof(comment),
+    mfi_offsetof(title_sort), mfi_offsetof(artist_sort), mfi_offsetof(album_sort),
+    mfi_offsetof(album_artist_sort), mfi_offsetof(composer_sort),
+    mfi_offsetof(type), mfi_offsetof(codectype), mfi_offsetof(description),
+  };
+
+static const size_t native_int_fields[] =
+  {
+    mfi_offsetof(track), mfi_offsetof(total_tracks), mfi_offsetof(disc), mfi_offsetof(total_discs),
+    mfi_offsetof(year), mfi_offsetof(date_released), mfi_offsetof(compilation),
+    mfi_offsetof(song_length), mfi_offsetof(bitrate), mfi_offsetof(samplerate), mfi_offsetof(bits_per_sample),
+  };
+
+
+/* ------------------------------- Helpers -------------------------------- */
+
+static inline uint32_t
+be16(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+be24(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static inline uint32_t
+be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t
+be64(const uint8_t *p)
+{
+  return ((uint64_t)be32(p) << 32) | be32(p + 4);
+}
+
+static inline uint32_t
+le32(const uint8_t *p)
+{
+  return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static inline uint32_t
+syncsafe32(const uint8_t *p)
+{
+  return ((uint32_t)(p[0] & 0x7f) << 21) | ((uint32_t)(p[1] & 0x7f) << 14) | ((uint32_t)(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+/* Returns a pointer to len bytes of the file at offset, valid until the next
+ * call, or NULL if the bytes are not there
+ */
+static const uint8_t *
+native_peek(struct native_ctx *ctx, int64_t offset, size_t len)
+{
+  uint8_t *tmp;
+  size_t want;
+  size_t done;
+  ssize_t got;
+
+  if ((len > NATIVE_PEEK_MAX) || (offset < 0) || (offset + (int64_t)len > ctx->size))
+    return NULL;
+
+  if (ctx->win && (offset >= ctx->win_offset) && (offset + len <= ctx->win_offset + ctx->win_len))
+    return ctx->win + (offset - ctx->win_offset);
+
+  want = (len > NATIVE_WINDOW) ? len : NATIVE_WINDOW;
+  if (offset + (int64_t)want > ctx->size)
+    want = ctx->size - offset;
+
+  if (want > ctx->win_alloc)
+    {
+      CHECK_NULL(L_SCAN, tmp = realloc(ctx->win, want));
+      ctx->win = tmp;
+      ctx->win_alloc = want;
+    }
+
+  ctx->win_len = 0;
+
+  for (done = 0; done < want; done += got)
+    {
+      got = pread(ctx->fd, ctx->win + done, want - done, offset + done);
+      if ((got < 0) && (errno == EINTR))
+	{
+	  got = 0;
+	  continue;
+	}
+      if (got <= 0)
+	return NULL;
+    }
+
+  ctx->win_offset = offset;
+  ctx->win_len = want;
+
+  return ctx->win;
+}
+
+/* Sets a string field unless it already has a value, so the first occurrence
+ * takes precedence like in the ffmpeg scanner. The value must be UTF-8 and is
+ * cut at the first NUL, if any.
+ */
+static void
+tag_set_str(char **field, const char *val, size_t len)
+{
+  if (*field || (len == 0) || (val[0] == '\0'))
+    return;
+
+  *field = strndup(val, len);
+}
+
+static void
+tag_set_int(uint32_t *field, const char *val, size_t len)
+{
+  char buf[32];
+
+  if (*field || (len == 0) || (len >= sizeof(buf)))
+    return;
+
+  memcpy(buf, val, len);
+  buf[len] = '\0';
+
+  safe_atou32(buf, field);
+}
+
+/* For "3/12" style values */
+static void
+tag_set_pair(uint32_t *first, uint32_t *second, const char *val, size_t len)
+{
+  const char *slash;
+
+  slash = memchr(val, '/', len);
+  if (slash)
+    {
+      tag_set_int(first, val, slash - val);
+      tag_set_int(second, slash + 1, len - (slash - val) - 1);
+    }
+  else
+    tag_set_int(first, val, len);
+}
+
+static void
+tag_set_date(struct media_file_info *tags, const char *val, size_t len)
+{
+  char buf[64];
+  struct tm tm = { 0 };
+
+  if (len >= sizeof(buf))
+    return;
+
+  memcpy(buf, val, len);
+  buf[len] = '\0';
+
+  if ((tags->year == 0) && (len >= 4) && (strspn(buf, "0123456789") >= 4))
+    tags->year = (buf[0] - '0') * 1000 + (buf[1] - '0') * 100 + (buf[2] - '0') * 10 + (buf[3] - '0');
+
+  if (tags->date_released)
+    return;
+
+  if ( strptime(buf, "%FT%T%z", &tm) // ISO 8601, %F=%Y-%m-%d, %T=%H:%M:%S
+       || strptime(buf, "%F %T", &tm)
+       || strptime(buf, "%F %H:%M", &tm)
+       || strptime(buf, "%F", &tm)
+     )
+    tags->date_released = (uint32_t)mktime(&tm);
+  else if (tags->year)
+    {
+      snprintf(buf, sizeof(buf), "%" PRIu32 "-01-01T12:00:00", tags->year);
+      if (strptime(buf, "%FT%T", &tm))
+	tags->date_released = (uint32_t)mktime(&tm);
+    }
+}
+
+/* Applies a text value found under the given key of the given map. Returns
+ * -1 if the value means we should leave the file to ffmpeg.
+ */
+static int
+tag_apply(struct native_ctx *ctx, const struct native_key *map, const char *val, size_t len)
+{
+  struct media_file_info *tags = &ctx->tags;
+  char **strval;
+  uint32_t *intval;
+  size_t i;
+
+  switch (map->kind)
+    {
+      case TAG_STR:
+      case TAG_COMMENT:
+	strval = (char **) ((char *) tags + map->offset);
+	tag_set_str(strval, val, len);
+	break;
+
+      case TAG_GENRE:
+	// Numeric ID3v1 style genres need the genre table of ffmpeg
+	for (i = 0; (i < len) && (val[i] >= '0') && (val[i] <= '9'); i++)
+	  ; // Count leading digits
+
+	if ((len > 0) && ((val[0] == '(') || (i == len)))
+	  return -1;
+
+	tag_set_str(&tags->genre, val, len);
+	break;
+
+      case TAG_TRACK:
+	tag_set_pair(&tags->track, &tags->total_tracks, val, len);
+	break;
+
+      case TAG_DISC:
+	tag_set_pair(&tags->disc, &tags->total_discs, val, len);
+	break;
+
+      case TAG_DATE:
+	tag_set_date(tags, val, len);
+	break;
+
+      case TAG_INT:
+	intval = (uint32_t *) ((char *) tags + map->offset);
+	tag_set_int(intval, val, len);
+	break;
+
+      case TAG_PICTURE:
+	tags->artwork = ARTWORK_EMBEDDED;
+	break;
+    }
+
+  return 0;
+}
+
+static const struct native_key *
+key_find(const struct native_key *map, const char *key, size_t keylen)
+{
+  int i;
+
+  for (i = 0; map[i].key; i++)
+    {
+      if ((strlen(map[i].key) == keylen) && (strncasecmp(map[i].key, key, keylen) == 0))
+	return &map[i];
+    }
+
+  return NULL;
+}
+
+
+/* -------------------------------- ID3v2 --------------------------------- */
+
+static const struct native_key id3_map[] =
+  {
+    { "TT2",  TAG_STR,     mfi_offsetof(title) },
+    { "TIT2", TAG_STR,     mfi_offsetof(title) },
+    { "TP1",  TAG_STR,     mfi_offsetof(artist) },
+    { "TPE1", TAG_STR,     mfi_offsetof(artist) },
+    { "TP2",  TAG_STR,     mfi_offsetof(album_artist) },
+    { "TPE2", TAG_STR,     mfi_offsetof(album_artist) },
+    { "TAL",  TAG_STR,     mfi_offsetof(album) },
+    { "TALB", TAG_STR,     mfi_offsetof(album) },
+    { "TCO",  TAG_GENRE,   mfi_offsetof(genre) },
+    { "TCON", TAG_GENRE,   mfi_offsetof(genre) },
+    { "TCM",  TAG_STR,     mfi_offsetof(composer) },
+    { "TCOM", TAG_STR,     mfi_offsetof(composer) },
+    { "TT1",  TAG_STR,     mfi_offsetof(grouping) },
+    { "TIT1", TAG_STR,     mfi_offsetof(grouping) },
+    { "GP1",  TAG_STR,     mfi_offsetof(grouping) },
+    { "GRP1", TAG_STR,     mfi_offsetof(grouping) },
+    { "TRK",  TAG_TRACK,   mfi_offsetof(track) },
+    { "TRCK", TAG_TRACK,   mfi_offsetof(track) },
+    { "TPA",  TAG_DISC,    mfi_offsetof(disc) },
+    { "TPOS", TAG_DISC,    mfi_offsetof(disc) },
+    { "TYE",  TAG_DATE,    mfi_offsetof(date_released) },
+    { "TYER", TAG_DATE,    mfi_offsetof(date_released) },
+    { "TDRC", TAG_DATE,    mfi_offsetof(date_released) },
+    { "TCP",  TAG_INT,     mfi_offsetof(compilation) },
+    { "TCMP", TAG_INT,     mfi_offsetof(compilation) },
+    { "TST",  TAG_STR,     mfi_offsetof(title_sort) },
+    { "TSOT", TAG_STR,     mfi_offsetof(title_sort) },
+    { "XSOT", TAG_STR,     mfi_offsetof(title_sort) },
+    { "TSP",  TAG_STR,     mfi_offsetof(artist_sort) },
+    { "TSOP", TAG_STR,     mfi_offsetof(artist_sort) },
+    { "XSOP", TAG_STR,     mfi_offsetof(artist_sort) },
+    { "TSA",  TAG_STR,     mfi_offsetof(album_sort) },
+    { "TSOA", TAG_STR,     mfi_offsetof(album_sort) },
+    { "XSOA", TAG_STR,     mfi_offsetof(album_sort) },
+    { "TS2",  TAG_STR,     mfi_offsetof(album_artist_sort) },
+    { "TSO2", TAG_STR,     mfi_offsetof(album_artist_sort) },
+    { "TSC",  TAG_STR,     mfi_offsetof(composer_sort) },
+    { "TSOC", TAG_STR,     mfi_offsetof(composer_sort) },
+    { "COM",  TAG_COMMENT, mfi_offsetof(comment) },
+    { "COMM", TAG_COMMENT, mfi_offsetof(comment) },
+    { "PIC",  TAG_PICTURE, mfi_offsetof(artwork) },
+    { "APIC", TAG_PICTURE, mfi_offsetof(artwork) },
+
+    { NULL,   0,           0 }
+  };
+
+/* Converts an ID3v2 string in the given encoding to UTF-8. Returns the
+ * number of input bytes consumed, including the terminator, or -1.
+ */
+static int
+id3_string(uint8_t enc, const uint8_t *in, size_t len, char *out, size_t outlen)
+{
+  size_t i;
+  size_t o;
+  uint32_t c;
+  uint32_t c2;
+  int bigendian;
+
+  o = 0;
+
+  if ((enc == 0) || (enc == 3))
+    {
+      for (i = 0; (i < len) && in[i]; i++)
+	{
+	  if ((enc == 3) || (in[i] < 0x80))
+	    {
+	      if (o + 1 >= outlen)
+		return -1;
+	      out[o++] = in[i];
+	    }
+	  else
+	    {
+	      if (o + 2 >= outlen)
+		return -1;
+	      out[o++] = 0xc0 | (in[i] >> 6);
+	      out[o++] = 0x80 | (in[i] & 0x3f);
+	    }
+	}
+
+      out[o] = '\0';
+      return (i < len) ? i + 1 : i;
+    }
+
+  if ((enc != 1) && (enc != 2))
+    return -1;
+
+  i = 0;
+  bigendian = (enc == 2);
+  if ((enc == 1) && (len >= 2))
+    {
+      if ((in[0] == 0xff) && (in[1] == 0xfe))
+	bigendian = 0;
+      else if ((in[0] == 0xfe) && (in[1] == 0xff))
+	bigendian = 1;
+      else
+	return -1;
+
+      i = 2;
+    }
+
+  for (; i + 1 < len; i += 2)
+    {
+      c = bigendian ? ((in[i] << 8) | in[i + 1]) : ((in[i + 1] << 8) | in[i]);
+      if (c == 0)
+	{
+	  i += 2;
+	  break;
+	}
+
+      if ((c >= 0xd800) && (c < 0xdc00))
+	{
+	  if (i + 3 >= len)
+	    return -1;
+
+	  c2 = bigendian ? ((in[i + 2] << 8) | in[i + 3]) : ((in[i + 3] << 8) | in[i + 2]);
+	  if ((c2 < 0xdc00) || (c2 >= 0xe000))
+	    return -1;
+
+	  c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+	  i += 2;
+	}
+
+      if (o + 4 >= outlen)
+	return -1;
+
+      if (c < 0x80)
+	out[o++] = c;
+      else if (c < 0x800)
+	{
+	  out[o++] = 0xc0 | (c >> 6);
+	  out[o++] = 0x80 | (c & 0x3f);
+	}
+      else if (c < 0x10000)
+	{
+	  out[o++] = 0xe0 | (c >> 12);
+	  out[o++] = 0x80 | ((c >> 6) & 0x3f);
+	  out[o++] = 0x80 | (c & 0x3f);
+	}
+      else
+	{
+	  out[o++] = 0xf0 | (c >> 18);
+	  out[o++] = 0x80 | ((c >> 12) & 0x3f);
+	  out[o++] = 0x80 | ((c >> 6) & 0x3f);
+	  out[o++] = 0x80 | (c & 0x3f);
+	}
+    }
+
+  out[o] = '\0';
+  return (i > len) ? len : i;
+}
+
+static int
+id3_frame(struct native_ctx *ctx, const struct native_key *map, const uint8_t *data, size_t len)
+{
+  char *text;
+  size_t textlen;
+  int n;
+  int ret;
+
+  if (map->kind == TAG_PICTURE)
+    return tag_apply(ctx, map, NULL, 0);
+
+  if (len < 2)
+    return 0;
+
+  textlen = 3 * len + 1;
+  CHECK_NULL(L_SCAN, text = malloc(textlen));
+
+  if (map->kind == TAG_COMMENT)
+    {
+      // Encoding, language, description and then the comment. Like ffmpeg we
+      // only want comments without a description (not e.g. iTunNORM)
+      if (len < 5)
+	{
+	  free(text);
+	  return 0;
+	}
+
+      n = id3_string(data[0], data + 4, len - 4, text, textlen);
+      if ((n < 0) || (text[0] != '\0'))
+	{
+	  free(text);
+	  return 0;
+	}
+
+      n = id3_string(data[0], data + 4 + n, len - 4 - n, text, textlen);
+    }
+  else
+    n = id3_string(data[0], data + 1, len - 1, text, textlen);
+
+  if (n < 0)
+    {
+      free(text);
+      return -1;
+    }
+
+  ret = tag_apply(ctx, map, text, strlen(text));
+
+  free(text);
+  return ret;
+}
+
+/* Reads the ID3v2 tag at the start of the file, if any, and returns the
+ * offset where the audio begins, or -1 if the tag should be left to ffmpeg
+ */
+static int64_t
+id3v2_read(struct native_ctx *ctx)
+{
+  const struct native_key *map;
+  const uint8_t *p;
+  uint8_t version;
+  uint8_t flags;
+  uint32_t tag_size;
+  uint32_t frame_size;
+  uint32_t frame_flags;
+  size_t hdrlen;
+  size_t idlen;
+  int64_t pos;
+  int64_t end;
+  int nframes;
+  int ret;
+
+  p = native_peek(ctx, 0, 10);
+  if (!p)
+    return -1;
+
+  if (memcmp(p, "ID3", 3) != 0)
+    return 0;
+
+  version = p[3];
+  flags = p[5];
+  tag_size = syncsafe32(p + 6);
+
+  // Unsynchronisation would need the whole tag rewritten, and v2.2 had
+  // compression in the header flags
+  if ((version < 2) || (version > 4) || (flags & 0x80) || ((version == 2) && (flags & 0x40)))
+    return -1;
+
+  pos = 10;
+  end = 10 + (int64_t)tag_size;
+
+  if ((version > 2) && (flags & 0x40))
+    {
+      p = native_peek(ctx, pos, 4);
+      if (!p)
+	return -1;
+
+      pos += (version == 3) ? 4 + be32(p) : syncsafe32(p);
+    }
+
+  hdrlen = (version == 2) ? 6 : 10;
+  idlen = (version == 2) ? 3 : 4;
+
+  for (nframes = 0; (pos + (int64_t)hdrlen <= end) && (nframes < NATIVE_MAX_ITEMS); nframes++)
+    {
+      p = native_peek(ctx, pos, hdrlen);
+      if (!p)
+	return -1;
+
+      // Padding
+      if (p[0] == '\0')
+	break;
+
+      if (strspn((const char *)p, "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") < idlen)
+	return -1;
+
+      if (version == 2)
+	{
+	  frame_size = be24(p + 3);
+	  frame_flags = 0;
+	}
+      else
+	{
+	  frame_size = (version == 3) ? be32(p + 4) : syncsafe32(p + 4);
+	  frame_flags = be16(p + 8);
+	}
+
+      if (pos + (int64_t)hdrlen + frame_size > end)
+	return -1;
+
+      map = key_find(id3_map, (const char *)p, idlen);
+      if (map)
+	{
+	  // Compressed, encrypted, unsynchronised or with data length indicator
+	  if ((version == 3) && (frame_flags & 0x00c0))
+	    return -1;
+	  if ((version == 4) && (frame_flags & 0x000f))
+	    return -1;
+
+	  if (map->kind == TAG_PICTURE)
+	    ret = id3_frame(ctx, map, NULL, 0);
+	  else
+	    {
+	      p = native_peek(ctx, pos + hdrlen, frame_size);
+	      if (!p)
+		return -1;
+
+	      ret = id3_frame(ctx, map, p, frame_size);
+	    }
+
+	  if (ret < 0)
+	    return -1;
+	}
+
+      pos += hdrlen + frame_size;
+    }
+
+  // Footer (v2.4)
+  if ((version == 4) && (flags & 0x10))
+    end += 10;
+
+  return end;
+}
+
+
+/* --------------------------------- MP3 ---------------------------------- */
+
+static const uint16_t mp3_bitrates[2][16] =
+  {
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 }, // MPEG 1 layer III
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },     // MPEG 2/2.5 layer III
+  };
+
+static const uint32_t mp3_samplerates[4][3] =
+  {
+    { 11025, 12000, 8000 },  // MPEG 2.5
+    { 0, 0, 0 },             // Reserved
+    { 22050, 24000, 16000 }, // MPEG 2
+    { 44100, 48000, 32000 }, // MPEG 1
+  };
+
+struct mp3_frame
+{
+  int mpeg1;
+  int mono;
+  uint32_t bitrate;
+  uint32_t samplerate;
+  uint32_t samples;
+  uint32_t len;
+};
+
+/* Only layer III, anything else is left to ffmpeg */
+static int
+mp3_header(uint32_t h, struct mp3_frame *frame)
+{
+  uint32_t version;
+  uint32_t bitrate_idx;
+  uint32_t samplerate_idx;
+
+  if ((h & 0xffe00000) != 0xffe00000)
+    return -1;
+
+  version = (h >> 19) & 3;
+  bitrate_idx = (h >> 12) & 0xf;
+  samplerate_idx = (h >> 10) & 3;
+
+  if ((version == 1) || (((h >> 17) & 3) != 1) || (bitrate_idx == 0) || (bitrate_idx == 15) || (samplerate_idx == 3))
+    return -1;
+
+  frame->mpeg1 = (version == 3);
+  frame->mono = (((h >> 6) & 3) == 3);
+  frame->bitrate = mp3_bitrates[frame->mpeg1 ? 0 : 1][bitrate_idx];
+  frame->samplerate = mp3_samplerates[version][samplerate_idx];
+  frame->samples = frame->mpeg1 ? 1152 : 576;
+  frame->len = (frame->mpeg1 ? 144000 : 72000) * frame->bitrate / frame->samplerate + ((h >> 9) & 1);
+
+  return 0;
+}
+
+static int
+mp3_read(struct native_ctx *ctx, int64_t audio_start)
+{
+  struct media_file_info *tags = &ctx->tags;
+  struct mp3_frame frame;
+  struct mp3_frame next;
+  const uint8_t *p;
+  uint32_t xing_offset;
+  uint32_t xing_flags;
+  uint32_t nframes;
+  uint32_t nbytes;
+  int64_t audio_end;
+  int64_t pos;
+  int64_t i;
+
+  audio_end = ctx->size;
+
+  // Other tags at the end are read by ffmpeg, so only accept them if ID3v2
+  // gave us all we need
+  p = native_peek(ctx, ctx->size - 128, 128);
+  if (p && (memcmp(p, "TAG", 3) == 0))
+    {
+      if (!tags->title)
+	return -1;
+
+      audio_end -= 128;
+    }
+
+  p = native_peek(ctx, audio_end - 32, 8);
+  if (p && (memcmp(p, "APETAGEX", 8) == 0))
+    return -1;
+
+  // Find the first frame, there might be some padding after the tag
+  p = native_peek(ctx, audio_start, 4);
+  for (i = 0; p && (i < NATIVE_WINDOW); i++)
+    {
+      p = native_peek(ctx, audio_start + i, 4);
+      if (p && (mp3_header(be32(p), &frame) == 0))
+	break;
+    }
+
+  if (!p || (i == NATIVE_WINDOW))
+    return -1;
+
+  pos = audio_start + i;
+
+  // Must be followed by another frame, or it was just a false sync
+  p = native_peek(ctx, pos + frame.len, 4);
+  if (!p || (mp3_header(be32(p), &next) < 0) || (next.samplerate != frame.samplerate))
+    return -1;
+
+  nframes = 0;
+  nbytes = 0;
+
+  xing_offset = 4 + (frame.mpeg1 ? (frame.mono ? 17 : 32) : (frame.mono ? 9 : 17));
+  p = native_peek(ctx, pos + xing_offset, 16);
+  if (p && ((memcmp(p, "Xing", 4) == 0) || (memcmp(p, "Info", 4) == 0)))
+    {
+      xing_flags = be32(p + 4);
+      if (xing_flags & 0x1)
+	nframes = be32(p + 8);
+      if (xing_flags & 0x2)
+	nbytes = be32(p + ((xing_flags & 0x1) ? 12 : 8));
+    }
+  else
+    {
+      p = native_peek(ctx, pos + 4 + 32, 18);
+      if (p && (memcmp(p, "VBRI", 4) == 0))
+	{
+	  nbytes = be32(p + 10);
+	  nframes = be32(p + 14);
+	}
+    }
+
+  if (nframes > 0)
+    {
+      tags->song_length = (uint64_t)nframes * frame.samples * 1000 / frame.samplerate;
+      if (nbytes == 0)
+	nbytes = audio_end - pos;
+      if (tags->song_length > 0)
+	tags->bitrate = (uint64_t)nbytes * 8 / tags->song_length;
+    }
+  else
+    {
+      tags->bitrate = frame.bitrate;
+      tags->song_length = (uint64_t)(audio_end - pos) * 8 / frame.bitrate;
+    }
+
+  tags->samplerate = frame.samplerate;
+  tags->bits_per_sample = 32; // What the ffmpeg decoder (float planar) reports
+
+  tags->type = strdup("mp3");
+  tags->codectype = strdup("mpeg");
+  tags->description = strdup("MPEG audio file");
+
+  return 0;
+}
+
+
+/* ------------------------------ FLAC/Vorbis ----------------------------- */
+
+static const struct native_key vorbis_map[] =
+  {
+    { "TITLE",                  TAG_STR,     mfi_offsetof(title) },
+    { "ARTIST",                 TAG_STR,     mfi_offsetof(artist) },
+    { "ALBUMARTIST",            TAG_STR,     mfi_offsetof(album_artist) },
+    { "ALBUM ARTIST",           TAG_STR,     mfi_offsetof(album_artist) },
+    { "ALBUM_ARTIST",           TAG_STR,     mfi_offsetof(album_artist) },
+    { "ALBUM",                  TAG_STR,     mfi_offsetof(album) },
+    { "GENRE",                  TAG_GENRE,   mfi_offsetof(genre) },
+    { "COMPOSER",               TAG_STR,     mfi_offsetof(composer) },
+    { "GROUPING",               TAG_STR,     mfi_offsetof(grouping) },
+    { "COMMENT",                TAG_COMMENT, mfi_offsetof(comment) },
+    { "DESCRIPTION",            TAG_COMMENT, mfi_offsetof(comment) },
+    { "TRACKNUMBER",            TAG_TRACK,   mfi_offsetof(track) },
+    { "TRACKTOTAL",             TAG_INT,     mfi_offsetof(total_tracks) },
+    { "TOTALTRACKS",            TAG_INT,     mfi_offsetof(total_tracks) },
+    { "DISCNUMBER",             TAG_DISC,    mfi_offsetof(disc) },
+    { "DISCTOTAL",              TAG_INT,     mfi_offsetof(total_discs) },
+    { "TOTALDISCS",             TAG_INT,     mfi_offsetof(total_discs) },
+    { "DATE",                   TAG_DATE,    mfi_offsetof(date_released) },
+    { "YEAR",                   TAG_DATE,    mfi_offsetof(date_released) },
+    { "COMPILATION",            TAG_INT,     mfi_offsetof(compilation) },
+    { "TITLESORT",              TAG_STR,     mfi_offsetof(title_sort) },
+    { "ARTISTSORT",             TAG_STR,     mfi_offsetof(artist_sort) },
+    { "ALBUMSORT",              TAG_STR,     mfi_offsetof(album_sort) },
+    { "ALBUMARTISTSORT",        TAG_STR,     mfi_offsetof(album_artist_sort) },
+    { "COMPOSERSORT",           TAG_STR,     mfi_offsetof(composer_sort) },
+    { "METADATA_BLOCK_PICTURE", TAG_PICTURE, mfi_offsetof(artwork) },
+
+    { NULL,                     0,           0 }
+  };
+
+static int
+vorbis_comments(struct native_ctx *ctx, const uint8_t *p, size_t len)
+{
+  const struct native_key *map;
+  const char *entry;
+  const char *eq;
+  uint32_t count;
+  uint32_t entrylen;
+  uint32_t i;
+  size_t pos;
+
+  if (len < 8)
+    return -1;
+
+  pos = 4 + le32(p);
+  if (pos + 4 > len)
+    return -1;
+
+  count = le32(p + pos);
+  pos += 4;
+
+  for (i = 0; (i < count) && (i < NATIVE_MAX_ITEMS); i++)
+    {
+      if (pos + 4 > len)
+	return -1;
+
+      entrylen = le32(p + pos);
+      pos += 4;
+      if (entrylen > len - pos)
+	return -1;
+
+      entry = (const char *)p + pos;
+      pos += entrylen;
+
+      eq = memchr(entry, '=', entrylen);
+      if (!eq)
+	continue;
+
+      map = key_find(vorbis_map, entry, eq - entry);
+      if (!map)
+	continue;
+
+      if (tag_apply(ctx, map, eq + 1, entrylen - (eq + 1 - entry)) < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+static int
+flac_read(struct native_ctx *ctx)
+{
+  struct media_file_info *tags = &ctx->tags;
+  const uint8_t *p;
+  uint64_t total_samples;
+  uint32_t samplerate;
+  uint32_t bps;
+  uint32_t blocklen;
+  uint8_t blocktype;
+  int have_streaminfo;
+  int last;
+  int64_t pos;
+  int n;
+
+  have_streaminfo = 0;
+  total_samples = 0;
+  samplerate = 0;
+  bps = 0;
+
+  pos = 4;
+  for (n = 0, last = 0; !last && (n < NATIVE_MAX_ITEMS); n++)
+    {
+      p = native_peek(ctx, pos, 4);
+      if (!p)
+	return -1;
+
+      last = p[0] & 0x80;
+      blocktype = p[0] & 0x7f;
+      blocklen = be24(p + 1);
+      pos += 4;
+
+      if ((blocktype == 0) && (blocklen >= 18))
+	{
+	  p = native_peek(ctx, pos, 18);
+	  if (!p)
+	    return -1;
+
+	  samplerate = (p[10] << 12) | (p[11] << 4) | (p[12] >> 4);
+	  bps = (((p[12] & 0x1) << 4) | (p[13] >> 4)) + 1;
+	  total_samples = ((uint64_t)(p[13] & 0xf) << 32) | be32(p + 14);
+	  have_streaminfo = 1;
+	}
+      else if (blocktype == 4)
+	{
+	  p = native_peek(ctx, pos, blocklen);
+	  if (!p || (vorbis_comments(ctx, p, blocklen) < 0))
+	    return -1;
+	}
+      else if (blocktype == 6)
+	tags->artwork = ARTWORK_EMBEDDED;
+      else if (blocktype == 127)
+	return -1;
+
+      pos += blocklen;
+    }
+
+  if (!have_streaminfo || (samplerate == 0))
+    return -1;
+
+  if (total_samples > 0)
+    tags->song_length = total_samples * 1000 / samplerate;
+  if (tags->song_length > 0)
+    tags->bitrate = (uint64_t)ctx->size * 8 / tags->song_length;
+
+  tags->samplerate = samplerate;
+  tags->bits_per_sample = (bps <= 16) ? 16 : 32; // Decoder outputs s16 or s32
+
+  tags->type = strdup("flac");
+  tags->codectype = strdup("flac");
+  tags->description = strdup("FLAC audio file");
+
+  return 0;
+}
+
+
+/* --------------------------------- MP4 ---------------------------------- */
+
+static const struct native_key mp4_map[] =
+  {
+    { "\xa9nam", TAG_STR,     mfi_offsetof(title) },
+    { "\xa9""ART", TAG_STR,   mfi_offsetof(artist) },
+    { "aART",    TAG_STR,     mfi_offsetof(album_artist) },
+    { "\xa9""alb", TAG_STR,   mfi_offsetof(album) },
+    { "\xa9gen", TAG_GENRE,   mfi_offsetof(genre) },
+    { "\xa9wrt", TAG_STR,     mfi_offsetof(composer) },
+    { "\xa9grp", TAG_STR,     mfi_offsetof(grouping) },
+    { "\xa9""cmt", TAG_COMMENT, mfi_offsetof(comment) },
+    { "desc",    TAG_COMMENT, mfi_offsetof(comment) },
+    { "\xa9""day", TAG_DATE,  mfi_offsetof(date_released) },
+    { "trkn",    TAG_TRACK,   mfi_offsetof(track) },
+    { "disk",    TAG_DISC,    mfi_offsetof(disc) },
+    { "cpil",    TAG_INT,     mfi_offsetof(compilation) },
+    { "sonm",    TAG_STR,     mfi_offsetof(title_sort) },
+    { "soar",    TAG_STR,     mfi_offsetof(artist_sort) },
+    { "soal",    TAG_STR,     mfi_offsetof(album_sort) },
+    { "soaa",    TAG_STR,     mfi_offsetof(album_artist_sort) },
+    { "soco",    TAG_STR,     mfi_offsetof(composer_sort) },
+    { "covr",    TAG_PICTURE, mfi_offsetof(artwork) },
+    { "gnre",    TAG_GENRE,   mfi_offsetof(genre) },
+
+    { NULL,      0,           0 }
+  };
+
+struct mp4_info
+{
+  uint32_t timescale;
+  uint64_t duration;
+
+  uint32_t codec;       // Sample entry format of the first sound track
+  uint32_t samplerate;
+  uint32_t bits;
+  uint32_t avg_bitrate;
+  int has_video;
+};
+
+#define MP4_TYPE(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+/* Reads an atom header at pos, returns the header length or -1 */
+static int
+mp4_atom(struct native_ctx *ctx, int64_t pos, int64_t end, uint32_t *type, int64_t *size)
+{
+  const uint8_t *p;
+  int hdrlen;
+
+  p = native_peek(ctx, pos, 8);
+  if (!p || (pos + 8 > end))
+    return -1;
+
+  *type = be32(p + 4);
+  *size = be32(p);
+  hdrlen = 8;
+
+  if (*size == 1)
+    {
+      p = native_peek(ctx, pos + 8, 8);
+      if (!p)
+	return -1;
+
+      *size = be64(p);
+      hdrlen = 16;
+    }
+  else if (*size == 0)
+    *size = end - pos;
+
+  if ((*size < hdrlen) || (pos + *size > end))
+    return -1;
+
+  return hdrlen;
+}
+
+/* Length of an MPEG-4 descriptor, stored in 7 bit groups */
+static int
+mp4_desc_len(const uint8_t *p, size_t avail, uint32_t *len)
+{
+  int i;
+
+  *len = 0;
+  for (i = 0; (i < 4) && (i < avail); i++)
+    {
+      *len = (*len << 7) | (p[i] & 0x7f);
+      if (!(p[i] & 0x80))
+	return i + 1;
+    }
+
+  return -1;
+}
+
+/* The esds of an mp4a sample entry, which tells if it is really AAC */
+static int
+mp4_esds(struct mp4_info *info, const uint8_t *p, size_t len)
+{
+  uint32_t dlen;
+  uint8_t flags;
+  size_t pos;
+  int n;
+
+  pos = 4; // Version and flags
+  if ((pos + 1 > len) || (p[pos] != 0x03))
+    return -1;
+
+  pos++;
+  n = mp4_desc_len(p + pos, len - pos, &dlen);
+  if (n < 0)
+    return -1;
+
+  pos += n;
+  if (pos + 3 > len)
+    return -1;
+
+  flags = p[pos + 2];
+  pos += 3;
+  if (flags & 0x80)
+    pos += 2;
+  if ((flags & 0x40) && (pos < len))
+    pos += 1 + p[pos];
+  if (flags & 0x20)
+    pos += 2;
+
+  if ((pos + 1 > len) || (p[pos] != 0x04))
+    return -1;
+
+  pos++;
+  n = mp4_desc_len(p + pos, len - pos, &dlen);
+  if (n < 0)
+    return -1;
+
+  pos += n;
+  if (pos + 13 > len)
+    return -1;
+
+  // MPEG-4 audio or MPEG-2 AAC, otherwise e.g. MP3 in MP4
+  if ((p[pos] != 0x40) && (p[pos] != 0x66) && (p[pos] != 0x67) && (p[pos] != 0x68))
+    return -1;
+
+  info->avg_bitrate = be32(p + pos + 9);
+
+  return 0;
+}
+
+static int
+mp4_stsd(struct native_ctx *ctx, struct mp4_info *info, int64_t pos, int64_t end)
+{
+  const uint8_t *p;
+  uint32_t type;
+  int64_t size;
+  int64_t entry;
+  int64_t child;
+  int hdrlen;
+
+  // Version/flags, entry count, then the first sample entry
+  entry = pos + 8;
+
+  hdrlen = mp4_atom(ctx, entry, end, &type, &size);
+  if ((hdrlen != 8) || (size < 36))
+    return -1;
+
+  if ((type != MP4_TYPE('m', 'p', '4', 'a')) && (type != MP4_TYPE('a', 'l', 'a', 'c')))
+    return -1;
+
+  p = native_peek(ctx, entry, 36);
+  if (!p)
+    return -1;
+
+  // Only version 0 sound sample entries
+  if (be16(p + 16) != 0)
+    return -1;
+
+  info->codec = type;
+  info->bits = be16(p + 26);
+  info->samplerate = be32(p + 32) >> 16;
+
+  child = entry + 36;
+
+  hdrlen = mp4_atom(ctx, child, entry + size, &type, &size);
+  if (hdrlen < 0)
+    return -1;
+
+  p = native_peek(ctx, child + hdrlen, size - hdrlen);
+  if (!p)
+    return -1;
+
+  if (info->codec == MP4_TYPE('m', 'p', '4', 'a'))
+    {
+      if ((type != MP4_TYPE('e', 's', 'd', 's')) || (mp4_esds(info, p, size - hdrlen) < 0))
+	return -1;
+    }
+  else
+    {
+      // ALACSpecificConfig after version/flags
+      if ((type != MP4_TYPE('a', 'l', 'a', 'c')) || (size - hdrlen < 28))
+	return -1;
+
+      info->bits = p[4 + 5];
+      info->avg_bitrate = be32(p + 4 + 16);
+      info->samplerate = be32(p + 4 + 20);
+    }
+
+  return 0;
+}
+
+static int
+mp4_ilst(struct native_ctx *ctx, int64_t pos, int64_t end)
+{
+  const struct native_key *map;
+  const uint8_t *p;
+  uint32_t type;
+  uint32_t datatype;
+  uint32_t val;
+  int64_t size;
+  int64_t datasize;
+  int hdrlen;
+  char key[4];
+  char buf[16];
+  char *text;
+  int n;
+  int ret;
+
+  for (n = 0; (pos < end) && (n < NATIVE_MAX_ITEMS); n++, pos += size)
+    {
+      hdrlen = mp4_atom(ctx, pos, end, &type, &size);
+      if (hdrlen < 0)
+	return -1;
+
+      key[0] = type >> 24;
+      key[1] = type >> 16;
+      key[2] = type >> 8;
+      key[3] = type;
+
+      map = key_find(mp4_map, key, 4);
+      if (!map)
+	continue;
+
+      // The value is in a data atom: type, locale and the payload
+      hdrlen = mp4_atom(ctx, pos + 8, pos + size, &type, &datasize);
+      if ((hdrlen != 8) || (type != MP4_TYPE('d', 'a', 't', 'a')) || (datasize < 16))
+	continue;
+
+      p = native_peek(ctx, pos + 16, 8);
+      if (!p)
+	return -1;
+
+      datatype = be32(p) & 0xffffff;
+
+      if (map->kind == TAG_PICTURE)
+	{
+	  tag_apply(ctx, map, NULL, 0);
+	  continue;
+	}
+
+      p = native_peek(ctx, pos + 24, datasize - 16);
+      if (!p)
+	return -1;
+
+      if ((map->kind == TAG_TRACK) || (map->kind == TAG_DISC))
+	{
+	  if (datasize - 16 < 6)
+	    continue;
+
+	  snprintf(buf, sizeof(buf), "%" PRIu32 "/%" PRIu32, be16(p + 2), be16(p + 4));
+	  ret = tag_apply(ctx, map, buf, strlen(buf));
+	}
+      else if ((map->kind == TAG_GENRE) && (datatype != 1))
+	return -1; // gnre is an ID3v1 genre index
+      else if (map->kind == TAG_INT)
+	{
+	  if (datasize - 16 < 1)
+	    continue;
+
+	  val = p[0];
+	  snprintf(buf, sizeof(buf), "%" PRIu32, val);
+	  ret = tag_apply(ctx, map, buf, strlen(buf));
+	}
+      else if (datatype == 1)
+	{
+	  CHECK_NULL(L_SCAN, text = strndup((const char *)p, datasize - 16));
+	  ret = tag_apply(ctx, map, text, strlen(text));
+	  free(text);
+	}
+      else
+	continue;
+
+      if (ret < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+/* Walks the boxes of moov that we are interested in */
+static int
+mp4_walk(struct native_ctx *ctx, struct mp4_info *info, int64_t pos, int64_t end, int depth, uint32_t handler)
+{
+  const uint8_t *p;
+  uint32_t type;
+  int64_t size;
+  int64_t payload;
+  int hdrlen;
+  int n;
+
+  if (depth > NATIVE_MAX_DEPTH)
+    return -1;
+
+  for (n = 0; (pos < end) && (n < NATIVE_MAX_ITEMS); n++, pos += size)
+    {
+      hdrlen = mp4_atom(ctx, pos, end, &type, &size);
+      if (hdrlen < 0)
+	return -1;
+
+      payload = pos + hdrlen;
+
+      switch (type)
+	{
+	  case MP4_TYPE('m', 'v', 'h', 'd'):
+	    p = native_peek(ctx, payload, 32);
+	    if (!p)
+	      return -1;
+
+	    if (p[0] == 1)
+	      {
+		info->timescale = be32(p + 20);
+		info->duration = be64(p + 24);
+	      }
+	    else
+	      {
+		info->timescale = be32(p + 12);
+		info->duration = be32(p + 16);
+	      }
+	    break;
+
+	  case MP4_TYPE('t', 'r', 'a', 'k'):
+	    if (mp4_walk(ctx, info, payload, pos + size, depth + 1, 0) < 0)
+	      return -1;
+	    break;
+
+	  case MP4_TYPE('m', 'd', 'i', 'a'):
+	    // Need the handler from hdlr before descending to the sample entry
+	    handler = 0;
+	    {
+	      int64_t cpos;
+	      int64_t csize;
+	      uint32_t ctype;
+	      int chdr;
+
+	      for (cpos = payload; cpos < pos + size; cpos += csize)
+		{
+		  chdr = mp4_atom(ctx, cpos, pos + size, &ctype, &csize);
+		  if (chdr < 0)
+		    return -1;
+
+		  if (ctype == MP4_TYPE('h', 'd', 'l', 'r'))
+		    {
+		      p = native_peek(ctx, cpos + chdr, 12);
+		      if (!p)
+			return -1;
+
+		      handler = be32(p + 8);
+		      break;
+		    }
+		}
+	    }
+
+	    if (handler == MP4_TYPE('v', 'i', 'd', 'e'))
+	      info->has_video = 1;
+	    else if ((handler == MP4_TYPE('s', 'o', 'u', 'n')) && !info->codec)
+	      {
+		if (mp4_walk(ctx, info, payload, pos + size, depth + 1, handler) < 0)
+		  return -1;
+	      }
+	    break;
+
+	  case MP4_TYPE('m', 'i', 'n', 'f'):
+	  case MP4_TYPE('s', 't', 'b', 'l'):
+	  case MP4_TYPE('u', 'd', 't', 'a'):
+	    if (mp4_walk(ctx, info, payload, pos + size, depth + 1, handler) < 0)
+	      return -1;
+	    break;
+
+	  case MP4_TYPE('s', 't', 's', 'd'):
+	    if ((handler == MP4_TYPE('s', 'o', 'u', 'n')) && (mp4_stsd(ctx, info, payload, pos + size) < 0))
+	      return -1;
+	    break;
+
+	  case MP4_TYPE('m', 'e', 't', 'a'):
+	    // Full atom, skip version and flags
+	    if (mp4_walk(ctx, info, payload + 4, pos + size, depth + 1, handler) < 0)
+	      return -1;
+	    break;
+
+	  case MP4_TYPE('i', 'l', 's', 't'):
+	    if (mp4_ilst(ctx, payload, pos + size) < 0)
+	      return -1;
+	    break;
+
+	  default:
+	    break;
+	}
+    }
+
+  return 0;
+}
+
+static int
+mp4_read(struct native_ctx *ctx)
+{
+  struct media_file_info *tags = &ctx->tags;
+  struct mp4_info info;
+  uint32_t type;
+  int64_t size;
+  int64_t pos;
+  int hdrlen;
+  int n;
+
+  memset(&info, 0, sizeof(struct mp4_info));
+
+  // The moov atom may be at the end of the file, after mdat
+  for (pos = 0, n = 0; (pos < ctx->size) && (n < NATIVE_MAX_ITEMS); pos += size, n++)
+    {
+      hdrlen = mp4_atom(ctx, pos, ctx->size, &type, &size);
+      if (hdrlen < 0)
+	return -1;
+
+      if ((n == 0) && (type != MP4_TYPE('f', 't', 'y', 'p')))
+	return -1;
+
+      if (type == MP4_TYPE('m', 'o', 'o', 'v'))
+	break;
+    }
+
+  if ((pos >= ctx->size) || (n == NATIVE_MAX_ITEMS))
+    return -1;
+
+  if (mp4_walk(ctx, &info, pos + hdrlen, pos + size, 0, 0) < 0)
+    return -1;
+
+  // Video is left to ffmpeg, it decides if it is a movie, TV show etc.
+  if (info.has_video || !info.codec || !info.timescale || !info.samplerate)
+    return -1;
+
+  tags->song_length = info.duration * 1000 / info.timescale;
+  if (info.avg_bitrate > 0)
+    tags->bitrate = info.avg_bitrate / 1000;
+  else if (tags->song_length > 0)
+    tags->bitrate = (uint64_t)ctx->size * 8 / tags->song_length;
+
+  tags->samplerate = info.samplerate;
+
+  tags->type = strdup("m4a");
+  if (info.codec == MP4_TYPE('a', 'l', 'a', 'c'))
+    {
+      tags->codectype = strdup("alac");
+      tags->description = strdup("Apple Lossless audio file");
+      tags->bits_per_sample = (info.bits <= 16) ? 16 : 32;
+    }
+  else
+    {
+      tags->codectype = strdup("mp4a");
+      tags->description = strdup("AAC audio file");
+      tags->bits_per_sample = 32; // Float planar from the ffmpeg decoder
+    }
+
+  return 0;
+}
+
+
+/* ------------------------------ Interface ------------------------------- */
+
+/*
+ * Fills the metadata of the given file into the given mfi, like
+ * scan_metadata_ffmpeg(), but without ffmpeg for the formats we can read
+ * natively. Returns -1 without touching the mfi if the file should be
+ * scanned with ffmpeg instead.
+ */
+int
+scan_metadata_native(const char *file, struct media_file_info *mfi)
+{
+  struct native_ctx ctx;
+  const uint8_t *p;
+  char **src_str;
+  char **dst_str;
+  uint32_t *src_int;
+  uint32_t *dst_int;
+  int64_t audio_start;
+  int i;
+  int ret;
+
+  if (mfi->data_kind != DATA_KIND_FILE)
+    return -1;
+
+  memset(&ctx, 0, sizeof(struct native_ctx));
+
+  ctx.path = file;
+  ctx.size = mfi->file_size;
+
+  ctx.fd = open(file, O_RDONLY);
+  if (ctx.fd < 0)
+    return -1;
+
+  if (ctx.size <= 0)
+    ctx.size = lseek(ctx.fd, 0, SEEK_END);
+
+  ret = -1;
+
+  p = native_peek(&ctx, 0, 12);
+  if (!p)
+    goto out;
+
+  if (memcmp(p, "fLaC", 4) == 0)
+    ret = flac_read(&ctx);
+  else if (memcmp(p + 4, "ftyp", 4) == 0)
+    ret = mp4_read(&ctx);
+  else if ((memcmp(p, "ID3", 3) == 0) || ((p[0] == 0xff) && ((p[1] & 0xe0) == 0xe0)))
+    {
+      audio_start = id3v2_read(&ctx);
+      if (audio_start >= 0)
+	ret = mp3_read(&ctx, audio_start);
+    }
+
+ out:
+  close(ctx.fd);
+  free(ctx.win);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_DBG, L_SCAN, "No native metadata reader for '%s', using ffmpeg\n", file);
+
+      free_mfi(&ctx.tags, 1);
+      return -1;
+    }
+
+  for (i = 0; i < (sizeof(native_str_fields) / sizeof(native_str_fields[0])); i++)
+    {
+      src_str = (char **) ((char *) &ctx.tags + native_str_fields[i]);
+      dst_str = (char **) ((char *) mfi + native_str_fields[i]);
+
+      if (*src_str && !*dst_str)
+	{
+	  *dst_str = *src_str;
+	  *src_str = NULL;
+	}
+    }
+
+  for (i = 0; i < (sizeof(native_int_fields) / sizeof(native_int_fields[0])); i++)
+    {
+      src_int = (uint32_t *) ((char *) &ctx.tags + native_int_fields[i]);
+      dst_int = (uint32_t *) ((char *) mfi + native_int_fields[i]);
+
+      if (*src_int && !*dst_int)
+	*dst_int = *src_int;
+    }
+
+  if (ctx.tags.artwork)
+    mfi->artwork = ctx.tags.artwork;
+
+  free_mfi(&ctx.tags, 1);
+
+  DPRINTF(E_DBG, L_SCAN, "Native metadata reader: '%s' is %s, duration %d ms, bitrate %d kbps\n",
+	  file, mfi->description, mfi->song_length, mfi->bitrate);
+
+  /* Just in case there's no title set ... */
+  if (mfi->title == NULL)
+    mfi->title = strdup(mfi->fname);
+
+  return 0;
+}
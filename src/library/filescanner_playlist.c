@@ -42,6 +42,140 @@
 #define PLAYLIST_PLS 1
 #define PLAYLIST_M3U 2
 
+/* Transient index of the library by case folded file name, chained through
+ * findex_next[] with -1 as the end marker
+ */
+static struct db_file_stamp *findex_files;
+static int findex_nfiles;
+static int *findex_next;
+static int *findex_buckets;
+static uint32_t findex_mask;
+
+
+static uint32_t
+file_index_hash(const char *fname)
+{
+  char buf[PATH_MAX];
+  size_t len;
+
+  // ASCII only case folding, same as COLLATE NOCASE
+  for (len = 0; fname[len] && (len < sizeof(buf)); len++)
+    buf[len] = ((fname[len] >= 'A') && (fname[len] <= 'Z')) ? fname[len] + ('a' - 'A') : fname[len];
+
+  return djb_hash(buf, len);
+}
+
+void
+file_index_free(void)
+{
+  db_file_stamps_free(findex_files, findex_nfiles);
+  free(findex_next);
+  free(findex_buckets);
+
+  findex_files = NULL;
+  findex_nfiles = 0;
+  findex_next = NULL;
+  findex_buckets = NULL;
+  findex_mask = 0;
+}
+
+void
+file_index_build(void)
+{
+  uint32_t nbuckets;
+  uint32_t i;
+  int n;
+
+  file_index_free();
+
+  n = db_file_stamps_all(&findex_files);
+  if (n <= 0)
+    return;
+
+  findex_nfiles = n;
+
+  for (nbuckets = 1024; nbuckets < findex_nfiles; nbuckets <<= 1)
+    ;
+
+  findex_mask = nbuckets - 1;
+
+  CHECK_NULL(L_SCAN, findex_buckets = malloc(nbuckets * sizeof(int)));
+  CHECK_NULL(L_SCAN, findex_next = malloc(findex_nfiles * sizeof(int)));
+
+  for (i = 0; i < nbuckets; i++)
+    findex_buckets[i] = -1;
+
+  for (n = 0; n < findex_nfiles; n++)
+    {
+      i = file_index_hash(filename_from_path(findex_files[n].path)) & findex_mask;
+      findex_next[n] = findex_buckets[i];
+      findex_buckets[i] = n;
+    }
+
+  DPRINTF(E_DBG, L_SCAN, "Built playlist lookup index of %d files\n", findex_nfiles);
+}
+
+int
+file_index_find(const char *path)
+{
+  const char *fname;
+  const char *dbpath;
+  const char *a;
+  const char *b;
+  int candidates;
+  int winner;
+  int score;
+  int first;
+  int i;
+  int n;
+
+  if (!findex_buckets)
+    return 0;
+
+  fname = filename_from_path(path);
+  first = findex_buckets[file_index_hash(fname) & findex_mask];
+
+  candidates = 0;
+  winner = -1;
+  for (n = first; n >= 0; n = findex_next[n])
+    {
+      if (strcasecmp(filename_from_path(findex_files[n].path), fname) != 0)
+	continue;
+
+      candidates++;
+      winner = findex_files[n].id;
+    }
+
+  if (candidates <= 1)
+    return winner;
+
+  // Same scoring as process_regular_file(), the file sharing most parent
+  // directories with the path wins, a draw means no match
+  winner = -1;
+  score = 0;
+  for (n = first; n >= 0; n = findex_next[n])
+    {
+      dbpath = findex_files[n].path;
+      if (strcasecmp(filename_from_path(dbpath), fname) != 0)
+	continue;
+
+      for (i = 0, a = NULL, b = NULL; (parent_dir(&a, path) == 0) && (parent_dir(&b, dbpath) == 0) && (strcasecmp(a, b) == 0); i++)
+	;
+
+      DPRINTF(E_SPAM, L_SCAN, "Comparison of '%s' and '%s' gave score %d\n", dbpath, path, i);
+
+      if (i > score)
+	{
+	  winner = findex_files[n].id;
+	  score = i;
+	}
+      else if (i == score)
+	winner = -1;
+    }
+
+  return winner;
+}
+
 /* Get metadata from the EXTINF tag */
 static int
 extinf_get(char *string, struct media_file_info *mfi, int *extinf)
@@ -135,6 +269,21 @@ process_regular_file(int pl_id, char *path)
 	path[i] = '/';
     }
 
+  // During bulk scans the in-memory index saves us the queries below
+  ret = file_index_find(path);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "No file in the library matches playlist entry '%s'\n", path);
+      return -1;
+    }
+  else if (ret > 0)
+    {
+      DPRINTF(E_DBG, L_SCAN, "Adding file id %d to playlist %d\n", ret, pl_id);
+
+      db_pl_add_item_byid(pl_id, ret);
+      return 0;
+    }
+
   ret = db_snprintf(filter, sizeof(filter), "f.fname = '%q' COLLATE NOCASE", filename_from_path(path));
   if (ret < 0)
     {
@@ -301,7 +450,7 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
       return;
     }
 
-  db_transaction_begin();
+  library_scan_session_begin();
 
   extinf = 0;
   memset(&mfi, 0, sizeof(struct media_file_info));
@@ -346,12 +495,8 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
 	ret = process_regular_file(pl_id, path);
 
       ntracks++;
-      if (ntracks % 200 == 0)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Processed %d items...\n", ntracks);
-	  db_transaction_end();
-	  db_transaction_begin();
-	}
+      if (library_scan_session_step())
+	DPRINTF(E_LOG, L_SCAN, "Processed %d items...\n", ntracks);
 
       if (ret == 0)
 	nadded++;
@@ -361,7 +506,7 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
       free_mfi(&mfi, 1);
     }
 
-  db_transaction_end();
+  library_scan_session_end();
 
   /* We had some extinf that we never got to use, free it now */
   if (extinf)
@@ -18,44 +18,122 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
+#include <event2/event.h>
+
+#include "logger.h"
+#include "misc.h"
 #include "listener.h"
 
+/* Notifications for async listeners are collected for this long */
+#define LISTENER_COALESCE_USEC 50000
+
 struct listener
 {
   notify notify_cb;
   short events;
+
+  // Only for listeners with their own event base
+  struct event *deliverev;
+  short pending;
+  uint64_t pending_since; // usec, monotonic
+
+  uint64_t notifications;
+  uint64_t deliveries;
+  uint64_t latency_total; // usec
+  uint64_t latency_max;   // usec
+
   struct listener *next;
 };
 
 struct listener *listener_list = NULL;
 
+// Subsystems start in parallel, so adding and removing is serialized. The list
+// head is published atomically, so listener_notify() doesn't need the lock.
+static pthread_mutex_t listener_lck = PTHREAD_MUTEX_INITIALIZER;
+
+static struct timeval listener_coalesce_tv = { 0, LISTENER_COALESCE_USEC };
+
+
+static uint64_t
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Thread: the listener's */
+static void
+deliver_cb(int fd, short what, void *arg)
+{
+  struct listener *listener = arg;
+  uint64_t since;
+  uint64_t latency;
+  short mask;
+
+  since = __atomic_load_n(&listener->pending_since, __ATOMIC_ACQUIRE);
+  mask = __atomic_exchange_n(&listener->pending, 0, __ATOMIC_ACQ_REL);
+  if (!mask)
+    return;
+
+  latency = now_usec() - since;
+
+  listener->deliveries++;
+  listener->latency_total += latency;
+  if (latency > listener->latency_max)
+    listener->latency_max = latency;
+
+  listener->notify_cb(mask);
+}
+
 int
-listener_add(notify notify_cb, short events)
+listener_add(notify notify_cb, short events, struct event_base *evbase)
 {
   struct listener *listener;
 
-  listener = (struct listener*)malloc(sizeof(struct listener));
+  listener = (struct listener*)calloc(1, sizeof(struct listener));
   if (!listener)
     {
       return -1;
     }
+
+  if (evbase)
+    {
+      listener->deliverev = evtimer_new(evbase, deliver_cb, listener);
+      if (!listener->deliverev)
+	{
+	  free(listener);
+	  return -1;
+	}
+    }
+
   listener->notify_cb = notify_cb;
   listener->events = events;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&listener_lck));
   listener->next = listener_list;
-  listener_list = listener;
+  __atomic_store_n(&listener_list, listener, __ATOMIC_RELEASE);
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&listener_lck));
 
   return 0;
 }
-
 int
 listener_remove(notify notify_cb)
 {
   struct listener *listener;
   struct listener *prev;
 
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&listener_lck));
+
   prev = NULL;
   for (listener = listener_list; listener; listener = listener->next)
     {
@@ -67,13 +145,25 @@ listener_remove(notify notify_cb)
 
   if (!listener)
     {
+      CHECK_ERR(L_MAIN, pthread_mutex_unlock(&listener_lck));
       return -1;
     }
 
   if (prev)
     prev->next = listener->next;
   else
-    listener_list = listener->next;
+    __atomic_store_n(&listener_list, listener->next, __ATOMIC_RELEASE);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&listener_lck));
+
+  if (listener->deliverev)
+    {
+      DPRINTF(E_DBG, L_MAIN, "Listener for events %d: %" PRIu64 " notifications in %" PRIu64 " deliveries, latency avg %" PRIu64 " max %" PRIu64 " usec\n",
+	listener->events, listener->notifications, listener->deliveries,
+	listener->deliveries ? listener->latency_total / listener->deliveries : 0, listener->latency_max);
+
+      event_free(listener->deliverev);
+    }
 
   free(listener);
   return 0;
@@ -84,11 +174,29 @@ listener_notify(enum listener_event_type type)
 {
   struct listener *listener;
 
-  listener = listener_list;
+  listener = __atomic_load_n(&listener_list, __ATOMIC_ACQUIRE);
   while (listener)
     {
-      if (type & listener->events)
+      if (!(type & listener->events))
+	{
+	  listener = listener->next;
+	  continue;
+	}
+
+      if (listener->deliverev)
+	{
+	  __atomic_add_fetch(&listener->notifications, 1, __ATOMIC_RELAXED);
+
+	  // Only the first notification of a batch arms the delivery
+	  if (__atomic_fetch_or(&listener->pending, type, __ATOMIC_ACQ_REL) == 0)
+	    {
+	      __atomic_store_n(&listener->pending_since, now_usec(), __ATOMIC_RELEASE);
+	      event_add(listener->deliverev, &listener_coalesce_tv);
+	    }
+	}
+      else
 	listener->notify_cb(type);
+
       listener = listener->next;
     }
 }
@@ -28,20 +28,30 @@ enum listener_event_type
   LISTENER_LASTFM = (1 << 10),
   /* Song rating changes */
   LISTENER_RATING = (1 << 11),
+  /* Progress of a running library scan, see library_scan_stats_get() */
+  LISTENER_SCAN = (1 << 12),
 };
 
+struct event_base;
+
 typedef void (*notify)(short event_mask);
 
 /*
  * Registers the given callback function to the given event types.
  * This function is not thread safe. Listeners must be added once at startup.
  *
+ * If evbase is given, the callback is not called by the notifying thread but
+ * on that event base, shortly after the first notification. Notifications that
+ * arrive in the meantime are merged into the event_mask of a single call. If
+ * evbase is NULL, the callback is called directly by the notifying thread.
+ *
  * @param notify_cb Callback function
  * @param event_mask Event mask, one or more of LISTENER_*
+ * @param evbase Event base of the thread the callback should run in, or NULL
  * @return 0 on success, -1 on failure
  */
 int
-listener_add(notify notify_cb, short event_mask);
+listener_add(notify notify_cb, short event_mask, struct event_base *evbase);
 
 /*
  * Removes the given callback function
@@ -54,8 +64,8 @@ int
 listener_remove(notify notify_cb);
 
 /*
- * Calls the callback function of the registered listeners listening for the
- * given type of event.
+ * Calls (or schedules the call of) the callback function of the registered
+ * listeners listening for the given type of event. Thread safe.
  *
  * @param type The event type, on of the LISTENER_* values
  *
@@ -0,0 +1,1106 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Replay of recorded client traffic, run with --replay <file>. Each recorded
+ * session (a client connection) is replayed by its own thread on its own
+ * connection, with the requests sent at the recorded times and each waiting
+ * for the reply to the one before, like the client did. With more than one
+ * client, that many copies of all the sessions run at the same time.
+ *
+ * Long polls (DAAP update, DACP playstatusupdate and MPD idle) only wait for
+ * changes, so they are skipped. DAAP and DACP session ids in the URIs are
+ * replaced by the ones the server gave the same client address at the last
+ * login of the copy, which means that Remotes must be paired with the server
+ * under test.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <event2/buffer.h>
+
+#include "loadtest.h"
+#include "conffile.h"
+#include "dmap_common.h"
+#include "logger.h"
+#include "misc.h"
+
+#define LOADTEST_TIMEOUT_SECS 30
+#define LOADTEST_SESSION_BUCKETS 1024
+#define LOADTEST_THREAD_STACK (256 * 1024)
+
+enum loadtest_proto
+{
+  LOADTEST_HTTP,
+  LOADTEST_MPD,
+};
+
+struct loadtest_endpoint
+{
+  char *name;
+
+  // Durations of the requests that got a reply without error
+  uint32_t *usec;
+  int count;
+  int size;
+
+  int errors;
+
+  struct loadtest_endpoint *next;
+};
+
+struct loadtest_request
+{
+  uint64_t at_usec;
+
+  // MPD requests only have the command line in uri
+  char *method;
+  char *uri;
+  char *user_agent;
+  char *daap_version;
+  char *accept_encoding;
+  char *body;
+
+  bool is_poll;
+  bool is_login;
+
+  struct loadtest_endpoint *endpoint;
+};
+
+struct loadtest_session
+{
+  char *id;
+  // Client address without the port, all sessions of a client share its login
+  char *host;
+  enum loadtest_proto proto;
+
+  struct loadtest_request *requests;
+  int nrequests;
+  int size;
+
+  struct loadtest_session *bucket_next;
+  struct loadtest_session *next;
+};
+
+struct loadtest_conn
+{
+  int fd;
+  int nrequests;
+  struct evbuffer *in;
+};
+
+struct loadtest_job
+{
+  pthread_t tid;
+  int copy;
+  struct loadtest_session *session;
+};
+
+static const char *loadtest_host;
+static int loadtest_http_port;
+static int loadtest_mpd_port;
+static char *loadtest_auth;
+static const char *loadtest_password;
+static uint64_t loadtest_start_usec;
+
+// Stats and logins are shared by all the session threads
+static pthread_mutex_t loadtest_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct loadtest_endpoint *loadtest_endpoints;
+static struct keyval *loadtest_logins;
+static int loadtest_requests;
+static int loadtest_skipped;
+static int loadtest_conn_errors;
+
+
+/* -------------------------------- Helpers --------------------------------- */
+
+static uint64_t
+loadtest_clock_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+loadtest_wait_until(uint64_t usec)
+{
+  struct timespec ts;
+  uint64_t now;
+
+  now = loadtest_clock_usec();
+  if (now >= usec)
+    return;
+
+  ts.tv_sec = (usec - now) / 1000000;
+  ts.tv_nsec = ((usec - now) % 1000000) * 1000;
+
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+static struct loadtest_endpoint *
+endpoint_get(enum loadtest_proto proto, const char *method, const char *uri)
+{
+  struct loadtest_endpoint *endpoint;
+  char name[256];
+  const char *ptr;
+  const char *end;
+  size_t len;
+
+  // MPD by command, HTTP by method and path, with the ids in the path as *
+  if (proto == LOADTEST_MPD)
+    snprintf(name, sizeof(name), "mpd %.*s", (int)strcspn(uri, " "), uri);
+  else
+    {
+      len = snprintf(name, sizeof(name), "%s ", method);
+      for (ptr = uri; *ptr && *ptr != '?' && len < sizeof(name) - 2; ptr = end)
+	{
+	  end = ptr + 1 + strcspn(ptr + 1, "/?");
+	  if (strspn(ptr + 1, "0123456789") == end - ptr - 1 && end - ptr > 1)
+	    len += snprintf(name + len, sizeof(name) - len, "/*");
+	  else if (strncmp(ptr + 1, "0x", 2) == 0 && strspn(ptr + 3, "0123456789abcdefABCDEF") == end - ptr - 3)
+	    len += snprintf(name + len, sizeof(name) - len, "/*");
+	  else
+	    len += snprintf(name + len, sizeof(name) - len, "%.*s", (int)(end - ptr), ptr);
+	}
+    }
+
+  for (endpoint = loadtest_endpoints; endpoint; endpoint = endpoint->next)
+    {
+      if (strcmp(endpoint->name, name) == 0)
+	return endpoint;
+    }
+
+  CHECK_NULL(L_MAIN, endpoint = calloc(1, sizeof(struct loadtest_endpoint)));
+  CHECK_NULL(L_MAIN, endpoint->name = strdup(name));
+
+  endpoint->next = loadtest_endpoints;
+  loadtest_endpoints = endpoint;
+
+  return endpoint;
+}
+
+static void
+endpoint_add(struct loadtest_endpoint *endpoint, uint64_t usec, bool error)
+{
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&loadtest_lck));
+
+  loadtest_requests++;
+
+  if (error)
+    endpoint->errors++;
+  else
+    {
+      if (endpoint->count == endpoint->size)
+	{
+	  endpoint->size = endpoint->size ? 2 * endpoint->size : 64;
+	  CHECK_NULL(L_MAIN, endpoint->usec = realloc(endpoint->usec, endpoint->size * sizeof(uint32_t)));
+	}
+
+      endpoint->usec[endpoint->count] = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+      endpoint->count++;
+    }
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&loadtest_lck));
+}
+
+// The requests that are held by the server until something changes
+static bool
+request_is_poll(enum loadtest_proto proto, const char *uri)
+{
+  const char *ptr;
+  size_t len;
+
+  if (proto == LOADTEST_MPD)
+    return (strncmp(uri, "idle", 4) == 0 && (uri[4] == '\0' || uri[4] == ' ')) || (strcmp(uri, "noidle") == 0);
+
+  len = strcspn(uri, "?");
+  if (!(len == strlen("/update") && strncmp(uri, "/update", len) == 0) && !(len >= strlen("/playstatusupdate") && strncmp(uri + len - strlen("/playstatusupdate"), "/playstatusupdate", strlen("/playstatusupdate")) == 0))
+    return false;
+
+  // The first request with revision-number=1 is answered right away
+  ptr = strstr(uri, "revision-number=");
+  if (!ptr)
+    return false;
+
+  ptr += strlen("revision-number=");
+  return !(ptr[0] == '1' && (ptr[1] == '\0' || ptr[1] == '&'));
+}
+
+static char *
+field_dup(const char *field)
+{
+  if (!field || field[0] == '\0')
+    return NULL;
+
+  return strdup(field);
+}
+
+
+/* ------------------------------ Request log ------------------------------- */
+
+static struct loadtest_session *
+session_get(struct loadtest_session **buckets, struct loadtest_session **tail, const char *id, enum loadtest_proto proto)
+{
+  struct loadtest_session *session;
+  uint32_t hash;
+
+  hash = djb_hash(id, strlen(id)) % LOADTEST_SESSION_BUCKETS;
+  for (session = buckets[hash]; session; session = session->bucket_next)
+    {
+      if (session->proto == proto && strcmp(session->id, id) == 0)
+	return session;
+    }
+
+  CHECK_NULL(L_MAIN, session = calloc(1, sizeof(struct loadtest_session)));
+  CHECK_NULL(L_MAIN, session->id = strdup(id));
+
+  // Recorded as address:port, IPv6 addresses have colons of their own
+  session->host = strndup(id, strrchr(id, ':') ? strrchr(id, ':') - id : strlen(id));
+  session->proto = proto;
+
+  session->bucket_next = buckets[hash];
+  buckets[hash] = session;
+
+  *tail = session;
+
+  return session;
+}
+
+static struct loadtest_session *
+log_load(const char *path, int *nsessions, int *nrequests)
+{
+  struct loadtest_session *buckets[LOADTEST_SESSION_BUCKETS];
+  struct loadtest_session *sessions;
+  struct loadtest_session *session;
+  struct loadtest_session *tail;
+  struct loadtest_session *prev_tail;
+  struct loadtest_request *r;
+  enum loadtest_proto proto;
+  char *fields[9];
+  char *line;
+  char *ptr;
+  size_t size;
+  uint64_t at;
+  int nfields;
+  int lineno;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (!fp)
+    {
+      fprintf(stderr, "Could not open request log '%s': %s\n", path, strerror(errno));
+      return NULL;
+    }
+
+  memset(buckets, 0, sizeof(buckets));
+  sessions = NULL;
+  tail = NULL;
+  *nsessions = 0;
+  *nrequests = 0;
+
+  line = NULL;
+  size = 0;
+  lineno = 0;
+  while (getline(&line, &size, fp) > 0)
+    {
+      lineno++;
+
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '#' || line[0] == '\0')
+	continue;
+
+      ptr = line;
+      for (nfields = 0; nfields < 9 && ptr; nfields++)
+	fields[nfields] = strsep(&ptr, "\t");
+
+      if (nfields >= 4 && strcmp(fields[1], "mpd") == 0)
+	proto = LOADTEST_MPD;
+      else if (nfields == 9 && strcmp(fields[1], "http") == 0)
+	proto = LOADTEST_HTTP;
+      else
+	{
+	  fprintf(stderr, "Ignoring invalid line %d of the request log\n", lineno);
+	  continue;
+	}
+
+      if (safe_atou64(fields[0], &at) < 0)
+	{
+	  fprintf(stderr, "Ignoring line %d of the request log, invalid time\n", lineno);
+	  continue;
+	}
+
+      prev_tail = tail;
+      session = session_get(buckets, &tail, fields[2], proto);
+      if (tail != prev_tail)
+	{
+	  if (prev_tail)
+	    prev_tail->next = tail;
+	  else
+	    sessions = tail;
+
+	  (*nsessions)++;
+	}
+
+      if (session->nrequests == session->size)
+	{
+	  session->size = session->size ? 2 * session->size : 16;
+	  CHECK_NULL(L_MAIN, session->requests = realloc(session->requests, session->size * sizeof(struct loadtest_request)));
+	}
+
+      r = &session->requests[session->nrequests];
+      memset(r, 0, sizeof(struct loadtest_request));
+
+      r->at_usec = at;
+      if (proto == LOADTEST_MPD)
+	{
+	  r->uri = strdup(fields[3]);
+	}
+      else
+	{
+	  r->method = strdup(fields[3]);
+	  r->uri = strdup(fields[4]);
+	  r->user_agent = field_dup(fields[5]);
+	  r->daap_version = field_dup(fields[6]);
+	  r->accept_encoding = field_dup(fields[7]);
+	  r->body = (fields[8][0] != '\0') ? b64_decode(fields[8]) : NULL;
+	}
+
+      r->is_poll = request_is_poll(proto, r->uri);
+      r->is_login = (proto == LOADTEST_HTTP && strncmp(r->uri + strcspn(r->uri, "?") - strlen("/login"), "/login", strlen("/login")) == 0);
+      r->endpoint = endpoint_get(proto, r->method, r->uri);
+
+      session->nrequests++;
+      (*nrequests)++;
+    }
+
+  free(line);
+  fclose(fp);
+
+  return sessions;
+}
+
+static void
+log_free(struct loadtest_session *sessions)
+{
+  struct loadtest_session *session;
+  struct loadtest_endpoint *endpoint;
+  struct loadtest_request *r;
+  int i;
+
+  while ((session = sessions))
+    {
+      sessions = session->next;
+
+      for (i = 0; i < session->nrequests; i++)
+	{
+	  r = &session->requests[i];
+	  free(r->method);
+	  free(r->uri);
+	  free(r->user_agent);
+	  free(r->daap_version);
+	  free(r->accept_encoding);
+	  free(r->body);
+	}
+
+      free(session->requests);
+      free(session->id);
+      free(session->host);
+      free(session);
+    }
+
+  while ((endpoint = loadtest_endpoints))
+    {
+      loadtest_endpoints = endpoint->next;
+      free(endpoint->name);
+      free(endpoint->usec);
+      free(endpoint);
+    }
+}
+
+
+/* ------------------------------ Connections ------------------------------- */
+
+static void
+conn_close(struct loadtest_conn *conn)
+{
+  if (conn->fd >= 0)
+    close(conn->fd);
+
+  conn->fd = -1;
+  conn->nrequests = 0;
+  evbuffer_drain(conn->in, evbuffer_get_length(conn->in));
+}
+
+static int
+conn_read(struct loadtest_conn *conn)
+{
+  return evbuffer_read(conn->in, conn->fd, 65536);
+}
+
+static int
+conn_write(struct loadtest_conn *conn, struct evbuffer *out)
+{
+  while (evbuffer_get_length(out) > 0)
+    {
+      if (evbuffer_write(out, conn->fd) <= 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+static int
+conn_open(struct loadtest_conn *conn, enum loadtest_proto proto)
+{
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+  struct timeval tv = { LOADTEST_TIMEOUT_SECS, 0 };
+  char port[8];
+  char *line;
+  int flag;
+  int fd;
+  int ret;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  snprintf(port, sizeof(port), "%d", (proto == LOADTEST_MPD) ? loadtest_mpd_port : loadtest_http_port);
+
+  ret = getaddrinfo(loadtest_host, port, &hints, &res);
+  if (ret != 0)
+    return -1;
+
+  fd = -1;
+  for (ai = res; ai; ai = ai->ai_next)
+    {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+	continue;
+
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+      flag = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	break;
+
+      close(fd);
+      fd = -1;
+    }
+
+  freeaddrinfo(res);
+
+  if (fd < 0)
+    return -1;
+
+  conn->fd = fd;
+  conn->nrequests = 0;
+
+  if (proto != LOADTEST_MPD)
+    return 0;
+
+  // "OK MPD <version>"
+  while (!(line = evbuffer_readln(conn->in, NULL, EVBUFFER_EOL_LF)))
+    {
+      if (conn_read(conn) <= 0)
+	{
+	  conn_close(conn);
+	  return -1;
+	}
+    }
+
+  ret = (strncmp(line, "OK MPD", strlen("OK MPD")) == 0) ? 0 : -1;
+  free(line);
+  if (ret < 0)
+    conn_close(conn);
+
+  return ret;
+}
+
+
+/* --------------------------------- HTTP ----------------------------------- */
+
+static char *
+http_uri_make(const char *uri, int copy, const char *host)
+{
+  char key[128];
+  char *session_id;
+  const char *ptr;
+  const char *end;
+  char *ret;
+
+  ptr = strstr(uri, "session-id=");
+  if (!ptr)
+    return strdup(uri);
+
+  snprintf(key, sizeof(key), "%d/%s", copy, host);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&loadtest_lck));
+  session_id = safe_strdup(keyval_get(loadtest_logins, key));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&loadtest_lck));
+
+  if (!session_id)
+    return strdup(uri);
+
+  ptr += strlen("session-id=");
+  end = ptr + strspn(ptr, "0123456789");
+
+  ret = safe_asprintf("%.*s%s%s", (int)(ptr - uri), uri, session_id, end);
+  free(session_id);
+
+  return ret;
+}
+
+static void
+http_login_save(struct evbuffer *body, int copy, const char *host)
+{
+  char key[128];
+  char value[32];
+  int64_t session_id;
+  int ret;
+
+  ret = dmap_find_int(evbuffer_pullup(body, -1), evbuffer_get_length(body), "mlid", &session_id);
+  if (ret < 0)
+    return;
+
+  snprintf(key, sizeof(key), "%d/%s", copy, host);
+  snprintf(value, sizeof(value), "%" PRIi64, session_id);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&loadtest_lck));
+  keyval_remove(loadtest_logins, key);
+  keyval_add(loadtest_logins, key, value);
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&loadtest_lck));
+}
+
+static int
+http_line_read(struct loadtest_conn *conn, char **line)
+{
+  while (!(*line = evbuffer_readln(conn->in, NULL, EVBUFFER_EOL_CRLF)))
+    {
+      if (conn_read(conn) <= 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+static int
+http_body_read(struct loadtest_conn *conn, struct evbuffer *body, size_t len)
+{
+  while (evbuffer_get_length(conn->in) < len)
+    {
+      if (conn_read(conn) <= 0)
+	return -1;
+    }
+
+  evbuffer_remove_buffer(conn->in, body, len);
+
+  return 0;
+}
+
+static int
+http_response_read(struct loadtest_conn *conn, bool is_head, struct evbuffer *body, int *status, bool *keepalive)
+{
+  char *line;
+  int64_t content_length;
+  bool chunked;
+  long chunk_len;
+  int minor;
+  int ret;
+
+  ret = http_line_read(conn, &line);
+  if (ret < 0)
+    return -1;
+
+  ret = sscanf(line, "HTTP/1.%d %d", &minor, status);
+  free(line);
+  if (ret != 2)
+    return -1;
+
+  *keepalive = (minor >= 1);
+  content_length = -1;
+  chunked = false;
+
+  for (;;)
+    {
+      ret = http_line_read(conn, &line);
+      if (ret < 0)
+	return -1;
+
+      if (line[0] == '\0')
+	{
+	  free(line);
+	  break;
+	}
+
+      if (strncasecmp(line, "Content-Length:", strlen("Content-Length:")) == 0)
+	content_length = strtoll(line + strlen("Content-Length:"), NULL, 10);
+      else if (strncasecmp(line, "Transfer-Encoding:", strlen("Transfer-Encoding:")) == 0)
+	chunked = (strcasestr(line, "chunked") != NULL);
+      else if (strncasecmp(line, "Connection:", strlen("Connection:")) == 0)
+	*keepalive = (strcasestr(line, "close") == NULL);
+
+      free(line);
+    }
+
+  if (is_head || *status == 204 || *status == 304 || *status < 200)
+    return 0;
+
+  if (chunked)
+    {
+      for (;;)
+	{
+	  ret = http_line_read(conn, &line);
+	  if (ret < 0)
+	    return -1;
+
+	  chunk_len = strtol(line, NULL, 16);
+	  free(line);
+
+	  if (chunk_len <= 0)
+	    break;
+
+	  // The chunk and its CRLF
+	  ret = http_body_read(conn, body, chunk_len);
+	  if (ret < 0 || http_line_read(conn, &line) < 0)
+	    return -1;
+
+	  free(line);
+	}
+
+      // Trailer
+      do
+	{
+	  ret = http_line_read(conn, &line);
+	  if (ret < 0)
+	    return -1;
+
+	  ret = (line[0] == '\0');
+	  free(line);
+	}
+      while (!ret);
+
+      return 0;
+    }
+
+  if (content_length >= 0)
+    return http_body_read(conn, body, content_length);
+
+  // No length, the body ends with the connection
+  while ((ret = conn_read(conn)) > 0)
+    ;
+
+  evbuffer_add_buffer(body, conn->in);
+  *keepalive = false;
+
+  return (ret < 0) ? -1 : 0;
+}
+
+static int
+http_exchange(struct loadtest_conn *conn, struct loadtest_job *job, struct loadtest_request *r, bool *error)
+{
+  struct evbuffer *out;
+  struct evbuffer *body;
+  char *uri;
+  bool keepalive;
+  int status;
+  int ret;
+
+  CHECK_NULL(L_MAIN, out = evbuffer_new());
+  CHECK_NULL(L_MAIN, body = evbuffer_new());
+
+  uri = http_uri_make(r->uri, job->copy, job->session->host);
+
+  evbuffer_add_printf(out, "%s %s HTTP/1.1\r\nHost: %s\r\n", r->method, uri, loadtest_host);
+  if (r->user_agent)
+    evbuffer_add_printf(out, "User-Agent: %s\r\n", r->user_agent);
+  if (r->daap_version)
+    evbuffer_add_printf(out, "Client-DAAP-Version: %s\r\n", r->daap_version);
+  // The login reply is read for the session id, so it shouldn't be gzipped
+  if (r->accept_encoding && !r->is_login)
+    evbuffer_add_printf(out, "Accept-Encoding: %s\r\n", r->accept_encoding);
+  if (loadtest_auth)
+    evbuffer_add_printf(out, "Authorization: Basic %s\r\n", loadtest_auth);
+  if (r->body)
+    evbuffer_add_printf(out, "Content-Length: %zu\r\n\r\n%s", strlen(r->body), r->body);
+  else
+    evbuffer_add_printf(out, "\r\n");
+
+  free(uri);
+
+  ret = conn_write(conn, out);
+  if (ret == 0)
+    ret = http_response_read(conn, strcmp(r->method, "HEAD") == 0, body, &status, &keepalive);
+
+  if (ret == 0)
+    {
+      conn->nrequests++;
+      *error = (status >= 400);
+
+      if (r->is_login && status == 200)
+	http_login_save(body, job->copy, job->session->host);
+      if (!keepalive)
+	conn_close(conn);
+    }
+
+  evbuffer_free(body);
+  evbuffer_free(out);
+
+  return ret;
+}
+
+
+/* ---------------------------------- MPD ----------------------------------- */
+
+/*
+ * @return 0 if the reply was read, 1 if the command is part of a command list
+ *         and has no reply of its own, -1 on connection errors
+ */
+static int
+mpd_exchange(struct loadtest_conn *conn, struct loadtest_request *r, bool *in_list, bool *error)
+{
+  struct evbuffer *out;
+  char *line;
+  size_t len;
+  int ret;
+
+  CHECK_NULL(L_MAIN, out = evbuffer_new());
+
+  if (strcmp(r->uri, "password") == 0)
+    evbuffer_add_printf(out, "password \"%s\"\n", loadtest_password);
+  else
+    evbuffer_add_printf(out, "%s\n", r->uri);
+
+  ret = conn_write(conn, out);
+  evbuffer_free(out);
+  if (ret < 0)
+    return -1;
+
+  if (strncmp(r->uri, "command_list_begin", strlen("command_list_begin")) == 0 || strncmp(r->uri, "command_list_ok_begin", strlen("command_list_ok_begin")) == 0)
+    *in_list = true;
+  else if (strncmp(r->uri, "command_list_end", strlen("command_list_end")) == 0)
+    *in_list = false;
+
+  if (*in_list)
+    return 1;
+
+  for (;;)
+    {
+      line = evbuffer_readln(conn->in, NULL, EVBUFFER_EOL_LF);
+      if (!line)
+	{
+	  if (conn_read(conn) <= 0)
+	    return -1;
+
+	  continue;
+	}
+
+      if (strcmp(line, "OK") == 0 || strncmp(line, "ACK ", 4) == 0)
+	break;
+
+      // Binary chunk of albumart/readpicture, followed by a newline
+      if (sscanf(line, "binary: %zu", &len) == 1)
+	{
+	  while (evbuffer_get_length(conn->in) < len + 1)
+	    {
+	      if (conn_read(conn) <= 0)
+		{
+		  free(line);
+		  return -1;
+		}
+	    }
+
+	  evbuffer_drain(conn->in, len + 1);
+	}
+
+      free(line);
+    }
+
+  *error = (line[0] == 'A');
+  free(line);
+
+  conn->nrequests++;
+
+  return 0;
+}
+
+
+/* -------------------------------- Replay ---------------------------------- */
+
+static void *
+session_run(void *arg)
+{
+  struct loadtest_job *job = arg;
+  struct loadtest_session *session = job->session;
+  struct loadtest_request *r;
+  struct loadtest_conn conn;
+  uint64_t start;
+  uint64_t usec;
+  bool in_list;
+  bool reused;
+  bool error;
+  int ret;
+  int i;
+
+  conn.fd = -1;
+  conn.nrequests = 0;
+  CHECK_NULL(L_MAIN, conn.in = evbuffer_new());
+
+  in_list = false;
+  for (i = 0; i < session->nrequests; i++)
+    {
+      r = &session->requests[i];
+
+      if (r->is_poll || (session->proto == LOADTEST_MPD && !loadtest_password && strcmp(r->uri, "password") == 0))
+	{
+	  __atomic_add_fetch(&loadtest_skipped, 1, __ATOMIC_RELAXED);
+	  continue;
+	}
+
+      loadtest_wait_until(loadtest_start_usec + r->at_usec);
+
+      // Once more on a new connection if the server closed a kept-alive one
+      do
+	{
+	  if (conn.fd < 0 && conn_open(&conn, session->proto) < 0)
+	    {
+	      __atomic_add_fetch(&loadtest_conn_errors, 1, __ATOMIC_RELAXED);
+	      ret = -1;
+	      break;
+	    }
+
+	  reused = (session->proto == LOADTEST_HTTP && conn.nrequests > 0);
+	  error = false;
+
+	  start = loadtest_clock_usec();
+	  if (session->proto == LOADTEST_MPD)
+	    ret = mpd_exchange(&conn, r, &in_list, &error);
+	  else
+	    ret = http_exchange(&conn, job, r, &error);
+	  usec = loadtest_clock_usec() - start;
+
+	  if (ret < 0)
+	    {
+	      conn_close(&conn);
+	      in_list = false;
+	    }
+	}
+      while (ret < 0 && reused);
+
+      if (ret < 0)
+	endpoint_add(r->endpoint, 0, true);
+      else if (ret == 0)
+	endpoint_add(r->endpoint, usec, error);
+    }
+
+  conn_close(&conn);
+  evbuffer_free(conn.in);
+
+  return NULL;
+}
+
+static int
+usec_cmp(const void *a, const void *b)
+{
+  uint32_t ua = *(const uint32_t *)a;
+  uint32_t ub = *(const uint32_t *)b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+static int
+endpoint_cmp(const void *a, const void *b)
+{
+  const struct loadtest_endpoint *ea = *(struct loadtest_endpoint * const *)a;
+  const struct loadtest_endpoint *eb = *(struct loadtest_endpoint * const *)b;
+
+  return (eb->count + eb->errors) - (ea->count + ea->errors);
+}
+
+static double
+percentile_ms(struct loadtest_endpoint *endpoint, int p)
+{
+  if (endpoint->count == 0)
+    return 0.0;
+
+  return endpoint->usec[(endpoint->count - 1) * p / 100] / 1000.0;
+}
+
+static void
+loadtest_report(int nsessions, int clients, uint64_t wall_usec)
+{
+  struct loadtest_endpoint **sorted;
+  struct loadtest_endpoint *endpoint;
+  int nendpoints;
+  int errors;
+  int i;
+
+  nendpoints = 0;
+  for (endpoint = loadtest_endpoints; endpoint; endpoint = endpoint->next)
+    nendpoints++;
+
+  CHECK_NULL(L_MAIN, sorted = calloc(nendpoints ? nendpoints : 1, sizeof(struct loadtest_endpoint *)));
+
+  errors = 0;
+  for (endpoint = loadtest_endpoints, i = 0; endpoint; endpoint = endpoint->next, i++)
+    {
+      qsort(endpoint->usec, endpoint->count, sizeof(uint32_t), usec_cmp);
+      errors += endpoint->errors;
+      sorted[i] = endpoint;
+    }
+
+  qsort(sorted, nendpoints, sizeof(struct loadtest_endpoint *), endpoint_cmp);
+
+  printf("Replayed %d sessions x %d clients in %.1f s: %d requests (%.1f/s), %d errors, %d connection failures, %d long polls skipped\n\n",
+	 nsessions, clients, wall_usec / 1000000.0, loadtest_requests, loadtest_requests * 1000000.0 / (wall_usec ? wall_usec : 1),
+	 errors, loadtest_conn_errors, loadtest_skipped);
+
+  printf("%-50s %8s %7s %9s %9s %9s %9s\n", "endpoint", "count", "errors", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+  for (i = 0; i < nendpoints; i++)
+    {
+      endpoint = sorted[i];
+      if (endpoint->count + endpoint->errors == 0)
+	continue;
+
+      printf("%-50s %8d %7d %9.2f %9.2f %9.2f %9.2f\n", endpoint->name, endpoint->count + endpoint->errors, endpoint->errors,
+	     percentile_ms(endpoint, 50), percentile_ms(endpoint, 90), percentile_ms(endpoint, 99), percentile_ms(endpoint, 100));
+    }
+
+  free(sorted);
+}
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+int
+loadtest_run(const char *path, const char *host, int clients)
+{
+  struct loadtest_session *sessions;
+  struct loadtest_session *session;
+  struct loadtest_job *jobs;
+  pthread_attr_t attr;
+  uint64_t start;
+  char *userpass;
+  int nsessions;
+  int nrequests;
+  int njobs;
+  int i;
+  int ret;
+
+  if (clients <= 0)
+    clients = 1;
+
+  loadtest_host = host ? host : "localhost";
+  loadtest_http_port = cfg_getint(cfg_getsec(cfg, "library"), "port");
+  loadtest_mpd_port = cfg_getint(cfg_getsec(cfg, "mpd"), "port");
+
+  loadtest_password = cfg_getstr(cfg_getsec(cfg, "library"), "password");
+  if (loadtest_password)
+    {
+      userpass = safe_asprintf("replay:%s", loadtest_password);
+      loadtest_auth = b64_encode((uint8_t *)userpass, strlen(userpass));
+      free(userpass);
+    }
+
+  CHECK_NULL(L_MAIN, loadtest_logins = keyval_alloc());
+
+  sessions = log_load(path, &nsessions, &nrequests);
+  if (!sessions)
+    {
+      fprintf(stderr, "No requests to replay in '%s'\n", path);
+      ret = -1;
+      goto out;
+    }
+
+  printf("Replaying %d requests of %d sessions from '%s' to %s with %d clients\n", nrequests, nsessions, path, loadtest_host, clients);
+
+  CHECK_NULL(L_MAIN, jobs = calloc(nsessions * clients, sizeof(struct loadtest_job)));
+
+  // Most of the time the threads just wait for the next request
+  CHECK_ERR(L_MAIN, pthread_attr_init(&attr));
+  CHECK_ERR(L_MAIN, pthread_attr_setstacksize(&attr, LOADTEST_THREAD_STACK));
+
+  loadtest_start_usec = loadtest_clock_usec();
+  start = loadtest_start_usec;
+
+  ret = 0;
+  njobs = 0;
+  for (i = 0; i < clients && ret == 0; i++)
+    {
+      for (session = sessions; session; session = session->next)
+	{
+	  jobs[njobs].copy = i;
+	  jobs[njobs].session = session;
+
+	  ret = pthread_create(&jobs[njobs].tid, &attr, session_run, &jobs[njobs]);
+	  if (ret != 0)
+	    {
+	      fprintf(stderr, "Could only start %d of %d session threads: %s\n", njobs, nsessions * clients, strerror(ret));
+	      break;
+	    }
+
+	  njobs++;
+	}
+    }
+
+  for (i = 0; i < njobs; i++)
+    pthread_join(jobs[i].tid, NULL);
+
+  loadtest_report(nsessions, clients, loadtest_clock_usec() - start);
+
+  CHECK_ERR(L_MAIN, pthread_attr_destroy(&attr));
+  free(jobs);
+
+  ret = (ret == 0) ? 0 : -1;
+
+ out:
+  log_free(sessions);
+  keyval_clear(loadtest_logins);
+  free(loadtest_logins);
+  free(loadtest_auth);
+  loadtest_auth = NULL;
+
+  return ret;
+}
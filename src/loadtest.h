@@ -0,0 +1,17 @@
+
+#ifndef __LOADTEST_H__
+#define __LOADTEST_H__
+
+/* Replays a request log recorded with the request_log option (see reqlog.h)
+ * against a running server (started with --replay) and prints the latency
+ * percentiles and errors per endpoint to stdout.
+ *
+ * @in path      request log to replay
+ * @in host      server to replay against, NULL for localhost
+ * @in clients   how many copies of the recorded sessions run at the same time
+ * @return       0 on success, -1 if the log could not be replayed
+ */
+int
+loadtest_run(const char *path, const char *host, int clients);
+
+#endif /* !__LOADTEST_H__ */
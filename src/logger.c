@@ -25,10 +25,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include <event2/event.h>
@@ -42,12 +45,58 @@ static pthread_mutex_t logger_lck;
 static int logger_initialized;
 static int logdomains;
 static int threshold;
+
+// What DPRINTF lets through, everything until the logger is initialized
+int logger_filter_severity = E_SPAM;
+int logger_filter_domains = ~0;
 static int console = 1;
 static char *logfilename;
 static FILE *logfile;
 static char *labels[] = { "config", "daap", "db", "httpd", "http", "main", "mdns", "misc", "rsp", "scan", "xcode", "event", "remote", "dacp", "ffmpeg", "artwork", "player", "raop", "laudio", "dmap", "dbperf", "spotify", "lastfm", "cache", "mpd", "stream", "cast", "fifo", "lib", "web" };
 static char *severities[] = { "FATAL", "LOG", "WARN", "INFO", "DEBUG", "SPAM" };
 
+/* Async logging: each thread formats its messages into its own ring, and the
+ * logger thread writes them to the log. Messages of all threads are written in
+ * the order they were made, by their sequence number. If a ring is full the
+ * message is dropped and counted.
+ */
+#define LOGGER_RING_SLOTS 256
+#define LOGGER_MSG_MAX 512
+#define LOGGER_WAKEUP_MSEC 100
+// While nothing is logged the logger thread sleeps for longer and longer, up to
+// this, and is then woken by the next message
+#define LOGGER_IDLE_MSEC 5000
+
+struct logger_msg
+{
+  uint64_t seq;
+  time_t stamp;
+  int severity;
+  int domain;
+  char text[LOGGER_MSG_MAX];
+};
+
+struct logger_ring
+{
+  struct logger_msg msgs[LOGGER_RING_SLOTS];
+  unsigned int head;     // Next slot to write, only changed by the owner thread
+  unsigned int tail;     // Next slot to read, only changed with logger_lck
+  unsigned int dropped;
+  bool orphaned;         // The owner thread has exited
+  struct logger_ring *next;
+};
+
+static bool logger_async;
+static bool logger_async_exit;
+static pthread_t tid_logger;
+static pthread_mutex_t async_lck; // Guards adding/removing rings and the exit flag
+static pthread_cond_t async_cond;
+static pthread_key_t ring_key;
+static struct logger_ring *rings;
+static __thread struct logger_ring *ring_self;
+static uint64_t logger_seq;
+static bool logger_idle;
+
 /* We need our own check to avoid nested locking or recursive calls */
 #define LOGGER_CHECK_ERR(f) \
   do { int lerr; lerr = f; if (lerr != 0) { \
@@ -132,6 +181,263 @@ vlogger_fatal(const char *fmt, ...)
   va_end(ap);
 }
 
+/* ----------------------------- Async logging ----------------------------- */
+
+/* Thread: any, on exit */
+static void
+ring_release(void *arg)
+{
+  struct logger_ring *ring = arg;
+
+  ring_self = NULL;
+  __atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static struct logger_ring *
+ring_get(void)
+{
+  struct logger_ring *ring;
+
+  if (ring_self)
+    return ring_self;
+
+  ring = calloc(1, sizeof(struct logger_ring));
+  if (!ring)
+    return NULL;
+
+  pthread_setspecific(ring_key, ring);
+
+  LOGGER_CHECK_ERR(pthread_mutex_lock(&async_lck));
+  ring->next = rings;
+  __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+  LOGGER_CHECK_ERR(pthread_mutex_unlock(&async_lck));
+
+  ring_self = ring;
+  return ring;
+}
+
+/* Formats the message into the ring of the calling thread, returns -1 if the
+ * thread has no ring
+ */
+static int
+vlogger_async(int severity, int domain, const char *fmt, va_list args)
+{
+  struct logger_ring *ring;
+  struct logger_msg *msg;
+  unsigned int head;
+  unsigned int tail;
+  va_list ap;
+  int ret;
+
+  ring = ring_get();
+  if (!ring)
+    return -1;
+
+  head = ring->head;
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= LOGGER_RING_SLOTS)
+    {
+      __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+
+  msg = &ring->msgs[head % LOGGER_RING_SLOTS];
+  msg->seq = __atomic_fetch_add(&logger_seq, 1, __ATOMIC_RELAXED);
+  msg->stamp = time(NULL);
+  msg->severity = severity;
+  msg->domain = domain;
+
+  va_copy(ap, args);
+  ret = vsnprintf(msg->text, sizeof(msg->text), fmt, ap);
+  va_end(ap);
+  if (ret >= (int)sizeof(msg->text))
+    msg->text[sizeof(msg->text) - 2] = '\n'; // Truncated
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  // The logger thread also wakes up by itself, so no lock for the signal
+  if (head + 1 - tail >= LOGGER_RING_SLOTS / 2 || __atomic_exchange_n(&logger_idle, false, __ATOMIC_RELAXED))
+    pthread_cond_signal(&async_cond);
+
+  return 0;
+}
+
+static void
+logger_msg_write(struct logger_msg *msg)
+{
+  char stamp[32];
+  int ret;
+
+  if (logfile)
+    {
+      ret = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&msg->stamp));
+      if (ret == 0)
+	stamp[0] = '\0';
+
+      fprintf(logfile, "[%s] [%5s] %8s: %s", stamp, severities[msg->severity], labels[msg->domain], msg->text);
+    }
+
+  if (console)
+    fprintf(stderr, "[%5s] %8s: %s", severities[msg->severity], labels[msg->domain], msg->text);
+}
+
+/* Writes what is in the rings, oldest first. Must be called with logger_lck.
+ * Returns true if anything was written.
+ */
+static bool
+logger_drain(void)
+{
+  struct logger_ring *first;
+  struct logger_ring *ring;
+  struct logger_ring *oldest;
+  struct logger_msg *msg;
+  struct logger_msg dropped;
+  unsigned int ndropped;
+  bool written;
+
+  first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  written = false;
+
+  for (ring = first; ring; ring = ring->next)
+    {
+      ndropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+      if (ndropped == 0)
+	continue;
+
+      memset(&dropped, 0, sizeof(struct logger_msg));
+      dropped.stamp = time(NULL);
+      dropped.severity = E_LOG;
+      dropped.domain = L_MISC;
+      snprintf(dropped.text, sizeof(dropped.text), "%u log messages were dropped, the log ring of a thread was full\n", ndropped);
+      logger_msg_write(&dropped);
+      written = true;
+    }
+
+  for (;;)
+    {
+      oldest = NULL;
+      for (ring = first; ring; ring = ring->next)
+	{
+	  if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+	    continue;
+
+	  if (!oldest || ring->msgs[ring->tail % LOGGER_RING_SLOTS].seq < oldest->msgs[oldest->tail % LOGGER_RING_SLOTS].seq)
+	    oldest = ring;
+	}
+
+      if (!oldest)
+	break;
+
+      msg = &oldest->msgs[oldest->tail % LOGGER_RING_SLOTS];
+      logger_msg_write(msg);
+      written = true;
+
+      __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+    }
+
+  if (written && logfile)
+    fflush(logfile);
+
+  return written;
+}
+
+/* Frees the rings of threads that have exited, once they are empty. Must be
+ * called with logger_lck.
+ */
+static void
+logger_rings_prune(void)
+{
+  struct logger_ring **prev;
+  struct logger_ring *ring;
+
+  LOGGER_CHECK_ERR(pthread_mutex_lock(&async_lck));
+
+  prev = &rings;
+  while ((ring = *prev))
+    {
+      if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) && ring->tail == ring->head)
+	{
+	  *prev = ring->next;
+	  free(ring);
+	  continue;
+	}
+
+      prev = &ring->next;
+    }
+
+  LOGGER_CHECK_ERR(pthread_mutex_unlock(&async_lck));
+}
+
+// Must be called with async_lck
+static bool
+logger_rings_empty(void)
+{
+  struct logger_ring *ring;
+
+  for (ring = rings; ring; ring = ring->next)
+    {
+      if (ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+	return false;
+    }
+
+  return true;
+}
+
+static void *
+logger_thread(void *arg)
+{
+  struct timespec ts;
+  unsigned int wait_msec;
+  bool written;
+  bool exiting;
+
+  wait_msec = LOGGER_WAKEUP_MSEC;
+
+  for (;;)
+    {
+      LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
+      written = logger_drain();
+      logger_rings_prune();
+      LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+
+      if (written)
+	wait_msec = LOGGER_WAKEUP_MSEC;
+      else if (wait_msec < LOGGER_IDLE_MSEC)
+	wait_msec = (2 * wait_msec < LOGGER_IDLE_MSEC) ? 2 * wait_msec : LOGGER_IDLE_MSEC;
+
+      LOGGER_CHECK_ERR(pthread_mutex_lock(&async_lck));
+      exiting = logger_async_exit;
+      if (!exiting)
+	{
+	  // From now on the next message signals us. A message that came just
+	  // before the flag was set is caught by the check, one that signals
+	  // before we wait is written after the timeout at the latest.
+	  if (wait_msec == LOGGER_IDLE_MSEC)
+	    __atomic_store_n(&logger_idle, true, __ATOMIC_RELAXED);
+
+	  if (wait_msec < LOGGER_IDLE_MSEC || logger_rings_empty())
+	    {
+	      clock_gettime(CLOCK_REALTIME, &ts);
+	      ts.tv_sec += wait_msec / 1000;
+	      ts.tv_nsec += (wait_msec % 1000) * 1000000L;
+	      if (ts.tv_nsec >= 1000000000L)
+		{
+		  ts.tv_sec++;
+		  ts.tv_nsec -= 1000000000L;
+		}
+
+	      pthread_cond_timedwait(&async_cond, &async_lck, &ts);
+	    }
+	}
+      LOGGER_CHECK_ERR(pthread_mutex_unlock(&async_lck));
+
+      if (exiting)
+	break;
+    }
+
+  pthread_exit(NULL);
+}
+
 static void
 vlogger(int severity, int domain, const char *fmt, va_list args)
 {
@@ -146,6 +452,13 @@ vlogger(int severity, int domain, const char *fmt, va_list args)
   if (!((1 << domain) & logdomains) || (severity > threshold))
     return;
 
+  // Fatal messages are written right away, the process may be about to end
+  if (__atomic_load_n(&logger_async, __ATOMIC_ACQUIRE) && severity != E_FATAL)
+    {
+      if (vlogger_async(severity, domain, fmt, args) == 0)
+	return;
+    }
+
   LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
 
   if (!logfile && !console)
@@ -154,21 +467,21 @@ vlogger(int severity, int domain, const char *fmt, va_list args)
       return;
     }
 
+  // Keeps the order with what is still in the rings
+  if (__atomic_load_n(&logger_async, __ATOMIC_ACQUIRE))
+    logger_drain();
+
   vlogger_writer(severity, domain, fmt, args);
 
   LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
 }
 
+/* The DPRINTF macro has already checked the log configuration */
 void
-DPRINTF(int severity, int domain, const char *fmt, ...)
+logger_dprintf(int severity, int domain, const char *fmt, ...)
 {
   va_list ap;
 
-  // If domain and severity do not match the current log configuration, return early to
-  // safe some unnecessary code execution (tiny performance gain)
-  if (logger_initialized && (!((1 << domain) & logdomains) || (severity > threshold)))
-    return;
-
   va_start(ap, fmt);
   vlogger(severity, domain, fmt, ap);
   va_end(ap);
@@ -286,6 +599,67 @@ logger_detach(void)
   console = 0;
 }
 
+/* Must be called after forking */
+int
+logger_async_start(void)
+{
+  int ret;
+
+  if (!logger_initialized || logger_async)
+    return 0;
+
+  CHECK_ERR(L_MISC, mutex_init(&async_lck));
+  CHECK_ERR(L_MISC, pthread_cond_init(&async_cond, NULL));
+  CHECK_ERR(L_MISC, pthread_key_create(&ring_key, ring_release));
+
+  logger_async_exit = false;
+
+  ret = pthread_create(&tid_logger, NULL, logger_thread, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_MISC, "Could not spawn logger thread: %s\n", strerror(ret));
+
+      CHECK_ERR(L_MISC, pthread_key_delete(ring_key));
+      CHECK_ERR(L_MISC, pthread_cond_destroy(&async_cond));
+      CHECK_ERR(L_MISC, pthread_mutex_destroy(&async_lck));
+      return -1;
+    }
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(tid_logger, "logger");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(tid_logger, "logger");
+#endif
+
+  __atomic_store_n(&logger_async, true, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Writes what is left in the rings and goes back to writing from the calling
+ * threads
+ */
+static void
+logger_async_stop(void)
+{
+  if (!logger_async)
+    return;
+
+  LOGGER_CHECK_ERR(pthread_mutex_lock(&async_lck));
+  logger_async_exit = true;
+  LOGGER_CHECK_ERR(pthread_cond_signal(&async_cond));
+  LOGGER_CHECK_ERR(pthread_mutex_unlock(&async_lck));
+
+  pthread_join(tid_logger, NULL);
+
+  // The rings are not freed, a thread that is still around might be using its
+  // own, but what is in them is written out
+  LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
+  __atomic_store_n(&logger_async, false, __ATOMIC_RELEASE);
+  logger_drain();
+  LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+}
+
 int
 logger_init(char *file, char *domains, int severity)
 {
@@ -336,12 +710,17 @@ logger_init(char *file, char *domains, int severity)
 
   logger_initialized = 1;
 
+  logger_filter_severity = threshold;
+  logger_filter_domains = logdomains;
+
   return 0;
 }
 
 void
 logger_deinit(void)
 {
+  logger_async_stop();
+
   if (logfile)
     {
       fclose(logfile);
@@ -352,6 +731,8 @@ logger_deinit(void)
     {
       /* logging w/o locks to stderr now */
       logger_initialized = 0;
+      logger_filter_severity = E_SPAM;
+      logger_filter_domains = ~0;
       console = 1;
       CHECK_ERR(L_MISC, pthread_mutex_destroy(&logger_lck));
     }
@@ -47,10 +47,31 @@
 #define E_DBG     4
 #define E_SPAM    5
 
+/* Messages above this severity are compiled out, see --with-log-max-level */
+#ifndef LOGGER_SEVERITY_MAX
+# define LOGGER_SEVERITY_MAX E_SPAM
+#endif
+
+#if LOGGER_SEVERITY_MAX < E_LOG
+# error "LOGGER_SEVERITY_MAX can't be below E_LOG"
+#endif
+
+/* The severity and domains that are currently logged, so DPRINTF can skip
+ * other messages before their arguments are evaluated. Set by logger_init().
+ */
+extern int logger_filter_severity;
+extern int logger_filter_domains;
+
+#define DPRINTF(severity, domain, ...)						\
+  do {										\
+    if (((severity) <= LOGGER_SEVERITY_MAX) && ((severity) <= logger_filter_severity) \
+	&& ((1 << (domain)) & logger_filter_domains))				\
+      logger_dprintf((severity), (domain), __VA_ARGS__);			\
+  } while (0)
 
 
 void
-DPRINTF(int severity, int domain, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+logger_dprintf(int severity, int domain, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 
 void
 logger_ffmpeg(void *ptr, int level, const char *fmt, va_list ap);
@@ -75,6 +96,10 @@ logger_domains(void);
 void
 logger_detach(void);
 
+/* Moves writing the log to a background thread, see the log_async option */
+int
+logger_async_start(void);
+
 int
 logger_init(char *file, char *domains, int severity);
 
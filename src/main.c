@@ -62,15 +62,21 @@ GCRY_THREAD_OPTION_PTHREAD_IMPL;
 #include "conffile.h"
 #include "db.h"
 #include "logger.h"
+#include "metrics.h"
 #include "misc.h"
 #include "cache.h"
+#include "artwork.h"
 #include "httpd.h"
 #include "mpd.h"
 #include "mdns.h"
 #include "remote_pairing.h"
 #include "player.h"
 #include "worker.h"
+#include "http.h"
 #include "library.h"
+#include "bench.h"
+#include "loadtest.h"
+#include "reqlog.h"
 #ifdef LASTFM
 # include "lastfm.h"
 #endif
@@ -111,6 +117,10 @@ usage(char *program)
   printf("  -b <id>        ffid to be broadcast\n");
   printf("  -v             Display version information\n");
   printf("  -w <directory> Use <directory> as the web root directory for serving static files\n");
+  printf("  --bench <name[:size]> Run a benchmark (daap, player, scan) and exit\n");
+  printf("  --replay <file> Replay a request log (see request_log) against a server and exit\n");
+  printf("  --replay-clients <n> Replay <n> copies of the recorded clients at the same time\n");
+  printf("  --replay-host <host> Server to replay against, default localhost\n");
   printf("\n\n");
   printf("Available log domains:\n");
   logger_domains();
@@ -429,6 +439,220 @@ signal_kqueue_cb(int fd, short event, void *arg)
 #endif
 
 
+/* ------------------------------- Startup --------------------------------- */
+
+/* The subsystems are started as a dependency graph: each step runs in its own
+ * thread as soon as what it depends on is up, so e.g. the database checks,
+ * mDNS and the output backends don't wait for each other. Steps that use mDNS
+ * depend on each other, since the mDNS client is not thread safe.
+ */
+enum startup_id
+{
+  STARTUP_MDNS,
+  STARTUP_DB,
+  STARTUP_HTTPC,
+  STARTUP_WORKER,
+  STARTUP_CACHE,
+  STARTUP_LIBRARY,
+  STARTUP_ARTWORK,
+  STARTUP_PLAYER,
+  STARTUP_HTTPD,
+#ifdef MPD
+  STARTUP_MPD,
+#endif
+  STARTUP_REMOTE,
+  STARTUP_MAX,
+};
+
+#define DEP(id) (1 << (id))
+
+enum startup_state
+{
+  STARTUP_WAITING,
+  STARTUP_RUNNING,
+  STARTUP_DONE,
+  STARTUP_FAILED,
+};
+
+struct startup_step
+{
+  const char *name;
+  int (*init)(void);
+  void (*deinit)(void);
+  unsigned int deps;
+  // The step thread needs its own connection if the init uses the db
+  bool needs_db;
+
+  enum startup_state state;
+};
+
+static const char *startup_webroot;
+
+static pthread_mutex_t startup_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_cond = PTHREAD_COND_INITIALIZER;
+
+static int
+startup_httpd_init(void)
+{
+  return httpd_init(startup_webroot);
+}
+
+static struct startup_step startup_steps[STARTUP_MAX] =
+  {
+    [STARTUP_MDNS]    = { "mDNS", mdns_init, mdns_deinit, 0, false },
+    [STARTUP_DB]      = { "Database", db_init, db_deinit, 0, false },
+    [STARTUP_HTTPC]   = { "HTTP client", http_client_init, http_client_deinit, 0, false },
+    [STARTUP_WORKER]  = { "Worker", worker_init, worker_deinit, DEP(STARTUP_DB), true },
+    [STARTUP_CACHE]   = { "Cache", cache_init, cache_deinit, DEP(STARTUP_DB), true },
+    [STARTUP_LIBRARY] = { "Library", library_init, library_deinit, DEP(STARTUP_DB) | DEP(STARTUP_WORKER) | DEP(STARTUP_CACHE), true },
+    [STARTUP_ARTWORK] = { "Artwork pregeneration", artwork_pregen_init, artwork_pregen_deinit, DEP(STARTUP_WORKER) | DEP(STARTUP_LIBRARY), true },
+    [STARTUP_PLAYER]  = { "Player", player_init, player_deinit, DEP(STARTUP_MDNS) | DEP(STARTUP_DB) | DEP(STARTUP_HTTPC) | DEP(STARTUP_WORKER), true },
+    // Listens right after the database is up, see httpd_ready()
+    [STARTUP_HTTPD]   = { "HTTPd", startup_httpd_init, httpd_deinit, DEP(STARTUP_DB), true },
+#ifdef MPD
+    [STARTUP_MPD]     = { "MPD", mpd_init, mpd_deinit, DEP(STARTUP_DB) | DEP(STARTUP_LIBRARY) | DEP(STARTUP_PLAYER), true },
+#endif
+    [STARTUP_REMOTE]  = { "Remote pairing", remote_pairing_init, remote_pairing_deinit, DEP(STARTUP_MDNS) | DEP(STARTUP_DB) | DEP(STARTUP_PLAYER), true },
+  };
+
+static void *
+startup_thread(void *arg)
+{
+  struct startup_step *step = arg;
+  struct timespec start;
+  struct timespec end;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  ret = 0;
+  if (step->needs_db)
+    ret = db_perthread_init();
+
+  if (ret == 0)
+    ret = step->init();
+
+  if (step->needs_db)
+    db_perthread_deinit();
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (ret != 0)
+    DPRINTF(E_FATAL, L_MAIN, "%s init failed\n", step->name);
+  else
+    DPRINTF(E_INFO, L_MAIN, "%s started in %ld ms\n", step->name,
+	    (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&startup_lck));
+  step->state = (ret != 0) ? STARTUP_FAILED : STARTUP_DONE;
+  CHECK_ERR(L_MAIN, pthread_cond_signal(&startup_cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&startup_lck));
+
+  return NULL;
+}
+
+static bool
+startup_deps_done(struct startup_step *step)
+{
+  int i;
+
+  for (i = 0; i < STARTUP_MAX; i++)
+    {
+      if ((step->deps & DEP(i)) && startup_steps[i].state != STARTUP_DONE)
+	return false;
+    }
+
+  return true;
+}
+
+/* Starts all steps and waits for them. If one fails no further steps are
+ * started, but the ones already running are waited for, so startup_deinit()
+ * can take down whatever did start.
+ */
+static int
+startup_run(const char *webroot)
+{
+  pthread_t tid;
+  bool failed;
+  int running;
+  int i;
+  int ret;
+
+  startup_webroot = webroot;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&startup_lck));
+
+  for (;;)
+    {
+      failed = false;
+      running = 0;
+      for (i = 0; i < STARTUP_MAX; i++)
+	{
+	  if (startup_steps[i].state == STARTUP_FAILED)
+	    failed = true;
+	  else if (startup_steps[i].state == STARTUP_RUNNING)
+	    running++;
+	}
+
+      for (i = 0; i < STARTUP_MAX && !failed; i++)
+	{
+	  if (startup_steps[i].state != STARTUP_WAITING || !startup_deps_done(&startup_steps[i]))
+	    continue;
+
+	  DPRINTF(E_LOG, L_MAIN, "%s init\n", startup_steps[i].name);
+
+	  ret = pthread_create(&tid, NULL, startup_thread, &startup_steps[i]);
+	  if (ret != 0)
+	    {
+	      DPRINTF(E_FATAL, L_MAIN, "Could not spawn startup thread for %s: %s\n", startup_steps[i].name, strerror(ret));
+
+	      startup_steps[i].state = STARTUP_FAILED;
+	      failed = true;
+	      break;
+	    }
+
+	  pthread_detach(tid);
+	  startup_steps[i].state = STARTUP_RUNNING;
+	  running++;
+	}
+
+      if (running == 0)
+	break;
+
+      CHECK_ERR(L_MAIN, pthread_cond_wait(&startup_cond, &startup_lck));
+    }
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&startup_lck));
+
+  return failed ? -1 : 0;
+}
+
+static void
+startup_step_deinit(enum startup_id id)
+{
+  if (startup_steps[id].state != STARTUP_DONE)
+    return;
+
+  DPRINTF(E_LOG, L_MAIN, "%s deinit\n", startup_steps[id].name);
+
+  // The main thread's own connection goes before the database
+  if (id == STARTUP_DB)
+    db_perthread_deinit();
+
+  startup_steps[id].deinit();
+  startup_steps[id].state = STARTUP_WAITING;
+}
+
+/* Deinits in reverse order of the table, which is the order of the deps */
+static void
+startup_deinit(void)
+{
+  int i;
+
+  for (i = STARTUP_MAX - 1; i >= 0; i--)
+    startup_step_deinit(i);
+}
+
 static int
 ffmpeg_lockmgr(void **pmutex, enum AVLockOp op)
 {
@@ -470,6 +694,10 @@ main(int argc, char **argv)
   bool mdns_no_daap;
   bool mdns_no_cname;
   bool mdns_no_web;
+  char *bench_spec;
+  char *replay_path;
+  char *replay_host;
+  int replay_clients;
   bool mdns_no_mpd;
   int loglevel;
   char *logdomains;
@@ -503,6 +731,10 @@ main(int argc, char **argv)
       { "mdns-no-daap", 0, NULL, 513 },
       { "mdns-no-cname",0, NULL, 514 },
       { "mdns-no-web",  0, NULL, 515 },
+      { "bench",        1, NULL, 516 },
+      { "replay",       1, NULL, 517 },
+      { "replay-clients", 1, NULL, 518 },
+      { "replay-host",  1, NULL, 519 },
 
       { NULL,           0, NULL, 0 }
     };
@@ -519,6 +751,10 @@ main(int argc, char **argv)
   mdns_no_daap = false;
   mdns_no_cname = false;
   mdns_no_web = false;
+  bench_spec = NULL;
+  replay_path = NULL;
+  replay_host = NULL;
+  replay_clients = 1;
 
   while ((option = getopt_long(argc, argv, "D:d:c:P:fb:vw:", option_map, NULL)) != -1)
     {
@@ -540,6 +776,29 @@ main(int argc, char **argv)
 	    mdns_no_web = true;
 	    break;
 
+	  case 516:
+	    bench_spec = optarg;
+	    background = false;
+	    break;
+
+	  case 517:
+	    replay_path = optarg;
+	    background = false;
+	    break;
+
+	  case 518:
+	    ret = safe_atoi32(optarg, &replay_clients);
+	    if (ret < 0 || replay_clients <= 0)
+	      {
+		fprintf(stderr, "Error: number of clients must be a positive integer in '--replay-clients %s'\n", optarg);
+		replay_clients = 1;
+	      }
+	    break;
+
+	  case 519:
+	    replay_host = optarg;
+	    break;
+
 	  case 'b':
 	    ffid = optarg;
 	    break;
@@ -710,6 +969,13 @@ main(int argc, char **argv)
       goto daemon_fail;
     }
 
+  /* Start the log writer thread (after forking) */
+  if (cfg_getbool(cfg_getsec(cfg, "general"), "log_async"))
+    logger_async_start();
+
+  /* Before the subsystems, so they can register their metrics */
+  metrics_init();
+
   /* Initialize event base (after forking) */
   CHECK_NULL(L_MAIN, evbase_main = event_base_new());
 
@@ -717,25 +983,28 @@ main(int argc, char **argv)
   CHECK_ERR(L_MAIN, evthread_use_pthreads());
 #endif
 
-  DPRINTF(E_LOG, L_MAIN, "mDNS init\n");
-  ret = mdns_init();
-  if (ret != 0)
+  /* Benchmarks set up what they need themselves, with a temporary database */
+  if (bench_spec)
     {
-      DPRINTF(E_FATAL, L_MAIN, "mDNS init failed\n");
+      ret = (bench_run(bench_spec, webroot) < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+      goto mdns_fail;
+    }
 
-      ret = EXIT_FAILURE;
+  /* The replay is a client of another instance, nothing needs to run here */
+  if (replay_path)
+    {
+      ret = (loadtest_run(replay_path, replay_host, replay_clients) < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
       goto mdns_fail;
     }
 
-  /* Initialize the database before starting */
-  DPRINTF(E_INFO, L_MAIN, "Initializing database\n");
-  ret = db_init();
+  reqlog_init();
+
+  /* Start the subsystems, with the HTTP server answering as soon as it can */
+  ret = startup_run(webroot);
   if (ret < 0)
     {
-      DPRINTF(E_FATAL, L_MAIN, "Database init failed\n");
-
       ret = EXIT_FAILURE;
-      goto db_fail;
+      goto startup_fail;
     }
 
   /* Open a DB connection for the main thread */
@@ -745,69 +1014,10 @@ main(int argc, char **argv)
       DPRINTF(E_FATAL, L_MAIN, "Could not perform perthread DB init for main\n");
 
       ret = EXIT_FAILURE;
-      goto db_fail;
-    }
-
-  /* Spawn worker thread */
-  ret = worker_init();
-  if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Worker thread failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto worker_fail;
-    }
-
-  /* Spawn cache thread */
-  ret = cache_init();
-  if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Cache thread failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto cache_fail;
-    }
-
-  /* Spawn library scan thread */
-  ret = library_init();
-  if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Library thread failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto library_fail;
-    }
-
-  /* Spawn player thread */
-  ret = player_init();
-  if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Player thread failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto player_fail;
-    }
-
-  /* Spawn HTTPd thread */
-  ret = httpd_init(webroot);
-  if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "HTTPd thread failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto httpd_fail;
+      goto startup_fail;
     }
 
 #ifdef MPD
-  /* Spawn MPD thread */
-  ret = mpd_init();
-  if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "MPD thread failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto mpd_fail;
-    }
   mdns_no_mpd = false;
 #else
   mdns_no_mpd = true;
@@ -817,15 +1027,7 @@ main(int argc, char **argv)
   lastfm_init();
 #endif
 
-  /* Start Remote pairing service */
-  ret = remote_pairing_init();
-  if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Remote pairing service failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto remote_fail;
-    }
+  httpd_ready();
 
   /* Register mDNS services */
   ret = register_services(ffid, mdns_no_web, mdns_no_rsp, mdns_no_daap, mdns_no_mpd);
@@ -897,52 +1099,14 @@ main(int argc, char **argv)
    * On a clean shutdown, bring mDNS down first to give a chance
    * to the clients to perform a clean shutdown on their end
    */
-  DPRINTF(E_LOG, L_MAIN, "mDNS deinit\n");
-  mdns_deinit();
+  startup_step_deinit(STARTUP_MDNS);
 
  sig_event_fail:
  signalfd_fail:
  mdns_reg_fail:
-  DPRINTF(E_LOG, L_MAIN, "Remote pairing deinit\n");
-  remote_pairing_deinit();
-
- remote_fail:
-#ifdef MPD
-  DPRINTF(E_LOG, L_MAIN, "MPD deinit\n");
-  mpd_deinit();
-
- mpd_fail:
-#endif
-  DPRINTF(E_LOG, L_MAIN, "HTTPd deinit\n");
-  httpd_deinit();
-
- httpd_fail:
-  DPRINTF(E_LOG, L_MAIN, "Player deinit\n");
-  player_deinit();
-
- player_fail:
-  DPRINTF(E_LOG, L_MAIN, "Library scanner deinit\n");
-  library_deinit();
-
- library_fail:
-  DPRINTF(E_LOG, L_MAIN, "Cache deinit\n");
-  cache_deinit();
-
- cache_fail:
-  DPRINTF(E_LOG, L_MAIN, "Worker deinit\n");
-  worker_deinit();
-
- worker_fail:
-  DPRINTF(E_LOG, L_MAIN, "Database deinit\n");
-  db_perthread_deinit();
-  db_deinit();
-
- db_fail:
-  if (ret == EXIT_FAILURE)
-    {
-      DPRINTF(E_LOG, L_MAIN, "mDNS deinit\n");
-      mdns_deinit();
-    }
+ startup_fail:
+  startup_deinit();
+  reqlog_deinit();
 
  mdns_fail:
  daemon_fail:
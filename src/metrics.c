@@ -0,0 +1,468 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <dirent.h>
+#endif
+
+#include <event2/buffer.h>
+
+#include "metrics.h"
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+
+#define METRICS_MAX 256
+#define METRICS_COLLECTORS_MAX 16
+
+// Upper bounds of the histogram buckets in usec, the last bucket is +Inf
+static const uint64_t metrics_bucket_usec[] =
+  {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+  };
+
+#define METRICS_BUCKETS (sizeof(metrics_bucket_usec) / sizeof(metrics_bucket_usec[0]) + 1)
+
+struct metrics_metric
+{
+  const char *name;
+  const char *labels;
+  const char *help;
+  enum metrics_type type;
+
+  // Counter and gauge value (a gauge is stored as int64_t)
+  uint64_t value;
+
+  // Histogram, the buckets are not cumulative here
+  uint64_t buckets[METRICS_BUCKETS];
+  uint64_t sum_usec;
+  uint64_t count;
+};
+
+static bool metrics_is_enabled;
+
+// Registration is only guarded against itself and rendering, the values are
+// updated with atomics
+static pthread_mutex_t metrics_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_metric metrics[METRICS_MAX];
+static int metrics_count;
+static metrics_collect_cb metrics_collectors[METRICS_COLLECTORS_MAX];
+static int metrics_ncollectors;
+
+
+static const char *
+type_name(enum metrics_type type)
+{
+  switch (type)
+    {
+      case METRICS_COUNTER:
+	return "counter";
+      case METRICS_GAUGE:
+	return "gauge";
+      case METRICS_HISTOGRAM:
+	return "histogram";
+    }
+
+  return "untyped";
+}
+
+static void
+print_sample(struct evbuffer *evbuf, const char *name, const char *suffix, const char *labels, const char *extra, const char *value)
+{
+  bool has_labels = (labels && labels[0]);
+
+  if (!has_labels && !extra)
+    evbuffer_add_printf(evbuf, "%s%s %s\n", name, suffix, value);
+  else
+    evbuffer_add_printf(evbuf, "%s%s{%s%s%s} %s\n", name, suffix,
+			has_labels ? labels : "", (has_labels && extra) ? "," : "", extra ? extra : "", value);
+}
+
+static void
+histogram_render(struct evbuffer *evbuf, struct metrics_metric *metric)
+{
+  char le[32];
+  char value[32];
+  uint64_t cumulative;
+  int i;
+
+  cumulative = 0;
+  for (i = 0; i < METRICS_BUCKETS; i++)
+    {
+      cumulative += __atomic_load_n(&metric->buckets[i], __ATOMIC_RELAXED);
+
+      if (i < METRICS_BUCKETS - 1)
+	snprintf(le, sizeof(le), "le=\"%g\"", metrics_bucket_usec[i] / 1000000.0);
+      else
+	snprintf(le, sizeof(le), "le=\"+Inf\"");
+
+      snprintf(value, sizeof(value), "%" PRIu64, cumulative);
+      print_sample(evbuf, metric->name, "_bucket", metric->labels, le, value);
+    }
+
+  snprintf(value, sizeof(value), "%.6f", __atomic_load_n(&metric->sum_usec, __ATOMIC_RELAXED) / 1000000.0);
+  print_sample(evbuf, metric->name, "_sum", metric->labels, NULL, value);
+
+  // Not necessarily the same as the +Inf bucket if there are concurrent updates
+  snprintf(value, sizeof(value), "%" PRIu64, __atomic_load_n(&metric->count, __ATOMIC_RELAXED));
+  print_sample(evbuf, metric->name, "_count", metric->labels, NULL, value);
+}
+
+static void
+metric_render(struct evbuffer *evbuf, struct metrics_metric *metric)
+{
+  uint64_t value;
+  char buf[32];
+
+  if (metric->type == METRICS_HISTOGRAM)
+    {
+      histogram_render(evbuf, metric);
+      return;
+    }
+
+  value = __atomic_load_n(&metric->value, __ATOMIC_RELAXED);
+  if (metric->type == METRICS_GAUGE)
+    snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)value);
+  else
+    snprintf(buf, sizeof(buf), "%" PRIu64, value);
+
+  print_sample(evbuf, metric->name, "", metric->labels, NULL, buf);
+}
+
+
+/* ---------------------------------- API ---------------------------------- */
+
+struct metrics_metric *
+metrics_register(const char *name, const char *labels, enum metrics_type type, const char *help)
+{
+  struct metrics_metric *metric;
+  int i;
+
+  if (!metrics_is_enabled)
+    return NULL;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&metrics_lck));
+
+  metric = NULL;
+  for (i = 0; i < metrics_count; i++)
+    {
+      if (strcmp(metrics[i].name, name) != 0)
+	continue;
+      if ((labels || metrics[i].labels) && (!labels || !metrics[i].labels || strcmp(metrics[i].labels, labels) != 0))
+	continue;
+
+      metric = &metrics[i];
+      break;
+    }
+
+  if (!metric && metrics_count < METRICS_MAX)
+    {
+      metric = &metrics[metrics_count];
+      metric->name = name;
+      if (labels)
+	CHECK_NULL(L_MAIN, metric->labels = strdup(labels));
+      metric->help = help;
+      metric->type = type;
+      metrics_count++;
+    }
+  else if (!metric)
+    DPRINTF(E_LOG, L_MAIN, "Too many metrics, not registering '%s'\n", name);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&metrics_lck));
+
+  return metric;
+}
+
+void
+metrics_counter_add(struct metrics_metric *metric, uint64_t n)
+{
+  if (!metric)
+    return;
+
+  __atomic_add_fetch(&metric->value, n, __ATOMIC_RELAXED);
+}
+
+void
+metrics_gauge_set(struct metrics_metric *metric, int64_t value)
+{
+  if (!metric)
+    return;
+
+  __atomic_store_n(&metric->value, (uint64_t)value, __ATOMIC_RELAXED);
+}
+
+void
+metrics_gauge_add(struct metrics_metric *metric, int64_t delta)
+{
+  if (!metric)
+    return;
+
+  __atomic_add_fetch(&metric->value, (uint64_t)delta, __ATOMIC_RELAXED);
+}
+
+void
+metrics_histogram_observe(struct metrics_metric *metric, uint64_t usec)
+{
+  int i;
+
+  if (!metric)
+    return;
+
+  for (i = 0; i < METRICS_BUCKETS - 1; i++)
+    {
+      if (usec <= metrics_bucket_usec[i])
+	break;
+    }
+
+  __atomic_add_fetch(&metric->buckets[i], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&metric->sum_usec, usec, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&metric->count, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t
+metrics_clock_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+metrics_collector_add(metrics_collect_cb cb)
+{
+  int i;
+
+  if (!metrics_is_enabled)
+    return;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&metrics_lck));
+
+  for (i = 0; i < metrics_ncollectors; i++)
+    {
+      if (metrics_collectors[i] == cb)
+	break;
+    }
+
+  if (i < metrics_ncollectors)
+    ; /* Already added */
+  else if (metrics_ncollectors < METRICS_COLLECTORS_MAX)
+    metrics_collectors[metrics_ncollectors++] = cb;
+  else
+    DPRINTF(E_LOG, L_MAIN, "Too many metrics collectors\n");
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&metrics_lck));
+}
+
+void
+metrics_print_family(struct evbuffer *evbuf, const char *name, enum metrics_type type, const char *help)
+{
+  evbuffer_add_printf(evbuf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type_name(type));
+}
+
+void
+metrics_print_value(struct evbuffer *evbuf, const char *name, const char *labels, int64_t value)
+{
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%" PRIi64, value);
+  print_sample(evbuf, name, "", labels, NULL, buf);
+}
+
+void
+metrics_print_seconds(struct evbuffer *evbuf, const char *name, const char *labels, uint64_t usec)
+{
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%.6f", usec / 1000000.0);
+  print_sample(evbuf, name, "", labels, NULL, buf);
+}
+
+void
+metrics_render(struct evbuffer *evbuf)
+{
+  metrics_collect_cb collectors[METRICS_COLLECTORS_MAX];
+  bool printed[METRICS_MAX];
+  int ncollectors;
+  int i;
+  int j;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&metrics_lck));
+
+  // The samples of a family must be together, but needn't be registered so
+  memset(printed, 0, sizeof(printed));
+  for (i = 0; i < metrics_count; i++)
+    {
+      if (printed[i])
+	continue;
+
+      metrics_print_family(evbuf, metrics[i].name, metrics[i].type, metrics[i].help);
+
+      for (j = i; j < metrics_count; j++)
+	{
+	  if (printed[j] || strcmp(metrics[j].name, metrics[i].name) != 0)
+	    continue;
+
+	  metric_render(evbuf, &metrics[j]);
+	  printed[j] = true;
+	}
+    }
+
+  ncollectors = metrics_ncollectors;
+  memcpy(collectors, metrics_collectors, sizeof(collectors));
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&metrics_lck));
+
+  // Collectors may have to wait for other threads, so not with the lock held
+  for (i = 0; i < ncollectors; i++)
+    collectors[i](evbuf);
+}
+
+#ifdef __linux__
+// Reads how often a thread went to sleep and was woken up again, i.e. its
+// voluntary context switches
+static int
+thread_wakeups_get(const char *tid, char *comm, size_t commlen, uint64_t *wakeups)
+{
+  char path[64];
+  char line[128];
+  FILE *fp;
+  char *ptr;
+  int ret;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%s/comm", tid);
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  ptr = fgets(comm, commlen, fp);
+  fclose(fp);
+  if (!ptr)
+    return -1;
+
+  comm[strcspn(comm, "\n\"\\")] = '\0';
+
+  snprintf(path, sizeof(path), "/proc/self/task/%s/status", tid);
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  ret = -1;
+  while (fgets(line, sizeof(line), fp))
+    {
+      if (sscanf(line, "voluntary_ctxt_switches: %" SCNu64, wakeups) == 1)
+	{
+	  ret = 0;
+	  break;
+	}
+    }
+
+  fclose(fp);
+
+  return ret;
+}
+
+// Per thread wakeups, so it can be seen which thread keeps an idle server
+// from sleeping, and the rate for the whole process since the last scrape
+static void
+wakeups_collect(struct evbuffer *evbuf)
+{
+  static pthread_mutex_t wakeups_lck = PTHREAD_MUTEX_INITIALIZER;
+  static uint64_t last_total;
+  static uint64_t last_usec;
+  struct dirent *de;
+  DIR *dir;
+  char comm[32];
+  char labels[96];
+  uint64_t wakeups;
+  uint64_t total;
+  uint64_t now;
+  double rate;
+
+  dir = opendir("/proc/self/task");
+  if (!dir)
+    return;
+
+  metrics_print_family(evbuf, "forked_daapd_thread_wakeups_total", METRICS_COUNTER, "Times the thread was woken up after sleeping");
+
+  total = 0;
+  while ((de = readdir(dir)))
+    {
+      if (de->d_name[0] == '.')
+	continue;
+
+      if (thread_wakeups_get(de->d_name, comm, sizeof(comm), &wakeups) < 0)
+	continue;
+
+      snprintf(labels, sizeof(labels), "thread=\"%s\",tid=\"%s\"", comm, de->d_name);
+      metrics_print_value(evbuf, "forked_daapd_thread_wakeups_total", labels, wakeups);
+
+      total += wakeups;
+    }
+
+  closedir(dir);
+
+  now = metrics_clock_usec();
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&wakeups_lck));
+
+  // Threads that have exited since the last scrape make the total go down
+  if (last_usec > 0 && now > last_usec && total >= last_total)
+    rate = (total - last_total) * 1000000.0 / (now - last_usec);
+  else
+    rate = 0;
+
+  last_total = total;
+  last_usec = now;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&wakeups_lck));
+
+  metrics_print_family(evbuf, "forked_daapd_wakeups_per_second", METRICS_GAUGE, "Wakeups of all threads per second since the previous scrape");
+  evbuffer_add_printf(evbuf, "forked_daapd_wakeups_per_second %.3f\n", rate);
+}
+#endif
+
+bool
+metrics_enabled(void)
+{
+  return metrics_is_enabled;
+}
+
+void
+metrics_init(void)
+{
+  metrics_is_enabled = cfg_getbool(cfg_getsec(cfg, "general"), "metrics");
+  if (metrics_is_enabled)
+    DPRINTF(E_INFO, L_MAIN, "Metrics are enabled, see /metrics\n");
+
+#ifdef __linux__
+  metrics_collector_add(wakeups_collect);
+#endif
+}
@@ -0,0 +1,85 @@
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <event2/buffer.h>
+
+/* Prometheus style metrics, served by httpd at /metrics if enabled with the
+ * general section's metrics option.
+ *
+ * Subsystems register their metrics at init and update them from any thread,
+ * the updates are atomic and cheap. Metrics that a subsystem already keeps in
+ * its own statistics are instead printed by a collector callback, which is
+ * called from the httpd thread when the metrics are requested.
+ *
+ * If metrics are disabled (or there are too many) registration returns NULL,
+ * and the update functions do nothing when given NULL.
+ */
+
+enum metrics_type
+{
+  METRICS_COUNTER,
+  METRICS_GAUGE,
+  METRICS_HISTOGRAM, // Durations, observed in usec and exported in seconds
+};
+
+struct metrics_metric;
+
+typedef void (*metrics_collect_cb)(struct evbuffer *evbuf);
+
+/*
+ * Registers a metric. Registering the same name and labels again returns the
+ * existing metric. Labels are copied, the other strings must remain valid, so
+ * normally they are literals.
+ *
+ * @in name      metric family name, e.g. "forked_daapd_db_query_seconds"
+ * @in labels    labels without braces, e.g. "handler=\"daap\"", or NULL
+ * @in type      type of metric, must be the same for all of the family
+ * @in help      description of the family
+ * @return       the metric, or NULL if metrics are disabled
+ */
+struct metrics_metric *
+metrics_register(const char *name, const char *labels, enum metrics_type type, const char *help);
+
+void
+metrics_counter_add(struct metrics_metric *metric, uint64_t n);
+
+void
+metrics_gauge_set(struct metrics_metric *metric, int64_t value);
+
+void
+metrics_gauge_add(struct metrics_metric *metric, int64_t delta);
+
+void
+metrics_histogram_observe(struct metrics_metric *metric, uint64_t usec);
+
+/* Monotonic clock in usec, for timing what is observed in histograms */
+uint64_t
+metrics_clock_usec(void);
+
+void
+metrics_collector_add(metrics_collect_cb cb);
+
+/* For collectors: prints the HELP and TYPE lines of a family, then its samples */
+void
+metrics_print_family(struct evbuffer *evbuf, const char *name, enum metrics_type type, const char *help);
+
+void
+metrics_print_value(struct evbuffer *evbuf, const char *name, const char *labels, int64_t value);
+
+void
+metrics_print_seconds(struct evbuffer *evbuf, const char *name, const char *labels, uint64_t usec);
+
+/* Adds all metrics to evbuf in the Prometheus text format */
+void
+metrics_render(struct evbuffer *evbuf);
+
+bool
+metrics_enabled(void);
+
+void
+metrics_init(void);
+
+#endif /* !__METRICS_H__ */
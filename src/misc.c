@@ -35,6 +35,12 @@
 #include <stdio.h>
 #include <limits.h>
 #include <sys/param.h>
+#include <sys/uio.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 #ifndef CLOCK_REALTIME
 #include <sys/time.h>
 #endif
@@ -1229,6 +1235,418 @@ timer_getoverrun(timer_t timer_id)
 
 #endif /* HAVE_MACH_CLOCK */
 
+int
+ringbuffer_init(struct ringbuffer *buf, size_t size)
+{
+  memset(buf, 0, sizeof(struct ringbuffer));
+
+  // One byte is never used, so that a full and an empty buffer can be told apart
+  buf->size = size + 1;
+  buf->buffer = malloc(buf->size);
+  if (!buf->buffer)
+    return -1;
+
+  return 0;
+}
+
+void
+ringbuffer_free(struct ringbuffer *buf, int content_only)
+{
+  if (!buf)
+    return;
+
+  free(buf->buffer);
+
+  if (!content_only)
+    free(buf);
+  else
+    memset(buf, 0, sizeof(struct ringbuffer));
+}
+
+void
+ringbuffer_reset(struct ringbuffer *buf)
+{
+  __atomic_store_n(&buf->write_pos, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&buf->read_pos, 0, __ATOMIC_RELEASE);
+}
+
+size_t
+ringbuffer_len(struct ringbuffer *buf)
+{
+  size_t write_pos;
+  size_t read_pos;
+
+  write_pos = __atomic_load_n(&buf->write_pos, __ATOMIC_ACQUIRE);
+  read_pos = __atomic_load_n(&buf->read_pos, __ATOMIC_ACQUIRE);
+
+  return (write_pos + buf->size - read_pos) % buf->size;
+}
+
+size_t
+ringbuffer_space(struct ringbuffer *buf)
+{
+  return buf->size - 1 - ringbuffer_len(buf);
+}
+
+size_t
+ringbuffer_write(struct ringbuffer *buf, const void *src, size_t srclen)
+{
+  size_t write_pos;
+  size_t read_pos;
+  size_t space;
+  size_t len;
+  size_t first;
+
+  write_pos = __atomic_load_n(&buf->write_pos, __ATOMIC_RELAXED);
+  read_pos = __atomic_load_n(&buf->read_pos, __ATOMIC_ACQUIRE);
+
+  space = (read_pos + buf->size - write_pos - 1) % buf->size;
+  len = (srclen < space) ? srclen : space;
+  if (len == 0)
+    return 0;
+
+  first = buf->size - write_pos;
+  if (first > len)
+    first = len;
+
+  memcpy(buf->buffer + write_pos, src, first);
+  memcpy(buf->buffer, (const uint8_t *)src + first, len - first);
+
+  // Publishes the data to the consumer
+  __atomic_store_n(&buf->write_pos, (write_pos + len) % buf->size, __ATOMIC_RELEASE);
+
+  return len;
+}
+
+ssize_t
+ringbuffer_write_fd(struct ringbuffer *buf, int fd, size_t maxlen)
+{
+  struct iovec iov[2];
+  size_t write_pos;
+  size_t read_pos;
+  size_t space;
+  size_t len;
+  size_t first;
+  ssize_t got;
+
+  write_pos = __atomic_load_n(&buf->write_pos, __ATOMIC_RELAXED);
+  read_pos = __atomic_load_n(&buf->read_pos, __ATOMIC_ACQUIRE);
+
+  space = (read_pos + buf->size - write_pos - 1) % buf->size;
+  len = (maxlen < space) ? maxlen : space;
+  if (len == 0)
+    return 0;
+
+  first = buf->size - write_pos;
+  if (first > len)
+    first = len;
+
+  iov[0].iov_base = buf->buffer + write_pos;
+  iov[0].iov_len = first;
+  iov[1].iov_base = buf->buffer;
+  iov[1].iov_len = len - first;
+
+  got = readv(fd, iov, (len > first) ? 2 : 1);
+  if (got <= 0)
+    return got;
+
+  // Publishes the data to the consumer
+  __atomic_store_n(&buf->write_pos, (write_pos + got) % buf->size, __ATOMIC_RELEASE);
+
+  return got;
+}
+
+size_t
+ringbuffer_read(void *dst, size_t dstlen, struct ringbuffer *buf)
+{
+  size_t write_pos;
+  size_t read_pos;
+  size_t avail;
+  size_t len;
+  size_t first;
+
+  read_pos = __atomic_load_n(&buf->read_pos, __ATOMIC_RELAXED);
+  write_pos = __atomic_load_n(&buf->write_pos, __ATOMIC_ACQUIRE);
+
+  avail = (write_pos + buf->size - read_pos) % buf->size;
+  len = (dstlen < avail) ? dstlen : avail;
+  if (len == 0)
+    return 0;
+
+  if (dst)
+    {
+      first = buf->size - read_pos;
+      if (first > len)
+	first = len;
+
+      memcpy(dst, buf->buffer + read_pos, first);
+      memcpy((uint8_t *)dst + first, buf->buffer, len - first);
+    }
+
+  // Hands the space back to the producer
+  __atomic_store_n(&buf->read_pos, (read_pos + len) % buf->size, __ATOMIC_RELEASE);
+
+  return len;
+}
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+};
+
+// Allocations are aligned to 8 bytes, so the data starts at an aligned offset
+#define ARENA_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define ARENA_DATA(block) ((uint8_t *)(block) + ARENA_ALIGN(sizeof(struct arena_block)))
+
+void *
+arena_calloc(struct arena *arena, size_t size)
+{
+  struct arena_block *block;
+  size_t block_size;
+  void *ptr;
+
+  size = ARENA_ALIGN(size);
+
+  block = arena->blocks;
+  if (!block || block->size - block->used < size)
+    {
+      block_size = arena->block_size ? arena->block_size : ARENA_BLOCK_SIZE;
+      if (size > block_size)
+	block_size = size;
+
+      block = malloc(ARENA_ALIGN(sizeof(struct arena_block)) + block_size);
+      if (!block)
+	return NULL;
+
+      block->size = block_size;
+      block->used = 0;
+      block->next = arena->blocks;
+      arena->blocks = block;
+    }
+
+  ptr = ARENA_DATA(block) + block->used;
+  block->used += size;
+
+  memset(ptr, 0, size);
+
+  return ptr;
+}
+
+char *
+arena_strdup(struct arena *arena, const char *str)
+{
+  size_t len;
+  char *copy;
+
+  len = strlen(str) + 1;
+
+  copy = arena_calloc(arena, len);
+  if (!copy)
+    return NULL;
+
+  memcpy(copy, str, len);
+
+  return copy;
+}
+
+bool
+arena_contains(struct arena *arena, const void *ptr)
+{
+  struct arena_block *block;
+
+  for (block = arena->blocks; block; block = block->next)
+    {
+      if ((const uint8_t *)ptr >= ARENA_DATA(block) && (const uint8_t *)ptr < ARENA_DATA(block) + block->used)
+	return true;
+    }
+
+  return false;
+}
+
+void
+arena_reset(struct arena *arena)
+{
+  struct arena_block *block;
+
+  if (!arena->blocks)
+    return;
+
+  // The oldest block is the last in the list
+  while (arena->blocks->next)
+    {
+      block = arena->blocks;
+      arena->blocks = block->next;
+      free(block);
+    }
+
+  arena->blocks->used = 0;
+}
+
+void
+arena_free(struct arena *arena)
+{
+  struct arena_block *block;
+
+  while ((block = arena->blocks))
+    {
+      arena->blocks = block->next;
+      free(block);
+    }
+}
+
+char *
+string_cache_get(struct string_cache *cache, const char *key)
+{
+  struct string_cache_entry *entry;
+  uint32_t hash;
+  char *value;
+
+  if (!key)
+    return NULL;
+
+  hash = djb_hash(key, strlen(key));
+  entry = &cache->entries[hash % STRING_CACHE_SIZE];
+  value = NULL;
+
+  pthread_mutex_lock(&cache->lck);
+
+  if (entry->key && entry->hash == hash && strcmp(entry->key, key) == 0)
+    {
+      if (cache->max_age == 0 || time(NULL) - entry->stamp < cache->max_age)
+	value = strdup(entry->value);
+    }
+
+  pthread_mutex_unlock(&cache->lck);
+
+  return value;
+}
+
+void
+string_cache_add(struct string_cache *cache, const char *key, const char *value)
+{
+  struct string_cache_entry *entry;
+  uint32_t hash;
+  char *k;
+  char *v;
+
+  if (!key || !value)
+    return;
+
+  k = strdup(key);
+  v = strdup(value);
+  if (!k || !v)
+    {
+      free(k);
+      free(v);
+      return;
+    }
+
+  hash = djb_hash(key, strlen(key));
+  entry = &cache->entries[hash % STRING_CACHE_SIZE];
+
+  pthread_mutex_lock(&cache->lck);
+
+  free(entry->key);
+  free(entry->value);
+
+  entry->hash = hash;
+  entry->key = k;
+  entry->value = v;
+  entry->stamp = time(NULL);
+
+  pthread_mutex_unlock(&cache->lck);
+}
+
+#define STRINTERN_BUCKETS 4096
+
+struct strintern_entry {
+  struct strintern_entry *next;
+  uint32_t hash;
+  unsigned int refcount;
+  char str[];
+};
+
+static pthread_mutex_t strintern_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct strintern_entry *strintern_buckets[STRINTERN_BUCKETS];
+static unsigned int strintern_count;
+
+char *
+strintern_get(const char *str)
+{
+  struct strintern_entry *entry;
+  uint32_t hash;
+  size_t len;
+
+  len = strlen(str);
+  hash = djb_hash(str, len);
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&strintern_lck));
+
+  for (entry = strintern_buckets[hash % STRINTERN_BUCKETS]; entry; entry = entry->next)
+    {
+      if (entry->hash == hash && strcmp(entry->str, str) == 0)
+	break;
+    }
+
+  if (entry)
+    entry->refcount++;
+  else
+    {
+      CHECK_NULL(L_MISC, entry = malloc(sizeof(struct strintern_entry) + len + 1));
+
+      memcpy(entry->str, str, len + 1);
+      entry->hash = hash;
+      entry->refcount = 1;
+      entry->next = strintern_buckets[hash % STRINTERN_BUCKETS];
+      strintern_buckets[hash % STRINTERN_BUCKETS] = entry;
+
+      __atomic_add_fetch(&strintern_count, 1, __ATOMIC_RELEASE);
+    }
+
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&strintern_lck));
+
+  return entry->str;
+}
+
+bool
+strintern_put(const char *ptr)
+{
+  struct strintern_entry **prev;
+  struct strintern_entry *entry;
+  uint32_t hash;
+
+  // Skips the hashing if nothing has been interned
+  if (!ptr || __atomic_load_n(&strintern_count, __ATOMIC_ACQUIRE) == 0)
+    return false;
+
+  hash = djb_hash(ptr, strlen(ptr));
+
+  CHECK_ERR(L_MISC, pthread_mutex_lock(&strintern_lck));
+
+  for (prev = &strintern_buckets[hash % STRINTERN_BUCKETS]; (entry = *prev); prev = &entry->next)
+    {
+      if (entry->str == ptr)
+	break;
+    }
+
+  if (entry)
+    {
+      entry->refcount--;
+      if (entry->refcount == 0)
+	{
+	  *prev = entry->next;
+	  free(entry);
+
+	  __atomic_sub_fetch(&strintern_count, 1, __ATOMIC_RELEASE);
+	}
+    }
+
+  CHECK_ERR(L_MISC, pthread_mutex_unlock(&strintern_lck));
+
+  return (entry != NULL);
+}
+
 int
 mutex_init(pthread_mutex_t *mutex)
 {
@@ -1243,6 +1661,140 @@ mutex_init(pthread_mutex_t *mutex)
   return err;
 }
 
+#ifdef __linux__
+// Parses a list of cpus such as "0,2-3"
+static int
+cpuset_parse(cpu_set_t *cpuset, const char *list)
+{
+  char *copy;
+  char *token;
+  char *ptr;
+  char *end;
+  long first;
+  long last;
+  long i;
+
+  CPU_ZERO(cpuset);
+
+  CHECK_NULL(L_MISC, copy = strdup(list));
+
+  for (token = strtok_r(copy, ",", &ptr); token; token = strtok_r(NULL, ",", &ptr))
+    {
+      first = strtol(token, &end, 10);
+      if (end == token)
+	goto error;
+
+      last = first;
+      if (*end == '-')
+	{
+	  token = end + 1;
+	  last = strtol(token, &end, 10);
+	  if (end == token)
+	    goto error;
+	}
+
+      if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+	goto error;
+
+      for (i = first; i <= last; i++)
+	CPU_SET(i, cpuset);
+    }
+
+  free(copy);
+  return 0;
+
+ error:
+  free(copy);
+  return -1;
+}
+
+static void
+thread_nice_set(int nice, bool *warned)
+{
+  int ret;
+
+  // On Linux the nice value of a thread id only applies to that thread
+  ret = setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice);
+  if (ret < 0 && !__atomic_exchange_n(warned, true, __ATOMIC_RELAXED))
+    DPRINTF(E_WARN, L_MISC, "Could not set thread nice value to %d: %s\n", nice, strerror(errno));
+}
+
+static void
+thread_affinity_set(const char *cpus, bool *warned)
+{
+  cpu_set_t cpuset;
+  int ret;
+
+  if (!cpus || cpus[0] == '\0')
+    return;
+
+  ret = cpuset_parse(&cpuset, cpus);
+  if (ret < 0)
+    {
+      if (!__atomic_exchange_n(warned, true, __ATOMIC_RELAXED))
+	DPRINTF(E_LOG, L_MISC, "Invalid list of cpus '%s', thread affinity not set\n", cpus);
+      return;
+    }
+
+  ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+  if (ret != 0 && !__atomic_exchange_n(warned, true, __ATOMIC_RELAXED))
+    DPRINTF(E_WARN, L_MISC, "Could not set thread affinity to cpus '%s': %s\n", cpus, strerror(ret));
+}
+#endif
+
+void
+thread_sched_set(enum thread_class thread_class)
+{
+  static bool warned_sched;
+  static bool warned_nice[2];
+  static bool warned_affinity[2];
+  cfg_t *general;
+  struct sched_param param;
+  const char *policy;
+  int priority;
+  int nice;
+  int ret;
+
+  general = cfg_getsec(cfg, "general");
+
+  if (thread_class == THREAD_CLASS_SCAN)
+    {
+#ifdef __linux__
+      nice = cfg_getint(general, "scan_thread_nice");
+      if (nice > 0)
+	thread_nice_set(nice, &warned_nice[thread_class]);
+
+      thread_affinity_set(cfg_getstr(general, "scan_thread_cpus"), &warned_affinity[thread_class]);
+#endif
+      return;
+    }
+
+  policy = cfg_getstr(general, "audio_thread_scheduling");
+  priority = cfg_getint(general, "audio_thread_priority");
+
+  if (strcmp(policy, "fifo") == 0 || strcmp(policy, "rr") == 0)
+    {
+      memset(&param, 0, sizeof(struct sched_param));
+      param.sched_priority = priority;
+
+      ret = pthread_setschedparam(pthread_self(), (policy[0] == 'f') ? SCHED_FIFO : SCHED_RR, &param);
+      if (ret == 0)
+	policy = NULL;
+      else if (!__atomic_exchange_n(&warned_sched, true, __ATOMIC_RELAXED))
+	DPRINTF(E_WARN, L_MISC, "Could not set %s scheduling with priority %d: %s, trying a lower nice value instead\n",
+		policy, priority, strerror(ret));
+    }
+  else if (strcmp(policy, "nice") != 0)
+    policy = NULL;
+
+#ifdef __linux__
+  if (policy)
+    thread_nice_set(-priority, &warned_nice[thread_class]);
+
+  thread_affinity_set(cfg_getstr(general, "audio_thread_cpus"), &warned_affinity[thread_class]);
+#endif
+}
+
 void
 log_fatal_err(int domain, const char *func, int line, int err)
 {
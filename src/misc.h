@@ -10,6 +10,7 @@
 #include <stdbool.h>
 #include <time.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 /* Samples to bytes, bytes to samples */
 #define STOB(s) ((s) * 4)
@@ -29,6 +30,48 @@ struct keyval {
   struct onekeyval *tail;
 };
 
+/* Fixed size byte ring buffer for one producer and one consumer thread. The
+   producer only moves write_pos and the consumer only moves read_pos, so the
+   two don't need to lock each other out. */
+/* Small fixed size cache of derived strings, e.g. a query filter and the SQL
+   it compiles to. Entries are direct mapped by key hash, so a colliding key
+   just replaces the previous entry. */
+#define STRING_CACHE_SIZE 64
+
+struct string_cache_entry {
+  uint32_t hash;
+  char *key;
+  char *value;
+  time_t stamp;
+};
+
+struct string_cache {
+  pthread_mutex_t lck;
+  int max_age; // Seconds an entry is valid, 0 means no expiry
+  struct string_cache_entry entries[STRING_CACHE_SIZE];
+};
+
+#define STRING_CACHE_INITIALIZER(age) { PTHREAD_MUTEX_INITIALIZER, (age) }
+
+struct ringbuffer {
+  uint8_t *buffer;
+  size_t size;
+  size_t write_pos;
+  size_t read_pos;
+};
+
+/* Allocations from an arena can't be freed one by one, they are all released
+   together by arena_reset() or arena_free(). Zero initialize the struct before
+   first use, a block_size of 0 means ARENA_BLOCK_SIZE. */
+#define ARENA_BLOCK_SIZE 16384
+
+struct arena_block;
+
+struct arena {
+  struct arena_block *blocks;
+  size_t block_size;
+};
+
 
 char **
 buildopts_get(void);
@@ -165,10 +208,93 @@ timespec_cmp(struct timespec time1, struct timespec time2);
 struct timespec
 timespec_reltoabs(struct timespec relative);
 
+/* Allocates a ring buffer that can hold size bytes */
+int
+ringbuffer_init(struct ringbuffer *buf, size_t size);
+
+void
+ringbuffer_free(struct ringbuffer *buf, int content_only);
+
+/* Empties the buffer, must not be called while a producer or consumer is
+   using it */
+void
+ringbuffer_reset(struct ringbuffer *buf);
+
+/* Number of bytes that can be read, safe to call from both threads */
+size_t
+ringbuffer_len(struct ringbuffer *buf);
+
+/* Number of bytes that can be written, safe to call from both threads */
+size_t
+ringbuffer_space(struct ringbuffer *buf);
+
+/* Producer: copies up to srclen bytes into the buffer, returns bytes written */
+size_t
+ringbuffer_write(struct ringbuffer *buf, const void *src, size_t srclen);
+
+/* Producer: reads up to maxlen bytes from fd directly into the buffer with
+   readv(), returns the result of readv() (0 if the buffer is full) */
+ssize_t
+ringbuffer_write_fd(struct ringbuffer *buf, int fd, size_t maxlen);
+
+/* Consumer: copies up to dstlen bytes out of the buffer, returns bytes read.
+   If dst is NULL the data is just discarded. */
+size_t
+ringbuffer_read(void *dst, size_t dstlen, struct ringbuffer *buf);
+
+/* Returns zeroed memory from the arena, or NULL if out of memory */
+void *
+arena_calloc(struct arena *arena, size_t size);
+
+char *
+arena_strdup(struct arena *arena, const char *str);
+
+/* True if ptr was allocated from the arena (and it hasn't been reset since) */
+bool
+arena_contains(struct arena *arena, const void *ptr);
+
+/* Releases all allocations, but keeps the first block for reuse */
+void
+arena_reset(struct arena *arena);
+
+void
+arena_free(struct arena *arena);
+
+/* Returns a copy of the value cached for key (caller must free), or NULL */
+char *
+string_cache_get(struct string_cache *cache, const char *key);
+
+void
+string_cache_add(struct string_cache *cache, const char *key, const char *value);
+
+/* Interned strings are shared by everyone holding the same value, which saves
+   memory for tag values like artist and genre that repeat across a library.
+   strintern_get() returns the shared copy of str, which must not be modified,
+   and strintern_put() gives it back. strintern_put() returns false if the
+   pointer is not an interned string, so the caller can free() it instead. */
+char *
+strintern_get(const char *str);
+
+bool
+strintern_put(const char *ptr);
+
 /* initialize mutex with error checking (not default on all platforms) */
 int
 mutex_init(pthread_mutex_t *mutex);
 
+enum thread_class
+{
+  THREAD_CLASS_AUDIO, // The player, input and output writer threads
+  THREAD_CLASS_SCAN,  // The library scanner threads
+};
+
+/* Applies the configured scheduling policy and CPU affinity for the class to
+ * the calling thread. If that is not permitted it falls back to what is, and
+ * logs why (once), but it is never an error.
+ */
+void
+thread_sched_set(enum thread_class thread_class);
+
 /* Check that the function returns 0, logging a fatal error referencing
    returned error (type errno) if it fails, and aborts the process.
    Example: CHECK_ERR(L_MAIN, my_function()); */
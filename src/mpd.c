@@ -54,13 +54,17 @@
 #include "library.h"
 #include "listener.h"
 #include "logger.h"
+#include "metrics.h"
 #include "misc.h"
 #include "player.h"
 #include "remote_pairing.h"
+#include "reqlog.h"
 
 
 #define MPD_ALL_IDLE_LISTENER_EVENTS (LISTENER_PLAYER | LISTENER_QUEUE | LISTENER_VOLUME | LISTENER_SPEAKER | LISTENER_OPTIONS | LISTENER_DATABASE | LISTENER_UPDATE | LISTENER_STORED_PLAYLIST | LISTENER_RATING)
 #define MPD_RATING_FACTOR 10.0
+#define MPD_BINARYLIMIT_DEFAULT 8192
+#define MPD_BINARYLIMIT_MIN 64
 
 static pthread_t tid_mpd;
 
@@ -77,6 +81,42 @@ struct evconnlistener *mpd_listener;
 static char *default_pl_dir;
 static bool allow_modifying_stored_playlists;
 
+// Replies to "list" commands, keyed by library revision and arguments
+static struct string_cache list_cache = STRING_CACHE_INITIALIZER(0);
+static struct event *list_prewarm_ev;
+static bool list_prewarm;
+
+static struct metrics_metric *mpd_metric_duration;
+
+// Clients ask for these when they open their library views
+static char *list_prewarm_tags[] = { "artist", "albumartist", "album", "genre", "date" };
+
+/* The current (or when stopped, the first) and the next queue item, so that
+ * "status" and "currentsong" from idle clients that all wake up at once don't
+ * each look them up. Only used by the mpd thread, and valid as long as the
+ * queue revision and the player's item and shuffle mode stay the same.
+ */
+struct mpd_queue_snapshot
+{
+  bool valid;
+  unsigned int queue_rev;
+  bool stopped;
+  uint32_t item_id;
+  char shuffle;
+
+  int queue_version;
+  int queue_length;
+
+  // Reply to "currentsong", NULL if there is no item or it could not be added
+  struct evbuffer *currentsong;
+  uint32_t id;       // 0 if there is no item
+  uint32_t pos;
+  uint32_t next_id;  // 0 if there is no next item
+  uint32_t next_pos;
+};
+
+static struct mpd_queue_snapshot queue_snapshot;
+
 #define COMMAND_ARGV_MAX 37
 
 /* MPD error codes (taken from ack.h) */
@@ -148,6 +188,77 @@ static const char * const ffmpeg_mime_types[] = { "application/flv", "applicatio
 /*
  * MPD client connection data
  */
+/* Output of listall, listallinfo and playlistinfo is not built completely in
+ * memory, instead it is added in steps while the client reads it. Steps are
+ * taken while the client's output buffer holds less than MPD_STREAM_LOWAT, and
+ * the socket bufferevent below it takes at most MPD_STREAM_HIWAT.
+ */
+#define MPD_STREAM_LOWAT (64 * 1024)
+#define MPD_STREAM_HIWAT (256 * 1024)
+/* Number of queue items per playlistinfo step */
+#define MPD_STREAM_BATCH 500
+
+struct mpd_stream;
+
+/* Adds the next part of the output to evbuf and sets done after the last one.
+ * Returns 0 on success, otherwise an ack error code and sets errmsg.
+ */
+typedef int (*mpd_stream_step)(struct evbuffer *evbuf, struct mpd_stream *stream, bool *done, char **errmsg);
+
+/* A directory of a listall/listallinfo stream with its subdirectories */
+struct mpd_stream_dir
+{
+  int dir_id;
+  int nsubdirs;
+  int next;  // The subdirectory to descend into next
+  int *subdir_ids;
+  char **subdir_paths;
+};
+
+struct mpd_stream
+{
+  mpd_stream_step step;
+  char *command;
+
+  // listall, listallinfo: the directories from the top one down to the one
+  // being listed
+  int listinfo;
+  struct mpd_stream_dir *dirs;
+  int ndirs;
+  int dirs_size;
+
+  // playlistinfo
+  char *filter;
+  int offset;
+};
+
+static void
+mpd_stream_dir_clear(struct mpd_stream_dir *dir)
+{
+  int i;
+
+  for (i = 0; i < dir->nsubdirs; i++)
+    free(dir->subdir_paths[i]);
+
+  free(dir->subdir_paths);
+  free(dir->subdir_ids);
+}
+
+static void
+mpd_stream_free(struct mpd_stream *stream)
+{
+  if (!stream)
+    return;
+
+  while (stream->ndirs > 0)
+    mpd_stream_dir_clear(&stream->dirs[--stream->ndirs]);
+
+  free(stream->dirs);
+  free(stream->filter);
+  free(stream->command);
+  free(stream);
+}
+
 struct mpd_client_ctx
 {
   // True if the connection is already authenticated or does not need authentication
@@ -165,6 +276,36 @@ struct mpd_client_ctx
   // The output buffer for the client (used to send data to the client)
   struct evbuffer *evbuffer;
 
+  // Cursor after the last row of the previous find/search window, with the
+  // filter, sort and end position of that window. If the next window starts
+  // there, the query continues from the cursor instead of skipping all the
+  // rows before it again.
+  char *window_cursor;
+  char *window_filter;
+  enum sort_type window_sort;
+  int window_end;
+
+  // Output of a command that is still being written, see mpd_write_cb(). The
+  // rest of the command sequence is processed when it is done, continuing with
+  // stream_listtype and stream_ncmd if stream_resume is set.
+  struct mpd_stream *stream;
+  enum command_list_type stream_listtype;
+  int stream_ncmd;
+  bool stream_resume;
+
+  // Maximum size of a binary chunk (set by the binarylimit command)
+  size_t binarylimit;
+
+  // Artwork for albumart/readpicture, kept so that the following chunks of
+  // the same image don't run the artwork pipeline again
+  char *art_path;
+  unsigned int art_revision;
+  int art_format;
+  struct evbuffer *art;
+
+  // Peer address and port, names the connection in the request log
+  char *session;
+
   struct mpd_client_ctx *next;
 };
 
@@ -202,9 +343,65 @@ free_mpd_client_ctx(void *ctx)
       client = client->next;
     }
 
+  mpd_stream_free(client_ctx->stream);
+  free(client_ctx->art_path);
+  if (client_ctx->art)
+    evbuffer_free(client_ctx->art);
+  free(client_ctx->window_cursor);
+  free(client_ctx->window_filter);
+  free(client_ctx->session);
   free(client_ctx);
 }
 
+static bool
+mpd_window_filter_equal(const char *a, const char *b)
+{
+  if (!a || !b)
+    return (a == b);
+
+  return (strcmp(a, b) == 0);
+}
+
+/*
+ * Switches a find/search query with a window to keyset pagination, if the
+ * window continues right where the client's previous one ended
+ */
+static void
+mpd_window_cursor_apply(struct mpd_client_ctx *ctx, struct query_params *qp)
+{
+  if (!ctx || !ctx->window_cursor || (qp->idx_type != I_SUB))
+    return;
+
+  if ((qp->offset != ctx->window_end) || (qp->sort != ctx->window_sort) || !mpd_window_filter_equal(qp->filter, ctx->window_filter))
+    return;
+
+  DPRINTF(E_DBG, L_MPD, "Continuing window at %d from cursor\n", qp->offset);
+
+  qp->cursor = ctx->window_cursor;
+  qp->idx_type = I_FIRST;
+}
+
+/*
+ * Remembers the cursor made from the last row of a window (takes ownership)
+ */
+static void
+mpd_window_cursor_save(struct mpd_client_ctx *ctx, struct query_params *qp, int window_end, char *cursor)
+{
+  if (!ctx)
+    {
+      free(cursor);
+      return;
+    }
+
+  free(ctx->window_cursor);
+  free(ctx->window_filter);
+
+  ctx->window_cursor = cursor;
+  ctx->window_filter = (cursor && qp->filter) ? strdup(qp->filter) : NULL;
+  ctx->window_sort = qp->sort;
+  ctx->window_end = window_end;
+}
+
 struct output
 {
   unsigned short shortid;
@@ -584,6 +781,44 @@ mpd_add_db_media_file_info(struct evbuffer *evbuf, struct db_media_file_info *db
   return ret;
 }
 
+/*
+ * Returns a condition for items where one of the given columns (space
+ * separated) contains value. Uses the full-text index if possible, otherwise
+ * LIKE. Free the result with free().
+ */
+static char *
+mpd_contains_clause(const char *columns, const char *value)
+{
+  char *clause;
+  char *cols;
+  char *col;
+  char *ptr;
+  char *tmp;
+
+  clause = db_fts_contains(columns, value);
+  if (clause)
+    return clause;
+
+  cols = strdup(columns);
+  for (col = strtok_r(cols, " ", &ptr); col; col = strtok_r(NULL, " ", &ptr))
+    {
+      if (clause)
+	{
+	  tmp = db_mprintf("%s OR %s LIKE '%%%q%%'", clause, col, value);
+	  free(clause);
+	  clause = tmp;
+	}
+      else
+	clause = db_mprintf("%s LIKE '%%%q%%'", col, value);
+    }
+  free(cols);
+
+  tmp = db_mprintf("(%s)", clause);
+  free(clause);
+
+  return tmp;
+}
+
 static int
 mpd_get_query_params_find(int argc, char **argv, struct query_params *qp)
 {
@@ -602,7 +837,7 @@ mpd_get_query_params_find(int argc, char **argv, struct query_params *qp)
     {
       if (0 == strcasecmp(argv[i], "any"))
 	{
-	  c1 = db_mprintf("(f.artist LIKE '%%%q%%' OR f.album LIKE '%%%q%%' OR f.title LIKE '%%%q%%')", argv[i + 1], argv[i + 1], argv[i + 1]);
+	  c1 = mpd_contains_clause("f.artist f.album f.title", argv[i + 1]);
 	}
       else if (0 == strcasecmp(argv[i], "file"))
 	{
@@ -721,7 +956,7 @@ mpd_get_query_params_search(int argc, char **argv, struct query_params *qp)
     {
       if (0 == strcasecmp(argv[i], "any"))
 	{
-	  c1 = db_mprintf("(f.artist LIKE '%%%q%%' OR f.album LIKE '%%%q%%' OR f.title LIKE '%%%q%%')", argv[i + 1], argv[i + 1], argv[i + 1]);
+	  c1 = mpd_contains_clause("f.artist f.album f.title", argv[i + 1]);
 	}
       else if (0 == strcasecmp(argv[i], "file"))
 	{
@@ -751,23 +986,23 @@ mpd_get_query_params_search(int argc, char **argv, struct query_params *qp)
 	}
       else if (0 == strcasecmp(argv[i], "artist"))
 	{
-	  c1 = db_mprintf("(f.artist LIKE '%%%q%%')", argv[i + 1]);
+	  c1 = mpd_contains_clause("f.artist", argv[i + 1]);
 	}
       else if (0 == strcasecmp(argv[i], "albumartist"))
 	{
-	  c1 = db_mprintf("(f.album_artist LIKE '%%%q%%')", argv[i + 1]);
+	  c1 = mpd_contains_clause("f.album_artist", argv[i + 1]);
 	}
       else if (0 == strcasecmp(argv[i], "album"))
 	{
-	  c1 = db_mprintf("(f.album LIKE '%%%q%%')", argv[i + 1]);
+	  c1 = mpd_contains_clause("f.album", argv[i + 1]);
 	}
       else if (0 == strcasecmp(argv[i], "title"))
 	{
-	  c1 = db_mprintf("(f.title LIKE '%%%q%%')", argv[i + 1]);
+	  c1 = mpd_contains_clause("f.title", argv[i + 1]);
 	}
       else if (0 == strcasecmp(argv[i], "genre"))
 	{
-	  c1 = db_mprintf("(f.genre LIKE '%%%q%%')", argv[i + 1]);
+	  c1 = mpd_contains_clause("f.genre", argv[i + 1]);
 	}
       else if (0 == strcasecmp(argv[i], "disc"))
 	{
@@ -817,39 +1052,115 @@ mpd_get_query_params_search(int argc, char **argv, struct query_params *qp)
   return 0;
 }
 
+static void
+queue_snapshot_clear(void)
+{
+  if (queue_snapshot.currentsong)
+    evbuffer_free(queue_snapshot.currentsong);
+
+  memset(&queue_snapshot, 0, sizeof(struct mpd_queue_snapshot));
+}
+
 /*
- * Command handler function for 'currentsong'
+ * Returns the queue snapshot for the given player status, looking up the items
+ * again only if the queue or the player's item changed
  */
-static int
-mpd_command_currentsong(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+static struct mpd_queue_snapshot *
+queue_snapshot_get(struct player_status *status)
 {
-
-  struct player_status status;
+  struct mpd_queue_snapshot *qs = &queue_snapshot;
   struct db_queue_item *queue_item;
+  unsigned int queue_rev;
+  bool stopped;
   int ret;
 
-  player_get_status(&status);
+  // Read before the lookups, so changes made during them invalidate the result
+  queue_rev = db_queue_revision_get();
+  stopped = (status->status == PLAY_STOPPED);
+
+  if (qs->valid && qs->queue_rev == queue_rev && qs->stopped == stopped && qs->shuffle == status->shuffle
+      && (stopped || qs->item_id == status->item_id))
+    return qs;
+
+  queue_snapshot_clear();
+
+  qs->queue_rev = queue_rev;
+  qs->stopped = stopped;
+  qs->item_id = status->item_id;
+  qs->shuffle = status->shuffle;
 
-  if (status.status == PLAY_STOPPED)
-    queue_item = db_queue_fetch_bypos(0, status.shuffle);
+  qs->queue_version = db_queue_get_version();
+  qs->queue_length = db_queue_get_count();
+
+  if (stopped)
+    queue_item = db_queue_fetch_bypos(0, status->shuffle);
   else
-    queue_item = db_queue_fetch_byitemid(status.item_id);
+    queue_item = db_queue_fetch_byitemid(status->item_id);
 
   if (!queue_item)
     {
-      return 0;
+      qs->valid = true;
+      return qs;
     }
 
-  ret = mpd_add_db_queue_item(evbuf, queue_item);
+  qs->id = queue_item->id;
+  qs->pos = queue_item->pos;
+
+  qs->currentsong = evbuffer_new();
+  ret = qs->currentsong ? mpd_add_db_queue_item(qs->currentsong, queue_item) : -1;
 
   free_queue_item(queue_item, 0);
 
   if (ret < 0)
+    {
+      if (qs->currentsong)
+	evbuffer_free(qs->currentsong);
+      qs->currentsong = NULL;
+    }
+
+  queue_item = db_queue_fetch_next(qs->id, status->shuffle);
+  if (queue_item)
+    {
+      qs->next_id = queue_item->id;
+      qs->next_pos = queue_item->pos;
+
+      free_queue_item(queue_item, 0);
+    }
+
+  // Retry next time if the item could not be added
+  qs->valid = (ret >= 0);
+
+  return qs;
+}
+
+/*
+ * Command handler function for 'currentsong'
+ */
+static int
+mpd_command_currentsong(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+
+  struct player_status status;
+  struct mpd_queue_snapshot *qs;
+  size_t len;
+
+  player_get_status(&status);
+
+  qs = queue_snapshot_get(&status);
+  if (!qs->id)
+    {
+      return 0;
+    }
+
+  if (!qs->currentsong)
     {
       *errmsg = safe_asprintf("Error adding media info for file with id: %d", status.id);
       return ACK_ERROR_UNKNOWN;
     }
 
+  len = evbuffer_get_length(qs->currentsong);
+  evbuffer_add(evbuf, evbuffer_pullup(qs->currentsong, -1), len);
+
   return 0;
 }
 
@@ -949,11 +1260,8 @@ static int
 mpd_command_status(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
   struct player_status status;
-  int queue_length;
-  int queue_version;
+  struct mpd_queue_snapshot *qs;
   char *state;
-  uint32_t itemid = 0;
-  struct db_queue_item *queue_item;
 
   player_get_status(&status);
 
@@ -972,8 +1280,7 @@ mpd_command_status(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
 	break;
     }
 
-  queue_version = db_admin_getint(DB_ADMIN_QUEUE_VERSION);
-  queue_length = db_queue_get_count();
+  qs = queue_snapshot_get(&status);
 
   evbuffer_add_printf(evbuf,
       "volume: %d\n"
@@ -990,25 +1297,17 @@ mpd_command_status(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
       status.shuffle,
       (status.repeat == REPEAT_SONG ? 1 : 0),
       status.consume,
-      queue_version,
-      queue_length,
+      qs->queue_version,
+      qs->queue_length,
       state);
 
-  if (status.status != PLAY_STOPPED)
-    queue_item = db_queue_fetch_byitemid(status.item_id);
-  else
-    queue_item = db_queue_fetch_bypos(0, status.shuffle);
-
-  if (queue_item)
+  if (qs->id > 0)
    {
       evbuffer_add_printf(evbuf,
 	  "song: %d\n"
 	  "songid: %d\n",
-	  queue_item->pos,
-	  queue_item->id);
-
-      itemid = queue_item->id;
-      free_queue_item(queue_item, 0);
+	  qs->pos,
+	  qs->id);
    }
 
   if (status.status != PLAY_STOPPED)
@@ -1027,19 +1326,13 @@ mpd_command_status(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
       evbuffer_add(evbuf, "updating_db: 1\n", 15);
     }
 
-  if (itemid > 0)
+  if (qs->next_id > 0)
     {
-      queue_item = db_queue_fetch_next(itemid, status.shuffle);
-      if (queue_item)
-	{
-	  evbuffer_add_printf(evbuf,
-	      "nextsong: %d\n"
-	      "nextsongid: %d\n",
-	      queue_item->id,
-	      queue_item->pos);
-
-	  free_queue_item(queue_item, 0);
-	}
+      evbuffer_add_printf(evbuf,
+	  "nextsong: %d\n"
+	  "nextsongid: %d\n",
+	  qs->next_id,
+	  qs->next_pos);
     }
 
   return 0;
@@ -1987,18 +2280,69 @@ mpd_command_playlistid(struct evbuffer *evbuf, int argc, char **argv, char **err
 }
 
 
+/*
+ * Adds the next MPD_STREAM_BATCH queue items of a playlistinfo stream
+ */
+static int
+mpd_stream_playlistinfo_step(struct evbuffer *evbuf, struct mpd_stream *stream, bool *done, char **errmsg)
+{
+  struct query_params query_params;
+  struct db_queue_item queue_item;
+  int n;
+  int ret;
+
+  memset(&query_params, 0, sizeof(struct query_params));
+  query_params.filter = stream->filter;
+  query_params.offset = stream->offset;
+  query_params.limit = MPD_STREAM_BATCH;
+
+  ret = db_queue_enum_start(&query_params);
+  if (ret < 0)
+    {
+      *errmsg = safe_asprintf("Failed to start queue enum for command playlistinfo");
+      return ACK_ERROR_UNKNOWN;
+    }
+
+  n = 0;
+  while ((ret = db_queue_enum_fetch(&query_params, &queue_item)) == 0 && queue_item.id > 0)
+    {
+      ret = mpd_add_db_queue_item(evbuf, &queue_item);
+      if (ret < 0)
+	{
+	  *errmsg = safe_asprintf("Error adding media info for file with id: %d", queue_item.file_id);
+
+	  db_queue_enum_end(&query_params);
+	  return ACK_ERROR_UNKNOWN;
+	}
+
+      n++;
+    }
+
+  db_queue_enum_end(&query_params);
+
+  stream->offset += n;
+  *done = (n < MPD_STREAM_BATCH);
+
+  return 0;
+}
+
 /*
  * Command handler function for 'playlistinfo'
  * Displays a list of all songs in the queue, or if the optional argument is given, displays information
  * only for the song SONGPOS or the range of songs START:END given in argv[1].
  *
  * The order of the songs is always the not shuffled order.
+ *
+ * The whole queue and large ranges are streamed in batches, so if the queue
+ * changes while the client is reading, it sees the batches before and after
+ * the change.
  */
 static int
 mpd_command_playlistinfo(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
   struct query_params query_params;
   struct db_queue_item queue_item;
+  struct mpd_stream *stream;
   int start_pos;
   int end_pos;
   int ret;
@@ -2022,6 +2366,17 @@ mpd_command_playlistinfo(struct evbuffer *evbuf, int argc, char **argv, char **e
 	query_params.filter = db_mprintf("pos >= %d AND pos < %d", start_pos, end_pos);
     }
 
+  if (ctx && (!query_params.filter || end_pos - start_pos > MPD_STREAM_BATCH))
+    {
+      CHECK_NULL(L_MPD, stream = calloc(1, sizeof(struct mpd_stream)));
+      stream->step = mpd_stream_playlistinfo_step;
+      stream->command = strdup("playlistinfo");
+      stream->filter = query_params.filter;
+
+      ctx->stream = stream;
+      return 0;
+    }
+
   ret = db_queue_enum_start(&query_params);
   if (ret < 0)
     {
@@ -2636,6 +2991,9 @@ mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 {
   struct query_params qp;
   struct db_media_file_info dbmfi;
+  char *cursor;
+  int window_end;
+  int nsongs;
   int ret;
 
   if (argc < 3 || ((argc - 1) % 2) != 0)
@@ -2652,6 +3010,9 @@ mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 
   mpd_get_query_params_find(argc - 1, argv + 1, &qp);
 
+  window_end = qp.offset + qp.limit;
+  mpd_window_cursor_apply(ctx, &qp);
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -2662,6 +3023,8 @@ mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
       return ACK_ERROR_UNKNOWN;
     }
 
+  cursor = NULL;
+  nsongs = 0;
   while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
     {
       ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
@@ -2669,9 +3032,17 @@ mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 	{
 	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
 	}
+
+      nsongs++;
+      if ((qp.idx_type != I_NONE) && (nsongs == qp.limit))
+	cursor = db_query_cursor_make(&qp, &dbmfi);
     }
 
   db_query_end(&qp);
+
+  if (qp.idx_type != I_NONE)
+    mpd_window_cursor_save(ctx, &qp, window_end, cursor);
+
   free(qp.filter);
 
   return 0;
@@ -2716,9 +3087,16 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 {
   struct query_params qp;
   struct db_group_info dbgri;
+  struct evbuffer *out;
+  struct evbuffer *key;
+  char *cache_key;
+  char *cached;
+  char *reply;
+  size_t len;
   char *type;
   char *browse_item;
   char *sort_item;
+  int i;
   int ret;
 
   if (argc < 2 || ((argc % 2) != 0))
@@ -2786,6 +3164,23 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
       return 0;
     }
 
+  // The reply only depends on the arguments and the library contents
+  CHECK_NULL(L_MPD, key = evbuffer_new());
+  evbuffer_add_printf(key, "%u", db_revision_get());
+  for (i = 1; i < argc; i++)
+    evbuffer_add_printf(key, "\x1f%s", argv[i]);
+  evbuffer_add(key, "", 1);
+  cache_key = (char *)evbuffer_pullup(key, -1);
+
+  cached = string_cache_get(&list_cache, cache_key);
+  if (cached)
+    {
+      evbuffer_add(evbuf, cached, strlen(cached));
+      free(cached);
+      evbuffer_free(key);
+      return 0;
+    }
+
   qp.idx_type = I_NONE;
 
   if (argc > 2)
@@ -2798,11 +3193,14 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
     {
       db_query_end(&qp);
       free(qp.filter);
+      evbuffer_free(key);
 
       *errmsg = safe_asprintf("Could not start query");
       return ACK_ERROR_UNKNOWN;
     }
 
+  CHECK_NULL(L_MPD, out = evbuffer_new());
+
   if (qp.type & Q_F_BROWSE)
     {
       if (qp.type == Q_BROWSE_VPATH)
@@ -2810,7 +3208,7 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 	  while (((ret = db_query_fetch_string_sort(&qp, &browse_item, &sort_item)) == 0) && (browse_item))
 	    {
 		// Remove the first "/" from the virtual_path
-		evbuffer_add_printf(evbuf,
+		evbuffer_add_printf(out,
 		      "%s%s\n",
 		      type,
 		      (browse_item + 1));
@@ -2820,7 +3218,7 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 	{
 	  while (((ret = db_query_fetch_string_sort(&qp, &browse_item, &sort_item)) == 0) && (browse_item))
 	    {
-		evbuffer_add_printf(evbuf,
+		evbuffer_add_printf(out,
 		      "%s%s\n",
 		      type,
 		      browse_item);
@@ -2831,7 +3229,7 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
     {
       while ((ret = db_query_fetch_group(&qp, &dbgri)) == 0)
 	{
-	  evbuffer_add_printf(evbuf,
+	  evbuffer_add_printf(out,
 		"%s%s\n",
 		type,
 		dbgri.itemname);
@@ -2841,19 +3239,27 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
   db_query_end(&qp);
   free(qp.filter);
 
+  // Only complete replies are cached
+  len = evbuffer_get_length(out);
+  evbuffer_add(out, "", 1);
+  reply = (char *)evbuffer_pullup(out, -1);
+  if (ret >= 0)
+    string_cache_add(&list_cache, cache_key, reply);
+
+  evbuffer_add(evbuf, reply, len);
+  evbuffer_free(out);
+  evbuffer_free(key);
+
   return 0;
 }
 
 static int
-mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int listinfo, char **errmsg)
+mpd_add_directory_playlists(struct evbuffer *evbuf, int directory_id, int listinfo, char **errmsg)
 {
-  struct directory_info subdir;
   struct query_params qp;
-  struct directory_enum dir_enum;
   struct db_playlist_info dbpli;
   char modified[32];
   uint32_t time_modified;
-  struct db_media_file_info dbmfi;
   int ret;
 
   // Load playlists for dir-id
@@ -2896,39 +3302,34 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
   db_query_end(&qp);
   free(qp.filter);
 
-  // Load sub directories for dir-id
-  memset(&dir_enum, 0, sizeof(struct directory_enum));
-  dir_enum.parent_id = directory_id;
-  ret = db_directory_enum_start(&dir_enum);
-  if (ret < 0)
+  return 0;
+}
+
+static void
+mpd_add_directory_subdir(struct evbuffer *evbuf, const char *virtual_path, int listinfo)
+{
+  if (listinfo)
     {
-      DPRINTF(E_LOG, L_MPD, "Failed to start directory enum for parent_id %d\n", directory_id);
-      db_directory_enum_end(&dir_enum);
-      return -1;
+      evbuffer_add_printf(evbuf,
+	"directory: %s\n"
+	"Last-Modified: %s\n",
+	(virtual_path + 1),
+	"2015-12-01 00:00");
     }
-  while ((ret = db_directory_enum_fetch(&dir_enum, &subdir)) == 0 && subdir.id > 0)
+  else
     {
-      if (listinfo)
-	{
-	  evbuffer_add_printf(evbuf,
-	    "directory: %s\n"
-	    "Last-Modified: %s\n",
-	    (subdir.virtual_path + 1),
-	    "2015-12-01 00:00");
-	}
-      else
-	{
-	  evbuffer_add_printf(evbuf,
-	    "directory: %s\n",
-	    (subdir.virtual_path + 1));
-	}
-
-      if (listall)
-	{
-	  mpd_add_directory(evbuf, subdir.id, listall, listinfo, errmsg);
-	}
+      evbuffer_add_printf(evbuf,
+	"directory: %s\n",
+	(virtual_path + 1));
     }
-  db_directory_enum_end(&dir_enum);
+}
+
+static int
+mpd_add_directory_files(struct evbuffer *evbuf, int directory_id, int listinfo, char **errmsg)
+{
+  struct query_params qp;
+  struct db_media_file_info dbmfi;
+  int ret;
 
   // Load files for dir-id
   memset(&qp, 0, sizeof(struct query_params));
@@ -2968,16 +3369,172 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
 }
 
 static int
-mpd_command_listall(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int listinfo, char **errmsg)
 {
-  int dir_id;
-  char parent[PATH_MAX];
+  struct directory_info subdir;
+  struct directory_enum dir_enum;
   int ret;
 
-  if (argc < 2 || strlen(argv[1]) == 0
-      || (strncmp(argv[1], "/", 1) == 0 && strlen(argv[1]) == 1))
+  ret = mpd_add_directory_playlists(evbuf, directory_id, listinfo, errmsg);
+  if (ret != 0)
+    return ret;
+
+  // Load sub directories for dir-id
+  memset(&dir_enum, 0, sizeof(struct directory_enum));
+  dir_enum.parent_id = directory_id;
+  ret = db_directory_enum_start(&dir_enum);
+  if (ret < 0)
     {
-      ret = snprintf(parent, sizeof(parent), "/");
+      DPRINTF(E_LOG, L_MPD, "Failed to start directory enum for parent_id %d\n", directory_id);
+      db_directory_enum_end(&dir_enum);
+      return -1;
+    }
+  while ((ret = db_directory_enum_fetch(&dir_enum, &subdir)) == 0 && subdir.id > 0)
+    {
+      mpd_add_directory_subdir(evbuf, subdir.virtual_path, listinfo);
+
+      if (listall)
+	{
+	  mpd_add_directory(evbuf, subdir.id, listall, listinfo, errmsg);
+	}
+    }
+  db_directory_enum_end(&dir_enum);
+
+  return mpd_add_directory_files(evbuf, directory_id, listinfo, errmsg);
+}
+
+/*
+ * Adds the playlists of the directory to evbuf and puts it on the stream's
+ * directory stack, with its subdirectories to descend into
+ */
+static int
+mpd_stream_dir_enter(struct evbuffer *evbuf, struct mpd_stream *stream, int directory_id, char **errmsg)
+{
+  struct mpd_stream_dir *dir;
+  struct directory_info subdir;
+  struct directory_enum dir_enum;
+  int size;
+  int ret;
+
+  ret = mpd_add_directory_playlists(evbuf, directory_id, stream->listinfo, errmsg);
+  if (ret != 0)
+    return ret;
+
+  if (stream->ndirs == stream->dirs_size)
+    {
+      size = stream->dirs_size ? 2 * stream->dirs_size : 8;
+      CHECK_NULL(L_MPD, stream->dirs = realloc(stream->dirs, size * sizeof(struct mpd_stream_dir)));
+      stream->dirs_size = size;
+    }
+
+  dir = &stream->dirs[stream->ndirs];
+  memset(dir, 0, sizeof(struct mpd_stream_dir));
+  dir->dir_id = directory_id;
+  stream->ndirs++;
+
+  memset(&dir_enum, 0, sizeof(struct directory_enum));
+  dir_enum.parent_id = directory_id;
+  ret = db_directory_enum_start(&dir_enum);
+  if (ret < 0)
+    {
+      db_directory_enum_end(&dir_enum);
+      *errmsg = safe_asprintf("Failed to start directory enum for parent_id %d", directory_id);
+      return ACK_ERROR_UNKNOWN;
+    }
+
+  size = 0;
+  while ((ret = db_directory_enum_fetch(&dir_enum, &subdir)) == 0 && subdir.id > 0)
+    {
+      if (dir->nsubdirs == size)
+	{
+	  size = size ? 2 * size : 16;
+	  CHECK_NULL(L_MPD, dir->subdir_ids = realloc(dir->subdir_ids, size * sizeof(int)));
+	  CHECK_NULL(L_MPD, dir->subdir_paths = realloc(dir->subdir_paths, size * sizeof(char *)));
+	}
+
+      dir->subdir_ids[dir->nsubdirs] = subdir.id;
+      CHECK_NULL(L_MPD, dir->subdir_paths[dir->nsubdirs] = strdup(subdir.virtual_path));
+      dir->nsubdirs++;
+    }
+  db_directory_enum_end(&dir_enum);
+
+  return 0;
+}
+
+/*
+ * Lists one subdirectory (with its playlists) of the innermost directory, or
+ * if there are no more of those, its files. Produces the same order as
+ * mpd_add_directory().
+ */
+static int
+mpd_stream_listall_step(struct evbuffer *evbuf, struct mpd_stream *stream, bool *done, char **errmsg)
+{
+  struct mpd_stream_dir *dir;
+  int directory_id;
+  int ret;
+
+  dir = &stream->dirs[stream->ndirs - 1];
+
+  if (dir->next < dir->nsubdirs)
+    {
+      mpd_add_directory_subdir(evbuf, dir->subdir_paths[dir->next], stream->listinfo);
+
+      directory_id = dir->subdir_ids[dir->next];
+      dir->next++;
+
+      return mpd_stream_dir_enter(evbuf, stream, directory_id, errmsg);
+    }
+
+  ret = mpd_add_directory_files(evbuf, dir->dir_id, stream->listinfo, errmsg);
+
+  mpd_stream_dir_clear(dir);
+  stream->ndirs--;
+
+  *done = (stream->ndirs == 0);
+
+  return ret;
+}
+
+/*
+ * Lists the directory recursively, which for the client is handed over to a
+ * stream that continues after the handler returns
+ */
+static int
+mpd_listall(struct evbuffer *evbuf, int directory_id, int listinfo, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  struct mpd_stream *stream;
+  int ret;
+
+  if (!ctx)
+    return mpd_add_directory(evbuf, directory_id, 1, listinfo, errmsg);
+
+  CHECK_NULL(L_MPD, stream = calloc(1, sizeof(struct mpd_stream)));
+  stream->step = mpd_stream_listall_step;
+  stream->command = strdup(listinfo ? "listallinfo" : "listall");
+  stream->listinfo = listinfo;
+
+  ret = mpd_stream_dir_enter(evbuf, stream, directory_id, errmsg);
+  if (ret != 0)
+    {
+      mpd_stream_free(stream);
+      return ret;
+    }
+
+  ctx->stream = stream;
+  return 0;
+}
+
+static int
+mpd_command_listall(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  int dir_id;
+  char parent[PATH_MAX];
+  int ret;
+
+  if (argc < 2 || strlen(argv[1]) == 0
+      || (strncmp(argv[1], "/", 1) == 0 && strlen(argv[1]) == 1))
+    {
+      ret = snprintf(parent, sizeof(parent), "/");
     }
   else if (strncmp(argv[1], "/", 1) == 0)
     {
@@ -3002,7 +3559,7 @@ mpd_command_listall(struct evbuffer *evbuf, int argc, char **argv, char **errmsg
       return ACK_ERROR_NO_EXIST;
     }
 
-  ret = mpd_add_directory(evbuf, dir_id, 1, 0, errmsg);
+  ret = mpd_listall(evbuf, dir_id, 0, errmsg, ctx);
 
   return ret;
 }
@@ -3042,7 +3599,7 @@ mpd_command_listallinfo(struct evbuffer *evbuf, int argc, char **argv, char **er
       return ACK_ERROR_NO_EXIST;
     }
 
-  ret = mpd_add_directory(evbuf, dir_id, 1, 1, errmsg);
+  ret = mpd_listall(evbuf, dir_id, 1, errmsg, ctx);
 
   return ret;
 }
@@ -3129,6 +3686,9 @@ mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
 {
   struct query_params qp;
   struct db_media_file_info dbmfi;
+  char *cursor;
+  int window_end;
+  int nsongs;
   int ret;
 
   if (argc < 3 || ((argc - 1) % 2) != 0)
@@ -3145,6 +3705,9 @@ mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
 
   mpd_get_query_params_search(argc - 1, argv + 1, &qp);
 
+  window_end = qp.offset + qp.limit;
+  mpd_window_cursor_apply(ctx, &qp);
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -3155,6 +3718,8 @@ mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
       return ACK_ERROR_UNKNOWN;
     }
 
+  cursor = NULL;
+  nsongs = 0;
   while (((ret = db_query_fetch_file(&qp, &dbmfi)) == 0) && (dbmfi.id))
     {
       ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
@@ -3162,9 +3727,17 @@ mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
 	{
 	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
 	}
+
+      nsongs++;
+      if ((qp.idx_type != I_NONE) && (nsongs == qp.limit))
+	cursor = db_query_cursor_make(&qp, &dbmfi);
     }
 
   db_query_end(&qp);
+
+  if (qp.idx_type != I_NONE)
+    mpd_window_cursor_save(ctx, &qp, window_end, cursor);
+
   free(qp.filter);
 
   return 0;
@@ -3432,6 +4005,140 @@ mpd_sticker_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, c
   return 0;
 }
 
+/*
+ * Loads the artwork of the song with the given uri into the client context,
+ * unless it is already there
+ */
+static int
+mpd_artwork_load(struct mpd_client_ctx *ctx, const char *uri, char **errmsg)
+{
+  struct media_file_info *mfi;
+  char *virtual_path;
+  unsigned int revision;
+
+  virtual_path = prepend_slash(uri);
+  revision = db_revision_get();
+
+  if (ctx->art && ctx->art_path && strcmp(ctx->art_path, virtual_path) == 0 && ctx->art_revision == revision)
+    {
+      free(virtual_path);
+      return 0;
+    }
+
+  free(ctx->art_path);
+  ctx->art_path = NULL;
+  if (ctx->art)
+    evbuffer_free(ctx->art);
+  ctx->art = NULL;
+
+  mfi = db_file_fetch_byvirtualpath(virtual_path);
+  if (!mfi)
+    {
+      DPRINTF(E_LOG, L_MPD, "Virtual path not found: %s\n", virtual_path);
+      *errmsg = safe_asprintf("No file exists");
+      free(virtual_path);
+      return ACK_ERROR_NO_EXIST;
+    }
+
+  CHECK_NULL(L_MPD, ctx->art = evbuffer_new());
+
+  // Same size as served by the artwork http server, so they share the cache
+  ctx->art_format = artwork_get_item(ctx->art, mfi->id, 600, 600);
+  if (ctx->art_format < 0)
+    evbuffer_drain(ctx->art, evbuffer_get_length(ctx->art));
+
+  ctx->art_path = virtual_path;
+  ctx->art_revision = revision;
+
+  free_mfi(mfi, 0);
+
+  return 0;
+}
+
+/*
+ * Writes the chunk of the loaded artwork starting at the offset in argv[2]
+ */
+static int
+mpd_artwork_chunk(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx, bool with_type)
+{
+  unsigned char *data;
+  uint32_t offset;
+  size_t size;
+  size_t len;
+  int ret;
+
+  ret = safe_atou32(argv[2], &offset);
+  if (ret < 0)
+    {
+      *errmsg = safe_asprintf("Argument offset doesn't convert to integer: '%s'", argv[2]);
+      return ACK_ERROR_ARG;
+    }
+
+  ret = mpd_artwork_load(ctx, argv[1], errmsg);
+  if (ret != 0)
+    return ret;
+
+  size = evbuffer_get_length(ctx->art);
+  if (size == 0)
+    return -1;
+
+  if (offset > size)
+    {
+      *errmsg = safe_asprintf("Offset too large");
+      return ACK_ERROR_ARG;
+    }
+
+  len = size - offset;
+  if (len > ctx->binarylimit)
+    len = ctx->binarylimit;
+
+  data = evbuffer_pullup(ctx->art, -1);
+
+  evbuffer_add_printf(evbuf, "size: %zu\n", size);
+  if (with_type)
+    evbuffer_add_printf(evbuf, "type: %s\n", (ctx->art_format == ART_FMT_PNG) ? "image/png" : "image/jpeg");
+  evbuffer_add_printf(evbuf, "binary: %zu\n", len);
+  evbuffer_add(evbuf, data + offset, len);
+  evbuffer_add(evbuf, "\n", 1);
+
+  return 0;
+}
+
+/*
+ * Command handler function for 'albumart'
+ * Sends a chunk of the cover of the song with the given uri
+ */
+static int
+mpd_command_albumart(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  int ret;
+
+  ret = mpd_artwork_chunk(evbuf, argc, argv, errmsg, ctx, false);
+  if (ret < 0)
+    {
+      *errmsg = safe_asprintf("No file exists");
+      return ACK_ERROR_NO_EXIST;
+    }
+
+  return ret;
+}
+
+/*
+ * Command handler function for 'readpicture'
+ * Like albumart, but also sends the image type. No picture is not an error.
+ */
+static int
+mpd_command_readpicture(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  int ret;
+
+  ret = mpd_artwork_chunk(evbuf, argc, argv, errmsg, ctx, true);
+  if (ret < 0)
+    return 0;
+
+  return ret;
+}
+
 struct mpd_sticker_command {
   const char *cmd;
   int (*handler)(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, const char *virtual_path);
@@ -3559,6 +4266,34 @@ mpd_command_password(struct evbuffer *evbuf, int argc, char **argv, char **errms
   return ACK_ERROR_PASSWORD;
 }
 
+/*
+ * Command handler function for 'binarylimit'
+ * Sets the maximum size of the binary chunks sent by albumart/readpicture
+ */
+static int
+mpd_command_binarylimit(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  uint32_t size;
+  int ret;
+
+  ret = safe_atou32(argv[1], &size);
+  if (ret < 0)
+    {
+      *errmsg = safe_asprintf("Argument doesn't convert to integer: '%s'", argv[1]);
+      return ACK_ERROR_ARG;
+    }
+
+  if (size < MPD_BINARYLIMIT_MIN)
+    {
+      *errmsg = safe_asprintf("Value too small");
+      return ACK_ERROR_ARG;
+    }
+
+  ctx->binarylimit = size;
+
+  return 0;
+}
+
 /*
  * Callback function for the 'player_speaker_enumerate' function.
  * Expect a struct output_get_param as argument and allocates a struct output if
@@ -4053,6 +4788,12 @@ struct mpd_command
    */
   int (*handler)(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx);
   int min_argc;
+
+  /*
+   * The command only changes the queue from the mpd thread, consecutive ones
+   * in a command list run in one db transaction (see db_queue_batch_begin)
+   */
+  bool queue_batch;
 };
 
 static struct mpd_command mpd_handlers[] =
@@ -4092,13 +4833,13 @@ static struct mpd_command mpd_handlers[] =
     { "stop",                       mpd_command_stop,                       -1 },
 
     // The current playlist
-    { "add",                        mpd_command_add,                         2 },
-    { "addid",                      mpd_command_addid,                       2 },
+    { "add",                        mpd_command_add,                         2, true },
+    { "addid",                      mpd_command_addid,                       2, true },
     { "clear",                      mpd_command_clear,                      -1 },
-    { "delete",                     mpd_command_delete,                     -1 },
-    { "deleteid",                   mpd_command_deleteid,                    2 },
-    { "move",                       mpd_command_move,                        3 },
-    { "moveid",                     mpd_command_moveid,                      3 },
+    { "delete",                     mpd_command_delete,                     -1, true },
+    { "deleteid",                   mpd_command_deleteid,                    2, true },
+    { "move",                       mpd_command_move,                        3, true },
+    { "moveid",                     mpd_command_moveid,                      3, true },
     { "playlist",                   mpd_command_playlistinfo,               -1 }, // According to the mpd protocol the use of "playlist" is deprecated
     { "playlistfind",               mpd_command_playlistfind,               -1 },
     { "playlistid",                 mpd_command_playlistid,                 -1 },
@@ -4119,7 +4860,7 @@ static struct mpd_command mpd_handlers[] =
     { "listplaylist",               mpd_command_listplaylist,                2 },
     { "listplaylistinfo",           mpd_command_listplaylistinfo,            2 },
     { "listplaylists",              mpd_command_listplaylists,              -1 },
-    { "load",                       mpd_command_load,                        2 },
+    { "load",                       mpd_command_load,                        2, true },
     { "playlistadd",                mpd_command_playlistadd,                 3 },
 //    { "playlistclear",              mpd_command_playlistclear,              -1 },
 //    { "playlistdelete",             mpd_command_playlistdelete,             -1 },
@@ -4136,8 +4877,10 @@ static struct mpd_command mpd_handlers[] =
     { "listall",                    mpd_command_listall,                    -1 },
     { "listallinfo",                mpd_command_listallinfo,                -1 },
 //    { "listfiles",                  mpd_command_listfiles,                  -1 },
+    { "albumart",                   mpd_command_albumart,                    3 },
     { "lsinfo",                     mpd_command_lsinfo,                     -1 },
 //    { "readcomments",               mpd_command_readcomments,               -1 },
+    { "readpicture",                mpd_command_readpicture,                 3 },
     { "search",                     mpd_command_search,                     -1 },
     { "searchadd",                  mpd_command_searchadd,                  -1 },
 //    { "searchaddpl",                mpd_command_searchaddpl,                -1 },
@@ -4154,6 +4897,7 @@ static struct mpd_command mpd_handlers[] =
     { "sticker",                    mpd_command_sticker,                     4 },
 
     // Connection settings
+    { "binarylimit",                mpd_command_binarylimit,                 2 },
     { "close",                      mpd_command_ignore,                     -1 },
 //    { "kill",                       mpd_command_kill,                       -1 },
     { "password",                   mpd_command_password,                   -1 },
@@ -4225,6 +4969,89 @@ mpd_command_commands(struct evbuffer *evbuf, int argc, char **argv, char **errms
 }
 
 
+static void
+mpd_read_cb(struct bufferevent *bev, void *ctx);
+
+static void
+mpd_event_cb(struct bufferevent *bev, short events, void *ctx);
+
+/*
+ * The write callback is set while a command's output is streamed, and invoked
+ * when the client has read enough of it that the output buffer is below
+ * MPD_STREAM_LOWAT. Adds the next parts of the output and when the stream is
+ * done, finishes the command and continues with the command sequence.
+ */
+static void
+mpd_write_cb(struct bufferevent *bev, void *ctx)
+{
+  struct mpd_client_ctx *client_ctx = ctx;
+  struct mpd_stream *stream = client_ctx->stream;
+  struct evbuffer *output;
+  char *errmsg;
+  bool done;
+  int ret;
+
+  if (!stream)
+    return;
+
+  output = bufferevent_get_output(bev);
+
+  done = false;
+  ret = 0;
+  while (!done && evbuffer_get_length(output) <= MPD_STREAM_LOWAT)
+    {
+      ret = stream->step(output, stream, &done, &errmsg);
+      if (ret != 0)
+	break;
+    }
+
+  if (ret == 0 && !done)
+    return;
+
+  bufferevent_setcb(bev, mpd_read_cb, NULL, mpd_event_cb, client_ctx);
+  bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+
+  client_ctx->stream = NULL;
+
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_MPD, "Error executing command '%s': %s\n", stream->command, errmsg);
+      evbuffer_add_printf(output, "ACK [%d@%d] {%s} %s\n", ret, client_ctx->stream_ncmd, stream->command, errmsg);
+      free(errmsg);
+      mpd_stream_free(stream);
+      return;
+    }
+
+  mpd_stream_free(stream);
+
+  if (client_ctx->stream_listtype == COMMAND_LIST_OK)
+    evbuffer_add(output, "list_OK\n", 8);
+
+  if (client_ctx->stream_listtype == COMMAND_LIST_NONE)
+    {
+      evbuffer_add(output, "OK\n", 3);
+
+      // Commands the client sent in the meantime
+      if (evbuffer_get_length(bufferevent_get_input(bev)) > 0)
+	mpd_read_cb(bev, client_ctx);
+
+      return;
+    }
+
+  client_ctx->stream_ncmd++;
+  client_ctx->stream_resume = true;
+  mpd_read_cb(bev, client_ctx);
+}
+
+static void
+mpd_stream_start(struct bufferevent *bev, struct mpd_client_ctx *client_ctx)
+{
+  bufferevent_setwatermark(bev, EV_WRITE, MPD_STREAM_LOWAT, 0);
+  bufferevent_setcb(bev, mpd_read_cb, mpd_write_cb, mpd_event_cb, client_ctx);
+
+  mpd_write_cb(bev, client_ctx);
+}
+
 /*
  * The read callback function is invoked if a complete command sequence was received from the client
  * (see mpd_input_filter function).
@@ -4247,8 +5074,15 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
   int close_cmd;
   char *argv[COMMAND_ARGV_MAX];
   int argc;
+  bool batch;
+  uint64_t start;
   struct mpd_client_ctx *client_ctx = (struct mpd_client_ctx *)ctx;
 
+  // Commands wait in the input buffer until the output of the previous one has
+  // been written
+  if (client_ctx->stream)
+    return;
+
   /* Get the input evbuffer, contains the command sequence received from the client */
   input = bufferevent_get_input(bev);
   /* Get the output evbuffer, used to send the server response to the client */
@@ -4262,11 +5096,23 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
   listtype = COMMAND_LIST_NONE;
   ncmd = 0;
   ret = -1;
+  batch = false;
+
+  // Continuing a command list after a streamed command
+  if (client_ctx->stream_resume)
+    {
+      listtype = client_ctx->stream_listtype;
+      ncmd = client_ctx->stream_ncmd;
+      ret = 0;
+      client_ctx->stream_resume = false;
+    }
 
   while ((line = evbuffer_readln(input, NULL, EVBUFFER_EOL_ANY)))
     {
       DPRINTF(E_DBG, L_MPD, "MPD message: %s\n", line);
 
+      reqlog_mpd(client_ctx->session, line);
+
       // Split the read line into command name and arguments
       ret = mpd_parse_args(line, &argc, argv);
       if (ret != 0 || argc <= 0)
@@ -4313,6 +5159,19 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
        */
       command = mpd_find_command(argv[0]);
 
+      // Queue changes of a command list are committed together
+      if (listtype != COMMAND_LIST_NONE && command && command->queue_batch && client_ctx->authenticated)
+	{
+	  if (!batch)
+	    db_queue_batch_begin();
+	  batch = true;
+	}
+      else if (batch)
+	{
+	  db_queue_batch_end();
+	  batch = false;
+	}
+
       if (command == NULL)
 	{
 	  errmsg = safe_asprintf("Unsupported command '%s'", argv[0]);
@@ -4334,7 +5193,18 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
 	  ret = ACK_ERROR_PERMISSION;
 	}
       else
-	ret = command->handler(output, argc, argv, &errmsg, client_ctx);
+	{
+	  start = metrics_clock_usec();
+	  httpd_trace_begin();
+
+	  // Whatever the command fetches from the db is released here in one go
+	  db_arena_begin();
+	  ret = command->handler(output, argc, argv, &errmsg, client_ctx);
+	  db_arena_end();
+
+	  metrics_histogram_observe(mpd_metric_duration, metrics_clock_usec() - start);
+	  httpd_trace_end("mpd", argv[0], NULL);
+	}
 
       /*
        * If an error occurred, add the ACK line to the response buffer and exit the loop
@@ -4348,6 +5218,20 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
 	  break;
 	}
 
+      /*
+       * The command handed its output over to a stream, the rest of the sequence
+       * is processed when the stream is done
+       */
+      if (client_ctx->stream)
+	{
+	  client_ctx->stream_listtype = listtype;
+	  client_ctx->stream_ncmd = ncmd;
+	  free(line);
+
+	  mpd_stream_start(bev, client_ctx);
+	  return;
+	}
+
       /*
        * If the command sequence started with command_list_ok_begin, add a list_ok line to the
        * response buffer after each command output.
@@ -4361,6 +5245,9 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
       ncmd++;
     }
 
+  if (batch)
+    db_queue_batch_end();
+
   DPRINTF(E_SPAM, L_MPD, "Finished MPD command sequence: %d\n", ret);
 
   /*
@@ -4514,6 +5401,8 @@ mpd_accept_conn_cb(struct evconnlistener *listener,
       return;
     }
 
+  client_ctx->binarylimit = MPD_BINARYLIMIT_DEFAULT;
+
   client_ctx->authenticated = !cfg_getstr(cfg_getsec(cfg, "library"), "password");
   if (!client_ctx->authenticated)
     {
@@ -4521,9 +5410,17 @@ mpd_accept_conn_cb(struct evconnlistener *listener,
       client_ctx->authenticated = peer_address_is_trusted(addr_str);
     }
 
+  if (reqlog_enabled() && sockaddr_to_string(address, addr_str, sizeof(addr_str)))
+    client_ctx->session = safe_asprintf("%s:%u", addr_str, ntohs((address->sa_family == AF_INET6) ? ((struct sockaddr_in6 *)address)->sin6_port : ((struct sockaddr_in *)address)->sin_port));
+
   client_ctx->next = mpd_clients;
   mpd_clients = client_ctx;
 
+  // The filter event only passes output on while the socket has less than
+  // MPD_STREAM_HIWAT pending, which is what makes streamed output wait for the
+  // client (see mpd_write_cb)
+  bufferevent_setwatermark(bev, EV_WRITE, 0, MPD_STREAM_HIWAT);
+
   bev = bufferevent_filter_new(bev, mpd_input_filter, NULL, BEV_OPT_CLOSE_ON_FREE, free_mpd_client_ctx, client_ctx);
   bufferevent_setcb(bev, mpd_read_cb, NULL, mpd_event_cb, client_ctx);
   bufferevent_enable(bev, EV_READ | EV_WRITE);
@@ -4595,16 +5492,56 @@ mpd_notify_idle_client(struct mpd_client_ctx *client_ctx, short events)
   return 0;
 }
 
-static enum command_state
-mpd_notify_idle(void *arg, int *retval)
+/* Thread: mpd */
+static void
+list_prewarm_cb(int fd, short what, void *arg)
 {
-  short event_mask;
+  struct evbuffer *evbuf;
+  char *argv[2];
+  char *errmsg;
+  int i;
+  int ret;
+
+  // The end of the scan will bring another database event
+  if (library_is_scanning())
+    return;
+
+  DPRINTF(E_DBG, L_MPD, "Pre-warming list cache\n");
+
+  CHECK_NULL(L_MPD, evbuf = evbuffer_new());
+
+  argv[0] = "list";
+  for (i = 0; i < sizeof(list_prewarm_tags)/sizeof(list_prewarm_tags[0]); i++)
+    {
+      argv[1] = list_prewarm_tags[i];
+
+      ret = mpd_command_list(evbuf, 2, argv, &errmsg, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_MPD, "Could not pre-warm list cache for '%s': %s\n", argv[1], errmsg);
+	  free(errmsg);
+	}
+
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+    }
+
+  evbuffer_free(evbuf);
+}
+
+/* Thread: mpd (delivered by the listener on evbase_mpd) */
+static void
+mpd_listener_cb(short event_mask)
+{
+  struct timeval tv = { 5, 0 };
   struct mpd_client_ctx *client;
   int i;
 
-  event_mask = *(short *)arg;
   DPRINTF(E_DBG, L_MPD, "Notify clients waiting for idle results: %d\n", event_mask);
 
+  // Restarts the timer, so bursts of changes only cause one pre-warm
+  if (list_prewarm_ev && (event_mask & LISTENER_DATABASE))
+    evtimer_add(list_prewarm_ev, &tv);
+
   i = 0;
   client = mpd_clients;
   while (client)
@@ -4615,20 +5552,6 @@ mpd_notify_idle(void *arg, int *retval)
       client = client->next;
       i++;
     }
-
-  *retval = 0;
-  return COMMAND_END;
-}
-
-static void
-mpd_listener_cb(short event_mask)
-{
-  short *ptr;
-
-  ptr = (short *)malloc(sizeof(short));
-  *ptr = event_mask;
-  DPRINTF(E_DBG, L_MPD, "Asynchronous listener callback called with event type %d.\n", event_mask);
-  commands_exec_async(cmdbase, mpd_notify_idle, ptr);
 }
 
 /*
@@ -4776,6 +5699,10 @@ int mpd_init(void)
     }
 
   cmdbase = commands_base_new(evbase_mpd, NULL);
+  commands_base_metrics(cmdbase, "mpd");
+
+  mpd_metric_duration = metrics_register("forked_daapd_http_request_duration_seconds", "handler=\"mpd\"", METRICS_HISTOGRAM,
+                                         "Time spent handling requests, by handler (mpd is the MPD protocol)");
 
   if (v6enabled)
     {
@@ -4875,6 +5802,10 @@ int mpd_init(void)
     }
 
   allow_modifying_stored_playlists = cfg_getbool(cfg_getsec(cfg, "mpd"), "allow_modifying_stored_playlists");
+
+  list_prewarm = cfg_getbool(cfg_getsec(cfg, "mpd"), "prewarm_list_cache");
+  if (list_prewarm)
+    CHECK_NULL(L_MPD, list_prewarm_ev = evtimer_new(evbase_mpd, list_prewarm_cb, NULL));
   pl_dir = cfg_getstr(cfg_getsec(cfg, "mpd"), "default_playlist_directory");
   if (pl_dir)
     default_pl_dir = safe_asprintf("/file:%s", pl_dir);
@@ -4896,12 +5827,15 @@ int mpd_init(void)
 #endif
 
   mpd_clients = NULL;
-  listener_add(mpd_listener_cb, MPD_ALL_IDLE_LISTENER_EVENTS);
+  listener_add(mpd_listener_cb, MPD_ALL_IDLE_LISTENER_EVENTS, evbase_mpd);
 
   return 0;
 
 
  thread_fail:
+  if (list_prewarm_ev)
+    event_free(list_prewarm_ev);
+  list_prewarm_ev = NULL;
  bind_fail:
   if (http_port > 0)
     evhttp_free(evhttpd);
@@ -4950,6 +5884,12 @@ void mpd_deinit(void)
       free_mpd_client_ctx(mpd_clients);
     }
 
+  queue_snapshot_clear();
+
+  if (list_prewarm_ev)
+    event_free(list_prewarm_ev);
+  list_prewarm_ev = NULL;
+
   http_port = cfg_getint(cfg_getsec(cfg, "mpd"), "http_port");
   if (http_port > 0)
     evhttp_free(evhttpd);
@@ -26,11 +26,31 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
 
+#include <event2/buffer.h>
+
+#include "conffile.h"
 #include "logger.h"
+#include "metrics.h"
+#include "misc.h"
+#include "db.h"
+#include "player.h"
 #include "outputs.h"
 
+// Size of the queue of a writer thread (in packets, about one second)
+#define OUTPUTS_QUEUE_PACKETS 126
+// How long the player will wait for room in the queue of an output with the
+// OUTPUT_QUEUE_BLOCK policy before it drops packets (ms)
+#define OUTPUTS_QUEUE_BLOCK_MS 5
+// A queue item is the rtptime of the packet followed by the packet
+#define OUTPUTS_QUEUE_ITEM_SIZE (sizeof(uint64_t) + STOB(AIRTUNES_V2_PACKET_SAMPLES))
+
 extern struct output_definition output_raop;
 extern struct output_definition output_streaming;
 extern struct output_definition output_dummy;
@@ -63,16 +83,361 @@ static struct output_definition *outputs[] = {
     NULL
 };
 
+struct output_writer
+{
+  enum output_types type;
+
+  pthread_t tid;
+
+  // Held by the writer thread while it writes, and by the player thread when
+  // it calls any other function of the output
+  pthread_mutex_t lock;
+
+  // The player thread is the only producer, and the writer thread (holding the
+  // lock) is the only consumer, so the queue itself needs no locking
+  struct ringbuffer queue;
+
+  // Posted by the player when it has queued packets, and by the writer thread
+  // when it has made room in the queue
+  sem_t packets;
+  sem_t room;
+
+  int exit;
+
+  // Only touched by the player thread
+  uint64_t drops;
+  bool dropping;
+
+  // Only touched by the consumer: rtptime of the next packet in the queue, if
+  // it was already read from the queue
+  uint64_t next_rtptime;
+  bool next_pending;
+
+  // Packets taken from the queue for the next write
+  uint8_t buf[OUTPUTS_BATCH_PACKETS_MAX * STOB(AIRTUNES_V2_PACKET_SAMPLES)];
+};
+
+// Must be in sync with enum output_types, NULL for outputs without write_thread
+static struct output_writer *writers[OUTPUT_TYPE_MAX];
+
+// Must be in sync with enum output_types. For outputs with a writer thread the
+// stats are protected by the writer's lock, otherwise only touched by the
+// player thread.
+static struct output_write_stats outputs_stats[OUTPUT_TYPE_MAX];
+static struct metrics_metric *outputs_metric_packets[OUTPUT_TYPE_MAX];
+
+// Set while devices are restored from the db, see outputs_device_restore()
+static bool outputs_restoring;
+
+
+/* ------------------------------ Writer threads ---------------------------- */
+
+static void
+writer_lock(enum output_types type)
+{
+  if (writers[type])
+    pthread_mutex_lock(&writers[type]->lock);
+}
+
+static void
+writer_unlock(enum output_types type)
+{
+  if (writers[type])
+    pthread_mutex_unlock(&writers[type]->lock);
+}
+
+static void
+write_stats_add(int i, struct timespec *start)
+{
+  struct timespec end;
+  uint64_t elapsed_us;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  elapsed_us = (end.tv_sec - start->tv_sec) * 1000000ULL + (end.tv_nsec - start->tv_nsec) / 1000;
+
+  outputs_stats[i].writes++;
+  outputs_stats[i].total_us += elapsed_us;
+  if (elapsed_us > outputs_stats[i].max_us)
+    outputs_stats[i].max_us = elapsed_us;
+}
+
+static void
+write_one(int i, uint8_t *buf, uint64_t rtptime, int npackets)
+{
+  struct timespec start;
+  int j;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (outputs[i]->write_batch)
+    outputs[i]->write_batch(buf, rtptime, npackets);
+  else
+    {
+      for (j = 0; j < npackets; j++)
+	outputs[i]->write(buf + j * STOB(AIRTUNES_V2_PACKET_SAMPLES), rtptime + j * AIRTUNES_V2_PACKET_SAMPLES);
+    }
+
+  write_stats_add(i, &start);
+
+  metrics_counter_add(outputs_metric_packets[i], npackets);
+}
+
+// Takes the next packets from the queue and writes them to the output. Only
+// contiguous packets are written together. Must be called with the lock held,
+// returns false if there was nothing in the queue.
+static bool
+writer_write_next(struct output_writer *w)
+{
+  uint64_t first;
+  int npackets;
+
+  first = 0;
+  npackets = 0;
+  while (npackets < OUTPUTS_BATCH_PACKETS_MAX)
+    {
+      if (!w->next_pending)
+	{
+	  if (ringbuffer_len(&w->queue) < OUTPUTS_QUEUE_ITEM_SIZE)
+	    break;
+
+	  ringbuffer_read(&w->next_rtptime, sizeof(w->next_rtptime), &w->queue);
+	  w->next_pending = true;
+	}
+
+      if (npackets > 0 && w->next_rtptime != first + npackets * AIRTUNES_V2_PACKET_SAMPLES)
+	break;
+
+      if (npackets == 0)
+	first = w->next_rtptime;
+
+      ringbuffer_read(w->buf + npackets * STOB(AIRTUNES_V2_PACKET_SAMPLES), STOB(AIRTUNES_V2_PACKET_SAMPLES), &w->queue);
+      w->next_pending = false;
+      npackets++;
+    }
+
+  if (npackets == 0)
+    return false;
+
+  sem_post(&w->room);
+
+  write_one(w->type, w->buf, first, npackets);
+
+  return true;
+}
+
+// Discards everything in the queue. Player thread only, with the lock held.
+static void
+writer_discard(struct output_writer *w)
+{
+  ringbuffer_read(NULL, ringbuffer_len(&w->queue), &w->queue);
+  w->next_pending = false;
+}
+
+static void *
+writer(void *arg)
+{
+  struct output_writer *w = arg;
+  bool more;
+
+  thread_sched_set(THREAD_CLASS_AUDIO);
+
+  while (1)
+    {
+      if (sem_wait(&w->packets) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  DPRINTF(E_LOG, L_PLAYER, "Writer thread for output '%s' could not wait for packets: %s\n", outputs[w->type]->name, strerror(errno));
+	  break;
+	}
+
+      if (__atomic_load_n(&w->exit, __ATOMIC_ACQUIRE))
+	break;
+
+      // The lock is released between writes, so the player doesn't have to
+      // wait for the whole queue if it needs the output
+      do
+	{
+	  pthread_mutex_lock(&w->lock);
+	  more = writer_write_next(w);
+	  pthread_mutex_unlock(&w->lock);
+	}
+      while (more);
+    }
+
+  pthread_exit(NULL);
+}
+
+// Puts the packets in the queue of the writer thread, according to the queue
+// policy of the output. Thread: player
+static void
+writer_enqueue(struct output_writer *w, uint8_t *buf, uint64_t rtptime, int npackets)
+{
+  struct timespec deadline;
+  uint64_t pkt_rtptime;
+  bool deadline_set;
+  int queued;
+  int i;
+
+  deadline_set = false;
+  queued = 0;
+  for (i = 0; i < npackets; i++)
+    {
+      if ((ringbuffer_space(&w->queue) < OUTPUTS_QUEUE_ITEM_SIZE) && (outputs[w->type]->queue_policy == OUTPUT_QUEUE_BLOCK))
+	{
+	  if (!deadline_set)
+	    {
+	      // sem_timedwait() only takes CLOCK_REALTIME
+	      clock_gettime(CLOCK_REALTIME, &deadline);
+	      deadline = timespec_add(deadline, (struct timespec){ 0, OUTPUTS_QUEUE_BLOCK_MS * 1000000 });
+	      deadline_set = true;
+
+	      // Clear out old room notifications, we only want new ones
+	      while (sem_trywait(&w->room) == 0)
+		;
+
+	      // Let the writer thread get started on what we have queued already
+	      if (queued > 0)
+		{
+		  sem_post(&w->packets);
+		  queued = 0;
+		}
+	    }
+
+	  while (ringbuffer_space(&w->queue) < OUTPUTS_QUEUE_ITEM_SIZE)
+	    {
+	      if ((sem_timedwait(&w->room, &deadline) < 0) && (errno != EINTR))
+		break;
+	    }
+	}
+
+      if (ringbuffer_space(&w->queue) < OUTPUTS_QUEUE_ITEM_SIZE)
+	{
+	  if (!w->dropping)
+	    DPRINTF(E_WARN, L_PLAYER, "Output '%s' is not keeping up, dropping packets\n", outputs[w->type]->name);
+
+	  w->dropping = true;
+	  w->drops++;
+	  continue;
+	}
+
+      if (w->dropping)
+	DPRINTF(E_INFO, L_PLAYER, "Output '%s' is keeping up again (%" PRIu64 " packets dropped so far)\n", outputs[w->type]->name, w->drops);
+
+      w->dropping = false;
+
+      pkt_rtptime = rtptime + i * AIRTUNES_V2_PACKET_SAMPLES;
+      ringbuffer_write(&w->queue, &pkt_rtptime, sizeof(pkt_rtptime));
+      ringbuffer_write(&w->queue, buf + i * STOB(AIRTUNES_V2_PACKET_SAMPLES), STOB(AIRTUNES_V2_PACKET_SAMPLES));
+      queued++;
+    }
+
+  if (queued > 0)
+    sem_post(&w->packets);
+}
+
+static int
+writer_start(enum output_types type)
+{
+  struct output_writer *w;
+  pthread_mutexattr_t mattr;
+  int ret;
+
+  w = calloc(1, sizeof(struct output_writer));
+  if (!w)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Out of memory for writer thread of output '%s'\n", outputs[type]->name);
+      return -1;
+    }
+
+  w->type = type;
+
+  ret = ringbuffer_init(&w->queue, OUTPUTS_QUEUE_PACKETS * OUTPUTS_QUEUE_ITEM_SIZE);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Out of memory for the queue of output '%s'\n", outputs[type]->name);
+      goto queue_fail;
+    }
+
+  // Recursive, since an output may cause the player to call back into it
+  CHECK_ERR(L_PLAYER, pthread_mutexattr_init(&mattr));
+  CHECK_ERR(L_PLAYER, pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE));
+  CHECK_ERR(L_PLAYER, pthread_mutex_init(&w->lock, &mattr));
+  CHECK_ERR(L_PLAYER, pthread_mutexattr_destroy(&mattr));
+
+  CHECK_ERRNO(L_PLAYER, sem_init(&w->packets, 0, 0));
+  CHECK_ERRNO(L_PLAYER, sem_init(&w->room, 0, 0));
+
+  ret = pthread_create(&w->tid, NULL, writer, w);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not spawn writer thread for output '%s': %s\n", outputs[type]->name, strerror(ret));
+      goto thread_fail;
+    }
+
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+  pthread_setname_np(w->tid, "output");
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+  pthread_set_name_np(w->tid, "output");
+#endif
+
+  writers[type] = w;
+
+  return 0;
+
+ thread_fail:
+  sem_destroy(&w->room);
+  sem_destroy(&w->packets);
+  pthread_mutex_destroy(&w->lock);
+  ringbuffer_free(&w->queue, 1);
+ queue_fail:
+  free(w);
+  return -1;
+}
+
+static void
+writer_stop(enum output_types type)
+{
+  struct output_writer *w = writers[type];
+
+  if (!w)
+    return;
+
+  __atomic_store_n(&w->exit, 1, __ATOMIC_RELEASE);
+  sem_post(&w->packets);
+
+  pthread_join(w->tid, NULL);
+
+  writers[type] = NULL;
+
+  sem_destroy(&w->room);
+  sem_destroy(&w->packets);
+  pthread_mutex_destroy(&w->lock);
+  ringbuffer_free(&w->queue, 1);
+  free(w);
+}
+
+
+/* ---------------------------- Called by player ---------------------------- */
+
 int
 outputs_device_start(struct output_device *device, output_status_cb cb, uint64_t rtptime)
 {
+  int ret;
+
   if (outputs[device->type]->disabled)
     return -1;
 
-  if (outputs[device->type]->device_start)
-    return outputs[device->type]->device_start(device, cb, rtptime);
-  else
+  if (!outputs[device->type]->device_start)
     return -1;
+
+  writer_lock(device->type);
+  ret = outputs[device->type]->device_start(device, cb, rtptime);
+  writer_unlock(device->type);
+
+  return ret;
 }
 
 void
@@ -81,20 +446,30 @@ outputs_device_stop(struct output_session *session)
   if (outputs[session->type]->disabled)
     return;
 
-  if (outputs[session->type]->device_stop)
-    outputs[session->type]->device_stop(session);
+  if (!outputs[session->type]->device_stop)
+    return;
+
+  writer_lock(session->type);
+  outputs[session->type]->device_stop(session);
+  writer_unlock(session->type);
 }
 
 int
 outputs_device_probe(struct output_device *device, output_status_cb cb)
 {
+  int ret;
+
   if (outputs[device->type]->disabled)
     return -1;
 
-  if (outputs[device->type]->device_probe)
-    return outputs[device->type]->device_probe(device, cb);
-  else
+  if (!outputs[device->type]->device_probe)
     return -1;
+
+  writer_lock(device->type);
+  ret = outputs[device->type]->device_probe(device, cb);
+  writer_unlock(device->type);
+
+  return ret;
 }
 
 void
@@ -110,26 +485,185 @@ outputs_device_free(struct output_device *device)
     DPRINTF(E_LOG, L_PLAYER, "BUG! Freeing device with active session?\n");
 
   if (outputs[device->type]->device_free_extra)
-    outputs[device->type]->device_free_extra(device);
+    {
+      writer_lock(device->type);
+      outputs[device->type]->device_free_extra(device);
+      writer_unlock(device->type);
+    }
 
   free(device->name);
   free(device->auth_key);
   free(device->v4_address);
   free(device->v6_address);
+  free(device->mdns_name);
+  free(device->mdns_txt);
 
   free(device);
 }
 
+void
+outputs_device_mdns_set(struct output_device *device, const char *name, struct keyval *txt)
+{
+  struct onekeyval *okv;
+  struct evbuffer *evbuf;
+
+  device->restored = outputs_restoring;
+
+  free(device->mdns_name);
+  device->mdns_name = safe_strdup(name);
+
+  free(device->mdns_txt);
+  device->mdns_txt = NULL;
+
+  if (!txt)
+    return;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    return;
+
+  // Values can't contain newlines, since they come from the TXT record strings
+  for (okv = txt->head; okv; okv = okv->next)
+    evbuffer_add_printf(evbuf, "%s=%s\n", okv->name, okv->value);
+
+  evbuffer_add(evbuf, "", 1);
+  device->mdns_txt = strdup((char *)evbuffer_pullup(evbuf, -1));
+
+  evbuffer_free(evbuf);
+}
+
+struct restore_arg
+{
+  const char *mdns_type;
+  int family;
+  mdns_browse_cb cb;
+};
+
+static void
+restore_cb(const char *mdns_name, const char *mdns_txt, const char *v4_address, int v4_port, const char *v6_address, int v6_port, void *arg)
+{
+  struct restore_arg *ra = arg;
+  struct keyval *txt;
+  char *buf;
+  char *line;
+  char *ptr;
+  char *eq;
+
+  txt = keyval_alloc();
+  if (!txt)
+    return;
+
+  buf = safe_strdup(mdns_txt);
+  for (line = strtok_r(buf, "\n", &ptr); line; line = strtok_r(NULL, "\n", &ptr))
+    {
+      eq = strchr(line, '=');
+      if (!eq)
+	continue;
+
+      *eq = '\0';
+      keyval_add(txt, line, eq + 1);
+    }
+  free(buf);
+
+  DPRINTF(E_DBG, L_PLAYER, "Restoring device '%s' (%s) from saved endpoints\n", mdns_name, ra->mdns_type);
+
+  // Same calls as mdns would make, only the device will be flagged as restored
+  outputs_restoring = true;
+
+  if (v4_address && v4_port > 0)
+    ra->cb(mdns_name, ra->mdns_type, "local", NULL, AF_INET, v4_address, v4_port, txt);
+
+  if (v6_address && v6_port > 0 && ra->family == AF_UNSPEC)
+    ra->cb(mdns_name, ra->mdns_type, "local", NULL, AF_INET6, v6_address, v6_port, txt);
+
+  outputs_restoring = false;
+
+  keyval_clear(txt);
+  free(txt);
+}
+
+/* Gets the devices of the given type that were known at the last shutdown from
+ * the db, and adds them through the output's mDNS browse callback. The player
+ * probes restored devices, so they are available right away instead of after
+ * mDNS discovery, which can take several seconds. A restored device is removed
+ * again if the probe fails, while mDNS will confirm the ones that are alive.
+ * Devices that mDNS hasn't announced for speaker_restore_days are not restored.
+ */
+void
+outputs_device_restore(enum output_types type, const char *mdns_type, int family, mdns_browse_cb cb)
+{
+  struct restore_arg ra;
+  time_t seen_since;
+  int days;
+  int ret;
+
+  days = cfg_getint(cfg_getsec(cfg, "general"), "speaker_restore_days");
+  if (days <= 0)
+    return;
+
+  ra.mdns_type = mdns_type;
+  ra.family = family;
+  ra.cb = cb;
+
+  seen_since = time(NULL) - (time_t)days * 24 * 3600;
+
+  ret = db_speaker_enum_endpoints(type, seen_since, restore_cb, &ra);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_PLAYER, "Could not restore %s devices from the db\n", outputs_name(type));
+}
+
 int
 outputs_device_volume_set(struct output_device *device, output_status_cb cb)
 {
+  int ret;
+
   if (outputs[device->type]->disabled)
     return -1;
 
-  if (outputs[device->type]->device_volume_set)
-    return outputs[device->type]->device_volume_set(device, cb);
-  else
+  if (!outputs[device->type]->device_volume_set)
+    return -1;
+
+  writer_lock(device->type);
+  ret = outputs[device->type]->device_volume_set(device, cb);
+  writer_unlock(device->type);
+
+  return ret;
+}
+
+/* Returns the sync offset of the device in samples. All outputs schedule their
+ * audio against the rtptime clock of the player, so a sample with rtptime t
+ * must be heard when the player position is t - offset.
+ */
+int
+outputs_device_offset(struct output_device *device)
+{
+  int offset_ms;
+
+  offset_ms = device->offset_ms;
+  if (offset_ms > OUTPUTS_OFFSET_MAX_MS)
+    offset_ms = OUTPUTS_OFFSET_MAX_MS;
+  else if (offset_ms < -OUTPUTS_OFFSET_MAX_MS)
+    offset_ms = -OUTPUTS_OFFSET_MAX_MS;
+
+  return offset_ms * 44100 / 1000;
+}
+
+// Returns 0 if the offset was applied to the session, 1 if it will be applied
+// with the next session, -1 on error
+int
+outputs_device_offset_set(struct output_device *device)
+{
+  if (outputs[device->type]->disabled)
     return -1;
+
+  if (!device->session || !outputs[device->type]->device_offset_set)
+    return 1;
+
+  writer_lock(device->type);
+  outputs[device->type]->device_offset_set(device);
+  writer_unlock(device->type);
+
+  return 0;
 }
 
 void
@@ -142,8 +676,12 @@ outputs_playback_start(uint64_t next_pkt, struct timespec *ts)
       if (outputs[i]->disabled)
 	continue;
 
-      if (outputs[i]->playback_start)
-	outputs[i]->playback_start(next_pkt, ts);
+      if (!outputs[i]->playback_start)
+	continue;
+
+      writer_lock(i);
+      outputs[i]->playback_start(next_pkt, ts);
+      writer_unlock(i);
     }
 }
 
@@ -157,13 +695,26 @@ outputs_playback_stop(void)
       if (outputs[i]->disabled)
 	continue;
 
+      writer_lock(i);
+
+      if (writers[i])
+	writer_discard(writers[i]);
+
       if (outputs[i]->playback_stop)
 	outputs[i]->playback_stop();
+
+      writer_unlock(i);
     }
 }
 
 void
 outputs_write(uint8_t *buf, uint64_t rtptime)
+{
+  outputs_write_batch(buf, rtptime, 1);
+}
+
+void
+outputs_write_batch(uint8_t *buf, uint64_t rtptime, int npackets)
 {
   int i;
 
@@ -172,8 +723,13 @@ outputs_write(uint8_t *buf, uint64_t rtptime)
       if (outputs[i]->disabled)
 	continue;
 
-      if (outputs[i]->write)
-	outputs[i]->write(buf, rtptime);
+      if (!outputs[i]->write && !outputs[i]->write_batch)
+	continue;
+
+      if (writers[i])
+	writer_enqueue(writers[i], buf, rtptime, npackets);
+      else
+	write_one(i, buf, rtptime, npackets);
     }
 }
 
@@ -189,21 +745,79 @@ outputs_flush(output_status_cb cb, uint64_t rtptime)
       if (outputs[i]->disabled)
 	continue;
 
+      writer_lock(i);
+
+      if (writers[i])
+	writer_discard(writers[i]);
+
       if (outputs[i]->flush)
 	ret += outputs[i]->flush(cb, rtptime);
+
+      writer_unlock(i);
     }
 
   return ret;
 }
 
+// Copies the write stats of the enabled outputs that have a write function to
+// stats, which must have room for OUTPUT_TYPE_MAX elements. A batched write
+// counts as one write.
+void
+outputs_write_stats_get(struct output_write_stats *stats, int *count)
+{
+  int i;
+
+  *count = 0;
+  for (i = 0; outputs[i]; i++)
+    {
+      if (outputs[i]->disabled || (!outputs[i]->write && !outputs[i]->write_batch))
+	continue;
+
+      writer_lock(i);
+      stats[*count] = outputs_stats[i];
+      writer_unlock(i);
+
+      stats[*count].name = outputs[i]->name;
+      if (writers[i])
+	{
+	  stats[*count].drops = writers[i]->drops;
+	  stats[*count].queued = ringbuffer_len(&writers[i]->queue) / OUTPUTS_QUEUE_ITEM_SIZE;
+	}
+      else if (outputs[i]->write_stats)
+	outputs[i]->write_stats(&stats[*count]);
+
+      (*count)++;
+    }
+}
+
+void
+outputs_write_stats_reset(void)
+{
+  int i;
+
+  for (i = 0; outputs[i]; i++)
+    {
+      writer_lock(i);
+      memset(&outputs_stats[i], 0, sizeof(struct output_write_stats));
+      writer_unlock(i);
+
+      if (writers[i])
+	writers[i]->drops = 0;
+    }
+}
+
 void
 outputs_status_cb(struct output_session *session, output_status_cb cb)
 {
   if (outputs[session->type]->disabled)
     return;
 
-  if (outputs[session->type]->status_cb)
-    outputs[session->type]->status_cb(session, cb);
+  if (!outputs[session->type]->status_cb)
+    return;
+
+  writer_lock(session->type);
+  outputs[session->type]->status_cb(session, cb);
+  writer_unlock(session->type);
 }
 
 struct output_metadata *
@@ -223,7 +837,9 @@ outputs_metadata_prepare(int id)
       if (!outputs[i]->metadata_prepare)
 	continue;
 
+      writer_lock(i);
       metadata = outputs[i]->metadata_prepare(id);
+      writer_unlock(i);
       if (!metadata)
 	continue;
 
@@ -238,7 +854,7 @@ outputs_metadata_prepare(int id)
       omd->metadata = metadata;
     }
 
-  return omd;  
+  return omd;
 }
 
 void
@@ -263,7 +879,9 @@ outputs_metadata_send(struct output_metadata *omd, uint64_t rtptime, uint64_t of
       if (!ptr)
 	continue;
 
+      writer_lock(i);
       outputs[i]->metadata_send(ptr->metadata, rtptime, offset, startup);
+      writer_unlock(i);
     }
 }
 
@@ -277,8 +895,12 @@ outputs_metadata_purge(void)
       if (outputs[i]->disabled)
 	continue;
 
-      if (outputs[i]->metadata_purge)
-	outputs[i]->metadata_purge();
+      if (!outputs[i]->metadata_purge)
+	continue;
+
+      writer_lock(i);
+      outputs[i]->metadata_purge();
+      writer_unlock(i);
     }
 }
 
@@ -292,8 +914,12 @@ outputs_metadata_prune(uint64_t rtptime)
       if (outputs[i]->disabled)
 	continue;
 
-      if (outputs[i]->metadata_prune)
-	outputs[i]->metadata_prune(rtptime);
+      if (!outputs[i]->metadata_prune)
+	continue;
+
+      writer_lock(i);
+      outputs[i]->metadata_prune(rtptime);
+      writer_unlock(i);
     }
 }
 
@@ -318,8 +944,24 @@ outputs_authorize(enum output_types type, const char *pin)
   if (outputs[type]->disabled)
     return;
 
-  if (outputs[type]->authorize)
-    outputs[type]->authorize(pin);
+  if (!outputs[type]->authorize)
+    return;
+
+  writer_lock(type);
+  outputs[type]->authorize(pin);
+  writer_unlock(type);
+}
+
+void
+outputs_lock(enum output_types type)
+{
+  writer_lock(type);
+}
+
+void
+outputs_unlock(enum output_types type)
+{
+  writer_unlock(type);
 }
 
 int
@@ -328,6 +970,12 @@ outputs_priority(struct output_device *device)
   return outputs[device->type]->priority;
 }
 
+int
+outputs_low_latency(struct output_device *device)
+{
+  return outputs[device->type]->low_latency;
+}
+
 const char *
 outputs_name(enum output_types type)
 {
@@ -337,6 +985,7 @@ outputs_name(enum output_types type)
 int
 outputs_init(void)
 {
+  char labels[64];
   int no_output;
   int ret;
   int i;
@@ -358,9 +1007,20 @@ outputs_init(void)
 
       ret = outputs[i]->init();
       if (ret < 0)
-	outputs[i]->disabled = 1;
-      else
-	no_output = 0;
+	{
+	  outputs[i]->disabled = 1;
+	  continue;
+	}
+
+      no_output = 0;
+
+      snprintf(labels, sizeof(labels), "output=\"%s\"", outputs[i]->name);
+      outputs_metric_packets[i] = metrics_register("forked_daapd_output_packets_total", labels, METRICS_COUNTER, "Packets written to the outputs");
+
+      // If we can't get a writer thread the output will just be written to
+      // from the player thread
+      if (outputs[i]->write_thread)
+	writer_start(i);
     }
 
   if (no_output)
@@ -379,8 +1039,9 @@ outputs_deinit(void)
       if (outputs[i]->disabled)
 	continue;
 
+      writer_stop(i);
+
       if (outputs[i]->deinit)
         outputs[i]->deinit();
     }
 }
-
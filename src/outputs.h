@@ -4,6 +4,8 @@
 
 #include <time.h>
 
+#include "mdns.h"
+
 /* Outputs is a generic interface between the player and a media output method,
  * like for instance AirPlay (raop) or ALSA. The purpose of the interface is to
  * make it easier to add new outputs without messing too much with the player or
@@ -28,7 +30,7 @@
  *   -> (fail)         -> device_stop       -> device_lost_cb
  * speaker_activate    -> device_probe      -> device_probe_cb
  * speaker_deactivate  -> device_stop       -> device_shutdown_cb
- * volume_set          -> device_volume_set -> device_command_cb
+ * volume_set          -> device_volume_set -> device_volume_cb
  *   ->                                     -> device_streaming_cb
  * (volume_setrel/abs_speaker is the same)
  * playback_start_item -> device_start      -> device_restart_cb
@@ -46,6 +48,13 @@
  *
  */
 
+// Maximum number of packets the player will give to outputs_write_batch()
+#define OUTPUTS_BATCH_PACKETS_MAX 16
+
+// Limit of the sync offset of a device (output_device->offset_ms), which must
+// be well within the 2 seconds that the player sends ahead of time
+#define OUTPUTS_OFFSET_MAX_MS 1000
+
 // Must be in sync with outputs[] in outputs.c
 enum output_types
 {
@@ -62,6 +71,7 @@ enum output_types
 #ifdef CHROMECAST
   OUTPUT_TYPE_CAST,
 #endif
+  OUTPUT_TYPE_MAX,
 };
 
 /* Output session state */
@@ -103,6 +113,9 @@ struct output_device
   unsigned has_password:1;
   unsigned has_video:1;
   unsigned requires_auth:1;
+  // Device was restored from the endpoints saved in the db, and has not yet
+  // been confirmed by mDNS
+  unsigned restored:1;
 
   // Credentials if relevant
   const char *password;
@@ -112,12 +125,27 @@ struct output_device
   int volume;
   int relvol;
 
+  // A volume request is in flight, and the volume changed again since it was
+  // sent. The player sends the latest volume when the request completes.
+  unsigned volume_pending:1;
+  unsigned volume_resend:1;
+
+  // Sync offset in milliseconds, positive values make the device play ahead of
+  // the player clock, negative delay it. Used to compensate for the latency of
+  // the device (e.g. of a receiver) that the output can't measure.
+  int offset_ms;
+
   // Address
   char *v4_address;
   char *v6_address;
   short v4_port;
   short v6_port;
 
+  // mDNS service name and TXT record of the device, saved in the db so that the
+  // device can be restored at startup without waiting for mDNS
+  char *mdns_name;
+  char *mdns_txt;
+
   // Opaque pointers to device and session data
   void *extra_device_info;
   struct output_session *session;
@@ -140,6 +168,33 @@ struct output_metadata
   struct output_metadata *next;
 };
 
+// Timing of the write() calls made to an output backend, used for the player
+// statistics. Collected by outputs_write() in the player thread, or by the
+// writer thread if the output has one.
+struct output_write_stats
+{
+  const char *name;
+
+  uint64_t writes;
+  uint64_t total_us;
+  uint64_t max_us;
+
+  // For outputs with a writer thread: packets that were dropped because the
+  // queue was full, and packets currently in the queue. Outputs that do their
+  // own buffering may instead report theirs with write_stats().
+  uint64_t drops;
+  int queued;
+};
+
+// What the player should do when the queue of an output's writer thread is full
+enum output_queue_policy
+{
+  // Drop the packets that don't fit
+  OUTPUT_QUEUE_DROP  = 0,
+  // Wait a little (OUTPUTS_QUEUE_BLOCK_MS) for the writer thread, then drop
+  OUTPUT_QUEUE_BLOCK = 1,
+};
+
 typedef void (*output_status_cb)(struct output_device *device, struct output_session *session, enum output_device_state status);
 
 struct output_definition
@@ -157,6 +212,19 @@ struct output_definition
   // Set to 1 if the output initialization failed
   int disabled;
 
+  // Set to 1 if the output has little buffering of its own and therefore needs
+  // the player to write at the packet rate (otherwise it may write in batches)
+  int low_latency;
+
+  // Set to 1 if write()/write_batch() may block, they will then be called from
+  // a writer thread of the output, so that the player thread is not delayed.
+  // The player queues the packets for the writer thread, and queue_policy
+  // decides what happens if the queue is full. Calls to all the other
+  // functions of the output are serialized with the writer thread, so the
+  // output itself does not need to be thread safe.
+  int write_thread;
+  enum output_queue_policy queue_policy;
+
   // Initialization function called during startup
   // Output must call device_cb when an output device becomes available/unavailable
   int (*init)(void);
@@ -179,6 +247,10 @@ struct output_definition
   // Set the volume and call back
   int (*device_volume_set)(struct output_device *device, output_status_cb cb);
 
+  // Apply a changed offset_ms to the session of the device. Optional, if not
+  // set the offset will only be applied when the next session is started.
+  void (*device_offset_set)(struct output_device *device);
+
   // Start/stop playback on devices that were started
   void (*playback_start)(uint64_t next_pkt, struct timespec *ts);
   void (*playback_stop)(void);
@@ -186,6 +258,15 @@ struct output_definition
   // Write stream data to the output devices
   void (*write)(uint8_t *buf, uint64_t rtptime);
 
+  // Write npackets contiguous packets of stream data to the output devices,
+  // rtptime is the rtptime of the first packet. Optional, if not set write()
+  // will be called for each packet.
+  void (*write_batch)(uint8_t *buf, uint64_t rtptime, int npackets);
+
+  // Fill in drops and queued of the write stats, for outputs that do their
+  // own buffering. Optional.
+  void (*write_stats)(struct output_write_stats *stats);
+
   // Flush all sessions, the return must be number of sessions pending the flush
   int (*flush)(output_status_cb cb, uint64_t rtptime);
 
@@ -214,9 +295,21 @@ outputs_device_probe(struct output_device *device, output_status_cb cb);
 void
 outputs_device_free(struct output_device *device);
 
+void
+outputs_device_mdns_set(struct output_device *device, const char *name, struct keyval *txt);
+
+void
+outputs_device_restore(enum output_types type, const char *mdns_type, int family, mdns_browse_cb cb);
+
 int
 outputs_device_volume_set(struct output_device *device, output_status_cb cb);
 
+int
+outputs_device_offset(struct output_device *device);
+
+int
+outputs_device_offset_set(struct output_device *device);
+
 void
 outputs_playback_start(uint64_t next_pkt, struct timespec *ts);
 
@@ -226,9 +319,18 @@ outputs_playback_stop(void);
 void
 outputs_write(uint8_t *buf, uint64_t rtptime);
 
+void
+outputs_write_batch(uint8_t *buf, uint64_t rtptime, int npackets);
+
 int
 outputs_flush(output_status_cb cb, uint64_t rtptime);
 
+void
+outputs_write_stats_get(struct output_write_stats *stats, int *count);
+
+void
+outputs_write_stats_reset(void);
+
 void
 outputs_status_cb(struct output_session *session, output_status_cb cb);
 
@@ -250,9 +352,22 @@ outputs_metadata_free(struct output_metadata *omd);
 void
 outputs_authorize(enum output_types type, const char *pin);
 
+/* Outputs with a write_thread must hold this lock when they change state that
+ * write() uses, outside of the functions that are called via outputs.c (e.g.
+ * in their own deferred callbacks)
+ */
+void
+outputs_lock(enum output_types type);
+
+void
+outputs_unlock(enum output_types type);
+
 int
 outputs_priority(struct output_device *device);
 
+int
+outputs_low_latency(struct output_device *device);
+
 const char *
 outputs_name(enum output_types type);
 
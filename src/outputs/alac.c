@@ -0,0 +1,394 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The encoder mirrors what ALAC decoders do: an LPC predictor on differences
+ * from the sample preceding the prediction window, whose coefficients adapt
+ * sample by sample to the sign of the residual, followed by adaptive Rice
+ * coding with run length coding of zeros. Since the decoder adapts the
+ * coefficients on its own, only the initial ones are sent.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "alac.h"
+
+#define ALAC_MAX_SAMPLES     4096
+#define ALAC_LPC_ORDER       8
+#define ALAC_LPC_QUANT       9
+// Both channels are coded with one extra bit, since the side channel needs it
+#define ALAC_BPS             17
+#define ALAC_ESCAPE_CODE     0x1ff
+#define ALAC_ELEMENT_CPE     1
+#define ALAC_ELEMENT_END     7
+
+struct bitwriter
+{
+  uint8_t *buf;
+  size_t len;
+  size_t pos;
+
+  uint64_t acc;
+  int nbits;
+  bool overflow;
+};
+
+static inline void
+bits_put(struct bitwriter *bw, uint32_t val, int n)
+{
+  bw->acc = (bw->acc << n) | (val & ((1ULL << n) - 1));
+  bw->nbits += n;
+
+  while (bw->nbits >= 8)
+    {
+      bw->nbits -= 8;
+
+      if (bw->pos < bw->len)
+	bw->buf[bw->pos++] = bw->acc >> bw->nbits;
+      else
+	bw->overflow = true;
+    }
+}
+
+static inline void
+bits_flush(struct bitwriter *bw)
+{
+  if (bw->nbits > 0)
+    bits_put(bw, 0, 8 - bw->nbits);
+}
+
+static inline int
+log2_int(uint32_t v)
+{
+  int n = 0;
+
+  while (v >>= 1)
+    n++;
+
+  return n;
+}
+
+static inline int
+sign_only(int v)
+{
+  return (v > 0) - (v < 0);
+}
+
+static inline int32_t
+sign_extend(int32_t val, int bits)
+{
+  int shift = 32 - bits;
+
+  return (int32_t)((uint32_t)val << shift) >> shift;
+}
+
+/* Levinson-Durbin on the autocorrelation of the samples. The coefficients are
+ * returned quantized, coefs[0] applies to the most recent sample.
+ */
+static void
+lpc_coefs_calc(int16_t *coefs, const int32_t *samples, int nsamples)
+{
+  double autoc[ALAC_LPC_ORDER + 1];
+  double lpc[ALAC_LPC_ORDER];
+  double tmp[ALAC_LPC_ORDER];
+  double err;
+  double r;
+  double c;
+  int i;
+  int j;
+
+  for (i = 0; i <= ALAC_LPC_ORDER; i++)
+    {
+      autoc[i] = 0;
+      for (j = i; j < nsamples; j++)
+	autoc[i] += (double)samples[j] * samples[j - i];
+    }
+
+  memset(coefs, 0, ALAC_LPC_ORDER * sizeof(int16_t));
+  if (autoc[0] == 0)
+    return;
+
+  // A little white noise keeps the recursion stable
+  autoc[0] *= 1.0001;
+
+  err = autoc[0];
+  for (i = 0; i < ALAC_LPC_ORDER; i++)
+    {
+      r = autoc[i + 1];
+      for (j = 0; j < i; j++)
+	r -= lpc[j] * autoc[i - j];
+      r /= err;
+
+      for (j = 0; j < i; j++)
+	tmp[j] = lpc[j] - r * lpc[i - 1 - j];
+      for (j = 0; j < i; j++)
+	lpc[j] = tmp[j];
+      lpc[i] = r;
+
+      err *= 1.0 - r * r;
+      if (err <= 0)
+	break;
+    }
+
+  for (i = 0; i < ALAC_LPC_ORDER; i++)
+    {
+      c = lpc[i] * (1 << ALAC_LPC_QUANT);
+      c = (c < 0) ? c - 0.5 : c + 0.5;
+      if (c > INT16_MAX)
+	c = INT16_MAX;
+      else if (c < INT16_MIN)
+	c = INT16_MIN;
+
+      coefs[i] = (int16_t)c;
+    }
+}
+
+/* Produces the residuals the decoder will need to reconstruct the samples.
+ * This must do exactly what the decoder does, including its 32 bit wrapping
+ * arithmetic and the coefficient adaptation. Here coefs[j] applies to
+ * samples[i - order + j], which is the reverse of lpc_coefs_calc().
+ */
+static void
+lpc_residuals(int32_t *residuals, const int32_t *samples, int nsamples, int16_t *coefs, int order)
+{
+  const int32_t *pred;
+  uint32_t sum;
+  int32_t val;
+  int32_t err;
+  int32_t d;
+  int err_sign;
+  int sign;
+  int i;
+  int j;
+
+  residuals[0] = samples[0];
+
+  for (i = 1; i <= order && i < nsamples; i++)
+    residuals[i] = sign_extend(samples[i] - samples[i - 1], ALAC_BPS);
+
+  for (; i < nsamples; i++)
+    {
+      d = samples[i - order - 1];
+      pred = &samples[i - order];
+
+      sum = 0;
+      for (j = 0; j < order; j++)
+	sum += (uint32_t)(pred[j] - d) * (uint32_t)coefs[j];
+
+      val = (int32_t)(sum + (1U << (ALAC_LPC_QUANT - 1))) >> ALAC_LPC_QUANT;
+
+      err = sign_extend(samples[i] - d - val, ALAC_BPS);
+      residuals[i] = err;
+
+      err_sign = sign_only(err);
+      if (!err_sign)
+	continue;
+
+      for (j = 0; j < order && err * err_sign > 0; j++)
+	{
+	  val = d - pred[j];
+	  sign = sign_only(val) * err_sign;
+	  coefs[j] -= sign;
+	  val *= sign;
+	  err -= (val >> ALAC_LPC_QUANT) * (j + 1);
+	}
+    }
+}
+
+static void
+rice_put(struct bitwriter *bw, uint32_t x, int k, int escape_bits)
+{
+  uint32_t divisor;
+  uint32_t q;
+  uint32_t r;
+
+  if (k > ALAC_RICE_LIMIT)
+    k = ALAC_RICE_LIMIT;
+
+  divisor = (1 << k) - 1;
+  q = x / divisor;
+  r = x % divisor;
+
+  if (q > 8)
+    {
+      bits_put(bw, ALAC_ESCAPE_CODE, 9);
+      bits_put(bw, x, escape_bits);
+      return;
+    }
+
+  if (q)
+    bits_put(bw, (1 << q) - 1, q);
+  bits_put(bw, 0, 1);
+
+  if (k != 1)
+    {
+      if (r > 0)
+	bits_put(bw, r + 1, k);
+      else
+	bits_put(bw, 0, k - 1);
+    }
+}
+
+static void
+rice_encode(struct bitwriter *bw, const int32_t *residuals, int nsamples)
+{
+  uint32_t history;
+  uint32_t block;
+  uint32_t x;
+  int modifier;
+  int k;
+  int i;
+
+  history = ALAC_RICE_INITIAL_HISTORY;
+  modifier = 0;
+
+  for (i = 0; i < nsamples; )
+    {
+      k = log2_int((history >> 9) + 3);
+
+      // Zigzag, so small negative values also get small codes
+      x = (residuals[i] < 0) ? (uint32_t)(-2 * residuals[i] - 1) : (uint32_t)(2 * residuals[i]);
+      i++;
+
+      rice_put(bw, x - modifier, k, ALAC_BPS);
+      modifier = 0;
+
+      if (x > 0xffff)
+	history = 0xffff;
+      else
+	history += x * ALAC_RICE_HISTORY_MULT - ((history * ALAC_RICE_HISTORY_MULT) >> 9);
+
+      if (history < 128 && i < nsamples)
+	{
+	  k = 7 - log2_int(history) + ((history + 16) >> 6);
+
+	  for (block = 0; i < nsamples && residuals[i] == 0; i++)
+	    block++;
+
+	  rice_put(bw, block, k, 16);
+	  modifier = (block <= 0xffff);
+	  history = 0;
+	}
+    }
+}
+
+static uint64_t
+diff_cost(const int32_t *samples, int nsamples)
+{
+  uint64_t cost;
+  int32_t d;
+  int i;
+
+  cost = 0;
+  for (i = 1; i < nsamples; i++)
+    {
+      d = samples[i] - samples[i - 1];
+      cost += (d < 0) ? -d : d;
+    }
+
+  return cost;
+}
+
+int
+alac_encode_compressed(uint8_t *buf, size_t buflen, const uint8_t *raw, int nsamples)
+{
+  struct bitwriter bw = { .buf = buf, .len = buflen };
+  int32_t samples[2][ALAC_MAX_SAMPLES];
+  int32_t residuals[2][ALAC_MAX_SAMPLES];
+  int16_t coefs[2][ALAC_LPC_ORDER];
+  int16_t adapt[ALAC_LPC_ORDER];
+  int shift;
+  int weight;
+  int ch;
+  int i;
+
+  if (nsamples <= ALAC_LPC_ORDER || nsamples > ALAC_MAX_SAMPLES)
+    return -1;
+
+  for (i = 0; i < nsamples; i++)
+    {
+      samples[0][i] = (int16_t)(raw[4 * i] | (raw[4 * i + 1] << 8));
+      samples[1][i] = (int16_t)(raw[4 * i + 2] | (raw[4 * i + 3] << 8));
+    }
+
+  // Mid/side unless the channels are so different that left/right is cheaper
+  shift = 0;
+  weight = 0;
+  if (diff_cost(samples[0], nsamples) + diff_cost(samples[1], nsamples) > 0)
+    {
+      for (i = 0; i < nsamples; i++)
+	{
+	  residuals[0][i] = samples[1][i] + ((samples[0][i] - samples[1][i]) >> 1);
+	  residuals[1][i] = samples[0][i] - samples[1][i];
+	}
+
+      if (diff_cost(residuals[0], nsamples) + diff_cost(residuals[1], nsamples) < diff_cost(samples[0], nsamples) + diff_cost(samples[1], nsamples))
+	{
+	  memcpy(samples, residuals, sizeof(samples));
+	  shift = 1;
+	  weight = 1;
+	}
+    }
+
+  bits_put(&bw, ALAC_ELEMENT_CPE, 3);
+  bits_put(&bw, 0, 4);  // element instance
+  bits_put(&bw, 0, 12); // unused
+  bits_put(&bw, 0, 1);  // no sample count, frame length is from the SDP
+  bits_put(&bw, 0, 2);  // no extra bytes
+  bits_put(&bw, 0, 1);  // compressed
+
+  bits_put(&bw, shift, 8);
+  bits_put(&bw, weight, 8);
+
+  for (ch = 0; ch < 2; ch++)
+    {
+      lpc_coefs_calc(adapt, samples[ch], nsamples);
+
+      bits_put(&bw, 0, 4); // prediction type
+      bits_put(&bw, ALAC_LPC_QUANT, 4);
+      bits_put(&bw, 4, 3); // rice modifier, the decoder uses it as modifier * pb / 4
+      bits_put(&bw, ALAC_LPC_ORDER, 5);
+
+      // Most recent sample first, and reversed for lpc_residuals()
+      for (i = 0; i < ALAC_LPC_ORDER; i++)
+	{
+	  bits_put(&bw, (uint16_t)adapt[i], 16);
+	  coefs[ch][ALAC_LPC_ORDER - 1 - i] = adapt[i];
+	}
+    }
+
+  for (ch = 0; ch < 2; ch++)
+    {
+      lpc_residuals(residuals[ch], samples[ch], nsamples, coefs[ch], ALAC_LPC_ORDER);
+      rice_encode(&bw, residuals[ch], nsamples);
+
+      if (bw.overflow)
+	return -1;
+    }
+
+  bits_put(&bw, ALAC_ELEMENT_END, 3);
+  bits_flush(&bw);
+
+  if (bw.overflow)
+    return -1;
+
+  return bw.pos;
+}
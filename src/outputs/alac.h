@@ -0,0 +1,23 @@
+#ifndef __ALAC_H__
+#define __ALAC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compressed ALAC encoder for AirPlay. The entropy coder parameters must match
+ * what is announced in the SDP fmtp line, i.e.
+ * "<frame length> 0 16 40 10 14 2 255 0 0 44100".
+ */
+
+#define ALAC_RICE_HISTORY_MULT   40
+#define ALAC_RICE_INITIAL_HISTORY 10
+#define ALAC_RICE_LIMIT          14
+
+/* Encodes nsamples frames of interleaved 16 bit little endian stereo from raw
+ * into buf. Returns the length of the compressed ALAC frame, or -1 if it does
+ * not fit in buflen, in which case the caller should send the frame verbatim.
+ */
+int
+alac_encode_compressed(uint8_t *buf, size_t buflen, const uint8_t *raw, int nsamples);
+
+#endif /* !__ALAC_H__ */
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 
 #include <event2/event.h>
@@ -37,11 +38,21 @@
 #include "logger.h"
 #include "player.h"
 #include "outputs.h"
+#include "pcm.h"
 
 #define PACKET_SIZE STOB(AIRTUNES_V2_PACKET_SAMPLES)
-// The maximum number of samples that the output is allowed to get behind (or
-// ahead) of the player position, before compensation is attempted
-#define ALSA_MAX_LATENCY 352
+// Drift between the sound card and the player clock is continuously corrected
+// by slightly resampling. Only if the output gets more than this number of
+// samples behind (or ahead) of the player position, e.g. after an underrun, do
+// we compensate by skipping or doubling packets.
+#define ALSA_MAX_LATENCY 4410
+// Max rate correction of the resampler in parts per million. Consumer DACs
+// are usually within 100 ppm.
+#define ALSA_RESAMPLE_MAX_PPM 1000
+// The resampler is a PI controller. The proportional part removes a latency
+// over about this many seconds, the integral part locks on to the drift.
+#define ALSA_RESAMPLE_P_SECONDS 30
+#define ALSA_RESAMPLE_I_SECONDS 120
 // If latency is jumping up and down we don't do compensation since we probably
 // wouldn't do a good job. This sets the maximum the latency is allowed to vary
 // within the 10 seconds where we measure latency each second.
@@ -57,6 +68,16 @@ static snd_mixer_elem_t *vol_elem;
 static long vol_min;
 static long vol_max;
 static int offset;
+// If set, or if there is no usable mixer, we scale the samples ourselves
+static bool software_volume;
+// Sample format negotiated with the device, we convert to it if not S16
+static snd_pcm_format_t pcm_format;
+static int pcm_sample_size;
+// If set we write (and convert) directly to the mmap'ed device buffer instead
+// of using snd_pcm_writei. Period and buffer sizes are in frames, 0 is default.
+static bool pcm_mmap;
+static snd_pcm_uframes_t period_size;
+static snd_pcm_uframes_t buffer_size;
 
 #define ALSA_F_STARTED  (1 << 15)
 
@@ -87,6 +108,17 @@ struct alsa_session
   int32_t last_latency;
   int sync_counter;
 
+  // Configured audio offset plus the device's sync offset (in samples), and
+  // what is left to skip (> 0) or repeat (< 0) after the offset was changed
+  int offset;
+  int offset_adjust;
+
+  // Resampler for drift correction, see sync_resample_adjust()
+  struct pcm_resample resample;
+  double drift_integral;
+  int16_t *resamplebuf;
+  size_t resamplebuf_size;
+
   // An array that will hold the packets we prebuffer. The length of the array
   // is prebuf_len (measured in rtp_packets)
   uint8_t *prebuf;
@@ -96,6 +128,11 @@ struct alsa_session
 
   int volume;
 
+  // Software volume (see pcm.h) and buffer for scaled/converted samples
+  int gain;
+  uint8_t *convbuf;
+  size_t convbuf_size;
+
   struct event *deferredev;
   output_status_cb defer_cb;
 
@@ -116,6 +153,9 @@ static struct alsa_session *sessions;
 static void
 defer_cb(int fd, short what, void *arg);
 
+static void
+playback_write_error(struct alsa_session *as, snd_pcm_sframes_t ret);
+
 /* ---------------------------- SESSION HANDLING ---------------------------- */
 
 static void
@@ -140,6 +180,8 @@ alsa_session_free(struct alsa_session *as)
 
   prebuf_free(as);
 
+  free(as->convbuf);
+  free(as->resamplebuf);
   free(as->output_session);
   free(as);
 }
@@ -203,8 +245,12 @@ alsa_session_make(struct output_device *device, output_status_cb cb)
   as->device = device;
   as->status_cb = cb;
   as->volume = device->volume;
+  as->gain = pcm_gain_from_volume(device->volume);
+  as->offset = offset + outputs_device_offset(device);
   as->devname = card_name;
 
+  pcm_resample_init(&as->resample);
+
   as->next = sessions;
   sessions = as;
 
@@ -241,11 +287,15 @@ defer_cb(int fd, short what, void *arg)
 	state = OUTPUT_STATE_FAILED;
     }
 
+  outputs_lock(OUTPUT_TYPE_ALSA);
+
   if (as->defer_cb)
     as->defer_cb(as->device, as->output_session, state);
 
   if (!(as->state & ALSA_F_STARTED))
     alsa_session_cleanup(as);
+
+  outputs_unlock(OUTPUT_TYPE_ALSA);
 }
 
 // Note: alsa_states also nukes the session if it is not ALSA_F_STARTED
@@ -442,7 +492,19 @@ device_open(struct alsa_session *as)
       goto out_fail;
     }
 
-  ret = snd_pcm_hw_params_set_access(hdl, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+  ret = -1;
+  if (pcm_mmap)
+    {
+      ret = snd_pcm_hw_params_set_access(hdl, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Device does not support mmap access, will use normal writes: %s\n", snd_strerror(ret));
+	  pcm_mmap = false;
+	}
+    }
+
+  if (ret < 0)
+    ret = snd_pcm_hw_params_set_access(hdl, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_LAUDIO, "Could not set access method: %s\n", snd_strerror(ret));
@@ -450,14 +512,28 @@ device_open(struct alsa_session *as)
       goto out_fail;
     }
 
-  ret = snd_pcm_hw_params_set_format(hdl, hw_params, SND_PCM_FORMAT_S16_LE);
+  // Some DACs only take 24 or 32 bit samples, then we convert
+  if (snd_pcm_hw_params_test_format(hdl, hw_params, SND_PCM_FORMAT_S16_LE) == 0)
+    pcm_format = SND_PCM_FORMAT_S16_LE;
+  else if (snd_pcm_hw_params_test_format(hdl, hw_params, SND_PCM_FORMAT_S32_LE) == 0)
+    pcm_format = SND_PCM_FORMAT_S32_LE;
+  else if (snd_pcm_hw_params_test_format(hdl, hw_params, SND_PCM_FORMAT_S24_3LE) == 0)
+    pcm_format = SND_PCM_FORMAT_S24_3LE;
+  else
+    pcm_format = SND_PCM_FORMAT_S16_LE;
+
+  ret = snd_pcm_hw_params_set_format(hdl, hw_params, pcm_format);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not set S16LE format: %s\n", snd_strerror(ret));
+      DPRINTF(E_LOG, L_LAUDIO, "Could not set %s format: %s\n", snd_pcm_format_name(pcm_format), snd_strerror(ret));
 
       goto out_fail;
     }
 
+  pcm_sample_size = snd_pcm_format_physical_width(pcm_format) / 8;
+  if (pcm_format != SND_PCM_FORMAT_S16_LE)
+    DPRINTF(E_INFO, L_LAUDIO, "Device does not support S16LE, will convert to %s\n", snd_pcm_format_name(pcm_format));
+
   ret = snd_pcm_hw_params_set_channels(hdl, hw_params, 2);
   if (ret < 0)
     {
@@ -474,20 +550,52 @@ device_open(struct alsa_session *as)
       goto out_fail;
     }
 
-  ret = snd_pcm_hw_params_get_buffer_size_max(hw_params, &bufsize);
-  if (ret < 0)
+  if (period_size)
     {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not get max buffer size: %s\n", snd_strerror(ret));
+      bufsize = period_size;
+      ret = snd_pcm_hw_params_set_period_size_near(hdl, hw_params, &bufsize, NULL);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not set period size to %lu: %s\n", period_size, snd_strerror(ret));
 
-      goto out_fail;
+	  goto out_fail;
+	}
+
+      if (bufsize != period_size)
+	DPRINTF(E_INFO, L_LAUDIO, "Device uses period size %lu instead of configured %lu\n", bufsize, period_size);
     }
 
-  ret = snd_pcm_hw_params_set_buffer_size_max(hdl, hw_params, &bufsize);
-  if (ret < 0)
+  if (buffer_size)
+    {
+      bufsize = buffer_size;
+      ret = snd_pcm_hw_params_set_buffer_size_near(hdl, hw_params, &bufsize);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not set buffer size to %lu: %s\n", buffer_size, snd_strerror(ret));
+
+	  goto out_fail;
+	}
+
+      if (bufsize != buffer_size)
+	DPRINTF(E_INFO, L_LAUDIO, "Device uses buffer size %lu instead of configured %lu\n", bufsize, buffer_size);
+    }
+  else
     {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not set buffer size to max: %s\n", snd_strerror(ret));
+      ret = snd_pcm_hw_params_get_buffer_size_max(hw_params, &bufsize);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not get max buffer size: %s\n", snd_strerror(ret));
 
-      goto out_fail;
+	  goto out_fail;
+	}
+
+      ret = snd_pcm_hw_params_set_buffer_size_max(hdl, hw_params, &bufsize);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Could not set buffer size to max: %s\n", snd_strerror(ret));
+
+	  goto out_fail;
+	}
     }
 
   ret = snd_pcm_hw_params(hdl, hw_params);
@@ -501,13 +609,12 @@ device_open(struct alsa_session *as)
   snd_pcm_hw_params_free(hw_params);
   hw_params = NULL;
 
+  if (software_volume)
+    return 0;
+
   ret = mixer_open();
   if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_LAUDIO, "Could not open mixer\n");
-
-      goto out_fail;
-    }
+    DPRINTF(E_LOG, L_LAUDIO, "Could not open mixer, will use software volume\n");
 
   return 0;
 
@@ -562,8 +669,15 @@ playback_start(struct alsa_session *as, uint64_t pos, uint64_t start_pos)
   // Clear prebuffer in case start somehow got called twice without a stop in between
   prebuf_free(as);
 
+  // New start, so whatever drift we measured before may not apply
+  pcm_resample_init(&as->resample);
+  as->drift_integral = 0;
+  as->last_latency = 0;
+  as->sync_counter = 0;
+  as->offset_adjust = 0;
+
   // Adjust the starting position with the configured value
-  start_pos -= offset;
+  start_pos -= as->offset;
 
   // The difference between pos and start_pos should match the 2 second
   // buffer that AirPlay uses. We will not use alsa's buffer for the initial
@@ -571,7 +685,7 @@ playback_start(struct alsa_session *as, uint64_t pos, uint64_t start_pos)
   // Instead we allocate our own buffer, and when it is time to play we write as
   // much as we can to alsa's buffer.
   as->prebuf_len = (start_pos - pos) / AIRTUNES_V2_PACKET_SAMPLES + 1;
-  if (as->prebuf_len > (3 * 44100 - offset) / AIRTUNES_V2_PACKET_SAMPLES)
+  if (as->prebuf_len > (3 * 44100 + as->offset) / AIRTUNES_V2_PACKET_SAMPLES)
     {
       DPRINTF(E_LOG, L_LAUDIO, "Sanity check of prebuf_len (%" PRIu32 " packets) failed\n", as->prebuf_len);
       return;
@@ -605,6 +719,166 @@ playback_start(struct alsa_session *as, uint64_t pos, uint64_t start_pos)
 }
 
 
+// Copies nsamples S16 samples to dst in the device format, applying the gain
+static void
+pcm_convert(uint8_t *dst, uint8_t *src, size_t nsamples, int gain)
+{
+  switch (pcm_format)
+    {
+      case SND_PCM_FORMAT_S32_LE:
+	pcm_s16_to_s32((int32_t *)dst, (int16_t *)src, nsamples, gain);
+	break;
+
+      case SND_PCM_FORMAT_S24_3LE:
+	pcm_s16_to_s24_3le(dst, (int16_t *)src, nsamples, gain);
+	break;
+
+      default:
+	memcpy(dst, src, nsamples * sizeof(int16_t));
+	if (gain < PCM_GAIN_UNITY)
+	  pcm_volume_s16((int16_t *)dst, nsamples, gain);
+	break;
+    }
+}
+
+// Like snd_pcm_writei, but the samples are converted straight into the device's
+// buffer, so there is no intermediate copy and no syscall per write. We also
+// start the device ourselves, since mmap writes don't trigger the start
+// threshold.
+static snd_pcm_sframes_t
+pcm_mmap_write(uint8_t *buf, snd_pcm_sframes_t nsamp, int gain)
+{
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t frames;
+  snd_pcm_uframes_t area_offset;
+  snd_pcm_sframes_t written;
+  snd_pcm_sframes_t ret;
+  uint8_t *dst;
+
+  ret = snd_pcm_avail_update(hdl);
+  if (ret < 0)
+    return ret;
+
+  written = 0;
+  while (written < nsamp)
+    {
+      frames = nsamp - written;
+      ret = snd_pcm_mmap_begin(hdl, &areas, &area_offset, &frames);
+      if (ret < 0)
+	return ret;
+
+      if (frames == 0)
+	break; // Buffer full
+
+      // Interleaved, so all channels share the first area
+      dst = (uint8_t *)areas[0].addr + (areas[0].first + area_offset * areas[0].step) / 8;
+
+      pcm_convert(dst, buf + STOB(written), 2 * frames, gain);
+
+      ret = snd_pcm_mmap_commit(hdl, area_offset, frames);
+      if (ret < 0)
+	return ret;
+
+      written += ret;
+      if (ret != frames)
+	break;
+    }
+
+  if (snd_pcm_state(hdl) == SND_PCM_STATE_PREPARED)
+    {
+      ret = snd_pcm_start(hdl);
+      if (ret < 0)
+	return ret;
+    }
+
+  return written;
+}
+
+// Writes nsamp frames to ALSA, applying software volume and converting to the
+// device format if needed. The caller's buffer is not modified, since it may
+// be the prebuffer.
+static snd_pcm_sframes_t
+pcm_write_frames(struct alsa_session *as, uint8_t *buf, snd_pcm_sframes_t nsamp)
+{
+  uint8_t *convbuf;
+  size_t nsamples;
+  size_t len;
+  int gain;
+
+  gain = vol_elem ? PCM_GAIN_UNITY : as->gain;
+
+  if (pcm_mmap)
+    return pcm_mmap_write(buf, nsamp, gain);
+
+  if (pcm_format == SND_PCM_FORMAT_S16_LE && gain >= PCM_GAIN_UNITY)
+    return snd_pcm_writei(hdl, buf, nsamp);
+
+  nsamples = 2 * nsamp;
+  len = nsamples * pcm_sample_size;
+  if (len > as->convbuf_size)
+    {
+      convbuf = realloc(as->convbuf, len);
+      if (!convbuf)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Out of memory for ALSA conversion buffer\n");
+	  return -ENOMEM;
+	}
+
+      as->convbuf = convbuf;
+      as->convbuf_size = len;
+    }
+
+  pcm_convert(as->convbuf, buf, nsamples, gain);
+
+  return snd_pcm_writei(hdl, as->convbuf, nsamp);
+}
+
+// Writes nsamp frames to ALSA after resampling them with the current drift
+// correction. Returns nsamp if everything was written, since that is what
+// the caller accounts in.
+static snd_pcm_sframes_t
+pcm_write(struct alsa_session *as, uint8_t *buf, snd_pcm_sframes_t nsamp)
+{
+  int16_t *resamplebuf;
+  snd_pcm_sframes_t ret;
+  size_t nframes;
+  size_t size;
+
+  // Without correction the resampler just passes the input through
+  if (as->resample.step == PCM_RESAMPLE_UNITY && as->resample.pos == PCM_RESAMPLE_UNITY)
+    {
+      as->resample.last[0] = ((int16_t *)buf)[2 * (nsamp - 1)];
+      as->resample.last[1] = ((int16_t *)buf)[2 * (nsamp - 1) + 1];
+
+      return pcm_write_frames(as, buf, nsamp);
+    }
+
+  // The step is at most ALSA_RESAMPLE_MAX_PPM below unity, so this is room
+  // enough for the output
+  nframes = nsamp + nsamp / 512 + 2;
+  size = STOB(nframes);
+  if (size > as->resamplebuf_size)
+    {
+      resamplebuf = realloc(as->resamplebuf, size);
+      if (!resamplebuf)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Out of memory for ALSA resample buffer\n");
+	  return -ENOMEM;
+	}
+
+      as->resamplebuf = resamplebuf;
+      as->resamplebuf_size = size;
+    }
+
+  nframes = pcm_resample_s16(as->resamplebuf, nframes, (int16_t *)buf, nsamp, &as->resample);
+
+  ret = pcm_write_frames(as, (uint8_t *)as->resamplebuf, nframes);
+  if (ret < 0)
+    return ret;
+
+  return (ret == nframes) ? nsamp : ret;
+}
+
 // This function writes the sample buf into either the prebuffer or directly to
 // ALSA, depending on how much room there is in ALSA, and whether we are
 // prebuffering or not. It also transfers from the the prebuffer to ALSA, if
@@ -648,7 +922,7 @@ buffer_write(struct alsa_session *as, uint8_t *buf, snd_pcm_sframes_t *avail, in
       as->prebuf_tail = (as->prebuf_tail + npackets) % as->prebuf_len;
     }
 
-  ret = snd_pcm_writei(hdl, buf, nsamp);
+  ret = pcm_write(as, buf, nsamp);
   if (ret < 0)
     return ret;
 
@@ -661,6 +935,34 @@ buffer_write(struct alsa_session *as, uint8_t *buf, snd_pcm_sframes_t *avail, in
   return 0;
 }
 
+// Sets the resampling ratio from the measured latency (positive if ALSA is
+// behind the player). Called about once a second.
+static void
+sync_resample_adjust(struct alsa_session *as, int32_t latency)
+{
+  double i_max;
+  double ppm;
+
+  // Anti windup: the integral part alone must stay within the max correction
+  i_max = (double)ALSA_RESAMPLE_MAX_PPM * ALSA_RESAMPLE_P_SECONDS * ALSA_RESAMPLE_I_SECONDS * 44100 / 1000000;
+
+  as->drift_integral += latency;
+  if (as->drift_integral > i_max)
+    as->drift_integral = i_max;
+  else if (as->drift_integral < -i_max)
+    as->drift_integral = -i_max;
+
+  ppm = (latency + as->drift_integral / ALSA_RESAMPLE_I_SECONDS) * 1000000 / (ALSA_RESAMPLE_P_SECONDS * 44100);
+  if (ppm > ALSA_RESAMPLE_MAX_PPM)
+    ppm = ALSA_RESAMPLE_MAX_PPM;
+  else if (ppm < -ALSA_RESAMPLE_MAX_PPM)
+    ppm = -ALSA_RESAMPLE_MAX_PPM;
+
+  as->resample.step = PCM_RESAMPLE_UNITY + (int64_t)(ppm * PCM_RESAMPLE_UNITY / 1000000);
+
+  DPRINTF(E_SPAM, L_LAUDIO, "ALSA latency %d samples, resampling with %.1f ppm\n", latency, ppm);
+}
+
 // Checks if ALSA's playback position is ahead or behind the player's
 enum alsa_sync_state
 sync_check(struct alsa_session *as, uint64_t rtptime, snd_pcm_sframes_t delay, int prebuf_empty)
@@ -683,7 +985,11 @@ sync_check(struct alsa_session *as, uint64_t rtptime, snd_pcm_sframes_t delay, i
     npackets = 0;
 
   pb_pos = rtptime - delay - AIRTUNES_V2_PACKET_SAMPLES * npackets;
-  latency = cur_pos - (pb_pos - offset);
+  latency = cur_pos - (pb_pos - as->offset);
+
+  // Jumpy measurements are not used for the drift estimate
+  if (abs(as->last_latency - latency) <= ALSA_MAX_LATENCY_VARIANCE)
+    sync_resample_adjust(as, latency);
 
   // If the latency is low or very different from our last measurement, we reset the sync_counter
   if (abs(latency) < ALSA_MAX_LATENCY || abs(as->last_latency - latency) > ALSA_MAX_LATENCY_VARIANCE)
@@ -701,6 +1007,9 @@ sync_check(struct alsa_session *as, uint64_t rtptime, snd_pcm_sframes_t delay, i
 	sync = ALSA_SYNC_BEHIND;
       else
 	sync = ALSA_SYNC_AHEAD;
+
+      // Let the resampler start over from the new position
+      as->drift_integral = 0;
     }
 
   as->last_latency = latency;
@@ -742,6 +1051,18 @@ playback_write(struct alsa_session *as, uint8_t *buf, uint64_t rtptime)
   if (as->sync_counter % 126 == 0)
     sync = sync_check(as, rtptime, delay, prebuf_empty);
 
+  // Move to a changed sync offset a packet at a time, the same way
+  if (as->offset_adjust >= AIRTUNES_V2_PACKET_SAMPLES)
+    {
+      as->offset_adjust -= AIRTUNES_V2_PACKET_SAMPLES;
+      sync = ALSA_SYNC_BEHIND;
+    }
+  else if (as->offset_adjust <= -AIRTUNES_V2_PACKET_SAMPLES)
+    {
+      as->offset_adjust += AIRTUNES_V2_PACKET_SAMPLES;
+      sync = ALSA_SYNC_AHEAD;
+    }
+
   // Skip write -> reduce the delay
   if (sync == ALSA_SYNC_BEHIND)
     return;
@@ -756,6 +1077,58 @@ playback_write(struct alsa_session *as, uint8_t *buf, uint64_t rtptime)
   return;
 
  alsa_error:
+  playback_write_error(as, ret);
+}
+
+// Writes npackets with a single call to ALSA. This is only possible when we
+// are not prebuffering and no sync check is due, otherwise we fall back to
+// writing the packets one by one.
+static void
+playback_write_batch(struct alsa_session *as, uint8_t *buf, uint64_t rtptime, int npackets)
+{
+  snd_pcm_sframes_t ret;
+  snd_pcm_sframes_t avail;
+  snd_pcm_sframes_t delay;
+  snd_pcm_sframes_t nsamp;
+  int i;
+
+  nsamp = npackets * AIRTUNES_V2_PACKET_SAMPLES;
+
+  if ((as->pos < as->start_pos) || (as->prebuf_head != as->prebuf_tail) || ((as->sync_counter % 126) + npackets >= 126))
+    goto fallback;
+
+  ret = snd_pcm_avail_delay(hdl, &avail, &delay);
+  if (ret < 0)
+    goto alsa_error;
+
+  if (avail < nsamp)
+    goto fallback;
+
+  as->pos += nsamp;
+  as->sync_counter += npackets;
+
+  ret = pcm_write(as, buf, nsamp);
+  if (ret < 0)
+    goto alsa_error;
+
+  if (ret != nsamp)
+    DPRINTF(E_WARN, L_LAUDIO, "ALSA partial write detected\n");
+
+  return;
+
+ fallback:
+  for (i = 0; i < npackets; i++)
+    playback_write(as, buf + i * PACKET_SIZE, rtptime + i * AIRTUNES_V2_PACKET_SAMPLES);
+
+  return;
+
+ alsa_error:
+  playback_write_error(as, ret);
+}
+
+static void
+playback_write_error(struct alsa_session *as, snd_pcm_sframes_t ret)
+{
   if (ret == -EPIPE)
     {
       DPRINTF(E_WARN, L_LAUDIO, "ALSA buffer underrun\n");
@@ -860,6 +1233,27 @@ alsa_device_probe(struct output_device *device, output_status_cb cb)
   return 0;
 }
 
+static void
+alsa_device_offset_set(struct output_device *device)
+{
+  struct alsa_session *as;
+  int new_offset;
+
+  if (!device->session || !device->session->session)
+    return;
+
+  as = device->session->session;
+
+  new_offset = offset + outputs_device_offset(device);
+
+  DPRINTF(E_DBG, L_LAUDIO, "Changing ALSA offset from %d to %d samples\n", as->offset, new_offset);
+
+  as->offset_adjust += new_offset - as->offset;
+  as->offset = new_offset;
+  as->last_latency = 0;
+  as->sync_counter = 0;
+}
+
 static int
 alsa_device_volume_set(struct output_device *device, output_status_cb cb)
 {
@@ -872,7 +1266,16 @@ alsa_device_volume_set(struct output_device *device, output_status_cb cb)
   as = device->session->session;
 
   if (!mixer_hdl || !vol_elem)
-    return 0;
+    {
+      as->gain = pcm_gain_from_volume(device->volume);
+
+      DPRINTF(E_DBG, L_LAUDIO, "Setting ALSA software volume to %d (gain %d)\n", device->volume, as->gain);
+
+      as->status_cb = cb;
+      alsa_status(as);
+
+      return 1;
+    }
 
   snd_mixer_handle_events(mixer_hdl);
 
@@ -957,6 +1360,27 @@ alsa_write(uint8_t *buf, uint64_t rtptime)
     }
 }
 
+static void
+alsa_write_batch(uint8_t *buf, uint64_t rtptime, int npackets)
+{
+  struct alsa_session *as;
+  uint64_t pos;
+
+  for (as = sessions; as; as = as->next)
+    {
+      if (as->state == ALSA_STATE_STARTED)
+	{
+	  playback_pos_get(&pos, rtptime);
+
+	  DPRINTF(E_DBG, L_LAUDIO, "Starting ALSA device '%s' (pos %" PRIu64 ", rtptime %" PRIu64 ")\n", as->devname, pos, rtptime);
+
+	  playback_start(as, pos, rtptime);
+	}
+
+      playback_write_batch(as, buf, rtptime, npackets);
+    }
+}
+
 static int
 alsa_flush(output_status_cb cb, uint64_t rtptime)
 {
@@ -1006,6 +1430,10 @@ alsa_init(void)
   mixer_device_name = cfg_getstr(cfg_audio, "mixer_device");
   if (mixer_device_name == NULL || strlen(mixer_device_name) == 0)
     mixer_device_name = card_name;
+  software_volume = cfg_getbool(cfg_audio, "software_volume");
+  pcm_mmap = cfg_getbool(cfg_audio, "mmap");
+  period_size = cfg_getint(cfg_audio, "period_size");
+  buffer_size = cfg_getint(cfg_audio, "buffer_size");
   nickname = cfg_getstr(cfg_audio, "nickname");
   offset = cfg_getint(cfg_audio, "offset");
   if (abs(offset) > 44100)
@@ -1053,15 +1481,20 @@ struct output_definition output_alsa =
   .type = OUTPUT_TYPE_ALSA,
   .priority = 3,
   .disabled = 0,
+  .low_latency = 1,
+  .write_thread = 1,
+  .queue_policy = OUTPUT_QUEUE_DROP,
   .init = alsa_init,
   .deinit = alsa_deinit,
   .device_start = alsa_device_start,
   .device_stop = alsa_device_stop,
   .device_probe = alsa_device_probe,
   .device_volume_set = alsa_device_volume_set,
+  .device_offset_set = alsa_device_offset_set,
   .playback_start = alsa_playback_start,
   .playback_stop = alsa_playback_stop,
   .write = alsa_write,
+  .write_batch = alsa_write_batch,
   .flush = alsa_flush,
   .status_cb = alsa_set_status_cb,
 };
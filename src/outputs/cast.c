@@ -89,6 +89,23 @@
 
 //#define DEBUG_CONNECTION 1
 
+// Formats of forked-daapd's HTTP stream that the default media receiver can
+// play (see httpd_streaming.c), chromecast/stream_format selects one
+struct cast_stream_format
+{
+  const char *name;
+  const char *path;
+  const char *content_type;
+};
+
+static struct cast_stream_format cast_stream_formats[] =
+{
+  { "mp3",  "/stream.mp3",  "audio/mp3" },
+  { "aac",  "/stream.aac",  "audio/aac" },
+  { "opus", "/stream.opus", "audio/ogg" },
+  { "flac", "/stream.flac", "audio/flac" },
+};
+
 union sockaddr_all
 {
   struct sockaddr_in sin;
@@ -156,7 +173,7 @@ struct cast_session
   // ChromeCast uses a float between 0 - 1
   float volume;
 
-  // IP address URL of forked-daapd's mp3 stream
+  // IP address URL of forked-daapd's stream, in the format of cast_stream
   char stream_url[128];
 
   // Outgoing request which have the USE_REQUEST_ID flag get a new id, and a
@@ -309,7 +326,7 @@ struct cast_msg_basic cast_msg[] =
   {
     .type = MEDIA_LOAD,
     .namespace = NS_MEDIA,
-    .payload = "{'currentTime':0,'media':{'contentId':'%s','streamType':'LIVE','contentType':'audio/mp3'},'customData':{},'sessionId':'%s','requestId':%d,'type':'LOAD','autoplay':1}",
+    .payload = "{'currentTime':0,'media':{'contentId':'%s','streamType':'LIVE','contentType':'%s'},'customData':{},'sessionId':'%s','requestId':%d,'type':'LOAD','autoplay':1}",
     .flags = USE_TRANSPORT_ID | USE_REQUEST_ID,
   },
   {
@@ -359,6 +376,7 @@ static struct event *flush_timer;
 static struct timeval heartbeat_timeout = { HEARTBEAT_TIMEOUT, 0 };
 static struct timeval flush_timeout = { FLUSH_TIMEOUT, 0 };
 static struct timeval reply_timeout = { REPLY_TIMEOUT, 0 };
+static struct cast_stream_format *cast_stream;
 
 
 /* ------------------------------- MISC HELPERS ----------------------------- */
@@ -497,9 +515,9 @@ stream_url_make(char *out, size_t len, const char *peer_addr, int family)
 
   port = cfg_getint(cfg_getsec(cfg, "library"), "port");
   if (family == AF_INET)
-    snprintf(out, len, "http://%s:%d/stream.mp3", host_addr, port);
+    snprintf(out, len, "http://%s:%d%s", host_addr, port, cast_stream->path);
   else
-    snprintf(out, len, "http://[%s]:%d/stream.mp3", host_addr, port);
+    snprintf(out, len, "http://[%s]:%d%s", host_addr, port, cast_stream->path);
 
   return 0;
 }
@@ -619,7 +637,7 @@ cast_msg_send(struct cast_session *cs, enum cast_msg_types type, cast_reply_cb r
   else if (type == STOP)
     snprintf(msg_buf, sizeof(msg_buf), cast_msg[type].payload, cs->session_id, cs->request_id);
   else if (type == MEDIA_LOAD)
-    snprintf(msg_buf, sizeof(msg_buf), cast_msg[type].payload, cs->stream_url, cs->session_id, cs->request_id);
+    snprintf(msg_buf, sizeof(msg_buf), cast_msg[type].payload, cs->stream_url, cast_stream->content_type, cs->session_id, cs->request_id);
   else if ((type == MEDIA_PLAY) || (type == MEDIA_PAUSE) || (type == MEDIA_STOP))
     snprintf(msg_buf, sizeof(msg_buf), cast_msg[type].payload, cs->media_session_id, cs->session_id, cs->request_id);
   else if (type == SET_VOLUME)
@@ -1244,9 +1262,12 @@ static void
 cast_device_cb(const char *name, const char *type, const char *domain, const char *hostname, int family, const char *address, int port, struct keyval *txt)
 {
   struct output_device *device;
+  const char *mdns_name;
   const char *friendly_name;
   uint32_t id;
 
+  mdns_name = name;
+
   id = djb_hash(name, strlen(name));
   if (!id)
     {
@@ -1308,6 +1329,8 @@ cast_device_cb(const char *name, const char *type, const char *domain, const cha
 	break;
     }
 
+  outputs_device_mdns_set(device, mdns_name, txt);
+
   player_device_add(device);
 }
 
@@ -1738,6 +1761,7 @@ cast_set_status_cb(struct output_session *session, output_status_cb cb)
 static int
 cast_init(void)
 {
+  const char *stream_format;
   int family;
   int i;
   int ret;
@@ -1752,6 +1776,23 @@ cast_init(void)
 	}
     }
 
+  stream_format = cfg_getstr(cfg_getsec(cfg, "chromecast"), "stream_format");
+  for (i = 0; i < (sizeof(cast_stream_formats) / sizeof(cast_stream_formats[0])); i++)
+    {
+      if (strcasecmp(stream_format, cast_stream_formats[i].name) == 0)
+	break;
+    }
+
+  if (i == (sizeof(cast_stream_formats) / sizeof(cast_stream_formats[0])))
+    {
+      DPRINTF(E_LOG, L_CAST, "Invalid Chromecast stream format '%s', using mp3\n", stream_format);
+      i = 0;
+    }
+
+  cast_stream = &cast_stream_formats[i];
+
+  DPRINTF(E_DBG, L_CAST, "Chromecast devices will play the %s stream (%s)\n", cast_stream->name, cast_stream->path);
+
   // Setting the cert file seems not to be required
   if ( ((ret = gnutls_global_init()) != GNUTLS_E_SUCCESS)
        || ((ret = gnutls_certificate_allocate_credentials(&tls_credentials)) != GNUTLS_E_SUCCESS)
@@ -1781,6 +1822,8 @@ cast_init(void)
       goto out_free_flush_timer;
     }
 
+  outputs_device_restore(OUTPUT_TYPE_CAST, "_googlecast._tcp", family, cast_device_cb);
+
   return 0;
 
  out_free_flush_timer:
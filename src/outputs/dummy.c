@@ -37,9 +37,12 @@
 
 #include "conffile.h"
 #include "logger.h"
+#include "misc.h"
 #include "player.h"
 #include "outputs.h"
 
+#define DUMMY_DEVICES_MAX 64
+
 struct dummy_session
 {
   enum output_device_state state;
@@ -51,12 +54,17 @@ struct dummy_session
   struct output_device *device;
   struct output_session *output_session;
   output_status_cb status_cb;
+
+  // Peak sample level, so that writing has about the cost of a real output
+  int peak;
+
+  struct dummy_session *next;
 };
 
 /* From player.c */
 extern struct event_base *evbase_player;
 
-struct dummy_session *sessions;
+static struct dummy_session *sessions;
 
 /* Forwards */
 static void
@@ -79,8 +87,20 @@ dummy_session_free(struct dummy_session *ds)
 static void
 dummy_session_cleanup(struct dummy_session *ds)
 {
-  // Normally some here code to remove from linked list - here we just say:
-  sessions = NULL;
+  struct dummy_session *s;
+
+  if (ds == sessions)
+    sessions = sessions->next;
+  else
+    {
+      for (s = sessions; s && (s->next != ds); s = s->next)
+	; /* EMPTY */
+
+      if (!s)
+	DPRINTF(E_WARN, L_LAUDIO, "WARNING: struct dummy_session not found in list; BUG!\n");
+      else
+	s->next = ds->next;
+    }
 
   dummy_session_free(ds);
 }
@@ -123,6 +143,7 @@ dummy_session_make(struct output_device *device, output_status_cb cb)
   ds->device = device;
   ds->status_cb = cb;
 
+  ds->next = sessions;
   sessions = ds;
 
   return ds;
@@ -215,25 +236,51 @@ dummy_device_volume_set(struct output_device *device, output_status_cb cb)
 static void
 dummy_playback_start(uint64_t next_pkt, struct timespec *ts)
 {
-  struct dummy_session *ds = sessions;
-
-  if (!sessions)
-    return;
+  struct dummy_session *ds;
 
-  ds->state = OUTPUT_STATE_STREAMING;
-  dummy_status(ds);
+  for (ds = sessions; ds; ds = ds->next)
+    {
+      ds->state = OUTPUT_STATE_STREAMING;
+      dummy_status(ds);
+    }
 }
 
 static void
 dummy_playback_stop(void)
 {
-  struct dummy_session *ds = sessions;
+  struct dummy_session *ds;
 
-  if (!sessions)
-    return;
+  for (ds = sessions; ds; ds = ds->next)
+    {
+      ds->state = OUTPUT_STATE_CONNECTED;
+      dummy_status(ds);
+    }
+}
 
-  ds->state = OUTPUT_STATE_CONNECTED;
-  dummy_status(ds);
+static void
+dummy_write(uint8_t *buf, uint64_t rtptime)
+{
+  struct dummy_session *ds;
+  int16_t *samples;
+  int peak;
+  int i;
+
+  samples = (int16_t *)buf;
+
+  for (ds = sessions; ds; ds = ds->next)
+    {
+      if (ds->state != OUTPUT_STATE_STREAMING)
+	continue;
+
+      peak = 0;
+      for (i = 0; i < 2 * AIRTUNES_V2_PACKET_SAMPLES; i++)
+	{
+	  if (abs(samples[i]) > peak)
+	    peak = abs(samples[i]);
+	}
+
+      ds->peak = peak;
+    }
 }
 
 static void
@@ -251,6 +298,8 @@ dummy_init(void)
   cfg_t *cfg_audio;
   char *nickname;
   char *type;
+  int ndevices;
+  int i;
 
   cfg_audio = cfg_getsec(cfg, "audio");
   type = cfg_getstr(cfg_audio, "type");
@@ -259,23 +308,36 @@ dummy_init(void)
 
   nickname = cfg_getstr(cfg_audio, "nickname");
 
-  device = calloc(1, sizeof(struct output_device));
-  if (!device)
+  ndevices = cfg_getint(cfg_audio, "dummy_devices");
+  if (ndevices < 1 || ndevices > DUMMY_DEVICES_MAX)
     {
-      DPRINTF(E_LOG, L_LAUDIO, "Out of memory for dummy device\n");
+      DPRINTF(E_LOG, L_LAUDIO, "Invalid dummy_devices %d, must be between 1 and %d\n", ndevices, DUMMY_DEVICES_MAX);
       return -1;
     }
 
-  device->id = 0;
-  device->name = strdup(nickname);
-  device->type = OUTPUT_TYPE_DUMMY;
-  device->type_name = outputs_name(device->type);
-  device->advertised = 1;
-  device->has_video = 0;
-
-  DPRINTF(E_INFO, L_LAUDIO, "Adding dummy output device '%s'\n", nickname);
-
-  player_device_add(device);
+  for (i = 0; i < ndevices; i++)
+    {
+      device = calloc(1, sizeof(struct output_device));
+      if (!device)
+	{
+	  DPRINTF(E_LOG, L_LAUDIO, "Out of memory for dummy device\n");
+	  return -1;
+	}
+
+      device->id = i;
+      if (i == 0)
+	device->name = strdup(nickname);
+      else
+	device->name = safe_asprintf("%s %d", nickname, i + 1);
+      device->type = OUTPUT_TYPE_DUMMY;
+      device->type_name = outputs_name(device->type);
+      device->advertised = 1;
+      device->has_video = 0;
+
+      DPRINTF(E_INFO, L_LAUDIO, "Adding dummy output device '%s'\n", device->name);
+
+      player_device_add(device);
+    }
 
   return 0;
 }
@@ -300,5 +362,6 @@ struct output_definition output_dummy =
   .device_volume_set = dummy_device_volume_set,
   .playback_start = dummy_playback_start,
   .playback_stop = dummy_playback_stop,
+  .write = dummy_write,
   .status_cb = dummy_set_status_cb,
 };
@@ -28,7 +28,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <event2/event.h>
@@ -38,46 +41,138 @@
 #include "logger.h"
 #include "player.h"
 #include "outputs.h"
+#include "pcm.h"
 
 #define FIFO_BUFFER_SIZE 65536 /* pipe capacity on Linux >= 2.6.11 */
-
+#define FIFO_PACKET_SIZE STOB(AIRTUNES_V2_PACKET_SAMPLES)
+// The player writes about 2 seconds ahead, that audio is held until it is due
+#define FIFO_AHEAD_PACKETS (88200 / AIRTUNES_V2_PACKET_SAMPLES + 2 * OUTPUTS_BATCH_PACKETS_MAX)
+// Max packets to write to the pipe with one writev()
+#define FIFO_IOV_MAX 64
+
+// What to do when the reader of the pipe is too slow and the backlog is full
+enum fifo_overflow_policy
+{
+  // Empty the pipe, the reader loses what it didn't read yet
+  FIFO_OVERFLOW_FLUSH,
+  // Drop the oldest audio of the backlog
+  FIFO_OVERFLOW_DROP_OLDEST,
+  // Keep the backlog, drop the new audio
+  FIFO_OVERFLOW_DROP_NEWEST,
+  // Drop the backlog, and the new audio until the reader has caught up
+  FIFO_OVERFLOW_PAUSE,
+};
 
 struct fifo_packet
 {
   /* pcm data */
-  uint8_t samples[1408]; // STOB(AIRTUNES_V2_PACKET_SAMPLES)
+  uint8_t samples[FIFO_PACKET_SIZE];
 
   /* RTP-time of the first sample*/
   uint64_t rtptime;
+};
 
-  struct fifo_packet *next;
-  struct fifo_packet *prev;
+struct fifo_ring
+{
+  struct fifo_packet *packets;
+  int size;
+
+  /* Index of the oldest packet */
+  int tail;
+  int count;
 };
 
 struct fifo_buffer
 {
-  struct fifo_packet *head;
-  struct fifo_packet *tail;
+  /* Packets from the player that are not due yet */
+  struct fifo_ring ahead;
+
+  /* Packets that are due, but that the reader hasn't taken yet */
+  struct fifo_ring backlog;
+
+  /* Bytes of the oldest backlog packet that were already written to the pipe */
+  size_t tail_offset;
+
+  /* Set while pausing because of FIFO_OVERFLOW_PAUSE */
+  bool paused;
+
+  /* Packets dropped because of overflows, for the player stats */
+  uint64_t drops;
 };
 static struct fifo_buffer buffer;
 
 
+static inline struct fifo_packet *
+ring_at(struct fifo_ring *ring, int i)
+{
+  return &ring->packets[(ring->tail + i) % ring->size];
+}
+
+// Returns the slot for a new packet, or NULL if the ring is full
+static struct fifo_packet *
+ring_push(struct fifo_ring *ring)
+{
+  if (ring->count == ring->size)
+    return NULL;
+
+  ring->count++;
+
+  return ring_at(ring, ring->count - 1);
+}
+
+static void
+ring_pop(struct fifo_ring *ring, int n)
+{
+  ring->tail = (ring->tail + n) % ring->size;
+  ring->count -= n;
+}
+
+static int
+ring_alloc(struct fifo_ring *ring, int size)
+{
+  ring->packets = calloc(size, sizeof(struct fifo_packet));
+  if (!ring->packets)
+    return -1;
+
+  ring->size = size;
+  ring->tail = 0;
+  ring->count = 0;
+
+  return 0;
+}
+
+static void
+clear_buffer()
+{
+  buffer.ahead.tail = 0;
+  buffer.ahead.count = 0;
+  buffer.backlog.tail = 0;
+  buffer.backlog.count = 0;
+  buffer.tail_offset = 0;
+  buffer.paused = false;
+}
+
 static void
 free_buffer()
 {
-  struct fifo_packet *packet;
-  struct fifo_packet *tmp;
+  free(buffer.ahead.packets);
+  free(buffer.backlog.packets);
 
-  packet = buffer.tail;
-  while (packet)
+  memset(&buffer, 0, sizeof(struct fifo_buffer));
+}
+
+static int
+alloc_buffer(int backlog_packets)
+{
+  free_buffer();
+
+  if (ring_alloc(&buffer.ahead, FIFO_AHEAD_PACKETS) < 0 || ring_alloc(&buffer.backlog, backlog_packets) < 0)
     {
-      tmp = packet;
-      packet = packet->next;
-      free(tmp);
+      free_buffer();
+      return -1;
     }
 
-  buffer.tail = NULL;
-  buffer.head = NULL;
+  return 0;
 }
 
 struct fifo_session
@@ -91,6 +186,9 @@ struct fifo_session
 
   int created;
 
+  // Gain for software volume, see pcm.h
+  int gain;
+
   struct event *deferredev;
   output_status_cb defer_cb;
 
@@ -105,6 +203,14 @@ extern struct event_base *evbase_player;
 
 static struct fifo_session *sessions;
 
+// If set the device volume is applied to the samples
+static bool software_volume;
+
+// Size of the backlog in packets, from the buffer_ms option, and what to do
+// when it overflows
+static int backlog_packets;
+static enum fifo_overflow_policy overflow_policy;
+
 /* Forwards */
 static void
 defer_cb(int fd, short what, void *arg);
@@ -286,6 +392,15 @@ fifo_session_make(struct output_device *device, output_status_cb cb)
       return NULL;
     }
 
+  if (alloc_buffer(backlog_packets) < 0)
+    {
+      DPRINTF(E_LOG, L_FIFO, "Out of memory for fifo buffer\n");
+      event_free(fifo_session->deferredev);
+      free(output_session);
+      free(fifo_session);
+      return NULL;
+    }
+
   output_session->session = fifo_session;
   output_session->type = device->type;
 
@@ -298,6 +413,7 @@ fifo_session_make(struct output_device *device, output_status_cb cb)
   fifo_session->path = device->extra_device_info;
   fifo_session->input_fd = -1;
   fifo_session->output_fd = -1;
+  fifo_session->gain = software_volume ? pcm_gain_from_volume(device->volume) : PCM_GAIN_UNITY;
 
   sessions = fifo_session;
 
@@ -357,7 +473,7 @@ fifo_device_stop(struct output_session *output_session)
   struct fifo_session *fifo_session = output_session->session;
 
   fifo_close(fifo_session);
-  free_buffer();
+  clear_buffer();
 
   fifo_session->state = OUTPUT_STATE_STOPPED;
   fifo_status(fifo_session);
@@ -400,6 +516,9 @@ fifo_device_volume_set(struct output_device *device, output_status_cb cb)
 
   fifo_session = device->session->session;
 
+  if (software_volume)
+    fifo_session->gain = pcm_gain_from_volume(device->volume);
+
   fifo_session->status_cb = cb;
   fifo_status(fifo_session);
 
@@ -426,7 +545,7 @@ fifo_playback_stop(void)
   if (!fifo_session)
     return;
 
-  free_buffer();
+  clear_buffer();
 
   fifo_session->state = OUTPUT_STATE_CONNECTED;
   fifo_status(fifo_session);
@@ -441,7 +560,7 @@ fifo_flush(output_status_cb cb, uint64_t rtptime)
     return 0;
 
   fifo_empty(fifo_session);
-  free_buffer();
+  clear_buffer();
 
   fifo_session->status_cb = cb;
   fifo_session->state = OUTPUT_STATE_CONNECTED;
@@ -450,30 +569,105 @@ fifo_flush(output_status_cb cb, uint64_t rtptime)
 }
 
 static void
-fifo_write(uint8_t *buf, uint64_t rtptime)
+fifo_packet_add(struct fifo_session *fifo_session, uint8_t *buf, uint64_t rtptime)
 {
-  struct fifo_session *fifo_session = sessions;
-  size_t length = STOB(AIRTUNES_V2_PACKET_SAMPLES);
-  ssize_t bytes;
   struct fifo_packet *packet;
-  uint64_t cur_pos;
-  struct timespec now;
-  int ret;
 
-  if (!fifo_session || !fifo_session->device->selected)
-    return;
+  packet = ring_push(&buffer.ahead);
+  if (!packet)
+    {
+      // Shouldn't happen, since we make room for what the player sends ahead
+      DPRINTF(E_WARN, L_FIFO, "FIFO buffer full, dropping packet\n");
+      buffer.drops++;
+      return;
+    }
 
-  packet = (struct fifo_packet *) calloc(1, sizeof(struct fifo_packet));
   memcpy(packet->samples, buf, sizeof(packet->samples));
+  pcm_volume_s16((int16_t *)packet->samples, sizeof(packet->samples) / sizeof(int16_t), fifo_session->gain);
   packet->rtptime = rtptime;
-  if (buffer.head)
+}
+
+// Drops the backlog, except a packet that was partly written, since the rest
+// of that must still go to the pipe to keep the stream aligned
+static void
+backlog_drop(int n)
+{
+  int keep;
+
+  keep = (buffer.tail_offset > 0) ? 1 : 0;
+  if (n > buffer.backlog.count - keep)
+    n = buffer.backlog.count - keep;
+  if (n <= 0)
+    return;
+
+  if (keep)
+    memcpy(ring_at(&buffer.backlog, n), ring_at(&buffer.backlog, 0), sizeof(struct fifo_packet));
+
+  ring_pop(&buffer.backlog, n);
+  buffer.drops += n;
+}
+
+// Moves the packets that are due for playback from the ahead ring to the
+// backlog, applying the overflow policy if the backlog is full
+static void
+fifo_packets_due(struct fifo_session *fifo_session, uint64_t cur_pos)
+{
+  struct fifo_packet *packet;
+  struct fifo_packet *due;
+  int queued;
+
+  // The reader has caught up when the pipe is less than half full
+  if (buffer.paused && ioctl(fifo_session->input_fd, FIONREAD, &queued) == 0 && queued < FIFO_BUFFER_SIZE / 2)
     {
-      buffer.head->next = packet;
-      packet->prev = buffer.head;
+      DPRINTF(E_INFO, L_FIFO, "Reader of FIFO \"%s\" has caught up, resuming\n", fifo_session->path);
+      buffer.paused = false;
     }
-  buffer.head = packet;
-  if (!buffer.tail)
-    buffer.tail = packet;
+
+  while (buffer.ahead.count > 0 && (due = ring_at(&buffer.ahead, 0))->rtptime <= cur_pos)
+    {
+      if (!buffer.paused && buffer.backlog.count == buffer.backlog.size)
+	{
+	  switch (overflow_policy)
+	    {
+	      case FIFO_OVERFLOW_FLUSH:
+	      case FIFO_OVERFLOW_DROP_OLDEST:
+		backlog_drop(1);
+		break;
+
+	      case FIFO_OVERFLOW_DROP_NEWEST:
+		break;
+
+	      case FIFO_OVERFLOW_PAUSE:
+		DPRINTF(E_WARN, L_FIFO, "Reader of FIFO \"%s\" is too slow, pausing\n", fifo_session->path);
+		backlog_drop(buffer.backlog.count);
+		buffer.paused = true;
+		break;
+	    }
+	}
+
+      packet = buffer.paused ? NULL : ring_push(&buffer.backlog);
+      if (packet)
+	memcpy(packet, due, sizeof(struct fifo_packet));
+      else
+	buffer.drops++;
+
+      ring_pop(&buffer.ahead, 1);
+    }
+}
+
+// Writes the backlog to the pipe, with up to FIFO_IOV_MAX packets per writev().
+// A packet that was only partly written stays in the backlog.
+static void
+fifo_packets_write(struct fifo_session *fifo_session)
+{
+  struct iovec iov[FIFO_IOV_MAX];
+  struct fifo_packet *packet;
+  uint64_t cur_pos;
+  struct timespec now;
+  ssize_t bytes;
+  ssize_t total;
+  int n;
+  int ret;
 
   ret = player_get_current_pos(&cur_pos, &now, 0);
   if (ret < 0)
@@ -482,15 +676,39 @@ fifo_write(uint8_t *buf, uint64_t rtptime)
       return;
     }
 
-  while (buffer.tail && buffer.tail->rtptime <= cur_pos)
+  fifo_packets_due(fifo_session, cur_pos);
+
+  while (buffer.backlog.count > 0)
     {
-      bytes = write(fifo_session->output_fd, buffer.tail->samples, length);
+      total = 0;
+      for (n = 0; n < buffer.backlog.count && n < FIFO_IOV_MAX; n++)
+	{
+	  packet = ring_at(&buffer.backlog, n);
+	  iov[n].iov_base = packet->samples;
+	  iov[n].iov_len = sizeof(packet->samples);
+	  total += sizeof(packet->samples);
+	}
+
+      iov[0].iov_base = (uint8_t *)iov[0].iov_base + buffer.tail_offset;
+      iov[0].iov_len -= buffer.tail_offset;
+      total -= buffer.tail_offset;
+
+      bytes = writev(fifo_session->output_fd, iov, n);
       if (bytes > 0)
 	{
-	  packet = buffer.tail;
-	  buffer.tail = buffer.tail->next;
-	  free(packet);
-	  return;
+	  if (bytes < total)
+	    ret = -1; // The pipe is full
+
+	  bytes += buffer.tail_offset;
+	  n = bytes / FIFO_PACKET_SIZE;
+	  ring_pop(&buffer.backlog, n);
+
+	  buffer.tail_offset = bytes - n * FIFO_PACKET_SIZE;
+
+	  if (ret < 0)
+	    return;
+
+	  continue;
 	}
 
       if (bytes < 0)
@@ -498,8 +716,14 @@ fifo_write(uint8_t *buf, uint64_t rtptime)
 	  switch (errno)
 	    {
 	      case EAGAIN:
-		/* The pipe is full, so empty it */
+		// The pipe is full. With the flush policy we make room by emptying
+		// it, otherwise the backlog waits for the reader.
+		if (overflow_policy != FIFO_OVERFLOW_FLUSH)
+		  return;
+
 		fifo_empty(fifo_session);
+		buffer.tail_offset = 0;
+		buffer.drops += FIFO_BUFFER_SIZE / FIFO_PACKET_SIZE;
 		continue;
 	      case EINTR:
 		continue;
@@ -508,9 +732,46 @@ fifo_write(uint8_t *buf, uint64_t rtptime)
 	  DPRINTF(E_LOG, L_FIFO, "Failed to write to FIFO %s: %d\n", fifo_session->path, errno);
 	  return;
 	}
+
+      return;
     }
 }
 
+static void
+fifo_write(uint8_t *buf, uint64_t rtptime)
+{
+  struct fifo_session *fifo_session = sessions;
+
+  if (!fifo_session || !fifo_session->device->selected)
+    return;
+
+  fifo_packet_add(fifo_session, buf, rtptime);
+
+  fifo_packets_write(fifo_session);
+}
+
+static void
+fifo_write_batch(uint8_t *buf, uint64_t rtptime, int npackets)
+{
+  struct fifo_session *fifo_session = sessions;
+  int i;
+
+  if (!fifo_session || !fifo_session->device->selected)
+    return;
+
+  for (i = 0; i < npackets; i++)
+    fifo_packet_add(fifo_session, buf + i * STOB(AIRTUNES_V2_PACKET_SAMPLES), rtptime + i * AIRTUNES_V2_PACKET_SAMPLES);
+
+  fifo_packets_write(fifo_session);
+}
+
+static void
+fifo_write_stats(struct output_write_stats *stats)
+{
+  stats->drops = buffer.drops;
+  stats->queued = buffer.backlog.count;
+}
+
 static void
 fifo_set_status_cb(struct output_session *session, output_status_cb cb)
 {
@@ -526,6 +787,7 @@ fifo_init(void)
   cfg_t *cfg_fifo;
   char *nickname;
   char *path;
+  char *policy;
 
   cfg_fifo = cfg_getsec(cfg, "fifo");
   if (!cfg_fifo)
@@ -536,6 +798,26 @@ fifo_init(void)
     return -1;
 
   nickname = cfg_getstr(cfg_fifo, "nickname");
+  software_volume = cfg_getbool(cfg_fifo, "software_volume");
+
+  policy = cfg_getstr(cfg_fifo, "overflow_policy");
+  if (!policy || strcasecmp(policy, "flush") == 0)
+    overflow_policy = FIFO_OVERFLOW_FLUSH;
+  else if (strcasecmp(policy, "drop_oldest") == 0)
+    overflow_policy = FIFO_OVERFLOW_DROP_OLDEST;
+  else if (strcasecmp(policy, "drop_newest") == 0)
+    overflow_policy = FIFO_OVERFLOW_DROP_NEWEST;
+  else if (strcasecmp(policy, "pause") == 0)
+    overflow_policy = FIFO_OVERFLOW_PAUSE;
+  else
+    {
+      DPRINTF(E_LOG, L_FIFO, "Invalid overflow_policy '%s' for fifo, using 'flush'\n", policy);
+      overflow_policy = FIFO_OVERFLOW_FLUSH;
+    }
+
+  backlog_packets = cfg_getint(cfg_fifo, "buffer_ms") * 44100 / 1000 / AIRTUNES_V2_PACKET_SAMPLES;
+  if (backlog_packets < 2 * OUTPUTS_BATCH_PACKETS_MAX)
+    backlog_packets = 2 * OUTPUTS_BATCH_PACKETS_MAX;
 
   memset(&buffer, 0, sizeof(struct fifo_buffer));
 
@@ -581,6 +863,8 @@ struct output_definition output_fifo =
   .playback_start = fifo_playback_start,
   .playback_stop = fifo_playback_stop,
   .write = fifo_write,
+  .write_batch = fifo_write_batch,
   .flush = fifo_flush,
   .status_cb = fifo_set_status_cb,
+  .write_stats = fifo_write_stats,
 };
@@ -0,0 +1,243 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# include <arm_neon.h>
+# define PCM_NEON 1
+#endif
+
+#include "pcm.h"
+
+
+int
+pcm_gain_from_volume(int volume)
+{
+  int64_t v;
+
+  if (volume <= 0)
+    return 0;
+  if (volume >= 100)
+    return PCM_GAIN_UNITY;
+
+  v = volume;
+
+  return (int)(PCM_GAIN_UNITY * v * v * v / 1000000);
+}
+
+static inline int16_t
+scale_s16(int16_t sample, int gain)
+{
+  // gain < PCM_GAIN_UNITY, so this can't overflow
+  return (int16_t)(((int32_t)sample * gain) >> 15);
+}
+
+// With Q15 gain the product is a Q30 value, so one more shift gives full S32
+static inline int32_t
+scale_s32(int16_t sample, int gain)
+{
+  return (int32_t)((uint32_t)((int32_t)sample * gain) << 1);
+}
+
+void
+pcm_volume_s16(int16_t *samples, size_t nsamples, int gain)
+{
+  size_t i = 0;
+
+  if (gain >= PCM_GAIN_UNITY)
+    return;
+
+  if (gain <= 0)
+    {
+      memset(samples, 0, nsamples * sizeof(int16_t));
+      return;
+    }
+
+#if defined(__SSE2__)
+  {
+    __m128i g = _mm_set1_epi16((int16_t)gain);
+    __m128i x, lo, hi, p0, p1;
+
+    for (; i + 8 <= nsamples; i += 8)
+      {
+	x = _mm_loadu_si128((__m128i *)(samples + i));
+	lo = _mm_mullo_epi16(x, g);
+	hi = _mm_mulhi_epi16(x, g);
+	p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15);
+	p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15);
+	_mm_storeu_si128((__m128i *)(samples + i), _mm_packs_epi32(p0, p1));
+      }
+  }
+#elif defined(PCM_NEON)
+  for (; i + 8 <= nsamples; i += 8)
+    vst1q_s16(samples + i, vqrdmulhq_n_s16(vld1q_s16(samples + i), (int16_t)gain));
+#endif
+
+  for (; i < nsamples; i++)
+    samples[i] = scale_s16(samples[i], gain);
+}
+
+void
+pcm_s16_to_s32(int32_t *dst, const int16_t *src, size_t nsamples, int gain)
+{
+  size_t i = 0;
+
+  if (gain < 0)
+    gain = 0;
+
+#if defined(__SSE2__)
+  {
+    __m128i zero = _mm_setzero_si128();
+    __m128i g = _mm_set1_epi16((int16_t)gain);
+    __m128i x, lo, hi;
+
+    if (gain >= PCM_GAIN_UNITY)
+      {
+	for (; i + 8 <= nsamples; i += 8)
+	  {
+	    x = _mm_loadu_si128((__m128i *)(src + i));
+	    _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(zero, x));
+	    _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(zero, x));
+	  }
+      }
+    else
+      {
+	for (; i + 8 <= nsamples; i += 8)
+	  {
+	    x = _mm_loadu_si128((__m128i *)(src + i));
+	    lo = _mm_mullo_epi16(x, g);
+	    hi = _mm_mulhi_epi16(x, g);
+	    _mm_storeu_si128((__m128i *)(dst + i), _mm_slli_epi32(_mm_unpacklo_epi16(lo, hi), 1));
+	    _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_slli_epi32(_mm_unpackhi_epi16(lo, hi), 1));
+	  }
+      }
+  }
+#elif defined(PCM_NEON)
+  {
+    int16x8_t x;
+
+    if (gain >= PCM_GAIN_UNITY)
+      {
+	for (; i + 8 <= nsamples; i += 8)
+	  {
+	    x = vld1q_s16(src + i);
+	    vst1q_s32(dst + i, vshll_n_s16(vget_low_s16(x), 16));
+	    vst1q_s32(dst + i + 4, vshll_n_s16(vget_high_s16(x), 16));
+	  }
+      }
+    else
+      {
+	for (; i + 8 <= nsamples; i += 8)
+	  {
+	    x = vld1q_s16(src + i);
+	    vst1q_s32(dst + i, vshlq_n_s32(vmull_n_s16(vget_low_s16(x), (int16_t)gain), 1));
+	    vst1q_s32(dst + i + 4, vshlq_n_s32(vmull_n_s16(vget_high_s16(x), (int16_t)gain), 1));
+	  }
+      }
+  }
+#endif
+
+  if (gain >= PCM_GAIN_UNITY)
+    {
+      for (; i < nsamples; i++)
+	dst[i] = (int32_t)((uint32_t)(int32_t)src[i] << 16);
+    }
+  else
+    {
+      for (; i < nsamples; i++)
+	dst[i] = scale_s32(src[i], gain);
+    }
+}
+
+void
+pcm_s16_to_s24_3le(uint8_t *dst, const int16_t *src, size_t nsamples, int gain)
+{
+  int32_t s;
+  size_t i;
+
+  if (gain < 0)
+    gain = 0;
+
+  for (i = 0; i < nsamples; i++)
+    {
+      if (gain >= PCM_GAIN_UNITY)
+	s = (int32_t)src[i] * 256;
+      else
+	s = scale_s32(src[i], gain) >> 8;
+
+      dst[3 * i]     = s & 0xff;
+      dst[3 * i + 1] = (s >> 8) & 0xff;
+      dst[3 * i + 2] = (s >> 16) & 0xff;
+    }
+}
+
+void
+pcm_resample_init(struct pcm_resample *rs)
+{
+  memset(rs, 0, sizeof(struct pcm_resample));
+
+  rs->step = PCM_RESAMPLE_UNITY;
+  rs->pos = PCM_RESAMPLE_UNITY;
+}
+
+size_t
+pcm_resample_s16(int16_t *dst, size_t dst_frames, const int16_t *src, size_t nframes, struct pcm_resample *rs)
+{
+  const int16_t *a;
+  const int16_t *b;
+  uint64_t end;
+  uint64_t pos;
+  size_t i;
+  size_t n;
+  int32_t f;
+
+  if (nframes == 0)
+    return 0;
+
+  // The input is seen as the last frame of the previous call followed by src,
+  // so frame i of src is at position i + 1
+  end = (uint64_t)nframes << 32;
+  pos = rs->pos;
+  n = 0;
+  while (pos <= end && n < dst_frames)
+    {
+      i = pos >> 32;
+      f = (pos >> 17) & 0x7fff; // Q15 fraction
+
+      a = (i == 0) ? rs->last : &src[2 * (i - 1)];
+      b = (i == nframes) ? a : &src[2 * i];
+
+      dst[2 * n]     = a[0] + (((b[0] - a[0]) * f) >> 15);
+      dst[2 * n + 1] = a[1] + (((b[1] - a[1]) * f) >> 15);
+
+      n++;
+      pos += rs->step;
+    }
+
+  rs->pos = (pos > end) ? pos - end : 0;
+  rs->last[0] = src[2 * (nframes - 1)];
+  rs->last[1] = src[2 * (nframes - 1) + 1];
+
+  return n;
+}
@@ -0,0 +1,62 @@
+#ifndef __PCM_H__
+#define __PCM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sample kernels for local outputs that do their own software volume and
+ * format conversion. Input is always interleaved S16 (native endian), gains
+ * are Q15 where PCM_GAIN_UNITY means no change. SSE2 or NEON is used if the
+ * compiler targets it, otherwise plain C.
+ */
+
+#define PCM_GAIN_UNITY 32768
+
+/* Converts a 0-100 device volume to a gain, using a cubic curve so the steps
+ * sound roughly even (about 60 dB from 1 to 100)
+ */
+int
+pcm_gain_from_volume(int volume);
+
+/* Scales nsamples S16 samples in place */
+void
+pcm_volume_s16(int16_t *samples, size_t nsamples, int gain);
+
+/* Converts nsamples S16 samples to S32 (native endian), applying the gain */
+void
+pcm_s16_to_s32(int32_t *dst, const int16_t *src, size_t nsamples, int gain);
+
+/* Converts nsamples S16 samples to packed 3-byte S24 little endian, applying
+ * the gain
+ */
+void
+pcm_s16_to_s24_3le(uint8_t *dst, const int16_t *src, size_t nsamples, int gain);
+
+/* State for pcm_resample_s16(), a linear interpolating resampler for small
+ * rate corrections (e.g. to keep a sound card in sync with the player clock).
+ * The step is input frames per output frame in 32.32 fixed point, so a step
+ * above PCM_RESAMPLE_UNITY plays faster.
+ */
+#define PCM_RESAMPLE_UNITY ((uint64_t)1 << 32)
+
+struct pcm_resample
+{
+  uint64_t step;
+  // Position of the next output frame, relative to the last input frame of
+  // the previous call
+  uint64_t pos;
+  int16_t last[2];
+};
+
+void
+pcm_resample_init(struct pcm_resample *rs);
+
+/* Resamples nframes stereo S16 frames from src to dst, which must have room
+ * for at least nframes * PCM_RESAMPLE_UNITY / rs->step + 1 frames
+ *
+ * @return         Number of frames written to dst
+ */
+size_t
+pcm_resample_s16(int16_t *dst, size_t dst_frames, const int16_t *src, size_t nframes, struct pcm_resample *rs);
+
+#endif /* !__PCM_H__ */
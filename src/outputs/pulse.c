@@ -29,6 +29,7 @@
 #include <inttypes.h>
 
 #include <event2/event.h>
+#include <event2/buffer.h>
 #include <pulse/pulseaudio.h>
 
 #include "misc.h"
@@ -38,11 +39,14 @@
 #include "outputs.h"
 #include "commands.h"
 
+#ifndef MIN
+# define MIN(a, b) ((a < b) ? a : b)
+#endif
+
 #define PULSE_MAX_DEVICES 64
 #define PULSE_LOG_MAX 10
 
 /* TODO for Pulseaudio
-   - Add real sync with AirPlay
    - Allow per-sink latency config
 */
 
@@ -64,6 +68,17 @@ struct pulse_session
   pa_buffer_attr attr;
   pa_volume_t volume;
 
+  // With a configured (low) tlength we hold back the audio that the player
+  // sends ahead of time, and only give Pulseaudio what is due. The rtptime
+  // is that of the first sample in pending.
+  struct evbuffer *pending;
+  uint64_t pending_rtptime;
+  bool started;
+
+  // Configured audio offset plus the device's sync offset, in samples. Only
+  // applied when the stream starts.
+  int offset;
+
   int logcount;
 
   char *devname;
@@ -85,6 +100,13 @@ static struct pulse_session *sessions;
 // Internal list with indeces of the Pulseaudio devices (sinks) we have registered
 static uint32_t pulse_known_devices[PULSE_MAX_DEVICES];
 
+// Buffer attributes from the config in samples, negative means default
+static int pulse_tlength;
+static int pulse_minreq;
+static int pulse_prebuf;
+// Adjusts the local audio timing, see the offset option
+static int pulse_offset;
+
 // Converts from 0 - 100 to Pulseaudio's scale
 static inline pa_volume_t
 pulse_from_device_volume(int device_volume)
@@ -116,6 +138,9 @@ pulse_session_free(struct pulse_session *ps)
   if (ps->devname)
     free(ps->devname);
 
+  if (ps->pending)
+    evbuffer_free(ps->pending);
+
   free(ps->output_session);
 
   free(ps);
@@ -163,6 +188,14 @@ pulse_session_make(struct output_device *device, output_status_cb cb)
       return NULL;
     }
 
+  if (pulse_tlength >= 0 && !(ps->pending = evbuffer_new()))
+    {
+      DPRINTF(E_LOG, L_LAUDIO, "Out of memory (pending)\n");
+      free(ps);
+      free(os);
+      return NULL;
+    }
+
   os->session = ps;
   os->type = device->type;
 
@@ -171,6 +204,7 @@ pulse_session_make(struct output_device *device, output_status_cb cb)
   ps->device = device;
   ps->status_cb = cb;
   ps->volume = pulse_from_device_volume(device->volume);
+  ps->offset = pulse_offset + outputs_device_offset(device);
   ps->devname = strdup(device->extra_device_info);
 
   ps->next = sessions;
@@ -210,11 +244,15 @@ send_status(void *arg, int *ptr)
 	state = OUTPUT_STATE_FAILED;
     }
 
+  outputs_lock(OUTPUT_TYPE_PULSE);
+
   status_cb = ps->status_cb;
   ps->status_cb = NULL;
   if (status_cb)
     status_cb(ps->device, ps->output_session, state);
 
+  outputs_unlock(OUTPUT_TYPE_PULSE);
+
   return COMMAND_PENDING; // Don't want the command module to clean up ps
 }
 
@@ -223,9 +261,14 @@ session_shutdown(void *arg, int *ptr)
 {
   struct pulse_session *ps = arg;
 
+  // Keeps the writer thread out while we remove the session
+  outputs_lock(OUTPUT_TYPE_PULSE);
+
   send_status(ps, ptr);
   pulse_session_cleanup(ps);
 
+  outputs_unlock(OUTPUT_TYPE_PULSE);
+
   return COMMAND_PENDING; // Don't want the command module to clean up ps
 }
 
@@ -577,7 +620,6 @@ stream_open(struct pulse_session *ps, pa_stream_notify_cb_t cb)
   pa_stream_flags_t flags;
   pa_sample_spec ss;
   pa_cvolume cvol;
-  int offset;
   int ret;
 
   DPRINTF(E_DBG, L_LAUDIO, "Opening Pulseaudio stream to '%s'\n", ps->devname);
@@ -586,13 +628,6 @@ stream_open(struct pulse_session *ps, pa_stream_notify_cb_t cb)
   ss.channels = 2;
   ss.rate = 44100;
 
-  offset = cfg_getint(cfg_getsec(cfg, "audio"), "offset");
-  if (abs(offset) > 44100)
-    {
-      DPRINTF(E_LOG, L_LAUDIO, "The audio offset (%d) set in the configuration is out of bounds\n", offset);
-      offset = 44100 * (offset/abs(offset));
-    }
-
   pa_threaded_mainloop_lock(pulse.mainloop);
 
   if (!(ps->stream = pa_stream_new(pulse.context, "forked-daapd audio", &ss, NULL)))
@@ -602,12 +637,24 @@ stream_open(struct pulse_session *ps, pa_stream_notify_cb_t cb)
 
   flags = PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 
-  ps->attr.tlength   = STOB(2 * ss.rate + AIRTUNES_V2_PACKET_SAMPLES - offset); // 2 second latency
+  // Without a configured tlength, the 2 seconds that the player sends ahead
+  // are buffered by Pulseaudio, which keeps it in sync with AirPlay
+  if (pulse_tlength < 0)
+    ps->attr.tlength = STOB(2 * ss.rate + AIRTUNES_V2_PACKET_SAMPLES - ps->offset); // 2 second latency
+  else
+    {
+      ps->attr.tlength = STOB(pulse_tlength);
+      flags |= PA_STREAM_ADJUST_LATENCY;
+    }
   ps->attr.maxlength = 2 * ps->attr.tlength;
-  ps->attr.prebuf    = (uint32_t)-1;
-  ps->attr.minreq    = (uint32_t)-1;
+  ps->attr.prebuf    = (pulse_prebuf < 0) ? (uint32_t)-1 : STOB(pulse_prebuf);
+  ps->attr.minreq    = (pulse_minreq < 0) ? (uint32_t)-1 : STOB(pulse_minreq);
   ps->attr.fragsize  = (uint32_t)-1;
 
+  if (ps->pending)
+    evbuffer_drain(ps->pending, evbuffer_get_length(ps->pending));
+  ps->started = false;
+
   pa_cvolume_set(&cvol, 2, ps->volume);
 
   ret = pa_stream_connect_playback(ps->stream, ps->devname, &ps->attr, flags, &cvol, NULL);
@@ -749,8 +796,121 @@ pulse_device_volume_set(struct output_device *device, output_status_cb cb)
   return 1;
 }
 
+// Copies the audio directly into memory that Pulseaudio gives us, so that
+// pa_stream_write() doesn't need to make its own copy. Must be called with the
+// mainloop lock.
+static int
+stream_write(struct pulse_session *ps, uint8_t *buf, size_t length)
+{
+  void *data;
+  size_t nbytes;
+  int ret;
+
+  while (length > 0)
+    {
+      nbytes = length;
+      ret = pa_stream_begin_write(ps->stream, &data, &nbytes);
+      if (ret < 0)
+	return -1;
+
+      if (nbytes > length)
+	nbytes = length;
+
+      memcpy(data, buf, nbytes);
+
+      ret = pa_stream_write(ps->stream, data, nbytes, NULL, 0LL, PA_SEEK_RELATIVE);
+      if (ret < 0)
+	return -1;
+
+      buf += nbytes;
+      length -= nbytes;
+    }
+
+  return 0;
+}
+
+// Returns the latency of the stream in samples, i.e. how long until a sample
+// we write now is heard, as measured by Pulseaudio
+static int
+stream_latency(struct pulse_session *ps)
+{
+  pa_usec_t usec;
+  int negative;
+  int ret;
+
+  ret = pa_stream_get_latency(ps->stream, &usec, &negative);
+  if (ret < 0 || negative)
+    return 0;
+
+  return (int)(usec * 44100 / 1000000);
+}
+
+// Adds the audio to the pending buffer and writes what is due to Pulseaudio,
+// which is all the audio that must be heard within tlength. Playback is not
+// started before the first sample is due, taking the measured stream latency
+// into account, so we stay in sync with the other outputs (e.g. AirPlay).
+static int
+stream_write_due(struct pulse_session *ps, uint8_t *buf, uint64_t rtptime, size_t length)
+{
+  struct timespec ts;
+  uint64_t cur_pos;
+  uint64_t due;
+  size_t pending_len;
+  size_t nbytes;
+  int latency;
+  int ret;
+
+  pending_len = evbuffer_get_length(ps->pending);
+  if (pending_len == 0)
+    ps->pending_rtptime = rtptime;
+
+  evbuffer_add(ps->pending, buf, length);
+  pending_len += length;
+
+  ret = player_get_current_pos(&cur_pos, &ts, 0);
+  if (ret < 0)
+    return 0; // Try again with the next packet
+
+  cur_pos += ps->offset;
+
+  if (!ps->started)
+    {
+      latency = stream_latency(ps);
+      if (ps->pending_rtptime > cur_pos + latency)
+	return 0;
+
+      DPRINTF(E_DBG, L_LAUDIO, "Starting Pulseaudio stream '%s' (measured latency %d samples)\n", ps->devname, latency);
+
+      // If we are late, drop what should already have been heard
+      if (ps->pending_rtptime + latency < cur_pos)
+	{
+	  nbytes = MIN(STOB(cur_pos - latency - ps->pending_rtptime), pending_len);
+	  evbuffer_drain(ps->pending, nbytes);
+	  ps->pending_rtptime += BTOS(nbytes);
+	  pending_len -= nbytes;
+	}
+
+      ps->started = true;
+    }
+
+  due = cur_pos + pulse_tlength;
+  if (ps->pending_rtptime >= due)
+    return 0;
+
+  nbytes = MIN(STOB(due - ps->pending_rtptime), pending_len);
+  if (nbytes == 0)
+    return 0;
+
+  ret = stream_write(ps, evbuffer_pullup(ps->pending, nbytes), nbytes);
+
+  evbuffer_drain(ps->pending, nbytes);
+  ps->pending_rtptime += BTOS(nbytes);
+
+  return ret;
+}
+
 static void
-pulse_write(uint8_t *buf, uint64_t rtptime)
+pulse_write_batch(uint8_t *buf, uint64_t rtptime, int npackets)
 {
   struct pulse_session *ps;
   struct pulse_session *next;
@@ -760,7 +920,7 @@ pulse_write(uint8_t *buf, uint64_t rtptime)
   if (!sessions)
     return;
 
-  length = STOB(AIRTUNES_V2_PACKET_SAMPLES);
+  length = npackets * STOB(AIRTUNES_V2_PACKET_SAMPLES);
 
   pa_threaded_mainloop_lock(pulse.mainloop);
 
@@ -771,7 +931,10 @@ pulse_write(uint8_t *buf, uint64_t rtptime)
       if (ps->state != PA_STREAM_READY)
 	continue;
 
-      ret = pa_stream_write(ps->stream, buf, length, NULL, 0LL, PA_SEEK_RELATIVE);
+      if (ps->pending)
+	ret = stream_write_due(ps, buf, rtptime, length);
+      else
+	ret = stream_write(ps, buf, length);
       if (ret < 0)
 	{
 	  ret = pa_context_errno(pulse.context);
@@ -787,6 +950,12 @@ pulse_write(uint8_t *buf, uint64_t rtptime)
   pa_threaded_mainloop_unlock(pulse.mainloop);
 }
 
+static void
+pulse_write(uint8_t *buf, uint64_t rtptime)
+{
+  pulse_write_batch(buf, rtptime, 1);
+}
+
 static void
 pulse_playback_start(uint64_t next_pkt, struct timespec *ts)
 {
@@ -819,6 +988,10 @@ pulse_playback_stop(void)
 
   for (ps = sessions; ps; ps = ps->next)
     {
+      if (ps->pending)
+	evbuffer_drain(ps->pending, evbuffer_get_length(ps->pending));
+      ps->started = false;
+
       o = pa_stream_cork(ps->stream, 1, NULL, NULL);
       if (!o)
 	{
@@ -857,6 +1030,10 @@ pulse_flush(output_status_cb cb, uint64_t rtptime)
 
       ps->status_cb = cb;
 
+      if (ps->pending)
+	evbuffer_drain(ps->pending, evbuffer_get_length(ps->pending));
+      ps->started = false;
+
       o = pa_stream_cork(ps->stream, 1, NULL, NULL);
       if (!o)
 	{
@@ -901,6 +1078,24 @@ pulse_init(void)
 
   server = cfg_getstr(cfg_getsec(cfg, "audio"), "server");
 
+  pulse_offset = cfg_getint(cfg_getsec(cfg, "audio"), "offset");
+  if (abs(pulse_offset) > 44100)
+    {
+      DPRINTF(E_LOG, L_LAUDIO, "The audio offset (%d) set in the configuration is out of bounds\n", pulse_offset);
+      pulse_offset = 44100 * (pulse_offset/abs(pulse_offset));
+    }
+
+  // Configured in milliseconds
+  pulse_tlength = cfg_getint(cfg_getsec(cfg, "audio"), "pulse_tlength");
+  pulse_minreq = cfg_getint(cfg_getsec(cfg, "audio"), "pulse_minreq");
+  pulse_prebuf = cfg_getint(cfg_getsec(cfg, "audio"), "pulse_prebuf");
+  if (pulse_tlength >= 0)
+    pulse_tlength = pulse_tlength * 44100 / 1000;
+  if (pulse_minreq >= 0)
+    pulse_minreq = pulse_minreq * 44100 / 1000;
+  if (pulse_prebuf >= 0)
+    pulse_prebuf = pulse_prebuf * 44100 / 1000;
+
   ret = 0;
 
   if (!(pulse.mainloop = pa_threaded_mainloop_new()))
@@ -973,6 +1168,9 @@ struct output_definition output_pulse =
   .type = OUTPUT_TYPE_PULSE,
   .priority = 3,
   .disabled = 0,
+  .low_latency = 1,
+  .write_thread = 1,
+  .queue_policy = OUTPUT_QUEUE_BLOCK,
   .init = pulse_init,
   .deinit = pulse_deinit,
   .device_start = pulse_device_start,
@@ -983,6 +1181,7 @@ struct output_definition output_pulse =
   .playback_start = pulse_playback_start,
   .playback_stop = pulse_playback_stop,
   .write = pulse_write,
+  .write_batch = pulse_write_batch,
   .flush = pulse_flush,
   .status_cb = pulse_set_status_cb,
 };
@@ -59,6 +59,7 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -68,12 +69,15 @@
 #include "conffile.h"
 #include "logger.h"
 #include "mdns.h"
+#include "metrics.h"
 #include "misc.h"
 #include "player.h"
 #include "db.h"
 #include "artwork.h"
 #include "dmap_common.h"
 #include "outputs.h"
+#include "worker.h"
+#include "alac.h"
 
 #ifdef RAOP_VERIFICATION
 #include "raop_verification.h"
@@ -86,9 +90,16 @@
 #define AIRTUNES_V2_HDR_LEN        12
 #define ALAC_HDR_LEN               3
 #define AIRTUNES_V2_PKT_LEN        (AIRTUNES_V2_HDR_LEN + ALAC_HDR_LEN + STOB(AIRTUNES_V2_PACKET_SAMPLES))
-#define AIRTUNES_V2_PKT_TAIL_LEN   (AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_HDR_LEN - ((AIRTUNES_V2_PKT_LEN / 16) * 16))
-#define AIRTUNES_V2_PKT_TAIL_OFF   (AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_PKT_TAIL_LEN)
-#define RETRANSMIT_BUFFER_SIZE     1000
+/* Must be a power of two, packets are stored at seqnum & RETRANSMIT_BUFFER_MASK */
+#define RETRANSMIT_BUFFER_SIZE     1024
+#define RETRANSMIT_BUFFER_MASK     (RETRANSMIT_BUFFER_SIZE - 1)
+
+/* Limits of the transmit queue, see raop_v2_txq_flush(). A GSO message must
+ * stay below the 64k datagram limit.
+ */
+#define RAOP_TXQ_MSGS_MAX          64
+#define RAOP_TXQ_IOV_MAX           256
+#define RAOP_GSO_SEGMENTS_MAX      MIN(64, 65000 / AIRTUNES_V2_PKT_LEN)
 
 #define RAOP_MD_DELAY_STARTUP      15360
 #define RAOP_MD_DELAY_SWITCH       (RAOP_MD_DELAY_STARTUP * 2)
@@ -96,6 +107,9 @@
 /* This is an arbitrary value which just needs to be kept in sync with the config */
 #define RAOP_CONFIG_MAX_VOLUME     11
 
+// How long a connection that passed pair-verify is kept open after a flush
+#define RAOP_VERIFIED_KEEP_SECONDS 300
+
 union sockaddr_all
 {
   struct sockaddr_in sin;
@@ -109,10 +123,14 @@ struct raop_v2_packet
   uint8_t clear[AIRTUNES_V2_PKT_LEN];
   uint8_t encrypted[AIRTUNES_V2_PKT_LEN];
 
-  uint16_t seqnum;
+  /* Compressed ALAC version of the packet, made if a session wants it and it
+   * is smaller than the verbatim one. alac_len is 0 if there is none.
+   */
+  uint8_t clear_alac[AIRTUNES_V2_PKT_LEN];
+  uint8_t encrypted_alac[AIRTUNES_V2_PKT_LEN];
+  int alac_len;
 
-  struct raop_v2_packet *prev;
-  struct raop_v2_packet *next;
+  uint16_t seqnum;
 };
 
 enum raop_devtype {
@@ -161,6 +179,9 @@ struct raop_extra
 
   bool encrypt;
   bool wants_metadata;
+  bool compress;
+
+  int verified_keep;
 };
 
 struct raop_session
@@ -173,9 +194,17 @@ struct raop_session
   bool auth_quirk_itunes;
   bool wants_metadata;
   bool keep_alive;
+  bool compress;
 
   bool only_probe;
 
+  /* Set when the connection passed pair-verify. Such a connection can be
+   * reused for the next playback without verifying again, so we keep it open
+   * for verified_keep seconds after a flush instead of the usual 10.
+   */
+  bool verified;
+  int verified_keep;
+
   struct event *deferredev;
 
   int reqs_in_flight;
@@ -194,6 +223,9 @@ struct raop_session
   int volume;
   uint64_t start_rtptime;
 
+  // Sync offset in samples, see outputs_device_offset()
+  int offset;
+
   /* Do not dereference - only passed to the status cb */
   struct output_device *device;
   struct output_session *output_session;
@@ -212,6 +244,13 @@ struct raop_session
 
   int server_fd;
 
+  /* Address of the stream port, used with the shared transmit socket */
+  union sockaddr_all server_sa;
+  socklen_t server_salen;
+
+  /* Set when a stream packet could not be sent, see raop_v2_txq_send() */
+  int send_errno;
+
   union sockaddr_all sa;
 
   struct raop_service *timing_svc;
@@ -220,11 +259,33 @@ struct raop_session
   struct raop_session *next;
 };
 
+/* Prepared metadata or artwork. Sent by reference, so all sessions share the
+ * same data, which is freed when the last request using it is done.
+ */
+struct raop_blob
+{
+  int refcount;
+
+  size_t len;
+  uint8_t data[];
+};
+
+struct raop_metadata_cache_entry
+{
+  uint32_t item_id;
+  uint32_t file_id;
+  char *artwork_url;
+
+  struct raop_blob *metadata;
+  struct raop_blob *artwork;
+  int artwork_fmt;
+};
+
 struct raop_metadata
 {
-  struct evbuffer *metadata;
+  struct raop_blob *metadata;
 
-  struct evbuffer *artwork;
+  struct raop_blob *artwork;
   int artwork_fmt;
 
   /* Progress data */
@@ -241,6 +302,22 @@ struct raop_service
   struct event *ev;
 };
 
+/* Stream packets waiting to be sent to all sessions with sendmmsg() */
+struct raop_v2_txq
+{
+  int fd;
+  bool gso;
+
+#ifdef HAVE_SENDMMSG
+  int nmsgs;
+  int niov;
+
+  struct mmsghdr msgs[RAOP_TXQ_MSGS_MAX];
+  struct iovec iov[RAOP_TXQ_IOV_MAX];
+  struct raop_session *rs[RAOP_TXQ_MSGS_MAX];
+#endif
+};
+
 typedef void (*evrtsp_req_cb)(struct evrtsp_request *req, void *arg);
 
 /* Truncate RTP time to lower 32bits for RAOP */
@@ -312,18 +389,32 @@ static int sync_counter;
 /* AirTunes v2 audio stream */
 static uint32_t ssrc_id;
 static uint16_t stream_seq;
+static struct raop_v2_txq txq_4;
+static struct raop_v2_txq txq_6;
 
-/* Retransmit packet buffer */
+/* Retransmit packet buffer, a ring of RETRANSMIT_BUFFER_SIZE packets that is
+ * allocated with the first packet. pktbuf_size packets up to and including
+ * pktbuf_head_seq are valid.
+ */
+static struct raop_v2_packet *pktbuf;
 static int pktbuf_size;
-static struct raop_v2_packet *pktbuf_head;
-static struct raop_v2_packet *pktbuf_tail;
+static uint16_t pktbuf_head_seq;
+
+static struct metrics_metric *raop_metric_resends;
+static struct metrics_metric *raop_metric_resend_misses;
 
 /* Metadata */
 static struct raop_metadata *metadata_head;
 static struct raop_metadata *metadata_tail;
 
+/* Metadata of the last queue items, see raop_metadata_payload_get() */
+#define RAOP_MD_CACHE_SIZE 3
+static struct raop_metadata_cache_entry metadata_cache[RAOP_MD_CACHE_SIZE];
+static pthread_mutex_t metadata_lck;
+
 /* FLUSH timer */
 static struct event *flush_timer;
+static time_t flush_start;
 
 /* Keep-alive timer - hack for ATV's with tvOS 10 */
 static struct event *keep_alive_timer;
@@ -793,12 +884,254 @@ raop_crypt_encrypt_aes_key_base64(void)
 
 
 /* RAOP metadata */
+static struct raop_blob *
+raop_blob_new(const uint8_t *data, size_t len)
+{
+  struct raop_blob *blob;
+
+  blob = malloc(sizeof(struct raop_blob) + len);
+  if (!blob)
+    {
+      DPRINTF(E_LOG, L_RAOP, "Out of memory for RAOP metadata blob\n");
+
+      return NULL;
+    }
+
+  blob->refcount = 1;
+  blob->len = len;
+  memcpy(blob->data, data, len);
+
+  return blob;
+}
+
+static struct raop_blob *
+raop_blob_ref(struct raop_blob *blob)
+{
+  if (!blob)
+    return NULL;
+
+  CHECK_ERR(L_RAOP, pthread_mutex_lock(&metadata_lck));
+  blob->refcount++;
+  CHECK_ERR(L_RAOP, pthread_mutex_unlock(&metadata_lck));
+
+  return blob;
+}
+
+static void
+raop_blob_unref(struct raop_blob *blob)
+{
+  int refcount;
+
+  if (!blob)
+    return;
+
+  CHECK_ERR(L_RAOP, pthread_mutex_lock(&metadata_lck));
+  refcount = --blob->refcount;
+  CHECK_ERR(L_RAOP, pthread_mutex_unlock(&metadata_lck));
+
+  if (refcount == 0)
+    free(blob);
+}
+
+static void
+raop_blob_unref_cb(const void *data, size_t datalen, void *extra)
+{
+  raop_blob_unref(extra);
+}
+
+/* Adds the blob to evbuf without copying, the reference is held until evbuf is
+ * done with the data
+ */
+static int
+raop_blob_add(struct evbuffer *evbuf, struct raop_blob *blob)
+{
+  int ret;
+
+  raop_blob_ref(blob);
+
+  ret = evbuffer_add_reference(evbuf, blob->data, blob->len, raop_blob_unref_cb, blob);
+  if (ret < 0)
+    raop_blob_unref(blob);
+
+  return ret;
+}
+
+static void
+raop_metadata_cache_entry_clear(struct raop_metadata_cache_entry *entry)
+{
+  raop_blob_unref(entry->metadata);
+  raop_blob_unref(entry->artwork);
+  free(entry->artwork_url);
+
+  memset(entry, 0, sizeof(struct raop_metadata_cache_entry));
+}
+
+static void
+raop_metadata_cache_purge(void)
+{
+  int i;
+
+  for (i = 0; i < RAOP_MD_CACHE_SIZE; i++)
+    raop_metadata_cache_entry_clear(&metadata_cache[i]);
+}
+
+static bool
+raop_metadata_artwork_match(struct raop_metadata_cache_entry *entry, struct db_queue_item *queue_item)
+{
+  if (entry->file_id != queue_item->file_id)
+    return false;
+
+  if (!entry->artwork_url || !queue_item->artwork_url)
+    return (entry->artwork_url == queue_item->artwork_url);
+
+  return (strcmp(entry->artwork_url, queue_item->artwork_url) == 0);
+}
+
+/* Thread: worker (the cache is only used from there, metadata_lck is for the
+ * refcounts, which requests in the player thread also change)
+ */
+static struct raop_metadata_cache_entry *
+raop_metadata_cache_find(uint32_t item_id)
+{
+  int i;
+
+  for (i = 0; i < RAOP_MD_CACHE_SIZE; i++)
+    {
+      if (metadata_cache[i].metadata && (metadata_cache[i].item_id == item_id))
+	return &metadata_cache[i];
+    }
+
+  return NULL;
+}
+
+/* Thread: worker */
+static void
+raop_metadata_cache_add(struct db_queue_item *queue_item, struct raop_blob *metadata, struct raop_blob *artwork, int artwork_fmt)
+{
+  struct raop_metadata_cache_entry *entry;
+  int i;
+
+  // Replaces the item's old entry, or else the least recently used one
+  for (i = 0; i < RAOP_MD_CACHE_SIZE - 1; i++)
+    {
+      if (metadata_cache[i].metadata && (metadata_cache[i].item_id == queue_item->id))
+	break;
+    }
+
+  raop_metadata_cache_entry_clear(&metadata_cache[i]);
+  memmove(&metadata_cache[1], &metadata_cache[0], i * sizeof(struct raop_metadata_cache_entry));
+
+  entry = &metadata_cache[0];
+  entry->item_id = queue_item->id;
+  entry->file_id = queue_item->file_id;
+  entry->artwork_url = safe_strdup(queue_item->artwork_url);
+  entry->metadata = raop_blob_ref(metadata);
+  entry->artwork = raop_blob_ref(artwork);
+  entry->artwork_fmt = artwork_fmt;
+}
+
+/* Thread: worker
+ *
+ * Gets the DMAP metadata and the artwork for a queue item, from the cache if
+ * possible. The caller gets a reference to both blobs (artwork may be NULL).
+ */
+static int
+raop_metadata_payload_get(struct raop_blob **metadata, struct raop_blob **artwork, int *artwork_fmt, struct db_queue_item *queue_item)
+{
+  struct raop_metadata_cache_entry *entry;
+  struct dmap_writer dmap;
+  struct evbuffer *evbuf;
+  bool have_artwork;
+  int ret;
+
+  *metadata = NULL;
+  *artwork = NULL;
+  *artwork_fmt = 0;
+
+  /* Turn it into DAAP metadata. This is cheap, so it is always done and then
+   * compared with the cached version, since e.g. the title of a stream changes
+   * while the item id stays the same.
+   */
+  dmap_writer_init(&dmap, 1024);
+
+  ret = dmap_encode_queue_metadata(&dmap, queue_item);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_RAOP, "Could not encode file metadata; metadata will not be sent\n");
+
+      goto error;
+    }
+
+  have_artwork = false;
+
+  entry = raop_metadata_cache_find(queue_item->id);
+  if (entry)
+    {
+      if ((entry->metadata->len == dmap.len) && (memcmp(entry->metadata->data, dmap.data, dmap.len) == 0))
+	*metadata = raop_blob_ref(entry->metadata);
+
+      if (raop_metadata_artwork_match(entry, queue_item))
+	{
+	  *artwork = raop_blob_ref(entry->artwork);
+	  *artwork_fmt = entry->artwork_fmt;
+	  have_artwork = true;
+	}
+    }
+
+  if (*metadata && have_artwork)
+    DPRINTF(E_DBG, L_RAOP, "Using prepared metadata for item id %" PRIu32 "\n", queue_item->id);
+
+  if (!*metadata)
+    {
+      *metadata = raop_blob_new(dmap.data, dmap.len);
+      if (!*metadata)
+	goto error;
+    }
+
+  if (!have_artwork)
+    {
+      evbuf = evbuffer_new();
+      if (!evbuf)
+	{
+	  DPRINTF(E_LOG, L_RAOP, "Out of memory for artwork evbuffer; no artwork will be sent\n");
+
+	  goto error;
+	}
+
+      ret = artwork_get_item(evbuf, queue_item->file_id, 600, 600);
+      if (ret < 0)
+	DPRINTF(E_INFO, L_RAOP, "Failed to retrieve artwork for file id %d; no artwork will be sent\n", queue_item->file_id);
+      else
+	{
+	  *artwork = raop_blob_new(evbuffer_pullup(evbuf, -1), evbuffer_get_length(evbuf));
+	  *artwork_fmt = ret;
+	}
+
+      evbuffer_free(evbuf);
+    }
+
+  raop_metadata_cache_add(queue_item, *metadata, *artwork, *artwork_fmt);
+
+  dmap_writer_free(&dmap);
+
+  return 0;
+
+ error:
+  raop_blob_unref(*metadata);
+  raop_blob_unref(*artwork);
+  *metadata = NULL;
+  *artwork = NULL;
+
+  dmap_writer_free(&dmap);
+
+  return -1;
+}
+
 static void
 raop_metadata_free(struct raop_metadata *rmd)
 {
-  evbuffer_free(rmd->metadata);
-  if (rmd->artwork)
-    evbuffer_free(rmd->artwork);
+  raop_blob_unref(rmd->metadata);
+  raop_blob_unref(rmd->artwork);
   free(rmd);
 }
 
@@ -836,13 +1169,45 @@ raop_metadata_prune(uint64_t rtptime)
     }
 }
 
+/* Thread: worker
+ *
+ * Prepares the item after the one that just started, so its metadata and
+ * artwork are ready when it starts playing
+ */
+static void
+raop_metadata_prefetch_cb(void *arg)
+{
+  struct player_status status;
+  struct db_queue_item *queue_item;
+  struct raop_blob *metadata;
+  struct raop_blob *artwork;
+  uint32_t *id = arg;
+  int artwork_fmt;
+  int ret;
+
+  player_get_status(&status);
+
+  queue_item = db_queue_fetch_next(*id, status.shuffle);
+  if (!queue_item)
+    return;
+
+  ret = raop_metadata_payload_get(&metadata, &artwork, &artwork_fmt, queue_item);
+  if (ret == 0)
+    {
+      raop_blob_unref(metadata);
+      raop_blob_unref(artwork);
+    }
+
+  free_queue_item(queue_item, 0);
+}
+
 /* Thread: worker */
 static void *
 raop_metadata_prepare(int id)
 {
   struct db_queue_item *queue_item;
   struct raop_metadata *rmd;
-  struct evbuffer *tmp;
+  uint32_t item_id;
   int ret;
 
   rmd = (struct raop_metadata *)malloc(sizeof(struct raop_metadata));
@@ -863,54 +1228,9 @@ raop_metadata_prepare(int id)
       goto out_rmd;
     }
 
-  /* Get artwork */
-  rmd->artwork = evbuffer_new();
-  if (!rmd->artwork)
-    {
-      DPRINTF(E_LOG, L_RAOP, "Out of memory for artwork evbuffer; no artwork will be sent\n");
-
-      goto skip_artwork;
-    }
-
-  ret = artwork_get_item(rmd->artwork, queue_item->file_id, 600, 600);
-  if (ret < 0)
-    {
-      DPRINTF(E_INFO, L_RAOP, "Failed to retrieve artwork for file id %d; no artwork will be sent\n", id);
-
-      evbuffer_free(rmd->artwork);
-      rmd->artwork = NULL;
-    }
-
-  rmd->artwork_fmt = ret;
-
- skip_artwork:
-
-  /* Turn it into DAAP metadata */
-  tmp = evbuffer_new();
-  if (!tmp)
-    {
-      DPRINTF(E_LOG, L_RAOP, "Out of memory for temporary metadata evbuffer; metadata will not be sent\n");
-
-      goto out_qi;
-    }
-
-  rmd->metadata = evbuffer_new();
-  if (!rmd->metadata)
-    {
-      DPRINTF(E_LOG, L_RAOP, "Out of memory for metadata evbuffer; metadata will not be sent\n");
-
-      evbuffer_free(tmp);
-      goto out_qi;
-    }
-
-  ret = dmap_encode_queue_metadata(rmd->metadata, tmp, queue_item);
-  evbuffer_free(tmp);
+  ret = raop_metadata_payload_get(&rmd->metadata, &rmd->artwork, &rmd->artwork_fmt, queue_item);
   if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_RAOP, "Could not encode file metadata; metadata will not be sent\n");
-
-      goto out_metadata;
-    }
+    goto out_qi;
 
   /* Progress - raop_metadata_send() will add rtptime to these */
   rmd->start = 0;
@@ -918,10 +1238,11 @@ raop_metadata_prepare(int id)
 
   free_queue_item(queue_item, 0);
 
+  item_id = id;
+  worker_execute(raop_metadata_prefetch_cb, &item_id, sizeof(item_id), 0, WORKER_PRIO_PLAYER);
+
   return rmd;
 
- out_metadata:
-  evbuffer_free(rmd->metadata);
  out_qi:
   free_queue_item(queue_item, 0);
  out_rmd:
@@ -1814,8 +2135,6 @@ static void
 raop_session_cleanup(struct raop_session *rs)
 {
   struct raop_session *s;
-  struct raop_v2_packet *pkt;
-  struct raop_v2_packet *next_pkt;
 
   if (rs == sessions)
     sessions = sessions->next;
@@ -1835,16 +2154,9 @@ raop_session_cleanup(struct raop_session *rs)
   /* No more active sessions, free retransmit buffer */
   if (!sessions)
     {
-      pkt = pktbuf_head;
-      while (pkt)
-	{
-	  next_pkt = pkt->next;
-	  free(pkt);
-	  pkt = next_pkt;
-	}
+      free(pktbuf);
 
-      pktbuf_head = NULL;
-      pktbuf_tail = NULL;
+      pktbuf = NULL;
       pktbuf_size = 0;
     }
 }
@@ -1952,6 +2264,8 @@ raop_session_make(struct output_device *rd, int family, output_status_cb cb, boo
   rs->password = rd->password;
 
   rs->wants_metadata = re->wants_metadata;
+  rs->compress = re->compress;
+  rs->verified_keep = re->verified_keep;
 
   switch (re->devtype)
     {
@@ -2065,6 +2379,7 @@ raop_session_make(struct output_device *rd, int family, output_status_cb cb, boo
   rs->family = family;
 
   rs->volume = rd->volume;
+  rs->offset = outputs_device_offset(rd);
 
   rs->next = sessions;
   sessions = rs;
@@ -2165,8 +2480,6 @@ static int
 raop_metadata_send_artwork(struct raop_session *rs, struct evbuffer *evbuf, struct raop_metadata *rmd, char *rtptime)
 {
   char *ctype;
-  uint8_t *buf;
-  size_t len;
   int ret;
 
   switch (rmd->artwork_fmt)
@@ -2185,10 +2498,7 @@ raop_metadata_send_artwork(struct raop_session *rs, struct evbuffer *evbuf, stru
 	return -1;
     }
 
-  buf = evbuffer_pullup(rmd->artwork, -1);
-  len = evbuffer_get_length(rmd->artwork);
-
-  ret = evbuffer_add(evbuf, buf, len);
+  ret = raop_blob_add(evbuf, rmd->artwork);
   if (ret != 0)
     {
       DPRINTF(E_LOG, L_RAOP, "Could not copy artwork for sending\n");
@@ -2206,14 +2516,9 @@ raop_metadata_send_artwork(struct raop_session *rs, struct evbuffer *evbuf, stru
 static int
 raop_metadata_send_metadata(struct raop_session *rs, struct evbuffer *evbuf, struct raop_metadata *rmd, char *rtptime)
 {
-  uint8_t *buf;
-  size_t len;
   int ret;
 
-  buf = evbuffer_pullup(rmd->metadata, -1);
-  len = evbuffer_get_length(rmd->metadata);
-
-  ret = evbuffer_add(evbuf, buf, len);
+  ret = raop_blob_add(evbuf, rmd->metadata);
   if (ret != 0)
     {
       DPRINTF(E_LOG, L_RAOP, "Could not copy metadata for sending\n");
@@ -2509,6 +2814,20 @@ raop_set_volume_one(struct output_device *rd, output_status_cb cb)
   return 1;
 }
 
+static void
+raop_set_offset_one(struct output_device *rd)
+{
+  struct raop_session *rs;
+
+  if (!rd->session || !rd->session->session)
+    return;
+
+  rs = rd->session->session;
+
+  // Applied with the next sync packet, i.e. within a second
+  rs->offset = outputs_device_offset(rd);
+}
+
 static void
 raop_cb_flush(struct evrtsp_request *req, void *arg)
 {
@@ -2612,17 +2931,41 @@ raop_device_stop(struct output_session *session);
 static void
 raop_flush_timer_cb(int fd, short what, void *arg)
 {
+  struct timeval tv;
   struct raop_session *rs;
+  time_t now;
+  time_t remaining;
 
   DPRINTF(E_DBG, L_RAOP, "Flush timer expired; tearing down RAOP sessions\n");
 
+  now = time(NULL);
+  remaining = 0;
+
   for (rs = sessions; rs; rs = rs->next)
     {
       if (!(rs->state & RAOP_STATE_F_CONNECTED))
 	continue;
 
+      // Keep verified connections, so the next playback can skip pair-verify
+      if (rs->verified && (flush_start + rs->verified_keep > now))
+	{
+	  if (flush_start + rs->verified_keep - now > remaining)
+	    remaining = flush_start + rs->verified_keep - now;
+
+	  continue;
+	}
+
       raop_device_stop(rs->output_session);
     }
+
+  if (remaining > 0)
+    {
+      DPRINTF(E_DBG, L_RAOP, "Keeping verified RAOP sessions for another %d seconds\n", (int)remaining);
+
+      evutil_timerclear(&tv);
+      tv.tv_sec = remaining;
+      evtimer_add(flush_timer, &tv);
+    }
 }
 
 static void
@@ -2678,6 +3021,8 @@ raop_flush(output_status_cb cb, uint64_t rtptime)
       evutil_timerclear(&tv);
       tv.tv_sec = 10;
       evtimer_add(flush_timer, &tv);
+
+      flush_start = time(NULL);
     }
 
   return pending;
@@ -2969,11 +3314,9 @@ raop_v2_control_send_sync(uint64_t next_pkt, struct timespec *init)
       timespec_to_ntp(init, &cur_stamp);
     }
 
-  cur_pos32 = htobe32(RAOP_RTPTIME(cur_pos));
   cur_stamp.sec = htobe32(cur_stamp.sec);
   cur_stamp.frac = htobe32(cur_stamp.frac);
 
-  memcpy(msg + 4, &cur_pos32, 4);
   memcpy(msg + 8, &cur_stamp.sec, 4);
   memcpy(msg + 12, &cur_stamp.frac, 4);
 
@@ -2982,6 +3325,11 @@ raop_v2_control_send_sync(uint64_t next_pkt, struct timespec *init)
       if (rs->state != RAOP_STATE_STREAMING)
 	continue;
 
+      // The device plays the rtptime we give for the clock stamp at that time,
+      // so telling it that we are further ahead than we are makes it play ahead
+      cur_pos32 = htobe32(RAOP_RTPTIME(cur_pos + rs->offset));
+      memcpy(msg + 4, &cur_pos32, 4);
+
       switch (rs->sa.ss.ss_family)
 	{
 	  case AF_INET:
@@ -3263,76 +3611,47 @@ raop_v2_control_start(int v6enabled)
 
 /* AirTunes v2 streaming */
 static struct raop_v2_packet *
-raop_v2_new_packet(void)
+raop_v2_new_packet(uint16_t seqnum)
 {
-  struct raop_v2_packet *pkt;
-
-  if (pktbuf_size >= RETRANSMIT_BUFFER_SIZE)
+  if (!pktbuf)
     {
-      pktbuf_size--;
-
-      pkt = pktbuf_tail;
-
-      pktbuf_tail = pktbuf_tail->prev;
-      pktbuf_tail->next = NULL;
-    }
-  else
-    {
-      pkt = (struct raop_v2_packet *)malloc(sizeof(struct raop_v2_packet));
-      if (!pkt)
+      pktbuf = calloc(RETRANSMIT_BUFFER_SIZE, sizeof(struct raop_v2_packet));
+      if (!pktbuf)
 	{
-	  DPRINTF(E_LOG, L_RAOP, "Out of memory for RAOP packet\n");
+	  DPRINTF(E_LOG, L_RAOP, "Out of memory for RAOP retransmit buffer\n");
 
 	  return NULL;
 	}
+
+      pktbuf_size = 0;
     }
 
-  return pkt;
+  // When the ring is full the slot holds the oldest packet, which is now gone
+  if (pktbuf_size == RETRANSMIT_BUFFER_SIZE)
+    pktbuf_size--;
+
+  return &pktbuf[seqnum & RETRANSMIT_BUFFER_MASK];
 }
 
-static struct raop_v2_packet *
-raop_v2_make_packet(uint8_t *rawbuf, uint64_t rtptime)
+/* Encrypts len bytes of a packet, except the RTP header and the tail that
+ * does not make up a whole AES block
+ */
+static int
+raop_v2_packet_encrypt(uint8_t *encrypted, uint8_t *clear, int len)
 {
   char ebuf[64];
-  struct raop_v2_packet *pkt;
   gpg_error_t gc_err;
-  uint32_t rtptime32;
-  uint16_t seq;
+  int enclen;
 
-  pkt = raop_v2_new_packet();
-  if (!pkt)
-    return NULL;
-
-  memset(pkt, 0, sizeof(struct raop_v2_packet));
-
-  alac_encode(rawbuf, pkt->clear + AIRTUNES_V2_HDR_LEN, STOB(AIRTUNES_V2_PACKET_SAMPLES));
-
-  stream_seq++;
-
-  pkt->seqnum = stream_seq;
-
-  seq = htobe16(pkt->seqnum);
-  rtptime32 = htobe32(RAOP_RTPTIME(rtptime));
-
-  pkt->clear[0] = 0x80;
-  pkt->clear[1] = (sync_counter == 0) ? 0xe0 : 0x60;
-
-  memcpy(pkt->clear + 2, &seq, 2);
-  memcpy(pkt->clear + 4, &rtptime32, 4);
-
-  /* RTP SSRC ID
-   * Note: should htobe32() that value, but it's just a
-   * random/unique ID so it's no big deal
-   */
-  memcpy(pkt->clear + 8, &ssrc_id, 4);
+  enclen = ((len - AIRTUNES_V2_HDR_LEN) / 16) * 16;
 
   /* Copy AirTunes v2 header to encrypted packet */
-  memcpy(pkt->encrypted, pkt->clear, AIRTUNES_V2_HDR_LEN);
+  memcpy(encrypted, clear, AIRTUNES_V2_HDR_LEN);
 
   /* Copy the tail of the audio packet that is left unencrypted */
-  memcpy(pkt->encrypted + AIRTUNES_V2_PKT_TAIL_OFF,
-	 pkt->clear + AIRTUNES_V2_PKT_TAIL_OFF,
-	 AIRTUNES_V2_PKT_TAIL_LEN);
+  memcpy(encrypted + AIRTUNES_V2_HDR_LEN + enclen,
+	 clear + AIRTUNES_V2_HDR_LEN + enclen,
+	 len - AIRTUNES_V2_HDR_LEN - enclen);
 
   /* Reset cipher */
   gc_err = gcry_cipher_reset(raop_aes_ctx);
@@ -3341,8 +3660,7 @@ raop_v2_make_packet(uint8_t *rawbuf, uint64_t rtptime)
       gpg_strerror_r(gc_err, ebuf, sizeof(ebuf));
       DPRINTF(E_LOG, L_RAOP, "Could not reset AES cipher: %s\n", ebuf);
 
-      free(pkt);
-      return NULL;
+      return -1;
     }
 
   /* Set IV */
@@ -3352,79 +3670,369 @@ raop_v2_make_packet(uint8_t *rawbuf, uint64_t rtptime)
       gpg_strerror_r(gc_err, ebuf, sizeof(ebuf));
       DPRINTF(E_LOG, L_RAOP, "Could not set AES IV: %s\n", ebuf);
 
-      free(pkt);
-      return NULL;
+      return -1;
     }
 
   /* Encrypt in blocks of 16 bytes */
   gc_err = gcry_cipher_encrypt(raop_aes_ctx,
-			       pkt->encrypted + AIRTUNES_V2_HDR_LEN, ((AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_HDR_LEN) / 16) * 16,
-			       pkt->clear + AIRTUNES_V2_HDR_LEN, ((AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_HDR_LEN) / 16) * 16);
+			       encrypted + AIRTUNES_V2_HDR_LEN, enclen,
+			       clear + AIRTUNES_V2_HDR_LEN, enclen);
   if (gc_err != GPG_ERR_NO_ERROR)
     {
       gpg_strerror_r(gc_err, ebuf, sizeof(ebuf));
       DPRINTF(E_LOG, L_RAOP, "Could not encrypt payload: %s\n", ebuf);
 
-      free(pkt);
-      return NULL;
+      return -1;
     }
 
-  pkt->prev = NULL;
-  pkt->next = pktbuf_head;
+  return 0;
+}
 
-  if (pktbuf_head)
-    pktbuf_head->prev = pkt;
+static struct raop_v2_packet *
+raop_v2_make_packet(uint8_t *rawbuf, uint64_t rtptime, bool compress)
+{
+  struct raop_v2_packet *pkt;
+  uint32_t rtptime32;
+  uint16_t seq;
+  int len;
+  int ret;
+
+  stream_seq++;
+
+  pkt = raop_v2_new_packet(stream_seq);
+  if (!pkt)
+    return NULL;
 
-  if (!pktbuf_tail)
-    pktbuf_tail = pkt;
+  memset(pkt, 0, sizeof(struct raop_v2_packet));
 
-  pktbuf_head = pkt;
+  alac_encode(rawbuf, pkt->clear + AIRTUNES_V2_HDR_LEN, STOB(AIRTUNES_V2_PACKET_SAMPLES));
+
+  pkt->seqnum = stream_seq;
+
+  seq = htobe16(pkt->seqnum);
+  rtptime32 = htobe32(RAOP_RTPTIME(rtptime));
+
+  pkt->clear[0] = 0x80;
+  pkt->clear[1] = (sync_counter == 0) ? 0xe0 : 0x60;
+
+  memcpy(pkt->clear + 2, &seq, 2);
+  memcpy(pkt->clear + 4, &rtptime32, 4);
+
+  /* RTP SSRC ID
+   * Note: should htobe32() that value, but it's just a
+   * random/unique ID so it's no big deal
+   */
+  memcpy(pkt->clear + 8, &ssrc_id, 4);
+
+  ret = raop_v2_packet_encrypt(pkt->encrypted, pkt->clear, AIRTUNES_V2_PKT_LEN);
+  if (ret < 0)
+    return NULL;
+
+  if (compress)
+    {
+      len = alac_encode_compressed(pkt->clear_alac + AIRTUNES_V2_HDR_LEN, AIRTUNES_V2_PKT_LEN - AIRTUNES_V2_HDR_LEN, rawbuf, AIRTUNES_V2_PACKET_SAMPLES);
+      if (len > 0)
+	{
+	  pkt->alac_len = AIRTUNES_V2_HDR_LEN + len;
+	  memcpy(pkt->clear_alac, pkt->clear, AIRTUNES_V2_HDR_LEN);
+
+	  ret = raop_v2_packet_encrypt(pkt->encrypted_alac, pkt->clear_alac, pkt->alac_len);
+	  if (ret < 0)
+	    return NULL;
+	}
+    }
+
+  /* If making an earlier packet failed there is a hole before this one, so
+   * the valid range restarts here
+   */
+  if (pktbuf_size > 0 && pkt->seqnum != (uint16_t)(pktbuf_head_seq + 1))
+    pktbuf_size = 0;
 
+  pktbuf_head_seq = pkt->seqnum;
   pktbuf_size++;
 
   return pkt;
 }
 
-static int
+/* Sends a packet to a single session right away, used when there is no shared
+ * transmit socket. Errors are recorded in rs->send_errno and handled by
+ * raop_v2_txq_send(), so the session is never freed here.
+ */
+/* Gets the version of the packet that the session should receive */
+static uint8_t *
+raop_v2_packet_data(struct raop_session *rs, struct raop_v2_packet *pkt, int *len)
+{
+  if (rs->compress && pkt->alac_len > 0)
+    {
+      *len = pkt->alac_len;
+      return (rs->encrypt) ? pkt->encrypted_alac : pkt->clear_alac;
+    }
+
+  *len = AIRTUNES_V2_PKT_LEN;
+  return (rs->encrypt) ? pkt->encrypted : pkt->clear;
+}
+
+static void
 raop_v2_send_packet(struct raop_session *rs, struct raop_v2_packet *pkt)
 {
   uint8_t *data;
+  int len;
   int ret;
 
-  if (!rs)
-    return -1;
+  if (rs->send_errno)
+    return;
 
-  data = (rs->encrypt) ? pkt->encrypted : pkt->clear;
+  data = raop_v2_packet_data(rs, pkt, &len);
 
-  ret = send(rs->server_fd, data, AIRTUNES_V2_PKT_LEN, 0);
+  ret = send(rs->server_fd, data, len, 0);
   if (ret < 0)
+    rs->send_errno = errno;
+  else if (ret != len)
+    DPRINTF(E_WARN, L_RAOP, "Partial send (%d) for '%s'\n", ret, rs->devname);
+}
+
+#ifdef HAVE_SENDMMSG
+static void
+raop_v2_txq_gso_disable(struct raop_v2_txq *txq)
+{
+#ifdef UDP_SEGMENT
+  int size = 0;
+
+  setsockopt(txq->fd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size));
+#endif
+  txq->gso = false;
+}
+
+// Sends a message whose segmentation was refused one packet at a time
+static void
+raop_v2_txq_send_unsegmented(struct raop_v2_txq *txq, struct mmsghdr *msg, struct raop_session *rs)
+{
+  struct msghdr hdr;
+  size_t i;
+  int ret;
+
+  hdr = msg->msg_hdr;
+  hdr.msg_iovlen = 1;
+
+  for (i = 0; i < msg->msg_hdr.msg_iovlen; i++)
+    {
+      hdr.msg_iov = &msg->msg_hdr.msg_iov[i];
+
+      ret = sendmsg(txq->fd, &hdr, 0);
+      if (ret < 0)
+	{
+	  rs->send_errno = errno;
+	  return;
+	}
+    }
+}
+
+/* Sends everything in the queue with as few sendmmsg() calls as possible. A
+ * failed message only marks its session, the rest of the queue still goes out.
+ */
+static void
+raop_v2_txq_flush(struct raop_v2_txq *txq)
+{
+  struct mmsghdr *msg;
+  int sent;
+  int ret;
+
+  sent = 0;
+  while (sent < txq->nmsgs)
+    {
+      ret = sendmmsg(txq->fd, txq->msgs + sent, txq->nmsgs - sent, 0);
+      if (ret > 0)
+	{
+	  sent += ret;
+	  continue;
+	}
+      else if (ret < 0 && errno == EINTR)
+	continue;
+
+      // The message at the head of what is left failed
+      msg = &txq->msgs[sent];
+      if (txq->gso && msg->msg_hdr.msg_iovlen > 1 && (errno == EINVAL || errno == EIO))
+	{
+	  DPRINTF(E_WARN, L_RAOP, "UDP segmentation offload not possible (%s), disabling\n", strerror(errno));
+
+	  raop_v2_txq_gso_disable(txq);
+	  raop_v2_txq_send_unsegmented(txq, msg, txq->rs[sent]);
+	}
+      else if (!txq->rs[sent]->send_errno)
+	txq->rs[sent]->send_errno = (ret < 0) ? errno : EIO;
+
+      sent++;
+    }
+
+  txq->nmsgs = 0;
+  txq->niov = 0;
+}
+#endif
+
+/* Queues a packet for a session. When GSO is possible consecutive full size
+ * packets for the same session share a message, and the kernel splits them
+ * into datagrams. Compressed packets vary in size, so they get a message each.
+ */
+static void
+raop_v2_txq_add(struct raop_session *rs, struct raop_v2_packet *pkt)
+{
+#ifdef HAVE_SENDMMSG
+  struct raop_v2_txq *txq;
+  struct msghdr *hdr;
+  uint8_t *data;
+  int len;
+
+  txq = (rs->sa.ss.ss_family == AF_INET6) ? &txq_6 : &txq_4;
+  if (txq->fd < 0)
+    {
+      raop_v2_send_packet(rs, pkt);
+      return;
+    }
+
+  data = raop_v2_packet_data(rs, pkt, &len);
+
+  if (txq->niov == RAOP_TXQ_IOV_MAX)
+    raop_v2_txq_flush(txq);
+
+  hdr = NULL;
+  if (txq->gso && (len == AIRTUNES_V2_PKT_LEN) && (txq->nmsgs > 0) && (txq->rs[txq->nmsgs - 1] == rs))
+    {
+      hdr = &txq->msgs[txq->nmsgs - 1].msg_hdr;
+      if ((hdr->msg_iovlen >= RAOP_GSO_SEGMENTS_MAX) || (hdr->msg_iov[hdr->msg_iovlen - 1].iov_len != AIRTUNES_V2_PKT_LEN))
+	hdr = NULL;
+    }
+
+  if (!hdr)
     {
-      DPRINTF(E_LOG, L_RAOP, "Send error for '%s': %s\n", rs->devname, strerror(errno));
+      if (txq->nmsgs == RAOP_TXQ_MSGS_MAX)
+	raop_v2_txq_flush(txq);
 
+      hdr = &txq->msgs[txq->nmsgs].msg_hdr;
+      memset(hdr, 0, sizeof(struct msghdr));
+
+      hdr->msg_name = &rs->server_sa;
+      hdr->msg_namelen = rs->server_salen;
+      hdr->msg_iov = &txq->iov[txq->niov];
+
+      txq->rs[txq->nmsgs] = rs;
+      txq->nmsgs++;
+    }
+
+  txq->iov[txq->niov].iov_base = data;
+  txq->iov[txq->niov].iov_len = len;
+  txq->niov++;
+
+  hdr->msg_iovlen++;
+#else
+  raop_v2_send_packet(rs, pkt);
+#endif
+}
+
+/* Sends what is queued and fails the sessions that had send errors. Sessions
+ * may be freed, so callers must not hold on to session pointers across this.
+ */
+static void
+raop_v2_txq_send(void)
+{
+  struct raop_session *rs;
+  struct raop_session *next;
+
+#ifdef HAVE_SENDMMSG
+  raop_v2_txq_flush(&txq_4);
+  raop_v2_txq_flush(&txq_6);
+#endif
+
+  for (rs = sessions; rs; rs = next)
+    {
+      // raop_session_failure frees rs, so save rs->next now
+      next = rs->next;
+
+      if (!rs->send_errno)
+	continue;
+
+      DPRINTF(E_LOG, L_RAOP, "Send error for '%s': %s\n", rs->devname, strerror(rs->send_errno));
+
+      rs->send_errno = 0;
       raop_session_failure(rs);
-      return -1;
     }
-  else if (ret != AIRTUNES_V2_PKT_LEN)
+}
+
+static int
+raop_v2_txq_open(struct raop_v2_txq *txq, int family)
+{
+#ifdef HAVE_SENDMMSG
+# ifdef UDP_SEGMENT
+  int size;
+  int ret;
+# endif
+
+  txq->nmsgs = 0;
+  txq->niov = 0;
+  txq->gso = false;
+
+# ifdef SOCK_CLOEXEC
+  txq->fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+# else
+  txq->fd = socket(family, SOCK_DGRAM, 0);
+# endif
+  if (txq->fd < 0)
     {
-      DPRINTF(E_WARN, L_RAOP, "Partial send (%d) for '%s'\n", ret, rs->devname);
+      DPRINTF(E_WARN, L_RAOP, "Could not create shared streaming socket, will send per device: %s\n", strerror(errno));
       return -1;
     }
 
+# ifdef UDP_SEGMENT
+  size = AIRTUNES_V2_PKT_LEN;
+  ret = setsockopt(txq->fd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size));
+  if (ret == 0)
+    txq->gso = true;
+  else
+    DPRINTF(E_DBG, L_RAOP, "UDP segmentation offload not available: %s\n", strerror(errno));
+# endif
+
   return 0;
+#else
+  txq->fd = -1;
+
+  return -1;
+#endif
+}
+
+static void
+raop_v2_txq_close(struct raop_v2_txq *txq)
+{
+  if (txq->fd >= 0)
+    close(txq->fd);
+
+  txq->fd = -1;
 }
 
 // Forward
 static void
 raop_playback_stop(void);
 
+// Compressed packets are only made if a session will use them
+static bool
+raop_v2_compress_wanted(void)
+{
+  struct raop_session *rs;
+
+  for (rs = sessions; rs; rs = rs->next)
+    {
+      if (rs->compress && (rs->state == RAOP_STATE_STREAMING))
+	return true;
+    }
+
+  return false;
+}
+
 static void
 raop_v2_write(uint8_t *buf, uint64_t rtptime)
 {
   struct raop_v2_packet *pkt;
   struct raop_session *rs;
-  struct raop_session *next;
 
-  pkt = raop_v2_make_packet(buf, rtptime);
+  pkt = raop_v2_make_packet(buf, rtptime, raop_v2_compress_wanted());
   if (!pkt)
     {
       raop_playback_stop();
@@ -3441,79 +4049,92 @@ raop_v2_write(uint8_t *buf, uint64_t rtptime)
   else
     sync_counter++;
 
-  for (rs = sessions; rs; rs = next)
+  for (rs = sessions; rs; rs = rs->next)
     {
-      // raop_v2_send_packet may free rs on failure, so save rs->next now
-      next = rs->next;
-
       if (rs->state != RAOP_STATE_STREAMING)
 	continue;
 
-      raop_v2_send_packet(rs, pkt);
+      raop_v2_txq_add(rs, pkt);
     }
 
-  return;
+  raop_v2_txq_send();
 }
 
+// Same as raop_v2_write, except all the packets are made before they are sent,
+// so the whole batch for all sessions goes out in as few syscalls as possible
 static void
-raop_v2_resend_range(struct raop_session *rs, uint16_t seqnum, uint16_t len)
+raop_v2_write_batch(uint8_t *buf, uint64_t rtptime, int npackets)
 {
-  struct raop_v2_packet *pktbuf;
-  int ret;
-  uint16_t distance;
+  struct raop_v2_packet *pkts[OUTPUTS_BATCH_PACKETS_MAX];
+  struct raop_session *rs;
+  bool compress;
+  int i;
 
-  /* Check that seqnum is in the retransmit buffer */
-  if ((seqnum > pktbuf_head->seqnum) || (seqnum < pktbuf_tail->seqnum))
-    {
-      DPRINTF(E_WARN, L_RAOP, "Device '%s' asking for seqnum %" PRIu16 "; not in buffer (h %" PRIu16 " t %" PRIu16 ")\n", rs->devname, seqnum, pktbuf_head->seqnum, pktbuf_tail->seqnum);
-      return;
-    }
+  compress = raop_v2_compress_wanted();
 
-  if (seqnum > pktbuf_head->seqnum)
+  for (i = 0; i < npackets; i++)
     {
-      distance = seqnum - pktbuf_tail->seqnum;
+      pkts[i] = raop_v2_make_packet(buf + i * STOB(AIRTUNES_V2_PACKET_SAMPLES), rtptime + i * AIRTUNES_V2_PACKET_SAMPLES, compress);
+      if (!pkts[i])
+	{
+	  raop_playback_stop();
+
+	  return;
+	}
 
-      if (distance > (RETRANSMIT_BUFFER_SIZE / 2))
-	pktbuf = pktbuf_head;
+      if (sync_counter == 126)
+	{
+	  raop_v2_control_send_sync(rtptime + i * AIRTUNES_V2_PACKET_SAMPLES, NULL);
+
+	  sync_counter = 1;
+	}
       else
-	pktbuf = pktbuf_tail;
+	sync_counter++;
     }
-  else
+
+  for (rs = sessions; rs; rs = rs->next)
     {
-      distance = pktbuf_head->seqnum - seqnum;
+      if (rs->state != RAOP_STATE_STREAMING)
+	continue;
 
-      if (distance > (RETRANSMIT_BUFFER_SIZE / 2))
-	pktbuf = pktbuf_tail;
-      else
-	pktbuf = pktbuf_head;
+      for (i = 0; i < npackets; i++)
+	raop_v2_txq_add(rs, pkts[i]);
     }
 
-  if (pktbuf == pktbuf_head)
+  raop_v2_txq_send();
+}
+
+static void
+raop_v2_resend_range(struct raop_session *rs, uint16_t seqnum, uint16_t len)
+{
+  uint16_t distance;
+  uint16_t i;
+
+  /* Check that seqnum is in the retransmit buffer, distance is how far behind
+   * the newest packet it is (wraps like the seqnums themselves)
+   */
+  distance = pktbuf_head_seq - seqnum;
+  if (!pktbuf || (distance >= pktbuf_size))
     {
-      while (pktbuf && seqnum != pktbuf->seqnum)
-	pktbuf = pktbuf->next;
+      DPRINTF(E_WARN, L_RAOP, "Device '%s' asking for seqnum %" PRIu16 "; not in buffer (h %" PRIu16 " t %" PRIu16 ")\n",
+	      rs->devname, seqnum, pktbuf_head_seq, (uint16_t)(pktbuf_head_seq - pktbuf_size + 1));
+      metrics_counter_add(raop_metric_resend_misses, len);
+      return;
     }
-  else
+
+  if (len > distance + 1)
     {
-      while (pktbuf && seqnum != pktbuf->seqnum)
-	pktbuf = pktbuf->prev;
+      DPRINTF(E_LOG, L_RAOP, "WARNING: retransmission of %" PRIu16 " packets requested, only %d available\n", len, distance + 1);
+      metrics_counter_add(raop_metric_resend_misses, len - (distance + 1));
+      len = distance + 1;
     }
 
-  while (len && pktbuf)
-    {
-      ret = raop_v2_send_packet(rs, pktbuf);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_RAOP, "Error retransmit packet, aborting retransmission\n");
-	  return;
-	}
+  metrics_counter_add(raop_metric_resends, len);
 
-      pktbuf = pktbuf->prev;
-      len--;
-    }
+  for (i = 0; i < len; i++)
+    raop_v2_txq_add(rs, &pktbuf[(uint16_t)(seqnum + i) & RETRANSMIT_BUFFER_MASK]);
 
-  if (len != 0)
-    DPRINTF(E_LOG, L_RAOP, "WARNING: len non-zero at end of retransmission\n");
+  raop_v2_txq_send();
 }
 
 static int
@@ -3551,6 +4172,9 @@ raop_v2_stream_open(struct raop_session *rs)
 	goto out_fail;
     }
 
+  memcpy(&rs->server_sa, &rs->sa, sizeof(rs->server_sa));
+  rs->server_salen = len;
+
   ret = connect(rs->server_fd, &rs->sa.sa, len);
   if (ret < 0)
     {
@@ -3588,6 +4212,10 @@ raop_startup_cancel(struct raop_session *rs)
     raop_session_failure(rs);
 }
 
+/* The reply to the startup volume comes after our user was told that the
+ * session is ready, so like for metadata there is no status_cb call unless the
+ * request failed.
+ */
 static void
 raop_cb_startup_volume(struct evrtsp_request *req, void *arg)
 {
@@ -3597,39 +4225,26 @@ raop_cb_startup_volume(struct evrtsp_request *req, void *arg)
   rs->reqs_in_flight--;
 
   if (!req)
-    goto cleanup;
+    goto error;
 
   if (req->response_code != RTSP_OK)
     {
       DPRINTF(E_LOG, L_RAOP, "SET_PARAMETER request failed for startup volume: %d %s\n", req->response_code, req->response_code_line);
 
-      goto cleanup;
+      goto error;
     }
 
   ret = raop_check_cseq(rs, req);
   if (ret < 0)
-    goto cleanup;
-
-  raop_metadata_startup_send(rs);
-
-  ret = raop_v2_stream_open(rs);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_RAOP, "Could not open streaming socket\n");
-
-      goto cleanup;
-    }
-
-  /* Session startup and setup is done, tell our user */
-  raop_status(rs);
+    goto error;
 
   if (!rs->reqs_in_flight)
     evrtsp_connection_set_closecb(rs->ctrl, raop_rtsp_close_cb, rs);
 
   return;
 
- cleanup:
-  raop_startup_cancel(rs);
+ error:
+  raop_session_failure(rs);
 }
 
 static void
@@ -3664,8 +4279,26 @@ raop_cb_startup_record(struct evrtsp_request *req, void *arg)
 
   rs->state = RAOP_STATE_RECORD;
 
-  /* Set initial volume */
-  raop_set_volume_internal(rs, rs->volume, raop_cb_startup_volume);
+  /* Set initial volume. We don't wait for the reply before streaming, since
+   * that would add a round trip to the startup of every device, and the
+   * device will have the volume long before the first audio is played.
+   */
+  ret = raop_set_volume_internal(rs, rs->volume, raop_cb_startup_volume);
+  if (ret < 0)
+    goto cleanup;
+
+  raop_metadata_startup_send(rs);
+
+  ret = raop_v2_stream_open(rs);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_RAOP, "Could not open streaming socket\n");
+
+      goto cleanup;
+    }
+
+  /* Session startup and setup is done, tell our user */
+  raop_status(rs);
 
   return;
 
@@ -4159,6 +4792,10 @@ raop_cb_verification_verify_step2(struct evrtsp_request *req, void *arg)
 
   DPRINTF(E_INFO, L_RAOP, "Verification of '%s' completed succesfully\n", rs->devname);
 
+  // The verified connection is worth keeping, so make sure it doesn't time out
+  rs->verified = 1;
+  rs->keep_alive = 1;
+
   rs->state = RAOP_STATE_STARTUP;
 
   raop_send_req_options(rs, raop_cb_startup_options);
@@ -4560,6 +5197,13 @@ raop_device_cb(const char *name, const char *type, const char *domain, const cha
   else
     re->wants_metadata = 0;
 
+  /* Compressed ALAC, costs some CPU but saves about half the bandwidth */
+  re->compress = (airplay && cfg_getbool(airplay, "alac_compression"));
+
+  re->verified_keep = airplay ? cfg_getint(airplay, "verified_keep_seconds") : RAOP_VERIFIED_KEEP_SECONDS;
+  if (re->verified_keep < 0)
+    re->verified_keep = 0;
+
   rd->advertised = 1;
 
   switch (family)
@@ -4583,6 +5227,8 @@ raop_device_cb(const char *name, const char *type, const char *domain, const cha
 	goto free_rd;
     }
 
+  outputs_device_mdns_set(rd, name, txt);
+
   ret = player_device_add(rd);
   if (ret < 0)
     goto free_rd;
@@ -4735,6 +5381,9 @@ raop_init(void)
   int family;
   int ret;
 
+  raop_metric_resends = metrics_register("forked_daapd_output_resent_packets_total", "output=\"AirPlay\"", METRICS_COUNTER, "Packets sent again because a device asked for them");
+  raop_metric_resend_misses = metrics_register("forked_daapd_output_resend_misses_total", "output=\"AirPlay\"", METRICS_COUNTER, "Packets a device asked for that were no longer buffered");
+
   timing_4svc.fd = -1;
   timing_4svc.port = 0;
 
@@ -4747,15 +5396,19 @@ raop_init(void)
   control_6svc.fd = -1;
   control_6svc.port = 0;
 
+  txq_4.fd = -1;
+  txq_6.fd = -1;
+
   sessions = NULL;
 
+  pktbuf = NULL;
   pktbuf_size = 0;
-  pktbuf_head = NULL;
-  pktbuf_tail = NULL;
 
   metadata_head = NULL;
   metadata_tail = NULL;
 
+  CHECK_ERR(L_RAOP, pthread_mutex_init(&metadata_lck, NULL));
+
   /* Generate RTP SSRC ID from library name */
   libname = cfg_getstr(cfg_getsec(cfg, "library"), "name");
   ssrc_id = djb_hash(libname, strlen(libname));
@@ -4843,6 +5496,11 @@ raop_init(void)
   if (v6enabled)
     v6enabled = !((timing_6svc.fd < 0) || (control_6svc.fd < 0));
 
+  // Not fatal, without them each session sends on its own socket
+  raop_v2_txq_open(&txq_4, AF_INET);
+  if (v6enabled)
+    raop_v2_txq_open(&txq_6, AF_INET6);
+
   if (v6enabled)
     family = AF_UNSPEC;
   else
@@ -4853,13 +5511,16 @@ raop_init(void)
     {
       DPRINTF(E_LOG, L_RAOP, "Could not add mDNS browser for AirPlay devices\n");
 
-      goto out_stop_control;
+      goto out_close_txq;
     }
 
+  outputs_device_restore(OUTPUT_TYPE_RAOP, "_raop._tcp", family, raop_device_cb);
 
   return 0;
 
- out_stop_control:
+ out_close_txq:
+  raop_v2_txq_close(&txq_4);
+  raop_v2_txq_close(&txq_6);
   raop_v2_control_stop();
  out_stop_timing:
   raop_v2_timing_stop();
@@ -4888,9 +5549,14 @@ raop_deinit(void)
       raop_session_free(rs);
     }
 
+  raop_v2_txq_close(&txq_4);
+  raop_v2_txq_close(&txq_6);
+
   raop_v2_control_stop();
   raop_v2_timing_stop();
 
+  raop_metadata_cache_purge();
+
   event_free(flush_timer);
   event_free(keep_alive_timer);
 
@@ -4913,9 +5579,11 @@ struct output_definition output_raop =
   .device_probe = raop_device_probe,
   .device_free_extra = raop_device_free_extra,
   .device_volume_set = raop_set_volume_one,
+  .device_offset_set = raop_set_offset_one,
   .playback_start = raop_playback_start,
   .playback_stop = raop_playback_stop,
   .write = raop_v2_write,
+  .write_batch = raop_v2_write_batch,
   .flush = raop_flush,
   .status_cb = raop_set_status_cb,
   .metadata_prepare = raop_metadata_prepare,
@@ -84,6 +84,7 @@
 #include "db.h"
 #include "logger.h"
 #include "conffile.h"
+#include "metrics.h"
 #include "misc.h"
 #include "player.h"
 #include "worker.h"
@@ -111,8 +112,8 @@
 
 // Default volume (must be from 0 - 100)
 #define PLAYER_DEFAULT_VOLUME 50
-// For every tick_interval, we will read a packet from the input buffer and
-// write it to the outputs. If the input is empty, we will try to catch up next
+// For every tick_interval, we will read packets from the input buffer and
+// write them to the outputs. If the input is empty, we will try to catch up next
 // tick. However, at some point we will owe the outputs so much data that we
 // have to suspend playback and wait for the input to get its act together.
 // (value is in milliseconds and should be low enough to avoid output underrun)
@@ -123,12 +124,28 @@
 // gets above this value, we will suspend playback and reset the output.
 // (value is in milliseconds)
 #define PLAYER_WRITE_BEHIND_MAX 1500
+// When none of the active outputs are low latency outputs, the playback timer
+// will only tick for every PLAYER_BATCH_PACKETS packets, and the packets are
+// then written to the outputs in one go. Must not exceed OUTPUTS_BATCH_PACKETS_MAX.
+#define PLAYER_BATCH_PACKETS 8
+
+// Number of upcoming queue items kept in the lookahead window
+#define PLAYER_LOOKAHEAD_ITEMS 4
+
+// Volume changes are notified to listeners at most this often, so that
+// dragging a volume slider doesn't flood the clients with updates
+#define PLAYER_VOLUME_NOTIFY_MSEC 100
 
 struct volume_param {
   int volume;
   uint64_t spk_id;
 };
 
+struct offset_param {
+  int offset_ms;
+  uint64_t spk_id;
+};
+
 struct spk_enum
 {
   spk_enum_cb cb;
@@ -147,6 +164,23 @@ struct metadata_param
   struct output_metadata *output;
 };
 
+// The queue items that follow item_id, so source_next() can do without queue
+// queries when switching tracks. Only valid while the queue revision and the
+// shuffle mode are those it was filled with.
+struct player_lookahead
+{
+  bool valid;
+  uint32_t item_id;
+  unsigned int queue_revision;
+  char shuffle;
+
+  // True if the window holds all the remaining items of the queue
+  bool end;
+
+  int count;
+  struct player_source *items[PLAYER_LOOKAHEAD_ITEMS];
+};
+
 struct speaker_auth_param
 {
   enum output_types type;
@@ -174,6 +208,7 @@ static int player_flush_pending;
 // Config values
 static int speaker_autoselect;
 static int clear_queue_on_stop_disabled;
+static int preroll_ms;
 
 // Player status
 static enum play_status player_state;
@@ -191,8 +226,11 @@ static struct event *pb_timer_ev;
 static struct timespec pb_timer_last;
 static struct timespec packet_timer_last;
 
-// How often the playback timer triggers playback_cb()
+// How often the playback timer triggers playback_cb(), tick_interval is set to
+// one of the two others depending on whether a low latency output is active
 static struct timespec tick_interval;
+static struct timespec tick_interval_low_latency;
+static struct timespec tick_interval_batch;
 // Timer resolution
 static struct timespec timer_res;
 // Time between two packets
@@ -208,6 +246,11 @@ static int pb_write_deficit_max;
 // True if we are trying to recover from a major playback timer overrun (write problems)
 static bool pb_write_recovery;
 
+// Playback timing statistics
+static struct player_stats pb_stats;
+static const uint32_t pb_stats_lateness_bound_ms[PLAYER_STATS_LATENESS_BUCKETS] = { 1, 2, 5, 10, 20, 50, 100, 0 };
+static struct metrics_metric *pb_metric_lateness;
+
 // Sync values
 static struct timespec pb_pos_stamp;
 static uint64_t pb_pos;
@@ -227,16 +270,49 @@ static int master_volume;
 // Audio source
 static struct player_source *cur_playing;
 static struct player_source *cur_streaming;
+static struct player_source *cur_preroll;
+static struct player_lookahead lookahead;
+static struct event *lookahead_ev;
+static struct event *volume_notify_ev;
+static struct timeval volume_notify_wait = { 0, PLAYER_VOLUME_NOTIFY_MSEC * 1000 };
 static uint32_t cur_plid;
 static uint32_t cur_plversion;
 
-// Player buffer (holds one packet)
-static uint8_t pb_buffer[STOB(AIRTUNES_V2_PACKET_SAMPLES)];
+// Player buffer (holds the packets that will be written to the outputs at the
+// end of the tick, and possibly a partial packet)
+static uint8_t pb_buffer[OUTPUTS_BATCH_PACKETS_MAX * STOB(AIRTUNES_V2_PACKET_SAMPLES)];
 static size_t pb_buffer_offset;
 
 // Play history
 static struct player_history *history;
 
+// Output metadata for the next item, prepared by metadata_prefetch_cb() in a
+// worker thread while the current item is still playing
+static pthread_mutex_t metadata_prepared_lck = PTHREAD_MUTEX_INITIALIZER;
+static struct output_metadata *metadata_prepared;
+static uint32_t metadata_prepared_item_id;
+
+// Copy of the player status that other threads read without a round trip to
+// the player thread, see status_snapshot_update() and player_get_status().
+// Published with a sequence lock: the sequence number is odd while the player
+// thread is writing, and 0 until the first publication.
+struct status_snapshot_key
+{
+  enum play_status state;
+  struct player_source *playing;
+  struct player_source *streaming;
+  int volume;
+  enum repeat_mode repeat;
+  char shuffle;
+  char consume;
+  uint32_t plid;
+};
+
+static struct player_status status_snapshot;
+static struct timespec status_snapshot_ts;
+static struct status_snapshot_key status_snapshot_key;
+static unsigned int status_snapshot_seq;
+
 
 /* -------------------------------- Forwards -------------------------------- */
 
@@ -246,6 +322,12 @@ playback_abort(void);
 static void
 playback_suspend(void);
 
+static void
+playback_timer_adjust(void);
+
+static void
+status_snapshot_update(bool force);
+
 
 /* ----------------------------- Volume helpers ----------------------------- */
 
@@ -288,6 +370,8 @@ volume_master_update(int newvol)
       if (device->selected)
 	device->relvol = vol_to_rel(device->volume);
     }
+
+  status_snapshot_update(true);
 }
 
 static void
@@ -358,6 +442,51 @@ scrobble_cb(void *arg)
 }
 #endif
 
+// Callback from a worker thread, prepares the output metadata (mainly the
+// artwork) for an item that will play next
+static void
+metadata_prefetch_cb(void *arg)
+{
+  uint32_t *item_id = arg;
+  struct output_metadata *o_metadata;
+  bool prepared;
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_lock(&metadata_prepared_lck));
+  prepared = (metadata_prepared_item_id == *item_id);
+  CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&metadata_prepared_lck));
+
+  if (prepared)
+    return;
+
+  o_metadata = outputs_metadata_prepare(*item_id);
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_lock(&metadata_prepared_lck));
+  if (metadata_prepared)
+    outputs_metadata_free(metadata_prepared);
+  metadata_prepared = o_metadata;
+  metadata_prepared_item_id = *item_id;
+  CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&metadata_prepared_lck));
+}
+
+// Returns the metadata metadata_prefetch_cb() prepared for the item, if any,
+// caller takes ownership
+static struct output_metadata *
+metadata_prepared_take(uint32_t item_id)
+{
+  struct output_metadata *o_metadata = NULL;
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_lock(&metadata_prepared_lck));
+  if (metadata_prepared_item_id == item_id)
+    {
+      o_metadata = metadata_prepared;
+      metadata_prepared = NULL;
+      metadata_prepared_item_id = 0;
+    }
+  CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&metadata_prepared_lck));
+
+  return o_metadata;
+}
+
 // Callback from the worker thread. Here the heavy lifting is done: updating the
 // db_queue_item, retrieving artwork (through outputs_metadata_prepare) and
 // when done, telling the player to send the metadata to the clients
@@ -367,6 +496,7 @@ metadata_update_cb(void *arg)
   struct input_metadata *metadata = arg;
   struct output_metadata *o_metadata;
   struct db_queue_item *queue_item;
+  bool changed;
   int ret;
 
   queue_item = db_queue_fetch_byitemid(metadata->item_id);
@@ -377,7 +507,8 @@ metadata_update_cb(void *arg)
     }
 
   // Update queue item if metadata changed
-  if (metadata->artist || metadata->title || metadata->album || metadata->genre || metadata->artwork_url || metadata->song_length)
+  changed = (metadata->artist || metadata->title || metadata->album || metadata->genre || metadata->artwork_url || metadata->song_length);
+  if (changed)
     {
       // Since we won't be using the metadata struct values for anything else than
       // this we just swap pointers
@@ -402,7 +533,16 @@ metadata_update_cb(void *arg)
 	}
     }
 
-  o_metadata = outputs_metadata_prepare(metadata->item_id);
+  // What metadata_prefetch_cb() prepared is only good if nothing changed
+  o_metadata = metadata_prepared_take(metadata->item_id);
+  if (o_metadata && changed)
+    {
+      outputs_metadata_free(o_metadata);
+      o_metadata = NULL;
+    }
+
+  if (!o_metadata)
+    o_metadata = outputs_metadata_prepare(metadata->item_id);
 
   // Actual sending must be done by player, since the worker does not own the outputs
   player_metadata_send(metadata, o_metadata);
@@ -428,7 +568,7 @@ metadata_trigger(int startup)
   if (ret < 0)
     return;
 
-  worker_execute(metadata_update_cb, &metadata, sizeof(metadata), 0);
+  worker_execute(metadata_update_cb, &metadata, sizeof(metadata), 0, WORKER_PRIO_PLAYER);
 }
 
 /*
@@ -480,6 +620,8 @@ status_update(enum play_status status)
 {
   player_state = status;
 
+  status_snapshot_update(true);
+
   listener_notify(LISTENER_PLAYER);
 }
 
@@ -502,6 +644,7 @@ static struct player_source *
 source_new(struct db_queue_item *queue_item)
 {
   struct player_source *ps;
+  struct media_file_info *mfi;
 
   ps = calloc(1, sizeof(struct player_source));
   if (!ps)
@@ -518,6 +661,18 @@ source_new(struct db_queue_item *queue_item)
   ps->play_next = NULL;
   ps->path = strdup(queue_item->path);
 
+  // Lets the input skip probing the file, see transcode_source_params
+  if (ps->data_kind == DATA_KIND_FILE && ps->id > 0)
+    {
+      mfi = db_file_fetch_byid(ps->id);
+      if (mfi)
+	{
+	  ps->samplerate = mfi->samplerate;
+	  ps->bits_per_sample = mfi->bits_per_sample;
+	  free_mfi(mfi, 0);
+	}
+    }
+
   return ps;
 }
 
@@ -530,6 +685,175 @@ source_free(struct player_source *ps)
   free(ps);
 }
 
+static struct player_source *
+source_dup(struct player_source *ps)
+{
+  struct player_source *new;
+
+  new = malloc(sizeof(struct player_source));
+  if (!new)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Out of memory (ps)\n");
+      return NULL;
+    }
+
+  memcpy(new, ps, sizeof(struct player_source));
+  new->path = strdup(ps->path);
+
+  return new;
+}
+
+static void
+lookahead_clear(void)
+{
+  int i;
+
+  for (i = 0; i < lookahead.count; i++)
+    source_free(lookahead.items[i]);
+
+  memset(&lookahead, 0, sizeof(struct player_lookahead));
+}
+
+/*
+ * Fills the lookahead window with the items that follow the current streaming
+ * source and has the metadata of the first one prepared. Runs from its own
+ * event, so the queries are not made while the player is switching tracks.
+ */
+static void
+lookahead_fill(void)
+{
+  struct db_queue_item *queue_item;
+  struct player_source *ps;
+  uint32_t item_id;
+
+  lookahead_clear();
+
+  if (!cur_streaming)
+    return;
+
+  lookahead.item_id = cur_streaming->item_id;
+  lookahead.queue_revision = db_queue_revision_get();
+  lookahead.shuffle = shuffle;
+
+  item_id = lookahead.item_id;
+  while (lookahead.count < PLAYER_LOOKAHEAD_ITEMS)
+    {
+      queue_item = db_queue_fetch_next(item_id, shuffle);
+      if (!queue_item)
+	{
+	  lookahead.end = true;
+	  break;
+	}
+
+      ps = source_new(queue_item);
+      free_queue_item(queue_item, 0);
+      if (!ps)
+	{
+	  lookahead_clear();
+	  return;
+	}
+
+      lookahead.items[lookahead.count] = ps;
+      lookahead.count++;
+
+      item_id = ps->item_id;
+    }
+
+  lookahead.valid = true;
+
+  if (lookahead.count > 0)
+    worker_execute(metadata_prefetch_cb, &lookahead.items[0]->item_id, sizeof(uint32_t), 0, WORKER_PRIO_BACKGROUND);
+}
+
+static void
+lookahead_refill(void)
+{
+  event_active(lookahead_ev, 0, 0);
+}
+
+static void
+lookahead_cb(int fd, short what, void *arg)
+{
+  lookahead_fill();
+}
+
+// Thread: player (the listener is added with evbase_player)
+static void
+lookahead_queue_cb(short event_mask)
+{
+  lookahead_fill();
+}
+
+/*
+ * Gets the item after the current streaming source from the lookahead window.
+ * If the streaming source is one of the items in the window, the items up to it
+ * are dropped and a refill is scheduled.
+ *
+ * @out ps   New player source, NULL if the queue ends after the current item
+ * @return   0 if the window had the answer, -1 if the queue must be queried
+ */
+static int
+lookahead_next(struct player_source **ps)
+{
+  int n;
+  int i;
+
+  *ps = NULL;
+
+  if (!lookahead.valid || (lookahead.shuffle != shuffle) || (lookahead.queue_revision != db_queue_revision_get()))
+    {
+      lookahead_refill();
+      return -1;
+    }
+
+  if (lookahead.item_id != cur_streaming->item_id)
+    {
+      for (i = 0; i < lookahead.count; i++)
+	{
+	  if (lookahead.items[i]->item_id == cur_streaming->item_id)
+	    break;
+	}
+
+      lookahead_refill();
+
+      if (i == lookahead.count)
+	return -1;
+
+      // Drop the items up to and including the new streaming source
+      n = i + 1;
+      for (i = 0; i < n; i++)
+	source_free(lookahead.items[i]);
+
+      lookahead.count -= n;
+      memmove(lookahead.items, lookahead.items + n, lookahead.count * sizeof(struct player_source *));
+      lookahead.item_id = cur_streaming->item_id;
+    }
+
+  if (lookahead.count == 0)
+    return lookahead.end ? 0 : -1;
+
+  *ps = source_dup(lookahead.items[0]);
+  if (!*ps)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Stops pre-rolling of the next item and frees the pre-rolled source
+ */
+static void
+source_preroll_stop(void)
+{
+  if (!cur_preroll)
+    return;
+
+  input_preroll_stop();
+
+  source_free(cur_preroll);
+  cur_preroll = NULL;
+}
+
 /*
  * Stops playback for the current streaming source and frees all
  * player sources (starting from the playing source). Sets current streaming
@@ -541,6 +865,8 @@ source_stop()
   struct player_source *ps_playing;
   struct player_source *ps_temp;
 
+  source_preroll_stop();
+
   if (cur_streaming)
     input_stop(cur_streaming);
 
@@ -580,6 +906,8 @@ source_pause(uint64_t pos)
   if (!ps_playing)
     return -1;
 
+  source_preroll_stop();
+
   if (cur_streaming && (cur_streaming == ps_playing))
     {
       if (ps_playing != cur_streaming)
@@ -798,9 +1126,9 @@ source_check(void)
       i++;
 
       id = (int)cur_playing->id;
-      worker_execute(playcount_inc_cb, &id, sizeof(int), 5);
+      worker_execute(playcount_inc_cb, &id, sizeof(int), 5, WORKER_PRIO_NORMAL);
 #ifdef LASTFM
-      worker_execute(scrobble_cb, &id, sizeof(int), 8);
+      worker_execute(scrobble_cb, &id, sizeof(int), 8, WORKER_PRIO_BACKGROUND);
 #endif
       history_add(cur_playing->id, cur_playing->item_id);
 
@@ -843,6 +1171,7 @@ source_next()
 {
   struct player_source *ps = NULL;
   struct db_queue_item *queue_item;
+  int ret;
 
   if (!cur_streaming)
     {
@@ -861,6 +1190,16 @@ source_next()
     }
   else
     {
+      // At the end of the queue with repeat all the queue must be queried
+      ret = lookahead_next(&ps);
+      if (ret == 0 && (ps || repeat != REPEAT_ALL))
+	{
+	  if (!ps)
+	    DPRINTF(E_DBG, L_PLAYER, "Reached end of queue\n");
+
+	  return ps;
+	}
+
       queue_item = db_queue_fetch_next(cur_streaming->item_id, shuffle);
       if (!queue_item && repeat == REPEAT_ALL)
 	{
@@ -914,6 +1253,122 @@ source_prev()
   return ps;
 }
 
+/*
+ * Starts pre-rolling the next item in the queue when the current streaming
+ * source is close to its end, so that the track switch in source_read() does
+ * not have to wait for the next item to be opened. Only done for files, since
+ * they have a known length and are safe to open ahead of time.
+ */
+static void
+source_preroll(void)
+{
+  struct player_source *ps;
+  struct db_queue_item *queue_item;
+  uint64_t pos_ms;
+  int ret;
+
+  if (!preroll_ms || cur_preroll || !cur_streaming || cur_streaming->preroll_checked)
+    return;
+
+  if ((cur_streaming->data_kind != DATA_KIND_FILE) || (cur_streaming->len_ms == 0) || (last_rtptime < cur_streaming->stream_start))
+    return;
+
+  pos_ms = ((last_rtptime - cur_streaming->stream_start) * 1000) / 44100;
+  if (pos_ms + preroll_ms < cur_streaming->len_ms)
+    return;
+
+  cur_streaming->preroll_checked = 1;
+
+  // If we are at the end of the queue, source_next() would reshuffle it, which
+  // must wait until the actual switch
+  if (shuffle && (repeat == REPEAT_ALL))
+    {
+      queue_item = db_queue_fetch_next(cur_streaming->item_id, shuffle);
+      if (!queue_item)
+	return;
+
+      free_queue_item(queue_item, 0);
+    }
+
+  ps = source_next();
+  if (!ps)
+    return;
+
+  if (ps->data_kind != DATA_KIND_FILE)
+    {
+      source_free(ps);
+      return;
+    }
+
+  ret = input_preroll_start(ps);
+  if (ret < 0)
+    {
+      source_free(ps);
+      return;
+    }
+
+  cur_preroll = ps;
+}
+
+/*
+ * Switches to the pre-rolled source, if it is (still) the next item in the
+ * queue. Must only be called when the current streaming source is at EOF.
+ *
+ * @param end_pos End position of the current streaming source
+ * @return 0 if switched, -1 if the caller must open the next item itself
+ */
+static int
+source_preroll_switch(uint64_t end_pos)
+{
+  struct player_source *ps;
+  int ret;
+
+  if (!cur_preroll)
+    return -1;
+
+  // The queue or the repeat/shuffle mode may have changed since pre-roll began
+  ps = source_next();
+  if (!ps || (ps->item_id != cur_preroll->item_id))
+    {
+      DPRINTF(E_DBG, L_PLAYER, "Next item changed, discarding pre-rolled '%s'\n", cur_preroll->path);
+
+      if (ps)
+	source_free(ps);
+
+      source_preroll_stop();
+      return -1;
+    }
+
+  source_free(ps);
+
+  ps = cur_preroll;
+  cur_preroll = NULL;
+
+  ret = input_preroll_switch(cur_streaming, ps);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Failed to open '%s' (id=%d, item-id=%d)\n", ps->path, ps->id, ps->item_id);
+
+      db_queue_delete_byitemid(ps->item_id);
+      source_free(ps);
+      return -1;
+    }
+
+  DPRINTF(E_INFO, L_PLAYER, "Switched to pre-rolled '%s' (id=%d, item-id=%d)\n", ps->path, ps->id, ps->item_id);
+
+  // Same as source_close() followed by source_open() and source_play()
+  cur_streaming->end = end_pos;
+  cur_streaming->play_next = ps;
+
+  cur_streaming = ps;
+
+  cur_streaming->stream_start = end_pos + 1;
+  cur_streaming->output_start = cur_streaming->stream_start;
+  cur_streaming->end = 0;
+
+  return 0;
+}
+
 static int
 source_switch(int nbytes)
 {
@@ -922,6 +1377,13 @@ source_switch(int nbytes)
 
   DPRINTF(E_DBG, L_PLAYER, "Switching track\n");
 
+  ret = source_preroll_switch(last_rtptime + AIRTUNES_V2_PACKET_SAMPLES + BTOS(nbytes) - 1);
+  if (ret == 0)
+    {
+      metadata_trigger(0);
+      return 0;
+    }
+
   source_close(last_rtptime + AIRTUNES_V2_PACKET_SAMPLES + BTOS(nbytes) - 1);
 
   while ((ps = source_next()))
@@ -958,10 +1420,28 @@ source_switch(int nbytes)
 
 /* ----------------- Main read, write and playback timer event -------------- */
 
+static void
+stats_switch(struct timespec *start)
+{
+  struct timespec now;
+  uint64_t elapsed_us;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    return;
+
+  elapsed_us = (now.tv_sec - start->tv_sec) * 1000000ULL + (now.tv_nsec - start->tv_nsec) / 1000;
+
+  pb_stats.switches++;
+  pb_stats.switch_total_us += elapsed_us;
+  if (elapsed_us > pb_stats.switch_max_us)
+    pb_stats.switch_max_us = elapsed_us;
+}
+
 // Returns -1 on error (caller should abort playback), or bytes read (possibly 0)
 static int
 source_read(uint8_t *buf, int len)
 {
+  struct timespec start;
   int nbytes;
   uint32_t item_id;
   int ret;
@@ -979,16 +1459,25 @@ source_read(uint8_t *buf, int len)
     {
       DPRINTF(E_LOG, L_PLAYER, "Error reading source %d\n", cur_streaming->id);
 
+      // The playback loop may not have ended, so we can't switch to the
+      // pre-rolled source without stopping the loop, which would also stop
+      // the pre-roll
+      source_preroll_stop();
+
       nbytes = 0;
       item_id = cur_streaming->item_id;
+      clock_gettime(CLOCK_MONOTONIC, &start);
       ret = source_switch(0);
+      stats_switch(&start);
       db_queue_delete_byitemid(item_id);
       if (ret < 0)
 	return -1;
     }
   else if (flags & INPUT_FLAG_EOF)
     {
+      clock_gettime(CLOCK_MONOTONIC, &start);
       ret = source_switch(nbytes);
+      stats_switch(&start);
       if (ret < 0)
 	return -1;
     }
@@ -1008,6 +1497,26 @@ source_read(uint8_t *buf, int len)
   return nbytes;
 }
 
+// Writes the complete packets in pb_buffer to the outputs
+static void
+playback_batch_write(void)
+{
+  int npackets;
+  size_t len;
+
+  npackets = pb_buffer_offset / STOB(AIRTUNES_V2_PACKET_SAMPLES);
+  if (npackets == 0)
+    return;
+
+  outputs_write_batch(pb_buffer, last_rtptime - (npackets - 1) * AIRTUNES_V2_PACKET_SAMPLES, npackets);
+
+  // Keep a partial packet, if any
+  len = npackets * STOB(AIRTUNES_V2_PACKET_SAMPLES);
+  pb_buffer_offset -= len;
+  if (pb_buffer_offset > 0)
+    memmove(pb_buffer, pb_buffer + len, pb_buffer_offset);
+}
+
 static void
 playback_write(void)
 {
@@ -1020,17 +1529,20 @@ playback_write(void)
   if (player_state == PLAY_STOPPED)
     return;
 
+  source_preroll();
+
   pb_read_deficit++;
   while (pb_read_deficit)
     {
-      want = sizeof(pb_buffer) - pb_buffer_offset;
+      want = STOB(AIRTUNES_V2_PACKET_SAMPLES) - (pb_buffer_offset % STOB(AIRTUNES_V2_PACKET_SAMPLES));
       got = source_read(pb_buffer + pb_buffer_offset, want);
       if (got == want)
 	{
 	  pb_read_deficit--;
 	  last_rtptime += AIRTUNES_V2_PACKET_SAMPLES;
-	  outputs_write(pb_buffer, last_rtptime);
-	  pb_buffer_offset = 0;
+	  pb_buffer_offset += got;
+	  if (pb_buffer_offset == sizeof(pb_buffer))
+	    playback_batch_write();
 	}
       else if (got < 0)
 	{
@@ -1041,6 +1553,7 @@ playback_write(void)
       else if (pb_read_deficit > pb_read_deficit_max)
 	{
 	  DPRINTF(E_LOG, L_PLAYER, "Source is not providing sufficient data, temporarily suspending playback (deficit=%d)\n", pb_read_deficit);
+	  pb_stats.underruns++;
 	  playback_suspend();
 	  return;
 	}
@@ -1053,11 +1566,65 @@ playback_write(void)
     }
 }
 
+static void
+stats_reset(void)
+{
+  memset(&pb_stats, 0, sizeof(struct player_stats));
+
+  pb_stats.input_buffered_min = SIZE_MAX;
+
+  outputs_write_stats_reset();
+}
+
+// Registers how late the timer tick was compared to when it was due
+static void
+stats_tick(struct timespec *due, uint64_t overrun)
+{
+  struct timespec now;
+  uint64_t late_us;
+  size_t size;
+  size_t len;
+  int i;
+
+  pb_stats.ticks++;
+  if (overrun > 0)
+    {
+      pb_stats.overruns++;
+      pb_stats.overrun_ticks += overrun;
+    }
+
+  len = input_buffer_level(&size);
+  if (len < pb_stats.input_buffered_min)
+    pb_stats.input_buffered_min = len;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    return;
+
+  if (timespec_cmp(now, *due) <= 0)
+    late_us = 0;
+  else
+    late_us = (now.tv_sec - due->tv_sec) * 1000000ULL + (now.tv_nsec - due->tv_nsec) / 1000;
+
+  if (late_us > pb_stats.lateness_max_us)
+    pb_stats.lateness_max_us = late_us;
+
+  for (i = 0; i < PLAYER_STATS_LATENESS_BUCKETS - 1; i++)
+    {
+      if (late_us < pb_stats_lateness_bound_ms[i] * 1000ULL)
+	break;
+    }
+
+  pb_stats.lateness[i]++;
+
+  metrics_histogram_observe(pb_metric_lateness, late_us);
+}
+
 static void
 playback_cb(int fd, short what, void *arg)
 {
   struct timespec next_tick;
   uint64_t overrun;
+  uint64_t i;
   int ret;
 
   // Check if we missed any timer expirations
@@ -1076,18 +1643,27 @@ playback_cb(int fd, short what, void *arg)
     overrun = ret;
 #endif /* HAVE_TIMERFD */
 
+  // The tick we are handling now was due after the last tick and the ones we missed
+  next_tick = timespec_add(pb_timer_last, tick_interval);
+  for (i = 0; i < overrun; i++)
+    next_tick = timespec_add(next_tick, tick_interval);
+
+  stats_tick(&next_tick, overrun);
+
   // We are too delayed, probably some output blocked: reset if first overrun or abort if second overrun
   if (overrun > pb_write_deficit_max)
     {
       if (pb_write_recovery)
 	{
 	  DPRINTF(E_LOG, L_PLAYER, "Permanent output delay detected (behind=%" PRIu64 ", max=%d), aborting\n", overrun, pb_write_deficit_max);
+	  pb_stats.aborts++;
 	  playback_abort();
 	  return;
 	}
 
       DPRINTF(E_LOG, L_PLAYER, "Output delay detected (behind=%" PRIu64 ", max=%d), resetting all outputs\n", overrun, pb_write_deficit_max);
       pb_write_recovery = true;
+      pb_stats.resets++;
       playback_suspend();
       return;
     }
@@ -1100,12 +1676,9 @@ playback_cb(int fd, short what, void *arg)
     }
 
   // If there was an overrun, we will try to read/write a corresponding number
-  // of times so we catch up. The read from the input is non-blocking, so it
-  // should not bring us further behind, even if there is no data.
-  next_tick = timespec_add(pb_timer_last, tick_interval);
-  for (; overrun > 0; overrun--)
-    next_tick = timespec_add(next_tick, tick_interval);
-
+  // of times so we catch up (next_tick includes the overrun). The read from the
+  // input is non-blocking, so it should not bring us further behind, even if
+  // there is no data.
   do
     {
       playback_write();
@@ -1117,7 +1690,16 @@ playback_cb(int fd, short what, void *arg)
   if (player_state == PLAY_STOPPED)
     return;
 
+  if (player_state == PLAY_PLAYING)
+    playback_batch_write();
+
   pb_timer_last = next_tick;
+
+  if (player_state == PLAY_PLAYING)
+    playback_timer_adjust();
+
+  // Picks up item changes and the end of buffering
+  status_snapshot_update(false);
 }
 
 
@@ -1200,13 +1782,32 @@ device_check(struct output_device *check)
 {
   struct output_device *device;
 
-  for (device = dev_list; device; device = device->next)
-    {
-      if (device == check)
-	break;
-    }
+  for (device = dev_list; device; device = device->next)
+    {
+      if (device == check)
+	break;
+    }
+
+  return (device) ? 0 : -1;
+}
+
+static void
+device_restore_probe_cb(struct output_device *device, struct output_session *session, enum output_device_state status)
+{
+  int ret;
+
+  ret = device_check(device);
+  if (ret < 0)
+    return;
+
+  // If mDNS found the device in the meantime it is no longer just restored
+  if (status != OUTPUT_STATE_FAILED || !device->restored)
+    return;
 
-  return (device) ? 0 : -1;
+  DPRINTF(E_INFO, L_PLAYER, "Restored %s device '%s' is not responding, removing it\n", device->type_name, device->name);
+
+  // Not deselected before removal, so it will be selected again when it shows up
+  device_remove(device);
 }
 
 static enum command_state
@@ -1243,6 +1844,14 @@ device_add(void *arg, int *retval)
       free(device->name);
       device->name = keep_name;
 
+      // Save the endpoints, so the device can be restored at next startup
+      if (!device->restored)
+	{
+	  ret = db_speaker_save(device);
+	  if (ret < 0)
+	    DPRINTF(E_LOG, L_PLAYER, "Could not save endpoints for %s device '%s'\n", device->type_name, device->name);
+	}
+
       if (device->selected && (player_state != PLAY_PLAYING))
 	speaker_select_output(device);
       else
@@ -1250,6 +1859,14 @@ device_add(void *arg, int *retval)
 
       device->next = dev_list;
       dev_list = device;
+
+      // Restored devices are probed in parallel, failing ones are removed again
+      if (device->restored)
+	{
+	  ret = outputs_device_probe(device, device_restore_probe_cb);
+	  if (ret < 0)
+	    DPRINTF(E_WARN, L_PLAYER, "Could not probe restored %s device '%s'\n", device->type_name, device->name);
+	}
     }
   // Update to a device already in the list
   else
@@ -1288,6 +1905,23 @@ device_add(void *arg, int *retval)
       device->has_password = add->has_password;
       device->password = add->password;
 
+      if (!add->restored)
+	{
+	  device->restored = 0;
+
+	  free(device->mdns_name);
+	  device->mdns_name = add->mdns_name;
+	  add->mdns_name = NULL;
+
+	  free(device->mdns_txt);
+	  device->mdns_txt = add->mdns_txt;
+	  add->mdns_txt = NULL;
+
+	  ret = db_speaker_save(device);
+	  if (ret < 0)
+	    DPRINTF(E_LOG, L_PLAYER, "Could not save endpoints for %s device '%s'\n", device->type_name, device->name);
+	}
+
       outputs_device_free(add);
     }
 
@@ -1384,6 +2018,20 @@ device_metadata_send(void *arg, int *retval)
 
 /* -------- Output device callbacks executed in the player thread ----------- */
 
+// Must be called before the device is removed
+static void
+device_failure_count(struct output_device *device, const char *stage)
+{
+  char labels[64];
+
+  if (!metrics_enabled())
+    return;
+
+  // Failures are rare, so registering (or finding) the metric each time is ok
+  snprintf(labels, sizeof(labels), "output=\"%s\",stage=\"%s\"", device->type_name, stage);
+  metrics_counter_add(metrics_register("forked_daapd_output_failures_total", labels, METRICS_COUNTER, "Output device failures by output type and when they happened"), 1);
+}
+
 static void
 device_streaming_cb(struct output_device *device, struct output_session *session, enum output_device_state status)
 {
@@ -1402,6 +2050,8 @@ device_streaming_cb(struct output_device *device, struct output_session *session
 
   if (status == OUTPUT_STATE_FAILED)
     {
+      device_failure_count(device, "streaming");
+
       DPRINTF(E_LOG, L_PLAYER, "The %s device '%s' FAILED\n", device->type_name, device->name);
 
       output_sessions--;
@@ -1453,6 +2103,38 @@ device_command_cb(struct output_device *device, struct output_session *session,
   commands_exec_end(cmdbase, 0);
 }
 
+static int
+device_volume_send(struct output_device *device);
+
+static void
+device_volume_cb(struct output_device *device, struct output_session *session, enum output_device_state status)
+{
+  bool resend;
+  int ret;
+
+  DPRINTF(E_DBG, L_PLAYER, "Callback from %s to device_volume_cb\n", outputs_name(device->type));
+
+  outputs_status_cb(session, device_streaming_cb);
+
+  ret = device_check(device);
+  if (ret < 0)
+    return;
+
+  resend = device->volume_resend;
+  device->volume_pending = 0;
+  device->volume_resend = 0;
+
+  if (status == OUTPUT_STATE_FAILED)
+    {
+      device_streaming_cb(device, session, status);
+      return;
+    }
+
+  // The volume changed while the request was in flight, send the latest
+  if (resend)
+    device_volume_send(device);
+}
+
 static void
 device_shutdown_cb(struct output_device *device, struct output_session *session, enum output_device_state status)
 {
@@ -1531,6 +2213,8 @@ device_activate_cb(struct output_device *device, struct output_session *session,
 
   if (status == OUTPUT_STATE_FAILED)
     {
+      device_failure_count(device, "start");
+
       speaker_deselect_output(device);
 
       if (!device->advertised)
@@ -1542,6 +2226,8 @@ device_activate_cb(struct output_device *device, struct output_session *session,
     }
 
   device->session = session;
+  device->volume_pending = 0;
+  device->volume_resend = 0;
 
   output_sessions++;
 
@@ -1598,6 +2284,8 @@ device_probe_cb(struct output_device *device, struct output_session *session, en
 
   if (status == OUTPUT_STATE_FAILED)
     {
+      device_failure_count(device, "probe");
+
       speaker_deselect_output(device);
 
       if (!device->advertised)
@@ -1647,6 +2335,8 @@ device_restart_cb(struct output_device *device, struct output_session *session,
 
   if (status == OUTPUT_STATE_FAILED)
     {
+      device_failure_count(device, "restart");
+
       speaker_deselect_output(device);
 
       if (!device->advertised)
@@ -1658,6 +2348,8 @@ device_restart_cb(struct output_device *device, struct output_session *session,
     }
 
   device->session = session;
+  device->volume_pending = 0;
+  device->volume_resend = 0;
 
   output_sessions++;
   outputs_status_cb(session, device_streaming_cb);
@@ -1669,12 +2361,67 @@ device_restart_cb(struct output_device *device, struct output_session *session,
 
 /* ------------------------- Internal playback routines --------------------- */
 
+// Selects the tick interval that matches the active outputs
+static bool
+tick_interval_select(void)
+{
+  struct output_device *device;
+  struct timespec interval;
+
+  interval = tick_interval_batch;
+  for (device = dev_list; device; device = device->next)
+    {
+      if (device->session && outputs_low_latency(device))
+	{
+	  interval = tick_interval_low_latency;
+	  break;
+	}
+    }
+
+  if (timespec_cmp(interval, tick_interval) == 0)
+    return false;
+
+  tick_interval = interval;
+
+  pb_write_deficit_max = (PLAYER_WRITE_BEHIND_MAX * 1000000 / tick_interval.tv_nsec);
+
+  return true;
+}
+
+// Called from playback_cb(), rearms the playback timer if a low latency output
+// was activated or deactivated. The timer is set to expire relative to the
+// last tick, so that we stay on the same time grid as before.
+static void
+playback_timer_adjust(void)
+{
+  struct itimerspec tick;
+  int ret;
+
+  if (!tick_interval_select())
+    return;
+
+  DPRINTF(E_DBG, L_PLAYER, "Changing tick interval to %ld ns\n", tick_interval.tv_nsec);
+
+  tick.it_interval = tick_interval;
+  tick.it_value = timespec_add(pb_timer_last, tick_interval);
+
+#ifdef HAVE_TIMERFD
+  ret = timerfd_settime(pb_timer_fd, TFD_TIMER_ABSTIME, &tick, NULL);
+#else
+  ret = timer_settime(pb_timer, TIMER_ABSTIME, &tick, NULL);
+#endif
+  if (ret < 0)
+    DPRINTF(E_LOG, L_PLAYER, "Could not rearm playback timer: %s\n", strerror(errno));
+}
+
 static int
 playback_timer_start(void)
 {
   struct itimerspec tick;
   int ret;
 
+  tick_interval_select();
+
   ret = event_add(pb_timer_ev, NULL);
   if (ret < 0)
     {
@@ -1849,6 +2596,47 @@ get_status(void *arg, int *retval)
   return COMMAND_END;
 }
 
+/* Publishes the player status for player_get_status(). Unless forced, it is
+ * only published if something other than the playback position changed, since
+ * readers extrapolate the position from the time of publication.
+ */
+static void
+status_snapshot_update(bool force)
+{
+  struct status_snapshot_key key;
+  struct player_status status;
+  struct timespec ts;
+  unsigned int seq;
+  int ret;
+
+  memset(&key, 0, sizeof(struct status_snapshot_key));
+  key.state = player_state;
+  key.playing = cur_playing;
+  key.streaming = cur_streaming;
+  key.volume = master_volume;
+  key.repeat = repeat;
+  key.shuffle = shuffle;
+  key.consume = consume;
+  key.plid = cur_plid;
+
+  if (!force && status_snapshot_seq > 0 && memcmp(&key, &status_snapshot_key, sizeof(struct status_snapshot_key)) == 0)
+    return;
+
+  get_status(&status, &ret);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  status_snapshot_key = key;
+
+  seq = status_snapshot_seq;
+  __atomic_store_n(&status_snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  status_snapshot = status;
+  status_snapshot_ts = ts;
+
+  __atomic_store_n(&status_snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
 static enum command_state
 now_playing(void *arg, int *retval)
 {
@@ -1905,6 +2693,84 @@ playback_stop(void *arg, int *retval)
   return COMMAND_END;
 }
 
+static enum command_state
+get_stats(void *arg, int *retval)
+{
+  struct player_stats *stats = arg;
+
+  *stats = pb_stats;
+
+  memcpy(stats->lateness_bound_ms, pb_stats_lateness_bound_ms, sizeof(stats->lateness_bound_ms));
+
+  stats->input_buffered = input_buffer_level(&stats->input_size);
+  if (stats->input_buffered_min == SIZE_MAX)
+    stats->input_buffered_min = 0;
+
+  outputs_write_stats_get(stats->outputs, &stats->noutputs);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+/* Thread: httpd, since it is a metrics collector */
+static void
+player_metrics_cb(struct evbuffer *evbuf)
+{
+  struct player_stats stats;
+  char labels[64];
+  int ret;
+  int i;
+
+  ret = player_get_stats(&stats);
+  if (ret < 0)
+    return;
+
+  metrics_print_family(evbuf, "forked_daapd_player_ticks_total", METRICS_COUNTER, "Playback timer ticks");
+  metrics_print_value(evbuf, "forked_daapd_player_ticks_total", NULL, stats.ticks);
+
+  metrics_print_family(evbuf, "forked_daapd_player_overrun_ticks_total", METRICS_COUNTER, "Playback timer ticks that were missed");
+  metrics_print_value(evbuf, "forked_daapd_player_overrun_ticks_total", NULL, stats.overrun_ticks);
+
+  metrics_print_family(evbuf, "forked_daapd_player_events_total", METRICS_COUNTER, "Output resets and aborts due to output delays, and suspends due to input underruns");
+  metrics_print_value(evbuf, "forked_daapd_player_events_total", "event=\"reset\"", stats.resets);
+  metrics_print_value(evbuf, "forked_daapd_player_events_total", "event=\"abort\"", stats.aborts);
+  metrics_print_value(evbuf, "forked_daapd_player_events_total", "event=\"underrun\"", stats.underruns);
+
+  metrics_print_family(evbuf, "forked_daapd_player_input_buffered_bytes", METRICS_GAUGE, "Fill level of the input buffer");
+  metrics_print_value(evbuf, "forked_daapd_player_input_buffered_bytes", NULL, stats.input_buffered);
+
+  metrics_print_family(evbuf, "forked_daapd_player_input_buffer_bytes", METRICS_GAUGE, "Size of the input buffer");
+  metrics_print_value(evbuf, "forked_daapd_player_input_buffer_bytes", NULL, stats.input_size);
+
+  metrics_print_family(evbuf, "forked_daapd_output_writes_total", METRICS_COUNTER, "Writes to the outputs, a batch of packets counts as one");
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      snprintf(labels, sizeof(labels), "output=\"%s\"", stats.outputs[i].name);
+      metrics_print_value(evbuf, "forked_daapd_output_writes_total", labels, stats.outputs[i].writes);
+    }
+
+  metrics_print_family(evbuf, "forked_daapd_output_write_seconds_total", METRICS_COUNTER, "Time spent writing to the outputs");
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      snprintf(labels, sizeof(labels), "output=\"%s\"", stats.outputs[i].name);
+      metrics_print_seconds(evbuf, "forked_daapd_output_write_seconds_total", labels, stats.outputs[i].total_us);
+    }
+
+  metrics_print_family(evbuf, "forked_daapd_output_dropped_packets_total", METRICS_COUNTER, "Packets dropped because an output could not keep up");
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      snprintf(labels, sizeof(labels), "output=\"%s\"", stats.outputs[i].name);
+      metrics_print_value(evbuf, "forked_daapd_output_dropped_packets_total", labels, stats.outputs[i].drops);
+    }
+
+  metrics_print_family(evbuf, "forked_daapd_output_queued_packets", METRICS_GAUGE, "Packets waiting to be written to an output");
+  for (i = 0; i < stats.noutputs; i++)
+    {
+      snprintf(labels, sizeof(labels), "output=\"%s\"", stats.outputs[i].name);
+      metrics_print_value(evbuf, "forked_daapd_output_queued_packets", labels, stats.outputs[i].queued);
+    }
+}
+
 static enum command_state
 playback_start_bh(void *arg, int *retval)
 {
@@ -1970,6 +2836,10 @@ playback_start_item(void *arg, int *retval)
       return COMMAND_END;
     }
 
+  // A new playback session, so start over with the stats
+  if (player_state == PLAY_STOPPED)
+    stats_reset();
+
   // Update global playback position
   pb_pos = last_rtptime + AIRTUNES_V2_PACKET_SAMPLES - 88200;
 
@@ -2204,6 +3074,7 @@ playback_prev_bh(void *arg, int *retval)
 
   // Silent status change - playback_start() sends the real status update
   player_state = PLAY_PAUSED;
+  status_snapshot_update(true);
 
   *retval = 0;
   return COMMAND_END;
@@ -2261,6 +3132,7 @@ playback_next_bh(void *arg, int *retval)
 
   // Silent status change - playback_start() sends the real status update
   player_state = PLAY_PAUSED;
+  status_snapshot_update(true);
 
   *retval = 0;
   return COMMAND_END;
@@ -2289,6 +3161,7 @@ playback_seek_bh(void *arg, int *retval)
 
   // Silent status change - playback_start() sends the real status update
   player_state = PLAY_PAUSED;
+  status_snapshot_update(true);
 
   *retval = 0;
   return COMMAND_END;
@@ -2395,6 +3268,7 @@ speaker_enumerate(void *arg, int *retval)
 	  spk.output_type = device->type_name;
 	  spk.relvol = device->relvol;
 	  spk.absvol = device->volume;
+	  spk.offset_ms = device->offset_ms;
 
 	  spk.selected = device->selected;
 	  spk.has_password = device->has_password;
@@ -2588,6 +3462,48 @@ speaker_disable(void *arg, int *retval)
   return COMMAND_END;
 }
 
+/* Sends the volume of the device, unless a volume request to it is already in
+ * flight. In that case only the latest volume is sent once the request has
+ * completed, see device_volume_cb(), so that a burst of volume changes doesn't
+ * queue up requests to the device. The volume commands therefore don't wait
+ * for the devices.
+ */
+static int
+device_volume_send(struct output_device *device)
+{
+  int ret;
+
+  if (!device->session)
+    return 0;
+
+  if (device->volume_pending)
+    {
+      device->volume_resend = 1;
+      return 0;
+    }
+
+  ret = outputs_device_volume_set(device, device_volume_cb);
+  if (ret > 0)
+    device->volume_pending = 1;
+
+  return ret;
+}
+
+static void
+volume_notify_cb(int fd, short what, void *arg)
+{
+  listener_notify(LISTENER_VOLUME);
+}
+
+// Notifies LISTENER_VOLUME once for all volume changes within the next
+// PLAYER_VOLUME_NOTIFY_MSEC
+static void
+volume_notify(void)
+{
+  if (!evtimer_pending(volume_notify_ev, NULL))
+    evtimer_add(volume_notify_ev, &volume_notify_wait);
+}
+
 static enum command_state
 volume_set(void *arg, int *retval)
 {
@@ -2614,14 +3530,12 @@ volume_set(void *arg, int *retval)
       DPRINTF(E_DBG, L_PLAYER, "*** %s: abs %d rel %d\n", device->name, device->volume, device->relvol);
 #endif
 
-      if (device->session)
-	*retval += outputs_device_volume_set(device, device_command_cb);
+      if (device_volume_send(device) < 0)
+	*retval = -1;
     }
 
-  listener_notify(LISTENER_VOLUME);
-
-  if (*retval > 0)
-    return COMMAND_PENDING; // async
+  status_snapshot_update(true);
+  volume_notify();
 
   return COMMAND_END;
 }
@@ -2656,16 +3570,14 @@ volume_setrel_speaker(void *arg, int *retval)
       DPRINTF(E_DBG, L_PLAYER, "*** %s: abs %d rel %d\n", device->name, device->volume, device->relvol);
 #endif
 
-      if (device->session)
-	*retval = outputs_device_volume_set(device, device_command_cb);
+      if (device_volume_send(device) < 0)
+	*retval = -1;
 
       break;
     }
 
-  listener_notify(LISTENER_VOLUME);
-
-  if (*retval > 0)
-    return COMMAND_PENDING; // async
+  status_snapshot_update(true);
+  volume_notify();
 
   return COMMAND_END;
 }
@@ -2707,16 +3619,48 @@ volume_setabs_speaker(void *arg, int *retval)
 	  DPRINTF(E_DBG, L_PLAYER, "*** %s: abs %d rel %d\n", device->name, device->volume, device->relvol);
 #endif
 
-	  if (device->session)
-	    *retval = outputs_device_volume_set(device, device_command_cb);//FIXME Does this need to be += ?
+	  if (device_volume_send(device) < 0)
+	    *retval = -1;
 	}
     }
 
-  listener_notify(LISTENER_VOLUME);
+  status_snapshot_update(true);
+  volume_notify();
 
-  if (*retval > 0)
-    return COMMAND_PENDING; // async
+  return COMMAND_END;
+}
+
+static enum command_state
+speaker_offset_set(void *arg, int *retval)
+{
+  struct offset_param *offset_param = arg;
+  struct output_device *device;
+  int ret;
+
+  for (device = dev_list; device; device = device->next)
+    {
+      if (device->id == offset_param->spk_id)
+	break;
+    }
 
+  if (!device)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Speaker %" PRIu64 " not found, can't set offset\n", offset_param->spk_id);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  device->offset_ms = offset_param->offset_ms;
+
+  ret = db_speaker_save(device);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_PLAYER, "Could not save offset for %s device '%s'\n", device->type_name, device->name);
+
+  ret = outputs_device_offset_set(device);
+  if (ret > 0)
+    DPRINTF(E_INFO, L_PLAYER, "Offset of %s device '%s' (%d ms) will be applied when playback starts\n", device->type_name, device->name, device->offset_ms);
+
+  *retval = (ret < 0) ? -1 : 0;
   return COMMAND_END;
 }
 
@@ -2745,6 +3689,7 @@ repeat_set(void *arg, int *retval)
 	return COMMAND_END;
     }
 
+  status_snapshot_update(true);
   listener_notify(LISTENER_OPTIONS);
 
   *retval = 0;
@@ -2776,6 +3721,7 @@ shuffle_set(void *arg, int *retval)
 	return COMMAND_END;
     }
 
+  status_snapshot_update(true);
   listener_notify(LISTENER_OPTIONS);
 
   *retval = 0;
@@ -2789,6 +3735,7 @@ consume_set(void *arg, int *retval)
 
   consume = cmdarg->intval;
 
+  status_snapshot_update(true);
   listener_notify(LISTENER_OPTIONS);
 
   *retval = 0;
@@ -2817,6 +3764,8 @@ playerqueue_plid(void *arg, int *retval)
   union player_arg *cmdarg = arg;
   cur_plid = cmdarg->id;
 
+  status_snapshot_update(true);
+
   *retval = 0;
   return COMMAND_END;
 }
@@ -2867,12 +3816,53 @@ player_get_current_pos(uint64_t *pos, struct timespec *ts, int commit)
   return 0;
 }
 
+/* Reads the status published by the player thread, so it is lock-free and
+ * does not wait for the player thread
+ */
 int
 player_get_status(struct player_status *status)
+{
+  struct timespec ts;
+  struct timespec now;
+  unsigned int seq;
+  uint64_t elapsed_ms;
+  int ret;
+
+  do
+    {
+      seq = __atomic_load_n(&status_snapshot_seq, __ATOMIC_ACQUIRE);
+      if (seq == 0)
+	{
+	  ret = commands_exec_sync(cmdbase, get_status, NULL, status);
+	  return ret;
+	}
+
+      *status = status_snapshot;
+      ts = status_snapshot_ts;
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+  while ((seq & 1) || seq != __atomic_load_n(&status_snapshot_seq, __ATOMIC_RELAXED));
+
+  if (status->status == PLAY_PLAYING)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      elapsed_ms = (now.tv_sec - ts.tv_sec) * 1000 + (now.tv_nsec - ts.tv_nsec) / 1000000;
+      status->pos_ms += elapsed_ms;
+      if (status->len_ms > 0 && status->pos_ms > status->len_ms)
+	status->pos_ms = status->len_ms;
+    }
+
+  return 0;
+}
+
+int
+player_get_stats(struct player_stats *stats)
 {
   int ret;
 
-  ret = commands_exec_sync(cmdbase, get_status, NULL, status);
+  ret = commands_exec_sync(cmdbase, get_stats, NULL, stats);
   return ret;
 }
 
@@ -3099,6 +4089,28 @@ player_volume_setabs_speaker(uint64_t id, int vol)
   return ret;
 }
 
+int
+player_speaker_offset_set(uint64_t id, int offset_ms)
+{
+  struct offset_param offset_param;
+  int ret;
+
+  if (abs(offset_ms) > OUTPUTS_OFFSET_MAX_MS)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Offset (%d ms) for player_speaker_offset_set is out of range\n", offset_ms);
+      return -1;
+    }
+
+  offset_param.spk_id = id;
+  offset_param.offset_ms = offset_ms;
+
+  ret = commands_exec_sync(cmdbase, speaker_offset_set, NULL, &offset_param);
+
+  listener_notify(LISTENER_SPEAKER);
+
+  return ret;
+}
+
 int
 player_repeat_set(enum repeat_mode mode)
 {
@@ -3245,6 +4257,8 @@ player(void *arg)
   struct output_device *device;
   int ret;
 
+  thread_sched_set(THREAD_CLASS_AUDIO);
+
   ret = db_perthread_init();
   if (ret < 0)
     {
@@ -3286,6 +4300,7 @@ player_init(void)
 
   speaker_autoselect = cfg_getbool(cfg_getsec(cfg, "general"), "speaker_autoselect");
   clear_queue_on_stop_disabled = cfg_getbool(cfg_getsec(cfg, "mpd"), "clear_queue_on_stop_disable");
+  preroll_ms = 1000 * cfg_getint(cfg_getsec(cfg, "general"), "preroll_seconds");
 
   dev_list = NULL;
 
@@ -3295,9 +4310,12 @@ player_init(void)
 
   cur_playing = NULL;
   cur_streaming = NULL;
+  cur_preroll = NULL;
   cur_plid = 0;
   cur_plversion = 0;
 
+  memset(&lookahead, 0, sizeof(struct player_lookahead));
+
   player_state = PLAY_STOPPED;
   repeat = REPEAT_OFF;
   shuffle = 0;
@@ -3322,9 +4340,11 @@ player_init(void)
       timer_res.tv_nsec = 2 * AIRTUNES_V2_STREAM_PERIOD;
     }
 
-  // Set the tick interval for the playback timer
+  // Set the tick intervals for the playback timer
   interval = MAX(timer_res.tv_nsec, AIRTUNES_V2_STREAM_PERIOD);
-  tick_interval.tv_nsec = interval;
+  tick_interval_low_latency.tv_nsec = interval;
+  tick_interval_batch.tv_nsec = MAX(interval, PLAYER_BATCH_PACKETS * AIRTUNES_V2_STREAM_PERIOD);
+  tick_interval = tick_interval_low_latency;
 
   pb_write_deficit_max = (PLAYER_WRITE_BEHIND_MAX * 1000000 / interval);
   pb_read_deficit_max  = (PLAYER_READ_BEHIND_MAX * 1000000 / interval);
@@ -3366,7 +4386,34 @@ player_init(void)
       goto evnew_fail;
     }
 
+  lookahead_ev = event_new(evbase_player, -1, 0, lookahead_cb, NULL);
+  if (!lookahead_ev)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not create lookahead event\n");
+      goto lookahead_fail;
+    }
+
+  volume_notify_ev = evtimer_new(evbase_player, volume_notify_cb, NULL);
+  if (!volume_notify_ev)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not create volume notify event\n");
+      goto volume_fail;
+    }
+
+  ret = listener_add(lookahead_queue_cb, LISTENER_QUEUE, evbase_player);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_PLAYER, "Could not add queue listener\n");
+      goto listener_fail;
+    }
+
   cmdbase = commands_base_new(evbase_player, NULL);
+  commands_base_metrics(cmdbase, "player");
+
+  pb_metric_lateness = metrics_register("forked_daapd_player_tick_lateness_seconds", NULL, METRICS_HISTOGRAM, "How late the playback timer ticks were");
+  metrics_collector_add(player_metrics_cb);
+
+  status_snapshot_update(true);
 
   ret = outputs_init();
   if (ret < 0)
@@ -3402,6 +4449,12 @@ player_init(void)
   outputs_deinit();
  outputs_fail:
   commands_base_free(cmdbase);
+  listener_remove(lookahead_queue_cb);
+ listener_fail:
+  event_free(volume_notify_ev);
+ volume_fail:
+  event_free(lookahead_ev);
+ lookahead_fail:
  evnew_fail:
   event_base_free(evbase_player);
  evbase_fail:
@@ -3421,6 +4474,8 @@ player_deinit(void)
 
   player_playback_stop();
 
+  listener_remove(lookahead_queue_cb);
+
 #ifdef HAVE_TIMERFD
   close(pb_timer_fd);
 #else
@@ -3444,5 +4499,16 @@ player_deinit(void)
 
   free(history);
 
+  lookahead_clear();
+  event_free(lookahead_ev);
+  event_free(volume_notify_ev);
+
+  CHECK_ERR(L_PLAYER, pthread_mutex_lock(&metadata_prepared_lck));
+  if (metadata_prepared)
+    outputs_metadata_free(metadata_prepared);
+  metadata_prepared = NULL;
+  metadata_prepared_item_id = 0;
+  CHECK_ERR(L_PLAYER, pthread_mutex_unlock(&metadata_prepared_lck));
+
   event_base_free(evbase_player);
 }
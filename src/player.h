@@ -3,9 +3,11 @@
 #define __PLAYER_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "db.h"
+#include "outputs.h"
 
 /* AirTunes v2 packet interval in ns */
 /* (352 samples/packet * 1e9 ns/s) / 44100 samples/s = 7981859 ns/packet */
@@ -17,6 +19,9 @@
 /* Maximum number of previously played songs that are remembered */
 #define MAX_HISTORY_COUNT 20
 
+/* Number of buckets in the tick lateness histogram of the player stats */
+#define PLAYER_STATS_LATENESS_BUCKETS 8
+
 enum play_status {
   PLAY_STOPPED = 2,
   PLAY_PAUSED  = 3,
@@ -35,6 +40,7 @@ struct spk_info {
   const char *output_type;
   int relvol;
   int absvol;
+  int offset_ms;
 
   bool selected;
   bool has_password;
@@ -64,6 +70,36 @@ struct player_status {
   uint32_t len_ms;
 };
 
+/* Playback timing statistics, reset when playback starts from stopped */
+struct player_stats {
+  /* Number of playback timer ticks */
+  uint64_t ticks;
+  /* Histogram of how late the ticks were, and the upper bound of each bucket
+   * in ms (the last bucket has no upper bound and is set to 0) */
+  uint64_t lateness[PLAYER_STATS_LATENESS_BUCKETS];
+  uint32_t lateness_bound_ms[PLAYER_STATS_LATENESS_BUCKETS];
+  uint64_t lateness_max_us;
+  /* Ticks with timer overruns, and the total number of missed ticks */
+  uint64_t overruns;
+  uint64_t overrun_ticks;
+  /* Output resets/aborts due to output delays, suspends due to input underrun */
+  uint32_t resets;
+  uint32_t aborts;
+  uint32_t underruns;
+  /* Track switches, and the time the player thread spent opening the next
+   * track (short if it was pre-rolled) */
+  uint32_t switches;
+  uint64_t switch_total_us;
+  uint64_t switch_max_us;
+  /* Input buffer fill level in bytes (current, lowest while playing) */
+  size_t input_buffered;
+  size_t input_buffered_min;
+  size_t input_size;
+  /* Duration of write() to the outputs */
+  struct output_write_stats outputs[OUTPUT_TYPE_MAX];
+  int noutputs;
+};
+
 typedef void (*spk_enum_cb)(struct spk_info *spk, void *arg);
 
 struct player_history
@@ -86,6 +122,9 @@ player_get_current_pos(uint64_t *pos, struct timespec *ts, int commit);
 int
 player_get_status(struct player_status *status);
 
+int
+player_get_stats(struct player_stats *stats);
+
 int
 player_now_playing(uint32_t *id);
 
@@ -101,6 +140,9 @@ player_speaker_enable(uint64_t id);
 int
 player_speaker_disable(uint64_t id);
 
+int
+player_speaker_offset_set(uint64_t id, int offset_ms);
+
 void
 player_speaker_status_trigger(void);
 
@@ -0,0 +1,187 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
+
+#include "reqlog.h"
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+
+#define REQLOG_HEADER "# forked-daapd request log 1\n"
+
+static pthread_mutex_t reqlog_lck = PTHREAD_MUTEX_INITIALIZER;
+static FILE *reqlog_fp;
+static uint64_t reqlog_start_usec;
+
+
+static uint64_t
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Tabs and line breaks in the values would break the format, the clients
+// don't send them anyway
+static void
+field_print(const char *value)
+{
+  const char *ptr;
+
+  fputc('\t', reqlog_fp);
+
+  if (!value)
+    return;
+
+  for (ptr = value; *ptr; ptr++)
+    fputc((*ptr == '\t' || *ptr == '\r' || *ptr == '\n') ? ' ' : *ptr, reqlog_fp);
+}
+
+static void
+line_end(void)
+{
+  fputc('\n', reqlog_fp);
+
+  if (fflush(reqlog_fp) != 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not write request log, recording stopped: %s\n", strerror(errno));
+      fclose(reqlog_fp);
+      __atomic_store_n(&reqlog_fp, NULL, __ATOMIC_RELEASE);
+    }
+}
+
+
+/* ---------------------------------- API ---------------------------------- */
+
+bool
+reqlog_enabled(void)
+{
+  return (__atomic_load_n(&reqlog_fp, __ATOMIC_ACQUIRE) != NULL);
+}
+
+void
+reqlog_http(const char *session, const char *method, const char *uri, const char *user_agent,
+	    const char *daap_version, const char *accept_encoding, struct evbuffer *body)
+{
+  char *body_b64;
+  size_t len;
+
+  if (!__atomic_load_n(&reqlog_fp, __ATOMIC_ACQUIRE))
+    return;
+
+  body_b64 = NULL;
+  len = body ? evbuffer_get_length(body) : 0;
+  if (len > 0)
+    body_b64 = b64_encode(evbuffer_pullup(body, -1), len);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&reqlog_lck));
+
+  if (reqlog_fp)
+    {
+      fprintf(reqlog_fp, "%" PRIu64 "\thttp", now_usec() - reqlog_start_usec);
+      field_print(session);
+      field_print(method);
+      field_print(uri);
+      field_print(user_agent);
+      field_print(daap_version);
+      field_print(accept_encoding);
+      field_print(body_b64);
+      line_end();
+    }
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&reqlog_lck));
+
+  free(body_b64);
+}
+
+void
+reqlog_mpd(const char *session, const char *line)
+{
+  if (!__atomic_load_n(&reqlog_fp, __ATOMIC_ACQUIRE))
+    return;
+
+  // The replay sends the password from its own config
+  if (strncmp(line, "password", strlen("password")) == 0)
+    line = "password";
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&reqlog_lck));
+
+  if (reqlog_fp)
+    {
+      fprintf(reqlog_fp, "%" PRIu64 "\tmpd", now_usec() - reqlog_start_usec);
+      field_print(session);
+      field_print(line);
+      line_end();
+    }
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&reqlog_lck));
+}
+
+int
+reqlog_init(void)
+{
+  const char *path;
+  FILE *fp;
+
+  path = cfg_getstr(cfg_getsec(cfg, "general"), "request_log");
+  if (!path || path[0] == '\0')
+    return 0;
+
+  fp = fopen(path, "w");
+  if (!fp)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not open request log '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  fputs(REQLOG_HEADER, fp);
+
+  reqlog_start_usec = now_usec();
+  __atomic_store_n(&reqlog_fp, fp, __ATOMIC_RELEASE);
+
+  DPRINTF(E_LOG, L_MAIN, "Recording client requests to '%s'\n", path);
+
+  return 0;
+}
+
+void
+reqlog_deinit(void)
+{
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&reqlog_lck));
+
+  if (reqlog_fp)
+    fclose(reqlog_fp);
+  __atomic_store_n(&reqlog_fp, NULL, __ATOMIC_RELEASE);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&reqlog_lck));
+}
@@ -0,0 +1,40 @@
+
+#ifndef __REQLOG_H__
+#define __REQLOG_H__
+
+#include <stdbool.h>
+#include <event2/buffer.h>
+
+/* Records the requests of the clients to the file set with the request_log
+ * option of the general section, so that the load can be replayed against a
+ * test instance with --replay (see loadtest.h). Each line is one request:
+ *
+ *   <usec since start> http <session> <method> <uri> <user-agent>
+ *     <client-daap-version> <accept-encoding> <base64 body>
+ *   <usec since start> mpd <session> <command line>
+ *
+ * with the fields separated by tabs, empty if not present. A session is a
+ * client connection, named by the peer address and port. Passwords are not
+ * recorded, the replay uses the ones from the config.
+ */
+
+/* Cheap check so that callers can skip preparing the fields */
+bool
+reqlog_enabled(void);
+
+/* Thread: httpd */
+void
+reqlog_http(const char *session, const char *method, const char *uri, const char *user_agent,
+	    const char *daap_version, const char *accept_encoding, struct evbuffer *body);
+
+/* Thread: mpd */
+void
+reqlog_mpd(const char *session, const char *line);
+
+int
+reqlog_init(void);
+
+void
+reqlog_deinit(void);
+
+#endif /* !__REQLOG_H__ */
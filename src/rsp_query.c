@@ -34,6 +34,10 @@
 #include "RSP2SQL.h"
 
 
+/* Cache of translated queries. Date expressions like "today" are resolved at
+   translation time, so entries must not be kept for long. */
+static struct string_cache rsp_query_cache = STRING_CACHE_INITIALIZER(60);
+
 char *
 rsp_query_parse_sql(const char *rsp_query)
 {
@@ -55,6 +59,13 @@ rsp_query_parse_sql(const char *rsp_query)
 
   char *ret = NULL;
 
+  ret = string_cache_get(&rsp_query_cache, rsp_query);
+  if (ret)
+    {
+      DPRINTF(E_SPAM, L_RSP, "Cached RSP SQL query for -%s-: -%s-\n", rsp_query, ret);
+      return ret;
+    }
+
   DPRINTF(E_DBG, L_RSP, "Trying RSP query -%s-\n", rsp_query);
 
 #if ANTLR3C_NEW_INPUT
@@ -127,6 +138,8 @@ rsp_query_parse_sql(const char *rsp_query)
     {
       DPRINTF(E_DBG, L_RSP, "RSP SQL query: -%s-\n", sql->chars);
       ret = strdup((char *)sql->chars);
+
+      string_cache_add(&rsp_query_cache, rsp_query, ret);
     }
   else
     {
@@ -82,6 +82,13 @@
 // An upper limit on sequential requests to Spotify's web api
 // - each request will return 50 objects (tracks)
 #define SPOTIFY_WEB_REQUESTS_MAX 20
+// Max number of web api pages that are requested in one go during a scan,
+// spotify:webapi_parallel_requests at a time
+#define SPOTIFY_SCAN_BATCH_PAGES 64
+// Page sizes of the web api endpoints
+#define SPOTIFY_WEBAPI_LIMIT_ALBUMS 50
+#define SPOTIFY_WEBAPI_LIMIT_PLAYLISTS 50
+#define SPOTIFY_WEBAPI_LIMIT_TRACKS 100
 
 /* --- Types --- */
 enum spotify_state
@@ -144,9 +151,6 @@ static struct spotify_status_info spotify_status_info;
 // Timeout timespec
 static struct timespec spotify_artwork_timeout = { SPOTIFY_ARTWORK_TIMEOUT, 0 };
 
-// Audio buffer
-static struct evbuffer *spotify_audio_buffer;
-
 /**
  * The application key is specific to forked-daapd, and allows Spotify
  * to produce statistics on how their service is used.
@@ -839,8 +843,6 @@ playback_stop(void *arg, int *retval)
 
   g_state = SPOTIFY_STATE_STOPPED;
 
-  evbuffer_drain(spotify_audio_buffer, evbuffer_get_length(spotify_audio_buffer));
-
   *retval = 0;
   return COMMAND_END;
 }
@@ -885,7 +887,7 @@ playback_eot(void *arg, int *retval)
   g_state = SPOTIFY_STATE_STOPPING;
 
   // TODO 1) This will block for a while, but perhaps ok?
-  input_write(spotify_audio_buffer, INPUT_FLAG_EOF);
+  input_write(NULL, INPUT_FLAG_EOF);
 
   *retval = 0;
   return COMMAND_END;
@@ -1173,7 +1175,6 @@ logged_out(sp_session *sess)
 static int music_delivery(sp_session *sess, const sp_audioformat *format,
                           const void *frames, int num_frames)
 {
-  size_t size;
   int ret;
 
   /* No support for resampling right now */
@@ -1184,28 +1185,17 @@ static int music_delivery(sp_session *sess, const sp_audioformat *format,
       return num_frames;
     }
 
-  // Audio discontinuity, e.g. seek
+  // Audio discontinuity, e.g. seek. Nothing is buffered here, so nothing to drop
   if (num_frames == 0)
-    {
-      evbuffer_drain(spotify_audio_buffer, evbuffer_get_length(spotify_audio_buffer));
-      return 0;
-    }
-
-  size = num_frames * sizeof(int16_t) * format->channels;
+    return 0;
 
-  ret = evbuffer_add(spotify_audio_buffer, frames, size);
+  // The frames are copied straight into the input buffer, as many as there is
+  // room for. libspotify delivers the ones we don't consume again next time.
+  ret = input_write_frames(frames, num_frames, sizeof(int16_t) * format->channels, 0);
   if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_SPOTIFY, "Out of memory adding audio to buffer\n");
-      return num_frames;
-    }
-
-  // The input buffer only accepts writing when it is approaching depletion, and
-  // because we use NONBLOCK it will just return if this is not the case. So in
-  // most cases no actual write is made and spotify_audio_buffer will just grow.
-  input_write(spotify_audio_buffer, INPUT_FLAG_NONBLOCK);
+    return num_frames; // Playback loop is ending, drop the audio
 
-  return num_frames;
+  return ret;
 }
 
 /**
@@ -1755,85 +1745,145 @@ webapi_track_save(struct spotify_track *track, struct spotify_album *album, cons
 
 
 /* Thread: library */
-static int
-scan_saved_albums()
+static void
+scan_saved_albums_page(struct spotify_request *request, int index, void *arg)
 {
-  struct spotify_request request;
   struct spotify_album album;
   struct spotify_track track;
   json_object *jsontracks;
+  int *count = arg;
   int track_count;
   int dir_id;
   int i;
-  int count;
   int ret;
 
-  count = 0;
-  memset(&request, 0, sizeof(struct spotify_request));
-
-  while (0 == spotifywebapi_request_next(&request, SPOTIFY_WEBAPI_SAVED_ALBUMS, false))
+  while (0 == spotifywebapi_saved_albums_fetch(request, &jsontracks, &track_count, &album))
     {
-      while (0 == spotifywebapi_saved_albums_fetch(&request, &jsontracks, &track_count, &album))
+      DPRINTF(E_DBG, L_SPOTIFY, "Got saved album: '%s' - '%s' (%s) - track-count: %d\n",
+	      album.artist, album.name, album.uri, track_count);
+
+      dir_id = prepare_directories(album.artist, album.name);
+      ret = 0;
+      for (i = 0; i < track_count && ret == 0; i++)
 	{
-	  DPRINTF(E_DBG, L_SPOTIFY, "Got saved album: '%s' - '%s' (%s) - track-count: %d\n",
-		  album.artist, album.name, album.uri, track_count);
+	  ret = spotifywebapi_album_track_fetch(jsontracks, i, &track);
+	  if (ret < 0 || !track.uri)
+	    continue;
 
-	  db_transaction_begin();
+	  webapi_track_save(&track, &album, NULL, dir_id);
+	  if (spotify_saved_plid)
+	    db_pl_add_item_bypath(spotify_saved_plid, track.uri);
+	}
 
-	  dir_id = prepare_directories(album.artist, album.name);
-	  ret = 0;
-	  for (i = 0; i < track_count && ret == 0; i++)
-	    {
-	      ret = spotifywebapi_album_track_fetch(jsontracks, i, &track);
-	      if (ret < 0 || !track.uri)
-		continue;
+      (*count)++;
+      if (*count >= request->total || (*count % 10 == 0))
+	DPRINTF(E_LOG, L_SPOTIFY, "Scanned %d of %d saved albums\n", *count, request->total);
+    }
+}
 
-	      webapi_track_save(&track, &album, NULL, dir_id);
-	      if (spotify_saved_plid)
-		db_pl_add_item_bypath(spotify_saved_plid, track.uri);
-	    }
+/*
+ * Requests the pages with the given uris in batches of SPOTIFY_SCAN_BATCH_PAGES,
+ * which are fetched concurrently (see spotifywebapi_request_pages), and calls
+ * cb for each page in order. The database writes of a batch are done in one
+ * transaction.
+ *
+ * Thread: library
+ */
+static void
+scan_pages(char **uris, int nuris, void (*cb)(struct spotify_request *request, int index, void *arg), void *arg)
+{
+  struct spotify_request *requests;
+  int n;
+  int i;
+  int j;
+  int ret;
 
-	  db_transaction_end();
+  if (nuris == 0)
+    return;
 
-	  count++;
-	  if (count >= request.total || (count % 10 == 0))
-	    DPRINTF(E_LOG, L_SPOTIFY, "Scanned %d of %d saved albums\n", count, request.total);
+  CHECK_NULL(L_SPOTIFY, requests = calloc(SPOTIFY_SCAN_BATCH_PAGES, sizeof(struct spotify_request)));
+
+  for (i = 0; i < nuris; i += n)
+    {
+      n = (nuris - i < SPOTIFY_SCAN_BATCH_PAGES) ? nuris - i : SPOTIFY_SCAN_BATCH_PAGES;
+
+      memset(requests, 0, n * sizeof(struct spotify_request));
+      ret = spotifywebapi_request_pages(requests, uris + i, n);
+      if (ret < 0)
+	break;
+
+      db_transaction_begin();
+
+      for (j = 0; j < n; j++)
+	{
+	  cb(&requests[j], i + j, arg);
+	  spotifywebapi_request_end(&requests[j]);
 	}
+
+      db_transaction_end();
     }
 
-  spotifywebapi_request_end(&request);
+  free(requests);
+}
 
-  return 0;
+/* Appends the uris for the pages [offset, total) of a paged endpoint */
+static int
+page_uris_add(char ***uris, int *nuris, const char *uri, int offset, int total, int limit, bool append_market)
+{
+  char **tmp;
+  int n;
+
+  if (offset >= total)
+    return 0;
+
+  n = (total - offset + limit - 1) / limit;
+
+  CHECK_NULL(L_SPOTIFY, tmp = realloc(*uris, (*nuris + n) * sizeof(char *)));
+  *uris = tmp;
+
+  for (; offset < total; offset += limit)
+    (*uris)[(*nuris)++] = spotifywebapi_page_uri(uri, offset, limit, append_market);
+
+  return n;
+}
+
+static void
+page_uris_free(char **uris, int nuris)
+{
+  int i;
+
+  for (i = 0; i < nuris; i++)
+    free(uris[i]);
+
+  free(uris);
 }
 
 /* Thread: library */
 static int
-scan_playlisttracks(struct spotify_playlist *playlist, int plid)
+scan_saved_albums()
 {
   struct spotify_request request;
-  struct spotify_track track;
-  int dir_id;
+  char **uris;
+  int nuris;
+  int count;
 
+  count = 0;
   memset(&request, 0, sizeof(struct spotify_request));
 
-  while (0 == spotifywebapi_request_next(&request, playlist->tracks_href, true))
+  // The first page tells how many there are, then we can get the rest at once
+  if (0 == spotifywebapi_request_next(&request, SPOTIFY_WEBAPI_SAVED_ALBUMS, false))
     {
       db_transaction_begin();
+      scan_saved_albums_page(&request, 0, &count);
+      db_transaction_end();
 
-      while (0 == spotifywebapi_playlisttracks_fetch(&request, &track))
-	{
-	  if (!track.uri || !track.is_playable)
-	    {
-	      DPRINTF(E_LOG, L_SPOTIFY, "Track not available for playback: '%s' - '%s' (%s) (restrictions: %s)\n", track.artist, track.name, track.uri, track.restrictions);
-	      continue;
-	    }
+      uris = NULL;
+      nuris = 0;
+      page_uris_add(&uris, &nuris, SPOTIFY_WEBAPI_SAVED_ALBUMS, SPOTIFY_WEBAPI_LIMIT_ALBUMS, request.total, SPOTIFY_WEBAPI_LIMIT_ALBUMS, false);
 
-	  dir_id = prepare_directories(track.album_artist, track.album);
-	  webapi_track_save(&track, NULL, playlist->name, dir_id);
-	  db_pl_add_item_bypath(plid, track.uri);
-	}
+      scan_pages(uris, nuris, scan_saved_albums_page, &count);
 
-      db_transaction_end();
+      page_uris_free(uris, nuris);
     }
 
   spotifywebapi_request_end(&request);
@@ -1841,55 +1891,195 @@ scan_playlisttracks(struct spotify_playlist *playlist, int plid)
   return 0;
 }
 
+/* A playlist with its track pages in scan_playlists_tracks() */
+struct scan_playlist
+{
+  const char *name;
+  const char *tracks_href;
+  int tracks_count;
+  int plid;
+};
+
+struct scan_playlists_ctx
+{
+  struct scan_playlist *pls;
+  int *owners; // Index in pls of each page
+  int nuris;
+};
+
 /* Thread: library */
-static int
-scan_playlists()
+static void
+scan_playlisttracks_page(struct spotify_request *request, const char *pl_name, int plid)
+{
+  struct spotify_track track;
+  int dir_id;
+
+  while (0 == spotifywebapi_playlisttracks_fetch(request, &track))
+    {
+      if (!track.uri || !track.is_playable)
+	{
+	  DPRINTF(E_LOG, L_SPOTIFY, "Track not available for playback: '%s' - '%s' (%s) (restrictions: %s)\n", track.artist, track.name, track.uri, track.restrictions);
+	  continue;
+	}
+
+      dir_id = prepare_directories(track.album_artist, track.album);
+      webapi_track_save(&track, NULL, pl_name, dir_id);
+      db_pl_add_item_bypath(plid, track.uri);
+    }
+}
+
+/* Thread: library */
+static void
+scan_playlisttracks_cb(struct spotify_request *request, int index, void *arg)
+{
+  struct scan_playlists_ctx *ctx = arg;
+  struct scan_playlist *pl;
+  bool last;
+
+  pl = &ctx->pls[ctx->owners[index]];
+
+  scan_playlisttracks_page(request, pl->name, pl->plid);
+
+  // If tracks were added since we got the count there will be a next page
+  last = (index + 1 == ctx->nuris) || (ctx->owners[index + 1] != ctx->owners[index]);
+  while (last && (0 == spotifywebapi_request_next(request, NULL, true)))
+    scan_playlisttracks_page(request, pl->name, pl->plid);
+}
+
+/* Scans the tracks of the given playlists, with the pages of all of them
+ * requested concurrently
+ *
+ * Thread: library
+ */
+static void
+scan_playlists_tracks(struct scan_playlist *pls, int npls)
+{
+  struct scan_playlists_ctx ctx;
+  char **uris;
+  int nuris;
+  int n;
+  int i;
+
+  uris = NULL;
+  nuris = 0;
+
+  memset(&ctx, 0, sizeof(struct scan_playlists_ctx));
+  ctx.pls = pls;
+
+  for (i = 0; i < npls; i++)
+    {
+      n = page_uris_add(&uris, &nuris, pls[i].tracks_href, 0, pls[i].tracks_count, SPOTIFY_WEBAPI_LIMIT_TRACKS, true);
+
+      CHECK_NULL(L_SPOTIFY, ctx.owners = realloc(ctx.owners, nuris * sizeof(int)));
+      for (; n > 0; n--)
+	ctx.owners[nuris - n] = i;
+    }
+
+  ctx.nuris = nuris;
+
+  scan_pages(uris, nuris, scan_playlisttracks_cb, &ctx);
+
+  free(ctx.owners);
+  page_uris_free(uris, nuris);
+}
+
+/* Thread: library */
+static void
+scan_playlists_page(struct spotify_request *request, int *count, int *trackcount)
 {
-  struct spotify_request request;
   struct spotify_playlist playlist;
+  struct scan_playlist *pls;
   char virtual_path[PATH_MAX];
+  int npls;
   int plid;
+
+  CHECK_NULL(L_SPOTIFY, pls = calloc(request->count + 1, sizeof(struct scan_playlist)));
+  npls = 0;
+
+  db_transaction_begin();
+
+  while (0 == spotifywebapi_playlists_fetch(request, &playlist))
+    {
+      DPRINTF(E_DBG, L_SPOTIFY, "Got playlist: '%s' with %d tracks (%s) \n", playlist.name, playlist.tracks_count, playlist.uri);
+
+      if (!playlist.uri || !playlist.name || playlist.tracks_count == 0 || !playlist.tracks_href)
+	{
+	  DPRINTF(E_LOG, L_SPOTIFY, "Ignoring playlist '%s' with %d tracks (%s)\n", playlist.name, playlist.tracks_count, playlist.uri);
+	  continue;
+	}
+
+      if (playlist.owner)
+	{
+	  snprintf(virtual_path, PATH_MAX, "/spotify:/%s (%s)", playlist.name, playlist.owner);
+	}
+      else
+	{
+	  snprintf(virtual_path, PATH_MAX, "/spotify:/%s", playlist.name);
+	}
+
+      plid = library_add_playlist_info(playlist.uri, playlist.name, virtual_path, PL_PLAIN, spotify_base_plid, DIR_SPOTIFY);
+      if (plid <= 0)
+	{
+	  DPRINTF(E_LOG, L_SPOTIFY, "Error adding playlist: '%s' (%s) \n", playlist.name, playlist.uri);
+	  continue;
+	}
+
+      pls[npls].name = playlist.name;
+      pls[npls].tracks_href = playlist.tracks_href;
+      pls[npls].tracks_count = playlist.tracks_count;
+      pls[npls].plid = plid;
+      npls++;
+
+      (*count)++;
+      *trackcount += playlist.tracks_count;
+    }
+
+  db_transaction_end();
+
+  scan_playlists_tracks(pls, npls);
+
+  DPRINTF(E_LOG, L_SPOTIFY, "Scanned %d of %d saved playlists (%d tracks)\n", *count, request->total, *trackcount);
+
+  free(pls);
+}
+
+/* Thread: library */
+static int
+scan_playlists()
+{
+  struct spotify_request request;
+  struct spotify_request *pages;
+  char **uris;
+  int nuris;
   int count;
   int trackcount;
+  int i;
 
   count = 0;
   trackcount = 0;
   memset(&request, 0, sizeof(struct spotify_request));
 
-  while (0 == spotifywebapi_request_next(&request, SPOTIFY_WEBAPI_SAVED_PLAYLISTS, false))
+  // As for the saved albums, the first page tells how many more there are
+  if (0 == spotifywebapi_request_next(&request, SPOTIFY_WEBAPI_SAVED_PLAYLISTS, false))
     {
-      while (0 == spotifywebapi_playlists_fetch(&request, &playlist))
-	{
-	  DPRINTF(E_DBG, L_SPOTIFY, "Got playlist: '%s' with %d tracks (%s) \n", playlist.name, playlist.tracks_count, playlist.uri);
-
-	  if (!playlist.uri || !playlist.name || playlist.tracks_count == 0)
-	    {
-	      DPRINTF(E_LOG, L_SPOTIFY, "Ignoring playlist '%s' with %d tracks (%s)\n", playlist.name, playlist.tracks_count, playlist.uri);
-	      continue;
-	    }
+      uris = NULL;
+      nuris = 0;
+      page_uris_add(&uris, &nuris, SPOTIFY_WEBAPI_SAVED_PLAYLISTS, SPOTIFY_WEBAPI_LIMIT_PLAYLISTS, request.total, SPOTIFY_WEBAPI_LIMIT_PLAYLISTS, false);
 
-	  if (playlist.owner)
-	    {
-	      snprintf(virtual_path, PATH_MAX, "/spotify:/%s (%s)", playlist.name, playlist.owner);
-	    }
-	  else
-	    {
-	      snprintf(virtual_path, PATH_MAX, "/spotify:/%s", playlist.name);
-	    }
-
-	  db_transaction_begin();
-	  plid = library_add_playlist_info(playlist.uri, playlist.name, virtual_path, PL_PLAIN, spotify_base_plid, DIR_SPOTIFY);
-	  db_transaction_end();
+      CHECK_NULL(L_SPOTIFY, pages = calloc(nuris + 1, sizeof(struct spotify_request)));
+      if (nuris > 0)
+	spotifywebapi_request_pages(pages, uris, nuris);
 
-	  if (plid > 0)
-	    scan_playlisttracks(&playlist, plid);
-	  else
-	    DPRINTF(E_LOG, L_SPOTIFY, "Error adding playlist: '%s' (%s) \n", playlist.name, playlist.uri);
+      scan_playlists_page(&request, &count, &trackcount);
 
-	  count++;
-	  trackcount += playlist.tracks_count;
-	  DPRINTF(E_LOG, L_SPOTIFY, "Scanned %d of %d saved playlists (%d tracks)\n", count, request.total, trackcount);
+      for (i = 0; i < nuris; i++)
+	{
+	  scan_playlists_page(&pages[i], &count, &trackcount);
+	  spotifywebapi_request_end(&pages[i]);
 	}
+
+      free(pages);
+      page_uris_free(uris, nuris);
     }
 
   spotifywebapi_request_end(&request);
@@ -1903,6 +2093,7 @@ scan_playlist(const char *uri)
 {
   struct spotify_request request;
   struct spotify_playlist playlist;
+  struct scan_playlist pl;
   char virtual_path[PATH_MAX];
   int plid;
 
@@ -1931,8 +2122,13 @@ scan_playlist(const char *uri)
 	  plid = library_add_playlist_info(playlist.uri, playlist.name, virtual_path, PL_PLAIN, spotify_base_plid, DIR_SPOTIFY);
 	  db_transaction_end();
 
-	  if (plid > 0)
-	    scan_playlisttracks(&playlist, plid);
+	  pl.name = playlist.name;
+	  pl.tracks_href = playlist.tracks_href;
+	  pl.tracks_count = playlist.tracks_count;
+	  pl.plid = plid;
+
+	  if ((plid > 0) && pl.tracks_href)
+	    scan_playlists_tracks(&pl, 1);
 	  else
 	    DPRINTF(E_LOG, L_SPOTIFY, "Error adding playlist: '%s' (%s) \n", playlist.name, playlist.uri);
 	}
@@ -2187,10 +2383,6 @@ spotify_init(void)
   spotify_status_info.libspotify_installed = true;
   CHECK_ERR(L_SPOTIFY, pthread_mutex_unlock(&status_lck));
 
-  spotify_audio_buffer = evbuffer_new();
-
-  CHECK_ERR(L_SPOTIFY, evbuffer_enable_locking(spotify_audio_buffer, NULL));
-
   CHECK_ERR(L_SPOTIFY, mutex_init(&login_lck));
   CHECK_ERR(L_SPOTIFY, pthread_cond_init(&login_cond, NULL));
 
@@ -2218,8 +2410,6 @@ spotify_init(void)
   CHECK_ERR(L_SPOTIFY, pthread_cond_destroy(&login_cond));
   CHECK_ERR(L_SPOTIFY, pthread_mutex_destroy(&login_lck));
 
-  evbuffer_free(spotify_audio_buffer);
-
   fptr_sp_session_release(g_sess);
   g_sess = NULL;
   
@@ -2280,9 +2470,6 @@ spotify_deinit(void)
   CHECK_ERR(L_SPOTIFY, pthread_cond_destroy(&login_cond));
   CHECK_ERR(L_SPOTIFY, pthread_mutex_destroy(&login_lck));
 
-  /* Free audio buffer */
-  evbuffer_free(spotify_audio_buffer);
-
   /* Release libspotify handle */
   dlclose(g_libhandle);
 }
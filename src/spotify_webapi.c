@@ -22,14 +22,17 @@
 #include <event2/event.h>
 #include <json.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+#include "conffile.h"
 #include "db.h"
 #include "http.h"
 #include "library.h"
 #include "logger.h"
+#include "misc.h"
 #include "misc_json.h"
 
 
@@ -72,18 +75,12 @@ free_http_client_ctx(struct http_client_ctx *ctx)
 }
 
 static int
-request_uri(struct spotify_request *request, const char *uri)
+request_prepare(struct spotify_request *request, const char *uri)
 {
   char bearer_token[1024];
-  int ret;
 
   memset(request, 0, sizeof(struct spotify_request));
 
-  if (0 > spotifywebapi_token_refresh(NULL))
-    {
-      return -1;
-    }
-
   request->ctx = calloc(1, sizeof(struct http_client_ctx));
   request->ctx->output_headers = calloc(1, sizeof(struct keyval));
   request->ctx->input_body = evbuffer_new();
@@ -96,13 +93,12 @@ request_uri(struct spotify_request *request, const char *uri)
       return -1;
     }
 
-  ret = http_client_request(request->ctx);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_SPOTIFY, "Request for saved tracks/albums failed\n");
-      return -1;
-    }
+  return 0;
+}
 
+static int
+request_parse(struct spotify_request *request, const char *uri)
+{
   // 0-terminate for safety
   evbuffer_add(request->ctx->input_body, "", 1);
 
@@ -126,6 +122,51 @@ request_uri(struct spotify_request *request, const char *uri)
   return 0;
 }
 
+static int
+request_uri(struct spotify_request *request, const char *uri)
+{
+  int ret;
+
+  memset(request, 0, sizeof(struct spotify_request));
+
+  if (0 > spotifywebapi_token_refresh(NULL))
+    {
+      return -1;
+    }
+
+  ret = request_prepare(request, uri);
+  if (ret < 0)
+    return -1;
+
+  ret = http_client_request(request->ctx);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SPOTIFY, "Request for saved tracks/albums failed\n");
+      return -1;
+    }
+
+  return request_parse(request, uri);
+}
+
+/* Reads the paging object of a response */
+static int
+request_paging(struct spotify_request *request)
+{
+  request->total = jparse_int_from_obj(request->haystack, "total");
+  request->next_uri = jparse_str_from_obj(request->haystack, "next");
+
+  if (jparse_array_from_obj(request->haystack, "items", &request->items) < 0)
+    {
+      DPRINTF(E_LOG, L_SPOTIFY, "No items in reply from Spotify. See:\n%s\n", request->response_body);
+      return -1;
+    }
+
+  request->count = json_object_array_length(request->items);
+
+  DPRINTF(E_DBG, L_SPOTIFY, "Got %d items\n", request->count);
+  return 0;
+}
+
 void
 spotifywebapi_request_end(struct spotify_request *request)
 {
@@ -171,19 +212,87 @@ spotifywebapi_request_next(struct spotify_request *request, const char *uri, boo
   if (ret < 0)
     return ret;
 
-  request->total = jparse_int_from_obj(request->haystack, "total");
-  request->next_uri = jparse_str_from_obj(request->haystack, "next");
+  return request_paging(request);
+}
 
-  if (jparse_array_from_obj(request->haystack, "items", &request->items) < 0)
+/*
+ * Returns the uri for the page at the given offset of a paged endpoint, the
+ * caller must free it
+ */
+char *
+spotifywebapi_page_uri(const char *uri, int offset, int limit, bool append_market)
+{
+  const char *sep;
+
+  sep = strchr(uri, '?') ? "&" : "?";
+
+  // The limit may already be in the base uri of some endpoints
+  if (strstr(uri, "limit="))
+    {
+      if (append_market && spotify_user_country)
+	return safe_asprintf("%s%soffset=%d&market=%s", uri, sep, offset, spotify_user_country);
+      else
+	return safe_asprintf("%s%soffset=%d", uri, sep, offset);
+    }
+
+  if (append_market && spotify_user_country)
+    return safe_asprintf("%s%soffset=%d&limit=%d&market=%s", uri, sep, offset, limit, spotify_user_country);
+  else
+    return safe_asprintf("%s%soffset=%d&limit=%d", uri, sep, offset, limit);
+}
+
+/*
+ * Requests the pages with the given uris (see spotifywebapi_page_uri), with
+ * spotify:webapi_parallel_requests at a time. Pages that failed will have no
+ * items. Each request must be ended with spotifywebapi_request_end(), and the
+ * uris must be kept until then.
+ *
+ * @return number of pages that were fetched, -1 on error
+ */
+int
+spotifywebapi_request_pages(struct spotify_request *requests, char **uris, int nuris)
+{
+  struct http_client_ctx **ctxs;
+  int parallel;
+  int nok;
+  int i;
+
+  if (0 > spotifywebapi_token_refresh(NULL))
     {
-      DPRINTF(E_LOG, L_SPOTIFY, "No items in reply from Spotify. See:\n%s\n", request->response_body);
       return -1;
     }
 
-  request->count = json_object_array_length(request->items);
+  CHECK_NULL(L_SPOTIFY, ctxs = calloc(nuris, sizeof(struct http_client_ctx *)));
 
-  DPRINTF(E_DBG, L_SPOTIFY, "Got %d items\n", request->count);
-  return 0;
+  for (i = 0; i < nuris; i++)
+    {
+      request_prepare(&requests[i], uris[i]);
+      ctxs[i] = requests[i].ctx;
+    }
+
+  parallel = cfg_getint(cfg_getsec(cfg, "spotify"), "webapi_parallel_requests");
+
+  http_client_request_multi(ctxs, nuris, parallel);
+
+  nok = 0;
+  for (i = 0; i < nuris; i++)
+    {
+      if ((ctxs[i]->ret == 0) && (request_parse(&requests[i], uris[i]) == 0) && (request_paging(&requests[i]) == 0))
+	{
+	  nok++;
+	  continue;
+	}
+
+      DPRINTF(E_LOG, L_SPOTIFY, "Request for '%s' failed\n", uris[i]);
+
+      // Nothing to iterate over
+      requests[i].count = 0;
+      requests[i].next_uri = NULL;
+    }
+
+  free(ctxs);
+
+  return nok;
 }
 
 static void
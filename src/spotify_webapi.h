@@ -106,6 +106,10 @@ void
 spotifywebapi_request_end(struct spotify_request *request);
 int
 spotifywebapi_request_next(struct spotify_request *request, const char *uri, bool append_market);
+char *
+spotifywebapi_page_uri(const char *uri, int offset, int limit, bool append_market);
+int
+spotifywebapi_request_pages(struct spotify_request *requests, char **uris, int nuris);
 int
 spotifywebapi_saved_albums_fetch(struct spotify_request *request, json_object **jsontracks, int *track_count, struct spotify_album *album);
 int
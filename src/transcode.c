@@ -24,6 +24,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -40,6 +41,7 @@
 #include "conffile.h"
 #include "db.h"
 #include "avio_evbuffer.h"
+#include "cache.h"
 #include "transcode.h"
 
 // Interval between ICY metadata checks for streams, in seconds
@@ -50,6 +52,8 @@
 #define MAX_BAD_PACKETS 5
 // How long to wait (in microsec) before interrupting av_read_frame
 #define READ_TIMEOUT 15000000
+// Distance (in ms) between entries in the seek index we build for files
+#define SEEK_INDEX_INTERVAL 2000
 
 static const char *default_codecs = "mpeg,wav";
 static const char *roku_codecs = "mpeg,mp4a,wma,wav";
@@ -81,6 +85,7 @@ struct settings_ctx
   int channels;
   enum AVSampleFormat sample_format;
   int byte_depth;
+  int64_t bit_rate;
   bool wavheader;
   bool icy;
 
@@ -106,6 +111,32 @@ struct stream_ctx
   int64_t offset_pts;
 };
 
+struct seek_index_entry
+{
+  int64_t pos;
+  int64_t pts;
+};
+
+// Some demuxers (e.g. mp3 without a Xing TOC and raw ADTS) can only seek by
+// reading the file from the start. For those we record the byte position of a
+// packet every SEEK_INDEX_INTERVAL while playing a file from start to end, and
+// store the result in the cache. Next time the file is opened, the entries are
+// given to ffmpeg as index entries, so av_seek_frame() can jump directly.
+struct seek_index
+{
+  char *path;
+  time_t mtime;
+
+  // Set while we are recording entries, cleared if we seek or have a cached index
+  bool building;
+  int64_t next_pts;
+  int64_t interval;
+
+  struct seek_index_entry *entries;
+  int nentries;
+  int size;
+};
+
 struct decode_ctx
 {
   // Settings derived from the profile
@@ -144,6 +175,9 @@ struct decode_ctx
 
   // Used to measure if av_read_frame is taking too long
   int64_t timestamp;
+
+  // Seek index for files where ffmpeg has no cheap way of seeking
+  struct seek_index seek_index;
 };
 
 struct encode_ctx
@@ -176,6 +210,13 @@ struct encode_ctx
 
   // WAV header
   uint8_t header[44];
+
+  // Timestamp for the next raw frame, see transcode_encode()
+  int64_t raw_pts;
+
+  // Output is raw PCM, so decoded frames that already have the output format
+  // can be written as they are, see frame_passthrough()
+  bool passthrough;
 };
 
 struct transcode_ctx
@@ -221,6 +262,41 @@ init_settings(struct settings_ctx *settings, enum transcode_profile profile)
 	settings->byte_depth = 2; // Bytes per sample = 16/8
 	break;
 
+      case XCODE_AAC:
+	settings->encode_audio = 1;
+	settings->format = "adts";
+	settings->audio_codec = AV_CODEC_ID_AAC;
+	settings->sample_rate = 44100;
+	settings->channel_layout = AV_CH_LAYOUT_STEREO;
+	settings->channels = 2;
+	settings->sample_format = AV_SAMPLE_FMT_FLTP;
+	settings->byte_depth = 2; // Bytes per sample = 16/8
+	settings->bit_rate = 128000;
+	break;
+
+      case XCODE_OPUS:
+	settings->encode_audio = 1;
+	settings->format = "ogg";
+	settings->audio_codec = AV_CODEC_ID_OPUS;
+	settings->sample_rate = 48000; // The only rate Opus takes that suits music
+	settings->channel_layout = AV_CH_LAYOUT_STEREO;
+	settings->channels = 2;
+	settings->sample_format = AV_SAMPLE_FMT_S16;
+	settings->byte_depth = 2; // Bytes per sample = 16/8
+	settings->bit_rate = 96000;
+	break;
+
+      case XCODE_FLAC:
+	settings->encode_audio = 1;
+	settings->format = "flac";
+	settings->audio_codec = AV_CODEC_ID_FLAC;
+	settings->sample_rate = 44100;
+	settings->channel_layout = AV_CH_LAYOUT_STEREO;
+	settings->channels = 2;
+	settings->sample_format = AV_SAMPLE_FMT_S16;
+	settings->byte_depth = 2; // Bytes per sample = 16/8
+	break;
+
       case XCODE_JPEG:
 	settings->encode_video = 1;
 	settings->silent = 1;
@@ -266,6 +342,8 @@ stream_settings_set(struct stream_ctx *s, struct settings_ctx *settings, enum AV
       s->codec->channels       = settings->channels;
       s->codec->sample_fmt     = settings->sample_format;
       s->codec->time_base      = (AVRational){1, settings->sample_rate};
+      if (settings->bit_rate)
+	s->codec->bit_rate     = settings->bit_rate;
     }
   else if (type == AVMEDIA_TYPE_VIDEO)
     {
@@ -363,6 +441,7 @@ static int
 stream_add(struct encode_ctx *ctx, struct stream_ctx *s, enum AVCodecID codec_id, const char *codec_name)
 {
   AVCodec *encoder;
+  int i;
   int ret;
 
   encoder = avcodec_find_encoder(codec_id);
@@ -377,6 +456,20 @@ stream_add(struct encode_ctx *ctx, struct stream_ctx *s, enum AVCodecID codec_id
 
   stream_settings_set(s, &ctx->settings, encoder->type);
 
+  // Encoders for the same codec may take different sample formats (e.g. libopus
+  // and ffmpeg's own opus encoder), so use what the encoder has if necessary
+  if (encoder->type == AVMEDIA_TYPE_AUDIO && encoder->sample_fmts)
+    {
+      for (i = 0; encoder->sample_fmts[i] != AV_SAMPLE_FMT_NONE; i++)
+	{
+	  if (encoder->sample_fmts[i] == s->codec->sample_fmt)
+	    break;
+	}
+
+      if (encoder->sample_fmts[i] == AV_SAMPLE_FMT_NONE)
+	s->codec->sample_fmt = encoder->sample_fmts[0];
+    }
+
   if (!s->codec->pix_fmt)
     {
       s->codec->pix_fmt = avcodec_default_get_format(s->codec, encoder->pix_fmts);
@@ -429,6 +522,126 @@ static int decode_interrupt_cb(void *arg)
   return 0;
 }
 
+/*                              Seek index                                   */
+
+static void
+seek_index_open(struct decode_ctx *ctx, const char *path)
+{
+  struct seek_index *si = &ctx->seek_index;
+  struct seek_index_entry *entries;
+  struct evbuffer *evbuf;
+  struct stat sb;
+  AVStream *st;
+  size_t len;
+  int n;
+  int i;
+  int ret;
+
+  st = ctx->audio_stream.stream;
+
+  // Only for local files where ffmpeg itself builds the index while reading
+  if (!path || ctx->avio || ctx->data_kind != DATA_KIND_FILE || !st || ctx->settings.encode_video)
+    return;
+
+  if (!(ctx->ifmt_ctx->iformat->flags & AVFMT_GENERIC_INDEX))
+    return;
+
+  if (stat(path, &sb) < 0)
+    return;
+
+  CHECK_NULL(L_XCODE, evbuf = evbuffer_new());
+
+  ret = cache_seekindex_get(evbuf, path, sb.st_mtime);
+  len = evbuffer_get_length(evbuf);
+  if (ret > 0 && len >= sizeof(struct seek_index_entry))
+    {
+      entries = (struct seek_index_entry *)evbuffer_pullup(evbuf, -1);
+      n = len / sizeof(struct seek_index_entry);
+
+      for (i = 0; i < n; i++)
+	av_add_index_entry(st, entries[i].pos, entries[i].pts, 0, 0, AVINDEX_KEYFRAME);
+
+      DPRINTF(E_DBG, L_XCODE, "Loaded seek index with %d entries for '%s'\n", n, path);
+
+      evbuffer_free(evbuf);
+      return;
+    }
+
+  evbuffer_free(evbuf);
+
+  // No cached index, so record one while the file is played
+  si->path = strdup(path);
+  if (!si->path)
+    return;
+
+  si->mtime = sb.st_mtime;
+  si->interval = av_rescale_q((int64_t)SEEK_INDEX_INTERVAL * 1000, AV_TIME_BASE_Q, st->time_base);
+  si->next_pts = 0;
+  si->building = true;
+}
+
+static void
+seek_index_add(struct decode_ctx *ctx, AVPacket *pkt)
+{
+  struct seek_index *si = &ctx->seek_index;
+  struct seek_index_entry *entries;
+  int size;
+
+  if (!si->building || pkt->stream_index != ctx->audio_stream.stream->index)
+    return;
+
+  if (pkt->pts == AV_NOPTS_VALUE || pkt->pos < 0 || pkt->pts < si->next_pts)
+    return;
+
+  if (si->nentries == si->size)
+    {
+      size = si->size ? 2 * si->size : 512;
+      entries = realloc(si->entries, size * sizeof(struct seek_index_entry));
+      if (!entries)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Out of memory for seek index\n");
+	  si->building = false;
+	  return;
+	}
+
+      si->entries = entries;
+      si->size = size;
+    }
+
+  si->entries[si->nentries].pos = pkt->pos;
+  si->entries[si->nentries].pts = pkt->pts;
+  si->nentries++;
+
+  si->next_pts = pkt->pts + si->interval;
+}
+
+// Called when we reached the end of the file after reading it all the way
+static void
+seek_index_save(struct decode_ctx *ctx)
+{
+  struct seek_index *si = &ctx->seek_index;
+
+  if (!si->building)
+    return;
+
+  si->building = false;
+
+  if (si->nentries < 2)
+    return;
+
+  DPRINTF(E_DBG, L_XCODE, "Saving seek index with %d entries for '%s'\n", si->nentries, si->path);
+
+  cache_seekindex_add(si->path, si->mtime, si->entries, si->nentries * sizeof(struct seek_index_entry));
+}
+
+static void
+seek_index_close(struct decode_ctx *ctx)
+{
+  free(ctx->seek_index.path);
+  free(ctx->seek_index.entries);
+  memset(&ctx->seek_index, 0, sizeof(struct seek_index));
+}
+
 /* Will read the next packet from the source, unless we are resuming after a
  * seek in which case the most recent packet found by transcode_seek() will be
  * returned. The packet will be put in ctx->packet.
@@ -460,6 +673,9 @@ read_packet(enum AVMediaType *type, struct decode_ctx *dec_ctx)
       ret = av_read_frame(dec_ctx->ifmt_ctx, dec_ctx->packet);
       if (ret < 0)
 	{
+	  if (ret == AVERROR_EOF)
+	    seek_index_save(dec_ctx);
+
 	  DPRINTF(E_WARN, L_XCODE, "Could not read frame: %s\n", err2str(ret));
 	  return ret;
 	}
@@ -468,6 +684,9 @@ read_packet(enum AVMediaType *type, struct decode_ctx *dec_ctx)
     }
   while (*type == AVMEDIA_TYPE_UNKNOWN);
 
+  if (*type == AVMEDIA_TYPE_AUDIO)
+    seek_index_add(dec_ctx, dec_ctx->packet);
+
   return 0;
 }
 
@@ -572,6 +791,32 @@ filter_encode_write(struct encode_ctx *ctx, struct stream_ctx *s, AVFrame *frame
   return ret;
 }
 
+/*
+ * Shortcut of part 3-5 of the conversion chain for decoded audio that already
+ * is in the output format, which is the case for most of a typical library
+ * (44.1 kHz 16 bit stereo FLAC decodes to just that). Returns false if the
+ * frame must go through the filter and the encoder.
+ */
+static bool
+frame_passthrough(struct encode_ctx *ctx, AVFrame *frame)
+{
+  size_t len;
+
+  if (!ctx->passthrough || frame->format != ctx->settings.sample_format ||
+      frame->sample_rate != ctx->settings.sample_rate || frame->channels != ctx->settings.channels)
+    return false;
+
+  len = frame->nb_samples * ctx->settings.channels * ctx->settings.byte_depth;
+
+  // Anything the muxer has buffered must come first
+  avio_flush(ctx->ofmt_ctx->pb);
+
+  if (evbuffer_add(ctx->obuf, frame->data[0], len) < 0)
+    return false;
+
+  return true;
+}
+
 /*
  * Part 2 of the conversion chain: read -> decode -> filter -> encode -> write
  *
@@ -620,6 +865,9 @@ decode_filter_encode_write(struct transcode_ctx *ctx, struct stream_ctx *s, AVPa
       if (!out_stream)
 	break;
 
+      if (type == AVMEDIA_TYPE_AUDIO && frame_passthrough(ctx->encode_ctx, dec_ctx->decoded_frame))
+	continue;
+
       ret = filter_encode_write(ctx->encode_ctx, out_stream, dec_ctx->decoded_frame);
       if (ret < 0)
 	break;
@@ -721,8 +969,39 @@ open_decoder(unsigned int *stream_index, struct decode_ctx *ctx, enum AVMediaTyp
   return dec_ctx;
 }
 
+/* Checks if the header of a local file (read by avformat_open_input) gave us
+ * the audio parameters the scanner found, in which case there is no need for
+ * avformat_find_stream_info(), which would read and decode the first part of
+ * the file. For formats like mp3 the demuxer only knows the codec, so they
+ * will not match and are probed.
+ */
+static bool
+probe_skip(struct decode_ctx *ctx, struct transcode_source_params *params)
+{
+  AVCodecParameters *codecpar;
+  int stream_index;
+  int bits;
+
+  if (!params || params->samplerate == 0 || ctx->data_kind != DATA_KIND_FILE || ctx->settings.encode_video)
+    return false;
+
+  stream_index = av_find_best_stream(ctx->ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+  if (stream_index < 0)
+    return false;
+
+  codecpar = ctx->ifmt_ctx->streams[stream_index]->codecpar;
+  if (codecpar->codec_id == AV_CODEC_ID_NONE || codecpar->channels <= 0 || codecpar->sample_rate != (int)params->samplerate)
+    return false;
+
+  bits = codecpar->bits_per_raw_sample ? codecpar->bits_per_raw_sample : codecpar->bits_per_coded_sample;
+  if (params->bits_per_sample && bits && bits != (int)params->bits_per_sample)
+    return false;
+
+  return true;
+}
+
 static int
-open_input(struct decode_ctx *ctx, const char *path, struct evbuffer *evbuf)
+open_input(struct decode_ctx *ctx, const char *path, struct evbuffer *evbuf, struct transcode_source_params *params)
 {
   AVDictionary *options = NULL;
   AVCodecContext *dec_ctx;
@@ -739,9 +1018,16 @@ open_input(struct decode_ctx *ctx, const char *path, struct evbuffer *evbuf)
       ctx->ifmt_ctx->probesize = 64000;
 # endif
       av_dict_set(&options, "icy", "1", 0);
+# ifdef HAVE_FFMPEG
+      // Let ffmpeg's http protocol reconnect by itself when the connection
+      // drops, so we don't have to set up the whole decoder again
+      av_dict_set(&options, "reconnect", "1", 0);
+      av_dict_set(&options, "reconnect_streamed", "1", 0);
+      av_dict_set(&options, "reconnect_delay_max", "4", 0);
+# endif
     }
 
-  // TODO Newest versions of ffmpeg have timeout and reconnect options we should use
+  // TODO Newest versions of ffmpeg have a timeout option we should use
   ctx->ifmt_ctx->interrupt_callback.callback = decode_interrupt_cb;
   ctx->ifmt_ctx->interrupt_callback.opaque = ctx;
   ctx->timestamp = av_gettime();
@@ -774,11 +1060,18 @@ open_input(struct decode_ctx *ctx, const char *path, struct evbuffer *evbuf)
       return -1;
     }
 
-  ret = avformat_find_stream_info(ctx->ifmt_ctx, NULL);
-  if (ret < 0)
+  if (probe_skip(ctx, params))
     {
-      DPRINTF(E_LOG, L_XCODE, "Cannot find stream information: %s\n", err2str(ret));
-      goto out_fail;
+      DPRINTF(E_DBG, L_XCODE, "Stream parameters of '%s' are known, not probing\n", path);
+    }
+  else
+    {
+      ret = avformat_find_stream_info(ctx->ifmt_ctx, NULL);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_XCODE, "Cannot find stream information: %s\n", err2str(ret));
+	  goto out_fail;
+	}
     }
 
   if (ctx->ifmt_ctx->nb_streams > MAX_STREAMS)
@@ -807,6 +1100,8 @@ open_input(struct decode_ctx *ctx, const char *path, struct evbuffer *evbuf)
       ctx->video_stream.stream = ctx->ifmt_ctx->streams[stream_index];
     }
 
+  seek_index_open(ctx, path);
+
   return 0;
 
  out_fail:
@@ -821,6 +1116,7 @@ open_input(struct decode_ctx *ctx, const char *path, struct evbuffer *evbuf)
 static void
 close_input(struct decode_ctx *ctx)
 {
+  seek_index_close(ctx);
   avio_evbuffer_close(ctx->avio);
   avcodec_free_context(&ctx->audio_stream.codec);
   avcodec_free_context(&ctx->video_stream.codec);
@@ -1055,6 +1351,13 @@ open_filter(struct stream_ctx *out_stream, struct stream_ctx *in_stream)
   if (ret < 0)
     goto out_fail;
 
+#ifdef HAVE_FFMPEG
+  // Encoders like aac and opus only take frames of exactly their frame size
+  if ((in_stream->codec->codec_type == AVMEDIA_TYPE_AUDIO) && (out_stream->codec->frame_size > 0)
+      && !(out_stream->codec->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+    av_buffersink_set_frame_size(buffersink_ctx, out_stream->codec->frame_size);
+#endif
+
   /* Fill filtering context */
   out_stream->buffersrc_ctx = buffersrc_ctx;
   out_stream->buffersink_ctx = buffersink_ctx;
@@ -1109,7 +1412,7 @@ close_filters(struct encode_ctx *ctx)
 /*                                  Setup                                    */
 
 struct decode_ctx *
-transcode_decode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, struct evbuffer *evbuf, uint32_t song_length)
+transcode_decode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, struct evbuffer *evbuf, uint32_t song_length, struct transcode_source_params *params)
 {
   struct decode_ctx *ctx;
 
@@ -1120,7 +1423,7 @@ transcode_decode_setup(enum transcode_profile profile, enum data_kind data_kind,
   ctx->duration = song_length;
   ctx->data_kind = data_kind;
 
-  if ((init_settings(&ctx->settings, profile) < 0) || (open_input(ctx, path, evbuf) < 0))
+  if ((init_settings(&ctx->settings, profile) < 0) || (open_input(ctx, path, evbuf, params) < 0))
     goto fail_free;
 
   return ctx;
@@ -1150,6 +1453,9 @@ transcode_encode_setup(enum transcode_profile profile, struct decode_ctx *src_ct
   if (ctx->settings.wavheader)
     make_wav_header(ctx, src_ctx, est_size);
 
+  // The s16le muxer writes the encoded samples as they are
+  ctx->passthrough = (ctx->settings.audio_codec == AV_CODEC_ID_PCM_S16LE && strcmp(ctx->settings.format, "s16le") == 0);
+
   if (open_output(ctx, src_ctx) < 0)
     goto fail_free;
 
@@ -1171,13 +1477,13 @@ transcode_encode_setup(enum transcode_profile profile, struct decode_ctx *src_ct
 }
 
 struct transcode_ctx *
-transcode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, uint32_t song_length, off_t *est_size)
+transcode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, uint32_t song_length, off_t *est_size, struct transcode_source_params *params)
 {
   struct transcode_ctx *ctx;
 
   CHECK_NULL(L_XCODE, ctx = calloc(1, sizeof(struct transcode_ctx)));
 
-  ctx->decode_ctx = transcode_decode_setup(profile, data_kind, path, NULL, song_length);
+  ctx->decode_ctx = transcode_decode_setup(profile, data_kind, path, NULL, song_length, params);
   if (!ctx->decode_ctx)
     {
       free(ctx);
@@ -1421,6 +1727,14 @@ transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, void *frame, in
       return -1;
     }
 
+  // Frames from transcode_frame_new() have no timestamp, but muxers like ogg
+  // need one, so count samples (the raw input time base is 1/sample rate)
+  if ((s == &ctx->audio_stream) && (f->pts == AV_NOPTS_VALUE))
+    {
+      f->pts = ctx->raw_pts;
+      ctx->raw_pts += f->nb_samples;
+    }
+
   ret = filter_encode_write(ctx, s, f);
   if (ret < 0)
     {
@@ -1476,6 +1790,20 @@ transcode(struct evbuffer *evbuf, int *icy_timer, struct transcode_ctx *ctx, int
   return processed;
 }
 
+int
+transcode_encode_header(struct evbuffer *evbuf, struct encode_ctx *ctx)
+{
+  int ret;
+
+  avio_flush(ctx->ofmt_ctx->pb);
+
+  ret = evbuffer_get_length(ctx->obuf);
+
+  evbuffer_add_buffer(evbuf, ctx->obuf);
+
+  return ret;
+}
+
 void *
 transcode_frame_new(enum transcode_profile profile, uint8_t *data, size_t size)
 {
@@ -1547,6 +1875,9 @@ transcode_seek(struct transcode_ctx *ctx, int ms)
   if ((start_time != AV_NOPTS_VALUE) && (start_time > 0))
     target_pts += start_time;
 
+  // The index we are recording must cover the file contiguously from the start
+  dec_ctx->seek_index.building = false;
+
   ret = av_seek_frame(dec_ctx->ifmt_ctx, s->stream->index, target_pts, AVSEEK_FLAG_BACKWARD);
   if (ret < 0)
     {
@@ -1632,6 +1963,75 @@ transcode_decode_query(struct decode_ctx *ctx, const char *query)
   return -1;
 }
 
+int
+transcode_decode_scale(struct decode_ctx *ctx, int width, int height)
+{
+  AVCodecContext *dec_ctx;
+  const AVCodec *decoder;
+  AVStream *stream;
+  int lowres;
+  int ret;
+
+  stream = ctx->video_stream.stream;
+  if (!stream || !ctx->video_stream.codec || (width <= 0) || (height <= 0))
+    return 0;
+
+  decoder = ctx->video_stream.codec->codec;
+  if (!decoder)
+    return 0;
+
+  for (lowres = 0; lowres < decoder->max_lowres; lowres++)
+    {
+      if (((stream->codecpar->width >> (lowres + 1)) < width) || ((stream->codecpar->height >> (lowres + 1)) < height))
+	break;
+    }
+
+  if (lowres == 0)
+    return 0;
+
+  // The decoder must be opened again, lowres can't be changed on an open one
+  CHECK_NULL(L_XCODE, dec_ctx = avcodec_alloc_context3(decoder));
+
+  ret = avcodec_parameters_to_context(dec_ctx, stream->codecpar);
+  if (ret < 0)
+    goto fail_free;
+
+  dec_ctx->lowres = lowres;
+
+  ret = avcodec_open2(dec_ctx, decoder, NULL);
+  if (ret < 0)
+    goto fail_free;
+
+  avcodec_free_context(&ctx->video_stream.codec);
+  ctx->video_stream.codec = dec_ctx;
+
+  DPRINTF(E_DBG, L_XCODE, "Decoding %dx%d image at 1/%d size\n", stream->codecpar->width, stream->codecpar->height, 1 << lowres);
+
+  return lowres;
+
+ fail_free:
+  DPRINTF(E_WARN, L_XCODE, "Could not open decoder for scaled decoding: %s\n", err2str(ret));
+  avcodec_free_context(&dec_ctx);
+  return 0;
+}
+
+int
+transcode_decode_image_copy(struct evbuffer *evbuf, struct decode_ctx *ctx)
+{
+  AVStream *stream;
+  int ret;
+
+  stream = ctx->video_stream.stream;
+  if (!stream || !(stream->disposition & AV_DISPOSITION_ATTACHED_PIC) || (stream->attached_pic.size <= 0))
+    return -1;
+
+  ret = evbuffer_add(evbuf, stream->attached_pic.data, stream->attached_pic.size);
+  if (ret < 0)
+    return -1;
+
+  return stream->attached_pic.size;
+}
+
 /*                                  Metadata                                 */
 
 struct http_icy_metadata *
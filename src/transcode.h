@@ -14,6 +14,10 @@ enum transcode_profile
   XCODE_PCM16_HEADER,
   // Transcodes the best audio stream into MP3
   XCODE_MP3,
+  // Transcodes the best audio stream into AAC (ADTS), Opus (Ogg) or FLAC
+  XCODE_AAC,
+  XCODE_OPUS,
+  XCODE_FLAC,
   // Transcodes the best video stream into JPEG/PNG
   XCODE_JPEG,
   XCODE_PNG,
@@ -23,15 +27,24 @@ struct decode_ctx;
 struct encode_ctx;
 struct transcode_ctx;
 
-// Setting up
+// Audio parameters of a file that are already known from the library scan. If
+// the file header says the same, the decoder is set up without probing the
+// stream, otherwise the stream is probed as usual. Zero means unknown.
+struct transcode_source_params
+{
+  uint32_t samplerate;
+  uint32_t bits_per_sample;
+};
+
+// Setting up, params may be NULL
 struct decode_ctx *
-transcode_decode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, struct evbuffer *evbuf, uint32_t song_length);
+transcode_decode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, struct evbuffer *evbuf, uint32_t song_length, struct transcode_source_params *params);
 
 struct encode_ctx *
 transcode_encode_setup(enum transcode_profile profile, struct decode_ctx *src_ctx, off_t *est_size, int width, int height);
 
 struct transcode_ctx *
-transcode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, uint32_t song_length, off_t *est_size);
+transcode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, uint32_t song_length, off_t *est_size, struct transcode_source_params *params);
 
 struct decode_ctx *
 transcode_decode_setup_raw(void);
@@ -73,6 +86,18 @@ transcode_decode(void **frame, struct decode_ctx *ctx);
 int
 transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, void *frame, int eof);
 
+/* Moves the header that the muxer wrote during setup to evbuf, instead of
+ * having it come out with the first transcode_encode(). Must be called before
+ * encoding. Used for live streams, where clients that join later also need
+ * the header (e.g. for Ogg or FLAC).
+ *
+ * @out evbuf      An evbuffer filled with the header
+ * @in  ctx        Encode context
+ * @return         Bytes added if OK, negative if error
+ */
+int
+transcode_encode_header(struct evbuffer *evbuf, struct encode_ctx *ctx);
+
 /* Demuxes, decodes, encodes and remuxes from the input.
  *
  * @out evbuf      An evbuffer filled with remuxed data
@@ -117,6 +142,28 @@ transcode_seek(struct transcode_ctx *ctx, int ms);
 int
 transcode_decode_query(struct decode_ctx *ctx, const char *query);
 
+/* Lets the image decoder output a reduced size (1/2, 1/4 or 1/8) that is still
+ * at least width x height, if the codec can do that cheaply (JPEG is scaled
+ * in the DCT domain). Must be called before transcode_encode_setup().
+ *
+ * @in  ctx        Decode context
+ * @in  width      Width the image will be rescaled to
+ * @in  height     Height the image will be rescaled to
+ * @return         The reduction as a power of two, 0 if full size
+ */
+int
+transcode_decode_scale(struct decode_ctx *ctx, int width, int height);
+
+/* Copies an image that is attached to a media file (embedded artwork) to evbuf
+ * as is, i.e. without decoding and encoding it
+ *
+ * @out evbuf      An evbuffer filled with the image
+ * @in  ctx        Decode context
+ * @return         Bytes added if OK, negative if error or no attached image
+ */
+int
+transcode_decode_image_copy(struct evbuffer *evbuf, struct decode_ctx *ctx);
+
 // Metadata
 struct http_icy_metadata *
 transcode_metadata(struct transcode_ctx *ctx, int *changed);
@@ -1079,7 +1079,7 @@ close_filters(struct encode_ctx *ctx)
 /*                                  Setup                                    */
 
 struct decode_ctx *
-transcode_decode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, struct evbuffer *evbuf, uint32_t song_length)
+transcode_decode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, struct evbuffer *evbuf, uint32_t song_length, struct transcode_source_params *params)
 {
   struct decode_ctx *ctx;
 
@@ -1142,7 +1142,7 @@ transcode_encode_setup(enum transcode_profile profile, struct decode_ctx *src_ct
 }
 
 struct transcode_ctx *
-transcode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, uint32_t song_length, off_t *est_size)
+transcode_setup(enum transcode_profile profile, enum data_kind data_kind, const char *path, uint32_t song_length, off_t *est_size, struct transcode_source_params *params)
 {
   struct transcode_ctx *ctx;
 
@@ -1153,7 +1153,7 @@ transcode_setup(enum transcode_profile profile, enum data_kind data_kind, const
       return NULL;
     }
 
-  ctx->decode_ctx = transcode_decode_setup(profile, data_kind, path, NULL, song_length);
+  ctx->decode_ctx = transcode_decode_setup(profile, data_kind, path, NULL, song_length, params);
   if (!ctx->decode_ctx)
     {
       free(ctx);
@@ -1483,6 +1483,20 @@ transcode_encode(struct evbuffer *evbuf, struct encode_ctx *ctx, void *frame, in
   return encoded_length;
 }
 
+int
+transcode_encode_header(struct evbuffer *evbuf, struct encode_ctx *ctx)
+{
+  int ret;
+
+  avio_flush(ctx->ofmt_ctx->pb);
+
+  ret = evbuffer_get_length(ctx->obuf);
+
+  evbuffer_add_buffer(evbuf, ctx->obuf);
+
+  return ret;
+}
+
 int
 transcode(struct evbuffer *evbuf, int *icy_timer, struct transcode_ctx *ctx, int want_bytes)
 {
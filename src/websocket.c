@@ -26,34 +26,52 @@
 # include <pthread_np.h>
 #endif
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #include "conffile.h"
 #include "listener.h"
 #include "logger.h"
+#include "player.h"
+
+// Number of past flushes a client can lag behind before it just gets notified
+// of everything (must be a power of two)
+#define WS_HISTORY 32
+// Events that change what is in a player snapshot
+#define WS_SNAPSHOT_EVENTS (LISTENER_PLAYER | LISTENER_VOLUME | LISTENER_OPTIONS)
 
 
 static struct lws_context *context;
 static pthread_t tid_websocket;
 
 static int websocket_port;
+static int websocket_interval;
 static bool ws_exit = false;
 
-// Event mask of events to notify websocket clients
+// Event mask of events to notify websocket clients, written by any thread
 static short events;
-// Event mask of events processed by the writeable callback
-static short write_events;
 
+// Event masks of the last flushes to the clients, indexed by flush sequence
+// number. Everything below is only used by the websocket thread.
+static short flush_events[WS_HISTORY];
+static unsigned int flush_seq;
+
+// Player state as of snapshot_seq, sent to clients that asked for snapshots
+static char *snapshot;
+static unsigned int snapshot_seq;
 
 
-/* Thread: library (the thread the event occurred) */
+/* Thread: any (the thread the event occurred) */
 static void
 listener_cb(short event_mask)
 {
-  // Add event to the event mask, clients will be notified at the next break of the libwebsockets service loop
-  events |= event_mask;
+  // Add event to the event mask, clients will be notified at the next flush
+  // from the libwebsockets service loop
+  __atomic_fetch_or(&events, event_mask, __ATOMIC_RELEASE);
 }
 
 /*
@@ -72,10 +90,17 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
  *
  * The client sends the events it wants to be notified of and the event mask is
  * set accordingly translating them to the LISTENER enum (see listener.h)
+ *
+ * Events of the flushes since seq that have not been written yet (because the
+ * client was not writeable) are merged into pending.
  */
 struct ws_session_data_notify
 {
   short events;
+  bool snapshot;
+
+  unsigned int seq;
+  short pending;
 };
 
 /*
@@ -84,7 +109,8 @@ struct ws_session_data_notify
  * Expects the message in "in" to be a JSON string of the form:
  *
  * {
- *   "notify": [ "update" ]
+ *   "notify": [ "update" ],
+ *   "snapshot": true
  * }
  */
 static int
@@ -98,7 +124,8 @@ process_notify_request(struct ws_session_data_notify *session_data, void *in, si
   json_object *needle;
   const char *event_type;
 
-  memset(session_data, 0, sizeof(struct ws_session_data_notify));
+  session_data->events = 0;
+  session_data->snapshot = false;
 
   tokener = json_tokener_new();
   request = json_tokener_parse_ex(tokener, in, len);
@@ -161,16 +188,90 @@ process_notify_request(struct ws_session_data_notify *session_data, void *in, si
 		{
 		  session_data->events |= LISTENER_QUEUE;
 		}
+	      else if (0 == strcmp(event_type, "scan"))
+		{
+		  session_data->events |= LISTENER_SCAN;
+		}
 	    }
 	}
     }
 
+  if (json_object_object_get_ex(request, "snapshot", &needle) && json_object_get_type(needle) == json_type_boolean)
+    session_data->snapshot = json_object_get_boolean(needle);
+
   json_tokener_free(tokener);
   json_object_put(request);
 
   return 0;
 }
 
+/*
+ * Returns the current player state as a JSON string in the form of the
+ * /api/player reply. It is fetched at most once per flush.
+ */
+static const char *
+player_snapshot_get(void)
+{
+  struct player_status status;
+  json_object *reply;
+
+  if (snapshot && snapshot_seq == flush_seq)
+    return snapshot;
+
+  free(snapshot);
+  snapshot = NULL;
+
+  if (player_get_status(&status) < 0)
+    return NULL;
+
+  reply = json_object_new_object();
+
+  switch (status.status)
+    {
+      case PLAY_PAUSED:
+	json_object_object_add(reply, "state", json_object_new_string("pause"));
+	break;
+
+      case PLAY_PLAYING:
+	json_object_object_add(reply, "state", json_object_new_string("play"));
+	break;
+
+      default:
+	json_object_object_add(reply, "state", json_object_new_string("stop"));
+	break;
+    }
+
+  switch (status.repeat)
+    {
+      case REPEAT_SONG:
+	json_object_object_add(reply, "repeat", json_object_new_string("single"));
+	break;
+
+      case REPEAT_ALL:
+	json_object_object_add(reply, "repeat", json_object_new_string("all"));
+	break;
+
+      default:
+	json_object_object_add(reply, "repeat", json_object_new_string("off"));
+	break;
+    }
+
+  json_object_object_add(reply, "consume", json_object_new_boolean(status.consume));
+  json_object_object_add(reply, "shuffle", json_object_new_boolean(status.shuffle));
+  json_object_object_add(reply, "volume", json_object_new_int(status.volume));
+
+  json_object_object_add(reply, "item_id", json_object_new_int(status.item_id));
+  json_object_object_add(reply, "item_length_ms", json_object_new_int(status.len_ms));
+  json_object_object_add(reply, "item_progress_ms", json_object_new_int(status.pos_ms));
+
+  snapshot = strdup(json_object_to_json_string(reply));
+  snapshot_seq = flush_seq;
+
+  json_object_put(reply);
+
+  return snapshot;
+}
+
 /*
  * Notify clients of the notify-protocol about occurred events
  *
@@ -179,14 +280,19 @@ process_notify_request(struct ws_session_data_notify *session_data, void *in, si
  * {
  *   "notify": [ "update" ]
  * }
+ *
+ * If with_snapshot is set and the events affect the player, the message also
+ * has a "player" object with the current player state.
  */
 static void
-send_notify_reply(short events, struct lws* wsi)
+send_notify_reply(short events, bool with_snapshot, struct lws* wsi)
 {
   unsigned char* buf;
   const char* json_response;
+  const char* player;
   json_object* reply;
   json_object* notify;
+  size_t len;
 
   notify = json_object_new_array();
   if (events & LISTENER_UPDATE)
@@ -225,20 +331,61 @@ send_notify_reply(short events, struct lws* wsi)
     {
       json_object_array_add(notify, json_object_new_string("queue"));
     }
+  if (events & LISTENER_SCAN)
+    {
+      json_object_array_add(notify, json_object_new_string("scan"));
+    }
 
   reply = json_object_new_object();
   json_object_object_add(reply, "notify", notify);
 
+  if (with_snapshot && (events & WS_SNAPSHOT_EVENTS))
+    {
+      player = player_snapshot_get();
+      if (player)
+	json_object_object_add(reply, "player", json_tokener_parse(player));
+    }
+
   json_response = json_object_to_json_string(reply);
+  len = strlen(json_response);
 
-  buf = malloc(LWS_PRE + strlen(json_response));
-  memcpy(&buf[LWS_PRE], json_response, strlen(json_response));
-  lws_write(wsi, &buf[LWS_PRE], strlen(json_response), LWS_WRITE_TEXT);
+  buf = malloc(LWS_PRE + len);
+  if (!buf)
+    {
+      json_object_put(reply);
+      return;
+    }
+
+  memcpy(&buf[LWS_PRE], json_response, len);
+  if (lws_write(wsi, &buf[LWS_PRE], len, LWS_WRITE_TEXT) < (int)len)
+    DPRINTF(E_WARN, L_WEB, "Could not write websocket notification\n");
 
   free(buf);
   json_object_put(reply);
 }
 
+/*
+ * Merges the events of the flushes the session has not seen yet into its
+ * pending mask. If it lagged behind more than WS_HISTORY flushes, it is
+ * notified of all its events.
+ */
+static void
+session_events_collect(struct ws_session_data_notify *session_data)
+{
+  if (flush_seq - session_data->seq > WS_HISTORY)
+    {
+      session_data->pending |= session_data->events;
+      session_data->seq = flush_seq;
+      return;
+    }
+
+  while (session_data->seq != flush_seq)
+    {
+      session_data->seq++;
+      session_data->pending |= flush_events[session_data->seq & (WS_HISTORY - 1)];
+    }
+}
+
 /*
  * Callback for the "notify" protocol
  */
@@ -254,6 +401,7 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
       case LWS_CALLBACK_ESTABLISHED:
 	// Initialize session data for new connections
 	memset(session_data, 0, sizeof(struct ws_session_data_notify));
+	session_data->seq = flush_seq;
 	break;
 
       case LWS_CALLBACK_RECEIVE:
@@ -261,10 +409,22 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
 	break;
 
       case LWS_CALLBACK_SERVER_WRITEABLE:
-	if (write_events)
+	session_events_collect(session_data);
+
+	session_data->pending &= session_data->events;
+	if (!session_data->pending)
+	  break;
+
+	// Slow client, keep collecting (superseded events just merge) and retry
+	// once it has drained what was already sent
+	if (lws_send_pipe_choked(wsi))
 	  {
-	    send_notify_reply(write_events, wsi);
+	    lws_callback_on_writable(wsi);
+	    break;
 	  }
+
+	send_notify_reply(session_data->pending, session_data->snapshot, wsi);
+	session_data->pending = 0;
 	break;
 
       default:
@@ -302,25 +462,55 @@ static struct lws_protocols protocols[] =
 };
 
 
+static uint64_t
+now_msec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /* Thread: websocket */
 static void *
 websocket(void *arg)
 {
+  uint64_t last_flush;
+  uint64_t now;
+  short mask;
+
   listener_add(listener_cb, LISTENER_UPDATE | LISTENER_PAIRING | LISTENER_SPOTIFY | LISTENER_LASTFM | LISTENER_SPEAKER
-	       | LISTENER_PLAYER | LISTENER_OPTIONS | LISTENER_VOLUME | LISTENER_QUEUE);
+	       | LISTENER_PLAYER | LISTENER_OPTIONS | LISTENER_VOLUME | LISTENER_QUEUE | LISTENER_SCAN, NULL);
+
+  last_flush = 0;
 
   while(!ws_exit)
     {
-      lws_service(context, 1000);
-      if (events)
+      lws_service(context, websocket_interval);
+
+      // Events are collected for at least websocket_interval, so e.g. a volume
+      // slider drag results in a few notifications instead of one per step
+      now = now_msec();
+      if (now - last_flush < (uint64_t)websocket_interval)
+	continue;
+
+      mask = __atomic_exchange_n(&events, 0, __ATOMIC_ACQ_REL);
+      if (mask)
 	{
-	  write_events = events;
-	  events = 0;
+	  flush_seq++;
+	  flush_events[flush_seq & (WS_HISTORY - 1)] = mask;
+	  last_flush = now;
+
 	  lws_callback_on_writable_all_protocol(context, &protocols[WS_PROTOCOL_NOTIFY]);
 	}
     }
 
   lws_context_destroy(context);
+
+  free(snapshot);
+  snapshot = NULL;
+
   pthread_exit(NULL);
 }
 
@@ -331,6 +521,9 @@ websocket_init(void)
   int ret;
 
   websocket_port = cfg_getint(cfg_getsec(cfg, "general"), "websocket_port");
+  websocket_interval = cfg_getint(cfg_getsec(cfg, "general"), "websocket_interval");
+  if (websocket_interval <= 0)
+    websocket_interval = 1;
 
   if (websocket_port <= 0)
     {
@@ -24,12 +24,14 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/param.h>
 #ifdef HAVE_PTHREAD_NP_H
 # include <pthread_np.h>
 #endif
@@ -38,65 +40,358 @@
 
 #include "db.h"
 #include "logger.h"
+#include "conffile.h"
+#include "misc.h"
+#include "metrics.h"
 #include "worker.h"
 #include "commands.h"
 
+// Delayed tasks wait in a wheel with one slot per second. The wheel only ticks
+// while it holds tasks, so an idle worker doesn't wake up.
+#define WORKER_WHEEL_SLOTS 64
 
-struct worker_arg
+// Each priority class is a lane whose tasks run one at a time, in the order
+// they were made, like they did when there was only one worker thread. The
+// pool threads take the tasks of the highest priority lane that isn't running.
+#define WORKER_POOL_MAX WORKER_PRIO_MAX
+
+struct worker_task
 {
   void (*cb)(void *);
   void *cb_arg;
-  int delay;
-  struct event *timer;
+  enum worker_prio prio;
+
+  // Laps of the wheel before the task is due
+  unsigned int rounds;
+
+  // When the task became due, for the latency metrics
+  uint64_t due_usec;
+
+  struct worker_task *next;
 };
 
+struct worker_lane
+{
+  struct worker_task *head;
+  struct worker_task *tail;
+  bool running;
+
+  // Metrics, only for tasks that are due (not the ones in the wheel)
+  unsigned int depth;
+  unsigned int depth_max;
+  uint64_t executed;
+  uint64_t wait_usec_total;
+  uint64_t wait_usec_max;
+  uint64_t run_usec_total;
+  uint64_t run_usec_max;
+};
+
+static const char *worker_prio_names[WORKER_PRIO_MAX] = { "player", "normal", "background" };
+
 
 /* --- Globals --- */
-// worker thread
+// worker thread, runs evbase_worker, the wheel and the WORKER_PRIO_NORMAL lane
 static pthread_t tid_worker;
 
+// Pool threads for the other lanes
+static pthread_t tid_pool[WORKER_POOL_MAX];
+static int pool_size;
+static bool pool_exit;
+
+// Lanes are guarded by worker_lck, pool threads wait for tasks on worker_cond
+static pthread_mutex_t worker_lck;
+static pthread_cond_t worker_cond;
+static struct worker_lane lanes[WORKER_PRIO_MAX];
+
+// The wheel is only used from the worker thread
+static struct worker_task *wheel[WORKER_WHEEL_SLOTS];
+static unsigned int wheel_pos;
+static unsigned int wheel_tasks;
+static struct event *wheel_ev;
+static struct timeval wheel_tv = { 1, 0 };
+
 // Event base, pipes and events
 struct event_base *evbase_worker;
 static int g_initialized;
 static struct commands_base *cmdbase;
 
 
+static uint64_t
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+task_free(struct worker_task *task)
+{
+  free(task->cb_arg);
+  free(task);
+}
+
+static void
+task_run(struct worker_task *task)
+{
+  struct worker_lane *lane = &lanes[task->prio];
+  uint64_t start;
+  uint64_t wait;
+  uint64_t run;
+
+  start = now_usec();
+
+  task->cb(task->cb_arg);
+
+  run = now_usec() - start;
+  wait = start - task->due_usec;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&worker_lck));
+  lane->executed++;
+  lane->wait_usec_total += wait;
+  lane->wait_usec_max = MAX(lane->wait_usec_max, wait);
+  lane->run_usec_total += run;
+  lane->run_usec_max = MAX(lane->run_usec_max, run);
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&worker_lck));
+
+  task_free(task);
+}
+
+static void
+lanes_stats_log(void)
+{
+  struct worker_lane *lane;
+  int i;
+
+  for (i = 0; i < WORKER_PRIO_MAX; i++)
+    {
+      lane = &lanes[i];
+      if (!lane->executed)
+	continue;
+
+      DPRINTF(E_DBG, L_MAIN, "Worker lane '%s': %" PRIu64 " tasks, max depth %u, wait avg %" PRIu64 " max %" PRIu64 " usec, run avg %" PRIu64 " max %" PRIu64 " usec\n",
+	worker_prio_names[i], lane->executed, lane->depth_max,
+	lane->wait_usec_total / lane->executed, lane->wait_usec_max,
+	lane->run_usec_total / lane->executed, lane->run_usec_max);
+    }
+}
+
+static void
+lanes_metrics_cb(struct evbuffer *evbuf)
+{
+  struct worker_lane copy[WORKER_PRIO_MAX];
+  char labels[WORKER_PRIO_MAX][32];
+  int i;
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&worker_lck));
+  memcpy(copy, lanes, sizeof(copy));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&worker_lck));
+
+  for (i = 0; i < WORKER_PRIO_MAX; i++)
+    snprintf(labels[i], sizeof(labels[i]), "lane=\"%s\"", worker_prio_names[i]);
+
+  metrics_print_family(evbuf, "forked_daapd_worker_queue_depth", METRICS_GAUGE, "Worker tasks that are due but not running");
+  for (i = 0; i < WORKER_PRIO_MAX; i++)
+    metrics_print_value(evbuf, "forked_daapd_worker_queue_depth", labels[i], copy[i].depth);
+
+  metrics_print_family(evbuf, "forked_daapd_worker_tasks_total", METRICS_COUNTER, "Worker tasks run");
+  for (i = 0; i < WORKER_PRIO_MAX; i++)
+    metrics_print_value(evbuf, "forked_daapd_worker_tasks_total", labels[i], copy[i].executed);
+
+  metrics_print_family(evbuf, "forked_daapd_worker_wait_seconds_total", METRICS_COUNTER, "Time worker tasks waited after they were due");
+  for (i = 0; i < WORKER_PRIO_MAX; i++)
+    metrics_print_seconds(evbuf, "forked_daapd_worker_wait_seconds_total", labels[i], copy[i].wait_usec_total);
+
+  metrics_print_family(evbuf, "forked_daapd_worker_run_seconds_total", METRICS_COUNTER, "Time spent running worker tasks");
+  for (i = 0; i < WORKER_PRIO_MAX; i++)
+    metrics_print_seconds(evbuf, "forked_daapd_worker_run_seconds_total", labels[i], copy[i].run_usec_total);
+}
+
+
+/* ------------------------------ POOL THREADS ----------------------------- */
+
+/* Must be called with worker_lck locked */
+static void
+lane_push(struct worker_task *task)
+{
+  struct worker_lane *lane = &lanes[task->prio];
+
+  task->next = NULL;
+  if (lane->tail)
+    lane->tail->next = task;
+  else
+    lane->head = task;
+  lane->tail = task;
+
+  lane->depth++;
+  lane->depth_max = MAX(lane->depth_max, lane->depth);
+}
+
+/* Must be called with worker_lck locked */
+static struct worker_task *
+lane_pop(void)
+{
+  struct worker_lane *lane;
+  struct worker_task *task;
+  int i;
+
+  for (i = 0; i < WORKER_PRIO_MAX; i++)
+    {
+      lane = &lanes[i];
+      if (i == WORKER_PRIO_NORMAL || lane->running || !lane->head)
+	continue;
+
+      task = lane->head;
+      lane->head = task->next;
+      if (!lane->head)
+	lane->tail = NULL;
+
+      lane->depth--;
+      lane->running = true;
+      return task;
+    }
+
+  return NULL;
+}
+
+static void *
+pool(void *arg)
+{
+  struct worker_task *task;
+  enum worker_prio prio;
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Error: DB init failed (worker pool thread)\n");
+      pthread_exit(NULL);
+    }
+
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&worker_lck));
+
+  while (!pool_exit)
+    {
+      task = lane_pop();
+      if (!task)
+	{
+	  CHECK_ERR(L_MAIN, pthread_cond_wait(&worker_cond, &worker_lck));
+	  continue;
+	}
+
+      CHECK_ERR(L_MAIN, pthread_mutex_unlock(&worker_lck));
+
+      prio = task->prio;
+      task_run(task);
+
+      CHECK_ERR(L_MAIN, pthread_mutex_lock(&worker_lck));
+
+      // Other threads may be waiting for the lane to become free
+      lanes[prio].running = false;
+      if (lanes[prio].head)
+	CHECK_ERR(L_MAIN, pthread_cond_broadcast(&worker_cond));
+    }
+
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&worker_lck));
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+
 /* ---------------------------- CALLBACK EXECUTION ------------------------- */
 /*                                Thread: worker                             */
 
 static void
-execute_cb(int fd, short what, void *arg)
+task_due(struct worker_task *task)
 {
-  struct worker_arg *cmdarg = arg;
+  task->due_usec = now_usec();
 
-  cmdarg->cb(cmdarg->cb_arg);
+  // Tasks of the normal lane may use evbase_worker, so they run right here
+  if (task->prio == WORKER_PRIO_NORMAL || pool_size == 0)
+    {
+      task_run(task);
+      return;
+    }
 
-  event_free(cmdarg->timer);
-  free(cmdarg->cb_arg);
-  free(cmdarg);
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&worker_lck));
+  lane_push(task);
+  CHECK_ERR(L_MAIN, pthread_cond_signal(&worker_cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&worker_lck));
 }
 
+static void
+wheel_tick_cb(int fd, short what, void *arg)
+{
+  struct worker_task *task;
+  struct worker_task *next;
+  struct worker_task *due;
+  struct worker_task **last;
+
+  wheel_pos = (wheel_pos + 1) % WORKER_WHEEL_SLOTS;
+
+  // Take the due tasks out of the slot first, a task that runs now may put
+  // new ones in
+  due = NULL;
+  last = &due;
+  for (task = wheel[wheel_pos], wheel[wheel_pos] = NULL; task; task = next)
+    {
+      next = task->next;
+
+      if (task->rounds > 0)
+	{
+	  task->rounds--;
+	  task->next = wheel[wheel_pos];
+	  wheel[wheel_pos] = task;
+	  continue;
+	}
+
+      task->next = NULL;
+      *last = task;
+      last = &task->next;
+      wheel_tasks--;
+    }
+
+  if (wheel_tasks == 0)
+    event_del(wheel_ev);
+
+  for (task = due; task; task = next)
+    {
+      next = task->next;
+      task_due(task);
+    }
+}
 
 static enum command_state
 execute(void *arg, int *retval)
 {
-  struct worker_arg *cmdarg = arg;
-  struct timeval tv = { cmdarg->delay, 0 };
+  struct worker_task *task = arg;
+  unsigned int slot;
+  unsigned int ticks;
 
-  if (cmdarg->delay)
-    {
-      cmdarg->timer = evtimer_new(evbase_worker, execute_cb, cmdarg);
-      evtimer_add(cmdarg->timer, &tv);
+  *retval = 0;
 
-      *retval = 0;
-      return COMMAND_PENDING; // Not done yet, ask caller not to free cmd
+  if (task->rounds == 0)
+    {
+      task_due(task);
+      return COMMAND_PENDING; // The task is freed when it has run
     }
 
-  cmdarg->cb(cmdarg->cb_arg);
-  free(cmdarg->cb_arg);
+  // The next tick can come at any time, so one is added to not run early
+  ticks = task->rounds + 1;
+  slot = (wheel_pos + ticks) % WORKER_WHEEL_SLOTS;
+  task->rounds = (ticks - 1) / WORKER_WHEEL_SLOTS;
 
-  *retval = 0;
-  return COMMAND_END;
+  task->next = wheel[slot];
+  wheel[slot] = task;
+
+  if (wheel_tasks++ == 0)
+    event_add(wheel_ev, &wheel_tv);
+
+  return COMMAND_PENDING;
 }
 
 
@@ -135,17 +430,17 @@ worker(void *arg)
 
 /* Thread: player */
 void
-worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
+worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay, enum worker_prio prio)
 {
-  struct worker_arg *cmdarg;
+  struct worker_task *task;
   void *argcpy;
 
   DPRINTF(E_DBG, L_MAIN, "Got worker execute request\n");
 
-  cmdarg = calloc(1, sizeof(struct worker_arg));
-  if (!cmdarg)
+  task = calloc(1, sizeof(struct worker_task));
+  if (!task)
     {
-      DPRINTF(E_LOG, L_MAIN, "Could not allocate worker_arg\n");
+      DPRINTF(E_LOG, L_MAIN, "Could not allocate worker_task\n");
       return;
     }
 
@@ -155,7 +450,7 @@ worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
       if (!argcpy)
 	{
 	  DPRINTF(E_LOG, L_MAIN, "Out of memory\n");
-	  free(cmdarg);
+	  free(task);
 	  return;
 	}
 
@@ -164,16 +459,19 @@ worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay)
   else
     argcpy = NULL;
 
-  cmdarg->cb = cb;
-  cmdarg->cb_arg = argcpy;
-  cmdarg->delay = delay;
+  task->cb = cb;
+  task->cb_arg = argcpy;
+  task->prio = (prio >= 0 && prio < WORKER_PRIO_MAX) ? prio : WORKER_PRIO_NORMAL;
+  task->rounds = (delay > 0) ? delay : 0; // Converted to wheel laps by execute()
 
-  commands_exec_async(cmdbase, execute, cmdarg);
+  commands_exec_async(cmdbase, execute, task);
 }
 
 int
 worker_init(void)
 {
+  char name[16];
+  int i;
   int ret;
 
   evbase_worker = event_base_new();
@@ -184,6 +482,42 @@ worker_init(void)
     }
 
   cmdbase = commands_base_new(evbase_worker, NULL);
+  commands_base_metrics(cmdbase, "worker");
+  metrics_collector_add(lanes_metrics_cb);
+
+  CHECK_NULL(L_MAIN, wheel_ev = event_new(evbase_worker, -1, EV_PERSIST, wheel_tick_cb, NULL));
+
+  CHECK_ERR(L_MAIN, mutex_init(&worker_lck));
+  CHECK_ERR(L_MAIN, pthread_cond_init(&worker_cond, NULL));
+
+  // The normal lane always runs in the worker thread
+  pool_size = cfg_getint(cfg_getsec(cfg, "general"), "worker_threads");
+  if (pool_size < 0)
+    pool_size = 0;
+  if (pool_size > WORKER_POOL_MAX - 1)
+    {
+      DPRINTF(E_INFO, L_MAIN, "Limiting worker_threads to %d, more can't run at the same time\n", WORKER_POOL_MAX - 1);
+      pool_size = WORKER_POOL_MAX - 1;
+    }
+
+  pool_exit = false;
+  for (i = 0; i < pool_size; i++)
+    {
+      ret = pthread_create(&tid_pool[i], NULL, pool, NULL);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Could not spawn worker pool thread: %s\n", strerror(errno));
+
+	  goto pool_fail;
+	}
+
+      snprintf(name, sizeof(name), "worker %d", i + 1);
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+      pthread_setname_np(tid_pool[i], name);
+#elif defined(HAVE_PTHREAD_SET_NAME_NP)
+      pthread_set_name_np(tid_pool[i], name);
+#endif
+    }
 
   ret = pthread_create(&tid_worker, NULL, worker, NULL);
   if (ret < 0)
@@ -200,8 +534,20 @@ worker_init(void)
 #endif
 
   return 0;
-  
+
  thread_fail:
+ pool_fail:
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&worker_lck));
+  pool_exit = true;
+  CHECK_ERR(L_MAIN, pthread_cond_broadcast(&worker_cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&worker_lck));
+  while (i-- > 0)
+    pthread_join(tid_pool[i], NULL);
+  pool_size = 0;
+
+  CHECK_ERR(L_MAIN, pthread_cond_destroy(&worker_cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_destroy(&worker_lck));
+  event_free(wheel_ev);
   commands_base_free(cmdbase);
   event_base_free(evbase_worker);
   evbase_worker = NULL;
@@ -213,6 +559,8 @@ worker_init(void)
 void
 worker_deinit(void)
 {
+  struct worker_task *task;
+  int i;
   int ret;
 
   g_initialized = 0;
@@ -225,6 +573,47 @@ worker_deinit(void)
       return;
     }
 
+  // Pool threads finish the task they are running, the rest is dropped like
+  // the tasks in the wheel
+  CHECK_ERR(L_MAIN, pthread_mutex_lock(&worker_lck));
+  pool_exit = true;
+  CHECK_ERR(L_MAIN, pthread_cond_broadcast(&worker_cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_unlock(&worker_lck));
+
+  for (i = 0; i < pool_size; i++)
+    {
+      ret = pthread_join(tid_pool[i], NULL);
+      if (ret != 0)
+	DPRINTF(E_LOG, L_MAIN, "Could not join worker pool thread: %s\n", strerror(ret));
+    }
+
+  lanes_stats_log();
+
+  for (i = 0; i < WORKER_PRIO_MAX; i++)
+    {
+      while ((task = lanes[i].head))
+	{
+	  lanes[i].head = task->next;
+	  task_free(task);
+	}
+      memset(&lanes[i], 0, sizeof(struct worker_lane));
+    }
+
+  for (i = 0; i < WORKER_WHEEL_SLOTS; i++)
+    {
+      while ((task = wheel[i]))
+	{
+	  wheel[i] = task->next;
+	  task_free(task);
+	}
+    }
+  wheel_tasks = 0;
+
+  CHECK_ERR(L_MAIN, pthread_cond_destroy(&worker_cond));
+  CHECK_ERR(L_MAIN, pthread_mutex_destroy(&worker_lck));
+
+  event_free(wheel_ev);
+
   // Free event base (should free events too)
   event_base_free(evbase_worker);
 }
@@ -2,10 +2,22 @@
 #ifndef __WORKER_H__
 #define __WORKER_H__
 
-/* The worker thread is made for running asyncronous tasks from a real time
+/* Priority classes of worker tasks. The tasks of a class run one at a time and
+ * in order, so a callback only races with callbacks of other classes. Tasks of
+ * WORKER_PRIO_NORMAL run in the thread of evbase_worker, so they can use it.
+ */
+enum worker_prio
+{
+  WORKER_PRIO_PLAYER,     // Things the player is waiting for, like metadata
+  WORKER_PRIO_NORMAL,
+  WORKER_PRIO_BACKGROUND, // Scrobbling, artwork pregeneration
+  WORKER_PRIO_MAX,
+};
+
+/* The worker threads are made for running asyncronous tasks from a real time
  * thread, mainly the player thread.
 
- * The worker_execute() function will trigger a callback from the worker thread.
+ * The worker_execute() function will trigger a callback from a worker thread.
  * Before returning the function will copy the argument given, so the caller
  * does not need to preserve them. However, if the argument contains pointers to
  * data, the caller must either make sure that the data remains valid until the
@@ -14,10 +26,11 @@
  * @param cb the function to call from the worker thread
  * @param cb_arg arguments for callback
  * @param arg_size size of the arguments given
- * @param delay how much in seconds to delay the execution
+ * @param delay how much in seconds to delay the execution (at least)
+ * @param prio the priority class of the task
  */
 void
-worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay);
+worker_execute(void (*cb)(void *), void *cb_arg, size_t arg_size, int delay, enum worker_prio prio);
 
 int
 worker_init(void);